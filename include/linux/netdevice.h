@@ -871,6 +871,7 @@ enum net_device_path_type {
 	DEV_PATH_PPPOE,
 	DEV_PATH_DSA,
 	DEV_PATH_MTK_WDMA,
+	DEV_PATH_TUN,
 };
 
 struct net_device_path {
@@ -903,6 +904,15 @@ struct net_device_path {
 			u8 bss;
 			u8 amsdu;
 		} mtk_wdma;
+		struct {
+			__be32		src_v4;
+			__be32		dst_v4;
+			u8		h_dest[ETH_ALEN];
+			u8		proto;
+			u8		ttl;
+			u8		tos;
+			bool		df;
+		} tun;
 	};
 };
 
@@ -78,6 +78,8 @@ struct sock;
 struct nf_hook_state {
 	u8 hook;
 	u8 pf;
+	/* nft_inner: tunnel header parsed in this traversal, 0 if none */
+	u32 inner_gen;
 	struct net_device *in;
 	struct net_device *out;
 	struct sock *sk;
@@ -119,9 +121,18 @@ struct nf_hook_entries_rcu_head {
 	void	*allocation;
 };
 
+/* Cost of a hook entry, see net.netfilter.nf_hook_stats */
+struct nf_hook_entry_stats {
+	u64				packets;
+	u64				cycles;
+};
+
 struct nf_hook_entries {
 	u16				num_hook_entries;
 	/* padding */
+#ifdef CONFIG_NETFILTER_HOOK_STATS
+	struct nf_hook_entry_stats __percpu *stats;	/* one per hook */
+#endif
 	struct nf_hook_entry		hooks[];
 
 	/* trailer: pointers to original orig_ops of each hook,
@@ -168,6 +179,7 @@ static inline void nf_hook_state_init(struct nf_hook_state *p,
 {
 	p->hook = hook;
 	p->pf = pf;
+	p->inner_gen = 0;
 	p->in = indev;
 	p->out = outdev;
 	p->sk = sk;
@@ -201,6 +213,9 @@ int nf_register_net_hooks(struct net *net, const struct nf_hook_ops *reg,
 			  unsigned int n);
 void nf_unregister_net_hooks(struct net *net, const struct nf_hook_ops *reg,
 			     unsigned int n);
+void nf_unregister_net_hook_noshrink(struct net *net,
+				     const struct nf_hook_ops *ops);
+void nf_hook_shrink(struct net *net, const struct nf_hook_ops *ops);
 
 /* Functions to register get/setsockopt ranges (non-inclusive).  You
    need to check permissions yourself! */
@@ -214,6 +229,13 @@ extern struct static_key nf_hooks_needed[NFPROTO_NUMPROTO][NF_MAX_HOOKS];
 int nf_hook_slow(struct sk_buff *skb, struct nf_hook_state *state,
 		 const struct nf_hook_entries *e, unsigned int i);
 
+#ifdef CONFIG_NETFILTER_HOOK_STATS
+DECLARE_STATIC_KEY_FALSE(nf_hook_stats_enabled);
+
+void nf_hook_entry_stats_get(const struct nf_hook_entries *e, unsigned int i,
+			     struct nf_hook_entry_stats *sum);
+#endif
+
 void nf_hook_slow_list(struct list_head *head, struct nf_hook_state *state,
 		       const struct nf_hook_entries *e);
 /**
@@ -465,6 +487,8 @@ static inline bool nf_ct_get_tuple_skb(struct nf_conntrack_tuple *dst_tuple,
 struct nf_conn;
 enum ip_conntrack_info;
 
+struct nf_conntrack_zone;
+
 struct nf_ct_hook {
 	int (*update)(struct net *net, struct sk_buff *skb);
 	void (*destroy)(struct nf_conntrack *);
@@ -474,9 +498,21 @@ struct nf_ct_hook {
 	void (*set_closing)(struct nf_conntrack *nfct);
 	int (*confirm)(struct sk_buff *skb);
 	u32 (*get_id)(const struct nf_conntrack *nfct);
+	bool (*frag_known)(struct net *net,
+			   const struct nf_conntrack_zone *zone,
+			   const struct sk_buff *skb,
+			   struct nf_conntrack_tuple *tuple);
+	void (*prefetch_list)(const struct list_head *head,
+			      const struct nf_hook_state *state);
 };
 extern const struct nf_ct_hook __rcu *nf_ct_hook;
 
+struct nf_ipvs_hook {
+	void (*prefetch_list)(const struct list_head *head,
+			      const struct nf_hook_state *state);
+};
+extern const struct nf_ipvs_hook __rcu *nf_ipvs_hook;
+
 struct nlattr;
 
 struct nfnl_ct_hook {
@@ -496,6 +532,12 @@ struct nf_defrag_hook {
 	struct module *owner;
 	int (*enable)(struct net *net);
 	void (*disable)(struct net *net);
+	/* tuple of a fragment forwarded without reassembly, @zone_id is
+	 * the one of the template, as on defragmentation
+	 */
+	bool (*frag_tuple)(const struct nf_hook_state *state,
+			   const struct sk_buff *skb, u16 zone_id,
+			   struct nf_conntrack_tuple *tuple);
 };
 
 extern const struct nf_defrag_hook __rcu *nf_defrag_v4_hook;
@@ -13,6 +13,7 @@
 #include <linux/netfilter.h>
 #include <linux/netfilter/x_tables.h>
 #include <linux/stringify.h>
+#include <linux/u64_stats_sync.h>
 #include <linux/vmalloc.h>
 #include <net/netlink.h>
 #include <uapi/linux/netfilter/ipset/ip_set.h>
@@ -56,6 +57,8 @@ enum ip_set_extension {
 	IPSET_EXT_COMMENT = (1 << IPSET_EXT_BIT_COMMENT),
 	IPSET_EXT_BIT_SKBINFO = 3,
 	IPSET_EXT_SKBINFO = (1 << IPSET_EXT_BIT_SKBINFO),
+	IPSET_EXT_BIT_PCPU_COUNTER = 4,
+	IPSET_EXT_PCPU_COUNTER = (1 << IPSET_EXT_BIT_PCPU_COUNTER),
 	/* Mark set with an extension which needs to call destroy */
 	IPSET_EXT_BIT_DESTROY = 7,
 	IPSET_EXT_DESTROY = (1 << IPSET_EXT_BIT_DESTROY),
@@ -63,6 +66,8 @@ enum ip_set_extension {
 
 #define SET_WITH_TIMEOUT(s)	((s)->extensions & IPSET_EXT_TIMEOUT)
 #define SET_WITH_COUNTER(s)	((s)->extensions & IPSET_EXT_COUNTER)
+#define SET_WITH_PCPU_COUNTER(s)	\
+	((s)->extensions & IPSET_EXT_PCPU_COUNTER)
 #define SET_WITH_COMMENT(s)	((s)->extensions & IPSET_EXT_COMMENT)
 #define SET_WITH_SKBINFO(s)	((s)->extensions & IPSET_EXT_SKBINFO)
 #define SET_WITH_FORCEADD(s)	((s)->flags & IPSET_CREATE_FLAG_FORCEADD)
@@ -91,9 +96,26 @@ struct ip_set_ext_type {
 
 extern const struct ip_set_ext_type ip_set_extensions[];
 
+struct ip_set_counter_pcpu {
+	u64_stats_t bytes;
+	u64_stats_t packets;
+	struct u64_stats_sync syncp;
+};
+
+struct ip_set_counter_rcu {
+	struct rcu_head rcu;
+	struct ip_set_counter_pcpu __percpu *pcpu;
+};
+
 struct ip_set_counter {
-	atomic64_t bytes;
-	atomic64_t packets;
+	union {
+		struct {
+			atomic64_t bytes;
+			atomic64_t packets;
+		};
+		/* Sets created with IPSET_FLAG_WITH_PERCPU_COUNTERS */
+		struct ip_set_counter_rcu __rcu *c;
+	};
 };
 
 struct ip_set_comment_rcu {
@@ -168,6 +190,8 @@ struct ip_set_type_variant {
 
 	/* When adding entries and set is full, try to resize the set */
 	int (*resize)(struct ip_set *set, bool retried);
+	/* Make room in advance for the elements of a bulk add */
+	void (*reserve)(struct ip_set *set, u32 elements);
 	/* Destroy the set */
 	void (*destroy)(struct ip_set *set);
 	/* Flush the elements */
@@ -188,6 +212,13 @@ struct ip_set_type_variant {
 	bool (*same_set)(const struct ip_set *a, const struct ip_set *b);
 	/* Cancel ongoing garbage collectors before destroying the set*/
 	void (*cancel_gc)(struct ip_set *set);
+	/* Two sets are being swapped, called under ip_set_ref_lock:
+	 * stop using the references resolved in advance */
+	void (*swapping)(struct ip_set *set);
+	/* The sets "a" and "b" have been swapped: update the references
+	 * to them the set resolved in advance */
+	void (*swapped)(struct ip_set *set, struct ip_set *a,
+			struct ip_set *b);
 	/* Region-locking is used */
 	bool region_lock;
 };
@@ -196,6 +227,7 @@ struct ip_set_region {
 	spinlock_t lock;	/* Region lock */
 	size_t ext_size;	/* Size of the dynamic extensions */
 	u32 elements;		/* Number of elements vs timeout */
+	unsigned long expires;	/* Earliest timeout of the elements */
 };
 
 /* Max range where every element is added/deleted in one step */
@@ -293,6 +325,11 @@ ip_set_ext_destroy(struct ip_set *set, void *data)
 
 		ip_set_extensions[IPSET_EXT_ID_COMMENT].destroy(set, c);
 	}
+	if (SET_WITH_PCPU_COUNTER(set)) {
+		struct ip_set_counter *c = ext_counter(data, set);
+
+		ip_set_extensions[IPSET_EXT_ID_COUNTER].destroy(set, c);
+	}
 }
 
 int ip_set_put_flags(struct sk_buff *skb, struct ip_set *set);
@@ -326,6 +363,9 @@ extern int ip_set_del(ip_set_id_t id, const struct sk_buff *skb,
 extern int ip_set_test(ip_set_id_t id, const struct sk_buff *skb,
 		       const struct xt_action_param *par,
 		       struct ip_set_adt_opt *opt);
+extern int ip_set_test_set(struct ip_set *set, const struct sk_buff *skb,
+			   const struct xt_action_param *par,
+			   struct ip_set_adt_opt *opt);
 
 /* Utility functions */
 extern void *ip_set_alloc(size_t size);
@@ -501,16 +541,11 @@ ip_set_timeout_set(unsigned long *timeout, u32 value)
 
 void ip_set_init_comment(struct ip_set *set, struct ip_set_comment *comment,
 			 const struct ip_set_ext *ext);
-
-static inline void
-ip_set_init_counter(struct ip_set_counter *counter,
-		    const struct ip_set_ext *ext)
-{
-	if (ext->bytes != ULLONG_MAX)
-		atomic64_set(&(counter)->bytes, (long long)(ext->bytes));
-	if (ext->packets != ULLONG_MAX)
-		atomic64_set(&(counter)->packets, (long long)(ext->packets));
-}
+struct ip_set_counter_rcu *ip_set_alloc_counter(void);
+void ip_set_free_counter(struct ip_set_counter_rcu *c);
+void ip_set_init_counter(struct ip_set *set, struct ip_set_counter *counter,
+			 const struct ip_set_ext *ext,
+			 struct ip_set_counter_rcu **prealloc);
 
 static inline void
 ip_set_init_skbinfo(struct ip_set_skbinfo *skbinfo,
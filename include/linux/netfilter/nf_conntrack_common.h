@@ -19,6 +19,15 @@ struct ip_conntrack_stat {
 	unsigned int expect_delete;
 	unsigned int search_restart;
 	unsigned int chaintoolong;
+	unsigned int buckets_grow;
+	unsigned int buckets_shrink;
+	unsigned int gc_scanned;
+	unsigned int gc_expired;
+	unsigned int gc_evicted;
+	unsigned int found_remote;
+	unsigned int clash_merge;
+	unsigned int clash_harder;
+	unsigned int clash_drop;
 };
 
 #define NFCT_INFOMASK	7UL
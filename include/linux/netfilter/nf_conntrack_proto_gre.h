@@ -4,6 +4,7 @@
 #include <asm/byteorder.h>
 #include <net/gre.h>
 #include <net/pptp.h>
+#include <net/net_namespace.h>
 
 struct nf_ct_gre {
 	unsigned int stream_timeout;
@@ -16,7 +17,8 @@ struct nf_conn;
 
 /* structure for original <-> reply keymap */
 struct nf_ct_gre_keymap {
-	struct list_head list;
+	struct hlist_node hnode;
+	possible_net_t net;
 	struct nf_conntrack_tuple tuple;
 	struct rcu_head rcu;
 };
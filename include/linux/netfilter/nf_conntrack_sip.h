@@ -195,4 +195,8 @@ int ct_sip_get_sdp_header(const struct nf_conn *ct, const char *dptr,
 			  enum sdp_header_types term,
 			  unsigned int *matchoff, unsigned int *matchlen);
 
+void ct_sip_index_mangled(const char *olddptr, unsigned int olddatalen,
+			  const char *dptr, unsigned int datalen,
+			  unsigned int matchoff, unsigned int matchlen);
+
 #endif /* __NF_CONNTRACK_SIP_H__ */
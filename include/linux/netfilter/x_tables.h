@@ -244,6 +244,33 @@ struct xt_table {
 
 #include <linux/netfilter_ipv4.h>
 
+/* Index of the runs of rules matching a single key each, built by
+ * xt_dispatch_build() once a ruleset is checked.  Rules are identified by
+ * their offset in the table divided by the grain, the size of the
+ * smallest entry of the family.
+ */
+struct xt_dispatch_key {
+	u32			key;
+	u32			offset;
+};
+
+struct xt_dispatch_run {
+	const struct xt_dispatch_key *keys;	/* sorted, first rule per key */
+	unsigned int		nkeys;
+	u32			end;		/* first rule past the run */
+};
+
+struct xt_dispatch_slot {
+	u32			key;	/* 0 if the rule isn't indexed */
+	u32			next;	/* next rule with this key or run end */
+	u32			run;	/* 1 + run index if the run starts here */
+};
+
+struct xt_dispatch {
+	struct xt_dispatch_run	*runs;
+	struct xt_dispatch_slot	slots[];
+};
+
 /* The table itself */
 struct xt_table_info {
 	/* Size per table */
@@ -264,6 +291,9 @@ struct xt_table_info {
 	unsigned int stacksize;
 	void ***jumpstack;
 
+	/* Rule index built at load time, may be NULL */
+	struct xt_dispatch *dispatch;
+
 	unsigned char entries[] __aligned(8);
 };
 
@@ -305,6 +335,12 @@ void *xt_copy_counters(sockptr_t arg, unsigned int len,
 		       struct xt_counters_info *info);
 struct xt_counters *xt_counters_alloc(unsigned int counters);
 
+typedef void (*xt_harvest_fn_t)(const struct xt_table_info *info,
+				unsigned int first, unsigned int last,
+				struct xt_counters *counters);
+void xt_harvest_counters(const struct xt_table_info *info,
+			 struct xt_counters *counters, xt_harvest_fn_t fn);
+
 struct xt_table *xt_register_table(struct net *net,
 				   const struct xt_table *table,
 				   struct xt_table_info *bootstrap,
@@ -335,6 +371,35 @@ void xt_proto_fini(struct net *net, u_int8_t af);
 struct xt_table_info *xt_alloc_table_info(unsigned int size);
 void xt_free_table_info(struct xt_table_info *info);
 
+void xt_dispatch_build(struct xt_table_info *info, const void *entry0,
+		       unsigned int grain, unsigned int min_run,
+		       u32 (*rule_key)(const void *entry, u16 *next_offset));
+u32 xt_dispatch_lookup(const struct xt_dispatch *d, unsigned int run,
+		       u32 key);
+void xt_dispatch_free(struct xt_dispatch *d);
+
+static inline const struct xt_dispatch_slot *
+xt_dispatch_slot(const struct xt_dispatch *d, unsigned int offset,
+		 unsigned int grain)
+{
+	return &d->slots[offset / grain];
+}
+
+/* Offset of the first rule that can match @key from the one at @offset,
+ * past the rules for other keys if a run starts there.
+ */
+static inline u32 xt_dispatch_enter(const struct xt_dispatch *d,
+				    unsigned int offset, u32 key,
+				    unsigned int grain)
+{
+	const struct xt_dispatch_slot *s = xt_dispatch_slot(d, offset, grain);
+
+	if (likely(!s->run) || s->key == key)
+		return offset;
+
+	return xt_dispatch_lookup(d, s->run - 1, key);
+}
+
 /**
  * xt_recseq - recursive seqcount for netfilter use
  *
@@ -447,6 +512,30 @@ xt_get_per_cpu_counter(struct xt_counters *cnt, unsigned int cpu)
 	return cnt;
 }
 
+/* Read one cpu's counter of a live table.  64 bit loads can't tear and
+ * readers don't need bcnt and pcnt to agree on an in-flight packet, so
+ * only 32 bit needs to wait for the cpu to leave the table.
+ */
+static inline void xt_fetch_per_cpu_counter(struct xt_counters *cnt,
+					    unsigned int cpu,
+					    u64 *bcnt, u64 *pcnt)
+{
+	const struct xt_counters *tmp = xt_get_per_cpu_counter(cnt, cpu);
+#if BITS_PER_LONG == 32
+	seqcount_t *s = &per_cpu(xt_recseq, cpu);
+	unsigned int start;
+
+	do {
+		start = read_seqcount_begin(s);
+		*bcnt = tmp->bcnt;
+		*pcnt = tmp->pcnt;
+	} while (read_seqcount_retry(s, start));
+#else
+	*bcnt = READ_ONCE(tmp->bcnt);
+	*pcnt = READ_ONCE(tmp->pcnt);
+#endif
+}
+
 struct nf_hook_ops *xt_hook_ops_alloc(const struct xt_table *, nf_hookfn *);
 
 int xt_register_template(const struct xt_table *t, int(*table_init)(struct net *net));
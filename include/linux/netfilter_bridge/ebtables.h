@@ -76,6 +76,26 @@ struct ebt_chainstack {
 	unsigned int n; /* n'th entry */
 };
 
+/* where to go on when an entry doesn't match the input or the output
+ * interface of a frame, see ebt_fill_skip()
+ */
+struct ebt_skip_step {
+	/* index of the entry, as for the counters */
+	unsigned int next;
+	/* offset of the entry in entries */
+	unsigned int offset;
+};
+
+enum {
+	EBT_SKIP_IN,
+	EBT_SKIP_OUT,
+	EBT_SKIP_MAX,
+};
+
+struct ebt_skip {
+	struct ebt_skip_step dev[EBT_SKIP_MAX];
+};
+
 struct ebt_table_info {
 	/* total size of the entries */
 	unsigned int entries_size;
@@ -84,6 +104,8 @@ struct ebt_table_info {
 	struct ebt_entries *hook_entry[NF_BR_NUMHOOKS];
 	/* room to maintain the stack used for jumping from and into udc */
 	struct ebt_chainstack **chainstack;
+	/* one per entry, indexed like the counters */
+	struct ebt_skip *skip;
 	char *entries;
 	struct ebt_counter counters[] ____cacheline_aligned;
 };
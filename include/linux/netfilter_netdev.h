@@ -4,8 +4,43 @@
 
 #include <linux/netfilter.h>
 #include <linux/netdevice.h>
+#include <linux/local_lock.h>
+#include <linux/in6.h>
 
 #ifdef CONFIG_NETFILTER_INGRESS
+/* Transmits of the ingress hooks held back until the end of a batch of
+ * received packets, see nf_ingress_xmit_defer().
+ */
+struct nf_ingress_xmit {
+	local_lock_t		bh_lock;
+	struct list_head	list;
+	unsigned int		len;
+	unsigned int		depth;
+};
+
+DECLARE_PER_CPU(struct nf_ingress_xmit, nf_ingress_xmit);
+
+struct nf_ingress_xmit_cb {
+	int			neigh_table;
+	union {
+		__be32		v4;
+		struct in6_addr	v6;
+	} nexthop;
+};
+
+/* neigh_table of a packet with the link layer header in place */
+#define NF_INGRESS_XMIT_DEV	(-1)
+
+#define NF_INGRESS_XMIT_CB(skb)	((struct nf_ingress_xmit_cb *)(skb)->cb)
+
+void __nf_ingress_xmit_sync(void);
+
+/* Packets held back on this cpu, see nf_ingress_xmit_defer(). */
+static inline bool nf_ingress_xmit_pending(void)
+{
+	return this_cpu_read(nf_ingress_xmit.len);
+}
+
 static inline bool nf_hook_ingress_active(const struct sk_buff *skb)
 {
 #ifdef CONFIG_JUMP_LABEL
@@ -35,9 +70,38 @@ static inline int nf_hook_ingress(struct sk_buff *skb)
 	if (ret == 0)
 		return -1;
 
+	/* the packet takes the slow path, it must not overtake the packets
+	 * of its flow held back by the fast path.
+	 */
+	if (ret == 1 && nf_ingress_xmit_pending())
+		__nf_ingress_xmit_sync();
+
 	return ret;
 }
 
+
+void __nf_ingress_xmit_begin(void);
+void __nf_ingress_xmit_end(void);
+bool nf_ingress_xmit_defer(struct sk_buff *skb, int neigh_table,
+			   const void *nexthop, unsigned int len);
+
+/* Open a batch, returns true if nf_ingress_xmit_end() needs to be called. */
+static inline bool nf_ingress_xmit_begin(void)
+{
+#ifdef CONFIG_JUMP_LABEL
+	if (!static_key_false(&nf_hooks_needed[NFPROTO_NETDEV][NF_NETDEV_INGRESS]))
+		return false;
+#endif
+	__nf_ingress_xmit_begin();
+	return true;
+}
+
+static inline void nf_ingress_xmit_end(bool batch)
+{
+	if (batch)
+		__nf_ingress_xmit_end();
+}
+
 #else /* CONFIG_NETFILTER_INGRESS */
 static inline int nf_hook_ingress_active(struct sk_buff *skb)
 {
@@ -48,6 +112,26 @@ static inline int nf_hook_ingress(struct sk_buff *skb)
 {
 	return 0;
 }
+
+static inline bool nf_ingress_xmit_begin(void)
+{
+	return false;
+}
+
+static inline bool nf_ingress_xmit_pending(void)
+{
+	return false;
+}
+
+static inline void nf_ingress_xmit_end(bool batch)
+{
+}
+
+static inline bool nf_ingress_xmit_defer(struct sk_buff *skb, int neigh_table,
+					 const void *nexthop, unsigned int len)
+{
+	return false;
+}
 #endif /* CONFIG_NETFILTER_INGRESS */
 
 #ifdef CONFIG_NETFILTER_EGRESS
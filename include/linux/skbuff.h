@@ -1453,6 +1453,9 @@ int skb_copy_seq_read(struct skb_seq_state *st, int offset, void *to, int len);
 
 unsigned int skb_find_text(struct sk_buff *skb, unsigned int from,
 			   unsigned int to, struct ts_config *config);
+unsigned int skb_find_text_state(struct sk_buff *skb, unsigned int from,
+				 unsigned int to, struct ts_config *config,
+				 struct ts_state *state);
 
 /*
  * Packet hash types specify the type of hash in skb_set_hash.
@@ -15,14 +15,20 @@ struct ts_config;
 #define TS_AUTOLOAD	1 /* Automatically load textsearch modules when needed */
 #define TS_IGNORECASE	2 /* Searches string case insensitively */
 
+/* Bound on the pattern set given to the "ac" algorithm */
+#define TS_AC_MAX_SET_LEN	U16_MAX
+
 /**
  * struct ts_state - search state
  * @offset: offset for next match
+ * @id: index of the pattern that matched, for algorithms searching
+ *	for a set of patterns
  * @cb: control buffer, for persistent variables of get_next_block()
  */
 struct ts_state
 {
 	unsigned int		offset;
+	unsigned int		id;
 	char			cb[48];
 };
 
@@ -34,6 +40,8 @@ struct ts_state
  * @destroy: destroy algorithm specific parts of a search configuration
  * @get_pattern: return head of pattern
  * @get_pattern_len: return length of pattern
+ * @get_match_len: return length of the last match, optional, for
+ *	algorithms whose matches are not as long as the pattern
  * @owner: module reference to algorithm
  */
 struct ts_ops
@@ -45,6 +53,8 @@ struct ts_ops
 	void			(*destroy)(struct ts_config *);
 	void *			(*get_pattern)(struct ts_config *);
 	unsigned int		(*get_pattern_len)(struct ts_config *);
+	unsigned int		(*get_match_len)(struct ts_config *,
+						 struct ts_state *);
 	struct module		*owner;
 	struct list_head	list;
 };
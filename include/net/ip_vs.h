@@ -40,9 +40,6 @@ static inline struct netns_ipvs *net_ipvs(struct net* net)
 	return net->ipvs;
 }
 
-/* Connections' size value needed by ip_vs_ctl.c */
-extern int ip_vs_conn_tab_size;
-
 extern struct mutex __ip_vs_mutex;
 
 struct ip_vs_iphdr {
@@ -365,6 +362,9 @@ struct ip_vs_estimator {
 	u64			inbps;
 	u64			outbps;
 
+	u8			idle;		/* log2 of periods per sample */
+	u8			skip;		/* periods left until sample */
+
 	s32			ktid:16,	/* kthread ID, -1=temp list */
 				ktrow:8,	/* row/tick ID for kthread */
 				ktcid:8;	/* chain ID for kthread tick */
@@ -665,6 +665,8 @@ struct ip_vs_dest_user_kern {
 	u16			tun_type;	/* tunnel type */
 	__be16			tun_port;	/* tunnel port */
 	u16			tun_flags;	/* tunnel flags */
+
+	u32			load;		/* load score */
 };
 
 
@@ -739,6 +741,7 @@ struct ip_vs_dest {
 	atomic_t		persistconns;	/* persistent connections */
 	__u32			u_threshold;	/* upper threshold */
 	__u32			l_threshold;	/* lower threshold */
+	__u32			load;		/* load score from user space */
 
 	/* for destination cache */
 	spinlock_t		dst_lock;	/* lock of dst_cache */
@@ -778,6 +781,13 @@ struct ip_vs_scheduler {
 	struct ip_vs_dest* (*schedule)(struct ip_vs_service *svc,
 				       const struct sk_buff *skb,
 				       struct ip_vs_iphdr *iph);
+	/* selecting a server for a client network of a persistent service,
+	 * sets *stable if the answer can't have changed since the last
+	 * persistence timeout, so that no template has to remember it
+	 */
+	struct ip_vs_dest* (*persist_dest)(struct ip_vs_service *svc,
+					   const union nf_inet_addr *snet,
+					   bool *stable);
 };
 
 /* The persistence engine object */
@@ -877,6 +887,8 @@ struct ipvs_master_sync_state {
 };
 
 struct ip_vs_sync_thread_data;
+struct ip_vs_sync_worker;
+struct ip_vs_svc_cache;
 
 /* How much time to keep dests in trash */
 #define IP_VS_DEST_TRASH_PERIOD		(120 * HZ)
@@ -888,10 +900,23 @@ struct ipvs_sync_daemon_cfg {
 	u16			mcast_port;
 	u8			mcast_af;
 	u8			mcast_ttl;
+	/* unicast TCP stream: mcast_group is the backup address */
+	u8			sync_tcp;
+	/* TCP backup: the only master accepted, in the family of the group */
+	union nf_inet_addr	sync_peer;
 	/* multicast interface name */
 	char			mcast_ifn[IP_VS_IFNAME_MAXLEN];
 };
 
+/* Connection table lookups, per cpu */
+struct ip_vs_conn_stats {
+	unsigned int		searched;	/* lookups */
+	unsigned int		found;		/* lookups with a hit */
+	unsigned int		search_restart;	/* repeated due to resizing */
+};
+
+struct ip_vs_aligned_lock;
+
 /* IPVS in network namespace */
 struct netns_ipvs {
 	int			gen;		/* Generation */
@@ -931,6 +956,21 @@ struct netns_ipvs {
 #endif
 	/* ip_vs_conn */
 	atomic_t		conn_count;      /* connection counter */
+	struct hlist_head	*conn_tab;	/* connection hash table */
+	unsigned int		conn_tab_bits;	/* its size is 1 << bits */
+	/* Table that ip_vs_conn_tab_resize() is still moving connections
+	 * out of: its buckets below conn_tab_next are moved already.
+	 */
+	struct hlist_head	*conn_tab_old;
+	unsigned int		conn_tab_bits_old;
+	unsigned int		conn_tab_next;
+	seqcount_spinlock_t	conn_tab_seq;	/* table switches */
+	spinlock_t		conn_tab_lock;
+	struct mutex		conn_tab_mutex;	/* resizing vs table walks */
+	struct work_struct	conn_tab_work;	/* grows the table */
+	unsigned int		conn_tab_resizes;
+	struct ip_vs_aligned_lock *conn_locks;	/* bucket lock stripes */
+	struct ip_vs_conn_stats __percpu *conn_stats;
 
 	/* ip_vs_ctl */
 	struct ip_vs_stats_rcu	*tot_stats;      /* Statistics & est. */
@@ -946,6 +986,9 @@ struct netns_ipvs {
 	atomic_t		ftpsvc_counter;
 	atomic_t		nullsvc_counter;
 	atomic_t		conn_out_counter;
+	/* Last service found, per CPU, valid for one svc_gen */
+	struct ip_vs_svc_cache __percpu *svc_cache;
+	atomic_t		svc_gen;
 
 #ifdef CONFIG_SYSCTL
 	/* delayed work for expiring no dest connections */
@@ -981,6 +1024,7 @@ struct netns_ipvs {
 	int			sysctl_sync_persist_mode;
 	unsigned long		sysctl_sync_qlen_max;
 	int			sysctl_sync_sock_size;
+	int			sysctl_sync_workers;
 	int			sysctl_cache_bypass;
 	int			sysctl_expire_nodest_conn;
 	int			sysctl_sloppy_tcp;
@@ -989,20 +1033,27 @@ struct netns_ipvs {
 	int			sysctl_sync_threshold[2];
 	unsigned int		sysctl_sync_refresh_period;
 	int			sysctl_sync_retries;
+	int			sysctl_sync_rate_limit;
 	int			sysctl_nat_icmp_send;
 	int			sysctl_pmtu_disc;
 	int			sysctl_backup_only;
 	int			sysctl_conn_reuse_mode;
 	int			sysctl_schedule_icmp;
 	int			sysctl_ignore_tunneled;
+	int			sysctl_persist_stateless;
 	int			sysctl_run_estimation;
 #ifdef CONFIG_SYSCTL
 	cpumask_var_t		sysctl_est_cpulist;	/* kthread cpumask */
 	int			est_cpulist_valid;	/* cpulist set */
 	int			sysctl_est_nice;	/* kthread nice */
+	int			sysctl_est_idle_backoff;
 	int			est_stopped;		/* stop tasks */
 #endif
 
+	/* ip_vs_mh */
+	int			sysctl_mh_tab_index;
+	/* ip_vs_twos */
+	int			sysctl_twos_load;
 	/* ip_vs_lblc */
 	int			sysctl_lblc_expiration;
 	struct ctl_table_header	*lblc_ctl_header;
@@ -1029,6 +1080,11 @@ struct netns_ipvs {
 	spinlock_t		sync_buff_lock;
 	struct ip_vs_sync_thread_data *master_tinfo;
 	struct ip_vs_sync_thread_data *backup_tinfo;
+	struct ip_vs_sync_worker *backup_workers;
+	int			backup_workers_cnt;
+	spinlock_t		sync_rate_lock;	/* sync token bucket */
+	unsigned long		sync_rate_stamp;
+	u64			sync_rate_credit;
 	int			threads_mask;
 	volatile int		sync_state;
 	struct mutex		sync_mutex;
@@ -1056,6 +1112,26 @@ struct netns_ipvs {
 #define IPVS_SYNC_CHECK_PERIOD	HZ
 #define IPVS_SYNC_FLUSH_TIME	(HZ * 2)
 #define IPVS_SYNC_PORTS_MAX	(1 << 6)
+#define IPVS_SYNC_WORKERS_MAX	32
+
+/* Table size index of MH services: 8 (251 slots) to 17 (131071 slots) */
+#ifdef CONFIG_IP_VS_MH_TAB_INDEX
+#define IP_VS_MH_TAB_INDEX	CONFIG_IP_VS_MH_TAB_INDEX
+#else
+#define IP_VS_MH_TAB_INDEX	12
+#endif
+#define IP_VS_MH_TAB_INDEX_MIN	8
+#define IP_VS_MH_TAB_INDEX_MAX	17
+
+/* Load compared by the twos scheduler */
+enum {
+	IP_VS_TWOS_LOAD_CONNS,		/* ip_vs_dest_conn_overhead() */
+	IP_VS_TWOS_LOAD_CPS,		/* new connections per second */
+	IP_VS_TWOS_LOAD_BPS,		/* KiB per second, in and out */
+	IP_VS_TWOS_LOAD_SCORE,		/* IPVS_DEST_ATTR_LOAD */
+	__IP_VS_TWOS_LOAD_MAX
+};
+#define IP_VS_TWOS_LOAD_MAX	(__IP_VS_TWOS_LOAD_MAX - 1)
 
 #ifdef CONFIG_SYSCTL
 
@@ -1079,6 +1155,11 @@ static inline int sysctl_sync_retries(struct netns_ipvs *ipvs)
 	return ipvs->sysctl_sync_retries;
 }
 
+static inline int sysctl_sync_rate_limit(struct netns_ipvs *ipvs)
+{
+	return READ_ONCE(ipvs->sysctl_sync_rate_limit);
+}
+
 static inline int sysctl_sync_ver(struct netns_ipvs *ipvs)
 {
 	return ipvs->sysctl_sync_ver;
@@ -1114,6 +1195,11 @@ static inline int sysctl_sync_sock_size(struct netns_ipvs *ipvs)
 	return ipvs->sysctl_sync_sock_size;
 }
 
+static inline int sysctl_sync_workers(struct netns_ipvs *ipvs)
+{
+	return READ_ONCE(ipvs->sysctl_sync_workers);
+}
+
 static inline int sysctl_pmtu_disc(struct netns_ipvs *ipvs)
 {
 	return ipvs->sysctl_pmtu_disc;
@@ -1145,6 +1231,11 @@ static inline int sysctl_ignore_tunneled(struct netns_ipvs *ipvs)
 	return ipvs->sysctl_ignore_tunneled;
 }
 
+static inline int sysctl_persist_stateless(struct netns_ipvs *ipvs)
+{
+	return ipvs->sysctl_persist_stateless;
+}
+
 static inline int sysctl_cache_bypass(struct netns_ipvs *ipvs)
 {
 	return ipvs->sysctl_cache_bypass;
@@ -1168,6 +1259,21 @@ static inline int sysctl_est_nice(struct netns_ipvs *ipvs)
 	return ipvs->sysctl_est_nice;
 }
 
+static inline int sysctl_est_idle_backoff(struct netns_ipvs *ipvs)
+{
+	return ipvs->sysctl_est_idle_backoff;
+}
+
+static inline int sysctl_mh_tab_index(struct netns_ipvs *ipvs)
+{
+	return READ_ONCE(ipvs->sysctl_mh_tab_index);
+}
+
+static inline int sysctl_twos_load(struct netns_ipvs *ipvs)
+{
+	return READ_ONCE(ipvs->sysctl_twos_load);
+}
+
 #else
 
 static inline int sysctl_sync_threshold(struct netns_ipvs *ipvs)
@@ -1190,6 +1296,11 @@ static inline int sysctl_sync_retries(struct netns_ipvs *ipvs)
 	return DEFAULT_SYNC_RETRIES & 3;
 }
 
+static inline int sysctl_sync_rate_limit(struct netns_ipvs *ipvs)
+{
+	return 0;
+}
+
 static inline int sysctl_sync_ver(struct netns_ipvs *ipvs)
 {
 	return DEFAULT_SYNC_VER;
@@ -1225,6 +1336,11 @@ static inline int sysctl_sync_sock_size(struct netns_ipvs *ipvs)
 	return 0;
 }
 
+static inline int sysctl_sync_workers(struct netns_ipvs *ipvs)
+{
+	return 0;
+}
+
 static inline int sysctl_pmtu_disc(struct netns_ipvs *ipvs)
 {
 	return 1;
@@ -1255,6 +1371,11 @@ static inline int sysctl_ignore_tunneled(struct netns_ipvs *ipvs)
 	return 0;
 }
 
+static inline int sysctl_persist_stateless(struct netns_ipvs *ipvs)
+{
+	return 0;
+}
+
 static inline int sysctl_cache_bypass(struct netns_ipvs *ipvs)
 {
 	return 0;
@@ -1275,6 +1396,21 @@ static inline int sysctl_est_nice(struct netns_ipvs *ipvs)
 	return IPVS_EST_NICE;
 }
 
+static inline int sysctl_est_idle_backoff(struct netns_ipvs *ipvs)
+{
+	return 0;
+}
+
+static inline int sysctl_mh_tab_index(struct netns_ipvs *ipvs)
+{
+	return IP_VS_MH_TAB_INDEX;
+}
+
+static inline int sysctl_twos_load(struct netns_ipvs *ipvs)
+{
+	return IP_VS_TWOS_LOAD_CONNS;
+}
+
 #endif
 
 /* IPVS core functions
@@ -1327,6 +1463,20 @@ struct ip_vs_conn * ip_vs_conn_in_get_proto(struct netns_ipvs *ipvs, int af,
 					    const struct sk_buff *skb,
 					    const struct ip_vs_iphdr *iph);
 
+void ip_vs_conn_prefetch_list(const struct list_head *head,
+			      const struct nf_hook_state *state);
+void ip_vs_in_stats_len(struct ip_vs_conn *cp, unsigned int len);
+
+#if (IS_BUILTIN(CONFIG_IP_VS) && IS_ENABLED(CONFIG_DEBUG_INFO_BTF)) || \
+    (IS_MODULE(CONFIG_IP_VS) && IS_ENABLED(CONFIG_DEBUG_INFO_BTF_MODULES))
+int ip_vs_register_bpf(void);
+#else
+static inline int ip_vs_register_bpf(void)
+{
+	return 0;
+}
+#endif
+
 struct ip_vs_conn *ip_vs_conn_out_get(const struct ip_vs_conn_param *p);
 
 struct ip_vs_conn * ip_vs_conn_out_get_proto(struct netns_ipvs *ipvs, int af,
@@ -1362,6 +1512,7 @@ const char *ip_vs_state_name(const struct ip_vs_conn *cp);
 void ip_vs_tcp_conn_listen(struct ip_vs_conn *cp);
 int ip_vs_check_template(struct ip_vs_conn *ct, struct ip_vs_dest *cdest);
 void ip_vs_random_dropentry(struct netns_ipvs *ipvs);
+int ip_vs_conn_tab_resize(struct netns_ipvs *ipvs, unsigned int bits);
 int ip_vs_conn_init(void);
 void ip_vs_conn_cleanup(void);
 
@@ -1580,6 +1731,7 @@ int ip_vs_start_estimator(struct netns_ipvs *ipvs, struct ip_vs_stats *stats);
 void ip_vs_stop_estimator(struct netns_ipvs *ipvs, struct ip_vs_stats *stats);
 void ip_vs_zero_estimator(struct ip_vs_stats *stats);
 void ip_vs_read_estimator(struct ip_vs_kstats *dst, struct ip_vs_stats *stats);
+void ip_vs_est_sync_counters(struct ip_vs_stats *stats);
 void ip_vs_est_reload_start(struct netns_ipvs *ipvs);
 int ip_vs_est_kthread_start(struct netns_ipvs *ipvs,
 			    struct ip_vs_est_kt_data *kd);
@@ -17,6 +17,8 @@ enum ip6_defrag_users {
 	__IP6_DEFRAG_CONNTRACK_BRIDGE_IN = IP6_DEFRAG_CONNTRACK_BRIDGE_IN + USHRT_MAX,
 };
 
+struct nf_ct_frag6_virt;
+
 /*
  *	Equivalent of ipv4 struct ip
  */
@@ -26,6 +28,7 @@ struct frag_queue {
 	int			iif;
 	__u16			nhoffset;
 	u8			ecn;
+	struct nf_ct_frag6_virt	*virt;	/* nf_defrag_ipv6 virtual reassembly */
 };
 
 #if IS_ENABLED(CONFIG_IPV6)
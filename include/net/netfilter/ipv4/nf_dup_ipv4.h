@@ -5,7 +5,19 @@
 #include <linux/skbuff.h>
 #include <uapi/linux/in.h>
 
+/* last route to a duplication target, per CPU */
+struct nf_dup_ipv4_cache {
+	struct dst_entry	*dst;
+	__be32			gw;
+	int			oif;
+	u8			tos;
+};
+
+struct nf_dup_ipv4_cache __percpu *nf_dup_ipv4_cache_alloc(void);
+void nf_dup_ipv4_cache_free(struct nf_dup_ipv4_cache __percpu *cache);
+
 void nf_dup_ipv4(struct net *net, struct sk_buff *skb, unsigned int hooknum,
-		 const struct in_addr *gw, int oif);
+		 const struct in_addr *gw, int oif,
+		 struct nf_dup_ipv4_cache __percpu *cache);
 
 #endif /* _NF_DUP_IPV4_H_ */
@@ -11,12 +11,15 @@ void nf_defrag_ipv6_disable(struct net *net);
 int nf_ct_frag6_init(void);
 void nf_ct_frag6_cleanup(void);
 int nf_ct_frag6_gather(struct net *net, struct sk_buff *skb, u32 user);
+bool nf_ct_frag6_tuple(struct net *net, const struct sk_buff *skb, u32 user,
+		       struct nf_conntrack_tuple *tuple);
 
 struct inet_frags_ctl;
 
 struct nft_ct_frag6_pernet {
 	struct ctl_table_header *nf_frag_frags_hdr;
 	struct fqdir	*fqdir;
+	u8		virtual_reasm;
 };
 
 #endif /* _NF_DEFRAG_IPV6_H */
@@ -1,8 +1,16 @@
 /* SPDX-License-Identifier: GPL-2.0 */
 
+struct nft_pktinfo;
+struct nft_regs;
+
 struct bpf_nf_ctx {
 	const struct nf_hook_state *state;
 	struct sk_buff *skb;
+	/* Only set when run from the nf_tables "bpf" expression, reached
+	 * through its kfuncs, not visible to programs.
+	 */
+	const struct nft_pktinfo *pkt;
+	struct nft_regs *regs;
 };
 
 #if IS_ENABLED(CONFIG_NETFILTER_BPF_LINK)
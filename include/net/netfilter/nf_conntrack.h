@@ -15,6 +15,7 @@
 
 #include <linux/bitops.h>
 #include <linux/compiler.h>
+#include <linux/percpu_counter.h>
 
 #include <linux/netfilter/nf_conntrack_common.h>
 #include <linux/netfilter/nf_conntrack_tcp.h>
@@ -23,9 +24,20 @@
 #include <linux/netfilter/nf_conntrack_proto_gre.h>
 
 #include <net/netfilter/nf_conntrack_tuple.h>
+#include <net/netns/conntrack.h>
 
 struct nf_ct_udp {
 	unsigned long	stream_ts;
+	/* UDP_QUIC_* bits, see nf_conntrack_proto_udp.c */
+	u8		quic;
+#ifdef CONFIG_NF_CONNTRACK_TIMEOUT
+	/* copy of the timeout policy, valid while timeout_genid matches
+	 * nf_ct_timeout_genid, see udp_ct_timeouts().
+	 */
+	u32		timeout_genid;
+	bool		has_timeouts;
+	unsigned int	timeouts[UDP_CT_MAX];
+#endif
 };
 
 /* per conntrack: protocol private data */
@@ -49,15 +61,31 @@ struct nf_conntrack_net_ecache {
 	struct hlist_nulls_head dying_list;
 };
 
+#define NF_CT_EXPECT_PORT_SLOTS	256
+
 struct nf_conntrack_net {
-	/* only used when new connection is allocated: */
-	atomic_t count;
+	/* only used when new connection is allocated, per-cpu so that
+	 * allocation and free don't bounce a shared cache line:
+	 */
+	struct percpu_counter count;
 	unsigned int expect_count;
+	/* expectations per destination port and protocol, folded into
+	 * slots, see nf_ct_expect_port_slot()
+	 */
+	unsigned int expect_ports[NF_CT_EXPECT_PORT_SLOTS];
+	/* largest extension area seen, see nf_ct_ext_add() */
+	unsigned int ext_prealloc;
+#ifdef CONFIG_NF_CONNTRACK_ACCT_PCPU
+	/* entries with per-cpu counters, see nf_ct_acct_promote() */
+	atomic_t acct_pcpu;
+#endif
 
 	/* only used from work queues, configuration plane, and so on: */
 	unsigned int users4;
 	unsigned int users6;
 	unsigned int users_bridge;
+	/* sysctls and proc files registered, see nf_conntrack_standalone.c */
+	bool registered;
 #ifdef CONFIG_SYSCTL
 	struct ctl_table_header	*sysctl_header;
 #endif
@@ -72,6 +100,21 @@ struct nf_conntrack_net {
 #include <net/netfilter/ipv4/nf_conntrack_ipv4.h>
 #include <net/netfilter/ipv6/nf_conntrack_ipv6.h>
 
+#ifdef CONFIG_NF_CONNTRACK_VMAP_CACHE
+struct nft_chain;
+
+/* Verdict of the first verdict map lookup asking for it in a direction,
+ * see nft_lookup.c
+ */
+struct nf_conn_vmap_cache {
+	seqcount_t		seq;
+	unsigned int		genid;
+	const void		*lookup;
+	int			code;
+	struct nft_chain	*chain;
+};
+#endif
+
 struct nf_conn {
 	/* Usage count in here is 1 for hash table, 1 per skb,
 	 * plus 1 for any connection(s) we are `master' for
@@ -83,23 +126,29 @@ struct nf_conn {
 	 * result in a conntrack module dependency.
 	 * beware nf_ct_get() is different and don't inc refcnt.
 	 */
+	/* Fields read by the lookup and for every packet of an established
+	 * connection.  Kept together at the start of the (cacheline aligned)
+	 * object, see nf_conn_struct_check().
+	 */
+	__cacheline_group_begin(nf_conn_hot);
 	struct nf_conntrack ct_general;
 
-	spinlock_t	lock;
 	/* jiffies32 when this ct is considered dead */
 	u32 timeout;
 
 #ifdef CONFIG_NF_CONNTRACK_ZONES
 	struct nf_conntrack_zone zone;
 #endif
-	/* XXX should I move this to the tail ? - Y.K */
-	/* These are my tuples; original and reply */
-	struct nf_conntrack_tuple_hash tuplehash[IP_CT_DIR_MAX];
-
 	/* Have we seen traffic both ways yet? (bitset) */
 	unsigned long status;
 
 	possible_net_t ct_net;
+	__cacheline_group_end(nf_conn_hot);
+
+	spinlock_t	lock;
+
+	/* These are my tuples; original and reply */
+	struct nf_conntrack_tuple_hash tuplehash[IP_CT_DIR_MAX];
 
 #if IS_ENABLED(CONFIG_NF_NAT)
 	struct hlist_node	nat_bysource;
@@ -118,6 +167,34 @@ struct nf_conn {
 	u_int32_t secmark;
 #endif
 
+#ifdef CONFIG_NF_CONNTRACK_EXPIRY_WHEEL
+	/* see nf_conntrack_wheel.c */
+	struct hlist_node wheel_node;
+	u16 wheel_cpu;
+	u16 wheel_slot;
+#endif
+
+#ifdef CONFIG_NF_CONNTRACK_ACCT_PCPU
+	/* pending counts of a busy connection, see nf_ct_acct_add() */
+	struct nf_conn_acct __percpu *acct_pcpu;
+	u32 acct_stamp;
+#endif
+
+#ifdef CONFIG_NF_CONNTRACK_ZONE_INDEX
+	/* see nf_conntrack_zone_index.c */
+	struct hlist_node zone_node;
+	u16 zone_cpu;
+#endif
+
+#ifdef CONFIG_NF_CONNTRACK_SOCK_CACHE
+	/* see nf_conntrack_sock.c */
+	struct sock __rcu *sk;
+#endif
+
+#ifdef CONFIG_NF_CONNTRACK_VMAP_CACHE
+	struct nf_conn_vmap_cache vmap_cache[IP_CT_DIR_MAX];
+#endif
+
 	/* Extensions */
 	struct nf_ct_ext *ext;
 
@@ -235,6 +312,8 @@ static inline bool nf_ct_kill(struct nf_conn *ct)
 struct nf_ct_iter_data {
 	struct net *net;
 	void *data;
+	/* if set, only entries of this zone are passed to iter */
+	const struct nf_conntrack_zone *zone;
 	u32 portid;
 	int report;
 };
@@ -243,6 +322,10 @@ struct nf_ct_iter_data {
 void nf_ct_iterate_cleanup_net(int (*iter)(struct nf_conn *i, void *data),
 			       const struct nf_ct_iter_data *iter_data);
 
+/* Iterate over all conntracks of a netns, leaving them in the table. */
+void nf_ct_iterate_net(void (*iter)(struct nf_conn *i, void *data),
+		       const struct nf_ct_iter_data *iter_data);
+
 /* also set unconfirmed conntracks as dying. Only use in module exit path. */
 void nf_ct_iterate_destroy(int (*iter)(struct nf_conn *i, void *data),
 			   void *data);
@@ -312,6 +395,24 @@ static inline bool nf_ct_should_gc(const struct nf_conn *ct)
 
 #define	NF_CT_DAY	(86400 * HZ)
 
+struct nf_ct_evring_record;
+void nf_ct_record_fill(struct nf_ct_evring_record *rec, u32 events,
+		       const struct nf_conn *ct);
+
+/* nf_conntrack_events=3: only report the end of a flow, together with its
+ * counters and timestamps.
+ */
+#define NF_CT_EVENTS_SUMMARY	3
+
+static inline bool nf_ct_events_summary(const struct net *net)
+{
+#ifdef CONFIG_NF_CONNTRACK_EVENTS
+	return READ_ONCE(net->ct.sysctl_events) == NF_CT_EVENTS_SUMMARY;
+#else
+	return false;
+#endif
+}
+
 struct kernel_param;
 
 int nf_conntrack_set_hashsize(const char *val, const struct kernel_param *kp);
@@ -321,6 +422,10 @@ extern struct hlist_nulls_head *nf_conntrack_hash;
 extern unsigned int nf_conntrack_htable_size;
 extern seqcount_spinlock_t nf_conntrack_generation;
 extern unsigned int nf_conntrack_max;
+extern unsigned int nf_conntrack_buckets_min;
+extern unsigned int nf_conntrack_buckets_max;
+extern u8 nf_conntrack_early_drop_policy;
+extern u8 nf_conntrack_numa_placement;
 
 /* must be called with rcu read lock held */
 static inline void
@@ -339,6 +444,11 @@ nf_conntrack_get_ht(struct hlist_nulls_head **hash, unsigned int *hsize)
 	*hsize = hsz;
 }
 
+unsigned int nf_conntrack_get_ht_resize(struct hlist_nulls_head **hash,
+					unsigned int *hsize,
+					struct hlist_nulls_head **old_hash,
+					unsigned int *old_hsize);
+
 struct nf_conn *nf_ct_tmpl_alloc(struct net *net,
 				 const struct nf_conntrack_zone *zone,
 				 gfp_t flags);
@@ -33,7 +33,7 @@ struct nf_conn_acct *nf_ct_acct_ext_add(struct nf_conn *ct, gfp_t gfp)
 	struct net *net = nf_ct_net(ct);
 	struct nf_conn_acct *acct;
 
-	if (!net->ct.sysctl_acct)
+	if (!net->ct.sysctl_acct && !nf_ct_events_summary(net))
 		return NULL;
 
 	acct = nf_ct_ext_add(ct, NF_CT_EXT_ACCT, gfp);
@@ -68,6 +68,15 @@ static inline void nf_ct_set_acct(struct net *net, bool enable)
 void nf_ct_acct_add(struct nf_conn *ct, u32 dir, unsigned int packets,
 		    unsigned int bytes);
 
+/* Fold the per-cpu counts of @ct, for readers that want exact values */
+#ifdef CONFIG_NF_CONNTRACK_ACCT_PCPU
+void nf_ct_acct_sync(const struct nf_conn *ct);
+#else
+static inline void nf_ct_acct_sync(const struct nf_conn *ct)
+{
+}
+#endif
+
 static inline void nf_ct_acct_update(struct nf_conn *ct, u32 dir,
 				     unsigned int bytes)
 {
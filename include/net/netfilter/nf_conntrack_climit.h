@@ -0,0 +1,69 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _NF_CONNTRACK_CLIMIT_H
+#define _NF_CONNTRACK_CLIMIT_H
+
+#include <linux/percpu_counter.h>
+#include <linux/refcount.h>
+
+#include <net/netfilter/nf_conntrack.h>
+
+/* Connection count kept up to date by the conntrack entries themselves:
+ * an entry counted holds a reference to the counter in its extension and
+ * drops it, along with the count, when it is destroyed.
+ */
+struct nf_ct_climit {
+	struct percpu_counter	count;
+	refcount_t		ref;
+};
+
+/* counters a single entry can be counted in */
+#define NF_CT_CLIMIT_MAX	2
+
+struct nf_conn_climit {
+	struct nf_ct_climit	*climit[NF_CT_CLIMIT_MAX];
+};
+
+#ifdef CONFIG_NF_CONNTRACK_CLIMIT
+struct nf_ct_climit *nf_ct_climit_alloc(gfp_t gfp);
+void nf_ct_climit_put(struct nf_ct_climit *climit);
+int nf_ct_climit_add(struct nf_conn *ct, struct nf_ct_climit *climit);
+void nf_ct_climit_destroy(struct nf_conn *ct);
+
+/* Exact only close to @limit, see percpu_counter_compare(). */
+static inline bool nf_ct_climit_over(struct nf_ct_climit *climit, u32 limit)
+{
+	return percpu_counter_compare(&climit->count, limit) > 0;
+}
+
+static inline bool nf_ct_climit_empty(struct nf_ct_climit *climit)
+{
+	return percpu_counter_sum(&climit->count) <= 0;
+}
+#else
+static inline struct nf_ct_climit *nf_ct_climit_alloc(gfp_t gfp)
+{
+	return NULL;
+}
+
+static inline void nf_ct_climit_put(struct nf_ct_climit *climit) {}
+
+static inline int nf_ct_climit_add(struct nf_conn *ct,
+				   struct nf_ct_climit *climit)
+{
+	return -EOPNOTSUPP;
+}
+
+static inline void nf_ct_climit_destroy(struct nf_conn *ct) {}
+
+static inline bool nf_ct_climit_over(struct nf_ct_climit *climit, u32 limit)
+{
+	return false;
+}
+
+static inline bool nf_ct_climit_empty(struct nf_ct_climit *climit)
+{
+	return true;
+}
+#endif /* CONFIG_NF_CONNTRACK_CLIMIT */
+
+#endif /* _NF_CONNTRACK_CLIMIT_H */
@@ -30,6 +30,7 @@ void nf_conntrack_cleanup_net(struct net *net);
 void nf_conntrack_cleanup_net_list(struct list_head *net_exit_list);
 
 void nf_conntrack_proto_pernet_init(struct net *net);
+int nf_conntrack_standalone_register_net(struct net *net);
 
 int nf_conntrack_proto_init(void);
 void nf_conntrack_proto_fini(void);
@@ -49,6 +50,11 @@ nf_conntrack_find_get(struct net *net,
 		      const struct nf_conntrack_zone *zone,
 		      const struct nf_conntrack_tuple *tuple);
 
+struct nf_conntrack_tuple_hash *
+nf_conntrack_find_rcu(struct net *net,
+		      const struct nf_conntrack_zone *zone,
+		      const struct nf_conntrack_tuple *tuple);
+
 int __nf_conntrack_confirm(struct sk_buff *skb);
 
 /* Confirm a connection: returns NF_DROP if packet must be dropped. */
@@ -78,9 +84,27 @@ void print_tuple(struct seq_file *s, const struct nf_conntrack_tuple *tuple,
 
 #define CONNTRACK_LOCKS 1024
 
-extern spinlock_t nf_conntrack_locks[CONNTRACK_LOCKS];
+/* Every new connection takes two of these in __nf_conntrack_confirm(),
+ * keep each one in its own cache line so that CPUs inserting unrelated
+ * flows don't bounce the line of a neighbouring lock.
+ */
+struct nf_conntrack_bucket_lock {
+	spinlock_t lock;
+} ____cacheline_aligned_in_smp;
+
+extern struct nf_conntrack_bucket_lock nf_conntrack_locks[CONNTRACK_LOCKS];
 void nf_conntrack_lock(spinlock_t *lock);
 
+/* The table size is always a multiple of CONNTRACK_LOCKS and each lock
+ * covers a contiguous range of buckets, so an entry is protected by the
+ * same lock no matter which table size it was hashed with.
+ */
+static inline spinlock_t *nf_conntrack_bucket_lock(unsigned int bucket,
+						   unsigned int hsize)
+{
+	return &nf_conntrack_locks[bucket / (hsize / CONNTRACK_LOCKS)].lock;
+}
+
 extern spinlock_t nf_conntrack_expect_lock;
 
 /* ctnetlink code shared by both ctnetlink and nf_conntrack_bpf */
@@ -28,8 +28,37 @@ struct nf_conntrack_ecache {
 	u16 expmask;			/* bitmask of expect events to be delivered */
 	u32 missed;			/* missed events */
 	u32 portid;			/* netlink portid of destroyer */
+#ifdef CONFIG_NF_CONNTRACK_EVENTS_RING
+	u32 ring_pending;		/* events held back, see nf_conntrack_evring.c */
+	u32 ring_since;			/* jiffies32 of the held back new event */
+#endif
 };
 
+#ifdef CONFIG_NF_CONNTRACK_EVENTS_RING
+struct ctl_table;
+
+extern u8 nf_ct_evring_enabled;
+extern unsigned int nf_ct_evring_coalesce_ms;
+
+void nf_ct_evring_report(u32 events, const struct nf_conn *ct,
+			 struct nf_conntrack_ecache *e);
+int nf_ct_evring_sysctl(const struct ctl_table *table, int write,
+			void *buffer, size_t *lenp, loff_t *ppos);
+void nf_conntrack_evring_fini(void);
+#else
+static inline void nf_conntrack_evring_fini(void) {}
+#endif
+
+/* Is anyone but ctnetlink interested in events of @net? */
+static inline bool nf_ct_evring_active(const struct net *net)
+{
+#ifdef CONFIG_NF_CONNTRACK_EVENTS_RING
+	return READ_ONCE(nf_ct_evring_enabled) && net_eq(net, &init_net);
+#else
+	return false;
+#endif
+}
+
 static inline struct nf_conntrack_ecache *
 nf_ct_ecache_find(const struct nf_conn *ct)
 {
@@ -105,7 +134,8 @@ nf_conntrack_event_cache(enum ip_conntrack_events event, struct nf_conn *ct)
 	struct net *net = nf_ct_net(ct);
 	struct nf_conntrack_ecache *e;
 
-	if (!rcu_access_pointer(net->ct.nf_conntrack_event_cb))
+	if (!rcu_access_pointer(net->ct.nf_conntrack_event_cb) &&
+	    !nf_ct_evring_active(net))
 		return;
 
 	e = nf_ct_ecache_find(ct);
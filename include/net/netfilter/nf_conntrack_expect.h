@@ -15,6 +15,25 @@ extern unsigned int nf_ct_expect_hsize;
 extern unsigned int nf_ct_expect_max;
 extern struct hlist_head *nf_ct_expect_hash;
 
+/* Bucket @i of the expectation table under RCU, NULL past its end.  The
+ * table only grows, and the new one is visible before its size.
+ */
+static inline struct hlist_head *nf_ct_expect_bucket_nr(unsigned int i)
+{
+	if (i >= smp_load_acquire(&nf_ct_expect_hsize))
+		return NULL;
+
+	return &READ_ONCE(nf_ct_expect_hash)[i];
+}
+
+/* Bucket of a hash under RCU */
+static inline struct hlist_head *nf_ct_expect_bucket(u32 hash)
+{
+	unsigned int hsize = smp_load_acquire(&nf_ct_expect_hsize);
+
+	return &READ_ONCE(nf_ct_expect_hash)[reciprocal_scale(hash, hsize)];
+}
+
 struct nf_conntrack_expect {
 	/* Conntrack expectation list member */
 	struct hlist_node lnode;
@@ -30,6 +30,12 @@ enum nf_ct_ext_id {
 #endif
 #if IS_ENABLED(CONFIG_NET_ACT_CT)
 	NF_CT_EXT_ACT_CT,
+#endif
+#ifdef CONFIG_NF_CONNTRACK_CLIMIT
+	NF_CT_EXT_CLIMIT,
+#endif
+#if IS_ENABLED(CONFIG_NETFILTER_NETLINK_QUEUE)
+	NF_CT_EXT_QUEUE,
 #endif
 	NF_CT_EXT_NUM,
 };
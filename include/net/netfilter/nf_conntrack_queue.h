@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _NF_CONNTRACK_QUEUE_H
+#define _NF_CONNTRACK_QUEUE_H
+
+#include <linux/types.h>
+#include <net/net_namespace.h>
+#include <net/netfilter/nf_conntrack.h>
+#include <net/netfilter/nf_conntrack_extend.h>
+
+struct nf_conn_queue {
+	/* queue and hook the flow skips, see nf_queue_bypass_scope() */
+	u64 bypass;
+};
+
+/* Can't use nf_ct_ext_find(), nf_queue cannot use symbols exported by
+ * the nf_conntrack module.
+ */
+static inline struct nf_conn_queue *nf_ct_queue_find(const struct nf_conn *ct)
+{
+#if IS_ENABLED(CONFIG_NETFILTER_NETLINK_QUEUE)
+	struct nf_ct_ext *ext = ct->ext;
+
+	if (!ext || !__nf_ct_ext_exist(ext, NF_CT_EXT_QUEUE))
+		return NULL;
+
+	return (void *)ct->ext + ct->ext->offset[NF_CT_EXT_QUEUE];
+#else
+	return NULL;
+#endif
+}
+
+/* Only the entries created once a flow bypass verdict was given in the
+ * netns carry the extension.
+ */
+static inline struct nf_conn_queue *nf_ct_queue_ext_add(struct nf_conn *ct)
+{
+#if IS_ENABLED(CONFIG_NETFILTER_NETLINK_QUEUE)
+	struct net *net = nf_ct_net(ct);
+
+	if (!READ_ONCE(net->nf.queue_bypass_used))
+		return NULL;
+
+	return nf_ct_ext_add(ct, NF_CT_EXT_QUEUE, GFP_ATOMIC);
+#else
+	return NULL;
+#endif
+}
+
+#endif /* _NF_CONNTRACK_QUEUE_H */
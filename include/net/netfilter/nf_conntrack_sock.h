@@ -0,0 +1,26 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _NF_CONNTRACK_SOCK_H
+#define _NF_CONNTRACK_SOCK_H
+
+#include <linux/skbuff.h>
+#include <net/sock.h>
+
+#include <net/netfilter/nf_conntrack.h>
+
+#ifdef CONFIG_NF_CONNTRACK_SOCK_CACHE
+struct sock *nf_ct_sk_get(const struct sk_buff *skb);
+void nf_ct_sk_set(const struct sk_buff *skb, struct sock *sk);
+void nf_ct_sk_gc(struct nf_conn *ct);
+void nf_ct_sk_destroy(struct nf_conn *ct);
+#else
+static inline struct sock *nf_ct_sk_get(const struct sk_buff *skb)
+{
+	return NULL;
+}
+
+static inline void nf_ct_sk_set(const struct sk_buff *skb, struct sock *sk) {}
+static inline void nf_ct_sk_gc(struct nf_conn *ct) {}
+static inline void nf_ct_sk_destroy(struct nf_conn *ct) {}
+#endif /* CONFIG_NF_CONNTRACK_SOCK_CACHE */
+
+#endif /* _NF_CONNTRACK_SOCK_H */
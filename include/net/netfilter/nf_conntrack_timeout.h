@@ -47,6 +47,27 @@ struct nf_conn_timeout *nf_ct_timeout_find(const struct nf_conn *ct)
 #endif
 }
 
+#ifdef CONFIG_NF_CONNTRACK_TIMEOUT
+/* Bumped when the values of a policy attached to conntracks change, or
+ * when a policy is detached.  Never 0.
+ */
+extern atomic_t nf_ct_timeout_genid;
+void nf_ct_timeout_bump_genid(void);
+#endif
+
+/* The policy of @ct, not confirmed yet, was set or replaced. */
+static inline void nf_ct_timeout_changed(struct nf_conn *ct)
+{
+#ifdef CONFIG_NF_CONNTRACK_TIMEOUT
+	switch (nf_ct_protonum(ct)) {
+	case IPPROTO_UDP:
+	case IPPROTO_UDPLITE:
+		ct->proto.udp.timeout_genid = 0;
+		break;
+	}
+#endif
+}
+
 static inline
 struct nf_conn_timeout *nf_ct_timeout_ext_add(struct nf_conn *ct,
 					      struct nf_ct_timeout *timeout,
@@ -60,6 +81,7 @@ struct nf_conn_timeout *nf_ct_timeout_ext_add(struct nf_conn *ct,
 		return NULL;
 
 	rcu_assign_pointer(timeout_ext->timeout, timeout);
+	nf_ct_timeout_changed(ct);
 
 	return timeout_ext;
 #else
@@ -0,0 +1,33 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _NF_CONNTRACK_WHEEL_H
+#define _NF_CONNTRACK_WHEEL_H
+
+#include <net/netfilter/nf_conntrack.h>
+
+#ifdef CONFIG_NF_CONNTRACK_EXPIRY_WHEEL
+extern u8 nf_conntrack_expiry_wheel;
+
+static inline bool nf_ct_wheel_enabled(void)
+{
+	return READ_ONCE(nf_conntrack_expiry_wheel);
+}
+
+void nf_ct_wheel_add(struct nf_conn *ct);
+void nf_ct_wheel_del(struct nf_conn *ct);
+
+void nf_conntrack_wheel_init(void);
+void nf_conntrack_wheel_fini(void);
+#else
+static inline bool nf_ct_wheel_enabled(void)
+{
+	return false;
+}
+
+static inline void nf_ct_wheel_add(struct nf_conn *ct) {}
+static inline void nf_ct_wheel_del(struct nf_conn *ct) {}
+
+static inline void nf_conntrack_wheel_init(void) {}
+static inline void nf_conntrack_wheel_fini(void) {}
+#endif /* CONFIG_NF_CONNTRACK_EXPIRY_WHEEL */
+
+#endif /* _NF_CONNTRACK_WHEEL_H */
@@ -0,0 +1,36 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _NF_CONNTRACK_ZONE_INDEX_H
+#define _NF_CONNTRACK_ZONE_INDEX_H
+
+#include <net/netfilter/nf_conntrack.h>
+#include <net/netfilter/nf_conntrack_zones.h>
+
+#ifdef CONFIG_NF_CONNTRACK_ZONE_INDEX
+/* The default zone holds most entries, it is left out of the index. */
+static inline bool nf_ct_zone_indexed(const struct nf_conntrack_zone *zone)
+{
+	return zone->id != NF_CT_DEFAULT_ZONE_ID;
+}
+
+void nf_ct_zone_index_add(struct nf_conn *ct);
+void nf_ct_zone_index_del(struct nf_conn *ct);
+void nf_ct_zone_index_cleanup(int (*iter)(struct nf_conn *i, void *data),
+			      const struct nf_ct_iter_data *iter_data);
+
+void nf_conntrack_zone_index_init(void);
+#else
+static inline bool nf_ct_zone_indexed(const struct nf_conntrack_zone *zone)
+{
+	return false;
+}
+
+static inline void nf_ct_zone_index_add(struct nf_conn *ct) {}
+static inline void nf_ct_zone_index_del(struct nf_conn *ct) {}
+static inline void
+nf_ct_zone_index_cleanup(int (*iter)(struct nf_conn *i, void *data),
+			 const struct nf_ct_iter_data *iter_data) {}
+
+static inline void nf_conntrack_zone_index_init(void) {}
+#endif /* CONFIG_NF_CONNTRACK_ZONE_INDEX */
+
+#endif /* _NF_CONNTRACK_ZONE_INDEX_H */
@@ -73,6 +73,9 @@ enum nf_flowtable_flags {
 	NF_FLOWTABLE_COUNTER		= 0x2,	/* NFT_FLOWTABLE_COUNTER */
 };
 
+/* Slots of the gc wheel, one per second, see nf_flow_offload_work_gc(). */
+#define NF_FLOW_GC_SLOTS		64
+
 struct nf_flowtable {
 	unsigned int			flags;		/* readonly in datapath */
 	int				priority;	/* control path (padding hole) */
@@ -84,6 +87,11 @@ struct nf_flowtable {
 	struct flow_block		flow_block;
 	struct rw_semaphore		flow_block_lock; /* Guards flow_block */
 	possible_net_t			net;
+
+	spinlock_t			gc_lock;	/* Guards gc_slots */
+	u32				gc_tick;
+	unsigned int			gc_sweep;
+	struct hlist_head		gc_slots[NF_FLOW_GC_SLOTS];
 };
 
 static inline bool nf_flowtable_hw_offload(struct nf_flowtable *flowtable)
@@ -103,10 +111,24 @@ enum flow_offload_xmit_type {
 	FLOW_OFFLOAD_XMIT_XFRM,
 	FLOW_OFFLOAD_XMIT_DIRECT,
 	FLOW_OFFLOAD_XMIT_TC,
+	FLOW_OFFLOAD_XMIT_BRIDGE,	/* as received, to a bridge port */
 };
 
 #define NF_FLOW_TABLE_ENCAP_MAX		2
 
+/* IPv4 tunnel, decapsulated on receive and pushed on transmit.  In the
+ * lookup key only proto and the addresses of the received outer header
+ * are set.
+ */
+struct flow_offload_tunnel {
+	__be32				src_v4;
+	__be32				dst_v4;
+	u8				proto;
+	u8				ttl;
+	u8				tos;
+	bool				df;
+};
+
 struct flow_offload_tuple {
 	union {
 		struct in_addr		src_v4;
@@ -129,6 +151,7 @@ struct flow_offload_tuple {
 		u16			id;
 		__be16			proto;
 	} encap[NF_FLOW_TABLE_ENCAP_MAX];
+	struct flow_offload_tunnel	tun;
 
 	/* All members above are keys for lookups, see flow_offload_hash(). */
 	struct { }			__hash;
@@ -148,6 +171,7 @@ struct flow_offload_tuple {
 			u32		hw_ifidx;
 			u8		h_source[ETH_ALEN];
 			u8		h_dest[ETH_ALEN];
+			struct flow_offload_tunnel tun;
 		} out;
 		struct {
 			u32		iifidx;
@@ -158,6 +182,10 @@ struct flow_offload_tuple {
 struct flow_offload_tuple_rhash {
 	struct rhash_head		node;
 	struct flow_offload_tuple	tuple;
+	/* jiffies of the last packet in this direction, see
+	 * flow_offload_refresh()
+	 */
+	u32				last_used;
 };
 
 enum nf_flow_flags {
@@ -171,6 +199,7 @@ enum nf_flow_flags {
 	NF_FLOW_HW_PENDING,
 	NF_FLOW_HW_BIDIRECTIONAL,
 	NF_FLOW_HW_ESTABLISHED,
+	NF_FLOW_REMOVED,
 };
 
 enum flow_offload_type {
@@ -183,10 +212,20 @@ struct flow_offload {
 	struct nf_conn				*ct;
 	unsigned long				flags;
 	u16					type;
+	u16					gc_slot;
 	u32					timeout;
+	struct nf_flowtable			*flowtable;
+	struct hlist_node			gc_node;
 	struct rcu_head				rcu_head;
 };
 
+/* Tunnel flows are only handled in software. */
+static inline bool nf_flow_is_tunnel(const struct flow_offload *flow)
+{
+	return flow->tuplehash[FLOW_OFFLOAD_DIR_ORIGINAL].tuple.tun.proto ||
+	       flow->tuplehash[FLOW_OFFLOAD_DIR_REPLY].tuple.tun.proto;
+}
+
 #define NF_FLOW_TIMEOUT (30 * HZ)
 #define nf_flowtable_time_stamp	(u32)jiffies
 
@@ -208,12 +247,14 @@ struct nf_flow_route {
 			} encap[NF_FLOW_TABLE_ENCAP_MAX];
 			u8			num_encaps:2,
 						ingress_vlans:2;
+			struct flow_offload_tunnel tun;
 		} in;
 		struct {
 			u32			ifindex;
 			u32			hw_ifindex;
 			u8			h_source[ETH_ALEN];
 			u8			h_dest[ETH_ALEN];
+			struct flow_offload_tunnel tun;
 		} out;
 		enum flow_offload_xmit_type	xmit_type;
 	} tuple[FLOW_OFFLOAD_DIR_MAX];
@@ -281,7 +322,8 @@ void flow_offload_route_init(struct flow_offload *flow,
 
 int flow_offload_add(struct nf_flowtable *flow_table, struct flow_offload *flow);
 void flow_offload_refresh(struct nf_flowtable *flow_table,
-			  struct flow_offload *flow, bool force);
+			  struct flow_offload *flow,
+			  enum flow_offload_tuple_dir dir, bool force);
 
 struct flow_offload_tuple_rhash *flow_offload_lookup(struct nf_flowtable *flow_table,
 						     struct flow_offload_tuple *tuple);
@@ -315,6 +357,8 @@ unsigned int nf_flow_offload_ip_hook(void *priv, struct sk_buff *skb,
 				     const struct nf_hook_state *state);
 unsigned int nf_flow_offload_ipv6_hook(void *priv, struct sk_buff *skb,
 				       const struct nf_hook_state *state);
+unsigned int nf_flow_offload_bridge_hook(void *priv, struct sk_buff *skb,
+					 const struct nf_hook_state *state);
 
 #if (IS_BUILTIN(CONFIG_NF_FLOW_TABLE) && IS_ENABLED(CONFIG_DEBUG_INFO_BTF)) || \
     (IS_MODULE(CONFIG_NF_FLOW_TABLE) && IS_ENABLED(CONFIG_DEBUG_INFO_BTF_MODULES))
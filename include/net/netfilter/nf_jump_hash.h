@@ -0,0 +1,32 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _NF_JUMP_HASH_H
+#define _NF_JUMP_HASH_H
+
+#include <linux/types.h>
+#include <linux/math64.h>
+
+/**
+ * nf_jump_hash - map a hash to one of @buckets buckets, consistently
+ * @hash: hash of the flow
+ * @buckets: number of buckets
+ *
+ * Jump consistent hash, by Lamping and Veach: going from n to n + 1
+ * buckets only moves 1/(n + 1) of the hashes, all of them to the new
+ * bucket, where reciprocal_scale() moves almost all of them.  Takes
+ * O(log n) steps and no table, so it fits matches and expressions that
+ * map flows to cluster nodes.
+ */
+static inline u32 nf_jump_hash(u32 hash, u32 buckets)
+{
+	u64 key = hash, b = 0, j = 0;
+
+	while (j < buckets) {
+		b = j;
+		key = key * 2862933555777941757ULL + 1;
+		j = div_u64((b + 1) << 31, (u32)(key >> 33) + 1);
+	}
+
+	return b;
+}
+
+#endif /* _NF_JUMP_HASH_H */
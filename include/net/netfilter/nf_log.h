@@ -28,6 +28,10 @@ struct nf_loginfo {
 			u_int16_t group;
 			u_int16_t qthreshold;
 			u_int16_t flags;
+			/* packets an aggregated record stands for, 0 if
+			 * not aggregated
+			 */
+			u_int32_t count;
 		} ulog;
 		struct {
 			u_int8_t level;
@@ -9,6 +9,7 @@
 #include <net/netfilter/nf_conntrack_extend.h>
 #include <net/netfilter/nf_conntrack_tuple.h>
 #include <uapi/linux/netfilter/nf_nat.h>
+#include <uapi/linux/netfilter/nf_nat_block.h>
 
 enum nf_nat_manip_type {
 	NF_NAT_MANIP_SRC,
@@ -32,6 +33,14 @@ struct nf_conn_nat {
 	union nf_conntrack_nat_help help;
 #if IS_ENABLED(CONFIG_NF_NAT_MASQUERADE)
 	int masq_index;
+#endif
+	/* source port taken from a pool or a block, see nf_nat_pool.c */
+	struct nf_nat_pool *pool;
+	struct nf_nat_block *block;
+	u16 pool_port;
+#if IS_ENABLED(CONFIG_NF_NAT_MASQUERADE)
+	/* in the index of nf_nat_masquerade.c, or counted as missing from it */
+	u8 masq_state;
 #endif
 };
 
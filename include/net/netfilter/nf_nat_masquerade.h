@@ -17,4 +17,14 @@ unsigned int
 nf_nat_masquerade_ipv6(struct sk_buff *skb, const struct nf_nat_range2 *range,
 		       const struct net_device *out);
 
+#if IS_ENABLED(CONFIG_NF_NAT_MASQUERADE)
+void nf_nat_masquerade_unindex(struct nf_conn *ct);
+int nf_nat_masquerade_init(void);
+void nf_nat_masquerade_fini(void);
+#else
+static inline void nf_nat_masquerade_unindex(struct nf_conn *ct) {}
+static inline int nf_nat_masquerade_init(void) { return 0; }
+static inline void nf_nat_masquerade_fini(void) {}
+#endif
+
 #endif /*_NF_NAT_MASQUERADE_H_ */
@@ -0,0 +1,41 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _NF_NAT_POOL_H
+#define _NF_NAT_POOL_H
+
+#include <net/netfilter/nf_conntrack.h>
+#include <net/netfilter/nf_conntrack_tuple.h>
+
+struct nf_nat_pool;
+struct nf_nat_range2;
+
+extern u8 nf_nat_port_pool;
+
+static inline bool nf_nat_pool_enabled(void)
+{
+	return READ_ONCE(nf_nat_port_pool);
+}
+
+struct nf_nat_pool *nf_nat_pool_get(struct net *net,
+				    const struct nf_conntrack_tuple *tuple,
+				    u16 min, u32 size, u16 block);
+void nf_nat_pool_put(struct nf_nat_pool *pool);
+
+int nf_nat_pool_claim(struct nf_nat_pool *pool, u32 start);
+void nf_nat_pool_unclaim(struct nf_nat_pool *pool, u32 port);
+
+bool nf_nat_block_unique_tuple(struct nf_conntrack_tuple *tuple,
+			       const struct nf_nat_range2 *range,
+			       struct nf_conn *ct, u16 min, u32 size);
+
+void nf_nat_pool_release(struct nf_conn *ct);
+
+/* nf_nat_core.c */
+int nf_nat_used_tuple(const struct nf_conntrack_tuple *tuple,
+		      const struct nf_conn *ignored_conntrack);
+bool nf_nat_inet_in_range(const struct nf_conntrack_tuple *t,
+			  const struct nf_nat_range2 *range);
+
+int nf_nat_pool_init(void);
+void nf_nat_pool_fini(void);
+
+#endif /* _NF_NAT_POOL_H */
@@ -0,0 +1,15 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _NF_NAT_XLAT_H_
+#define _NF_NAT_XLAT_H_
+
+#include <linux/in6.h>
+#include <linux/skbuff.h>
+
+/* Stateless IPv4/IPv6 translation, RFC 7915, with IPv4 addresses embedded
+ * in the last 32 bits of a /96 prefix, RFC 6052.  skb->data points to the
+ * network header, on success it points to the translated one.
+ */
+int nf_nat_xlat_4to6(struct sk_buff *skb, const struct in6_addr *prefix);
+int nf_nat_xlat_6to4(struct sk_buff *skb, const struct in6_addr *prefix);
+
+#endif /* _NF_NAT_XLAT_H_ */
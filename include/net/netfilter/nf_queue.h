@@ -11,6 +11,7 @@
 /* Each queued (to userspace) skbuff has one of these. */
 struct nf_queue_entry {
 	struct list_head	list;
+	struct hlist_node	hnode;		/* by id, for verdicts */
 	struct sk_buff		*skb;
 	unsigned int		id;
 	unsigned int		hook_index;	/* index in hook_entries->hook[] */
@@ -39,6 +40,25 @@ void nf_unregister_queue_handler(void);
 bool nf_queue_entry_get_refs(struct nf_queue_entry *entry);
 void nf_queue_entry_free(struct nf_queue_entry *entry);
 
+#if IS_ENABLED(CONFIG_NETFILTER_NETLINK_QUEUE)
+/* A flow bypasses the queue it was accepted from with the flow bypass
+ * verdict flag, at the hook it was queued at only.  The scope, never 0,
+ * is stored in the conntrack entry.  Bumping the netns generation, when
+ * queues are destroyed, ends all the bypasses of the netns.
+ */
+static inline u64 nf_queue_bypass_scope(const struct nf_hook_state *state,
+					unsigned int queuenum)
+{
+	return (u64)READ_ONCE(state->net->nf.queue_bypass_gen) << 32 |
+	       (queuenum & 0xffff) << 16 | state->pf << 8 | (state->hook + 1);
+}
+
+static inline void nf_queue_bypass_flush(struct net *net)
+{
+	WRITE_ONCE(net->nf.queue_bypass_gen, net->nf.queue_bypass_gen + 1);
+}
+#endif
+
 static inline void init_hashrandom(u32 *jhash_initval)
 {
 	while (*jhash_initval == 0)
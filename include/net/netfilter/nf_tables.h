@@ -25,6 +25,32 @@ enum {
 	NFT_PKTINFO_L4PROTO	= (1 << 0),
 	NFT_PKTINFO_INNER	= (1 << 1),
 	NFT_PKTINFO_INNER_FULL	= (1 << 2),
+	NFT_PKTINFO_FRAG	= (1 << 3),
+	NFT_PKTINFO_HDR		= (1 << 4),
+	NFT_PKTINFO_TCPOPT	= (1 << 5),
+};
+
+enum nft_pktinfo_hdr_kinds {
+	NFT_PKTINFO_HDR_IPV6,
+	NFT_PKTINFO_HDR_TCPOPT,
+};
+
+#define NFT_PKTINFO_HDR_MAX	8
+#define NFT_PKTINFO_HDR_NONE	U16_MAX
+
+/**
+ *	struct nft_pktinfo_hdr - result of a header or option lookup
+ *
+ *	@kind: NFT_PKTINFO_HDR_*
+ *	@type: header or option searched for
+ *	@len: option length, for TCP options
+ *	@off: where it was found, NFT_PKTINFO_HDR_NONE if it was not
+ */
+struct nft_pktinfo_hdr {
+	u8	kind;
+	u8	type;
+	u8	len;
+	u16	off;
 };
 
 struct nft_pktinfo {
@@ -35,8 +61,68 @@ struct nft_pktinfo {
 	u16				fragoff;
 	u16				thoff;
 	u16				inneroff;
+	/* paged fragment of the last payload load from paged data, where
+	 * it starts and skb_headlen() then, valid with NFT_PKTINFO_FRAG.
+	 */
+	u8				frag;
+	u32				fragstart;
+	u32				fraghead;
+	/* lookups done so far, valid with NFT_PKTINFO_HDR.  With
+	 * NFT_PKTINFO_TCPOPT, all TCP options but EOL and NOP are in there.
+	 */
+	u8				hdr_num;
+	struct nft_pktinfo_hdr		hdr[NFT_PKTINFO_HDR_MAX];
 };
 
+/* Expressions looking for the same IPv6 extension header or TCP option in
+ * the same packet reuse the result of the first lookup.  The results are
+ * filled in lazily through the const pktinfo, as inneroff, and are
+ * dropped by whatever rewrites headers in a way that can move them.
+ */
+static inline const struct nft_pktinfo_hdr *
+nft_pktinfo_hdr_find(const struct nft_pktinfo *pkt, u8 kind, u8 type)
+{
+	unsigned int i;
+
+	if (!(pkt->flags & NFT_PKTINFO_HDR))
+		return NULL;
+
+	for (i = 0; i < pkt->hdr_num; i++) {
+		if (pkt->hdr[i].kind == kind && pkt->hdr[i].type == type)
+			return &pkt->hdr[i];
+	}
+
+	return NULL;
+}
+
+static inline bool nft_pktinfo_hdr_store(const struct nft_pktinfo *pkt,
+					 u8 kind, u8 type, u16 off, u8 len)
+{
+	struct nft_pktinfo *p = (struct nft_pktinfo *)pkt;
+
+	if (!(p->flags & NFT_PKTINFO_HDR)) {
+		p->hdr_num = 0;
+		p->flags |= NFT_PKTINFO_HDR;
+	}
+
+	if (p->hdr_num == NFT_PKTINFO_HDR_MAX)
+		return false;
+
+	p->hdr[p->hdr_num].kind = kind;
+	p->hdr[p->hdr_num].type = type;
+	p->hdr[p->hdr_num].len = len;
+	p->hdr[p->hdr_num].off = off;
+	p->hdr_num++;
+
+	return true;
+}
+
+static inline void nft_pktinfo_hdr_flush(const struct nft_pktinfo *pkt)
+{
+	((struct nft_pktinfo *)pkt)->flags &= ~(NFT_PKTINFO_HDR |
+						NFT_PKTINFO_TCPOPT);
+}
+
 static inline struct sock *nft_sk(const struct nft_pktinfo *pkt)
 {
 	return pkt->state->sk;
@@ -209,6 +295,7 @@ static inline void nft_data_copy(u32 *dst, const struct nft_data *src,
  *	@family: protocol family
  *	@level: depth of the chains
  *	@report: notify via unicast netlink message
+ *	@vseq: validation pass, 0 if chains validated before aren't skipped
  *	@reg_inited: bitmap of initialised registers
  */
 struct nft_ctx {
@@ -221,7 +308,10 @@ struct nft_ctx {
 	u16				flags;
 	u8				family;
 	u8				level;
+	u8				jumps;
+	bool				tail;
 	bool				report;
+	u32				vseq;
 	DECLARE_BITMAP(reg_inited, NFT_REG32_NUM);
 };
 
@@ -330,6 +420,9 @@ struct nft_set_iter {
 	enum nft_iter_type type:8;
 	unsigned int	count;
 	unsigned int	skip;
+	/* backend specific position of the element passed to @fn */
+	unsigned long	pos;
+	u32		pos_gen;
 	int		err;
 	int		(*fn)(const struct nft_ctx *ctx,
 			      struct nft_set *set,
@@ -337,6 +430,24 @@ struct nft_set_iter {
 			      struct nft_elem_priv *elem_priv);
 };
 
+/**
+ *	nft_set_iter_resume - resume a walk from a previous position
+ *
+ *	@iter: iterator, @pos as left by the walk that stopped
+ *
+ *	Backends that can resume a walk call this once they have checked that
+ *	@pos and @pos_gen still designate an element of the set.  The @skip
+ *	elements the previous walks went through are accounted as visited.
+ */
+static inline bool nft_set_iter_resume(struct nft_set_iter *iter)
+{
+	if (!iter->pos)
+		return false;
+
+	iter->count = iter->skip;
+	return true;
+}
+
 /**
  *	struct nft_set_desc - description of set elements
  *
@@ -582,6 +693,9 @@ struct nft_set_elem_expr {
  *	@catchall_list: list of catch-all set element
  * 	@data: private set data
  */
+struct nft_set_prefilter;
+struct nft_set_prefilter_stats;
+
 struct nft_set {
 	struct list_head		list;
 	struct list_head		bindings;
@@ -615,6 +729,10 @@ struct nft_set {
 	u8				num_exprs;
 	struct nft_expr			*exprs[NFT_SET_EXPR_MAX];
 	struct list_head		catchall_list;
+	struct nft_set_prefilter __rcu	*prefilter;
+	struct nft_set_prefilter_stats __percpu *prefilter_stats;
+	/* part of nelems reserved by each cpu for packet path insertions */
+	int __percpu			*nelems_credit;
 	unsigned char			data[]
 		__attribute__((aligned(__alignof__(u64))));
 };
@@ -996,14 +1114,25 @@ struct nft_expr_ops {
  *	@genmask: generation mask
  *	@dlen: length of expression data
  *	@udata: user data is appended to the rule
+ *	@hw_pending: hardware offload queued, see offload_async
+ *	@hw_failed: hardware offload queued and rejected by the driver
+ *	@profile: per-cpu profiling counters, if enabled
+ *	@dump: cached netlink form of the expressions and user data
  *	@data: expression data
  */
+struct nft_rule_profile;
+struct nft_rule_dump;
+
 struct nft_rule {
 	struct list_head		list;
 	u64				handle:42,
 					genmask:2,
 					dlen:12,
-					udata:1;
+					udata:1,
+					hw_pending:1,
+					hw_failed:1;
+	struct nft_rule_profile __percpu *profile;
+	struct nft_rule_dump __rcu	*dump;
 	unsigned char			data[]
 		__attribute__((aligned(__alignof__(struct nft_expr))));
 };
@@ -1132,6 +1261,11 @@ struct nft_chain {
 
 	/* Only used during control plane commit phase: */
 	struct nft_rule_blob		*blob_next;
+
+	/* deepest level and jump count validated in pass vseq */
+	u32				vseq;
+	u8				vlevel;
+	u8				vjumps;
 };
 
 int nft_chain_validate(const struct nft_ctx *ctx, const struct nft_chain *chain);
@@ -1293,6 +1427,7 @@ static inline void nft_use_inc_restore(u32 *use)
  *	@udlen: length of the user data
  *	@udata: user data
  *	@validate_state: internal, set when transaction adds jumps
+ *	@blob_commits: internal, commits left that have to visit the chains
  */
 struct nft_table {
 	struct list_head		list;
@@ -1312,6 +1447,7 @@ struct nft_table {
 	u16				udlen;
 	u8				*udata;
 	u8				validate_state;
+	u8				blob_commits;
 };
 
 static inline bool nft_table_has_owner(const struct nft_table *table)
@@ -1521,6 +1657,10 @@ void nft_trace_notify(const struct nft_pktinfo *pkt,
 		      const struct nft_rule_dp *rule,
 		      struct nft_traceinfo *info);
 
+int nft_trace_ring_get(struct net *net);
+void nft_trace_ring_put(struct net *net);
+bool nft_trace_ring_proc_create(struct net *net);
+
 #define MODULE_ALIAS_NFT_CHAIN(family, name) \
 	MODULE_ALIAS("nft-chain-" __stringify(family) "-" name)
 
@@ -1552,6 +1692,20 @@ static inline unsigned int nft_gencursor_next(const struct net *net)
 	return net->nft.gencursor + 1 == 1 ? 1 : 0;
 }
 
+/* Called after the generation cursor moved on: results cached along with a
+ * previous genid, under which they were computed, are stale.
+ */
+static inline void nft_genid_bump(struct net *net)
+{
+	unsigned int genid = net->nft.genid;
+
+	while (++genid == 0)
+		;
+
+	/* pairs with the acquire in nft_lookup_ct_eval() */
+	smp_store_release(&net->nft.genid, genid);
+}
+
 static inline u8 nft_genmask_next(const struct net *net)
 {
 	return 1 << nft_gencursor_next(net);
@@ -1912,6 +2066,8 @@ __printf(2, 3) int nft_request_module(struct net *net, const char *fmt, ...);
 static inline int nft_request_module(struct net *net, const char *fmt, ...) { return -ENOENT; }
 #endif
 
+struct nft_trace_ring;
+
 struct nftables_pernet {
 	struct list_head	tables;
 	struct list_head	commit_list;
@@ -1921,12 +2077,20 @@ struct nftables_pernet {
 	struct list_head	module_list;
 	struct list_head	notify_list;
 	struct mutex		commit_mutex;
+	struct mutex		notify_mutex;
 	u64			table_handle;
 	u64			tstamp;
 	unsigned int		base_seq;
 	unsigned int		gc_seq;
+	unsigned int		validate_seq;
+	unsigned int		rule_dump_gen;
 	u8			validate_state;
 	struct work_struct	destroy_work;
+	struct list_head	offload_pending;
+	struct list_head	offload_list;
+	struct work_struct	offload_work;
+	struct nft_trace_ring * __rcu *trace_ring;
+	unsigned int		trace_users;
 };
 
 extern unsigned int nf_tables_net_id;
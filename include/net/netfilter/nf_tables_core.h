@@ -3,7 +3,10 @@
 #define _NET_NF_TABLES_CORE_H
 
 #include <net/netfilter/nf_tables.h>
+#include <net/netfilter/nft_meta.h>
 #include <linux/indirect_call_wrapper.h>
+#include <linux/hash.h>
+#include <linux/jhash.h>
 
 extern struct nft_expr_type nft_imm_type;
 extern struct nft_expr_type nft_cmp_type;
@@ -36,6 +39,13 @@ struct nft_bitwise_fast_expr {
 	u8			dreg;
 };
 
+struct nft_bitwise16_fast_expr {
+	struct nft_data		mask;
+	struct nft_data		xor;
+	u8			sreg;
+	u8			dreg;
+};
+
 struct nft_cmp_fast_expr {
 	u32			data;
 	u32			mask;
@@ -81,6 +91,97 @@ struct nft_payload {
 extern const struct nft_expr_ops nft_payload_fast_ops;
 
 extern const struct nft_expr_ops nft_bitwise_fast_ops;
+extern const struct nft_expr_ops nft_bitwise16_fast_ops;
+
+struct nft_lookup {
+	struct nft_set			*set;
+	u8				sreg;
+	u8				dreg;
+	bool				dreg_set;
+	bool				invert;
+	bool				ct_cache;
+	struct nft_set_binding		binding;
+};
+
+/* Fused expressions, only ever found in the rule blob, see
+ * nft_expr_fuse().  The leading member is the priv area of the first
+ * expression fused, its eval function can be called on the fused one.
+ */
+struct nft_payload_cmp_expr {
+	struct nft_payload		payload;
+	struct nft_cmp_fast_expr	cmp;
+};
+
+struct nft_meta_lookup_expr {
+	struct nft_meta			meta;
+	struct nft_lookup		lookup;
+};
+
+struct nft_ct_state_cmp_expr {
+	struct nft_ct			ct;
+	struct nft_bitwise_fast_expr	bitwise;
+	struct nft_cmp_fast_expr	cmp;
+};
+
+extern const struct nft_expr_ops nft_payload_cmp_ops;
+extern const struct nft_expr_ops nft_meta_lookup_ops;
+extern const struct nft_expr_ops nft_ct_state_cmp_ops;
+
+unsigned int nft_expr_fuse(void *dst, const struct nft_expr **expr,
+			   const struct nft_expr *last);
+void nft_expr_tail_call(struct nft_expr *expr);
+
+/* longest path of chains, jumps and gotos, nft_chain_validate() accepts */
+#define NFT_CHAIN_DEPTH_MAX	64
+
+extern u8 nft_chain_depth;
+
+/* Classifier for runs of rules matching the same fields, see
+ * nft_classify_run().  Takes a rule of its own in the rule blob, its
+ * lookup table is placed after the blob trailer.
+ */
+struct nft_classify;
+
+struct nft_classify_expr {
+	struct nft_classify		*cls;
+};
+
+#define NFT_CLASSIFY_RULE_SIZE	(sizeof(struct nft_rule_dp) + \
+				 NFT_EXPR_SIZE(sizeof(struct nft_classify_expr)))
+
+/* Per-rule profile, the expression leads each rule of the blob when
+ * profiling is on at commit time.
+ */
+struct nft_rule_profile {
+	u64				evals;
+	u64				cycles;
+};
+
+struct nft_rule_profile_expr {
+	struct nft_rule_profile __percpu *profile;
+};
+
+#define NFT_RULE_PROFILE_SIZE	NFT_EXPR_SIZE(sizeof(struct nft_rule_profile_expr))
+
+extern const struct nft_expr_ops nft_rule_profile_ops;
+extern struct static_key_false nft_rule_profile_enabled;
+
+unsigned int nft_rule_profile_init(void *dst, struct nft_rule *rule);
+
+extern const struct nft_expr_ops nft_classify_ops;
+extern u8 nft_classify_min_rules;
+
+unsigned int nft_classify_run(const struct net *net,
+			      const struct nft_chain *chain,
+			      const struct nft_rule *rule, unsigned int min);
+size_t nft_classify_size(unsigned int nrules);
+struct nft_classify *nft_classify_init(void *data, void *table,
+				       const struct nft_rule *rule,
+				       unsigned int nrules);
+void nft_classify_add(struct nft_classify *cls, const struct nft_rule *rule,
+		      const struct nft_rule_dp *prule);
+void nft_classify_done(struct nft_classify *cls,
+		       const struct nft_rule_dp *miss);
 
 extern struct static_key_false nft_counters_enabled;
 extern struct static_key_false nft_trace_enabled;
@@ -88,10 +189,24 @@ extern struct static_key_false nft_trace_enabled;
 extern const struct nft_set_type nft_set_rhash_type;
 extern const struct nft_set_type nft_set_hash_type;
 extern const struct nft_set_type nft_set_hash_fast_type;
+extern const struct nft_set_type nft_set_ohash_type;
 extern const struct nft_set_type nft_set_rbtree_type;
 extern const struct nft_set_type nft_set_bitmap_type;
+extern const struct nft_set_type nft_set_bitmap_tree_type;
 extern const struct nft_set_type nft_set_pipapo_type;
 extern const struct nft_set_type nft_set_pipapo_avx2_type;
+extern const struct nft_set_type nft_set_pipapo_neon_type;
+
+#if IS_ENABLED(CONFIG_KUNIT)
+/* backend selection, exposed to the set benchmark */
+extern const struct nft_set_type *nft_set_types[];
+extern const unsigned int nft_set_types_num;
+bool nft_set_ops_candidate(const struct nft_set_type *type, u32 flags);
+const struct nft_set_ops *__nft_select_set_ops(u32 flags,
+					       const struct nft_set_desc *desc);
+u32 nft_set_kernel_size(const struct nft_set_ops *ops,
+			const struct nft_set_desc *desc);
+#endif
 
 #ifdef CONFIG_MITIGATION_RETPOLINE
 bool nft_rhash_lookup(const struct net *net, const struct nft_set *set,
@@ -100,11 +215,15 @@ bool nft_rbtree_lookup(const struct net *net, const struct nft_set *set,
 		       const u32 *key, const struct nft_set_ext **ext);
 bool nft_bitmap_lookup(const struct net *net, const struct nft_set *set,
 		       const u32 *key, const struct nft_set_ext **ext);
+bool nft_bitmap_tree_lookup(const struct net *net, const struct nft_set *set,
+			    const u32 *key, const struct nft_set_ext **ext);
 bool nft_hash_lookup_fast(const struct net *net,
 			  const struct nft_set *set,
 			  const u32 *key, const struct nft_set_ext **ext);
 bool nft_hash_lookup(const struct net *net, const struct nft_set *set,
 		     const u32 *key, const struct nft_set_ext **ext);
+bool nft_ohash_lookup(const struct net *net, const struct nft_set *set,
+		      const u32 *key, const struct nft_set_ext **ext);
 bool nft_set_do_lookup(const struct net *net, const struct nft_set *set,
 		       const u32 *key, const struct nft_set_ext **ext);
 #else
@@ -116,12 +235,90 @@ nft_set_do_lookup(const struct net *net, const struct nft_set *set,
 }
 #endif
 
-/* called from nft_pipapo_avx2.c */
+/* Blocked bloom filter checked before looking up sets without intervals:
+ * each key sets NFT_SET_PREFILTER_K bits in a single cache line sized
+ * block. Keys are added on insertion and never removed, the filter is
+ * rebuilt on commit once too many of its keys are gone.
+ */
+#define NFT_SET_PREFILTER_BLOCK_BITS	512
+#define NFT_SET_PREFILTER_K		3
+#define NFT_SET_PREFILTER_BITS_PER_KEY	16
+#define NFT_SET_PREFILTER_MAX_BLOCKS	(1U << 20)
+
+struct nft_set_prefilter_stats {
+	u64			checked;
+	u64			rejected;
+	u64			false_positives;
+};
+
+struct nft_set_prefilter {
+	struct rcu_head		rcu;
+	u32			seed;
+	u32			nblocks;
+	/* keys added, including the ones removed since */
+	u32			nkeys;
+	unsigned long		*bits;
+};
+
+extern unsigned int nft_set_prefilter_min;
+
+/* hash buckets scanned per set gc run, 0 for all of them */
+extern unsigned int nft_set_gc_budget;
+
+/* age of named counter totals reported by dumps, 0 for exact reads */
+extern unsigned int nft_counter_fold_ms;
+
+/* bytes a quota may consume per cpu before the shared counter is updated */
+extern unsigned int nft_quota_percpu_slack;
+
+/* remember IPv4 fib expression results per cpu until the routes change */
+extern u8 nft_fib_cache;
+
+static inline u32 nft_set_prefilter_hash(const struct nft_set_prefilter *pf,
+					 const struct nft_set *set,
+					 const u32 *key)
+{
+	if (set->klen == 4)
+		return jhash_1word(*key, pf->seed);
+
+	return jhash(key, set->klen, pf->seed);
+}
+
+static inline unsigned long
+nft_set_prefilter_bit(const struct nft_set_prefilter *pf, u32 hash, int i)
+{
+	u32 block = reciprocal_scale(hash, pf->nblocks);
+
+	/* 9 bits for each position in the block, from the top 27 */
+	hash *= GOLDEN_RATIO_32;
+
+	return (unsigned long)block * NFT_SET_PREFILTER_BLOCK_BITS +
+	       ((hash >> (5 + 9 * i)) & (NFT_SET_PREFILTER_BLOCK_BITS - 1));
+}
+
+static inline bool nft_set_prefilter_test(const struct nft_set_prefilter *pf,
+					  const struct nft_set *set,
+					  const u32 *key)
+{
+	u32 hash = nft_set_prefilter_hash(pf, set, key);
+	int i;
+
+	for (i = 0; i < NFT_SET_PREFILTER_K; i++) {
+		if (!test_bit(nft_set_prefilter_bit(pf, hash, i), pf->bits))
+			return false;
+	}
+
+	return true;
+}
+
+/* called from nft_pipapo_avx2.c and nft_set_pipapo_neon.c */
 bool nft_pipapo_lookup(const struct net *net, const struct nft_set *set,
 		       const u32 *key, const struct nft_set_ext **ext);
 /* called from nft_set_pipapo.c */
 bool nft_pipapo_avx2_lookup(const struct net *net, const struct nft_set *set,
 			    const u32 *key, const struct nft_set_ext **ext);
+bool nft_pipapo_neon_lookup(const struct net *net, const struct nft_set *set,
+			    const u32 *key, const struct nft_set_ext **ext);
 
 void nft_counter_init_seqcount(void);
 
@@ -134,6 +331,8 @@ void nft_cmp_eval(const struct nft_expr *expr,
 		  struct nft_regs *regs, const struct nft_pktinfo *pkt);
 void nft_lookup_eval(const struct nft_expr *expr,
 		     struct nft_regs *regs, const struct nft_pktinfo *pkt);
+void __nft_lookup_eval(const struct nft_lookup *priv,
+		       struct nft_regs *regs, const struct nft_pktinfo *pkt);
 void nft_payload_eval(const struct nft_expr *expr,
 		      struct nft_regs *regs, const struct nft_pktinfo *pkt);
 void nft_immediate_eval(const struct nft_expr *expr,
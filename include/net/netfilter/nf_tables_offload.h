@@ -65,16 +65,27 @@ struct nft_flow_rule {
 	__be16			proto;
 	struct nft_flow_match	match;
 	struct flow_rule	*rule;
+	/* set lookup, see nft_flow_rule_set_lookup() */
+	struct nft_set		*set;
+	struct nft_offload_reg	set_reg;
+	int			set_action;
 };
 
 void nft_flow_rule_set_addr_type(struct nft_flow_rule *flow,
 				 enum flow_dissector_key_id addr_type);
+int nft_flow_rule_set_lookup(struct nft_offload_ctx *ctx,
+			     struct nft_flow_rule *flow, struct nft_set *set,
+			     u8 sreg, bool verdict);
 
 struct nft_rule;
 struct nft_flow_rule *nft_flow_rule_create(struct net *net, const struct nft_rule *rule);
 int nft_flow_rule_stats(const struct nft_chain *chain, const struct nft_rule *rule);
 void nft_flow_rule_destroy(struct nft_flow_rule *flow);
 int nft_flow_rule_offload_commit(struct net *net);
+void nft_flow_rule_offload_queue(struct net *net);
+void nft_flow_rule_offload_cancel(struct net *net);
+void nft_flow_rule_offload_flush(struct net *net);
+void nft_flow_rule_offload_work(struct work_struct *work);
 
 #define NFT_OFFLOAD_MATCH_FLAGS(__key, __base, __field, __len, __reg, __flags)	\
 	(__reg)->base_offset	=					\
@@ -28,6 +28,7 @@ struct nf_tcp_net {
 	u8 tcp_be_liberal;
 	u8 tcp_max_retrans;
 	u8 tcp_ignore_invalid_rst;
+	u8 tcp_fastpath;
 #if IS_ENABLED(CONFIG_NF_FLOW_TABLE)
 	unsigned int offload_timeout;
 #endif
@@ -41,6 +42,8 @@ enum udp_conntrack {
 
 struct nf_udp_net {
 	unsigned int timeouts[UDP_CT_MAX];
+	unsigned int quic_timeouts[UDP_CT_MAX];
+	u8 quic;
 #if IS_ENABLED(CONFIG_NF_FLOW_TABLE)
 	unsigned int offload_timeout;
 #endif
@@ -71,7 +74,6 @@ enum gre_conntrack {
 };
 
 struct nf_gre_net {
-	struct list_head	keymap_list;
 	unsigned int		timeouts[GRE_CT_MAX];
 };
 #endif
@@ -6,6 +6,10 @@ struct nf_flow_table_stat {
 	unsigned int count_wq_add;
 	unsigned int count_wq_del;
 	unsigned int count_wq_stats;
+	unsigned int count_wq_add_busy;
+	unsigned int count_wq_stats_busy;
+	unsigned int count_cache_hit;
+	unsigned int count_cache_miss;
 };
 
 struct netns_ft {
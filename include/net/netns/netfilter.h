@@ -33,5 +33,11 @@ struct netns_nf {
 #if IS_ENABLED(CONFIG_NF_DEFRAG_IPV6)
 	unsigned int defrag_ipv6_users;
 #endif
+#if IS_ENABLED(CONFIG_NETFILTER_NETLINK_QUEUE)
+	/* bumped to end all queue bypasses, see nf_queue_bypass_scope() */
+	unsigned int queue_bypass_gen;
+	/* set once a queue was bound, see nf_ct_queue_ext_add() */
+	bool queue_bypass_used;
+#endif
 };
 #endif
@@ -4,6 +4,8 @@
 
 struct netns_nftables {
 	u8			gencursor;
+	/* bumped once gencursor moved on, never 0, see nft_genid_bump() */
+	unsigned int		genid;
 };
 
 #endif
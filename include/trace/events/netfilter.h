@@ -0,0 +1,121 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM netfilter
+
+#if !defined(_TRACE_NETFILTER_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_NETFILTER_H
+
+#include <linux/netfilter.h>
+#include <linux/tracepoint.h>
+
+/* Per packet costs.  The timestamps are only taken while the event is
+ * enabled, histograms are built with hist triggers or BPF.
+ */
+
+TRACE_EVENT(nf_hook_entry,
+
+	TP_PROTO(const struct nf_hook_state *state, nf_hookfn *hook,
+		 unsigned int verdict, u64 ns),
+
+	TP_ARGS(state, hook, verdict, ns),
+
+	TP_STRUCT__entry(
+		__field(u8,		pf)
+		__field(u8,		hooknum)
+		__field(void *,		hook)
+		__field(unsigned int,	verdict)
+		__field(u64,		ns)
+	),
+
+	TP_fast_assign(
+		__entry->pf = state->pf;
+		__entry->hooknum = state->hook;
+		__entry->hook = hook;
+		__entry->verdict = verdict;
+		__entry->ns = ns;
+	),
+
+	TP_printk("pf=%u hooknum=%u hook=%ps verdict=0x%x ns=%llu",
+		  __entry->pf, __entry->hooknum, __entry->hook,
+		  __entry->verdict, __entry->ns)
+);
+
+TRACE_EVENT(nf_ct_lookup,
+
+	TP_PROTO(unsigned int bucket, unsigned int depth, bool found),
+
+	TP_ARGS(bucket, depth, found),
+
+	TP_STRUCT__entry(
+		__field(unsigned int,	bucket)
+		__field(unsigned int,	depth)
+		__field(bool,		found)
+	),
+
+	TP_fast_assign(
+		__entry->bucket = bucket;
+		__entry->depth = depth;
+		__entry->found = found;
+	),
+
+	TP_printk("bucket=%u depth=%u found=%d",
+		  __entry->bucket, __entry->depth, __entry->found)
+);
+
+TRACE_EVENT(nft_set_lookup,
+
+	TP_PROTO(const char *table, const char *set, bool found, u64 ns),
+
+	TP_ARGS(table, set, found, ns),
+
+	TP_STRUCT__entry(
+		__string(table,		table)
+		__string(set,		set)
+		__field(bool,		found)
+		__field(u64,		ns)
+	),
+
+	TP_fast_assign(
+		__assign_str(table);
+		__assign_str(set);
+		__entry->found = found;
+		__entry->ns = ns;
+	),
+
+	TP_printk("table=%s set=%s found=%d ns=%llu",
+		  __get_str(table), __get_str(set), __entry->found,
+		  __entry->ns)
+);
+
+TRACE_EVENT(nf_nat_unique_tuple,
+
+	TP_PROTO(u8 protonum, int maniptype, unsigned int range_size,
+		 unsigned int probes, bool found),
+
+	TP_ARGS(protonum, maniptype, range_size, probes, found),
+
+	TP_STRUCT__entry(
+		__field(u8,		protonum)
+		__field(int,		maniptype)
+		__field(unsigned int,	range_size)
+		__field(unsigned int,	probes)
+		__field(bool,		found)
+	),
+
+	TP_fast_assign(
+		__entry->protonum = protonum;
+		__entry->maniptype = maniptype;
+		__entry->range_size = range_size;
+		__entry->probes = probes;
+		__entry->found = found;
+	),
+
+	TP_printk("proto=%u %s range=%u probes=%u found=%d",
+		  __entry->protonum, __entry->maniptype ? "dst" : "src",
+		  __entry->range_size, __entry->probes, __entry->found)
+);
+
+#endif /* _TRACE_NETFILTER_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
@@ -411,6 +411,8 @@ enum {
 
 	IPVS_DEST_ATTR_TUN_FLAGS,	/* tunnel flags */
 
+	IPVS_DEST_ATTR_LOAD,		/* load score, fed by user space */
+
 	__IPVS_DEST_ATTR_MAX,
 };
 
@@ -431,6 +433,9 @@ enum {
 	IPVS_DAEMON_ATTR_MCAST_GROUP6,	/* IPv6 Multicast Address */
 	IPVS_DAEMON_ATTR_MCAST_PORT,	/* Multicast Port (base) */
 	IPVS_DAEMON_ATTR_MCAST_TTL,	/* Multicast TTL */
+	IPVS_DAEMON_ATTR_SYNC_TCP,	/* Sync over TCP to/from the group addr */
+	IPVS_DAEMON_ATTR_SYNC_PEER,	/* IPv4 address of the TCP master */
+	IPVS_DAEMON_ATTR_SYNC_PEER6,	/* IPv6 address of the TCP master */
 	__IPVS_DAEMON_ATTR_MAX,
 };
 
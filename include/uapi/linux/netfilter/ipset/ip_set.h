@@ -66,6 +66,7 @@ enum {
 	IPSET_ATTR_PROTOCOL_MIN, /* 10: Minimal supported version number */
 	IPSET_ATTR_REVISION_MIN	= IPSET_ATTR_PROTOCOL_MIN, /* type rev min */
 	IPSET_ATTR_INDEX,	/* 11: Kernel index of set */
+	IPSET_ATTR_SIZE_HINT,	/* 12: Expected number of elements to add */
 	__IPSET_ATTR_CMD_MAX,
 };
 #define IPSET_ATTR_CMD_MAX	(__IPSET_ATTR_CMD_MAX - 1)
@@ -205,6 +206,9 @@ enum ipset_cadt_flags {
 	IPSET_FLAG_WITH_SKBINFO = (1 << IPSET_FLAG_BIT_WITH_SKBINFO),
 	IPSET_FLAG_BIT_IFACE_WILDCARD = 7,
 	IPSET_FLAG_IFACE_WILDCARD = (1 << IPSET_FLAG_BIT_IFACE_WILDCARD),
+	IPSET_FLAG_BIT_WITH_PERCPU_COUNTERS = 8,
+	IPSET_FLAG_WITH_PERCPU_COUNTERS =
+		(1 << IPSET_FLAG_BIT_WITH_PERCPU_COUNTERS),
 	IPSET_FLAG_CADT_MAX	= 15,
 };
 
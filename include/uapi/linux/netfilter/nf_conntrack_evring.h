@@ -0,0 +1,42 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+#ifndef _UAPI_NF_CONNTRACK_EVRING_H
+#define _UAPI_NF_CONNTRACK_EVRING_H
+
+#include <linux/types.h>
+
+/* Records written to the per-cpu relay files in
+ * <debugfs>/nf_conntrack_events/ when the
+ * net.netfilter.nf_conntrack_events_ring sysctl is enabled.
+ *
+ * /proc/net/nf_conntrack_snapshot reads back the whole table of the
+ * network namespace in the same format, with events set to 0.
+ *
+ * Addresses and ports are in network byte order, IPv4 addresses use
+ * the first word only.  For ICMP, sport holds the id and dport the
+ * type and code, as in the conntrack tuple.
+ */
+struct nf_ct_evring_tuple {
+	__be32	src[4];
+	__be32	dst[4];
+	__be16	sport;
+	__be16	dport;
+};
+
+struct nf_ct_evring_record {
+	__u32	events;		/* (1 << IPCT_*) bitmask */
+	__u32	status;		/* IPS_* bits */
+	__u32	id;		/* as CTA_ID */
+	__u32	mark;
+	__u16	zone;
+	__u8	l3num;
+	__u8	l4num;
+	__u32	timeout;	/* remaining, in seconds */
+	__aligned_u64	timestamp;	/* event time, ns since the epoch */
+	__aligned_u64	start;		/* flow start/stop, 0 without */
+	__aligned_u64	stop;		/* conntrack timestamping */
+	__aligned_u64	packets[2];	/* original, reply; 0 without */
+	__aligned_u64	bytes[2];	/* conntrack accounting */
+	struct nf_ct_evring_tuple tuple[2];
+};
+
+#endif /* _UAPI_NF_CONNTRACK_EVRING_H */
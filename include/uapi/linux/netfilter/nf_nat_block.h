@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+#ifndef _UAPI_NF_NAT_BLOCK_H
+#define _UAPI_NF_NAT_BLOCK_H
+
+#include <linux/netfilter/nf_nat.h>
+#include <linux/netfilter/nf_tables.h>
+
+/* Port block allocation for source NAT.
+ *
+ * With NF_NAT_RANGE_PROTO_BLOCK, source ports are taken from blocks of
+ * NFTA_NAT_BLOCK_SIZE ports handed out per subscriber, the original
+ * source address.  A subscriber gets a block of a NAT address on its
+ * first connection and further ones when those are full.  Allocations
+ * and releases of blocks are reported as AUDIT_NETFILTER_NAT records.
+ */
+
+/* fixed value, next to NF_NAT_RANGE_NETMAP in the NF_NAT_RANGE_* flags */
+#define NF_NAT_RANGE_PROTO_BLOCK	(1 << 7)
+
+/* fixed value, next to NFTA_NAT_FLAGS in enum nft_nat_attributes:
+ * ports per block (NLA_U16), required with NF_NAT_RANGE_PROTO_BLOCK
+ */
+#define NFTA_NAT_BLOCK_SIZE		8
+
+#endif /* _UAPI_NF_NAT_BLOCK_H */
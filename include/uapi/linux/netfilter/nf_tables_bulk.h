@@ -0,0 +1,42 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+#ifndef _UAPI_NF_TABLES_BULK_H
+#define _UAPI_NF_TABLES_BULK_H
+
+#include <linux/types.h>
+#include <linux/netfilter/nf_tables.h>
+
+/* Bulk load of set elements from a file, e.g. a memfd.
+ *
+ * NFT_MSG_NEWSETELEM carries the file descriptor in NFTA_SET_ELEM_LIST_FD
+ * instead of NFTA_SET_ELEM_LIST_ELEMENTS.  The file holds a struct
+ * nft_set_bulk_hdr followed by count records, each made of the key (klen
+ * bytes) and, for maps, the data (dlen bytes), without any padding.  Keys
+ * and data are laid out as in NFTA_DATA_VALUE attributes.
+ *
+ * The elements are added as part of the batch: they show up at commit,
+ * with the usual notifications, and are gone if the batch is aborted.
+ * As for NFTA_SET_ELEM_LIST_ELEMENTS, keys already in the set fail the
+ * batch with NLM_F_EXCL only.
+ *
+ * With NFT_SET_BULK_F_REPLACE, the records replace the elements of the
+ * set, the catch-all one included, as a flush followed by the additions
+ * in the same batch would.  Sets updated from the packet path can't be
+ * replaced that way.
+ */
+#define NFTA_SET_ELEM_LIST_FD	5	/* NLA_U32 */
+
+#define NFT_SET_BULK_MAGIC	0x6e667462	/* "nftb" */
+
+enum nft_set_bulk_flags {
+	NFT_SET_BULK_F_REPLACE	= (1 << 0),
+};
+
+struct nft_set_bulk_hdr {
+	__u32	magic;
+	__u32	klen;			/* as the set */
+	__u32	dlen;			/* as the set, 0 for non-maps */
+	__u32	count;
+	__u32	flags;			/* NFT_SET_BULK_F_* */
+};
+
+#endif /* _UAPI_NF_TABLES_BULK_H */
@@ -0,0 +1,36 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+#ifndef _UAPI_NFNETLINK_CONNTRACK_UPDATE_H
+#define _UAPI_NFNETLINK_CONNTRACK_UPDATE_H
+
+#include <linux/netfilter/nfnetlink_conntrack.h>
+
+/* Updates all the entries matching a filter in a single pass over the
+ * table.  The filter is given by the same attributes as for flushing
+ * with IPCTNL_MSG_CT_DELETE: the family, CTA_ZONE, CTA_MARK and
+ * CTA_MARK_MASK, CTA_STATUS and CTA_STATUS_MASK, CTA_PROTOINFO, and
+ * CTA_FILTER with the tuples.  The changes are nested in CTA_UPDATE,
+ * which holds CTA_MARK and CTA_MARK_MASK, CTA_LABELS and CTA_LABELS_MASK
+ * with the same meaning as for IPCTNL_MSG_CT_NEW.  An event is sent for
+ * every entry that changed.
+ */
+
+/* fixed value, following IPCTNL_MSG_CT_GET_UNCONFIRMED in
+ * enum cntl_msg_types
+ */
+#define IPCTNL_MSG_CT_UPDATE	8
+
+/* fixed value, following CTA_TIMESTAMP_EVENT in enum ctattr_type */
+#define CTA_UPDATE		28
+
+/* Address masks for the tuples of CTA_FILTER, for prefix matching.  Nests
+ * like CTA_TUPLE_IP, with CTA_IP_V4_SRC/DST or CTA_IP_V6_SRC/DST holding
+ * the masks of the addresses selected by CTA_FILTER_ORIG_FLAGS and
+ * CTA_FILTER_REPLY_FLAGS.  Missing masks are all ones.  They apply to
+ * dumps, flushes and updates.
+ *
+ * Fixed values, following CTA_FILTER_REPLY_FLAGS in enum ctattr_filter.
+ */
+#define CTA_FILTER_ORIG_MASK	3
+#define CTA_FILTER_REPLY_MASK	4
+
+#endif /* _UAPI_NFNETLINK_CONNTRACK_UPDATE_H */
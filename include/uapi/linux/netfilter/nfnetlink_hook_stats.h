@@ -0,0 +1,15 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+#ifndef _UAPI_NFNL_HOOK_STATS_H
+#define _UAPI_NFNL_HOOK_STATS_H
+
+#include <linux/netfilter/nfnetlink_hook.h>
+
+/* Cost of a hook entry, dumped with it while the net.netfilter.nf_hook_stats
+ * sysctl is set.  Attributes following NFNLA_HOOK_CHAIN_INFO in
+ * enum nfnl_hook_attributes, with fixed values.
+ */
+#define NFNLA_HOOK_PACKETS	7	/* u64 */
+#define NFNLA_HOOK_CYCLES	8	/* u64 */
+#define NFNLA_HOOK_PAD		9
+
+#endif /* _UAPI_NFNL_HOOK_STATS_H */
@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+#ifndef _UAPI_NFNETLINK_LOG_RING_H
+#define _UAPI_NFNETLINK_LOG_RING_H
+
+#include <linux/types.h>
+
+/* Per-cpu relay buffers for NFLOG groups of the initial network namespace.
+ *
+ * Setting NFULNL_CFG_F_RING in NFULA_CFG_FLAGS writes the packets logged
+ * to the group as records into the relay files <debugfs>/nfnetlink_log/
+ * <group>/cpuN, which userspace can mmap() and poll(), instead of sending
+ * them over netlink.  Clearing the flag or unbinding the group removes the
+ * files, copy mode and copy range apply as usual.
+ *
+ * Records are record_size bytes, read from the file of that name: a struct
+ * nfulnl_ring_record followed by room for the copy range in effect when
+ * the flag was set, up to NFULNL_RING_PAYLOAD_MAX bytes.  Records that
+ * don't fit in the buffer are counted in the "dropped" file and in the
+ * lost field of the next record written on that cpu.  Fields are in host
+ * byte order.
+ */
+#define NFULNL_CFG_F_RING		0x0008
+
+struct nfulnl_ring_record {
+	__aligned_u64	timestamp;	/* ns since the epoch */
+	__u32	lost;		/* records dropped on this cpu before */
+	__u32	mark;
+	__u32	indev;		/* ifindex, 0 if none */
+	__u32	outdev;
+	__u32	pkt_len;
+	__u16	caplen;		/* payload bytes following the record */
+	__be16	hw_protocol;
+	__u16	group;
+	__u8	pf;
+	__u8	hook;
+	__u32	count;		/* packets logged, > 1 if aggregated */
+	char	prefix[32];	/* NUL padded, truncated */
+};
+
+/* payload bytes per record, at most */
+#define NFULNL_RING_PAYLOAD_MAX		1024
+
+#endif /* _UAPI_NFNETLINK_LOG_RING_H */
@@ -0,0 +1,29 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+#ifndef _UAPI_NFNETLINK_QUEUE_EXT_H
+#define _UAPI_NFNETLINK_QUEUE_EXT_H
+
+#include <linux/netfilter/nfnetlink_queue.h>
+
+/* With NFQA_CFG_F_GSO, only send the headers of GSO packets.  Verdicts
+ * apply to the whole packet, a payload of these packets rewrites the
+ * headers in place and must keep their layout: IP version, header and
+ * extension header lengths, protocol and TCP data offset.
+ *
+ * Fixed value, following NFQA_CFG_F_SECCTX in the NFQA_CFG_F_* flags.
+ */
+#define NFQA_CFG_F_GSO_HDR	0x20
+
+/* Verdict flags, NLA_U32.  Fixed value, following NFQA_CGROUP_CLASSID in
+ * enum nfqnl_attr_type.
+ */
+#define NFQA_VERDICT_FLAGS	23
+
+/* With NF_ACCEPT, the following packets of the connection skip this queue
+ * at the hook the packet was queued at, and carry on with the next rule.
+ * Other queues and hooks still see them.  A "flow add" rule behind the
+ * queue then moves the flow to the flowtable.  Bypasses end when a queue
+ * of the netns is destroyed.
+ */
+#define NFQA_VERDICT_F_FLOW_BYPASS	(1 << 0)
+
+#endif /* _UAPI_NFNETLINK_QUEUE_EXT_H */
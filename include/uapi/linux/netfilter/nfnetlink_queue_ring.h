@@ -0,0 +1,88 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+#ifndef _UAPI_NFNETLINK_QUEUE_RING_H
+#define _UAPI_NFNETLINK_QUEUE_RING_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/* Shared memory rings for NFQUEUE, through /dev/nfqueue.
+ *
+ * The queue is bound and configured over nfnetlink as usual, copy mode,
+ * copy range, maximum length and NFQA_CFG_F_FAIL_OPEN/NFQA_CFG_F_GSO
+ * apply.  NFQ_RING_SETUP then attaches a ring to the (empty) queue and
+ * packets are no longer sent over netlink while the device is open.
+ *
+ * The area mapped at offset 0 holds a struct nfq_ring_hdr, the receive
+ * ring of nr_frames struct nfq_ring_desc at rx_offset, the completion ring
+ * of nr_frames struct nfq_ring_verdict at cq_offset and nr_frames packet
+ * buffers of frame_size bytes at frames_offset.  Indexes are free running,
+ * slots are index & (nr_frames - 1).  Fields are in host byte order.
+ *
+ * The kernel copies the packet to a free frame, fills in a descriptor and
+ * bumps rx_producer.  Userspace consumes descriptors, bumping rx_consumer,
+ * and posts verdicts in the completion ring, bumping cq_producer.  The
+ * frame belongs to userspace until its verdict is consumed, it may be
+ * rewritten to mangle the packet.  Verdicts are picked up when further
+ * packets are queued, on poll() and on NFQ_RING_KICK.
+ */
+struct nfq_ring_hdr {
+	__u32	rx_producer;
+	__u32	__pad0[15];
+	__u32	rx_consumer;
+	__u32	__pad1[15];
+	__u32	cq_producer;
+	__u32	__pad2[15];
+	__u32	cq_consumer;
+	__u32	__pad3[15];
+};
+
+struct nfq_ring_desc {
+	__u32	id;
+	__u32	frame;		/* buffer index, also id & (nr_frames - 1) */
+	__u32	len;		/* bytes in the frame */
+	__u32	pkt_len;	/* packet length, len may be shorter */
+	__u32	mark;
+	__u32	priority;
+	__u32	indev;		/* ifindex, 0 if none */
+	__u32	outdev;
+	__be16	hw_protocol;
+	__u8	pf;
+	__u8	hook;
+	__u32	__pad;
+};
+
+enum nfq_ring_verdict_flags {
+	NFQ_RING_VF_MARK	= (1 << 0),	/* set skb mark */
+	NFQ_RING_VF_PAYLOAD	= (1 << 1),	/* replace packet by frame */
+	NFQ_RING_VF_FLOW_BYPASS	= (1 << 2),	/* stop queueing the flow */
+};
+
+struct nfq_ring_verdict {
+	__u32	id;
+	__u32	verdict;	/* as in nfqnl_msg_verdict_hdr */
+	__u32	flags;		/* NFQ_RING_VF_* */
+	__u32	mark;
+	__u32	len;		/* with NFQ_RING_VF_PAYLOAD */
+	__u32	__pad;
+};
+
+struct nfq_ring_setup {
+	__u16	queue_num;
+	__u16	__pad;
+	__u32	nr_frames;	/* power of two */
+	__u32	frame_size;	/* power of two, 2048 to 65536 */
+	/* filled in by the kernel */
+	__u32	mmap_size;
+	__u32	rx_offset;
+	__u32	cq_offset;
+	__u32	frames_offset;
+};
+
+#define NFQ_RING_MAX_FRAMES		65536
+#define NFQ_RING_MIN_FRAME_SIZE		2048
+#define NFQ_RING_MAX_FRAME_SIZE		65536
+
+#define NFQ_RING_SETUP	_IOWR(0xf6, 1, struct nfq_ring_setup)
+#define NFQ_RING_KICK	_IO(0xf6, 2)
+
+#endif /* _UAPI_NFNETLINK_QUEUE_RING_H */
@@ -0,0 +1,34 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+#ifndef _UAPI_NFT_BPF_H
+#define _UAPI_NFT_BPF_H
+
+#include <linux/netfilter/nf_tables.h>
+
+/* BPF expression.
+ *
+ * The "bpf" expression runs a BPF_PROG_TYPE_NETFILTER program and
+ * breaks if it returns NF_DROP.  From the expression, the program can
+ * get at the packet information with the bpf_nft_pktinfo() kfunc, and
+ * at the data registers with bpf_nft_regs(), which returns them as an
+ * array of u32 starting with NFT_REG32_00, NFT_REG_1 being its first
+ * four words.  Both return NULL when the program runs from a hook
+ * attached through a BPF link.
+ */
+
+/**
+ * enum nft_bpf_attributes - nf_tables bpf expression netlink attributes
+ *
+ * @NFTA_BPF_FD: file descriptor of the program to run (NLA_U32)
+ * @NFTA_BPF_ID: id of the program, on dumps (NLA_U32)
+ * @NFTA_BPF_TAG: tag of the program, on dumps (NLA_BINARY)
+ */
+enum nft_bpf_attributes {
+	NFTA_BPF_UNSPEC,
+	NFTA_BPF_FD,
+	NFTA_BPF_ID,
+	NFTA_BPF_TAG,
+	__NFTA_BPF_MAX
+};
+#define NFTA_BPF_MAX		(__NFTA_BPF_MAX - 1)
+
+#endif /* _UAPI_NFT_BPF_H */
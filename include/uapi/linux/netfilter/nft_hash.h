@@ -0,0 +1,31 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+#ifndef _UAPI_NFT_HASH_H
+#define _UAPI_NFT_HASH_H
+
+#include <linux/netfilter/nf_tables.h>
+
+/* Toeplitz hash of the register range, as computed by NICs for RSS, with
+ * NFTA_HASH_KEY or the key of netdev_rss_key_fill() that most drivers
+ * program.  With NFT_HASH_F_SKB, the hash the NIC already stored into
+ * the skb is used instead, if any.
+ */
+/* enum nft_hash_types, fixed value */
+#define NFT_HASH_TOEPLITZ	2
+
+/* Attributes of the hash expression following NFTA_HASH_SET_ID in
+ * enum nft_hash_attributes, with fixed values.
+ */
+
+/* Toeplitz key, NLA_BINARY */
+#define NFTA_HASH_KEY		10
+/* NFT_HASH_F_*, NLA_U32 */
+#define NFTA_HASH_FLAGS		11
+
+#define NFT_HASH_F_SKB		(1 << 0)
+/* Map the hash to the modulus with a consistent hash, so that growing
+ * the modulus by one only changes the result for 1/modulus of the
+ * inputs, e.g. to spread flows over cluster nodes.
+ */
+#define NFT_HASH_F_CONSISTENT	(1 << 1)
+
+#endif /* _UAPI_NFT_HASH_H */
@@ -0,0 +1,16 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+#ifndef _UAPI_NFT_LAST_H
+#define _UAPI_NFT_LAST_H
+
+#include <linux/netfilter/nf_tables.h>
+
+/* Attributes of the last expression following NFTA_LAST_PAD in
+ * enum nft_last_attributes, with fixed values.
+ */
+
+/* Only rewrite the stamp once it is older than this many ms, 0 for one
+ * jiffy, NLA_U32.
+ */
+#define NFTA_LAST_RESOLUTION	4
+
+#endif /* _UAPI_NFT_LAST_H */
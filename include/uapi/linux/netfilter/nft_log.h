@@ -0,0 +1,26 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+#ifndef _UAPI_NFT_LOG_H
+#define _UAPI_NFT_LOG_H
+
+#include <linux/netfilter/nf_tables.h>
+
+/* Attributes of the log expression following NFTA_LOG_FLAGS in
+ * enum nft_log_attributes, with fixed values.
+ */
+
+/* Log 1 in N packets, at random, NLA_U32 */
+#define NFTA_LOG_SAMPLE		7
+/* Log a single record per interval in ms and cpu, carrying the number of
+ * packets seen since the previous one.  The record is emitted with the
+ * first packet after the interval.  Group logging only, NLA_U32.
+ */
+#define NFTA_LOG_INTERVAL	8
+/* NFT_LOG_F_*, NLA_U32 */
+#define NFTA_LOG_FILTER		9
+
+/* Only log the first packet of a connection, the one that creates the
+ * conntrack entry.  Untracked packets are logged.
+ */
+#define NFT_LOG_F_FLOW_FIRST	(1 << 0)
+
+#endif /* _UAPI_NFT_LOG_H */
@@ -0,0 +1,20 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+#ifndef _UAPI_NFT_LOOKUP_H
+#define _UAPI_NFT_LOOKUP_H
+
+#include <linux/netfilter/nf_tables.h>
+
+/* Verdict map lookups only: the verdict is kept in the conntrack entry of
+ * the packet, and later packets of the same connection in the same
+ * direction get it without looking the key up, until the next commit.
+ * There is one slot per direction, owned by the first lookup filling it
+ * in a generation.
+ * The key must be the same for all packets of a connection in a given
+ * direction.  Maps with timeouts or updated from the packet path, and
+ * elements with stateful expressions, are not cached.
+ */
+
+/* enum nft_lookup_flags, fixed value: NFT_LOOKUP_F_INV is bit 0 */
+#define NFT_LOOKUP_F_CT_CACHE	(1 << 16)
+
+#endif /* _UAPI_NFT_LOOKUP_H */
@@ -0,0 +1,62 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+#ifndef _UAPI_NFT_METER_H
+#define _UAPI_NFT_METER_H
+
+#include <linux/netfilter/nf_tables.h>
+
+/* Keyed rate limiter.
+ *
+ * A meter object holds one token bucket per key, with the parameters of
+ * a limit (NFTA_METER_RATE, _UNIT, _BURST, _TYPE as NFTA_LIMIT_*) shared
+ * by all of them.  At most NFTA_METER_SIZE keys are tracked, the least
+ * recently used are evicted to make room for new ones.
+ *
+ * The "meter" expression looks the key up in NFTA_METER_EXPR_SREG and
+ * breaks when the bucket of that key is out of tokens, or, with
+ * NFT_LIMIT_F_INV, when it is not.  Referenced through objref, without a
+ * key, all packets share one bucket.
+ */
+
+/* outside of the range of enum nft_object_types */
+#define NFT_OBJECT_METER	64
+
+/**
+ * enum nft_meter_attributes - nf_tables meter object netlink attributes
+ *
+ * @NFTA_METER_RATE: refill rate (NLA_U64)
+ * @NFTA_METER_UNIT: refill unit, in seconds (NLA_U64)
+ * @NFTA_METER_BURST: burst (NLA_U32)
+ * @NFTA_METER_TYPE: type of limit (NLA_U32: enum nft_limit_type)
+ * @NFTA_METER_FLAGS: flags (NLA_U32: NFT_LIMIT_F_INV)
+ * @NFTA_METER_SIZE: maximum number of keys (NLA_U32)
+ * @NFTA_METER_KLEN: key length (NLA_U32)
+ */
+enum nft_meter_attributes {
+	NFTA_METER_UNSPEC,
+	NFTA_METER_RATE,
+	NFTA_METER_UNIT,
+	NFTA_METER_BURST,
+	NFTA_METER_TYPE,
+	NFTA_METER_FLAGS,
+	NFTA_METER_SIZE,
+	NFTA_METER_KLEN,
+	NFTA_METER_PAD,
+	__NFTA_METER_MAX
+};
+#define NFTA_METER_MAX		(__NFTA_METER_MAX - 1)
+
+/**
+ * enum nft_meter_expr_attributes - nf_tables meter expression netlink attributes
+ *
+ * @NFTA_METER_EXPR_NAME: name of the meter object (NLA_STRING)
+ * @NFTA_METER_EXPR_SREG: source register of the key (NLA_U32: nft_registers)
+ */
+enum nft_meter_expr_attributes {
+	NFTA_METER_EXPR_UNSPEC,
+	NFTA_METER_EXPR_NAME,
+	NFTA_METER_EXPR_SREG,
+	__NFTA_METER_EXPR_MAX
+};
+#define NFTA_METER_EXPR_MAX	(__NFTA_METER_EXPR_MAX - 1)
+
+#endif /* _UAPI_NFT_METER_H */
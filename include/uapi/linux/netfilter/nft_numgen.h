@@ -0,0 +1,19 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+#ifndef _UAPI_NFT_NUMGEN_H
+#define _UAPI_NFT_NUMGEN_H
+
+#include <linux/netfilter/nf_tables.h>
+
+/* Per-CPU round robin.
+ *
+ * Like NFT_NG_INCREMENTAL, but each CPU walks the NFTA_NG_MODULUS values
+ * on its own, starting at a different one, so that CPUs don't share a
+ * counter.  Each CPU hands out every value in turn, the values are evenly
+ * used overall, but two packets in a row don't get consecutive values
+ * unless they are handled by the same CPU.
+ */
+
+/* outside of the range of enum nft_ng_types */
+#define NFT_NG_INCREMENTAL_PERCPU	64
+
+#endif /* _UAPI_NFT_NUMGEN_H */
@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+#ifndef _UAPI_NFT_STRING_H
+#define _UAPI_NFT_STRING_H
+
+#include <linux/netfilter/nf_tables.h>
+
+/* Multi-pattern payload search.
+ *
+ * The "string" expression looks for any of the patterns of
+ * NFTA_STRING_PATTERNS, or among the keys of the constant set
+ * NFTA_STRING_SET, in a single pass over the packet, from offset
+ * NFTA_STRING_FROM up to offset NFTA_STRING_TO, both relative to the
+ * network header, and breaks if none is found.  With
+ * NFTA_STRING_DREG, the index in the list of the pattern that matched
+ * is stored in that register, as a u32.  For a map with u32 values, the
+ * value of the element that matched is stored instead.  Trailing zero
+ * bytes of set keys are not part of the patterns.
+ */
+
+#define NFT_STRING_MAX_PATTERNS		1024
+#define NFT_STRING_MAX_PATTERN_LEN	255
+
+/**
+ * enum nft_string_flags - nf_tables string expression flags
+ *
+ * @NFT_STRING_F_ICASE: ignore case of ASCII letters
+ */
+enum nft_string_flags {
+	NFT_STRING_F_ICASE	= (1 << 0),
+};
+
+/**
+ * enum nft_string_attributes - nf_tables string expression netlink attributes
+ *
+ * @NFTA_STRING_PATTERNS: patterns to look for (NLA_NESTED: NFTA_STRING_PATTERN)
+ * @NFTA_STRING_FROM: offset to start searching at (NLA_U32)
+ * @NFTA_STRING_TO: offset to stop searching at (NLA_U32)
+ * @NFTA_STRING_FLAGS: flags (NLA_U32: enum nft_string_flags)
+ * @NFTA_STRING_DREG: destination register of the pattern index (NLA_U32: nft_registers)
+ * @NFTA_STRING_SET: name of the set of patterns (NLA_STRING)
+ * @NFTA_STRING_SET_ID: uniquely identifies a set in a transaction (NLA_U32)
+ */
+enum nft_string_attributes {
+	NFTA_STRING_UNSPEC,
+	NFTA_STRING_PATTERNS,
+	NFTA_STRING_FROM,
+	NFTA_STRING_TO,
+	NFTA_STRING_FLAGS,
+	NFTA_STRING_DREG,
+	NFTA_STRING_SET,
+	NFTA_STRING_SET_ID,
+	__NFTA_STRING_MAX
+};
+#define NFTA_STRING_MAX		(__NFTA_STRING_MAX - 1)
+
+/**
+ * enum nft_string_pattern_attributes - nf_tables string pattern netlink attributes
+ *
+ * @NFTA_STRING_PATTERN: pattern (NLA_BINARY, 1 to NFT_STRING_MAX_PATTERN_LEN bytes)
+ */
+enum nft_string_pattern_attributes {
+	NFTA_STRING_PATTERN_UNSPEC,
+	NFTA_STRING_PATTERN,
+	__NFTA_STRING_PATTERN_MAX
+};
+#define NFTA_STRING_PATTERN_MAX	(__NFTA_STRING_PATTERN_MAX - 1)
+
+#endif /* _UAPI_NFT_STRING_H */
@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+#ifndef _UAPI_NFT_XLAT_H
+#define _UAPI_NFT_XLAT_H
+
+/* Stateless IPv4/IPv6 translation.
+ *
+ * The "xlat" expression translates IPv4 packets to IPv6 and back, with
+ * both addresses embedded in NFTA_XLAT_PREFIX, the /96 prefix 64:ff9b::
+ * if not given.  Translated packets are received again in the other
+ * family, the ones that can't be translated continue as usual.
+ */
+
+/**
+ * enum nft_xlat_attributes - nf_tables xlat expression netlink attributes
+ *
+ * @NFTA_XLAT_PREFIX: /96 prefix (NLA_BINARY: struct in6_addr)
+ */
+enum nft_xlat_attributes {
+	NFTA_XLAT_UNSPEC,
+	NFTA_XLAT_PREFIX,
+	__NFTA_XLAT_MAX
+};
+#define NFTA_XLAT_MAX		(__NFTA_XLAT_MAX - 1)
+
+#endif /* _UAPI_NFT_XLAT_H */
@@ -13880,6 +13880,16 @@ static int check_kfunc_call(struct bpf_verifier_env *env, struct bpf_insn *insn,
 					regs[BPF_REG_0].type |= MEM_RCU;
 				else
 					regs[BPF_REG_0].type |= PTR_TRUSTED;
+			} else if (is_kfunc_rcu_protected(&meta)) {
+				/* not referenced, only valid until the end of
+				 * the RCU read section
+				 */
+				if (!in_rcu_cs(env)) {
+					verbose(env, "kernel func %s requires RCU critical section protection\n",
+						func_name);
+					return -EACCES;
+				}
+				regs[BPF_REG_0].type |= MEM_RCU;
 			}
 		}
 
@@ -0,0 +1,277 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * lib/ts_ac.c		Aho-Corasick multi-pattern text search implementation
+ *
+ * ==========================================================================
+ *
+ *   Looks for any pattern of a set in a single pass over the text [1].
+ *   The patterns are stored in a trie; when the text can't be followed
+ *   further down the trie, the search continues from the state of the
+ *   longest proper suffix of the text read so far that is still a
+ *   prefix of some pattern, its failure link.  Instead of following
+ *   failure links at search time, they are folded into a complete
+ *   transition table DELTA at init time, so that find() costs a single
+ *   table lookup per byte of text whatever the number of patterns.
+ *
+ *   To keep DELTA small, it is indexed by byte class rather than by
+ *   byte: every byte found in a pattern has a class of its own, all
+ *   the others share class 0.  With TS_IGNORECASE, a lower case letter
+ *   shares the class of its upper case.
+ *
+ *   The pattern handed to textsearch_prepare() is a set of patterns: a
+ *   sequence of records made of one byte with the length of a pattern,
+ *   at least 1, followed by the pattern itself.  find() reports the
+ *   match that ends first, the index of its record is stored in
+ *   ts_state->id.  If several patterns end at the same offset, the
+ *   longest one is reported, the first of the set if identical.  The
+ *   search goes on after the end of the previous match.
+ *
+ *   [1] A. V. Aho, M. J. Corasick
+ *       Efficient string matching: an aid to bibliographic search,
+ *       Communications of the ACM, 18(6), 1975
+ */
+
+#include <linux/module.h>
+#include <linux/types.h>
+#include <linux/string.h>
+#include <linux/ctype.h>
+#include <linux/mm.h>
+#include <linux/textsearch.h>
+
+/* no pattern ends in this state */
+#define AC_NONE			U16_MAX
+/* states are u16, the root being one of them */
+#define AC_MAX_SET_LEN		TS_AC_MAX_SET_LEN
+/* bound on the size of DELTA, 16 MiB */
+#define AC_MAX_TRANSITIONS	(1U << 23)
+
+struct ts_ac
+{
+	u16 *		delta;
+	u16 *		match;
+	u8 *		pattern_len;
+	u8 *		set;
+	unsigned int	set_len;
+	unsigned int	nclasses;
+	u16		class[256];
+};
+
+static unsigned int ac_find(struct ts_config *conf, struct ts_state *state)
+{
+	struct ts_ac *ac = ts_config_priv(conf);
+	unsigned int i, q = 0, text_len, consumed = state->offset;
+	const u8 *text;
+	u16 id;
+
+	for (;;) {
+		text_len = conf->get_next_block(consumed, &text, conf, state);
+
+		if (unlikely(text_len == 0))
+			break;
+
+		for (i = 0; i < text_len; i++) {
+			q = ac->delta[q * ac->nclasses + ac->class[text[i]]];
+			id = ac->match[q];
+			if (unlikely(id != AC_NONE)) {
+				state->offset = consumed + i + 1;
+				state->id = id;
+				return state->offset - ac->pattern_len[id];
+			}
+		}
+
+		consumed += text_len;
+	}
+
+	return UINT_MAX;
+}
+
+static int ac_build(struct ts_ac *ac, unsigned int nstates, gfp_t gfp_mask)
+{
+	unsigned int nclasses = ac->nclasses;
+	unsigned int i, j, c, id, next = 1;
+	unsigned int head = 0, tail = 0;
+	u16 *fail, *queue, *t, q, f;
+	const u8 *set = ac->set;
+
+	fail = kvmalloc_array(2 * nstates, sizeof(u16), gfp_mask);
+	if (!fail)
+		return -ENOMEM;
+	queue = fail + nstates;
+
+	/* Trie of all patterns, 0 is both the root and "no edge" */
+	for (i = 0, id = 0; i < ac->set_len; i += 1 + set[i], id++) {
+		ac->pattern_len[id] = set[i];
+
+		for (j = 1, q = 0; j <= set[i]; j++) {
+			t = &ac->delta[q * nclasses + ac->class[set[i + j]]];
+			if (!*t)
+				*t = next++;
+			q = *t;
+		}
+
+		if (ac->match[q] == AC_NONE)
+			ac->match[q] = id;
+	}
+
+	/* Children of the root fail back to it, its missing edges loop */
+	for (c = 0; c < nclasses; c++) {
+		q = ac->delta[c];
+		if (q) {
+			fail[q] = 0;
+			queue[tail++] = q;
+		}
+	}
+
+	/* Breadth first, so that the state a failure link points to, being
+	 * less deep, is complete by the time it is needed.
+	 */
+	while (head < tail) {
+		q = queue[head++];
+
+		for (c = 0; c < nclasses; c++) {
+			t = &ac->delta[q * nclasses + c];
+			f = ac->delta[fail[q] * nclasses + c];
+
+			if (!*t) {
+				*t = f;
+				continue;
+			}
+
+			fail[*t] = f;
+			if (ac->match[*t] == AC_NONE)
+				ac->match[*t] = ac->match[f];
+			queue[tail++] = *t;
+		}
+	}
+
+	kvfree(fail);
+	return 0;
+}
+
+static struct ts_config *ac_init(const void *pattern, unsigned int len,
+				 gfp_t gfp_mask, int flags)
+{
+	unsigned int i, j, c, npatterns = 0, nstates;
+	const u8 *set = pattern;
+	struct ts_config *conf;
+	struct ts_ac *ac;
+	size_t priv_size;
+	int err;
+
+	if (len == 0 || len > AC_MAX_SET_LEN)
+		return ERR_PTR(-EINVAL);
+
+	for (i = 0; i < len; i += 1 + set[i]) {
+		if (set[i] == 0 || set[i] >= len - i)
+			return ERR_PTR(-EINVAL);
+		npatterns++;
+	}
+
+	priv_size = sizeof(*ac) + len + npatterns;
+	conf = alloc_ts_config(priv_size, gfp_mask);
+	if (IS_ERR(conf))
+		return conf;
+
+	conf->flags = flags;
+	ac = ts_config_priv(conf);
+	ac->set = (u8 *) (ac + 1);
+	ac->set_len = len;
+	ac->pattern_len = ac->set + len;
+	memcpy(ac->set, pattern, len);
+
+	for (i = 0; i < len; i += 1 + set[i]) {
+		for (j = 1; j <= set[i]; j++) {
+			c = set[i + j];
+			if (flags & TS_IGNORECASE)
+				c = toupper(c);
+			ac->class[c] = 1;
+		}
+	}
+
+	ac->nclasses = 1;
+	for (c = 0; c < 256; c++)
+		if (ac->class[c])
+			ac->class[c] = ac->nclasses++;
+	if (flags & TS_IGNORECASE)
+		for (c = 0; c < 256; c++)
+			ac->class[c] = ac->class[toupper(c)];
+
+	/* one state per pattern byte at most, plus the root */
+	nstates = len - npatterns + 1;
+	err = -EINVAL;
+	if (nstates * ac->nclasses > AC_MAX_TRANSITIONS)
+		goto err;
+
+	err = -ENOMEM;
+	ac->delta = kvcalloc(nstates * ac->nclasses, sizeof(u16), gfp_mask);
+	ac->match = kvmalloc_array(nstates, sizeof(u16), gfp_mask);
+	if (!ac->delta || !ac->match)
+		goto err;
+	memset(ac->match, 0xff, nstates * sizeof(u16));
+
+	err = ac_build(ac, nstates, gfp_mask);
+	if (err < 0)
+		goto err;
+
+	return conf;
+err:
+	kvfree(ac->match);
+	kvfree(ac->delta);
+	kfree(conf);
+	return ERR_PTR(err);
+}
+
+static void ac_destroy(struct ts_config *conf)
+{
+	struct ts_ac *ac = ts_config_priv(conf);
+
+	kvfree(ac->match);
+	kvfree(ac->delta);
+}
+
+static void *ac_get_pattern(struct ts_config *conf)
+{
+	struct ts_ac *ac = ts_config_priv(conf);
+	return ac->set;
+}
+
+static unsigned int ac_get_pattern_len(struct ts_config *conf)
+{
+	struct ts_ac *ac = ts_config_priv(conf);
+	return ac->set_len;
+}
+
+static unsigned int ac_get_match_len(struct ts_config *conf,
+				     struct ts_state *state)
+{
+	struct ts_ac *ac = ts_config_priv(conf);
+	return ac->pattern_len[state->id];
+}
+
+static struct ts_ops ac_ops = {
+	.name		  = "ac",
+	.find		  = ac_find,
+	.init		  = ac_init,
+	.destroy	  = ac_destroy,
+	.get_pattern	  = ac_get_pattern,
+	.get_pattern_len  = ac_get_pattern_len,
+	.get_match_len	  = ac_get_match_len,
+	.owner		  = THIS_MODULE,
+	.list		  = LIST_HEAD_INIT(ac_ops.list)
+};
+
+static int __init init_ac(void)
+{
+	return textsearch_register(&ac_ops);
+}
+
+static void __exit exit_ac(void)
+{
+	textsearch_unregister(&ac_ops);
+}
+
+MODULE_DESCRIPTION("Aho-Corasick multi-pattern text search implementation");
+MODULE_LICENSE("GPL");
+
+module_init(init_ac);
+module_exit(exit_ac);
@@ -11,11 +11,62 @@
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 #include <linux/ip.h>
 #include <linux/if_arp.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
 #include <linux/module.h>
+#include <linux/random.h>
+#include <linux/rhashtable.h>
 #include <linux/netfilter/x_tables.h>
 #include <linux/netfilter_bridge/ebtables.h>
 #include <linux/netfilter_bridge/ebt_among.h>
 
+/* The wormhash has 256 buckets, lists of this size and more are also
+ * hashed on the whole address.  The layout userspace passed in is kept
+ * as is, it is what the rule dumps.
+ */
+#define EBT_AMONG_HASH_MIN	256
+
+struct ebt_among_hash {
+	struct rhash_head		node;
+	const struct ebt_mac_wormhash	*wh;	/* key */
+	struct rcu_head			rcu;
+	u32				mask;
+	int				*next;	/* pool index, -1 ends */
+	int				heads[];
+};
+
+static const struct rhashtable_params ebt_among_hash_params = {
+	.head_offset		= offsetof(struct ebt_among_hash, node),
+	.key_offset		= offsetof(struct ebt_among_hash, wh),
+	.key_len		= sizeof(const struct ebt_mac_wormhash *),
+	.automatic_shrinking	= true,
+};
+
+static struct rhashtable ebt_among_hashes;
+static u32 ebt_among_hash_seed __read_mostly;
+
+static u32 ebt_among_hash_key(const u32 *cmp)
+{
+	return jhash_2words(cmp[0], cmp[1], ebt_among_hash_seed);
+}
+
+static bool ebt_among_hash_contains(const struct ebt_among_hash *hash,
+				    const struct ebt_mac_wormhash *wh,
+				    const u32 *cmp, __be32 ip)
+{
+	const struct ebt_mac_wormhash_tuple *p;
+	int i;
+
+	i = hash->heads[ebt_among_hash_key(cmp) & hash->mask];
+	for (; i >= 0; i = hash->next[i]) {
+		p = &wh->pool[i];
+		if (cmp[1] == p->cmp[1] && cmp[0] == p->cmp[0] &&
+		    (p->ip == 0 || p->ip == ip))
+			return true;
+	}
+	return false;
+}
+
 static bool ebt_mac_wormhash_contains(const struct ebt_mac_wormhash *wh,
 				      const char *mac, __be32 ip)
 {
@@ -30,6 +81,21 @@ static bool ebt_mac_wormhash_contains(const struct ebt_mac_wormhash *wh,
 	int key = ((const unsigned char *)mac)[5];
 
 	ether_addr_copy(((char *) cmp) + 2, mac);
+
+	if (wh->poolsize >= EBT_AMONG_HASH_MIN) {
+		const struct ebt_among_hash *hash;
+		bool ret = false;
+
+		rcu_read_lock();
+		hash = rhashtable_lookup(&ebt_among_hashes, &wh,
+					 ebt_among_hash_params);
+		if (hash)
+			ret = ebt_among_hash_contains(hash, wh, cmp, ip);
+		rcu_read_unlock();
+		if (hash)
+			return ret;
+	}
+
 	start = wh->table[key];
 	limit = wh->table[key + 1];
 	if (ip) {
@@ -68,6 +134,63 @@ static int ebt_mac_wormhash_check_integrity(const struct ebt_mac_wormhash
 	return 0;
 }
 
+static int ebt_among_hash_create(const struct ebt_mac_wormhash *wh)
+{
+	struct ebt_among_hash *hash;
+	unsigned int size, h;
+	int i, err;
+
+	if (!wh || wh->poolsize < EBT_AMONG_HASH_MIN)
+		return 0;
+
+	size = roundup_pow_of_two(wh->poolsize);
+	hash = kvmalloc(struct_size(hash, heads, size + wh->poolsize),
+			GFP_KERNEL_ACCOUNT);
+	if (!hash)
+		return -ENOMEM;
+
+	hash->wh = wh;
+	hash->mask = size - 1;
+	hash->next = hash->heads + size;
+	for (h = 0; h < size; h++)
+		hash->heads[h] = -1;
+
+	for (i = wh->poolsize - 1; i >= 0; i--) {
+		h = ebt_among_hash_key(wh->pool[i].cmp) & hash->mask;
+		hash->next[i] = hash->heads[h];
+		hash->heads[h] = i;
+	}
+
+	err = rhashtable_insert_fast(&ebt_among_hashes, &hash->node,
+				     ebt_among_hash_params);
+	if (err)
+		kvfree(hash);
+
+	return err;
+}
+
+static void ebt_among_hash_free_rcu(struct rcu_head *head)
+{
+	kvfree(container_of(head, struct ebt_among_hash, rcu));
+}
+
+static void ebt_among_hash_destroy(const struct ebt_mac_wormhash *wh)
+{
+	struct ebt_among_hash *hash;
+
+	if (!wh || wh->poolsize < EBT_AMONG_HASH_MIN)
+		return;
+
+	hash = rhashtable_lookup_fast(&ebt_among_hashes, &wh,
+				      ebt_among_hash_params);
+	if (!hash)
+		return;
+
+	rhashtable_remove_fast(&ebt_among_hashes, &hash->node,
+			       ebt_among_hash_params);
+	call_rcu(&hash->rcu, ebt_among_hash_free_rcu);
+}
+
 static int get_ip_dst(const struct sk_buff *skb, __be32 *addr)
 {
 	if (eth_hdr(skb)->h_proto == htons(ETH_P_IP)) {
@@ -252,27 +375,60 @@ static int ebt_among_mt_check(const struct xt_mtchk_param *par)
 		pr_err_ratelimited("src integrity fail: %x\n", -err);
 		return -EINVAL;
 	}
+
+	err = ebt_among_hash_create(wh_dst);
+	if (err)
+		return err;
+
+	err = ebt_among_hash_create(wh_src);
+	if (err) {
+		ebt_among_hash_destroy(wh_dst);
+		return err;
+	}
 	return 0;
 }
 
+static void ebt_among_mt_destroy(const struct xt_mtdtor_param *par)
+{
+	const struct ebt_among_info *info = par->matchinfo;
+
+	ebt_among_hash_destroy(ebt_among_wh_dst(info));
+	ebt_among_hash_destroy(ebt_among_wh_src(info));
+}
+
 static struct xt_match ebt_among_mt_reg __read_mostly = {
 	.name		= "among",
 	.revision	= 0,
 	.family		= NFPROTO_BRIDGE,
 	.match		= ebt_among_mt,
 	.checkentry	= ebt_among_mt_check,
+	.destroy	= ebt_among_mt_destroy,
 	.matchsize	= -1, /* special case */
 	.me		= THIS_MODULE,
 };
 
 static int __init ebt_among_init(void)
 {
-	return xt_register_match(&ebt_among_mt_reg);
+	int err;
+
+	ebt_among_hash_seed = get_random_u32();
+
+	err = rhashtable_init(&ebt_among_hashes, &ebt_among_hash_params);
+	if (err)
+		return err;
+
+	err = xt_register_match(&ebt_among_mt_reg);
+	if (err)
+		rhashtable_destroy(&ebt_among_hashes);
+
+	return err;
 }
 
 static void __exit ebt_among_fini(void)
 {
 	xt_unregister_match(&ebt_among_mt_reg);
+	rcu_barrier();
+	rhashtable_destroy(&ebt_among_hashes);
 }
 
 module_init(ebt_among_init);
@@ -126,6 +126,18 @@ ebt_dev_check(const char *entry, const struct net_device *device)
 	return devname[i] != entry[i] && entry[i] != 1;
 }
 
+/* returns the interface check the entry fails, EBT_SKIP_MAX if none */
+static inline int
+ebt_dev_match(const struct ebt_entry *e, const struct net_device *in,
+	      const struct net_device *out)
+{
+	if (NF_INVF(e, EBT_IIN, ebt_dev_check(e->in, in)))
+		return EBT_SKIP_IN;
+	if (NF_INVF(e, EBT_IOUT, ebt_dev_check(e->out, out)))
+		return EBT_SKIP_OUT;
+	return EBT_SKIP_MAX;
+}
+
 /* process standard matches */
 static inline int
 ebt_basic_match(const struct ebt_entry *e, const struct sk_buff *skb,
@@ -147,10 +159,7 @@ ebt_basic_match(const struct ebt_entry *e, const struct sk_buff *skb,
 		   NF_INVF(e, EBT_IPROTO, e->ethproto != ethproto))
 		return 1;
 
-	if (NF_INVF(e, EBT_IIN, ebt_dev_check(e->in, in)))
-		return 1;
-	if (NF_INVF(e, EBT_IOUT, ebt_dev_check(e->out, out)))
-		return 1;
+	/* in and out were checked by ebt_dev_match() already */
 	/* rcu_read_lock()ed by nf_hook_thresh */
 	if (in && (p = br_port_get_rcu(in)) != NULL &&
 	    NF_INVF(e, EBT_ILOGICALIN,
@@ -198,11 +207,12 @@ unsigned int ebt_do_table(void *priv, struct sk_buff *skb,
 	struct ebt_entry *point;
 	struct ebt_counter *counter_base, *cb_base;
 	const struct ebt_entry_target *t;
-	int verdict, sp = 0;
+	int verdict, sp = 0, dev;
 	struct ebt_chainstack *cs;
 	struct ebt_entries *chaininfo;
 	const char *base;
 	const struct ebt_table_info *private;
+	const struct ebt_skip_step *step;
 	struct xt_action_param acpar;
 
 	acpar.state   = state;
@@ -224,6 +234,10 @@ unsigned int ebt_do_table(void *priv, struct sk_buff *skb,
 	base = private->entries;
 	i = 0;
 	while (i < nentries) {
+		dev = ebt_dev_match(point, state->in, state->out);
+		if (dev != EBT_SKIP_MAX)
+			goto letsskip;
+
 		if (ebt_basic_match(point, skb, state->in, state->out))
 			goto letscontinue;
 
@@ -303,6 +317,12 @@ unsigned int ebt_do_table(void *priv, struct sk_buff *skb,
 letscontinue:
 		point = ebt_next_entry(point);
 		i++;
+		continue;
+letsskip:
+		/* the following entries with the same check fail it too */
+		step = &private->skip[chaininfo->counter_offset + i].dev[dev];
+		point = (struct ebt_entry *)(base + step->offset);
+		i = step->next - chaininfo->counter_offset;
 	}
 
 	/* I actually like this :) */
@@ -388,6 +408,7 @@ static inline void ebt_free_table_info(struct ebt_table_info *info)
 			vfree(info->chainstack[i]);
 		vfree(info->chainstack);
 	}
+	vfree(info->skip);
 }
 static inline int
 ebt_check_match(struct ebt_entry_match *m, struct xt_mtchk_param *par,
@@ -863,6 +884,69 @@ static int check_chainloops(const struct ebt_entries *chain, struct ebt_cl_stack
 	return 0;
 }
 
+static bool ebt_same_dev(const struct ebt_entry *a, const struct ebt_entry *b,
+			 int dev)
+{
+	if (dev == EBT_SKIP_IN)
+		return !((a->invflags ^ b->invflags) & EBT_IIN) &&
+		       !memcmp(a->in, b->in, IFNAMSIZ);
+
+	return !((a->invflags ^ b->invflags) & EBT_IOUT) &&
+	       !memcmp(a->out, b->out, IFNAMSIZ);
+}
+
+/* the entries from start up to idx share the check, idx follows them */
+static void ebt_skip_close(struct ebt_skip *skip, unsigned int *start,
+			   unsigned int idx, unsigned int off, int dev)
+{
+	unsigned int n;
+
+	for (n = *start; n < idx; n++) {
+		skip[n].dev[dev].next = idx;
+		skip[n].dev[dev].offset = off;
+	}
+	*start = idx;
+}
+
+/* Consecutive entries of a chain checking the same input, or output,
+ * interface name either all pass the check for a frame or all fail it,
+ * so ebt_do_table() goes on after the whole run when the first one fails.
+ * Rules for the ports of a bridge are usually grouped by port, a frame
+ * then only compares the name once per port.
+ */
+static void ebt_fill_skip(struct ebt_table_info *newinfo)
+{
+	unsigned int start[EBT_SKIP_MAX] = {};
+	const struct ebt_entry *e, *prev = NULL;
+	unsigned int idx = 0, off = 0;
+	int dev;
+
+	while (off < newinfo->entries_size) {
+		e = (const struct ebt_entry *)(newinfo->entries + off);
+		if (e->bitmask == 0) {
+			/* start of a chain, runs end with the previous one */
+			for (dev = 0; dev < EBT_SKIP_MAX; dev++)
+				ebt_skip_close(newinfo->skip, &start[dev],
+					       idx, off, dev);
+			prev = NULL;
+			off += sizeof(struct ebt_entries);
+			continue;
+		}
+
+		for (dev = 0; dev < EBT_SKIP_MAX; dev++) {
+			if (!prev || !ebt_same_dev(prev, e, dev))
+				ebt_skip_close(newinfo->skip, &start[dev],
+					       idx, off, dev);
+		}
+		prev = e;
+		off += e->next_offset;
+		idx++;
+	}
+
+	for (dev = 0; dev < EBT_SKIP_MAX; dev++)
+		ebt_skip_close(newinfo->skip, &start[dev], idx, off, dev);
+}
+
 /* do the parsing of the table/chains/entries/matches/watchers/targets, heh */
 static int translate_table(struct net *net, const char *name,
 			   struct ebt_table_info *newinfo)
@@ -912,6 +996,16 @@ static int translate_table(struct net *net, const char *name,
 	if (k != newinfo->nentries)
 		return -EINVAL;
 
+	/* this will get free'd in do_replace()/ebt_register_table()
+	 * if an error occurs
+	 */
+	if (newinfo->nentries) {
+		newinfo->skip = vmalloc(array_size(newinfo->nentries,
+						   sizeof(*newinfo->skip)));
+		if (!newinfo->skip)
+			return -ENOMEM;
+	}
+
 	/* get the location of the udc, put them in an array
 	 * while we're at it, allocate the chainstack
 	 */
@@ -978,6 +1072,8 @@ static int translate_table(struct net *net, const char *name,
 	if (ret != 0) {
 		EBT_ENTRY_ITERATE(newinfo->entries, newinfo->entries_size,
 				  ebt_cleanup_entry, net, &i);
+	} else if (newinfo->skip) {
+		ebt_fill_skip(newinfo);
 	}
 	vfree(cl_s);
 	return ret;
@@ -1025,6 +1121,7 @@ static int do_replace_finish(struct net *net, struct ebt_replace *repl,
 	}
 
 	newinfo->chainstack = NULL;
+	newinfo->skip = NULL;
 	ret = ebt_verify_pointers(repl, newinfo);
 	if (ret != 0)
 		goto free_counterstmp;
@@ -1223,6 +1320,7 @@ int ebt_register_table(struct net *net, const struct ebt_table *input_table,
 
 	/* fill in newinfo and parse the entries */
 	newinfo->chainstack = NULL;
+	newinfo->skip = NULL;
 	for (i = 0; i < NF_BR_NUMHOOKS; i++) {
 		if ((repl->valid_hooks & (1 << i)) == 0)
 			newinfo->hook_entry[i] = NULL;
@@ -6040,15 +6040,27 @@ static void __netif_receive_skb_list_core(struct list_head *head, bool pfmemallo
 	struct net_device *od_curr = NULL;
 	struct sk_buff *skb, *next;
 	LIST_HEAD(sublist);
+	bool nf_batch;
 
+	nf_batch = nf_ingress_xmit_begin();
 	list_for_each_entry_safe(skb, next, head, list) {
 		struct net_device *orig_dev = skb->dev;
 		struct packet_type *pt_prev = NULL;
 
 		skb_list_del_init(skb);
 		__netif_receive_skb_core(&skb, pfmemalloc, &pt_prev);
-		if (!pt_prev)
+		if (!pt_prev) {
+			/* packets held back by the ingress hooks go after
+			 * those that passed them before.
+			 */
+			if (nf_batch && nf_ingress_xmit_pending() &&
+			    !list_empty(&sublist)) {
+				__netif_receive_skb_list_ptype(&sublist, pt_curr,
+							       od_curr);
+				INIT_LIST_HEAD(&sublist);
+			}
 			continue;
+		}
 		if (pt_curr != pt_prev || od_curr != orig_dev) {
 			/* dispatch old sublist */
 			__netif_receive_skb_list_ptype(&sublist, pt_curr, od_curr);
@@ -6062,6 +6074,7 @@ static void __netif_receive_skb_list_core(struct list_head *head, bool pfmemallo
 
 	/* dispatch final sublist */
 	__netif_receive_skb_list_ptype(&sublist, pt_curr, od_curr);
+	nf_ingress_xmit_end(nf_batch);
 }
 
 static int __netif_receive_skb(struct sk_buff *skb)
@@ -4504,6 +4504,45 @@ static void skb_ts_finish(struct ts_config *conf, struct ts_state *state)
 	skb_abort_seq_read(TS_SKB_CB(state));
 }
 
+/**
+ * skb_find_text_state - Find a text pattern in skb data
+ * @skb: the buffer to look in
+ * @from: search offset
+ * @to: search limit
+ * @config: textsearch configuration
+ * @state: search state, left for the caller to inspect
+ *
+ * Like skb_find_text(), for callers that need the search state once
+ * the search is over, e.g. the index of the pattern that matched when
+ * searching for a set of patterns.
+ */
+unsigned int skb_find_text_state(struct sk_buff *skb, unsigned int from,
+				 unsigned int to, struct ts_config *config,
+				 struct ts_state *state)
+{
+	unsigned int patlen;
+	unsigned int ret;
+
+	BUILD_BUG_ON(sizeof(struct skb_seq_state) > sizeof(state->cb));
+
+	config->get_next_block = skb_ts_get_next_block;
+	config->finish = skb_ts_finish;
+
+	skb_prepare_seq_read(skb, from, to, TS_SKB_CB(state));
+
+	ret = textsearch_find(config, state);
+	if (ret == UINT_MAX)
+		return ret;
+
+	if (config->ops->get_match_len)
+		patlen = config->ops->get_match_len(config, state);
+	else
+		patlen = config->ops->get_pattern_len(config);
+
+	return (ret + patlen <= to - from ? ret : UINT_MAX);
+}
+EXPORT_SYMBOL(skb_find_text_state);
+
 /**
  * skb_find_text - Find a text pattern in skb data
  * @skb: the buffer to look in
@@ -4519,19 +4558,9 @@ static void skb_ts_finish(struct ts_config *conf, struct ts_state *state)
 unsigned int skb_find_text(struct sk_buff *skb, unsigned int from,
 			   unsigned int to, struct ts_config *config)
 {
-	unsigned int patlen = config->ops->get_pattern_len(config);
 	struct ts_state state;
-	unsigned int ret;
-
-	BUILD_BUG_ON(sizeof(struct skb_seq_state) > sizeof(state.cb));
 
-	config->get_next_block = skb_ts_get_next_block;
-	config->finish = skb_ts_finish;
-
-	skb_prepare_seq_read(skb, from, to, TS_SKB_CB(&state));
-
-	ret = textsearch_find(config, &state);
-	return (ret + patlen <= to - from ? ret : UINT_MAX);
+	return skb_find_text_state(skb, from, to, config, &state);
 }
 EXPORT_SYMBOL(skb_find_text);
 
@@ -740,6 +740,25 @@ static const struct rhashtable_params ip4_rhash_params = {
 	.automatic_shrinking	= true,
 };
 
+/* Is the datagram of this fragment being reassembled?  Under RCU. */
+bool ip_defrag_queued(struct net *net, const struct sk_buff *skb, u32 user)
+{
+	struct net_device *dev = skb->dev ? : skb_dst_dev(skb);
+	const struct iphdr *iph = ip_hdr(skb);
+	struct frag_v4_compare_key key = {
+		.saddr = iph->saddr,
+		.daddr = iph->daddr,
+		.user = user,
+		.vif = l3mdev_master_ifindex_rcu(dev),
+		.id = iph->id,
+		.protocol = iph->protocol,
+	};
+
+	return rhashtable_lookup(&net->ipv4.fqdir->rhashtable, &key,
+				 ip4_rhash_params);
+}
+EXPORT_SYMBOL(ip_defrag_queued);
+
 void __init ipfrag_init(void)
 {
 	ip4_frags.constructor = ip4_frag_init;
@@ -101,6 +101,7 @@
 #include <linux/init.h>
 #include <linux/netfilter_ipv4.h>
 #include <linux/if_ether.h>
+#include <linux/etherdevice.h>
 
 #include <net/sock.h>
 #include <net/ip.h>
@@ -353,6 +354,65 @@ ipip_tunnel_ctl(struct net_device *dev, struct ip_tunnel_parm_kern *p, int cmd)
 	return ip_tunnel_ctl(dev, p, cmd);
 }
 
+static int ipip_fill_forward_path(struct net_device_path_ctx *ctx,
+				  struct net_device_path *path)
+{
+	struct ip_tunnel *tunnel = netdev_priv(ctx->dev);
+	const struct iphdr *tiph = &tunnel->parms.iph;
+	struct neighbour *n;
+	struct flowi4 fl4;
+	struct rtable *rt;
+	u8 nud_state;
+
+	if (tunnel->collect_md || !tiph->saddr || !tiph->daddr ||
+	    (tiph->protocol && tiph->protocol != IPPROTO_IPIP))
+		return -1;
+
+	ip_tunnel_init_flow(&fl4, IPPROTO_IPIP, tiph->daddr, tiph->saddr, 0,
+			    tiph->tos & INET_DSCP_MASK, tunnel->net,
+			    tunnel->parms.link, tunnel->fwmark, 0, 0);
+	rt = ip_route_output_key(tunnel->net, &fl4);
+	if (IS_ERR(rt))
+		return -1;
+
+	if (rt->rt_type != RTN_UNICAST || rt->dst.dev == ctx->dev) {
+		ip_rt_put(rt);
+		return -1;
+	}
+
+	n = __ipv4_neigh_lookup_noref(rt->dst.dev,
+				      (__force u32)rt_nexthop(rt, tiph->daddr));
+	if (!n) {
+		ip_rt_put(rt);
+		return -1;
+	}
+
+	read_lock_bh(&n->lock);
+	nud_state = n->nud_state;
+	ether_addr_copy(ctx->daddr, n->ha);
+	read_unlock_bh(&n->lock);
+
+	if (!(nud_state & NUD_VALID)) {
+		ip_rt_put(rt);
+		return -1;
+	}
+
+	path->type = DEV_PATH_TUN;
+	path->dev = ctx->dev;
+	path->tun.src_v4 = tiph->saddr;
+	path->tun.dst_v4 = tiph->daddr;
+	ether_addr_copy(path->tun.h_dest, ctx->daddr);
+	path->tun.proto = IPPROTO_IPIP;
+	path->tun.ttl = tiph->ttl;
+	path->tun.tos = tiph->tos;
+	path->tun.df = !!(tiph->frag_off & htons(IP_DF));
+
+	ctx->dev = rt->dst.dev;
+	ip_rt_put(rt);
+
+	return 0;
+}
+
 static const struct net_device_ops ipip_netdev_ops = {
 	.ndo_init       = ipip_tunnel_init,
 	.ndo_uninit     = ip_tunnel_uninit,
@@ -362,6 +422,7 @@ static const struct net_device_ops ipip_netdev_ops = {
 	.ndo_get_stats64 = dev_get_tstats64,
 	.ndo_get_iflink = ip_tunnel_get_iflink,
 	.ndo_tunnel_ctl	= ipip_tunnel_ctl,
+	.ndo_fill_forward_path = ipip_fill_forward_path,
 };
 
 #define IPIP_FEATURES (NETIF_F_SG |		\
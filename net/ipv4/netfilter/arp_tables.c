@@ -179,6 +179,56 @@ struct arpt_entry *arpt_next_entry(const struct arpt_entry *entry)
 	return (void *)entry + entry->next_offset;
 }
 
+/* ARP spoofing protection is a long run of "-s IP --source-mac MAC" rules.
+ * translate_table() indexes each run of rules on a single source address,
+ * so a packet entering a run jumps to the first rule for its sender and,
+ * once past that rule, to the next rule for the same address.  Rules in
+ * between can't match: arp_packet_match() rejects the address and has no
+ * side effects.  Everything outside these runs is walked linearly.
+ */
+#define ARPT_DISPATCH_MIN	8
+/* Smallest possible entry, so offset / grain is unique per entry */
+#define ARPT_DISPATCH_GRAIN	(sizeof(struct arpt_entry) + \
+				 sizeof(struct xt_entry_target))
+
+/* The sender address, where arp_packet_match() reads it.  0.0.0.0, as sent
+ * by address probes, is never indexed: such packets walk runs linearly.
+ */
+static u32 arpt_packet_key(const struct arphdr *arphdr,
+			   const struct net_device *dev)
+{
+	const char *arpptr = (char *)(arphdr + 1) + dev->addr_len;
+	__be32 src_ipaddr;
+
+	memcpy(&src_ipaddr, arpptr, sizeof(u32));
+	return (__force u32)src_ipaddr;
+}
+
+/* Skip the rules of a run that starts at @e and can't match @key. */
+static inline struct arpt_entry *
+arpt_dispatch_enter(const struct xt_dispatch *d, const void *base,
+		    struct arpt_entry *e, u32 key)
+{
+	return get_entry(base, xt_dispatch_enter(d, (void *)e - base, key,
+						 ARPT_DISPATCH_GRAIN));
+}
+
+static inline struct arpt_entry *
+arpt_dispatch_next(const struct xt_dispatch *d, const void *base,
+		   const struct arpt_entry *e, u32 key)
+{
+	if (d && key) {
+		const struct xt_dispatch_slot *s;
+
+		s = xt_dispatch_slot(d, (const void *)e - base,
+				     ARPT_DISPATCH_GRAIN);
+		if (s->key == key)
+			return get_entry(base, s->next);
+	}
+
+	return arpt_next_entry(e);
+}
+
 unsigned int arpt_do_table(void *priv,
 			   struct sk_buff *skb,
 			   const struct nf_hook_state *state)
@@ -193,8 +243,10 @@ unsigned int arpt_do_table(void *priv,
 	const void *table_base;
 	unsigned int cpu, stackidx = 0;
 	const struct xt_table_info *private;
+	const struct xt_dispatch *dispatch;
 	struct xt_action_param acpar;
 	unsigned int addend;
+	u32 key = 0;
 
 	if (!pskb_may_pull(skb, arp_hdr_len(skb->dev)))
 		return NF_DROP;
@@ -218,12 +270,18 @@ unsigned int arpt_do_table(void *priv,
 	acpar.hotdrop = false;
 
 	arp = arp_hdr(skb);
+	dispatch = private->dispatch;
+	if (dispatch)
+		key = arpt_packet_key(arp, skb->dev);
 	do {
 		const struct xt_entry_target *t;
 		struct xt_counters *counter;
 
+		if (dispatch && key)
+			e = arpt_dispatch_enter(dispatch, table_base, e, key);
+
 		if (!arp_packet_match(arp, skb->dev, indev, outdev, &e->arp)) {
-			e = arpt_next_entry(e);
+			e = arpt_dispatch_next(dispatch, table_base, e, key);
 			continue;
 		}
 
@@ -272,7 +330,9 @@ unsigned int arpt_do_table(void *priv,
 		if (verdict == XT_CONTINUE) {
 			/* Target might have changed stuff. */
 			arp = arp_hdr(skb);
-			e = arpt_next_entry(e);
+			if (dispatch)
+				key = arpt_packet_key(arp, skb->dev);
+			e = arpt_dispatch_next(dispatch, table_base, e, key);
 		} else {
 			/* Verdict */
 			break;
@@ -513,6 +573,19 @@ static void cleanup_entry(struct arpt_entry *e, struct net *net)
 	xt_percpu_counter_free(&e->counters);
 }
 
+/* Key of a rule that only accepts a single sender address. */
+static u32 arpt_rule_key(const void *entry, u16 *next_offset)
+{
+	const struct arpt_entry *e = entry;
+
+	*next_offset = e->next_offset;
+	if (e->arp.smsk.s_addr != htonl(0xFFFFFFFF) ||
+	    e->arp.invflags & ARPT_INV_SRCIP)
+		return 0;
+
+	return (__force u32)e->arp.src.s_addr;
+}
+
 /* Checks and translates the user-supplied table segment (held in
  * newinfo).
  */
@@ -591,6 +664,8 @@ static int translate_table(struct net *net,
 		return ret;
 	}
 
+	xt_dispatch_build(newinfo, entry0, ARPT_DISPATCH_GRAIN,
+			  ARPT_DISPATCH_MIN, arpt_rule_key);
 	return ret;
  out_free:
 	kvfree(offsets);
@@ -598,49 +673,47 @@ static int translate_table(struct net *net,
 }
 
 static void get_counters(const struct xt_table_info *t,
+			 unsigned int first, unsigned int last,
 			 struct xt_counters counters[])
 {
+	struct arpt_entry *start = (void *)t->entries;
 	struct arpt_entry *iter;
-	unsigned int cpu;
-	unsigned int i;
+	unsigned int cpu, i;
 
-	for_each_possible_cpu(cpu) {
-		seqcount_t *s = &per_cpu(xt_recseq, cpu);
+	for (i = 0; i < first; i++)
+		start = arpt_next_entry(start);
 
-		i = 0;
-		xt_entry_foreach(iter, t->entries, t->size) {
-			struct xt_counters *tmp;
+	for_each_possible_cpu(cpu) {
+		iter = start;
+		for (i = first; i < last; i++, iter = arpt_next_entry(iter)) {
 			u64 bcnt, pcnt;
-			unsigned int start;
-
-			tmp = xt_get_per_cpu_counter(&iter->counters, cpu);
-			do {
-				start = read_seqcount_begin(s);
-				bcnt = tmp->bcnt;
-				pcnt = tmp->pcnt;
-			} while (read_seqcount_retry(s, start));
 
+			xt_fetch_per_cpu_counter(&iter->counters, cpu,
+						 &bcnt, &pcnt);
 			ADD_COUNTER(counters[i], bcnt, pcnt);
-			++i;
 			cond_resched();
 		}
 	}
 }
 
-static void get_old_counters(const struct xt_table_info *t,
-			     struct xt_counters counters[])
+static void get_old_counters_range(const struct xt_table_info *t,
+				   unsigned int first, unsigned int last,
+				   struct xt_counters counters[])
 {
+	struct arpt_entry *start = (void *)t->entries;
 	struct arpt_entry *iter;
 	unsigned int cpu, i;
 
+	for (i = 0; i < first; i++)
+		start = arpt_next_entry(start);
+
 	for_each_possible_cpu(cpu) {
-		i = 0;
-		xt_entry_foreach(iter, t->entries, t->size) {
+		iter = start;
+		for (i = first; i < last; i++, iter = arpt_next_entry(iter)) {
 			struct xt_counters *tmp;
 
 			tmp = xt_get_per_cpu_counter(&iter->counters, cpu);
 			ADD_COUNTER(counters[i], tmp->bcnt, tmp->pcnt);
-			++i;
 		}
 		cond_resched();
 	}
@@ -662,7 +735,7 @@ static struct xt_counters *alloc_counters(const struct xt_table *table)
 	if (counters == NULL)
 		return ERR_PTR(-ENOMEM);
 
-	get_counters(private, counters);
+	xt_harvest_counters(private, counters, get_counters);
 
 	return counters;
 }
@@ -923,7 +996,7 @@ static int __do_replace(struct net *net, const char *name,
 
 	xt_table_unlock(t);
 
-	get_old_counters(oldinfo, counters);
+	xt_harvest_counters(oldinfo, counters, get_old_counters_range);
 
 	/* Decrease module usage counts and free resource */
 	loc_cpu_old_entry = oldinfo->entries;
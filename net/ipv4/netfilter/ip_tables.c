@@ -21,8 +21,11 @@
 #include <linux/proc_fs.h>
 #include <linux/err.h>
 #include <linux/cpumask.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
 
 #include <linux/netfilter/x_tables.h>
+#include <linux/netfilter/xt_tcpudp.h>
 #include <linux/netfilter_ipv4/ip_tables.h>
 #include <net/netfilter/nf_log.h>
 #include "../../netfilter/xt_repldata.h"
@@ -218,6 +221,83 @@ struct ipt_entry *ipt_next_entry(const struct ipt_entry *entry)
 	return (void *)entry + entry->next_offset;
 }
 
+/* Large rulesets are mostly long runs of "-p tcp/udp --dport N" rules.
+ * translate_table() indexes each such run by (protocol, port), so a packet
+ * entering a run jumps to the first rule that can match it and, once past
+ * that rule, to the next rule with the same key.  Rules in between can't
+ * match: their first match would reject the packet on the port without
+ * side effects.  Everything outside these runs is walked linearly.
+ */
+#define IPT_DISPATCH_MIN	8
+/* Smallest possible entry, so offset / grain is unique per entry */
+#define IPT_DISPATCH_GRAIN	(sizeof(struct ipt_entry) + \
+				 sizeof(struct xt_entry_target))
+/* Never indexed: the packet can't match any rule of a run */
+#define IPT_DISPATCH_NOMATCH	1
+
+static inline u32 ipt_dispatch_key(u8 proto, u16 port)
+{
+	return (u32)proto << 16 | port;
+}
+
+/* Returns 0 if the packet must walk runs linearly. */
+static u32 ipt_packet_key(const struct sk_buff *skb, const struct iphdr *ip,
+			  const struct xt_action_param *par)
+{
+	union {
+		struct tcphdr tcp;
+		struct udphdr udp;
+	} _hdr;
+	const struct udphdr *uh;
+	unsigned int len;
+
+	switch (ip->protocol) {
+	case IPPROTO_TCP:
+		len = sizeof(struct tcphdr);
+		break;
+	case IPPROTO_UDP:
+		len = sizeof(struct udphdr);
+		break;
+	default:
+		return IPT_DISPATCH_NOMATCH;
+	}
+
+	/* Fragments and truncated headers may hotdrop in the tcp match. */
+	if (par->fragoff)
+		return 0;
+
+	uh = skb_header_pointer(skb, par->thoff, len, &_hdr);
+	if (!uh)
+		return 0;
+
+	return ipt_dispatch_key(ip->protocol, ntohs(uh->dest));
+}
+
+/* Skip the rules of a run that starts at @e and can't match @key. */
+static inline struct ipt_entry *
+ipt_dispatch_enter(const struct xt_dispatch *d, const void *base,
+		   struct ipt_entry *e, u32 key)
+{
+	return get_entry(base, xt_dispatch_enter(d, (void *)e - base, key,
+						 IPT_DISPATCH_GRAIN));
+}
+
+static inline struct ipt_entry *
+ipt_dispatch_next(const struct xt_dispatch *d, const void *base,
+		  const struct ipt_entry *e, u32 key)
+{
+	if (d && key) {
+		const struct xt_dispatch_slot *s;
+
+		s = xt_dispatch_slot(d, (const void *)e - base,
+				     IPT_DISPATCH_GRAIN);
+		if (s->key == key)
+			return get_entry(base, s->next);
+	}
+
+	return ipt_next_entry(e);
+}
+
 /* Returns one of the generic firewall policies, like NF_ACCEPT. */
 unsigned int
 ipt_do_table(void *priv,
@@ -235,8 +315,10 @@ ipt_do_table(void *priv,
 	struct ipt_entry *e, **jumpstack;
 	unsigned int stackidx, cpu;
 	const struct xt_table_info *private;
+	const struct xt_dispatch *dispatch;
 	struct xt_action_param acpar;
 	unsigned int addend;
+	u32 key = 0;
 
 	/* Initialization */
 	stackidx = 0;
@@ -261,6 +343,9 @@ ipt_do_table(void *priv,
 	cpu        = smp_processor_id();
 	table_base = private->entries;
 	jumpstack  = (struct ipt_entry **)private->jumpstack[cpu];
+	dispatch   = private->dispatch;
+	if (dispatch)
+		key = ipt_packet_key(skb, ip, &acpar);
 
 	/* Switch to alternate jumpstack if we're being invoked via TEE.
 	 * TEE issues XT_CONTINUE verdict on original skb so we must not
@@ -280,10 +365,13 @@ ipt_do_table(void *priv,
 		struct xt_counters *counter;
 
 		WARN_ON(!e);
+		if (dispatch && key)
+			e = ipt_dispatch_enter(dispatch, table_base, e, key);
+
 		if (!ip_packet_match(ip, indev, outdev,
 		    &e->ip, acpar.fragoff)) {
  no_match:
-			e = ipt_next_entry(e);
+			e = ipt_dispatch_next(dispatch, table_base, e, key);
 			continue;
 		}
 
@@ -346,7 +434,9 @@ ipt_do_table(void *priv,
 		if (verdict == XT_CONTINUE) {
 			/* Target might have changed stuff. */
 			ip = ip_hdr(skb);
-			e = ipt_next_entry(e);
+			if (dispatch)
+				key = ipt_packet_key(skb, ip, &acpar);
+			e = ipt_dispatch_next(dispatch, table_base, e, key);
 		} else {
 			/* Verdict */
 			break;
@@ -654,6 +744,46 @@ cleanup_entry(struct ipt_entry *e, struct net *net)
 	xt_percpu_counter_free(&e->counters);
 }
 
+/* Key of a rule whose first match only accepts a single destination port. */
+static u32 ipt_rule_key(const void *entry, u16 *next_offset)
+{
+	const struct ipt_entry *e = entry;
+	const struct xt_entry_match *m = (void *)e->elems;
+	const struct xt_match *match;
+
+	*next_offset = e->next_offset;
+	if (e->target_offset == sizeof(struct ipt_entry) ||
+	    e->ip.invflags & XT_INV_PROTO)
+		return 0;
+
+	match = m->u.kernel.match;
+	if (match->revision != 0)
+		return 0;
+
+	switch (e->ip.proto) {
+	case IPPROTO_TCP: {
+		const struct xt_tcp *info = (const void *)m->data;
+
+		if (strcmp(match->name, "tcp") ||
+		    info->invflags & XT_TCP_INV_DSTPT ||
+		    info->dpts[0] != info->dpts[1])
+			return 0;
+		return ipt_dispatch_key(IPPROTO_TCP, info->dpts[0]);
+	}
+	case IPPROTO_UDP: {
+		const struct xt_udp *info = (const void *)m->data;
+
+		if (strcmp(match->name, "udp") ||
+		    info->invflags & XT_UDP_INV_DSTPT ||
+		    info->dpts[0] != info->dpts[1])
+			return 0;
+		return ipt_dispatch_key(IPPROTO_UDP, info->dpts[0]);
+	}
+	}
+
+	return 0;
+}
+
 /* Checks and translates the user-supplied table segment (held in
    newinfo) */
 static int
@@ -729,6 +859,8 @@ translate_table(struct net *net, struct xt_table_info *newinfo, void *entry0,
 		return ret;
 	}
 
+	xt_dispatch_build(newinfo, entry0, IPT_DISPATCH_GRAIN,
+			  IPT_DISPATCH_MIN, ipt_rule_key);
 	return ret;
  out_free:
 	kvfree(offsets);
@@ -737,49 +869,47 @@ translate_table(struct net *net, struct xt_table_info *newinfo, void *entry0,
 
 static void
 get_counters(const struct xt_table_info *t,
+	     unsigned int first, unsigned int last,
 	     struct xt_counters counters[])
 {
+	struct ipt_entry *start = (void *)t->entries;
 	struct ipt_entry *iter;
-	unsigned int cpu;
-	unsigned int i;
+	unsigned int cpu, i;
 
-	for_each_possible_cpu(cpu) {
-		seqcount_t *s = &per_cpu(xt_recseq, cpu);
+	for (i = 0; i < first; i++)
+		start = ipt_next_entry(start);
 
-		i = 0;
-		xt_entry_foreach(iter, t->entries, t->size) {
-			struct xt_counters *tmp;
+	for_each_possible_cpu(cpu) {
+		iter = start;
+		for (i = first; i < last; i++, iter = ipt_next_entry(iter)) {
 			u64 bcnt, pcnt;
-			unsigned int start;
-
-			tmp = xt_get_per_cpu_counter(&iter->counters, cpu);
-			do {
-				start = read_seqcount_begin(s);
-				bcnt = tmp->bcnt;
-				pcnt = tmp->pcnt;
-			} while (read_seqcount_retry(s, start));
 
+			xt_fetch_per_cpu_counter(&iter->counters, cpu,
+						 &bcnt, &pcnt);
 			ADD_COUNTER(counters[i], bcnt, pcnt);
-			++i; /* macro does multi eval of i */
 			cond_resched();
 		}
 	}
 }
 
-static void get_old_counters(const struct xt_table_info *t,
-			     struct xt_counters counters[])
+static void get_old_counters_range(const struct xt_table_info *t,
+				   unsigned int first, unsigned int last,
+				   struct xt_counters counters[])
 {
+	struct ipt_entry *start = (void *)t->entries;
 	struct ipt_entry *iter;
 	unsigned int cpu, i;
 
+	for (i = 0; i < first; i++)
+		start = ipt_next_entry(start);
+
 	for_each_possible_cpu(cpu) {
-		i = 0;
-		xt_entry_foreach(iter, t->entries, t->size) {
+		iter = start;
+		for (i = first; i < last; i++, iter = ipt_next_entry(iter)) {
 			const struct xt_counters *tmp;
 
 			tmp = xt_get_per_cpu_counter(&iter->counters, cpu);
 			ADD_COUNTER(counters[i], tmp->bcnt, tmp->pcnt);
-			++i; /* macro does multi eval of i */
 		}
 
 		cond_resched();
@@ -801,7 +931,7 @@ static struct xt_counters *alloc_counters(const struct xt_table *table)
 	if (counters == NULL)
 		return ERR_PTR(-ENOMEM);
 
-	get_counters(private, counters);
+	xt_harvest_counters(private, counters, get_counters);
 
 	return counters;
 }
@@ -1075,7 +1205,7 @@ __do_replace(struct net *net, const char *name, unsigned int valid_hooks,
 
 	xt_table_unlock(t);
 
-	get_old_counters(oldinfo, counters);
+	xt_harvest_counters(oldinfo, counters, get_old_counters_range);
 
 	/* Decrease module usage counts and free resource */
 	xt_entry_foreach(iter, oldinfo->entries, oldinfo->size)
@@ -9,6 +9,9 @@
 #include <linux/module.h>
 #include <linux/rcupdate.h>
 #include <linux/skbuff.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
+#include <linux/mm.h>
 #include <net/netns/generic.h>
 #include <net/route.h>
 #include <net/ip.h>
@@ -19,10 +22,153 @@
 #if IS_ENABLED(CONFIG_NF_CONNTRACK)
 #include <net/netfilter/nf_conntrack.h>
 #endif
+#include <net/netfilter/nf_conntrack_tuple.h>
 #include <net/netfilter/nf_conntrack_zones.h>
 
 static DEFINE_MUTEX(defrag4_mutex);
 
+struct nf_defrag4_pernet {
+	struct ctl_table_header	*sysctl_hdr;
+	u8			virtual_reasm;
+};
+
+static unsigned int nf_defrag4_pernet_id __read_mostly;
+
+static struct nf_defrag4_pernet *nf_defrag4_pernet(struct net *net)
+{
+	return net_generic(net, nf_defrag4_pernet_id);
+}
+
+/* Virtual reassembly: the fragments of a datagram that belongs to a known
+ * connection are forwarded as they are instead of being reassembled and
+ * fragmented again on output.  The first fragment goes through conntrack
+ * as any packet with a transport header, the datagram is remembered with
+ * its tuple and conntrack looks the others up by it, in the zone it finds
+ * then, see nf_defrag4_frag_tuple().
+ *
+ * Only for forwarded fragments, and only when the first fragment arrives
+ * before the others: anything else is reassembled as usual.  The table is
+ * shared by the CPUs, the fragments of a datagram are not guaranteed to
+ * be received on the same one, and a slot in use is never taken over, its
+ * datagram would be lost.
+ *
+ * The byte ranges received are kept, merged when adjacent, so that
+ * duplicate fragments are dropped and overlapping ones drop what is left
+ * of the datagram, as ip_defrag() would.
+ */
+#define NF_DEFRAG4_VIRT_SIZE	1024
+#define NF_DEFRAG4_VIRT_RANGES	8
+
+struct nf_defrag4_virt {
+	spinlock_t			lock;
+	struct net			*net;	/* NULL when free */
+	unsigned long			expires;
+	__be32				saddr;
+	__be32				daddr;
+	__be16				id;
+	u8				protocol;
+	unsigned int			reasm;	/* fragments on their way to ip_defrag() */
+	unsigned int			len;	/* 0 until the last fragment */
+	unsigned int			pending; /* not looked up by conntrack yet */
+	bool				dropped;
+	u8				nranges;
+	struct {
+		u16			start;
+		u16			end;
+	}				ranges[NF_DEFRAG4_VIRT_RANGES];
+	struct nf_conntrack_tuple	tuple;
+};
+
+static struct nf_defrag4_virt *nf_defrag4_virt_tab __read_mostly;
+static u32 nf_defrag4_virt_rnd __read_mostly;
+
+static struct nf_defrag4_virt *nf_defrag4_virt_slot(const struct iphdr *iph)
+{
+	u32 hash;
+
+	hash = jhash_3words((__force u32)iph->saddr, (__force u32)iph->daddr,
+			    (__force u32)iph->id << 8 | iph->protocol,
+			    nf_defrag4_virt_rnd);
+
+	return &nf_defrag4_virt_tab[hash % NF_DEFRAG4_VIRT_SIZE];
+}
+
+static bool nf_defrag4_virt_busy(const struct nf_defrag4_virt *v)
+{
+	return v->net && time_before(jiffies, v->expires);
+}
+
+static bool nf_defrag4_virt_match(const struct nf_defrag4_virt *v,
+				  const struct net *net,
+				  const struct iphdr *iph)
+{
+	return nf_defrag4_virt_busy(v) && v->net == net &&
+	       v->saddr == iph->saddr && v->daddr == iph->daddr &&
+	       v->id == iph->id && v->protocol == iph->protocol;
+}
+
+/* -EEXIST for a fragment whose bytes were all received already, -EINVAL
+ * for one overlapping them only partly or inconsistent with the length.
+ */
+static int nf_defrag4_virt_add(struct nf_defrag4_virt *v,
+			       unsigned int offset, unsigned int end, bool last)
+{
+	unsigned int i, n = v->nranges;
+	bool prev, next;
+
+	if (end <= offset || end > U16_MAX)
+		return -EINVAL;
+
+	if (last) {
+		if (v->len ? end != v->len : v->ranges[n - 1].end > end)
+			return -EINVAL;
+	} else if (end & 0x7 || (v->len && end > v->len)) {
+		return -EINVAL;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (offset >= v->ranges[i].start && end <= v->ranges[i].end)
+			return -EEXIST;
+		if (offset < v->ranges[i].end && end > v->ranges[i].start)
+			return -EINVAL;
+	}
+
+	for (i = 0; i < n && v->ranges[i].start < offset; i++)
+		;
+
+	prev = i > 0 && v->ranges[i - 1].end == offset;
+	next = i < n && v->ranges[i].start == end;
+	if (prev && next) {
+		v->ranges[i - 1].end = v->ranges[i].end;
+		memmove(&v->ranges[i], &v->ranges[i + 1],
+			(n - i - 1) * sizeof(v->ranges[0]));
+		v->nranges--;
+	} else if (prev) {
+		v->ranges[i - 1].end = end;
+	} else if (next) {
+		v->ranges[i].start = offset;
+	} else {
+		if (n == NF_DEFRAG4_VIRT_RANGES)
+			return -EINVAL;
+
+		memmove(&v->ranges[i + 1], &v->ranges[i],
+			(n - i) * sizeof(v->ranges[0]));
+		v->ranges[i].start = offset;
+		v->ranges[i].end = end;
+		v->nranges++;
+	}
+
+	if (last)
+		v->len = end;
+
+	return 0;
+}
+
+static bool nf_defrag4_virt_complete(const struct nf_defrag4_virt *v)
+{
+	return v->len && v->nranges == 1 && v->ranges[0].end == v->len;
+}
+
 static int nf_ct_ipv4_gather_frags(struct net *net, struct sk_buff *skb,
 				   u_int32_t user)
 {
@@ -38,6 +184,114 @@ static int nf_ct_ipv4_gather_frags(struct net *net, struct sk_buff *skb,
 	return err;
 }
 
+static int nf_ct_ipv4_virtual_frags(struct net *net, struct sk_buff *skb,
+				    u_int32_t user)
+{
+	const struct iphdr *iph = ip_hdr(skb);
+	const struct nf_ct_hook *ct_hook;
+	unsigned int offset, end;
+	struct nf_conntrack_zone zone;
+	struct nf_defrag4_virt *v;
+	int err;
+
+	offset = (ntohs(iph->frag_off) & IP_OFFSET) << 3;
+	end = offset + ntohs(iph->tot_len) - ip_hdrlen(skb);
+	v = nf_defrag4_virt_slot(iph);
+	ct_hook = rcu_dereference(nf_ct_hook);
+
+	spin_lock_bh(&v->lock);
+
+	if (nf_defrag4_virt_match(v, net, iph)) {
+		err = v->dropped ? -EINVAL :
+		      nf_defrag4_virt_add(v, offset, end,
+					  !(iph->frag_off & htons(IP_MF)));
+		if (err == -EINVAL)
+			v->dropped = true;
+		else if (!err)
+			v->pending++;
+		spin_unlock_bh(&v->lock);
+
+		if (err)
+			kfree_skb(skb);
+		return err;
+	}
+
+	/* A fragment of this datagram may be on its way to a reassembly
+	 * queue, the first one must not overtake it.
+	 */
+	if (iph->frag_off & htons(IP_OFFSET) || nf_defrag4_virt_busy(v) ||
+	    v->reasm || !ct_hook || ip_defrag_queued(net, skb, user))
+		goto reassemble;
+
+	/* the zone of a template attached before defragmentation */
+	nf_ct_zone_init(&zone, user - IP_DEFRAG_CONNTRACK_IN,
+			NF_CT_DEFAULT_ZONE_DIR, 0);
+	if (!ct_hook->frag_known(net, &zone, skb, &v->tuple))
+		goto reassemble;
+
+	v->net = net;
+	v->expires = jiffies + READ_ONCE(net->ipv4.fqdir->timeout);
+	v->saddr = iph->saddr;
+	v->daddr = iph->daddr;
+	v->id = iph->id;
+	v->protocol = iph->protocol;
+	v->len = 0;
+	v->pending = 0;
+	v->dropped = false;
+	v->nranges = 1;
+	v->ranges[0].start = 0;
+	v->ranges[0].end = end;
+
+	spin_unlock_bh(&v->lock);
+	return 0;
+
+reassemble:
+	v->reasm++;
+	spin_unlock_bh(&v->lock);
+
+	err = nf_ct_ipv4_gather_frags(net, skb, user);
+
+	spin_lock_bh(&v->lock);
+	v->reasm--;
+	spin_unlock_bh(&v->lock);
+
+	return err;
+}
+
+/* Called by conntrack for fragments without transport header, the slots
+ * don't depend on the zone.  The slot goes once the datagram is complete
+ * and each of its fragments has been looked up.
+ */
+static bool nf_defrag4_frag_tuple(const struct nf_hook_state *state,
+				  const struct sk_buff *skb, u16 zone_id,
+				  struct nf_conntrack_tuple *tuple)
+{
+	struct nf_defrag4_pernet *nf_defrag = nf_defrag4_pernet(state->net);
+	const struct iphdr *iph = ip_hdr(skb);
+	struct nf_defrag4_virt *v;
+	bool found = false;
+
+	if (!READ_ONCE(nf_defrag->virtual_reasm) || !nf_defrag4_virt_tab ||
+	    !ip_is_fragment(iph))
+		return false;
+
+	v = nf_defrag4_virt_slot(iph);
+
+	spin_lock_bh(&v->lock);
+	if (nf_defrag4_virt_match(v, state->net, iph) && !v->dropped) {
+		*tuple = v->tuple;
+		found = true;
+
+		if (v->pending)
+			v->pending--;
+		if (!v->pending && nf_defrag4_virt_complete(v))
+			v->net = NULL;
+	}
+	spin_unlock_bh(&v->lock);
+
+	return found;
+}
+
 static enum ip_defrag_users nf_ct_defrag_user(unsigned int hooknum,
 					      struct sk_buff *skb)
 {
@@ -81,10 +335,17 @@ static unsigned int ipv4_conntrack_defrag(void *priv,
 #endif
 	/* Gather fragments. */
 	if (ip_is_fragment(ip_hdr(skb))) {
+		struct nf_defrag4_pernet *nf_defrag;
 		enum ip_defrag_users user =
 			nf_ct_defrag_user(state->hook, skb);
 
-		if (nf_ct_ipv4_gather_frags(state->net, skb, user))
+		nf_defrag = nf_defrag4_pernet(state->net);
+		if (READ_ONCE(nf_defrag->virtual_reasm) && nf_defrag4_virt_tab &&
+		    user >= IP_DEFRAG_CONNTRACK_IN &&
+		    user <= __IP_DEFRAG_CONNTRACK_IN_END) {
+			if (nf_ct_ipv4_virtual_frags(state->net, skb, user))
+				return NF_STOLEN;
+		} else if (nf_ct_ipv4_gather_frags(state->net, skb, user))
 			return NF_STOLEN;
 	}
 	return NF_ACCEPT;
@@ -105,8 +366,87 @@ static const struct nf_hook_ops ipv4_defrag_ops[] = {
 	},
 };
 
+#ifdef CONFIG_SYSCTL
+static struct ctl_table nf_defrag4_sysctl_table[] = {
+	{
+		.procname	= "nf_conntrack_frag4_virtual",
+		.maxlen		= sizeof(u8),
+		.mode		= 0644,
+		.proc_handler	= proc_dou8vec_minmax,
+		.extra1		= SYSCTL_ZERO,
+		.extra2		= SYSCTL_ONE,
+	},
+};
+
+static int nf_defrag4_sysctl_register(struct net *net)
+{
+	struct nf_defrag4_pernet *nf_defrag = nf_defrag4_pernet(net);
+	struct ctl_table_header *hdr;
+	struct ctl_table *table;
+
+	table = nf_defrag4_sysctl_table;
+	if (!net_eq(net, &init_net)) {
+		table = kmemdup(table, sizeof(nf_defrag4_sysctl_table),
+				GFP_KERNEL);
+		if (!table)
+			return -ENOMEM;
+	}
+
+	table[0].data = &nf_defrag->virtual_reasm;
+
+	hdr = register_net_sysctl_sz(net, "net/netfilter", table,
+				     ARRAY_SIZE(nf_defrag4_sysctl_table));
+	if (!hdr) {
+		if (!net_eq(net, &init_net))
+			kfree(table);
+		return -ENOMEM;
+	}
+
+	nf_defrag->sysctl_hdr = hdr;
+	return 0;
+}
+
+static void nf_defrag4_sysctl_unregister(struct net *net)
+{
+	struct nf_defrag4_pernet *nf_defrag = nf_defrag4_pernet(net);
+	const struct ctl_table *table;
+
+	table = nf_defrag->sysctl_hdr->ctl_table_arg;
+	unregister_net_sysctl_table(nf_defrag->sysctl_hdr);
+	if (!net_eq(net, &init_net))
+		kfree(table);
+}
+#else
+static int nf_defrag4_sysctl_register(struct net *net)
+{
+	return 0;
+}
+
+static void nf_defrag4_sysctl_unregister(struct net *net)
+{
+}
+#endif
+
+static int __net_init defrag4_net_init(struct net *net)
+{
+	return nf_defrag4_sysctl_register(net);
+}
+
 static void __net_exit defrag4_net_exit(struct net *net)
 {
+	unsigned int i;
+
+	nf_defrag4_sysctl_unregister(net);
+
+	for (i = 0; nf_defrag4_virt_tab && i < NF_DEFRAG4_VIRT_SIZE; i++) {
+		struct nf_defrag4_virt *v = &nf_defrag4_virt_tab[i];
+
+		spin_lock_bh(&v->lock);
+		if (v->net == net)
+			v->net = NULL;
+		spin_unlock_bh(&v->lock);
+	}
+
 	if (net->nf.defrag_ipv4_users) {
 		nf_unregister_net_hooks(net, ipv4_defrag_ops,
 					ARRAY_SIZE(ipv4_defrag_ops));
@@ -118,19 +458,34 @@ static const struct nf_defrag_hook defrag_hook = {
 	.owner = THIS_MODULE,
 	.enable = nf_defrag_ipv4_enable,
 	.disable = nf_defrag_ipv4_disable,
+	.frag_tuple = nf_defrag4_frag_tuple,
 };
 
 static struct pernet_operations defrag4_net_ops = {
+	.init = defrag4_net_init,
 	.exit = defrag4_net_exit,
+	.id   = &nf_defrag4_pernet_id,
+	.size = sizeof(struct nf_defrag4_pernet),
 };
 
 static int __init nf_defrag_init(void)
 {
+	unsigned int i;
 	int err;
 
+	/* virtual reassembly is an option, run without it if short */
+	nf_defrag4_virt_tab = kvcalloc(NF_DEFRAG4_VIRT_SIZE,
+				       sizeof(*nf_defrag4_virt_tab),
+				       GFP_KERNEL);
+	for (i = 0; nf_defrag4_virt_tab && i < NF_DEFRAG4_VIRT_SIZE; i++)
+		spin_lock_init(&nf_defrag4_virt_tab[i].lock);
+	nf_defrag4_virt_rnd = get_random_u32();
+
 	err = register_pernet_subsys(&defrag4_net_ops);
-	if (err)
+	if (err) {
+		kvfree(nf_defrag4_virt_tab);
 		return err;
+	}
 
 	rcu_assign_pointer(nf_defrag_v4_hook, &defrag_hook);
 	return err;
@@ -140,6 +495,8 @@ static void __exit nf_defrag_fini(void)
 {
 	rcu_assign_pointer(nf_defrag_v4_hook, NULL);
 	unregister_pernet_subsys(&defrag4_net_ops);
+	synchronize_rcu();
+	kvfree(nf_defrag4_virt_tab);
 }
 
 int nf_defrag_ipv4_enable(struct net *net)
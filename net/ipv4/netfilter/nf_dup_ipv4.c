@@ -12,6 +12,7 @@
 #include <linux/skbuff.h>
 #include <linux/netfilter.h>
 #include <net/checksum.h>
+#include <net/dst.h>
 #include <net/icmp.h>
 #include <net/ip.h>
 #include <net/route.h>
@@ -21,25 +22,89 @@
 #include <net/netfilter/nf_conntrack.h>
 #endif
 
+struct nf_dup_ipv4_cache __percpu *nf_dup_ipv4_cache_alloc(void)
+{
+	return alloc_percpu_gfp(struct nf_dup_ipv4_cache, GFP_KERNEL_ACCOUNT);
+}
+EXPORT_SYMBOL_GPL(nf_dup_ipv4_cache_alloc);
+
+void nf_dup_ipv4_cache_free(struct nf_dup_ipv4_cache __percpu *cache)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		dst_release(per_cpu_ptr(cache, cpu)->dst);
+	free_percpu(cache);
+}
+EXPORT_SYMBOL_GPL(nf_dup_ipv4_cache_free);
+
+/* Routes are checked against the route generation of the netns, bumped
+ * on every FIB change, so a cached route is never used after the FIB it
+ * was looked up in has changed.  Called with BHs disabled.
+ */
+static struct dst_entry *
+nf_dup_ipv4_cache_get(struct nf_dup_ipv4_cache __percpu *cache, __be32 gw,
+		      int oif, u8 tos)
+{
+	struct nf_dup_ipv4_cache *c = this_cpu_ptr(cache);
+	struct dst_entry *dst = c->dst;
+
+	if (!dst || c->gw != gw || c->oif != oif || c->tos != tos)
+		return NULL;
+
+	if (!dst_check(dst, 0)) {
+		c->dst = NULL;
+		dst_release(dst);
+		return NULL;
+	}
+
+	return dst_clone(dst);
+}
+
+static void nf_dup_ipv4_cache_set(struct nf_dup_ipv4_cache __percpu *cache,
+				  __be32 gw, int oif, u8 tos,
+				  struct dst_entry *dst)
+{
+	struct nf_dup_ipv4_cache *c = this_cpu_ptr(cache);
+
+	dst_release(c->dst);
+	c->dst = dst_clone(dst);
+	c->gw = gw;
+	c->oif = oif;
+	c->tos = tos;
+}
+
 static bool nf_dup_ipv4_route(struct net *net, struct sk_buff *skb,
-			      const struct in_addr *gw, int oif)
+			      const struct in_addr *gw, int oif,
+			      struct nf_dup_ipv4_cache __percpu *cache)
 {
 	const struct iphdr *iph = ip_hdr(skb);
+	u8 tos = inet_dscp_to_dsfield(ip4h_dscp(iph));
+	struct dst_entry *dst;
 	struct rtable *rt;
 	struct flowi4 fl4;
 
+	dst = cache ? nf_dup_ipv4_cache_get(cache, gw->s_addr, oif, tos) : NULL;
+	if (dst) {
+		rt = dst_rtable(dst);
+		goto out;
+	}
+
 	memset(&fl4, 0, sizeof(fl4));
 	if (oif != -1)
 		fl4.flowi4_oif = oif;
 
 	fl4.daddr = gw->s_addr;
-	fl4.flowi4_tos = inet_dscp_to_dsfield(ip4h_dscp(iph));
+	fl4.flowi4_tos = tos;
 	fl4.flowi4_scope = RT_SCOPE_UNIVERSE;
 	fl4.flowi4_flags = FLOWI_FLAG_KNOWN_NH;
 	rt = ip_route_output_key(net, &fl4);
 	if (IS_ERR(rt))
 		return false;
 
+	if (cache)
+		nf_dup_ipv4_cache_set(cache, gw->s_addr, oif, tos, &rt->dst);
+out:
 	skb_dst_drop(skb);
 	skb_dst_set(skb, &rt->dst);
 	skb->dev      = rt->dst.dev;
@@ -49,7 +114,8 @@ static bool nf_dup_ipv4_route(struct net *net, struct sk_buff *skb,
 }
 
 void nf_dup_ipv4(struct net *net, struct sk_buff *skb, unsigned int hooknum,
-		 const struct in_addr *gw, int oif)
+		 const struct in_addr *gw, int oif,
+		 struct nf_dup_ipv4_cache __percpu *cache)
 {
 	struct iphdr *iph;
 
@@ -85,7 +151,7 @@ void nf_dup_ipv4(struct net *net, struct sk_buff *skb, unsigned int hooknum,
 	    hooknum == NF_INET_LOCAL_IN)
 		--iph->ttl;
 
-	if (nf_dup_ipv4_route(net, skb, gw, oif)) {
+	if (nf_dup_ipv4_route(net, skb, gw, oif, cache)) {
 		current->in_nf_duplicate = true;
 		ip_local_out(net, skb->sk, skb);
 		current->in_nf_duplicate = false;
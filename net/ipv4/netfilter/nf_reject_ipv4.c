@@ -8,6 +8,7 @@
 #include <net/tcp.h>
 #include <net/route.h>
 #include <net/dst.h>
+#include <net/l3mdev.h>
 #include <net/netfilter/ipv4/nf_reject.h>
 #include <linux/netfilter_ipv4.h>
 #include <linux/netfilter_bridge.h>
@@ -235,6 +236,29 @@ static int nf_reject_fill_skb_dst(struct sk_buff *skb_in)
 	return 0;
 }
 
+/* nf_reject_fill_skb_dst() just looked the route to the sender up from its
+ * address only.  Without policy routing, marks, VRFs nor IPsec policies,
+ * ip_route_me_harder() would find the same one again.
+ */
+static bool nf_reject_dst_reusable(struct net *net, const struct sock *sk,
+				   const struct sk_buff *nskb)
+{
+	const struct dst_entry *dst = skb_dst(nskb);
+
+	if (sk || nskb->mark || dst->error ||
+	    l3mdev_master_ifindex(dst->dev))
+		return false;
+#ifdef CONFIG_IP_MULTIPLE_TABLES
+	if (net->ipv4.fib_has_custom_rules)
+		return false;
+#endif
+#ifdef CONFIG_XFRM
+	if (READ_ONCE(net->xfrm.policy_count[XFRM_POLICY_OUT]))
+		return false;
+#endif
+	return true;
+}
+
 /* Send RST reply */
 void nf_send_reset(struct net *net, struct sock *sk, struct sk_buff *oldskb,
 		   int hook)
@@ -268,7 +292,10 @@ void nf_send_reset(struct net *net, struct sock *sk, struct sk_buff *oldskb,
 	nf_reject_iphdr_put(nskb, oldskb, IPPROTO_TCP,
 			    ip4_dst_hoplimit(skb_dst(nskb)));
 	nf_reject_ip_tcphdr_put(nskb, oldskb, oth);
-	if (ip_route_me_harder(net, sk, nskb, RTN_UNSPEC))
+	if ((hook == NF_INET_PRE_ROUTING || hook == NF_INET_INGRESS) &&
+	    nf_reject_dst_reusable(net, sk, nskb))
+		skb_dst_set(nskb, dst_clone(skb_dst(oldskb)));
+	else if (ip_route_me_harder(net, sk, nskb, RTN_UNSPEC))
 		goto free_nskb;
 
 	/* "Never happens" */
@@ -312,6 +339,21 @@ void nf_send_reset(struct net *net, struct sock *sk, struct sk_buff *oldskb,
 }
 EXPORT_SYMBOL_GPL(nf_send_reset);
 
+/* icmp_send() drops what is over the global ICMP rate limit only once
+ * the route to the sender is known.  Under a scan, don't look it up for
+ * errors that would be dropped anyway.
+ */
+static bool nf_reject_icmp_allow(const struct sk_buff *skb_in)
+{
+	struct net *net = dev_net(skb_in->dev);
+
+	if (!(READ_ONCE(net->ipv4.sysctl_icmp_ratemask) &
+	      (1 << ICMP_DEST_UNREACH)))
+		return true;
+
+	return icmp_global_allow(net);
+}
+
 void nf_send_unreach(struct sk_buff *skb_in, int code, int hook)
 {
 	struct iphdr *iph = ip_hdr(skb_in);
@@ -322,7 +364,8 @@ void nf_send_unreach(struct sk_buff *skb_in, int code, int hook)
 		return;
 
 	if ((hook == NF_INET_PRE_ROUTING || hook == NF_INET_INGRESS) &&
-	    nf_reject_fill_skb_dst(skb_in) < 0)
+	    (!nf_reject_icmp_allow(skb_in) ||
+	     nf_reject_fill_skb_dst(skb_in) < 0))
 		return;
 
 	if (skb_csum_unnecessary(skb_in) ||
@@ -15,6 +15,7 @@
 struct nft_dup_ipv4 {
 	u8	sreg_addr;
 	u8	sreg_dev;
+	struct nf_dup_ipv4_cache __percpu *cache;
 };
 
 static void nft_dup_ipv4_eval(const struct nft_expr *expr,
@@ -27,7 +28,8 @@ static void nft_dup_ipv4_eval(const struct nft_expr *expr,
 	};
 	int oif = priv->sreg_dev ? regs->data[priv->sreg_dev] : -1;
 
-	nf_dup_ipv4(nft_net(pkt), pkt->skb, nft_hook(pkt), &gw, oif);
+	nf_dup_ipv4(nft_net(pkt), pkt->skb, nft_hook(pkt), &gw, oif,
+		    priv->cache);
 }
 
 static int nft_dup_ipv4_init(const struct nft_ctx *ctx,
@@ -45,11 +47,26 @@ static int nft_dup_ipv4_init(const struct nft_ctx *ctx,
 	if (err < 0)
 		return err;
 
-	if (tb[NFTA_DUP_SREG_DEV])
+	if (tb[NFTA_DUP_SREG_DEV]) {
 		err = nft_parse_register_load(ctx, tb[NFTA_DUP_SREG_DEV],
 					      &priv->sreg_dev, sizeof(int));
+		if (err < 0)
+			return err;
+	}
 
-	return err;
+	priv->cache = nf_dup_ipv4_cache_alloc();
+	if (!priv->cache)
+		return -ENOMEM;
+
+	return 0;
+}
+
+static void nft_dup_ipv4_destroy(const struct nft_ctx *ctx,
+				 const struct nft_expr *expr)
+{
+	struct nft_dup_ipv4 *priv = nft_expr_priv(expr);
+
+	nf_dup_ipv4_cache_free(priv->cache);
 }
 
 static int nft_dup_ipv4_dump(struct sk_buff *skb,
@@ -75,6 +92,7 @@ static const struct nft_expr_ops nft_dup_ipv4_ops = {
 	.size		= NFT_EXPR_SIZE(sizeof(struct nft_dup_ipv4)),
 	.eval		= nft_dup_ipv4_eval,
 	.init		= nft_dup_ipv4_init,
+	.destroy	= nft_dup_ipv4_destroy,
 	.dump		= nft_dup_ipv4_dump,
 	.reduce		= NFT_REDUCE_READONLY,
 };
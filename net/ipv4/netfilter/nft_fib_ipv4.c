@@ -2,6 +2,8 @@
 
 #include <linux/kernel.h>
 #include <linux/init.h>
+#include <linux/jhash.h>
+#include <linux/local_lock.h>
 #include <linux/module.h>
 #include <linux/netlink.h>
 #include <linux/netfilter.h>
@@ -15,6 +17,110 @@
 #include <net/ip_fib.h>
 #include <net/route.h>
 
+#define NFT_FIB4_CACHE_SIZE	128
+
+struct nft_fib4_cache_key {
+	u64		net_cookie;
+	__be32		daddr;
+	__be32		saddr;
+	int		iif;
+	int		oif;
+	int		l3mdev;
+	u32		mark;
+	u8		tos;
+	u8		proto;
+};
+
+/* Result of a route lookup, valid as long as the route generation of the
+ * netns doesn't change.  @found is the ifindex of the device stored into
+ * the register, 0 if none.
+ */
+struct nft_fib4_cache_ent {
+	struct nft_fib4_cache_key	key;
+	int				genid;
+	int				found;
+};
+
+struct nft_fib4_cache {
+	struct nft_fib4_cache_ent	ent[NFT_FIB4_CACHE_SIZE];
+	local_lock_t			bh_lock;
+};
+
+static DEFINE_PER_CPU(struct nft_fib4_cache, nft_fib4_cache) = {
+	.bh_lock = INIT_LOCAL_LOCK(bh_lock),
+};
+
+static void nft_fib4_cache_key(struct nft_fib4_cache_key *key,
+			       const struct nft_pktinfo *pkt,
+			       const struct flowi4 *fl4,
+			       const struct net_device *oif)
+{
+	memset(key, 0, sizeof(*key));
+	key->net_cookie = nft_net(pkt)->net_cookie;
+	key->daddr = fl4->daddr;
+	key->saddr = fl4->saddr;
+	key->iif = fl4->flowi4_iif;
+	key->oif = oif ? oif->ifindex : 0;
+	key->l3mdev = fl4->flowi4_l3mdev;
+	key->mark = fl4->flowi4_mark;
+	key->tos = fl4->flowi4_tos;
+	key->proto = fl4->flowi4_proto;
+}
+
+static u32 nft_fib4_cache_slot(const struct nft_fib4_cache_key *key)
+{
+	return jhash(key, sizeof(*key), 0) % NFT_FIB4_CACHE_SIZE;
+}
+
+/* Returns true and sets *@found on a hit.  A device that went away since
+ * is a miss, as long as its routes are not flushed yet.
+ */
+static bool nft_fib4_cache_get(const struct nft_pktinfo *pkt,
+			       const struct nft_fib4_cache_key *key,
+			       const struct net_device *oif,
+			       const struct net_device **found)
+{
+	struct nft_fib4_cache_ent *ent;
+	int ifindex = -1;
+
+	local_bh_disable();
+	local_lock_nested_bh(&nft_fib4_cache.bh_lock);
+	ent = this_cpu_ptr(&nft_fib4_cache.ent[nft_fib4_cache_slot(key)]);
+	if (ent->genid == rt_genid_ipv4(nft_net(pkt)) &&
+	    !memcmp(&ent->key, key, sizeof(*key)))
+		ifindex = ent->found;
+	local_unlock_nested_bh(&nft_fib4_cache.bh_lock);
+	local_bh_enable();
+
+	if (ifindex < 0)
+		return false;
+
+	if (!ifindex)
+		*found = NULL;
+	else if (oif)
+		*found = oif;
+	else
+		*found = dev_get_by_index_rcu(nft_net(pkt), ifindex);
+
+	return !ifindex || *found;
+}
+
+static void nft_fib4_cache_set(const struct nft_pktinfo *pkt,
+			       const struct nft_fib4_cache_key *key,
+			       int genid, const struct net_device *found)
+{
+	struct nft_fib4_cache_ent *ent;
+
+	local_bh_disable();
+	local_lock_nested_bh(&nft_fib4_cache.bh_lock);
+	ent = this_cpu_ptr(&nft_fib4_cache.ent[nft_fib4_cache_slot(key)]);
+	ent->key = *key;
+	ent->genid = genid;
+	ent->found = found ? found->ifindex : 0;
+	local_unlock_nested_bh(&nft_fib4_cache.bh_lock);
+	local_bh_enable();
+}
+
 /* don't try to find route from mcast/bcast/zeronet */
 static __be32 get_saddr(__be32 addr)
 {
@@ -73,8 +179,11 @@ void nft_fib4_eval(const struct nft_expr *expr, struct nft_regs *regs,
 		.flowi4_proto = pkt->tprot,
 		.flowi4_uid = sock_net_uid(nft_net(pkt), NULL),
 	};
+	const struct net_device *found = NULL;
+	struct nft_fib4_cache_key key;
 	const struct net_device *oif;
-	const struct net_device *found;
+	int genid = 0;
+	bool cache;
 
 	if (nft_fib_can_skip(pkt)) {
 		nft_fib_store_result(dest, priv, nft_in(pkt));
@@ -130,14 +239,24 @@ void nft_fib4_eval(const struct nft_expr *expr, struct nft_regs *regs,
 
 	*dest = 0;
 
+	cache = READ_ONCE(nft_fib_cache);
+	if (cache) {
+		nft_fib4_cache_key(&key, pkt, &fl4, oif);
+		if (nft_fib4_cache_get(pkt, &key, oif, &found))
+			goto out;
+
+		/* read first, a flush racing with the lookup invalidates it */
+		genid = rt_genid_ipv4(nft_net(pkt));
+	}
+
 	if (fib_lookup(nft_net(pkt), &fl4, &res, FIB_LOOKUP_IGNORE_LINKSTATE))
-		return;
+		goto out_cache;
 
 	switch (res.type) {
 	case RTN_UNICAST:
 		break;
 	case RTN_LOCAL: /* Should not see RTN_LOCAL here */
-		return;
+		goto out_cache;
 	default:
 		break;
 	}
@@ -146,10 +265,14 @@ void nft_fib4_eval(const struct nft_expr *expr, struct nft_regs *regs,
 		found = FIB_RES_DEV(res);
 	} else {
 		if (!fib_info_nh_uses_dev(res.fi, oif))
-			return;
+			goto out_cache;
 		found = oif;
 	}
 
+out_cache:
+	if (cache)
+		nft_fib4_cache_set(pkt, &key, genid, found);
+out:
 	nft_fib_store_result(dest, priv, found);
 }
 EXPORT_SYMBOL_GPL(nft_fib4_eval);
@@ -67,13 +67,21 @@ static struct sk_buff *__tcpv4_gso_segment_list_csum(struct sk_buff *segs)
 	iph2 = ip_hdr(seg->next);
 
 	if (!(*(const u32 *)&th->source ^ *(const u32 *)&th2->source) &&
-	    iph->daddr == iph2->daddr && iph->saddr == iph2->saddr)
+	    iph->daddr == iph2->daddr && iph->saddr == iph2->saddr &&
+	    iph->ttl == iph2->ttl)
 		return segs;
 
 	while ((seg = seg->next)) {
 		th2 = tcp_hdr(seg);
 		iph2 = ip_hdr(seg);
 
+		/* forwarded, only the head had its ttl decremented */
+		if (iph2->ttl != iph->ttl) {
+			csum_replace2(&iph2->check, htons(iph2->ttl << 8),
+				      htons(iph->ttl << 8));
+			iph2->ttl = iph->ttl;
+		}
+
 		__tcpv4_gso_segment_csum(seg,
 					 &iph2->saddr, iph->saddr,
 					 &th2->source, th->source);
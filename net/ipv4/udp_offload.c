@@ -385,13 +385,21 @@ static struct sk_buff *__udpv4_gso_segment_list_csum(struct sk_buff *segs)
 	if ((udp_hdr(seg)->dest == udp_hdr(seg->next)->dest) &&
 	    (udp_hdr(seg)->source == udp_hdr(seg->next)->source) &&
 	    (ip_hdr(seg)->daddr == ip_hdr(seg->next)->daddr) &&
-	    (ip_hdr(seg)->saddr == ip_hdr(seg->next)->saddr))
+	    (ip_hdr(seg)->saddr == ip_hdr(seg->next)->saddr) &&
+	    (ip_hdr(seg)->ttl == ip_hdr(seg->next)->ttl))
 		return segs;
 
 	while ((seg = seg->next)) {
 		uh2 = udp_hdr(seg);
 		iph2 = ip_hdr(seg);
 
+		/* forwarded, only the head had its ttl decremented */
+		if (iph2->ttl != iph->ttl) {
+			csum_replace2(&iph2->check, htons(iph2->ttl << 8),
+				      htons(iph->ttl << 8));
+			iph2->ttl = iph->ttl;
+		}
+
 		__udpv4_gso_segment_csum(seg,
 					 &iph2->saddr, &iph->saddr,
 					 &uh2->source, &uh->source);
@@ -443,13 +451,16 @@ static struct sk_buff *__udpv6_gso_segment_list_csum(struct sk_buff *segs)
 
 	if (!(*(const u32 *)&uh->source ^ *(const u32 *)&uh2->source) &&
 	    ipv6_addr_equal(&iph->saddr, &iph2->saddr) &&
-	    ipv6_addr_equal(&iph->daddr, &iph2->daddr))
+	    ipv6_addr_equal(&iph->daddr, &iph2->daddr) &&
+	    iph->hop_limit == iph2->hop_limit)
 		return segs;
 
 	while ((seg = seg->next)) {
 		uh2 = udp_hdr(seg);
 		iph2 = ipv6_hdr(seg);
 
+		iph2->hop_limit = iph->hop_limit;
+
 		__udpv6_gso_segment_csum(seg, &iph2->saddr, &iph->saddr,
 					 &uh2->source, uh->source);
 		__udpv6_gso_segment_csum(seg, &iph2->daddr, &iph->daddr,
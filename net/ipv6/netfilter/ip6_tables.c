@@ -754,49 +754,47 @@ translate_table(struct net *net, struct xt_table_info *newinfo, void *entry0,
 
 static void
 get_counters(const struct xt_table_info *t,
+	     unsigned int first, unsigned int last,
 	     struct xt_counters counters[])
 {
+	struct ip6t_entry *start = (void *)t->entries;
 	struct ip6t_entry *iter;
-	unsigned int cpu;
-	unsigned int i;
+	unsigned int cpu, i;
 
-	for_each_possible_cpu(cpu) {
-		seqcount_t *s = &per_cpu(xt_recseq, cpu);
+	for (i = 0; i < first; i++)
+		start = ip6t_next_entry(start);
 
-		i = 0;
-		xt_entry_foreach(iter, t->entries, t->size) {
-			struct xt_counters *tmp;
+	for_each_possible_cpu(cpu) {
+		iter = start;
+		for (i = first; i < last; i++, iter = ip6t_next_entry(iter)) {
 			u64 bcnt, pcnt;
-			unsigned int start;
-
-			tmp = xt_get_per_cpu_counter(&iter->counters, cpu);
-			do {
-				start = read_seqcount_begin(s);
-				bcnt = tmp->bcnt;
-				pcnt = tmp->pcnt;
-			} while (read_seqcount_retry(s, start));
 
+			xt_fetch_per_cpu_counter(&iter->counters, cpu,
+						 &bcnt, &pcnt);
 			ADD_COUNTER(counters[i], bcnt, pcnt);
-			++i;
 			cond_resched();
 		}
 	}
 }
 
-static void get_old_counters(const struct xt_table_info *t,
-			     struct xt_counters counters[])
+static void get_old_counters_range(const struct xt_table_info *t,
+				   unsigned int first, unsigned int last,
+				   struct xt_counters counters[])
 {
+	struct ip6t_entry *start = (void *)t->entries;
 	struct ip6t_entry *iter;
 	unsigned int cpu, i;
 
+	for (i = 0; i < first; i++)
+		start = ip6t_next_entry(start);
+
 	for_each_possible_cpu(cpu) {
-		i = 0;
-		xt_entry_foreach(iter, t->entries, t->size) {
+		iter = start;
+		for (i = first; i < last; i++, iter = ip6t_next_entry(iter)) {
 			const struct xt_counters *tmp;
 
 			tmp = xt_get_per_cpu_counter(&iter->counters, cpu);
 			ADD_COUNTER(counters[i], tmp->bcnt, tmp->pcnt);
-			++i;
 		}
 		cond_resched();
 	}
@@ -817,7 +815,7 @@ static struct xt_counters *alloc_counters(const struct xt_table *table)
 	if (counters == NULL)
 		return ERR_PTR(-ENOMEM);
 
-	get_counters(private, counters);
+	xt_harvest_counters(private, counters, get_counters);
 
 	return counters;
 }
@@ -1092,7 +1090,7 @@ __do_replace(struct net *net, const char *name, unsigned int valid_hooks,
 
 	xt_table_unlock(t);
 
-	get_old_counters(oldinfo, counters);
+	xt_harvest_counters(oldinfo, counters, get_old_counters_range);
 
 	/* Decrease module usage counts and free resource */
 	xt_entry_foreach(iter, oldinfo->entries, oldinfo->size)
@@ -29,6 +29,8 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <net/netfilter/ipv6/nf_defrag_ipv6.h>
+#include <net/netfilter/nf_conntrack_tuple.h>
+#include <net/netfilter/nf_conntrack_zones.h>
 #include <net/netns/generic.h>
 
 static const char nf_frags_cache_name[] = "nf-frags";
@@ -62,6 +64,14 @@ static struct ctl_table nf_ct_frag6_sysctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= proc_doulongvec_minmax,
 	},
+	{
+		.procname	= "nf_conntrack_frag6_virtual",
+		.maxlen		= sizeof(u8),
+		.mode		= 0644,
+		.proc_handler	= proc_dou8vec_minmax,
+		.extra1		= SYSCTL_ZERO,
+		.extra2		= SYSCTL_ONE,
+	},
 };
 
 static int nf_ct_frag6_sysctl_register(struct net *net)
@@ -85,6 +95,7 @@ static int nf_ct_frag6_sysctl_register(struct net *net)
 	table[1].extra2	= &nf_frag->fqdir->high_thresh;
 	table[2].data	= &nf_frag->fqdir->high_thresh;
 	table[2].extra1	= &nf_frag->fqdir->low_thresh;
+	table[3].data	= &nf_frag->virtual_reasm;
 
 	hdr = register_net_sysctl_sz(net, "net/netfilter", table,
 				     ARRAY_SIZE(nf_ct_frag6_sysctl_table));
@@ -141,23 +152,57 @@ static void nf_ct_frag6_expire(struct timer_list *t)
 	ip6frag_expire_frag_queue(fq->q.fqdir->net, fq);
 }
 
+/* Byte ranges of a datagram forwarded by virtual reassembly, to tell
+ * overlapping and duplicate fragments.  Adjacent ranges are merged, the
+ * fragments of a datagram received in order keep a single one.
+ */
+#define NF_CT_FRAG6_VIRT_RANGES	8
+
+struct nf_ct_frag6_virt {
+	struct nf_conntrack_tuple	tuple;
+	unsigned int			len;	/* 0 until the last fragment */
+	unsigned int			pending; /* not looked up by conntrack yet */
+	bool				dropped;
+	u8				nranges;
+	struct {
+		u16			start;
+		u16			end;
+	}				ranges[NF_CT_FRAG6_VIRT_RANGES];
+};
+
+static void nf_ct_frag6_destroy(struct inet_frag_queue *q)
+{
+	struct frag_queue *fq = container_of(q, struct frag_queue, q);
+
+	if (fq->virt) {
+		sub_frag_mem_limit(q->fqdir, sizeof(*fq->virt));
+		kfree(fq->virt);
+	}
+}
+
+static void fq_key(struct frag_v6_compare_key *key, __be32 id, u32 user,
+		   const struct ipv6hdr *hdr, int iif)
+{
+	key->id = id;
+	key->saddr = hdr->saddr;
+	key->daddr = hdr->daddr;
+	key->user = user;
+	key->iif = iif;
+
+	if (!(ipv6_addr_type(&hdr->daddr) & (IPV6_ADDR_MULTICAST |
+					    IPV6_ADDR_LINKLOCAL)))
+		key->iif = 0;
+}
+
 /* Creation primitives. */
 static struct frag_queue *fq_find(struct net *net, __be32 id, u32 user,
 				  const struct ipv6hdr *hdr, int iif)
 {
 	struct nft_ct_frag6_pernet *nf_frag = nf_frag_pernet(net);
-	struct frag_v6_compare_key key = {
-		.id = id,
-		.saddr = hdr->saddr,
-		.daddr = hdr->daddr,
-		.user = user,
-		.iif = iif,
-	};
+	struct frag_v6_compare_key key = {};
 	struct inet_frag_queue *q;
 
-	if (!(ipv6_addr_type(&hdr->daddr) & (IPV6_ADDR_MULTICAST |
-					    IPV6_ADDR_LINKLOCAL)))
-		key.iif = 0;
+	fq_key(&key, id, user, hdr, iif);
 
 	q = inet_frag_find(nf_frag->fqdir, &key);
 	if (!q)
@@ -393,7 +438,8 @@ static int nf_ct_frag6_reasm(struct frag_queue *fq, struct sk_buff *skb,
  *
  */
 static int
-find_prev_fhdr(struct sk_buff *skb, u8 *prevhdrp, int *prevhoff, int *fhoff)
+find_prev_fhdr(const struct sk_buff *skb, u8 *prevhdrp, int *prevhoff,
+	       int *fhoff)
 {
 	u8 nexthdr = ipv6_hdr(skb)->nexthdr;
 	const int netoff = skb_network_offset(skb);
@@ -442,8 +488,197 @@ find_prev_fhdr(struct sk_buff *skb, u8 *prevhdrp, int *prevhoff, int *fhoff)
 	return 0;
 }
 
+/* Record the bytes of a fragment: -EINVAL for one overlapping those
+ * already seen, the datagram must be discarded (RFC 5722), -EEXIST for a
+ * duplicate, only the fragment is.
+ */
+static int nf_ct_frag6_virt_add(struct nf_ct_frag6_virt *virt,
+				unsigned int offset, unsigned int end, bool last)
+{
+	unsigned int i, n = virt->nranges;
+	bool prev, next;
+
+	if (end <= offset || end > IPV6_MAXPLEN)
+		return -EINVAL;
+
+	if (last) {
+		if (virt->len ? end != virt->len :
+		    n && virt->ranges[n - 1].end > end)
+			return -EINVAL;
+	} else if (end & 0x7 || (virt->len && end > virt->len)) {
+		return -EINVAL;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (offset >= virt->ranges[i].start &&
+		    end <= virt->ranges[i].end)
+			return -EEXIST;
+		if (offset < virt->ranges[i].end &&
+		    end > virt->ranges[i].start)
+			return -EINVAL;
+	}
+
+	for (i = 0; i < n && virt->ranges[i].start < offset; i++)
+		;
+
+	prev = i > 0 && virt->ranges[i - 1].end == offset;
+	next = i < n && virt->ranges[i].start == end;
+	if (prev && next) {
+		virt->ranges[i - 1].end = virt->ranges[i].end;
+		memmove(&virt->ranges[i], &virt->ranges[i + 1],
+			(n - i - 1) * sizeof(virt->ranges[0]));
+		virt->nranges--;
+	} else if (prev) {
+		virt->ranges[i - 1].end = end;
+	} else if (next) {
+		virt->ranges[i].start = offset;
+	} else {
+		/* too many holes, give up on this datagram */
+		if (n == NF_CT_FRAG6_VIRT_RANGES)
+			return -EINVAL;
+
+		memmove(&virt->ranges[i + 1], &virt->ranges[i],
+			(n - i) * sizeof(virt->ranges[0]));
+		virt->ranges[i].start = offset;
+		virt->ranges[i].end = end;
+		virt->nranges++;
+	}
+
+	if (last)
+		virt->len = end;
+
+	return 0;
+}
+
+static bool nf_ct_frag6_virt_complete(const struct nf_ct_frag6_virt *virt)
+{
+	return virt->len && virt->nranges == 1 &&
+	       virt->ranges[0].start == 0 && virt->ranges[0].end == virt->len;
+}
+
+/* Virtual reassembly: the fragments of a datagram that belongs to a known
+ * connection go on as they are instead of being reassembled and fragmented
+ * again on output.  The first fragment goes through conntrack as any
+ * packet with a transport header, the queue keeps its tuple and conntrack
+ * looks the others up by it, in the zone it finds then, through
+ * nf_ct_frag6_tuple().  No reference to the entry is held.
+ *
+ * Only when the first fragment is the first to arrive: in any other case,
+ * or if it starts a new connection, the datagram is reassembled so that
+ * conntrack sees it whole.
+ */
+static int nf_ct_frag6_virtual(struct net *net, struct frag_queue *fq,
+			       struct sk_buff *skb,
+			       const struct frag_hdr *fhdr, u32 user)
+{
+	struct nf_ct_frag6_virt *virt = fq->virt;
+	const struct nf_ct_hook *ct_hook;
+	struct nf_conntrack_zone zone;
+	unsigned int payload_len;
+	int offset, end, err;
+
+	payload_len = ntohs(ipv6_hdr(skb)->payload_len);
+	offset = ntohs(fhdr->frag_off) & ~0x7;
+	end = offset + (payload_len -
+			((u8 *)(fhdr + 1) - (u8 *)(ipv6_hdr(skb) + 1)));
+
+	if (!virt) {
+		if (fq->q.flags || fq->q.meat || offset ||
+		    user < IP6_DEFRAG_CONNTRACK_IN ||
+		    user > __IP6_DEFRAG_CONNTRACK_IN)
+			return -EAGAIN;
+
+		ct_hook = rcu_dereference(nf_ct_hook);
+		if (!ct_hook)
+			return -EAGAIN;
+
+		virt = kzalloc(sizeof(*virt), GFP_ATOMIC);
+		if (!virt)
+			return -EAGAIN;
+
+		/* the zone of a template attached before defragmentation */
+		nf_ct_zone_init(&zone, user - IP6_DEFRAG_CONNTRACK_IN,
+				NF_CT_DEFAULT_ZONE_DIR, 0);
+		if (!ct_hook->frag_known(net, &zone, skb, &virt->tuple)) {
+			kfree(virt);
+			return -EAGAIN;
+		}
+
+		add_frag_mem_limit(fq->q.fqdir, sizeof(*virt));
+		fq->virt = virt;
+	}
+
+	if (virt->dropped)
+		return -EINVAL;
+
+	err = nf_ct_frag6_virt_add(virt, offset, end,
+				   !(fhdr->frag_off & htons(IP6_MF)));
+	if (err == -EINVAL)
+		virt->dropped = true;
+	if (err)
+		return -EINVAL;
+
+	if (offset)
+		virt->pending++;
+
+	return 0;
+}
+
+/* Tuple of a fragment without transport header forwarded by virtual
+ * reassembly, looked up from nf_conntrack_in().  The queue goes once the
+ * datagram is complete and each of its fragments has been looked up.
+ */
+bool nf_ct_frag6_tuple(struct net *net, const struct sk_buff *skb, u32 user,
+		       struct nf_conntrack_tuple *tuple)
+{
+	struct nft_ct_frag6_pernet *nf_frag = nf_frag_pernet(net);
+	struct frag_v6_compare_key key = {};
+	const struct frag_hdr *fhdr;
+	struct nf_ct_frag6_virt *virt;
+	struct inet_frag_queue *q;
+	struct frag_hdr _fhdr;
+	int nhoff, fhoff;
+	bool found = false;
+	int refs = 0;
+	u8 prevhdr;
+
+	if (!READ_ONCE(nf_frag->virtual_reasm) ||
+	    find_prev_fhdr(skb, &prevhdr, &nhoff, &fhoff) < 0)
+		return false;
+
+	fhdr = skb_header_pointer(skb, fhoff, sizeof(_fhdr), &_fhdr);
+	if (!fhdr)
+		return false;
+
+	fq_key(&key, fhdr->identification, user, ipv6_hdr(skb),
+	       skb->dev ? skb->dev->ifindex : 0);
+
+	/* rcu_read_lock()ed by nf_hook_thresh */
+	q = rhashtable_lookup(&nf_frag->fqdir->rhashtable, &key,
+			      nf_frags.rhash_params);
+	if (!q)
+		return false;
+
+	spin_lock_bh(&q->lock);
+	virt = container_of(q, struct frag_queue, q)->virt;
+	if (virt && !virt->dropped && !(q->flags & INET_FRAG_COMPLETE)) {
+		*tuple = virt->tuple;
+		found = true;
+
+		if (virt->pending)
+			virt->pending--;
+		if (!virt->pending && nf_ct_frag6_virt_complete(virt))
+			inet_frag_kill(q, &refs);
+	}
+	spin_unlock_bh(&q->lock);
+	inet_frag_putn(q, refs);
+
+	return found;
+}
+
 int nf_ct_frag6_gather(struct net *net, struct sk_buff *skb, u32 user)
 {
+	struct nft_ct_frag6_pernet *nf_frag = nf_frag_pernet(net);
 	u16 savethdr = skb->transport_header;
 	u8 nexthdr = NEXTHDR_FRAGMENT;
 	int fhoff, nhoff, ret;
@@ -488,7 +723,14 @@ int nf_ct_frag6_gather(struct net *net, struct sk_buff *skb, u32 user)
 
 	spin_lock_bh(&fq->q.lock);
 
-	ret = nf_ct_frag6_queue(fq, skb, fhdr, nhoff, &refs);
+	ret = -EAGAIN;
+	if (READ_ONCE(nf_frag->virtual_reasm))
+		ret = nf_ct_frag6_virtual(net, fq, skb, fhdr, user);
+
+	if (ret == -EAGAIN)
+		ret = nf_ct_frag6_queue(fq, skb, fhdr, nhoff, &refs);
+	else
+		skb->transport_header = savethdr;
 	if (ret == -EPROTO) {
 		skb->transport_header = savethdr;
 		ret = 0;
@@ -556,7 +798,7 @@ int nf_ct_frag6_init(void)
 	int ret = 0;
 
 	nf_frags.constructor = ip6frag_init;
-	nf_frags.destructor = NULL;
+	nf_frags.destructor = nf_ct_frag6_destroy;
 	nf_frags.qsize = sizeof(struct frag_queue);
 	nf_frags.frag_expire = nf_ct_frag6_expire;
 	nf_frags.frags_cache_name = nf_frags_cache_name;
@@ -29,7 +29,7 @@
 static DEFINE_MUTEX(defrag6_mutex);
 
 static enum ip6_defrag_users nf_ct6_defrag_user(unsigned int hooknum,
-						struct sk_buff *skb)
+						const struct sk_buff *skb)
 {
 	u16 zone_id = NF_CT_DEFAULT_ZONE_ID;
 #if IS_ENABLED(CONFIG_NF_CONNTRACK)
@@ -97,10 +97,31 @@ static void __net_exit defrag6_net_exit(struct net *net)
 	}
 }
 
+/* Called by conntrack for fragments without transport header.  A datagram
+ * queued without template may get one from the raw rules.
+ */
+static bool nf_defrag6_frag_tuple(const struct nf_hook_state *state,
+				  const struct sk_buff *skb, u16 zone_id,
+				  struct nf_conntrack_tuple *tuple)
+{
+	if (state->hook != NF_INET_PRE_ROUTING || nf_bridge_in_prerouting(skb))
+		return false;
+
+	if (nf_ct_frag6_tuple(state->net, skb,
+			      IP6_DEFRAG_CONNTRACK_IN + zone_id, tuple))
+		return true;
+
+	return zone_id != NF_CT_DEFAULT_ZONE_ID &&
+	       nf_ct_frag6_tuple(state->net, skb,
+				 IP6_DEFRAG_CONNTRACK_IN + NF_CT_DEFAULT_ZONE_ID,
+				 tuple);
+}
+
 static const struct nf_defrag_hook defrag_hook = {
 	.owner = THIS_MODULE,
 	.enable = nf_defrag_ipv6_enable,
 	.disable = nf_defrag_ipv6_disable,
+	.frag_tuple = nf_defrag6_frag_tuple,
 };
 
 static struct pernet_operations defrag6_net_ops = {
@@ -131,13 +131,16 @@ static struct sk_buff *__tcpv6_gso_segment_list_csum(struct sk_buff *segs)
 
 	if (!(*(const u32 *)&th->source ^ *(const u32 *)&th2->source) &&
 	    ipv6_addr_equal(&iph->saddr, &iph2->saddr) &&
-	    ipv6_addr_equal(&iph->daddr, &iph2->daddr))
+	    ipv6_addr_equal(&iph->daddr, &iph2->daddr) &&
+	    iph->hop_limit == iph2->hop_limit)
 		return segs;
 
 	while ((seg = seg->next)) {
 		th2 = tcp_hdr(seg);
 		iph2 = ipv6_hdr(seg);
 
+		iph2->hop_limit = iph->hop_limit;
+
 		__tcpv6_gso_segment_csum(seg, &iph2->saddr, &iph->saddr,
 					 &th2->source, th->source);
 		__tcpv6_gso_segment_csum(seg, &iph2->daddr, &iph->daddr,
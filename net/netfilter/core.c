@@ -22,12 +22,25 @@
 #include <linux/mutex.h>
 #include <linux/mm.h>
 #include <linux/rcupdate.h>
+#include <linux/percpu.h>
+#include <linux/static_call.h>
+#include <linux/sysctl.h>
+#include <linux/timex.h>
+#include <linux/sched/clock.h>
 #include <net/net_namespace.h>
 #include <net/netfilter/nf_queue.h>
 #include <net/sock.h>
+#include <net/neighbour.h>
 
 #include "nf_internals.h"
 
+#define CREATE_TRACE_POINTS
+#include <trace/events/netfilter.h>
+
+EXPORT_TRACEPOINT_SYMBOL_GPL(nf_ct_lookup);
+EXPORT_TRACEPOINT_SYMBOL_GPL(nft_set_lookup);
+EXPORT_TRACEPOINT_SYMBOL_GPL(nf_nat_unique_tuple);
+
 const struct nf_ipv6_ops __rcu *nf_ipv6_ops __read_mostly;
 EXPORT_SYMBOL_GPL(nf_ipv6_ops);
 
@@ -56,8 +69,19 @@ static struct nf_hook_entries *allocate_hook_entries_size(u16 num)
 		return NULL;
 
 	e = kvzalloc(alloc, GFP_KERNEL_ACCOUNT);
-	if (e)
-		e->num_hook_entries = num;
+	if (!e)
+		return NULL;
+
+#ifdef CONFIG_NETFILTER_HOOK_STATS
+	e->stats = __alloc_percpu_gfp(sizeof(struct nf_hook_entry_stats) * num,
+				      __alignof__(struct nf_hook_entry_stats),
+				      GFP_KERNEL_ACCOUNT);
+	if (!e->stats) {
+		kvfree(e);
+		return NULL;
+	}
+#endif
+	e->num_hook_entries = num;
 	return e;
 }
 
@@ -66,9 +90,57 @@ static void __nf_hook_entries_free(struct rcu_head *h)
 	struct nf_hook_entries_rcu_head *head;
 
 	head = container_of(h, struct nf_hook_entries_rcu_head, head);
+#ifdef CONFIG_NETFILTER_HOOK_STATS
+	free_percpu(((struct nf_hook_entries *)head->allocation)->stats);
+#endif
 	kvfree(head->allocation);
 }
 
+#ifdef CONFIG_NETFILTER_HOOK_STATS
+DEFINE_STATIC_KEY_FALSE(nf_hook_stats_enabled);
+EXPORT_SYMBOL_GPL(nf_hook_stats_enabled);
+
+/* A new blob replaces the old one on each (un)registration: carry the
+ * counters of a hook over, updates racing with this are lost.
+ */
+static void nf_hook_entry_stats_move(struct nf_hook_entries *new,
+				     unsigned int j,
+				     const struct nf_hook_entries *old,
+				     unsigned int i)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		*per_cpu_ptr(&new->stats[j], cpu) =
+			*per_cpu_ptr(&old->stats[i], cpu);
+}
+
+void nf_hook_entry_stats_get(const struct nf_hook_entries *e, unsigned int i,
+			     struct nf_hook_entry_stats *sum)
+{
+	int cpu;
+
+	sum->packets = 0;
+	sum->cycles = 0;
+
+	for_each_possible_cpu(cpu) {
+		const struct nf_hook_entry_stats *stats;
+
+		stats = per_cpu_ptr(&e->stats[i], cpu);
+		sum->packets += READ_ONCE(stats->packets);
+		sum->cycles += READ_ONCE(stats->cycles);
+	}
+}
+EXPORT_SYMBOL_GPL(nf_hook_entry_stats_get);
+#else
+static void nf_hook_entry_stats_move(struct nf_hook_entries *new,
+				     unsigned int j,
+				     const struct nf_hook_entries *old,
+				     unsigned int i)
+{
+}
+#endif
+
 static void nf_hook_entries_free(struct nf_hook_entries *e)
 {
 	struct nf_hook_entries_rcu_head *head;
@@ -97,6 +169,150 @@ static const struct nf_hook_ops dummy_ops = {
 	.priority = INT_MIN,
 };
 
+#ifdef CONFIG_MITIGATION_RETPOLINE
+/* Hook functions are called through a static call, i.e. without a
+ * retpoline, if they have one of these slots.  The slots are handed out
+ * to the first hook functions registered, which in practice are the
+ * defrag, conntrack, nf_tables and nat ones.  Others are called
+ * indirectly.
+ */
+#define NF_HOOK_DIRECT_CALLS	8
+
+static struct static_key_false nf_hook_skip_direct_calls;
+
+static nf_hookfn *nf_hook_direct_fn[NF_HOOK_DIRECT_CALLS] __read_mostly;
+
+static struct {
+	unsigned int	users;
+	unsigned long	gp_state;	/* grace period since release */
+} nf_hook_direct[NF_HOOK_DIRECT_CALLS];
+
+static DEFINE_MUTEX(nf_hook_direct_mutex);
+
+DEFINE_STATIC_CALL_NULL(nf_hook_direct0, accept_all);
+DEFINE_STATIC_CALL_NULL(nf_hook_direct1, accept_all);
+DEFINE_STATIC_CALL_NULL(nf_hook_direct2, accept_all);
+DEFINE_STATIC_CALL_NULL(nf_hook_direct3, accept_all);
+DEFINE_STATIC_CALL_NULL(nf_hook_direct4, accept_all);
+DEFINE_STATIC_CALL_NULL(nf_hook_direct5, accept_all);
+DEFINE_STATIC_CALL_NULL(nf_hook_direct6, accept_all);
+DEFINE_STATIC_CALL_NULL(nf_hook_direct7, accept_all);
+
+static void nf_hook_direct_update(unsigned int i, nf_hookfn *fn)
+{
+	switch (i) {
+	case 0: static_call_update(nf_hook_direct0, fn); break;
+	case 1: static_call_update(nf_hook_direct1, fn); break;
+	case 2: static_call_update(nf_hook_direct2, fn); break;
+	case 3: static_call_update(nf_hook_direct3, fn); break;
+	case 4: static_call_update(nf_hook_direct4, fn); break;
+	case 5: static_call_update(nf_hook_direct5, fn); break;
+	case 6: static_call_update(nf_hook_direct6, fn); break;
+	case 7: static_call_update(nf_hook_direct7, fn); break;
+	}
+}
+
+static __always_inline unsigned int
+nf_hook_entry_call(const struct nf_hook_entry *entry, struct sk_buff *skb,
+		   struct nf_hook_state *state)
+{
+	nf_hookfn *fn = entry->hook;
+
+	if (static_branch_likely(&nf_hook_skip_direct_calls))
+		goto indirect_call;
+
+	if (fn == nf_hook_direct_fn[0])
+		return static_call(nf_hook_direct0)(entry->priv, skb, state);
+	if (fn == nf_hook_direct_fn[1])
+		return static_call(nf_hook_direct1)(entry->priv, skb, state);
+	if (fn == nf_hook_direct_fn[2])
+		return static_call(nf_hook_direct2)(entry->priv, skb, state);
+	if (fn == nf_hook_direct_fn[3])
+		return static_call(nf_hook_direct3)(entry->priv, skb, state);
+	if (fn == nf_hook_direct_fn[4])
+		return static_call(nf_hook_direct4)(entry->priv, skb, state);
+	if (fn == nf_hook_direct_fn[5])
+		return static_call(nf_hook_direct5)(entry->priv, skb, state);
+	if (fn == nf_hook_direct_fn[6])
+		return static_call(nf_hook_direct6)(entry->priv, skb, state);
+	if (fn == nf_hook_direct_fn[7])
+		return static_call(nf_hook_direct7)(entry->priv, skb, state);
+indirect_call:
+	return fn(entry->priv, skb, state);
+}
+
+/* The static call of a slot is updated before the slot is published, and
+ * a released slot is reused only after a grace period, so that a packet
+ * that matched the former function can't end up in the new one.
+ */
+static void nf_hook_direct_get(nf_hookfn *fn)
+{
+	int i, slot = -1;
+
+	mutex_lock(&nf_hook_direct_mutex);
+	for (i = 0; i < NF_HOOK_DIRECT_CALLS; i++) {
+		if (nf_hook_direct[i].users &&
+		    nf_hook_direct_fn[i] == fn) {
+			nf_hook_direct[i].users++;
+			goto out;
+		}
+		if (!nf_hook_direct[i].users && slot < 0)
+			slot = i;
+	}
+
+	if (slot < 0)
+		goto out;
+
+	cond_synchronize_rcu(nf_hook_direct[slot].gp_state);
+	nf_hook_direct_update(slot, fn);
+	nf_hook_direct[slot].users = 1;
+	WRITE_ONCE(nf_hook_direct_fn[slot], fn);
+out:
+	mutex_unlock(&nf_hook_direct_mutex);
+}
+
+static void nf_hook_direct_put(nf_hookfn *fn)
+{
+	int i;
+
+	mutex_lock(&nf_hook_direct_mutex);
+	for (i = 0; i < NF_HOOK_DIRECT_CALLS; i++) {
+		if (!nf_hook_direct[i].users ||
+		    nf_hook_direct_fn[i] != fn)
+			continue;
+
+		if (--nf_hook_direct[i].users == 0) {
+			WRITE_ONCE(nf_hook_direct_fn[i], NULL);
+			nf_hook_direct[i].gp_state = get_state_synchronize_rcu();
+		}
+		break;
+	}
+	mutex_unlock(&nf_hook_direct_mutex);
+}
+
+static void __init nf_hook_direct_init(void)
+{
+	int i;
+
+	for (i = 0; i < NF_HOOK_DIRECT_CALLS; i++)
+		nf_hook_direct[i].gp_state = get_completed_synchronize_rcu();
+
+	if (!cpu_feature_enabled(X86_FEATURE_RETPOLINE))
+		static_branch_enable(&nf_hook_skip_direct_calls);
+}
+#else
+static __always_inline unsigned int
+nf_hook_entry_call(const struct nf_hook_entry *entry, struct sk_buff *skb,
+		   struct nf_hook_state *state)
+{
+	return nf_hook_entry_hookfn(entry, skb, state);
+}
+
+static void nf_hook_direct_get(nf_hookfn *fn) { }
+static void nf_hook_direct_put(nf_hookfn *fn) { }
+static void __init nf_hook_direct_init(void) { }
+#endif /* CONFIG_MITIGATION_RETPOLINE */
+
 static struct nf_hook_entries *
 nf_hook_entries_grow(const struct nf_hook_entries *old,
 		     const struct nf_hook_ops *reg)
@@ -151,6 +367,7 @@ nf_hook_entries_grow(const struct nf_hook_entries *old,
 		if (inserted || reg->priority > orig_ops[i]->priority) {
 			new_ops[nhooks] = (void *)orig_ops[i];
 			new->hooks[nhooks] = old->hooks[i];
+			nf_hook_entry_stats_move(new, nhooks, old, i);
 			i++;
 		} else {
 			new_ops[nhooks] = (void *)reg;
@@ -264,6 +481,7 @@ static void *__nf_hook_entries_try_shrink(struct nf_hook_entries *old,
 			continue;
 		new->hooks[j] = old->hooks[i];
 		new_ops[j] = (void *)orig_ops[i];
+		nf_hook_entry_stats_move(new, j, old, i);
 		j++;
 	}
 	hooks_validate(new);
@@ -483,7 +701,8 @@ static bool nf_remove_net_hook(struct nf_hook_entries *old,
 }
 
 static void __nf_unregister_net_hook(struct net *net, int pf,
-				     const struct nf_hook_ops *reg)
+				     const struct nf_hook_ops *reg,
+				     bool shrink)
 {
 	struct nf_hook_entries __rcu **pp;
 	struct nf_hook_entries *p;
@@ -514,7 +733,7 @@ static void __nf_unregister_net_hook(struct net *net, int pf,
 		WARN_ONCE(1, "hook not found, pf %d num %d", pf, reg->hooknum);
 	}
 
-	p = __nf_hook_entries_try_shrink(p, pp);
+	p = shrink ? __nf_hook_entries_try_shrink(p, pp) : NULL;
 	mutex_unlock(&nf_hook_mutex);
 	if (!p)
 		return;
@@ -523,21 +742,89 @@ static void __nf_unregister_net_hook(struct net *net, int pf,
 	nf_hook_entries_free(p);
 }
 
-void nf_unregister_net_hook(struct net *net, const struct nf_hook_ops *reg)
+static void nf_unregister_net_hook_pf(struct net *net,
+				      const struct nf_hook_ops *reg,
+				      bool shrink)
 {
 	if (reg->pf == NFPROTO_INET) {
 		if (reg->hooknum == NF_INET_INGRESS) {
-			__nf_unregister_net_hook(net, NFPROTO_INET, reg);
+			__nf_unregister_net_hook(net, NFPROTO_INET, reg, shrink);
 		} else {
-			__nf_unregister_net_hook(net, NFPROTO_IPV4, reg);
-			__nf_unregister_net_hook(net, NFPROTO_IPV6, reg);
+			__nf_unregister_net_hook(net, NFPROTO_IPV4, reg, shrink);
+			__nf_unregister_net_hook(net, NFPROTO_IPV6, reg, shrink);
 		}
 	} else {
-		__nf_unregister_net_hook(net, reg->pf, reg);
+		__nf_unregister_net_hook(net, reg->pf, reg, shrink);
 	}
 }
+
+void nf_unregister_net_hook(struct net *net, const struct nf_hook_ops *reg)
+{
+	nf_unregister_net_hook_pf(net, reg, true);
+	nf_hook_direct_put(reg->hook);
+}
 EXPORT_SYMBOL(nf_unregister_net_hook);
 
+/*
+ * nf_unregister_net_hook_noshrink - unregister a hook, keep its slot
+ *
+ * The hook is replaced by a dummy one, like nf_unregister_net_hook()
+ * does, but the blob is left as is: a batch of unregistrations then
+ * calls nf_hook_shrink() once done, so that each blob is reallocated
+ * and copied once instead of once per hook.
+ */
+void nf_unregister_net_hook_noshrink(struct net *net,
+				     const struct nf_hook_ops *reg)
+{
+	nf_unregister_net_hook_pf(net, reg, false);
+	nf_hook_direct_put(reg->hook);
+}
+EXPORT_SYMBOL_GPL(nf_unregister_net_hook_noshrink);
+
+static void __nf_hook_shrink(struct net *net, int pf,
+			     const struct nf_hook_ops *reg)
+{
+	struct nf_hook_entries __rcu **pp;
+	struct nf_hook_entries *p;
+
+	pp = nf_hook_entry_head(net, pf, reg->hooknum, reg->dev);
+	if (!pp)
+		return;
+
+	mutex_lock(&nf_hook_mutex);
+	p = nf_entry_dereference(*pp);
+	if (p)
+		p = __nf_hook_entries_try_shrink(p, pp);
+	mutex_unlock(&nf_hook_mutex);
+	if (!p)
+		return;
+
+	nf_queue_nf_hook_drop(net);
+	nf_hook_entries_free(p);
+}
+
+/*
+ * nf_hook_shrink - drop the dummy hooks from the blob(s) @reg goes to
+ *
+ * @reg doesn't need to be registered anymore, only its pf, hooknum and
+ * dev are used.  Nothing is copied if the blob has no dummy hook, e.g.
+ * because it was already shrunk for another hook of the same batch.
+ */
+void nf_hook_shrink(struct net *net, const struct nf_hook_ops *reg)
+{
+	if (reg->pf == NFPROTO_INET) {
+		if (reg->hooknum == NF_INET_INGRESS) {
+			__nf_hook_shrink(net, NFPROTO_INET, reg);
+		} else {
+			__nf_hook_shrink(net, NFPROTO_IPV4, reg);
+			__nf_hook_shrink(net, NFPROTO_IPV6, reg);
+		}
+	} else {
+		__nf_hook_shrink(net, reg->pf, reg);
+	}
+}
+EXPORT_SYMBOL_GPL(nf_hook_shrink);
+
 void nf_hook_entries_delete_raw(struct nf_hook_entries __rcu **pp,
 				const struct nf_hook_ops *reg)
 {
@@ -551,7 +838,8 @@ void nf_hook_entries_delete_raw(struct nf_hook_entries __rcu **pp,
 }
 EXPORT_SYMBOL_GPL(nf_hook_entries_delete_raw);
 
-int nf_register_net_hook(struct net *net, const struct nf_hook_ops *reg)
+static int nf_register_net_hook_pf(struct net *net,
+				   const struct nf_hook_ops *reg)
 {
 	int err;
 
@@ -567,7 +855,8 @@ int nf_register_net_hook(struct net *net, const struct nf_hook_ops *reg)
 
 			err = __nf_register_net_hook(net, NFPROTO_IPV6, reg);
 			if (err < 0) {
-				__nf_unregister_net_hook(net, NFPROTO_IPV4, reg);
+				__nf_unregister_net_hook(net, NFPROTO_IPV4, reg,
+							 true);
 				return err;
 			}
 		}
@@ -579,6 +868,19 @@ int nf_register_net_hook(struct net *net, const struct nf_hook_ops *reg)
 
 	return 0;
 }
+
+int nf_register_net_hook(struct net *net, const struct nf_hook_ops *reg)
+{
+	int err;
+
+	nf_hook_direct_get(reg->hook);
+
+	err = nf_register_net_hook_pf(net, reg);
+	if (err < 0)
+		nf_hook_direct_put(reg->hook);
+
+	return err;
+}
 EXPORT_SYMBOL(nf_register_net_hook);
 
 int nf_register_net_hooks(struct net *net, const struct nf_hook_ops *reg,
@@ -607,12 +909,67 @@ void nf_unregister_net_hooks(struct net *net, const struct nf_hook_ops *reg,
 	unsigned int i;
 
 	for (i = 0; i < hookcount; i++)
-		nf_unregister_net_hook(net, &reg[i]);
+		nf_unregister_net_hook_noshrink(net, &reg[i]);
+
+	for (i = 0; i < hookcount; i++)
+		nf_hook_shrink(net, &reg[i]);
 }
 EXPORT_SYMBOL(nf_unregister_net_hooks);
 
 /* Returns 1 if okfn() needs to be executed by the caller,
  * -EPERM for NF_DROP, 0 otherwise.  Caller must hold rcu_read_lock. */
+#ifdef CONFIG_NETFILTER_HOOK_STATS
+static noinline unsigned int
+nf_hook_entry_hookfn_stats(const struct nf_hook_entries *e, unsigned int s,
+			   struct sk_buff *skb, struct nf_hook_state *state)
+{
+	cycles_t start = get_cycles();
+	unsigned int verdict;
+
+	verdict = nf_hook_entry_call(&e->hooks[s], skb, state);
+
+	this_cpu_inc(e->stats[s].packets);
+	this_cpu_add(e->stats[s].cycles, get_cycles() - start);
+
+	return verdict;
+}
+#endif
+
+static __always_inline unsigned int
+__nf_hook_entries_hookfn(const struct nf_hook_entries *e, unsigned int s,
+			 struct sk_buff *skb, struct nf_hook_state *state)
+{
+#ifdef CONFIG_NETFILTER_HOOK_STATS
+	if (static_branch_unlikely(&nf_hook_stats_enabled))
+		return nf_hook_entry_hookfn_stats(e, s, skb, state);
+#endif
+	return nf_hook_entry_call(&e->hooks[s], skb, state);
+}
+
+static noinline unsigned int
+nf_hook_entry_hookfn_trace(const struct nf_hook_entries *e, unsigned int s,
+			   struct sk_buff *skb, struct nf_hook_state *state)
+{
+	nf_hookfn *hook = e->hooks[s].hook;
+	u64 start = local_clock();
+	unsigned int verdict;
+
+	verdict = __nf_hook_entries_hookfn(e, s, skb, state);
+	trace_nf_hook_entry(state, hook, verdict, local_clock() - start);
+
+	return verdict;
+}
+
+static __always_inline unsigned int
+nf_hook_entries_hookfn(const struct nf_hook_entries *e, unsigned int s,
+		       struct sk_buff *skb, struct nf_hook_state *state)
+{
+	if (trace_nf_hook_entry_enabled())
+		return nf_hook_entry_hookfn_trace(e, s, skb, state);
+
+	return __nf_hook_entries_hookfn(e, s, skb, state);
+}
+
 int nf_hook_slow(struct sk_buff *skb, struct nf_hook_state *state,
 		 const struct nf_hook_entries *e, unsigned int s)
 {
@@ -620,7 +977,7 @@ int nf_hook_slow(struct sk_buff *skb, struct nf_hook_state *state,
 	int ret;
 
 	for (; s < e->num_hook_entries; s++) {
-		verdict = nf_hook_entry_hookfn(&e->hooks[s], skb, state);
+		verdict = nf_hook_entries_hookfn(e, s, skb, state);
 		switch (verdict & NF_VERDICT_MASK) {
 		case NF_ACCEPT:
 			break;
@@ -655,6 +1012,26 @@ void nf_hook_slow_list(struct list_head *head, struct nf_hook_state *state,
 	LIST_HEAD(sublist);
 	int ret;
 
+#if IS_ENABLED(CONFIG_NF_CONNTRACK)
+	if (state->hook == NF_INET_PRE_ROUTING && !list_is_singular(head)) {
+		const struct nf_ct_hook *ct_hook;
+
+		ct_hook = rcu_dereference(nf_ct_hook);
+		if (ct_hook)
+			ct_hook->prefetch_list(head, state);
+	}
+#endif
+#if IS_ENABLED(CONFIG_IP_VS)
+	/* IPVS looks the packets up in local input, soon after routing */
+	if (state->hook == NF_INET_PRE_ROUTING && !list_is_singular(head)) {
+		const struct nf_ipvs_hook *ipvs_hook;
+
+		ipvs_hook = rcu_dereference(nf_ipvs_hook);
+		if (ipvs_hook)
+			ipvs_hook->prefetch_list(head, state);
+	}
+#endif
+
 	list_for_each_entry_safe(skb, next, head, list) {
 		skb_list_del_init(skb);
 		ret = nf_hook_slow(skb, state, e, 0);
@@ -666,6 +1043,139 @@ void nf_hook_slow_list(struct list_head *head, struct nf_hook_state *state,
 }
 EXPORT_SYMBOL(nf_hook_slow_list);
 
+#ifdef CONFIG_NETFILTER_INGRESS
+/* Upper bound of packets held back, a NAPI budget. */
+#define NF_INGRESS_XMIT_BATCH	64
+
+DEFINE_PER_CPU(struct nf_ingress_xmit, nf_ingress_xmit) = {
+	.bh_lock	= INIT_LOCAL_LOCK(bh_lock),
+};
+
+static void nf_ingress_xmit_one(struct sk_buff *skb)
+{
+	struct nf_ingress_xmit_cb cb = *NF_INGRESS_XMIT_CB(skb);
+
+	if (cb.neigh_table == NF_INGRESS_XMIT_DEV)
+		dev_queue_xmit(skb);
+	else
+		neigh_xmit(cb.neigh_table, skb->dev, &cb.nexthop, skb);
+}
+
+/* Transmit the packets held back, those of one device after the other.
+ * The order of the packets of a device, and thus of a flow, is kept.
+ */
+static void nf_ingress_xmit_flush(struct nf_ingress_xmit *xmit)
+{
+	struct sk_buff *skb, *next;
+	struct net_device *dev;
+	LIST_HEAD(list);
+
+	list_splice_init(&xmit->list, &list);
+	xmit->len = 0;
+	local_unlock_nested_bh(&nf_ingress_xmit.bh_lock);
+
+	while (!list_empty(&list)) {
+		dev = list_first_entry(&list, struct sk_buff, list)->dev;
+
+		list_for_each_entry_safe(skb, next, &list, list) {
+			if (skb->dev != dev)
+				continue;
+
+			skb_list_del_init(skb);
+			nf_ingress_xmit_one(skb);
+		}
+	}
+
+	local_lock_nested_bh(&nf_ingress_xmit.bh_lock);
+}
+
+void __nf_ingress_xmit_begin(void)
+{
+	local_bh_disable();
+	local_lock_nested_bh(&nf_ingress_xmit.bh_lock);
+	this_cpu_ptr(&nf_ingress_xmit)->depth++;
+	local_unlock_nested_bh(&nf_ingress_xmit.bh_lock);
+}
+
+void __nf_ingress_xmit_end(void)
+{
+	struct nf_ingress_xmit *xmit;
+
+	local_lock_nested_bh(&nf_ingress_xmit.bh_lock);
+	xmit = this_cpu_ptr(&nf_ingress_xmit);
+	/* only the outermost batch transmits, more packets may be held
+	 * back while flushing.
+	 */
+	if (xmit->depth == 1) {
+		while (xmit->len)
+			nf_ingress_xmit_flush(xmit);
+	}
+	xmit->depth--;
+	local_unlock_nested_bh(&nf_ingress_xmit.bh_lock);
+	local_bh_enable();
+}
+
+/* Transmit the packets held back so far, before a packet that passed the
+ * ingress hook goes on.  The packets already passed are dispatched before
+ * any packet is held back after them, see __netif_receive_skb_list_core().
+ */
+void __nf_ingress_xmit_sync(void)
+{
+	struct nf_ingress_xmit *xmit;
+
+	local_lock_nested_bh(&nf_ingress_xmit.bh_lock);
+	xmit = this_cpu_ptr(&nf_ingress_xmit);
+	if (xmit->depth == 1) {
+		while (xmit->len)
+			nf_ingress_xmit_flush(xmit);
+	}
+	local_unlock_nested_bh(&nf_ingress_xmit.bh_lock);
+}
+
+/**
+ * nf_ingress_xmit_defer - transmit a packet at the end of the receive batch
+ * @skb: packet to transmit, skb->dev is the output device
+ * @neigh_table: neighbour table to resolve @nexthop in, NF_INGRESS_XMIT_DEV
+ *	if the link layer header is already built
+ * @nexthop: next hop address, ignored for NF_INGRESS_XMIT_DEV
+ * @len: length of @nexthop
+ *
+ * Returns: false if no batch is open on this cpu, the caller transmits
+ * @skb itself then.
+ */
+bool nf_ingress_xmit_defer(struct sk_buff *skb, int neigh_table,
+			   const void *nexthop, unsigned int len)
+{
+	struct nf_ingress_xmit_cb *cb = NF_INGRESS_XMIT_CB(skb);
+	struct nf_ingress_xmit *xmit;
+
+	BUILD_BUG_ON(sizeof(struct nf_ingress_xmit_cb) > sizeof(skb->cb));
+
+	if (WARN_ON_ONCE(len > sizeof(cb->nexthop)))
+		return false;
+
+	local_lock_nested_bh(&nf_ingress_xmit.bh_lock);
+	xmit = this_cpu_ptr(&nf_ingress_xmit);
+	if (!xmit->depth) {
+		local_unlock_nested_bh(&nf_ingress_xmit.bh_lock);
+		return false;
+	}
+
+	if (xmit->len >= NF_INGRESS_XMIT_BATCH)
+		nf_ingress_xmit_flush(xmit);
+
+	cb->neigh_table = neigh_table;
+	if (len)
+		memcpy(&cb->nexthop, nexthop, len);
+	list_add_tail(&skb->list, &xmit->list);
+	xmit->len++;
+	local_unlock_nested_bh(&nf_ingress_xmit.bh_lock);
+
+	return true;
+}
+EXPORT_SYMBOL_GPL(nf_ingress_xmit_defer);
+#endif
+
 /* This needs to be compiled in any case to avoid dependencies between the
  * nfnetlink_queue code and nf_conntrack.
  */
@@ -675,6 +1185,9 @@ EXPORT_SYMBOL_GPL(nfnl_ct_hook);
 const struct nf_ct_hook __rcu *nf_ct_hook __read_mostly;
 EXPORT_SYMBOL_GPL(nf_ct_hook);
 
+const struct nf_ipvs_hook __rcu *nf_ipvs_hook __read_mostly;
+EXPORT_SYMBOL_GPL(nf_ipvs_hook);
+
 const struct nf_defrag_hook __rcu *nf_defrag_v4_hook __read_mostly;
 EXPORT_SYMBOL_GPL(nf_defrag_v4_hook);
 
@@ -802,14 +1315,85 @@ static struct pernet_operations netfilter_net_ops = {
 	.exit = netfilter_net_exit,
 };
 
+#if defined(CONFIG_NETFILTER_HOOK_STATS) && defined(CONFIG_SYSCTL)
+static u8 nf_hook_stats __read_mostly;
+static DEFINE_MUTEX(nf_hook_stats_mutex);
+
+static int nf_hook_stats_sysctl(const struct ctl_table *table, int write,
+				void *buffer, size_t *lenp, loff_t *ppos)
+{
+	int ret;
+
+	mutex_lock(&nf_hook_stats_mutex);
+	ret = proc_dou8vec_minmax(table, write, buffer, lenp, ppos);
+	if (ret < 0 || !write)
+		goto out;
+
+	if (nf_hook_stats)
+		static_branch_enable(&nf_hook_stats_enabled);
+	else
+		static_branch_disable(&nf_hook_stats_enabled);
+out:
+	mutex_unlock(&nf_hook_stats_mutex);
+	return ret;
+}
+
+/* The key is global, so is the knob: only in the initial namespace. */
+static struct ctl_table nf_hook_stats_sysctl_table[] = {
+	{
+		.procname	= "nf_hook_stats",
+		.data		= &nf_hook_stats,
+		.maxlen		= sizeof(u8),
+		.mode		= 0644,
+		.proc_handler	= nf_hook_stats_sysctl,
+		.extra1		= SYSCTL_ZERO,
+		.extra2		= SYSCTL_ONE,
+	},
+};
+
+static struct ctl_table_header *nf_hook_stats_header;
+
+static int __init nf_hook_stats_init(void)
+{
+	nf_hook_stats_header =
+		register_net_sysctl_sz(&init_net, "net/netfilter",
+				       nf_hook_stats_sysctl_table,
+				       ARRAY_SIZE(nf_hook_stats_sysctl_table));
+	if (!nf_hook_stats_header)
+		return -ENOMEM;
+
+	return 0;
+}
+
+static void __init nf_hook_stats_fini(void)
+{
+	unregister_net_sysctl_table(nf_hook_stats_header);
+}
+#else
+static int __init nf_hook_stats_init(void) { return 0; }
+static void __init nf_hook_stats_fini(void) { }
+#endif
+
 int __init netfilter_init(void)
 {
 	int ret;
+#ifdef CONFIG_NETFILTER_INGRESS
+	int cpu;
 
-	ret = register_pernet_subsys(&netfilter_net_ops);
+	for_each_possible_cpu(cpu)
+		INIT_LIST_HEAD(&per_cpu(nf_ingress_xmit, cpu).list);
+#endif
+
+	nf_hook_direct_init();
+
+	ret = nf_hook_stats_init();
 	if (ret < 0)
 		goto err;
 
+	ret = register_pernet_subsys(&netfilter_net_ops);
+	if (ret < 0)
+		goto err_hook_stats;
+
 #ifdef CONFIG_LWTUNNEL
 	ret = netfilter_lwtunnel_init();
 	if (ret < 0)
@@ -826,6 +1410,8 @@ int __init netfilter_init(void)
 err_lwtunnel_pernet:
 #endif
 	unregister_pernet_subsys(&netfilter_net_ops);
+err_hook_stats:
+	nf_hook_stats_fini();
 err:
 	return ret;
 }
@@ -133,8 +133,16 @@ mtype_add(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 	struct mtype *map = set->data;
 	const struct mtype_adt_elem *e = value;
 	void *x = get_ext(set, map, e->id);
-	int ret = mtype_do_add(e, map, flags, set->dsize);
+	struct ip_set_counter_rcu *counter = NULL;
+	int ret;
 
+	if (SET_WITH_PCPU_COUNTER(set)) {
+		counter = ip_set_alloc_counter();
+		if (!counter)
+			return -ENOMEM;
+	}
+
+	ret = mtype_do_add(e, map, flags, set->dsize);
 	if (ret == IPSET_ADD_FAILED) {
 		if (SET_WITH_TIMEOUT(set) &&
 		    ip_set_timeout_expired(ext_timeout(x, set))) {
@@ -142,6 +150,7 @@ mtype_add(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 			ret = 0;
 		} else if (!(flags & IPSET_FLAG_EXIST)) {
 			set_bit(e->id, map->members);
+			ip_set_free_counter(counter);
 			return -IPSET_ERR_EXIST;
 		}
 		/* Element is re-added, cleanup extensions */
@@ -158,7 +167,7 @@ mtype_add(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 #endif
 
 	if (SET_WITH_COUNTER(set))
-		ip_set_init_counter(ext_counter(x, set), ext);
+		ip_set_init_counter(set, ext_counter(x, set), ext, &counter);
 	if (SET_WITH_COMMENT(set))
 		ip_set_init_comment(set, ext_comment(x, set), ext);
 	if (SET_WITH_SKBINFO(set))
@@ -167,6 +176,7 @@ mtype_add(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 	/* Activate element */
 	set_bit(e->id, map->members);
 	set->elements++;
+	ip_set_free_counter(counter);
 
 	return 0;
 }
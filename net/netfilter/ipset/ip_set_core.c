@@ -13,6 +13,7 @@
 #include <linux/skbuff.h>
 #include <linux/spinlock.h>
 #include <linux/rculist.h>
+#include <linux/percpu.h>
 #include <net/netlink.h>
 #include <net/net_namespace.h>
 #include <net/netns/generic.h>
@@ -397,6 +398,113 @@ ip_set_comment_free(struct ip_set *set, void *ptr)
 	rcu_assign_pointer(comment->c, NULL);
 }
 
+#define IP_SET_COUNTER_PCPU_SIZE				\
+	(sizeof(struct ip_set_counter_rcu) +			\
+	 num_possible_cpus() * sizeof(struct ip_set_counter_pcpu))
+
+/* With per-CPU counters, the storage is allocated before the element is
+ * added, so that the add fails as a whole when it can't be.
+ */
+struct ip_set_counter_rcu *
+ip_set_alloc_counter(void)
+{
+	struct ip_set_counter_rcu *c;
+	int cpu;
+
+	c = kmalloc(sizeof(*c), GFP_ATOMIC);
+	if (unlikely(!c))
+		return NULL;
+	c->pcpu = alloc_percpu_gfp(struct ip_set_counter_pcpu, GFP_ATOMIC);
+	if (unlikely(!c->pcpu)) {
+		kfree(c);
+		return NULL;
+	}
+	for_each_possible_cpu(cpu)
+		u64_stats_init(&per_cpu_ptr(c->pcpu, cpu)->syncp);
+	return c;
+}
+EXPORT_SYMBOL_GPL(ip_set_alloc_counter);
+
+/* Frees storage from ip_set_alloc_counter() the add did not use */
+void
+ip_set_free_counter(struct ip_set_counter_rcu *c)
+{
+	if (!c)
+		return;
+	free_percpu(c->pcpu);
+	kfree(c);
+}
+EXPORT_SYMBOL_GPL(ip_set_free_counter);
+
+/* Called from the add functions, protected by the set or region lock.
+ * With per-CPU counters, *prealloc is taken over when the element has
+ * no storage yet.
+ */
+void
+ip_set_init_counter(struct ip_set *set, struct ip_set_counter *counter,
+		    const struct ip_set_ext *ext,
+		    struct ip_set_counter_rcu **prealloc)
+{
+	struct ip_set_counter_pcpu *pcpu;
+	struct ip_set_counter_rcu *c;
+	bool first = true;
+	int cpu;
+
+	if (!SET_WITH_PCPU_COUNTER(set)) {
+		if (ext->bytes != ULLONG_MAX)
+			atomic64_set(&(counter)->bytes, (long long)(ext->bytes));
+		if (ext->packets != ULLONG_MAX)
+			atomic64_set(&(counter)->packets,
+				     (long long)(ext->packets));
+		return;
+	}
+
+	c = rcu_dereference_protected(counter->c, 1);
+	if (!c) {
+		c = *prealloc;
+		*prealloc = NULL;
+		set->ext_size += IP_SET_COUNTER_PCPU_SIZE;
+		rcu_assign_pointer(counter->c, c);
+	}
+	/* The values given are accounted to the first CPU */
+	for_each_possible_cpu(cpu) {
+		pcpu = per_cpu_ptr(c->pcpu, cpu);
+		if (ext->bytes != ULLONG_MAX)
+			u64_stats_set(&pcpu->bytes, first ? ext->bytes : 0);
+		if (ext->packets != ULLONG_MAX)
+			u64_stats_set(&pcpu->packets, first ? ext->packets : 0);
+		first = false;
+	}
+}
+EXPORT_SYMBOL_GPL(ip_set_init_counter);
+
+static void
+ip_set_counter_rcu_free(struct rcu_head *head)
+{
+	struct ip_set_counter_rcu *c =
+		container_of(head, struct ip_set_counter_rcu, rcu);
+
+	free_percpu(c->pcpu);
+	kfree(c);
+}
+
+/* Called under the same conditions as ip_set_comment_free(),
+ * for sets with per-CPU counters only.
+ */
+static void
+ip_set_counter_free(struct ip_set *set, void *ptr)
+{
+	struct ip_set_counter *counter = ptr;
+	struct ip_set_counter_rcu *c;
+
+	c = rcu_dereference_protected(counter->c, 1);
+	if (unlikely(!c))
+		return;
+	set->ext_size -= IP_SET_COUNTER_PCPU_SIZE;
+	rcu_assign_pointer(counter->c, NULL);
+	call_rcu(&c->rcu, ip_set_counter_rcu_free);
+}
+
 typedef void (*destroyer)(struct ip_set *, void *);
 /* ipset data extension types, in size order */
 
@@ -406,6 +514,7 @@ const struct ip_set_ext_type ip_set_extensions[] = {
 		.flag	= IPSET_FLAG_WITH_COUNTERS,
 		.len	= sizeof(struct ip_set_counter),
 		.align	= __alignof__(struct ip_set_counter),
+		.destroy = ip_set_counter_free,
 	},
 	[IPSET_EXT_ID_TIMEOUT] = {
 		.type	= IPSET_EXT_TIMEOUT,
@@ -447,6 +556,11 @@ ip_set_elem_len(struct ip_set *set, struct nlattr *tb[], size_t len,
 		cadt_flags = ip_set_get_h32(tb[IPSET_ATTR_CADT_FLAGS]);
 	if (cadt_flags & IPSET_FLAG_WITH_FORCEADD)
 		set->flags |= IPSET_CREATE_FLAG_FORCEADD;
+	/* Per-CPU counters imply counters and need a destructor */
+	if (cadt_flags & IPSET_FLAG_WITH_PERCPU_COUNTERS) {
+		cadt_flags |= IPSET_FLAG_WITH_COUNTERS;
+		set->extensions |= IPSET_EXT_PCPU_COUNTER | IPSET_EXT_DESTROY;
+	}
 	if (!align)
 		align = 1;
 	for (id = 0; id < IPSET_EXT_ID_MAX; id++) {
@@ -520,27 +634,51 @@ ip_set_get_extensions(struct ip_set *set, struct nlattr *tb[],
 }
 EXPORT_SYMBOL_GPL(ip_set_get_extensions);
 
-static u64
-ip_set_get_bytes(const struct ip_set_counter *counter)
-{
-	return (u64)atomic64_read(&(counter)->bytes);
-}
+/* Per-CPU counters are folded here, when listing or matching on them */
+static void
+ip_set_get_counter(const struct ip_set *set,
+		   const struct ip_set_counter *counter,
+		   u64 *bytes, u64 *packets)
+{
+	const struct ip_set_counter_pcpu *pcpu;
+	const struct ip_set_counter_rcu *c;
+	unsigned int start;
+	u64 b, p;
+	int cpu;
+
+	if (!SET_WITH_PCPU_COUNTER(set)) {
+		*bytes = (u64)atomic64_read(&(counter)->bytes);
+		*packets = (u64)atomic64_read(&(counter)->packets);
+		return;
+	}
 
-static u64
-ip_set_get_packets(const struct ip_set_counter *counter)
-{
-	return (u64)atomic64_read(&(counter)->packets);
+	*bytes = *packets = 0;
+	c = rcu_dereference_check(counter->c, rcu_read_lock_bh_held());
+	if (unlikely(!c))
+		return;
+	for_each_possible_cpu(cpu) {
+		pcpu = per_cpu_ptr(c->pcpu, cpu);
+		do {
+			start = u64_stats_fetch_begin(&pcpu->syncp);
+			b = u64_stats_read(&pcpu->bytes);
+			p = u64_stats_read(&pcpu->packets);
+		} while (u64_stats_fetch_retry(&pcpu->syncp, start));
+		*bytes += b;
+		*packets += p;
+	}
 }
 
 static bool
-ip_set_put_counter(struct sk_buff *skb, const struct ip_set_counter *counter)
+ip_set_put_counter(struct sk_buff *skb, const struct ip_set *set,
+		   const struct ip_set_counter *counter)
 {
+	u64 bytes, packets;
+
+	ip_set_get_counter(set, counter, &bytes, &packets);
 	return nla_put_net64(skb, IPSET_ATTR_BYTES,
-			     cpu_to_be64(ip_set_get_bytes(counter)),
-			     IPSET_ATTR_PAD) ||
+			     cpu_to_be64(bytes), IPSET_ATTR_PAD) ||
 	       nla_put_net64(skb, IPSET_ATTR_PACKETS,
-			     cpu_to_be64(ip_set_get_packets(counter)),
-			     IPSET_ATTR_PAD);
+			     cpu_to_be64(packets), IPSET_ATTR_PAD);
 }
 
 static bool
@@ -573,7 +711,7 @@ ip_set_put_extensions(struct sk_buff *skb, const struct ip_set *set,
 			return -EMSGSIZE;
 	}
 	if (SET_WITH_COUNTER(set) &&
-	    ip_set_put_counter(skb, ext_counter(e, set)))
+	    ip_set_put_counter(skb, set, ext_counter(e, set)))
 		return -EMSGSIZE;
 	if (SET_WITH_COMMENT(set) &&
 	    ip_set_put_comment(skb, ext_comment(e, set)))
@@ -616,11 +754,35 @@ ip_set_add_packets(u64 packets, struct ip_set_counter *counter)
 }
 
 static void
-ip_set_update_counter(struct ip_set_counter *counter,
+ip_set_add_counter_pcpu(const struct ip_set_ext *ext,
+			struct ip_set_counter *counter)
+{
+	struct ip_set_counter_pcpu *pcpu;
+	struct ip_set_counter_rcu *c;
+
+	/* Matching runs in process context for locally generated packets */
+	local_bh_disable();
+	c = rcu_dereference_bh(counter->c);
+	if (likely(c)) {
+		pcpu = this_cpu_ptr(c->pcpu);
+		u64_stats_update_begin(&pcpu->syncp);
+		u64_stats_add(&pcpu->bytes, ext->bytes);
+		u64_stats_add(&pcpu->packets, ext->packets);
+		u64_stats_update_end(&pcpu->syncp);
+	}
+	local_bh_enable();
+}
+
+static void
+ip_set_update_counter(const struct ip_set *set, struct ip_set_counter *counter,
 		      const struct ip_set_ext *ext, u32 flags)
 {
 	if (ext->packets != ULLONG_MAX &&
 	    !(flags & IPSET_FLAG_SKIP_COUNTER_UPDATE)) {
+		if (SET_WITH_PCPU_COUNTER(set)) {
+			ip_set_add_counter_pcpu(ext, counter);
+			return;
+		}
 		ip_set_add_bytes(ext->bytes, counter);
 		ip_set_add_packets(ext->packets, counter);
 	}
@@ -643,15 +805,18 @@ ip_set_match_extensions(struct ip_set *set, const struct ip_set_ext *ext,
 		return false;
 	if (SET_WITH_COUNTER(set)) {
 		struct ip_set_counter *counter = ext_counter(data, set);
+		u64 bytes, packets;
 
-		ip_set_update_counter(counter, ext, flags);
+		ip_set_update_counter(set, counter, ext, flags);
 
-		if (flags & IPSET_FLAG_MATCH_COUNTERS &&
-		    !(ip_set_match_counter(ip_set_get_packets(counter),
-				mext->packets, mext->packets_op) &&
-		      ip_set_match_counter(ip_set_get_bytes(counter),
-				mext->bytes, mext->bytes_op)))
-			return false;
+		if (flags & IPSET_FLAG_MATCH_COUNTERS) {
+			ip_set_get_counter(set, counter, &bytes, &packets);
+			if (!(ip_set_match_counter(packets, mext->packets,
+						   mext->packets_op) &&
+			      ip_set_match_counter(bytes, mext->bytes,
+						   mext->bytes_op)))
+				return false;
+		}
 	}
 	if (SET_WITH_SKBINFO(set))
 		ip_set_get_skbinfo(ext_skbinfo(data, set),
@@ -741,11 +906,23 @@ ip_set_test(ip_set_id_t index, const struct sk_buff *skb,
 	    const struct xt_action_param *par, struct ip_set_adt_opt *opt)
 {
 	struct ip_set *set = ip_set_rcu_get(xt_net(par), index);
-	int ret = 0;
 
 	BUG_ON(!set);
 	pr_debug("set %s, index %u\n", set->name, index);
 
+	return ip_set_test_set(set, skb, par, opt);
+}
+EXPORT_SYMBOL_GPL(ip_set_test);
+
+/* Test with the set already resolved by the caller, who holds a
+ * reference to it: used by list:set for its members.
+ */
+int
+ip_set_test_set(struct ip_set *set, const struct sk_buff *skb,
+		const struct xt_action_param *par, struct ip_set_adt_opt *opt)
+{
+	int ret = 0;
+
 	if (opt->dim < set->type->dimension ||
 	    !(opt->family == set->family || set->family == NFPROTO_UNSPEC))
 		return 0;
@@ -770,7 +947,7 @@ ip_set_test(ip_set_id_t index, const struct sk_buff *skb,
 	/* Convert error codes to nomatch */
 	return (ret < 0 ? 0 : ret);
 }
-EXPORT_SYMBOL_GPL(ip_set_test);
+EXPORT_SYMBOL_GPL(ip_set_test_set);
 
 int
 ip_set_add(ip_set_id_t index, const struct sk_buff *skb,
@@ -1393,8 +1570,8 @@ static int ip_set_swap(struct sk_buff *skb, const struct nfnl_info *info,
 		       const struct nlattr * const attr[])
 {
 	struct ip_set_net *inst = ip_set_pernet(info->net);
-	struct ip_set *from, *to;
-	ip_set_id_t from_id, to_id;
+	struct ip_set *from, *to, *s;
+	ip_set_id_t from_id, to_id, i;
 	char from_name[IPSET_MAXNAMELEN];
 
 	if (unlikely(protocol_min_failed(attr) ||
@@ -1427,6 +1604,16 @@ static int ip_set_swap(struct sk_buff *skb, const struct nfnl_info *info,
 		return -EBUSY;
 	}
 
+	/* The sets caching their members go by index until they follow
+	 * the swap below: they can't take their own lock under this one.
+	 */
+	for (i = 0; i < inst->ip_set_max; i++) {
+		s = ip_set(inst, i);
+		if (s && s->variant->swapping)
+			s->variant->swapping(s);
+	}
+	smp_wmb();
+
 	strscpy_pad(from_name, from->name, IPSET_MAXNAMELEN);
 	strscpy_pad(from->name, to->name, IPSET_MAXNAMELEN);
 	strscpy_pad(to->name, from_name, IPSET_MAXNAMELEN);
@@ -1436,6 +1623,12 @@ static int ip_set_swap(struct sk_buff *skb, const struct nfnl_info *info,
 	ip_set(inst, to_id) = from;
 	write_unlock_bh(&ip_set_ref_lock);
 
+	for (i = 0; i < inst->ip_set_max; i++) {
+		s = ip_set(inst, i);
+		if (s && s->variant->swapped)
+			s->variant->swapped(s, from, to);
+	}
+
 	return 0;
 }
 
@@ -1460,6 +1653,8 @@ ip_set_put_flags(struct sk_buff *skb, struct ip_set *set)
 			return -EMSGSIZE;
 	if (SET_WITH_COUNTER(set))
 		cadt_flags |= IPSET_FLAG_WITH_COUNTERS;
+	if (SET_WITH_PCPU_COUNTER(set))
+		cadt_flags |= IPSET_FLAG_WITH_PERCPU_COUNTERS;
 	if (SET_WITH_COMMENT(set))
 		cadt_flags |= IPSET_FLAG_WITH_COMMENT;
 	if (SET_WITH_SKBINFO(set))
@@ -1727,6 +1922,7 @@ static const struct nla_policy ip_set_adt_policy[IPSET_ATTR_CMD_MAX + 1] = {
 	[IPSET_ATTR_LINENO]	= { .type = NLA_U32 },
 	[IPSET_ATTR_DATA]	= { .type = NLA_NESTED },
 	[IPSET_ATTR_ADT]	= { .type = NLA_NESTED },
+	[IPSET_ATTR_SIZE_HINT]	= { .type = NLA_U32 },
 };
 
 static int
@@ -1825,13 +2021,22 @@ static int ip_set_ad(struct net *net, struct sock *ctnl,
 		      !flag_nested(attr[IPSET_ATTR_DATA])) ||
 		     (attr[IPSET_ATTR_ADT] &&
 		      (!flag_nested(attr[IPSET_ATTR_ADT]) ||
-		       !attr[IPSET_ATTR_LINENO]))))
+		       !attr[IPSET_ATTR_LINENO])) ||
+		     (attr[IPSET_ATTR_SIZE_HINT] &&
+		      !(attr[IPSET_ATTR_SIZE_HINT]->nla_type &
+			NLA_F_NET_BYTEORDER))))
 		return -IPSET_ERR_PROTOCOL;
 
 	set = find_set(inst, nla_data(attr[IPSET_ATTR_SETNAME]));
 	if (!set)
 		return -ENOENT;
 
+	/* Restore: size the set once instead of resizing it repeatedly */
+	if (adt == IPSET_ADD && attr[IPSET_ATTR_SIZE_HINT] &&
+	    set->variant->reserve)
+		set->variant->reserve(set,
+				ip_set_get_h32(attr[IPSET_ATTR_SIZE_HINT]));
+
 	use_lineno = !!attr[IPSET_ATTR_LINENO];
 	if (attr[IPSET_ATTR_DATA]) {
 		if (nla_parse_nested(tb, IPSET_ATTR_ADT_MAX,
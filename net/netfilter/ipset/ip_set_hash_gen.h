@@ -32,9 +32,12 @@
  * Readers and resizing
  *
  * Resizing can be triggered by userspace command only, and those
- * are serialized by the nfnl mutex. During resizing the set is
- * read-locked, so the only possible concurrent operations are
- * the kernel side readers. Those must be protected by proper RCU locking.
+ * are serialized by the nfnl mutex. The elements are moved to the new
+ * table region by region, under the region locks, while kernel side
+ * add/del, gc and readers keep running: readers finding an emptied
+ * bucket of the old table look it up in the new one, writers pick the
+ * table by the regions already moved. A resize interrupted by memory
+ * pressure is resumed by the next one.
  */
 
 /* Number of elements to store in an initial array block */
@@ -75,7 +78,7 @@ struct hbucket {
 struct htable_gc {
 	struct delayed_work dwork;
 	struct ip_set *set;	/* Set the gc belongs to */
-	u32 region;		/* Last gc run position */
+	unsigned long next_run;	/* When the gc is queued for */
 };
 
 /* The hash table: the table size stored here in order to make resizing easy */
@@ -84,11 +87,23 @@ struct htable {
 	atomic_t uref;		/* References for dumping and gc */
 	u8 htable_bits;		/* size of hash table == 2^htable_bits */
 	u32 maxelem;		/* Maxelem per region */
+	u32 moved;		/* Regions moved to next by resizing */
+	struct htable __rcu *next;	/* Table being resized to */
 	struct ip_set_region *hregion;	/* Region locks and ext sizes */
 	struct hbucket __rcu *bucket[]; /* hashtable buckets */
 };
 
 #define hbucket(h, i)		((h)->bucket[i])
+
+/* Keep the earliest of the timeouts, region ones under the region lock */
+static inline void
+ahash_expires(unsigned long *expires, unsigned long timeout)
+{
+	if (timeout != IPSET_ELEM_PERMANENT &&
+	    (*expires == IPSET_ELEM_PERMANENT ||
+	     time_before(timeout, *expires)))
+		WRITE_ONCE(*expires, timeout);
+}
 #define ext_size(n, dsize)	\
 	(sizeof(struct hbucket) + (n) * (dsize))
 
@@ -152,6 +167,14 @@ htable_size(u8 hbits)
 #define CIDR_POS(c)		((c) - 2)
 #endif
 
+#ifdef IP_SET_HASH_WITH_NETS_INDEX
+/* The types using the index store the first network address as the first
+ * member of the element: the first byte is the most significant one.
+ */
+#define NETS_INDEX_BITS		8
+#define NETS_INDEX(d)		(*(const u8 *)(d))
+#endif
+
 #else
 #define NLEN			0
 #endif /* IP_SET_HASH_WITH_NETS */
@@ -202,6 +225,7 @@ static const union nf_inet_addr zeromask = {};
 #undef mtype_ext_cleanup
 #undef mtype_add_cidr
 #undef mtype_del_cidr
+#undef mtype_add_index
 #undef mtype_ahash_memsize
 #undef mtype_flush
 #undef mtype_destroy
@@ -215,14 +239,19 @@ static const union nf_inet_addr zeromask = {};
 #undef mtype_test
 #undef mtype_uref
 #undef mtype_resize
+#undef mtype_reserve
 #undef mtype_ext_size
-#undef mtype_resize_ad
+#undef mtype_resize_region
+#undef mtype_bucket
+#undef mtype_list_bucket
+#undef mtype_table_put
 #undef mtype_head
 #undef mtype_list
 #undef mtype_gc_do
 #undef mtype_gc
 #undef mtype_gc_init
 #undef mtype_cancel_gc
+#undef mtype_expires
 #undef mtype_variant
 #undef mtype_data_match
 
@@ -247,6 +276,7 @@ static const union nf_inet_addr zeromask = {};
 #define mtype_ext_cleanup	IPSET_TOKEN(MTYPE, _ext_cleanup)
 #define mtype_add_cidr		IPSET_TOKEN(MTYPE, _add_cidr)
 #define mtype_del_cidr		IPSET_TOKEN(MTYPE, _del_cidr)
+#define mtype_add_index		IPSET_TOKEN(MTYPE, _add_index)
 #define mtype_ahash_memsize	IPSET_TOKEN(MTYPE, _ahash_memsize)
 #define mtype_flush		IPSET_TOKEN(MTYPE, _flush)
 #define mtype_destroy		IPSET_TOKEN(MTYPE, _destroy)
@@ -260,14 +290,19 @@ static const union nf_inet_addr zeromask = {};
 #define mtype_test		IPSET_TOKEN(MTYPE, _test)
 #define mtype_uref		IPSET_TOKEN(MTYPE, _uref)
 #define mtype_resize		IPSET_TOKEN(MTYPE, _resize)
+#define mtype_reserve		IPSET_TOKEN(MTYPE, _reserve)
 #define mtype_ext_size		IPSET_TOKEN(MTYPE, _ext_size)
-#define mtype_resize_ad		IPSET_TOKEN(MTYPE, _resize_ad)
+#define mtype_resize_region	IPSET_TOKEN(MTYPE, _resize_region)
+#define mtype_bucket		IPSET_TOKEN(MTYPE, _bucket)
+#define mtype_list_bucket	IPSET_TOKEN(MTYPE, _list_bucket)
+#define mtype_table_put		IPSET_TOKEN(MTYPE, _table_put)
 #define mtype_head		IPSET_TOKEN(MTYPE, _head)
 #define mtype_list		IPSET_TOKEN(MTYPE, _list)
 #define mtype_gc_do		IPSET_TOKEN(MTYPE, _gc_do)
 #define mtype_gc		IPSET_TOKEN(MTYPE, _gc)
 #define mtype_gc_init		IPSET_TOKEN(MTYPE, _gc_init)
 #define mtype_cancel_gc		IPSET_TOKEN(MTYPE, _cancel_gc)
+#define mtype_expires		IPSET_TOKEN(MTYPE, _expires)
 #define mtype_variant		IPSET_TOKEN(MTYPE, _variant)
 #define mtype_data_match	IPSET_TOKEN(MTYPE, _data_match)
 
@@ -301,21 +336,16 @@ struct htype {
 	u8 netmask;		/* netmask value for subnets to store */
 	union nf_inet_addr bitmask;	/* stores bitmask */
 #endif
-	struct list_head ad;	/* Resize add|del backlist */
 	struct mtype_elem next; /* temporary storage for uadd */
 #ifdef IP_SET_HASH_WITH_NETS
 	struct net_prefixes nets[NLEN]; /* book-keeping of prefixes */
 #endif
-};
-
-/* ADD|DEL entries saved during resize */
-struct mtype_resize_ad {
-	struct list_head list;
-	enum ipset_adt ad;	/* ADD|DEL element */
-	struct mtype_elem d;	/* Element value */
-	struct ip_set_ext ext;	/* Extensions for ADD */
-	struct ip_set_ext mext;	/* Target extensions for ADD */
-	u32 flags;		/* Flags for ADD */
+#ifdef IP_SET_HASH_WITH_NETS_INDEX
+	/* prefix lengths of the first dimension ever added,
+	 * by the first byte of the network address
+	 */
+	DECLARE_BITMAP(nets_index[1 << NETS_INDEX_BITS], HOST_MASK + 1);
+#endif
 };
 
 #ifdef IP_SET_HASH_WITH_NETS
@@ -371,11 +401,36 @@ mtype_del_cidr(struct ip_set *set, struct htype *h, u8 cidr, u8 n)
 }
 #endif
 
+#ifdef IP_SET_HASH_WITH_NETS_INDEX
+/* Record the prefix length of the first network of an element for all
+ * the first address bytes it covers. Deleted elements are not removed
+ * from the index: that costs a useless lookup only, until flush.
+ */
+static void
+mtype_add_index(struct htype *h, const struct mtype_elem *d)
+{
+	u8 cidr = DCIDR_GET(d->cidr, 0);
+	u32 i, first = NETS_INDEX(d), span = 1;
+
+	if (cidr < NETS_INDEX_BITS) {
+		span <<= NETS_INDEX_BITS - cidr;
+		first &= ~(span - 1);
+	}
+	for (i = first; i < first + span; i++)
+		set_bit(cidr, h->nets_index[i]);
+}
+#endif
+
 /* Calculate the actual memory size of the set data */
 static size_t
 mtype_ahash_memsize(const struct htype *h, const struct htable *t)
 {
-	return sizeof(*h) + sizeof(*t) + ahash_sizeof_regions(t->htable_bits);
+	size_t memsize = sizeof(*h);
+
+	for (; t; t = rcu_dereference_bh(t->next))
+		memsize += sizeof(*t) + ahash_sizeof_regions(t->htable_bits);
+
+	return memsize;
 }
 
 /* Get the ith element from the array block n */
@@ -401,33 +456,41 @@ mtype_flush(struct ip_set *set)
 	struct hbucket *n;
 	u32 r, i;
 
-	t = ipset_dereference_nfnl(h->table);
-	for (r = 0; r < ahash_numof_locks(t->htable_bits); r++) {
-		spin_lock_bh(&t->hregion[r].lock);
-		for (i = ahash_bucket_start(r, t->htable_bits);
-		     i < ahash_bucket_end(r, t->htable_bits); i++) {
-			n = __ipset_dereference(hbucket(t, i));
-			if (!n)
-				continue;
-			if (set->extensions & IPSET_EXT_DESTROY)
-				mtype_ext_cleanup(set, n);
-			/* FIXME: use slab cache */
-			rcu_assign_pointer(hbucket(t, i), NULL);
-			kfree_rcu(n, rcu);
+	/* An interrupted resize leaves elements in both tables */
+	for (t = ipset_dereference_nfnl(h->table); t;
+	     t = ipset_dereference_nfnl(t->next)) {
+		for (r = 0; r < ahash_numof_locks(t->htable_bits); r++) {
+			spin_lock_bh(&t->hregion[r].lock);
+			for (i = ahash_bucket_start(r, t->htable_bits);
+			     i < ahash_bucket_end(r, t->htable_bits); i++) {
+				n = __ipset_dereference(hbucket(t, i));
+				if (!n)
+					continue;
+				if (set->extensions & IPSET_EXT_DESTROY)
+					mtype_ext_cleanup(set, n);
+				/* FIXME: use slab cache */
+				rcu_assign_pointer(hbucket(t, i), NULL);
+				kfree_rcu(n, rcu);
+			}
+			t->hregion[r].ext_size = 0;
+			t->hregion[r].elements = 0;
+			t->hregion[r].expires = IPSET_ELEM_PERMANENT;
+			spin_unlock_bh(&t->hregion[r].lock);
 		}
-		t->hregion[r].ext_size = 0;
-		t->hregion[r].elements = 0;
-		spin_unlock_bh(&t->hregion[r].lock);
 	}
 #ifdef IP_SET_HASH_WITH_NETS
 	memset(h->nets, 0, sizeof(h->nets));
 #endif
+#ifdef IP_SET_HASH_WITH_NETS_INDEX
+	memset(h->nets_index, 0, sizeof(h->nets_index));
+#endif
 }
 
 /* Destroy the hashtable part of the set */
 static void
 mtype_ahash_destroy(struct ip_set *set, struct htable *t, bool ext_destroy)
 {
+	struct htable *next = (__force struct htable *)t->next;
 	struct hbucket *n;
 	u32 i;
 
@@ -443,6 +506,26 @@ mtype_ahash_destroy(struct ip_set *set, struct htable *t, bool ext_destroy)
 
 	ip_set_free(t->hregion);
 	ip_set_free(t);
+
+	/* The table resized to is pinned by the one it replaces */
+	if (!next)
+		return;
+	if (ext_destroy)
+		mtype_ahash_destroy(set, next, true);
+	else if (atomic_dec_and_test(&next->uref) && atomic_read(&next->ref))
+		mtype_ahash_destroy(set, next, false);
+}
+
+/* Release a table reference: the last user of a table replaced
+ * by resizing destroys it.
+ */
+static void
+mtype_table_put(struct ip_set *set, struct htable *t)
+{
+	if (atomic_dec_and_test(&t->uref) && atomic_read(&t->ref)) {
+		pr_debug("Table destroy after resize: %p\n", t);
+		mtype_ahash_destroy(set, t, false);
+	}
 }
 
 /* Destroy a hash type of set */
@@ -450,13 +533,8 @@ static void
 mtype_destroy(struct ip_set *set)
 {
 	struct htype *h = set->data;
-	struct list_head *l, *lt;
 
 	mtype_ahash_destroy(set, (__force struct htable *)h->table, true);
-	list_for_each_safe(l, lt, &h->ad) {
-		list_del(l);
-		kfree(l);
-	}
 	kfree(h);
 
 	set->data = NULL;
@@ -491,6 +569,7 @@ mtype_gc_do(struct ip_set *set, struct htype *h, struct htable *t, u32 r)
 	u8 k;
 #endif
 	u8 htable_bits = t->htable_bits;
+	unsigned long expires = IPSET_ELEM_PERMANENT;
 
 	spin_lock_bh(&t->hregion[r].lock);
 	for (i = ahash_bucket_start(r, htable_bits);
@@ -504,8 +583,11 @@ mtype_gc_do(struct ip_set *set, struct htype *h, struct htable *t, u32 r)
 				continue;
 			}
 			data = ahash_data(n, j, dsize);
-			if (!ip_set_timeout_expired(ext_timeout(data, set)))
+			if (!ip_set_timeout_expired(ext_timeout(data, set))) {
+				ahash_expires(&expires,
+					      *ext_timeout(data, set));
 				continue;
+			}
 			pr_debug("expired %u/%u\n", i, j);
 			clear_bit(j, n->used);
 			smp_mb__after_atomic();
@@ -550,6 +632,8 @@ mtype_gc_do(struct ip_set *set, struct htype *h, struct htable *t, u32 r)
 			kfree_rcu(n, rcu);
 		}
 	}
+	/* Survivors only: the region is not walked again until then */
+	WRITE_ONCE(t->hregion[r].expires, expires);
 	spin_unlock_bh(&t->hregion[r].lock);
 }
 
@@ -559,9 +643,10 @@ mtype_gc(struct work_struct *work)
 	struct htable_gc *gc;
 	struct ip_set *set;
 	struct htype *h;
-	struct htable *t;
-	u32 r, numof_locks;
-	unsigned int next_run;
+	struct htable *t, *x;
+	unsigned long expires, next_run;
+	long delay;
+	u32 r;
 
 	gc = container_of(work, struct htable_gc, dwork.work);
 	set = gc->set;
@@ -570,31 +655,45 @@ mtype_gc(struct work_struct *work)
 	spin_lock_bh(&set->lock);
 	t = ipset_dereference_set(h->table, set);
 	atomic_inc(&t->uref);
-	numof_locks = ahash_numof_locks(t->htable_bits);
-	r = gc->region++;
-	if (r >= numof_locks) {
-		r = gc->region = 0;
-	}
-	next_run = (IPSET_GC_PERIOD(set->timeout) * HZ) / numof_locks;
-	if (next_run < HZ/10)
-		next_run = HZ/10;
 	spin_unlock_bh(&set->lock);
 
-	mtype_gc_do(set, h, t, r);
+	/* Walk the regions with expired elements only and come back when
+	 * the earliest of the others is due. Elements already moved by
+	 * resizing are in the next table, pinned by t.
+	 */
+	next_run = jiffies + IPSET_GC_PERIOD(set->timeout) * HZ;
+	for (x = t; x; x = __ipset_dereference(x->next)) {
+		for (r = 0; r < ahash_numof_locks(x->htable_bits); r++) {
+			expires = READ_ONCE(x->hregion[r].expires);
+			if (ip_set_timeout_expired(&expires)) {
+				mtype_gc_do(set, h, x, r);
+				cond_resched();
+				expires = READ_ONCE(x->hregion[r].expires);
+			}
+			if (expires != IPSET_ELEM_PERMANENT &&
+			    time_before(expires, next_run))
+				next_run = expires;
+		}
+	}
 
 	if (atomic_dec_and_test(&t->uref) && atomic_read(&t->ref)) {
 		pr_debug("Table destroy after resize by expire: %p\n", t);
 		mtype_ahash_destroy(set, t, false);
 	}
 
-	queue_delayed_work(system_power_efficient_wq, &gc->dwork, next_run);
-
+	/* Elements expire once jiffies is past their timeout */
+	delay = (long)(next_run - jiffies) + 1;
+	if (delay < HZ/10)
+		delay = HZ/10;
+	WRITE_ONCE(gc->next_run, jiffies + delay);
+	queue_delayed_work(system_power_efficient_wq, &gc->dwork, delay);
 }
 
 static void
 mtype_gc_init(struct htable_gc *gc)
 {
 	INIT_DEFERRABLE_WORK(&gc->dwork, mtype_gc);
+	gc->next_run = jiffies + HZ;
 	queue_delayed_work(system_power_efficient_wq, &gc->dwork, HZ);
 }
 
@@ -607,62 +706,190 @@ mtype_cancel_gc(struct ip_set *set)
 		cancel_delayed_work_sync(&h->gc.dwork);
 }
 
-static int
-mtype_add(struct ip_set *set, void *value, const struct ip_set_ext *ext,
-	  struct ip_set_ext *mext, u32 flags);
-static int
-mtype_del(struct ip_set *set, void *value, const struct ip_set_ext *ext,
-	  struct ip_set_ext *mext, u32 flags);
+/* A new timeout in region: bring the gc forward when it is earlier
+ * than the next run.
+ */
+static void
+mtype_expires(struct htype *h, struct ip_set_region *region,
+	      unsigned long timeout)
+{
+	long delay;
+
+	if (timeout == IPSET_ELEM_PERMANENT)
+		return;
+	ahash_expires(&region->expires, timeout);
+	if (!time_before(timeout, READ_ONCE(h->gc.next_run)))
+		return;
+	WRITE_ONCE(h->gc.next_run, timeout);
+	delay = (long)(timeout - jiffies) + 1;
+	mod_delayed_work(system_power_efficient_wq, &h->gc.dwork,
+			 max_t(long, delay, HZ/10));
+}
 
-/* Resize a hash: create a new hash table with doubling the hashsize
- * and inserting the elements to it. Repeat until we succeed or
- * fail due to memory pressures.
+/* Move region r of orig to t, twice as large: the elements of bucket i
+ * go to the buckets i and i + size of orig. The new buckets are filled
+ * completely before the old ones are emptied, so readers never miss an
+ * element. If an allocation fails, nothing of the region is published
+ * and the whole region is moved again by the next attempt.
  */
 static int
-mtype_resize(struct ip_set *set, bool retried)
+mtype_resize_region(struct ip_set *set, struct htable *orig,
+		    struct htable *t, u32 r)
 {
 	struct htype *h = set->data;
-	struct htable *t, *orig;
-	u8 htable_bits;
-	size_t hsize, dsize = set->dsize;
+	u32 hsize = jhash_size(orig->htable_bits);
+	u32 start = ahash_bucket_start(r, orig->htable_bits);
+	u32 end = ahash_bucket_end(r, orig->htable_bits);
+	u32 nr[2], count[2], elements[2] = { 0, 0 };
+	size_t dsize = set->dsize, ext[2] = { 0, 0 };
+	struct mtype_elem *data, *d;
+	struct hbucket *n, *m[2];
+	u64 high;
+	u32 i, j, k;
+	int ret = 0;
 #ifdef IP_SET_HASH_WITH_NETS
+	struct mtype_elem tmp;
 	u8 flags;
-	struct mtype_elem *tmp;
 #endif
-	struct mtype_elem *data;
-	struct mtype_elem *d;
-	struct hbucket *n, *m;
-	struct list_head *l, *lt;
-	struct mtype_resize_ad *x;
-	u32 i, j, r, nr, key;
-	int ret;
 
+	/* The new regions are fed by old region r only */
+	nr[0] = ahash_region(start, t->htable_bits);
+	nr[1] = ahash_region(start + hsize, t->htable_bits);
+
+	spin_lock_bh(&orig->hregion[r].lock);
+	spin_lock_nested(&t->hregion[nr[0]].lock, SINGLE_DEPTH_NESTING);
+	if (nr[1] != nr[0])
+		spin_lock_nested(&t->hregion[nr[1]].lock,
+				 SINGLE_DEPTH_NESTING + 1);
+
+	for (i = start; i < end; i++) {
+		n = __ipset_dereference(hbucket(orig, i));
+		if (!n)
+			continue;
+		high = 0;
+		count[0] = count[1] = 0;
+		for (j = 0; j < n->pos; j++) {
+			if (!test_bit(j, n->used))
+				continue;
+			data = ahash_data(n, j, dsize);
 #ifdef IP_SET_HASH_WITH_NETS
-	tmp = kmalloc(dsize, GFP_KERNEL);
-	if (!tmp)
-		return -ENOMEM;
+			/* Elements are hashed without the flags */
+			flags = 0;
+			memcpy(&tmp, data, sizeof(tmp));
+			data = &tmp;
+			mtype_data_reset_flags(data, &flags);
 #endif
+			k = HKEY(data, h->initval, t->htable_bits) >=
+			    hsize;
+			if (k)
+				high |= BIT_ULL(j);
+			count[k]++;
+		}
+		for (k = 0; k < 2; k++) {
+			if (!count[k])
+				continue;
+			m[k] = kzalloc(sizeof(*m[k]) +
+				       round_up(count[k], AHASH_INIT_SIZE) *
+				       dsize, GFP_ATOMIC);
+			if (!m[k]) {
+				ret = -ENOMEM;
+				goto cleanup;
+			}
+			m[k]->size = round_up(count[k], AHASH_INIT_SIZE);
+			for (j = 0; j < n->pos; j++) {
+				if (!test_bit(j, n->used) ||
+				    !!(high & BIT_ULL(j)) != k)
+					continue;
+				d = ahash_data(m[k], m[k]->pos, dsize);
+				memcpy(d, ahash_data(n, j, dsize), dsize);
+				set_bit(m[k]->pos++, m[k]->used);
+			}
+			elements[k] += count[k];
+			ext[k] += ext_size(m[k]->size, dsize);
+			/* Not reachable until the old bucket is emptied */
+			rcu_assign_pointer(hbucket(t, i + k * hsize), m[k]);
+		}
+	}
+
+	/* Readers finding an emptied bucket must find the new ones */
+	smp_wmb();
+	for (i = start; i < end; i++) {
+		n = __ipset_dereference(hbucket(orig, i));
+		if (!n)
+			continue;
+		RCU_INIT_POINTER(hbucket(orig, i), NULL);
+		kfree_rcu(n, rcu);
+	}
+	for (k = 0; k < 2; k++) {
+		t->hregion[nr[k]].elements += elements[k];
+		t->hregion[nr[k]].ext_size += ext[k];
+		if (elements[k])
+			ahash_expires(&t->hregion[nr[k]].expires,
+				      orig->hregion[r].expires);
+	}
+	orig->hregion[r].elements = 0;
+	orig->hregion[r].ext_size = 0;
+	WRITE_ONCE(orig->hregion[r].expires, IPSET_ELEM_PERMANENT);
+	/* Writers recheck it under the region lock */
+	WRITE_ONCE(orig->moved, r + 1);
+	goto unlock;
+
+cleanup:
+	for (i = start; i < end; i++) {
+		for (k = 0; k < 2; k++) {
+			n = __ipset_dereference(hbucket(t, i + k * hsize));
+			if (!n)
+				continue;
+			RCU_INIT_POINTER(hbucket(t, i + k * hsize), NULL);
+			kfree(n);
+		}
+	}
+unlock:
+	if (nr[1] != nr[0])
+		spin_unlock(&t->hregion[nr[1]].lock);
+	spin_unlock(&t->hregion[nr[0]].lock);
+	spin_unlock_bh(&orig->hregion[r].lock);
+
+	return ret;
+}
+
+/* Resize a hash: create a new hash table with doubling the hashsize
+ * and move the elements to it region by region. The memory of the
+ * old buckets is released as their regions are moved. If a region
+ * cannot be moved due to memory pressure, the resize stops and the
+ * next one continues from that region.
+ */
+static int
+mtype_resize(struct ip_set *set, bool retried)
+{
+	struct htype *h = set->data;
+	struct htable *t, *orig;
+	u8 htable_bits;
+	size_t hsize;
+	u32 i, r;
+	int ret = 0;
+
 	orig = ipset_dereference_bh_nfnl(h->table);
-	htable_bits = orig->htable_bits;
+	t = ipset_dereference_bh_nfnl(orig->next);
+	if (t) {
+		pr_debug("resume resizing set %s from region %u\n",
+			 set->name, orig->moved);
+		goto move;
+	}
 
-retry:
-	ret = 0;
-	htable_bits++;
+	htable_bits = orig->htable_bits + 1;
 	if (!htable_bits)
 		goto hbwarn;
 	hsize = htable_size(htable_bits);
 	if (!hsize)
 		goto hbwarn;
 	t = ip_set_alloc(hsize);
-	if (!t) {
-		ret = -ENOMEM;
-		goto out;
-	}
+	if (!t)
+		return -ENOMEM;
 	t->hregion = ip_set_alloc(ahash_sizeof_regions(htable_bits));
 	if (!t->hregion) {
 		ip_set_free(t);
-		ret = -ENOMEM;
-		goto out;
+		return -ENOMEM;
 	}
 	t->htable_bits = htable_bits;
 	t->maxelem = h->maxelem / ahash_numof_locks(htable_bits);
@@ -670,90 +897,29 @@ mtype_resize(struct ip_set *set, bool retried)
 		spin_lock_init(&t->hregion[i].lock);
 
 	/* There can't be another parallel resizing,
-	 * but dumping, gc, kernel side add/del are possible
+	 * but dumping, gc, kernel side add/del are possible.
+	 * The new table is pinned by the old one until that is destroyed.
 	 */
-	orig = ipset_dereference_bh_nfnl(h->table);
-	atomic_set(&orig->ref, 1);
-	atomic_inc(&orig->uref);
+	atomic_set(&t->uref, 1);
+	rcu_assign_pointer(orig->next, t);
 	pr_debug("attempt to resize set %s from %u to %u, t %p\n",
 		 set->name, orig->htable_bits, htable_bits, orig);
-	for (r = 0; r < ahash_numof_locks(orig->htable_bits); r++) {
-		/* Expire may replace a hbucket with another one */
-		rcu_read_lock_bh();
-		for (i = ahash_bucket_start(r, orig->htable_bits);
-		     i < ahash_bucket_end(r, orig->htable_bits); i++) {
-			n = __ipset_dereference(hbucket(orig, i));
-			if (!n)
-				continue;
-			for (j = 0; j < n->pos; j++) {
-				if (!test_bit(j, n->used))
-					continue;
-				data = ahash_data(n, j, dsize);
-				if (SET_ELEM_EXPIRED(set, data))
-					continue;
-#ifdef IP_SET_HASH_WITH_NETS
-				/* We have readers running parallel with us,
-				 * so the live data cannot be modified.
-				 */
-				flags = 0;
-				memcpy(tmp, data, dsize);
-				data = tmp;
-				mtype_data_reset_flags(data, &flags);
-#endif
-				key = HKEY(data, h->initval, htable_bits);
-				m = __ipset_dereference(hbucket(t, key));
-				nr = ahash_region(key, htable_bits);
-				if (!m) {
-					m = kzalloc(sizeof(*m) +
-					    AHASH_INIT_SIZE * dsize,
-					    GFP_ATOMIC);
-					if (!m) {
-						ret = -ENOMEM;
-						goto cleanup;
-					}
-					m->size = AHASH_INIT_SIZE;
-					t->hregion[nr].ext_size +=
-						ext_size(AHASH_INIT_SIZE,
-							 dsize);
-					RCU_INIT_POINTER(hbucket(t, key), m);
-				} else if (m->pos >= m->size) {
-					struct hbucket *ht;
-
-					if (m->size >= AHASH_MAX(h)) {
-						ret = -EAGAIN;
-					} else {
-						ht = kzalloc(sizeof(*ht) +
-						(m->size + AHASH_INIT_SIZE)
-						* dsize,
-						GFP_ATOMIC);
-						if (!ht)
-							ret = -ENOMEM;
-					}
-					if (ret < 0)
-						goto cleanup;
-					memcpy(ht, m, sizeof(struct hbucket) +
-					       m->size * dsize);
-					ht->size = m->size + AHASH_INIT_SIZE;
-					t->hregion[nr].ext_size +=
-						ext_size(AHASH_INIT_SIZE,
-							 dsize);
-					kfree(m);
-					m = ht;
-					RCU_INIT_POINTER(hbucket(t, key), ht);
-				}
-				d = ahash_data(m, m->pos, dsize);
-				memcpy(d, data, dsize);
-				set_bit(m->pos++, m->used);
-				t->hregion[nr].elements++;
-#ifdef IP_SET_HASH_WITH_NETS
-				mtype_data_reset_flags(d, &flags);
-#endif
-			}
-		}
-		rcu_read_unlock_bh();
+
+move:
+	atomic_inc(&orig->uref);
+	for (r = orig->moved; r < ahash_numof_locks(orig->htable_bits); r++) {
+		ret = mtype_resize_region(set, orig, t, r);
+		if (ret < 0)
+			break;
+		cond_resched();
+	}
+	if (ret < 0) {
+		/* Both tables stay in use until the next attempt */
+		atomic_dec(&orig->uref);
+		return ret;
 	}
 
-	/* There can't be any other writer. */
+	/* There can't be any other writer of the table pointer. */
 	rcu_assign_pointer(h->table, t);
 
 	/* Give time to other readers of the set */
@@ -761,46 +927,40 @@ mtype_resize(struct ip_set *set, bool retried)
 
 	pr_debug("set %s resized from %u (%p) to %u (%p)\n", set->name,
 		 orig->htable_bits, orig, t->htable_bits, t);
-	/* Add/delete elements processed by the SET target during resize.
-	 * Kernel-side add cannot trigger a resize and userspace actions
-	 * are serialized by the mutex.
-	 */
-	list_for_each_safe(l, lt, &h->ad) {
-		x = list_entry(l, struct mtype_resize_ad, list);
-		if (x->ad == IPSET_ADD) {
-			mtype_add(set, &x->d, &x->ext, &x->mext, x->flags);
-		} else {
-			mtype_del(set, &x->d, NULL, NULL, 0);
-		}
-		list_del(l);
-		kfree(l);
-	}
-	/* If there's nobody else using the table, destroy it */
+	/* Users still holding the old table destroy it when done */
+	atomic_set(&orig->ref, 1);
 	if (atomic_dec_and_test(&orig->uref)) {
 		pr_debug("Table destroy by resize %p\n", orig);
 		mtype_ahash_destroy(set, orig, false);
 	}
 
-out:
-#ifdef IP_SET_HASH_WITH_NETS
-	kfree(tmp);
-#endif
-	return ret;
-
-cleanup:
-	rcu_read_unlock_bh();
-	atomic_set(&orig->ref, 0);
-	atomic_dec(&orig->uref);
-	mtype_ahash_destroy(set, t, false);
-	if (ret == -EAGAIN)
-		goto retry;
-	goto out;
+	return 0;
 
 hbwarn:
 	/* In case we have plenty of memory :-) */
 	pr_warn("Cannot increase the hashsize of set %s further\n", set->name);
-	ret = -IPSET_ERR_HASH_FULL;
-	goto out;
+	return -IPSET_ERR_HASH_FULL;
+}
+
+/* Grow the hash table ahead of a bulk add, rather than doubling it
+ * each time a bucket overflows while the elements are added.
+ */
+static void
+mtype_reserve(struct ip_set *set, u32 elements)
+{
+	struct htype *h = set->data;
+	const struct htable *t;
+
+	elements = min(elements, h->maxelem);
+	for (;;) {
+		t = ipset_dereference_nfnl(h->table);
+		/* An interrupted resize is completed first */
+		if (!rcu_access_pointer(t->next) &&
+		    jhash_size(t->htable_bits) >= elements / AHASH_INIT_SIZE)
+			return;
+		if (mtype_resize(set, false))
+			return;
+	}
 }
 
 /* Get the current number of elements and ext_size in the set  */
@@ -813,22 +973,48 @@ mtype_ext_size(struct ip_set *set, u32 *elements, size_t *ext_size)
 	struct hbucket *n;
 	struct mtype_elem *data;
 
-	t = rcu_dereference_bh(h->table);
-	for (r = 0; r < ahash_numof_locks(t->htable_bits); r++) {
-		for (i = ahash_bucket_start(r, t->htable_bits);
-		     i < ahash_bucket_end(r, t->htable_bits); i++) {
-			n = rcu_dereference_bh(hbucket(t, i));
-			if (!n)
-				continue;
-			for (j = 0; j < n->pos; j++) {
-				if (!test_bit(j, n->used))
+	/* Moved buckets are emptied in the old table during resize */
+	for (t = rcu_dereference_bh(h->table); t;
+	     t = rcu_dereference_bh(t->next)) {
+		for (r = 0; r < ahash_numof_locks(t->htable_bits); r++) {
+			for (i = ahash_bucket_start(r, t->htable_bits);
+			     i < ahash_bucket_end(r, t->htable_bits); i++) {
+				n = rcu_dereference_bh(hbucket(t, i));
+				if (!n)
 					continue;
-				data = ahash_data(n, j, set->dsize);
-				if (!SET_ELEM_EXPIRED(set, data))
-					(*elements)++;
+				for (j = 0; j < n->pos; j++) {
+					if (!test_bit(j, n->used))
+						continue;
+					data = ahash_data(n, j, set->dsize);
+					if (!SET_ELEM_EXPIRED(set, data))
+						(*elements)++;
+				}
 			}
+			*ext_size += t->hregion[r].ext_size;
 		}
-		*ext_size += t->hregion[r].ext_size;
+	}
+}
+
+/* Get the bucket of an element for readers: during resize, the buckets
+ * of the regions already moved are empty in the old table and the
+ * element is looked up in the new one.
+ */
+static struct hbucket *
+mtype_bucket(const struct htype *h, const struct htable *t,
+	     const struct mtype_elem *d)
+{
+	struct hbucket *n;
+
+	for (;;) {
+		n = rcu_dereference_bh(hbucket(t, HKEY(d, h->initval,
+						       t->htable_bits)));
+		if (n)
+			return n;
+		t = rcu_dereference_bh(t->next);
+		if (!t)
+			return NULL;
+		/* Pairs with smp_wmb() in mtype_resize_region() */
+		smp_rmb();
 	}
 }
 
@@ -844,20 +1030,36 @@ mtype_add(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 	const struct mtype_elem *d = value;
 	struct mtype_elem *data;
 	struct hbucket *n, *old = ERR_PTR(-ENOENT);
+	struct ip_set_counter_rcu *counter = NULL;
 	int i, j = -1, ret;
 	bool flag_exist = flags & IPSET_FLAG_EXIST;
 	bool deleted = false, forceadd = false, reuse = false;
 	u32 r, key, multi = 0, elements, maxelem;
 
+	if (SET_WITH_PCPU_COUNTER(set)) {
+		counter = ip_set_alloc_counter();
+		if (!counter)
+			return -ENOMEM;
+	}
+
+retry:
 	rcu_read_lock_bh();
 	t = rcu_dereference_bh(h->table);
 	key = HKEY(value, h->initval, t->htable_bits);
 	r = ahash_region(key, t->htable_bits);
+	/* Region already moved by resizing */
+	while (r < smp_load_acquire(&t->moved)) {
+		t = rcu_dereference_bh(t->next);
+		key = HKEY(value, h->initval, t->htable_bits);
+		r = ahash_region(key, t->htable_bits);
+	}
 	atomic_inc(&t->uref);
 	elements = t->hregion[r].elements;
 	maxelem = t->maxelem;
 	if (elements >= maxelem) {
+		const struct htable *x;
 		u32 e;
+
 		if (SET_WITH_TIMEOUT(set)) {
 			rcu_read_unlock_bh();
 			mtype_gc_do(set, h, t, r);
@@ -865,14 +1067,23 @@ mtype_add(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 		}
 		maxelem = h->maxelem;
 		elements = 0;
-		for (e = 0; e < ahash_numof_locks(t->htable_bits); e++)
-			elements += t->hregion[e].elements;
+		/* Count both tables during resize */
+		for (x = rcu_dereference_bh(h->table); x;
+		     x = rcu_dereference_bh(x->next))
+			for (e = 0; e < ahash_numof_locks(x->htable_bits); e++)
+				elements += x->hregion[e].elements;
 		if (elements >= maxelem && SET_WITH_FORCEADD(set))
 			forceadd = true;
 	}
 	rcu_read_unlock_bh();
 
 	spin_lock_bh(&t->hregion[r].lock);
+	if (unlikely(r < t->moved)) {
+		/* Moved while we were waiting for the lock */
+		spin_unlock_bh(&t->hregion[r].lock);
+		mtype_table_put(set, t);
+		goto retry;
+	}
 	n = rcu_dereference_bh(hbucket(t, key));
 	if (!n) {
 		if (forceadd || elements >= maxelem)
@@ -944,7 +1155,7 @@ mtype_add(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 			/* Trigger rehashing */
 			mtype_data_next(&h->next, d);
 			ret = -EAGAIN;
-			goto resize;
+			goto unlock;
 		}
 		old = n;
 		n = kzalloc(sizeof(*n) +
@@ -969,6 +1180,9 @@ mtype_add(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 #ifdef IP_SET_HASH_WITH_NETS
 	for (i = 0; i < IPSET_NET_COUNT; i++)
 		mtype_add_cidr(set, h, NCIDR_PUT(DCIDR_GET(d->cidr, i)), i);
+#endif
+#ifdef IP_SET_HASH_WITH_NETS_INDEX
+	mtype_add_index(h, d);
 #endif
 	memcpy(data, d, sizeof(struct mtype_elem));
 overwrite_extensions:
@@ -976,14 +1190,17 @@ mtype_add(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 	mtype_data_set_flags(data, flags);
 #endif
 	if (SET_WITH_COUNTER(set))
-		ip_set_init_counter(ext_counter(data, set), ext);
+		ip_set_init_counter(set, ext_counter(data, set), ext,
+				    &counter);
 	if (SET_WITH_COMMENT(set))
 		ip_set_init_comment(set, ext_comment(data, set), ext);
 	if (SET_WITH_SKBINFO(set))
 		ip_set_init_skbinfo(ext_skbinfo(data, set), ext);
 	/* Must come last for the case when timed out entry is reused */
-	if (SET_WITH_TIMEOUT(set))
+	if (SET_WITH_TIMEOUT(set)) {
 		ip_set_timeout_set(ext_timeout(data, set), ext->timeout);
+		mtype_expires(h, &t->hregion[r], *ext_timeout(data, set));
+	}
 	smp_mb__before_atomic();
 	set_bit(j, n->used);
 	if (old != ERR_PTR(-ENOENT)) {
@@ -992,26 +1209,7 @@ mtype_add(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 			kfree_rcu(old, rcu);
 	}
 	ret = 0;
-resize:
-	spin_unlock_bh(&t->hregion[r].lock);
-	if (atomic_read(&t->ref) && ext->target) {
-		/* Resize is in process and kernel side add, save values */
-		struct mtype_resize_ad *x;
-
-		x = kzalloc(sizeof(struct mtype_resize_ad), GFP_ATOMIC);
-		if (!x)
-			/* Don't bother */
-			goto out;
-		x->ad = IPSET_ADD;
-		memcpy(&x->d, value, sizeof(struct mtype_elem));
-		memcpy(&x->ext, ext, sizeof(struct ip_set_ext));
-		memcpy(&x->mext, mext, sizeof(struct ip_set_ext));
-		x->flags = flags;
-		spin_lock_bh(&set->lock);
-		list_add_tail(&x->list, &h->ad);
-		spin_unlock_bh(&set->lock);
-	}
-	goto out;
+	goto unlock;
 
 set_full:
 	if (net_ratelimit())
@@ -1025,6 +1223,7 @@ mtype_add(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 		pr_debug("Table destroy after resize by add: %p\n", t);
 		mtype_ahash_destroy(set, t, false);
 	}
+	ip_set_free_counter(counter);
 	return ret;
 }
 
@@ -1039,22 +1238,32 @@ mtype_del(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 	const struct mtype_elem *d = value;
 	struct mtype_elem *data;
 	struct hbucket *n;
-	struct mtype_resize_ad *x = NULL;
 	int i, j, k, r, ret = -IPSET_ERR_EXIST;
 	u32 key, multi = 0;
 	size_t dsize = set->dsize;
 
-	/* Userspace add and resize is excluded by the mutex.
-	 * Kernespace add does not trigger resize.
+	/* Kernel side del may run parallel with resizing: pick the table
+	 * by the regions already moved, as in add.
 	 */
+retry:
 	rcu_read_lock_bh();
 	t = rcu_dereference_bh(h->table);
 	key = HKEY(value, h->initval, t->htable_bits);
 	r = ahash_region(key, t->htable_bits);
+	while (r < smp_load_acquire(&t->moved)) {
+		t = rcu_dereference_bh(t->next);
+		key = HKEY(value, h->initval, t->htable_bits);
+		r = ahash_region(key, t->htable_bits);
+	}
 	atomic_inc(&t->uref);
 	rcu_read_unlock_bh();
 
 	spin_lock_bh(&t->hregion[r].lock);
+	if (unlikely(r < t->moved)) {
+		spin_unlock_bh(&t->hregion[r].lock);
+		mtype_table_put(set, t);
+		goto retry;
+	}
 	n = rcu_dereference_bh(hbucket(t, key));
 	if (!n)
 		goto out;
@@ -1082,19 +1291,6 @@ mtype_del(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 #endif
 		ip_set_ext_destroy(set, data);
 
-		if (atomic_read(&t->ref) && ext->target) {
-			/* Resize is in process and kernel side del,
-			 * save values
-			 */
-			x = kzalloc(sizeof(struct mtype_resize_ad),
-				    GFP_ATOMIC);
-			if (x) {
-				x->ad = IPSET_DEL;
-				memcpy(&x->d, value,
-				       sizeof(struct mtype_elem));
-				x->flags = flags;
-			}
-		}
 		for (; i < n->pos; i++) {
 			if (!test_bit(i, n->used))
 				k++;
@@ -1129,11 +1325,6 @@ mtype_del(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 
 out:
 	spin_unlock_bh(&t->hregion[r].lock);
-	if (x) {
-		spin_lock_bh(&set->lock);
-		list_add(&x->list, &h->ad);
-		spin_unlock_bh(&set->lock);
-	}
 	if (atomic_dec_and_test(&t->uref) && atomic_read(&t->ref)) {
 		pr_debug("Table destroy after resize by del: %p\n", t);
 		mtype_ahash_destroy(set, t, false);
@@ -1170,10 +1361,18 @@ mtype_test_cidrs(struct ip_set *set, struct mtype_elem *d,
 #else
 	int ret, i, j = 0;
 #endif
-	u32 key, multi = 0;
+#ifdef IP_SET_HASH_WITH_NETS_INDEX
+	const unsigned long *index = h->nets_index[NETS_INDEX(d)];
+#endif
+	u32 multi = 0;
 
 	pr_debug("test by nets\n");
 	for (; j < NLEN && h->nets[j].cidr[0] && !multi; j++) {
+#ifdef IP_SET_HASH_WITH_NETS_INDEX
+		/* No network of this size around the address */
+		if (!test_bit(NCIDR_GET(h->nets[j].cidr[0]), index))
+			continue;
+#endif
 #if IPSET_NET_COUNT == 2
 		mtype_data_reset_elem(d, &orig);
 		mtype_data_netmask(d, NCIDR_GET(h->nets[j].cidr[0]), false);
@@ -1184,8 +1383,7 @@ mtype_test_cidrs(struct ip_set *set, struct mtype_elem *d,
 #else
 		mtype_data_netmask(d, NCIDR_GET(h->nets[j].cidr[0]));
 #endif
-		key = HKEY(d, h->initval, t->htable_bits);
-		n = rcu_dereference_bh(hbucket(t, key));
+		n = mtype_bucket(h, t, d);
 		if (!n)
 			continue;
 		for (i = 0; i < n->pos; i++) {
@@ -1221,7 +1419,7 @@ mtype_test(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 	struct hbucket *n;
 	struct mtype_elem *data;
 	int i, ret = 0;
-	u32 key, multi = 0;
+	u32 multi = 0;
 
 	rcu_read_lock_bh();
 	t = rcu_dereference_bh(h->table);
@@ -1238,8 +1436,7 @@ mtype_test(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 	}
 #endif
 
-	key = HKEY(d, h->initval, t->htable_bits);
-	n = rcu_dereference_bh(hbucket(t, key));
+	n = mtype_bucket(h, t, d);
 	if (!n) {
 		ret = 0;
 		goto out;
@@ -1348,19 +1545,63 @@ mtype_uref(struct ip_set *set, struct netlink_callback *cb, bool start)
 	}
 }
 
+/* Dump the elements of bucket i of t. Once moved by resizing, they are
+ * in the buckets i and i + size of t of the next table.
+ */
+static int
+mtype_list_bucket(const struct ip_set *set, struct sk_buff *skb,
+		  const struct htable *t, u32 i)
+{
+	const struct htable *next;
+	const struct hbucket *n;
+	const struct mtype_elem *e;
+	struct nlattr *nested;
+	int j, ret;
+
+	n = rcu_dereference(hbucket(t, i));
+	pr_debug("cb->arg bucket: %u, t %p n %p\n", i, t, n);
+	if (!n) {
+		next = rcu_dereference(t->next);
+		if (!next)
+			return 0;
+		/* Pairs with smp_wmb() in mtype_resize_region() */
+		smp_rmb();
+		ret = mtype_list_bucket(set, skb, next, i);
+		if (ret)
+			return ret;
+		return mtype_list_bucket(set, skb, next,
+					 i + jhash_size(t->htable_bits));
+	}
+	for (j = 0; j < n->pos; j++) {
+		if (!test_bit(j, n->used))
+			continue;
+		e = ahash_data(n, j, set->dsize);
+		if (SET_ELEM_EXPIRED(set, e))
+			continue;
+		pr_debug("list hash %u hbucket %p i %u, data %p\n",
+			 i, n, j, e);
+		nested = nla_nest_start(skb, IPSET_ATTR_DATA);
+		if (!nested)
+			return -EMSGSIZE;
+		if (mtype_data_list(skb, e) ||
+		    ip_set_put_extensions(skb, set, e, true))
+			return -ENOSPC;
+		nla_nest_end(skb, nested);
+	}
+	return 0;
+}
+
 /* Reply a LIST/SAVE request: dump the elements of the specified set */
 static int
 mtype_list(const struct ip_set *set,
 	   struct sk_buff *skb, struct netlink_callback *cb)
 {
 	const struct htable *t;
-	struct nlattr *atd, *nested;
-	const struct hbucket *n;
-	const struct mtype_elem *e;
+	struct nlattr *atd;
 	u32 first = cb->args[IPSET_CB_ARG0];
 	/* We assume that one hash bucket fills into one page */
 	void *incomplete;
-	int i, ret = 0;
+	int ret = 0;
 
 	atd = nla_nest_start(skb, IPSET_ATTR_ADT);
 	if (!atd)
@@ -1374,34 +1615,15 @@ mtype_list(const struct ip_set *set,
 	     cb->args[IPSET_CB_ARG0]++) {
 		cond_resched_rcu();
 		incomplete = skb_tail_pointer(skb);
-		n = rcu_dereference(hbucket(t, cb->args[IPSET_CB_ARG0]));
-		pr_debug("cb->arg bucket: %lu, t %p n %p\n",
-			 cb->args[IPSET_CB_ARG0], t, n);
-		if (!n)
+		ret = mtype_list_bucket(set, skb, t, cb->args[IPSET_CB_ARG0]);
+		if (!ret)
 			continue;
-		for (i = 0; i < n->pos; i++) {
-			if (!test_bit(i, n->used))
-				continue;
-			e = ahash_data(n, i, set->dsize);
-			if (SET_ELEM_EXPIRED(set, e))
-				continue;
-			pr_debug("list hash %lu hbucket %p i %u, data %p\n",
-				 cb->args[IPSET_CB_ARG0], n, i, e);
-			nested = nla_nest_start(skb, IPSET_ATTR_DATA);
-			if (!nested) {
-				if (cb->args[IPSET_CB_ARG0] == first) {
-					nla_nest_cancel(skb, atd);
-					ret = -EMSGSIZE;
-					goto out;
-				}
-				goto nla_put_failure;
-			}
-			if (mtype_data_list(skb, e))
-				goto nla_put_failure;
-			if (ip_set_put_extensions(skb, set, e, true))
-				goto nla_put_failure;
-			nla_nest_end(skb, nested);
+		if (ret == -EMSGSIZE && cb->args[IPSET_CB_ARG0] == first) {
+			nla_nest_cancel(skb, atd);
+			goto out;
 		}
+		ret = 0;
+		goto nla_put_failure;
 	}
 	nla_nest_end(skb, atd);
 	/* Set listing finished */
@@ -1448,6 +1670,7 @@ static const struct ip_set_type_variant mtype_variant = {
 	.list	= mtype_list,
 	.uref	= mtype_uref,
 	.resize	= mtype_resize,
+	.reserve = mtype_reserve,
 	.same_set = mtype_same_set,
 	.cancel_gc = mtype_cancel_gc,
 	.region_lock = true,
@@ -1605,7 +1828,6 @@ IPSET_TOKEN(HTYPE, _create)(struct net *net, struct ip_set *set,
 	t->maxelem = h->maxelem / ahash_numof_locks(hbits);
 	RCU_INIT_POINTER(h->table, t);
 
-	INIT_LIST_HEAD(&h->ad);
 	set->data = h;
 #ifndef IP_SET_PROTO_UNDEF
 	if (set->family == NFPROTO_IPV4) {
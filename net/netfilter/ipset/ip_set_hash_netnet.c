@@ -36,6 +36,7 @@ MODULE_ALIAS("ip_set_hash:net,net");
 #define IP_SET_HASH_WITH_NETS
 #define IP_SET_HASH_WITH_NETMASK
 #define IP_SET_HASH_WITH_BITMASK
+#define IP_SET_HASH_WITH_NETS_INDEX
 #define IPSET_NET_COUNT 2
 
 /* IPv4 variants */
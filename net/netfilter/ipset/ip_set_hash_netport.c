@@ -44,6 +44,7 @@ MODULE_ALIAS("ip_set_hash:net,port");
  * dancing back and forth.
  */
 #define IP_SET_HASH_WITH_NETS_PACKED
+#define IP_SET_HASH_WITH_NETS_INDEX
 
 /* IPv4 variant */
 
@@ -27,12 +27,14 @@ struct set_elem {
 	struct rcu_head rcu;
 	struct list_head list;
 	struct ip_set *set;	/* Sigh, in order to cleanup reference */
+	struct ip_set *member;	/* The set behind id, resolved at add */
 	ip_set_id_t id;
 } __aligned(__alignof__(u64));
 
 struct set_adt_elem {
 	ip_set_id_t id;
 	ip_set_id_t refid;
+	struct ip_set *member;
 	int before;
 };
 
@@ -43,6 +45,7 @@ struct list_set {
 	struct ip_set *set;	/* attached to this ip_set */
 	struct net *net;	/* namespace */
 	struct list_head members; /* the set members */
+	bool swapping;		/* member pointers not updated yet */
 };
 
 static int
@@ -61,7 +64,14 @@ list_set_ktest(struct ip_set *set, const struct sk_buff *skb,
 	if (opt->cmdflags & IPSET_FLAG_SKIP_SUBCOUNTER_UPDATE)
 		opt->cmdflags |= IPSET_FLAG_SKIP_COUNTER_UPDATE;
 	list_for_each_entry_rcu(e, &map->members, list) {
-		ret = ip_set_test(e->id, skb, par, opt);
+		if (SET_WITH_TIMEOUT(set) &&
+		    ip_set_timeout_expired(ext_timeout(e, set)))
+			continue;
+		if (unlikely(smp_load_acquire(&map->swapping)))
+			ret = ip_set_test(e->id, skb, par, opt);
+		else
+			ret = ip_set_test_set(READ_ONCE(e->member), skb, par,
+					      opt);
 		if (ret <= 0)
 			continue;
 		if (ip_set_match_extensions(set, ext, mext, flags, e))
@@ -219,10 +229,10 @@ list_set_utest(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 
 static void
 list_set_init_extensions(struct ip_set *set, const struct ip_set_ext *ext,
-			 struct set_elem *e)
+			 struct set_elem *e, struct ip_set_counter_rcu **counter)
 {
 	if (SET_WITH_COUNTER(set))
-		ip_set_init_counter(ext_counter(e, set), ext);
+		ip_set_init_counter(set, ext_counter(e, set), ext, counter);
 	if (SET_WITH_COMMENT(set))
 		ip_set_init_comment(set, ext_comment(e, set), ext);
 	if (SET_WITH_SKBINFO(set))
@@ -239,6 +249,7 @@ list_set_uadd(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 	struct list_set *map = set->data;
 	struct set_adt_elem *d = value;
 	struct set_elem *e, *n, *prev, *next;
+	struct ip_set_counter_rcu *counter = NULL;
 	bool flag_exist = flags & IPSET_FLAG_EXIST;
 
 	/* Find where to add the new entry */
@@ -262,13 +273,22 @@ list_set_uadd(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 	    (d->before < 0 && !prev))
 		return -IPSET_ERR_REF_EXIST;
 
+	if (SET_WITH_PCPU_COUNTER(set)) {
+		counter = ip_set_alloc_counter();
+		if (!counter)
+			return -ENOMEM;
+	}
+
 	/* Re-add already existing element */
 	if (n) {
-		if (!flag_exist)
+		if (!flag_exist) {
+			ip_set_free_counter(counter);
 			return -IPSET_ERR_EXIST;
+		}
 		/* Update extensions */
 		ip_set_ext_destroy(set, n);
-		list_set_init_extensions(set, ext, n);
+		list_set_init_extensions(set, ext, n, &counter);
+		ip_set_free_counter(counter);
 
 		/* Set is already added to the list */
 		ip_set_put_byindex(map->net, d->id);
@@ -295,12 +315,16 @@ list_set_uadd(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 		n = NULL;
 
 	e = kzalloc(set->dsize, GFP_ATOMIC);
-	if (!e)
+	if (!e) {
+		ip_set_free_counter(counter);
 		return -ENOMEM;
+	}
 	e->id = d->id;
+	e->member = d->member;
 	e->set = set;
 	INIT_LIST_HEAD(&e->list);
-	list_set_init_extensions(set, ext, e);
+	list_set_init_extensions(set, ext, e, &counter);
+	ip_set_free_counter(counter);
 	if (n)
 		list_set_replace(set, e, n);
 	else if (next)
@@ -370,6 +394,7 @@ list_set_uadt(struct ip_set *set, struct nlattr *tb[],
 	e.id = ip_set_get_byname(map->net, nla_data(tb[IPSET_ATTR_NAME]), &s);
 	if (e.id == IPSET_INVALID_ID)
 		return -IPSET_ERR_NAME;
+	e.member = s;
 	/* "Loop detection" */
 	if (s->type->features & IPSET_TYPE_NAME) {
 		ret = -IPSET_ERR_LOOP;
@@ -552,6 +577,31 @@ list_set_cancel_gc(struct ip_set *set)
 	list_set_flush(set);
 }
 
+static void
+list_set_swapping(struct ip_set *set)
+{
+	struct list_set *map = set->data;
+
+	WRITE_ONCE(map->swapping, true);
+}
+
+static void
+list_set_swapped(struct ip_set *set, struct ip_set *a, struct ip_set *b)
+{
+	struct list_set *map = set->data;
+	struct set_elem *e;
+
+	spin_lock_bh(&set->lock);
+	list_for_each_entry(e, &map->members, list) {
+		if (e->member == a)
+			WRITE_ONCE(e->member, b);
+		else if (e->member == b)
+			WRITE_ONCE(e->member, a);
+	}
+	smp_store_release(&map->swapping, false);
+	spin_unlock_bh(&set->lock);
+}
+
 static const struct ip_set_type_variant set_variant = {
 	.kadt	= list_set_kadt,
 	.uadt	= list_set_uadt,
@@ -566,6 +616,8 @@ static const struct ip_set_type_variant set_variant = {
 	.list	= list_set_list,
 	.same_set = list_set_same_set,
 	.cancel_gc = list_set_cancel_gc,
+	.swapping = list_set_swapping,
+	.swapped = list_set_swapped,
 };
 
 static void
@@ -0,0 +1,182 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/* Unstable IPVS Helpers for XDP hook
+ *
+ * These are called from the XDP programs.
+ * Note that it is allowed to break compatibility for these functions since
+ * the interface they are exposed through to BPF programs is explicitly
+ * unstable.
+ */
+
+#define KMSG_COMPONENT "IPVS"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/bpf.h>
+#include <linux/btf.h>
+#include <linux/if_ether.h>
+#include <linux/in.h>
+#include <net/xdp.h>
+#include <net/ip_vs.h>
+
+/* bpf_ipvs_opts - options for bpf ipvs helpers
+ * @error: out parameter, set for any encountered error
+ */
+struct bpf_ipvs_opts {
+	s32 error;
+};
+
+enum {
+	IP_VS_BPF_OPTS_SZ = 4,
+};
+
+__diag_push();
+__diag_ignore_all("-Wmissing-prototypes",
+		  "Global functions as their definitions will be in ip_vs BTF");
+
+__bpf_kfunc_start_defs();
+
+/* Only connections that ip_vs_in_hook() would just hand to the transmitter
+ * without looking at the payload or at the state of the protocol.
+ */
+static int bpf_xdp_ipvs_conn_check(const struct ip_vs_conn *cp)
+{
+	struct ip_vs_dest *dest = cp->dest;
+
+	switch (IP_VS_FWD_METHOD(cp)) {
+	case IP_VS_CONN_F_DROUTE:
+	case IP_VS_CONN_F_TUNNEL:
+		break;
+	default:
+		return -EOPNOTSUPP;
+	}
+
+	if (cp->app || cp->flags & IP_VS_CONN_F_ONE_PACKET ||
+	    !dest || !(dest->flags & IP_VS_DEST_F_AVAILABLE))
+		return -EOPNOTSUPP;
+
+	/* state changes and sync messages are driven by the stack */
+	if (cp->ipvs->sync_state & IP_VS_STATE_MASTER)
+		return -EOPNOTSUPP;
+
+	switch (cp->protocol) {
+	case IPPROTO_TCP:
+		if (cp->state != IP_VS_TCP_S_ESTABLISHED)
+			return -EAGAIN;
+		break;
+	case IPPROTO_UDP:
+		break;
+	case IPPROTO_SCTP:
+		if (cp->state != IP_VS_SCTP_S_ESTABLISHED)
+			return -EAGAIN;
+		break;
+	default:
+		return -EOPNOTSUPP;
+	}
+
+	return 0;
+}
+
+/**
+ * bpf_xdp_ipvs_conn_lookup - look up the IPVS connection of a packet
+ * @ctx: XDP context, starting with the ethernet header
+ * @fib_tuple: addresses and ports of the packet, from client to virtual
+ *	service, l4_protocol and family set
+ * @opts: options, @opts->error set on failure
+ * @opts_len: size of @opts, must be IP_VS_BPF_OPTS_SZ
+ *
+ * Looks the connection up in the netns of the receiving device, like
+ * ip_vs_in_hook() does for an skb.  Only established direct routing and
+ * tunnel connections are returned, their packets are accounted and their
+ * timeout is refreshed as if the stack had forwarded them.  The caller
+ * then builds the packet for the real server, cp->daddr and cp->dest
+ * hold the address and the tunnel settings, and redirects it.  TCP
+ * packets with SYN, FIN or RST set have to be passed to the stack, which
+ * tracks the state of the connection.
+ *
+ * The connection is not referenced: it stays valid until the program
+ * returns.
+ *
+ * Returns: the connection, or NULL with @opts->error set: -ENOENT if none
+ * was found, -EAGAIN if it isn't established yet, -EOPNOTSUPP if its
+ * packets have to go through the stack.
+ */
+__bpf_kfunc struct ip_vs_conn *
+bpf_xdp_ipvs_conn_lookup(struct xdp_md *ctx, struct bpf_fib_lookup *fib_tuple,
+			 struct bpf_ipvs_opts *opts, u32 opts_len)
+{
+	struct xdp_buff *xdp = (struct xdp_buff *)ctx;
+	union nf_inet_addr caddr = {}, vaddr = {};
+	struct net_device *dev = xdp->rxq->dev;
+	struct netns_ipvs *ipvs = net_ipvs(dev_net(dev));
+	struct ip_vs_conn_param p;
+	struct ip_vs_conn *cp;
+	int err;
+
+	if (opts_len != IP_VS_BPF_OPTS_SZ) {
+		opts->error = -EINVAL;
+		return NULL;
+	}
+
+	switch (fib_tuple->family) {
+	case AF_INET:
+		caddr.ip = fib_tuple->ipv4_src;
+		vaddr.ip = fib_tuple->ipv4_dst;
+		break;
+#ifdef CONFIG_IP_VS_IPV6
+	case AF_INET6:
+		memcpy(&caddr.in6, fib_tuple->ipv6_src, sizeof(caddr.in6));
+		memcpy(&vaddr.in6, fib_tuple->ipv6_dst, sizeof(vaddr.in6));
+		break;
+#endif
+	default:
+		opts->error = -EAFNOSUPPORT;
+		return NULL;
+	}
+
+	if (!ipvs || sysctl_backup_only(ipvs) || !READ_ONCE(ipvs->enable)) {
+		opts->error = -ENOENT;
+		return NULL;
+	}
+
+	ip_vs_conn_fill_param(ipvs, fib_tuple->family, fib_tuple->l4_protocol,
+			      &caddr, fib_tuple->sport, &vaddr,
+			      fib_tuple->dport, &p);
+	cp = ip_vs_conn_in_get(&p);
+	if (!cp) {
+		opts->error = -ENOENT;
+		return NULL;
+	}
+
+	err = bpf_xdp_ipvs_conn_check(cp);
+	if (err) {
+		__ip_vs_conn_put(cp);
+		opts->error = err;
+		return NULL;
+	}
+
+	ip_vs_in_stats_len(cp, xdp_get_buff_len(xdp) - ETH_HLEN);
+	/* rearms the timer, the memory is freed after a grace period */
+	ip_vs_conn_put(cp);
+
+	return cp;
+}
+
+__diag_pop()
+
+__bpf_kfunc_end_defs();
+
+BTF_KFUNCS_START(ip_vs_kfunc_set)
+BTF_ID_FLAGS(func, bpf_xdp_ipvs_conn_lookup, KF_TRUSTED_ARGS | KF_RET_NULL)
+BTF_KFUNCS_END(ip_vs_kfunc_set)
+
+static const struct btf_kfunc_id_set ip_vs_bpf_kfunc_set = {
+	.owner = THIS_MODULE,
+	.set   = &ip_vs_kfunc_set,
+};
+
+int ip_vs_register_bpf(void)
+{
+	return register_btf_kfunc_id_set(BPF_PROG_TYPE_XDP,
+					 &ip_vs_bpf_kfunc_set);
+}
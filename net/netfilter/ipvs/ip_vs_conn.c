@@ -32,6 +32,7 @@
 #include <linux/jhash.h>
 #include <linux/random.h>
 #include <linux/rcupdate_wait.h>
+#include <linux/prefetch.h>
 
 #include <net/net_namespace.h>
 #include <net/ip_vs.h>
@@ -42,20 +43,17 @@
 #endif
 
 /*
- * Connection hash size. Default is what was selected at compile time.
+ * Connection hash size of init_net. Default is what was selected at
+ * compile time. The other netns start with the smallest table, all of
+ * them grow with their number of connections.
 */
 static int ip_vs_conn_tab_bits = CONFIG_IP_VS_TAB_BITS;
 module_param_named(conn_tab_bits, ip_vs_conn_tab_bits, int, 0444);
 MODULE_PARM_DESC(conn_tab_bits, "Set connections' hash size");
 
-/* size and mask values */
-int ip_vs_conn_tab_size __read_mostly;
-static int ip_vs_conn_tab_mask __read_mostly;
-
-/*
- *  Connection hash table: for input and output packets lookups of IPVS
- */
-static struct hlist_head *ip_vs_conn_tab __read_mostly;
+/* bounds of the table sizes */
+#define IP_VS_CONN_TAB_BITS_MIN	8
+static int ip_vs_conn_tab_bits_max __read_mostly;
 
 /*  SLAB cache for IPVS connections */
 static struct kmem_cache *ip_vs_conn_cachep __read_mostly;
@@ -85,38 +83,39 @@ struct ip_vs_aligned_lock
 	spinlock_t	l;
 } __attribute__((__aligned__(SMP_CACHE_BYTES)));
 
-/* lock array for conn table */
-static struct ip_vs_aligned_lock
-__ip_vs_conntbl_lock_array[CT_LOCKARRAY_SIZE] __cacheline_aligned;
-
-static inline void ct_write_lock_bh(unsigned int key)
+/*
+ * Lock stripes of the conn table of a netns: a hash value maps to the
+ * same stripe whatever the table size, the smallest table has more
+ * buckets than stripes.
+ */
+static inline void ct_write_lock_bh(struct netns_ipvs *ipvs, unsigned int key)
 {
-	spin_lock_bh(&__ip_vs_conntbl_lock_array[key&CT_LOCKARRAY_MASK].l);
+	spin_lock_bh(&ipvs->conn_locks[key&CT_LOCKARRAY_MASK].l);
 }
 
-static inline void ct_write_unlock_bh(unsigned int key)
+static inline void ct_write_unlock_bh(struct netns_ipvs *ipvs,
+				      unsigned int key)
 {
-	spin_unlock_bh(&__ip_vs_conntbl_lock_array[key&CT_LOCKARRAY_MASK].l);
+	spin_unlock_bh(&ipvs->conn_locks[key&CT_LOCKARRAY_MASK].l);
 }
 
 static void ip_vs_conn_expire(struct timer_list *t);
 
 /*
- *	Returns hash value for IPVS connection entry
+ *	Returns hash value for IPVS connection entry, the bucket is
+ *	selected by the low bits of it
  */
-static unsigned int ip_vs_conn_hashkey(struct netns_ipvs *ipvs, int af, unsigned int proto,
+static unsigned int ip_vs_conn_hashkey(int af, unsigned int proto,
 				       const union nf_inet_addr *addr,
 				       __be16 port)
 {
 #ifdef CONFIG_IP_VS_IPV6
 	if (af == AF_INET6)
-		return (jhash_3words(jhash(addr, 16, ip_vs_conn_rnd),
-				    (__force u32)port, proto, ip_vs_conn_rnd) ^
-			((size_t)ipvs>>8)) & ip_vs_conn_tab_mask;
+		return jhash_3words(jhash(addr, 16, ip_vs_conn_rnd),
+				    (__force u32)port, proto, ip_vs_conn_rnd);
 #endif
-	return (jhash_3words((__force u32)addr->ip, (__force u32)port, proto,
-			    ip_vs_conn_rnd) ^
-		((size_t)ipvs>>8)) & ip_vs_conn_tab_mask;
+	return jhash_3words((__force u32)addr->ip, (__force u32)port, proto,
+			    ip_vs_conn_rnd);
 }
 
 static unsigned int ip_vs_conn_hashkey_param(const struct ip_vs_conn_param *p,
@@ -126,8 +125,7 @@ static unsigned int ip_vs_conn_hashkey_param(const struct ip_vs_conn_param *p,
 	__be16 port;
 
 	if (p->pe_data && p->pe->hashkey_raw)
-		return p->pe->hashkey_raw(p, ip_vs_conn_rnd, inverse) &
-			ip_vs_conn_tab_mask;
+		return p->pe->hashkey_raw(p, ip_vs_conn_rnd, inverse);
 
 	if (likely(!inverse)) {
 		addr = p->caddr;
@@ -137,7 +135,7 @@ static unsigned int ip_vs_conn_hashkey_param(const struct ip_vs_conn_param *p,
 		port = p->vport;
 	}
 
-	return ip_vs_conn_hashkey(p->ipvs, p->af, p->protocol, addr, port);
+	return ip_vs_conn_hashkey(p->af, p->protocol, addr, port);
 }
 
 static unsigned int ip_vs_conn_hashkey_conn(const struct ip_vs_conn *cp)
@@ -156,12 +154,97 @@ static unsigned int ip_vs_conn_hashkey_conn(const struct ip_vs_conn *cp)
 	return ip_vs_conn_hashkey_param(&p, false);
 }
 
+#define ip_vs_conn_tab_idx(hash, bits)	((hash) & ((1U << (bits)) - 1))
+
+/* Bucket to insert a connection with hash value @hash into.
+ * Caller must hold the lock stripe of @hash: it keeps
+ * ip_vs_conn_tab_resize() from moving the bucket meanwhile.
+ */
+static struct hlist_head *ip_vs_conn_tab_bucket(struct netns_ipvs *ipvs,
+						unsigned int hash)
+{
+	struct hlist_head *tab, *old_tab;
+	unsigned int bits, old_bits, seq;
+
+	do {
+		seq = read_seqcount_begin(&ipvs->conn_tab_seq);
+		tab = ipvs->conn_tab;
+		bits = ipvs->conn_tab_bits;
+		old_tab = ipvs->conn_tab_old;
+		old_bits = ipvs->conn_tab_bits_old;
+	} while (read_seqcount_retry(&ipvs->conn_tab_seq, seq));
+
+	if (unlikely(old_tab) &&
+	    ip_vs_conn_tab_idx(hash, old_bits) >=
+	    READ_ONCE(ipvs->conn_tab_next))
+		return &old_tab[ip_vs_conn_tab_idx(hash, old_bits)];
+
+	return &tab[ip_vs_conn_tab_idx(hash, bits)];
+}
+
+/* Chains to search for a hash value: while resizing, the bucket of the
+ * old table comes first, so that a connection moved meanwhile is found
+ * in the new one.
+ */
+struct ip_vs_conn_lookup {
+	struct hlist_head	*chain[2];
+	unsigned int		old_idx;	/* bucket in the old table */
+	unsigned int		next;		/* old buckets moved at start */
+	unsigned int		seq;		/* of the tables looked up */
+};
+
+#define ip_vs_conn_lookup_for_each(cp, l, i)				\
+	for (i = !(l)->chain[0]; i < 2; i++)				\
+		hlist_for_each_entry_rcu(cp, (l)->chain[i], c_list)
+
+static void ip_vs_conn_lookup_start(struct netns_ipvs *ipvs,
+				    unsigned int hash,
+				    struct ip_vs_conn_lookup *l)
+{
+	do {
+		l->seq = read_seqcount_begin(&ipvs->conn_tab_seq);
+		l->chain[0] = NULL;
+		if (unlikely(ipvs->conn_tab_old)) {
+			l->old_idx = ip_vs_conn_tab_idx(hash,
+							ipvs->conn_tab_bits_old);
+			l->chain[0] = &ipvs->conn_tab_old[l->old_idx];
+		}
+		l->chain[1] = &ipvs->conn_tab[ip_vs_conn_tab_idx(hash,
+							ipvs->conn_tab_bits)];
+	} while (read_seqcount_retry(&ipvs->conn_tab_seq, l->seq));
+
+	/* Pairs with smp_store_release() in ip_vs_conn_tab_move() */
+	l->next = smp_load_acquire(&ipvs->conn_tab_next);
+	this_cpu_inc(ipvs->conn_stats->searched);
+}
+
+/* After a miss: search again when a resize started or ended meanwhile, or
+ * when the old bucket was moved, its connections are in neither chain for
+ * a moment.
+ */
+static bool ip_vs_conn_lookup_retry(struct netns_ipvs *ipvs,
+				    const struct ip_vs_conn_lookup *l)
+{
+	if (read_seqcount_retry(&ipvs->conn_tab_seq, l->seq))
+		goto restart;
+	if (likely(!l->chain[0]))
+		return false;
+	smp_rmb();
+	if (l->old_idx < l->next ||
+	    l->old_idx > READ_ONCE(ipvs->conn_tab_next))
+		return false;
+restart:
+	this_cpu_inc(ipvs->conn_stats->search_restart);
+	return true;
+}
+
 /*
- *	Hashes ip_vs_conn in ip_vs_conn_tab by netns,proto,addr,port.
+ *	Hashes ip_vs_conn in the conn table of its netns by proto,addr,port.
  *	returns bool success.
  */
 static inline int ip_vs_conn_hash(struct ip_vs_conn *cp)
 {
+	struct netns_ipvs *ipvs = cp->ipvs;
 	unsigned int hash;
 	int ret;
 
@@ -171,13 +254,14 @@ static inline int ip_vs_conn_hash(struct ip_vs_conn *cp)
 	/* Hash by protocol, client address and port */
 	hash = ip_vs_conn_hashkey_conn(cp);
 
-	ct_write_lock_bh(hash);
+	ct_write_lock_bh(ipvs, hash);
 	spin_lock(&cp->lock);
 
 	if (!(cp->flags & IP_VS_CONN_F_HASHED)) {
 		cp->flags |= IP_VS_CONN_F_HASHED;
 		refcount_inc(&cp->refcnt);
-		hlist_add_head_rcu(&cp->c_list, &ip_vs_conn_tab[hash]);
+		hlist_add_head_rcu(&cp->c_list,
+				   ip_vs_conn_tab_bucket(ipvs, hash));
 		ret = 1;
 	} else {
 		pr_err("%s(): request for already hashed, called from %pS\n",
@@ -186,15 +270,16 @@ static inline int ip_vs_conn_hash(struct ip_vs_conn *cp)
 	}
 
 	spin_unlock(&cp->lock);
-	ct_write_unlock_bh(hash);
+	ct_write_unlock_bh(ipvs, hash);
 
 	return ret;
 }
 
 
 /*
- *	UNhashes ip_vs_conn from ip_vs_conn_tab.
- *	returns bool success. Caller should hold conn reference.
+ *	UNhashes ip_vs_conn from the conn table, whichever table of a
+ *	resize it is in. Returns bool success. Caller should hold conn
+ *	reference.
  */
 static inline int ip_vs_conn_unhash(struct ip_vs_conn *cp)
 {
@@ -204,7 +289,7 @@ static inline int ip_vs_conn_unhash(struct ip_vs_conn *cp)
 	/* unhash it and decrease its reference counter */
 	hash = ip_vs_conn_hashkey_conn(cp);
 
-	ct_write_lock_bh(hash);
+	ct_write_lock_bh(cp->ipvs, hash);
 	spin_lock(&cp->lock);
 
 	if (cp->flags & IP_VS_CONN_F_HASHED) {
@@ -216,12 +301,12 @@ static inline int ip_vs_conn_unhash(struct ip_vs_conn *cp)
 		ret = 0;
 
 	spin_unlock(&cp->lock);
-	ct_write_unlock_bh(hash);
+	ct_write_unlock_bh(cp->ipvs, hash);
 
 	return ret;
 }
 
-/* Try to unlink ip_vs_conn from ip_vs_conn_tab.
+/* Try to unlink ip_vs_conn from the conn table.
  * returns bool success.
  */
 static inline bool ip_vs_conn_unlink(struct ip_vs_conn *cp)
@@ -234,7 +319,7 @@ static inline bool ip_vs_conn_unlink(struct ip_vs_conn *cp)
 
 	hash = ip_vs_conn_hashkey_conn(cp);
 
-	ct_write_lock_bh(hash);
+	ct_write_lock_bh(cp->ipvs, hash);
 	spin_lock(&cp->lock);
 
 	if (cp->flags & IP_VS_CONN_F_HASHED) {
@@ -247,14 +332,14 @@ static inline bool ip_vs_conn_unlink(struct ip_vs_conn *cp)
 	}
 
 	spin_unlock(&cp->lock);
-	ct_write_unlock_bh(hash);
+	ct_write_unlock_bh(cp->ipvs, hash);
 
 	return ret;
 }
 
 
 /*
- *  Gets ip_vs_conn associated with supplied parameters in the ip_vs_conn_tab.
+ *  Gets ip_vs_conn associated with supplied parameters in the conn table.
  *  Called for pkts coming from OUTside-to-INside.
  *	p->caddr, p->cport: pkt source address (foreign host)
  *	p->vaddr, p->vport: pkt dest address (load balancer)
@@ -262,28 +347,35 @@ static inline bool ip_vs_conn_unlink(struct ip_vs_conn *cp)
 static inline struct ip_vs_conn *
 __ip_vs_conn_in_get(const struct ip_vs_conn_param *p)
 {
+	struct netns_ipvs *ipvs = p->ipvs;
+	struct ip_vs_conn_lookup l;
 	unsigned int hash;
 	struct ip_vs_conn *cp;
+	int i;
 
 	hash = ip_vs_conn_hashkey_param(p, false);
 
 	rcu_read_lock();
 
-	hlist_for_each_entry_rcu(cp, &ip_vs_conn_tab[hash], c_list) {
+retry:
+	ip_vs_conn_lookup_start(ipvs, hash, &l);
+	ip_vs_conn_lookup_for_each(cp, &l, i) {
 		if (p->cport == cp->cport && p->vport == cp->vport &&
 		    cp->af == p->af &&
 		    ip_vs_addr_equal(p->af, p->caddr, &cp->caddr) &&
 		    ip_vs_addr_equal(p->af, p->vaddr, &cp->vaddr) &&
 		    ((!p->cport) ^ (!(cp->flags & IP_VS_CONN_F_NO_CPORT))) &&
-		    p->protocol == cp->protocol &&
-		    cp->ipvs == p->ipvs) {
+		    p->protocol == cp->protocol) {
 			if (!__ip_vs_conn_get(cp))
 				continue;
 			/* HIT */
+			this_cpu_inc(ipvs->conn_stats->found);
 			rcu_read_unlock();
 			return cp;
 		}
 	}
+	if (ip_vs_conn_lookup_retry(ipvs, &l))
+		goto retry;
 
 	rcu_read_unlock();
 
@@ -345,20 +437,103 @@ ip_vs_conn_in_get_proto(struct netns_ipvs *ipvs, int af,
 }
 EXPORT_SYMBOL_GPL(ip_vs_conn_in_get_proto);
 
+#define IP_VS_CONN_PREFETCH_BATCH	16
+
+/* Called for a list of packets before they traverse the prerouting hooks
+ * one by one.  Compute the buckets that the lookups of ip_vs_in_hook()
+ * will hit in local input and prefetch them, so that the cache misses of
+ * a burst overlap instead of being taken one packet at a time.
+ *
+ * This is only a hint: persistence engines hash differently, and a
+ * resize may move the bucket meanwhile.
+ */
+void ip_vs_conn_prefetch_list(const struct list_head *head,
+			      const struct nf_hook_state *state)
+{
+	struct hlist_head *buckets[IP_VS_CONN_PREFETCH_BATCH];
+	struct netns_ipvs *ipvs = net_ipvs(state->net);
+	unsigned int i, n = 0, bits, seq;
+	struct hlist_head *tab;
+	struct sk_buff *skb;
+	int af;
+
+	switch (state->pf) {
+	case NFPROTO_IPV4:
+		af = AF_INET;
+		break;
+#ifdef CONFIG_IP_VS_IPV6
+	case NFPROTO_IPV6:
+		af = AF_INET6;
+		break;
+#endif
+	default:
+		return;
+	}
+
+	if (!ipvs || sysctl_backup_only(ipvs) || !READ_ONCE(ipvs->enable))
+		return;
+
+	do {
+		seq = read_seqcount_begin(&ipvs->conn_tab_seq);
+		tab = ipvs->conn_tab;
+		bits = ipvs->conn_tab_bits;
+	} while (read_seqcount_retry(&ipvs->conn_tab_seq, seq));
+
+	if (!tab)
+		return;
+
+	list_for_each_entry(skb, head, list) {
+		struct ip_vs_iphdr iph;
+		__be16 _ports[2], *pptr;
+		unsigned int hash;
+
+		if (skb->ipvs_property || skb->pkt_type != PACKET_HOST)
+			continue;
+
+		ip_vs_fill_iph_skb(af, skb, false, &iph);
+		if (iph.protocol != IPPROTO_TCP &&
+		    iph.protocol != IPPROTO_UDP &&
+		    iph.protocol != IPPROTO_SCTP)
+			continue;
+
+		pptr = frag_safe_skb_hp(skb, iph.len, sizeof(_ports), _ports);
+		if (!pptr)
+			continue;
+
+		hash = ip_vs_conn_hashkey(af, iph.protocol, &iph.saddr,
+					  pptr[0]);
+		buckets[n] = &tab[ip_vs_conn_tab_idx(hash, bits)];
+		prefetch(buckets[n]);
+		if (++n == IP_VS_CONN_PREFETCH_BATCH)
+			break;
+	}
+
+	/* the bucket heads should have arrived by now */
+	for (i = 0; i < n; i++) {
+		struct hlist_node *first = READ_ONCE(buckets[i]->first);
+
+		if (first)
+			prefetch(first);
+	}
+}
+
 /* Get reference to connection template */
 struct ip_vs_conn *ip_vs_ct_in_get(const struct ip_vs_conn_param *p)
 {
+	struct netns_ipvs *ipvs = p->ipvs;
+	struct ip_vs_conn_lookup l;
 	unsigned int hash;
 	struct ip_vs_conn *cp;
+	int i;
 
 	hash = ip_vs_conn_hashkey_param(p, false);
 
 	rcu_read_lock();
 
-	hlist_for_each_entry_rcu(cp, &ip_vs_conn_tab[hash], c_list) {
+retry:
+	ip_vs_conn_lookup_start(ipvs, hash, &l);
+	ip_vs_conn_lookup_for_each(cp, &l, i) {
 		if (unlikely(p->pe_data && p->pe->ct_match)) {
-			if (cp->ipvs != p->ipvs)
-				continue;
 			if (p->pe == cp->pe && p->pe->ct_match(p, cp)) {
 				if (__ip_vs_conn_get(cp))
 					goto out;
@@ -374,15 +549,18 @@ struct ip_vs_conn *ip_vs_ct_in_get(const struct ip_vs_conn_param *p)
 				     p->af, p->vaddr, &cp->vaddr) &&
 		    p->vport == cp->vport && p->cport == cp->cport &&
 		    cp->flags & IP_VS_CONN_F_TEMPLATE &&
-		    p->protocol == cp->protocol &&
-		    cp->ipvs == p->ipvs) {
+		    p->protocol == cp->protocol) {
 			if (__ip_vs_conn_get(cp))
 				goto out;
 		}
 	}
+	if (ip_vs_conn_lookup_retry(ipvs, &l))
+		goto retry;
 	cp = NULL;
 
   out:
+	if (cp)
+		this_cpu_inc(ipvs->conn_stats->found);
 	rcu_read_unlock();
 
 	IP_VS_DBG_BUF(9, "template lookup/in %s %s:%d->%s:%d %s\n",
@@ -394,16 +572,19 @@ struct ip_vs_conn *ip_vs_ct_in_get(const struct ip_vs_conn_param *p)
 	return cp;
 }
 
-/* Gets ip_vs_conn associated with supplied parameters in the ip_vs_conn_tab.
+/* Gets ip_vs_conn associated with supplied parameters in the conn table.
  * Called for pkts coming from inside-to-OUTside.
  *	p->caddr, p->cport: pkt source address (inside host)
  *	p->vaddr, p->vport: pkt dest address (foreign host) */
 struct ip_vs_conn *ip_vs_conn_out_get(const struct ip_vs_conn_param *p)
 {
+	struct netns_ipvs *ipvs = p->ipvs;
+	struct ip_vs_conn_lookup l;
 	unsigned int hash;
 	struct ip_vs_conn *cp, *ret=NULL;
 	const union nf_inet_addr *saddr;
 	__be16 sport;
+	int i;
 
 	/*
 	 *	Check for "full" addressed entries
@@ -412,7 +593,9 @@ struct ip_vs_conn *ip_vs_conn_out_get(const struct ip_vs_conn_param *p)
 
 	rcu_read_lock();
 
-	hlist_for_each_entry_rcu(cp, &ip_vs_conn_tab[hash], c_list) {
+retry:
+	ip_vs_conn_lookup_start(ipvs, hash, &l);
+	ip_vs_conn_lookup_for_each(cp, &l, i) {
 		if (p->vport != cp->cport)
 			continue;
 
@@ -427,16 +610,19 @@ struct ip_vs_conn *ip_vs_conn_out_get(const struct ip_vs_conn_param *p)
 		if (p->cport == sport && cp->af == p->af &&
 		    ip_vs_addr_equal(p->af, p->vaddr, &cp->caddr) &&
 		    ip_vs_addr_equal(p->af, p->caddr, saddr) &&
-		    p->protocol == cp->protocol &&
-		    cp->ipvs == p->ipvs) {
+		    p->protocol == cp->protocol) {
 			if (!__ip_vs_conn_get(cp))
 				continue;
 			/* HIT */
+			this_cpu_inc(ipvs->conn_stats->found);
 			ret = cp;
-			break;
+			goto out;
 		}
 	}
+	if (ip_vs_conn_lookup_retry(ipvs, &l))
+		goto retry;
 
+  out:
 	rcu_read_unlock();
 
 	IP_VS_DBG_BUF(9, "lookup/out %s %s:%d->%s:%d %s\n",
@@ -935,7 +1121,7 @@ void ip_vs_conn_expire_now(struct ip_vs_conn *cp)
 
 
 /*
- *	Create a new connection entry and hash it into the ip_vs_conn_tab
+ *	Create a new connection entry and hash it into the conn table
  */
 struct ip_vs_conn *
 ip_vs_conn_new(const struct ip_vs_conn_param *p, int dest_af,
@@ -999,7 +1185,11 @@ ip_vs_conn_new(const struct ip_vs_conn_param *p, int dest_af,
 	cp->in_seq.delta = 0;
 	cp->out_seq.delta = 0;
 
-	atomic_inc(&ipvs->conn_count);
+	/* Grow the table beyond two connections per bucket */
+	if (unlikely((unsigned int)atomic_inc_return(&ipvs->conn_count) >
+		     2U << READ_ONCE(ipvs->conn_tab_bits)) &&
+	    READ_ONCE(ipvs->conn_tab_bits) < ip_vs_conn_tab_bits_max)
+		queue_work(system_long_wq, &ipvs->conn_tab_work);
 	if (flags & IP_VS_CONN_F_NO_CPORT)
 		atomic_inc(&ip_vs_conn_no_cport_cnt);
 
@@ -1034,7 +1224,7 @@ ip_vs_conn_new(const struct ip_vs_conn_param *p, int dest_af,
 	if (ip_vs_conntrack_enabled(ipvs))
 		cp->flags |= IP_VS_CONN_F_NFCT;
 
-	/* Hash it in the ip_vs_conn_tab finally */
+	/* Hash it in the conn table finally */
 	ip_vs_conn_hash(cp);
 
 	return cp;
@@ -1050,15 +1240,17 @@ struct ip_vs_iter_state {
 	unsigned int		skip_elems;
 };
 
-static void *ip_vs_conn_array(struct ip_vs_iter_state *iter)
+static void *ip_vs_conn_array(struct seq_file *seq)
 {
-	int idx;
+	struct ip_vs_iter_state *iter = seq->private;
+	struct netns_ipvs *ipvs = net_ipvs(seq_file_net(seq));
+	unsigned int idx;
 	struct ip_vs_conn *cp;
 
-	for (idx = iter->bucket; idx < ip_vs_conn_tab_size; idx++) {
+	for (idx = iter->bucket; idx < (1U << ipvs->conn_tab_bits); idx++) {
 		unsigned int skip = 0;
 
-		hlist_for_each_entry_rcu(cp, &ip_vs_conn_tab[idx], c_list) {
+		hlist_for_each_entry_rcu(cp, &ipvs->conn_tab[idx], c_list) {
 			/* __ip_vs_conn_get() is not needed by
 			 * ip_vs_conn_seq_show and ip_vs_conn_sync_seq_show
 			 */
@@ -1083,6 +1275,8 @@ static void *ip_vs_conn_seq_start(struct seq_file *seq, loff_t *pos)
 {
 	struct ip_vs_iter_state *iter = seq->private;
 
+	/* A single table to walk */
+	mutex_lock(&net_ipvs(seq_file_net(seq))->conn_tab_mutex);
 	rcu_read_lock();
 	if (*pos == 0) {
 		iter->skip_elems = 0;
@@ -1090,7 +1284,7 @@ static void *ip_vs_conn_seq_start(struct seq_file *seq, loff_t *pos)
 		return SEQ_START_TOKEN;
 	}
 
-	return ip_vs_conn_array(iter);
+	return ip_vs_conn_array(seq);
 }
 
 static void *ip_vs_conn_seq_next(struct seq_file *seq, void *v, loff_t *pos)
@@ -1101,7 +1295,7 @@ static void *ip_vs_conn_seq_next(struct seq_file *seq, void *v, loff_t *pos)
 
 	++*pos;
 	if (v == SEQ_START_TOKEN)
-		return ip_vs_conn_array(iter);
+		return ip_vs_conn_array(seq);
 
 	/* more on same hash chain? */
 	e = rcu_dereference(hlist_next_rcu(&cp->c_list));
@@ -1113,13 +1307,14 @@ static void *ip_vs_conn_seq_next(struct seq_file *seq, void *v, loff_t *pos)
 	iter->skip_elems = 0;
 	iter->bucket++;
 
-	return ip_vs_conn_array(iter);
+	return ip_vs_conn_array(seq);
 }
 
 static void ip_vs_conn_seq_stop(struct seq_file *seq, void *v)
 	__releases(RCU)
 {
 	rcu_read_unlock();
+	mutex_unlock(&net_ipvs(seq_file_net(seq))->conn_tab_mutex);
 }
 
 static int ip_vs_conn_seq_show(struct seq_file *seq, void *v)
@@ -1306,19 +1501,22 @@ static inline bool ip_vs_conn_ops_mode(struct ip_vs_conn *cp)
 /* Called from keventd and must protect itself from softirqs */
 void ip_vs_random_dropentry(struct netns_ipvs *ipvs)
 {
-	int idx;
+	unsigned int idx, bits;
 	struct ip_vs_conn *cp;
 
+	/* Not while the table is resized, next time */
+	if (!mutex_trylock(&ipvs->conn_tab_mutex))
+		return;
+	bits = ipvs->conn_tab_bits;
+
 	rcu_read_lock();
 	/*
 	 * Randomly scan 1/32 of the whole table every second
 	 */
-	for (idx = 0; idx < (ip_vs_conn_tab_size>>5); idx++) {
-		unsigned int hash = get_random_u32() & ip_vs_conn_tab_mask;
+	for (idx = 0; idx < (1U << bits >> 5); idx++) {
+		unsigned int hash = ip_vs_conn_tab_idx(get_random_u32(), bits);
 
-		hlist_for_each_entry_rcu(cp, &ip_vs_conn_tab[hash], c_list) {
-			if (cp->ipvs != ipvs)
-				continue;
+		hlist_for_each_entry_rcu(cp, &ipvs->conn_tab[hash], c_list) {
 			if (atomic_read(&cp->n_control))
 				continue;
 			if (cp->flags & IP_VS_CONN_F_TEMPLATE) {
@@ -1368,24 +1566,24 @@ void ip_vs_random_dropentry(struct netns_ipvs *ipvs)
 		cond_resched_rcu();
 	}
 	rcu_read_unlock();
+	mutex_unlock(&ipvs->conn_tab_mutex);
 }
 
 
 /*
- *      Flush all the connection entries in the ip_vs_conn_tab
+ *      Flush all the connection entries in the conn table
  */
 static void ip_vs_conn_flush(struct netns_ipvs *ipvs)
 {
-	int idx;
+	unsigned int idx;
 	struct ip_vs_conn *cp, *cp_c;
 
 flush_again:
+	mutex_lock(&ipvs->conn_tab_mutex);
 	rcu_read_lock();
-	for (idx = 0; idx < ip_vs_conn_tab_size; idx++) {
+	for (idx = 0; idx < (1U << ipvs->conn_tab_bits); idx++) {
 
-		hlist_for_each_entry_rcu(cp, &ip_vs_conn_tab[idx], c_list) {
-			if (cp->ipvs != ipvs)
-				continue;
+		hlist_for_each_entry_rcu(cp, &ipvs->conn_tab[idx], c_list) {
 			if (atomic_read(&cp->n_control))
 				continue;
 			cp_c = cp->control;
@@ -1399,6 +1597,7 @@ static void ip_vs_conn_flush(struct netns_ipvs *ipvs)
 		cond_resched_rcu();
 	}
 	rcu_read_unlock();
+	mutex_unlock(&ipvs->conn_tab_mutex);
 
 	/* the counter may be not NULL, because maybe some conn entries
 	   are run by slow timer handler or unhashed but still referred */
@@ -1411,16 +1610,14 @@ static void ip_vs_conn_flush(struct netns_ipvs *ipvs)
 #ifdef CONFIG_SYSCTL
 void ip_vs_expire_nodest_conn_flush(struct netns_ipvs *ipvs)
 {
-	int idx;
+	unsigned int idx;
 	struct ip_vs_conn *cp, *cp_c;
 	struct ip_vs_dest *dest;
 
+	mutex_lock(&ipvs->conn_tab_mutex);
 	rcu_read_lock();
-	for (idx = 0; idx < ip_vs_conn_tab_size; idx++) {
-		hlist_for_each_entry_rcu(cp, &ip_vs_conn_tab[idx], c_list) {
-			if (cp->ipvs != ipvs)
-				continue;
-
+	for (idx = 0; idx < (1U << ipvs->conn_tab_bits); idx++) {
+		hlist_for_each_entry_rcu(cp, &ipvs->conn_tab[idx], c_list) {
 			dest = cp->dest;
 			if (!dest || (dest->flags & IP_VS_DEST_F_AVAILABLE))
 				continue;
@@ -1443,6 +1640,142 @@ void ip_vs_expire_nodest_conn_flush(struct netns_ipvs *ipvs)
 			break;
 	}
 	rcu_read_unlock();
+	mutex_unlock(&ipvs->conn_tab_mutex);
+}
+#endif
+
+/*
+ *	Resizing of the conn table of a netns
+ */
+static struct hlist_head *ip_vs_conn_tab_alloc(unsigned int bits)
+{
+	struct hlist_head *tab;
+	unsigned int idx;
+
+	tab = kvmalloc_array(1U << bits, sizeof(*tab), GFP_KERNEL);
+	if (!tab)
+		return NULL;
+
+	for (idx = 0; idx < (1U << bits); idx++)
+		INIT_HLIST_HEAD(&tab[idx]);
+
+	return tab;
+}
+
+/* Move the connections of bucket @idx of the old table to the new one */
+static void ip_vs_conn_tab_move(struct netns_ipvs *ipvs, unsigned int idx)
+{
+	struct hlist_head *head = &ipvs->conn_tab_old[idx];
+	struct ip_vs_conn *cp;
+	unsigned int hash;
+
+	/* The old bucket and its connections share the lock stripe */
+	ct_write_lock_bh(ipvs, idx);
+	while (!hlist_empty(head)) {
+		cp = hlist_entry(head->first, struct ip_vs_conn, c_list);
+		hash = ip_vs_conn_hashkey_conn(cp);
+		hlist_del_rcu(&cp->c_list);
+		hlist_add_head_rcu(&cp->c_list,
+				   &ipvs->conn_tab[ip_vs_conn_tab_idx(hash,
+							ipvs->conn_tab_bits)]);
+	}
+	/* Inserts and lookups of the bucket go to the new table now */
+	smp_store_release(&ipvs->conn_tab_next, idx + 1);
+	ct_write_unlock_bh(ipvs, idx);
+}
+
+int ip_vs_conn_tab_resize(struct netns_ipvs *ipvs, unsigned int bits)
+{
+	struct hlist_head *tab, *old_tab;
+	unsigned int idx, old_bits;
+
+	if (bits < IP_VS_CONN_TAB_BITS_MIN || bits > ip_vs_conn_tab_bits_max)
+		return -EINVAL;
+
+	tab = ip_vs_conn_tab_alloc(bits);
+	if (!tab)
+		return -ENOMEM;
+
+	mutex_lock(&ipvs->conn_tab_mutex);
+	old_tab = ipvs->conn_tab;
+	old_bits = ipvs->conn_tab_bits;
+	if (!old_tab || old_bits == bits) {
+		mutex_unlock(&ipvs->conn_tab_mutex);
+		kvfree(tab);
+		return 0;
+	}
+
+	/* Publish the new table, then empty the old one bucket by bucket:
+	 * lookups search both meanwhile, inserts and deletes wait only for
+	 * the bucket being moved.
+	 */
+	spin_lock_bh(&ipvs->conn_tab_lock);
+	write_seqcount_begin(&ipvs->conn_tab_seq);
+	ipvs->conn_tab_old = old_tab;
+	ipvs->conn_tab_bits_old = old_bits;
+	WRITE_ONCE(ipvs->conn_tab_next, 0);
+	ipvs->conn_tab = tab;
+	WRITE_ONCE(ipvs->conn_tab_bits, bits);
+	write_seqcount_end(&ipvs->conn_tab_seq);
+	spin_unlock_bh(&ipvs->conn_tab_lock);
+
+	for (idx = 0; idx < (1U << old_bits); idx++) {
+		ip_vs_conn_tab_move(ipvs, idx);
+		cond_resched();
+	}
+
+	spin_lock_bh(&ipvs->conn_tab_lock);
+	write_seqcount_begin(&ipvs->conn_tab_seq);
+	ipvs->conn_tab_old = NULL;
+	write_seqcount_end(&ipvs->conn_tab_seq);
+	spin_unlock_bh(&ipvs->conn_tab_lock);
+	ipvs->conn_tab_resizes++;
+
+	/* Lookups can still walk the old chains */
+	synchronize_net();
+	mutex_unlock(&ipvs->conn_tab_mutex);
+
+	kvfree(old_tab);
+	return 0;
+}
+
+static void ip_vs_conn_tab_work_handler(struct work_struct *work)
+{
+	struct netns_ipvs *ipvs = container_of(work, struct netns_ipvs,
+					       conn_tab_work);
+	unsigned int bits;
+
+	/* Room for a connection per bucket */
+	bits = order_base_2(atomic_read(&ipvs->conn_count));
+	bits = min_t(unsigned int, bits, ip_vs_conn_tab_bits_max);
+	if (bits > READ_ONCE(ipvs->conn_tab_bits))
+		ip_vs_conn_tab_resize(ipvs, bits);
+}
+
+#ifdef CONFIG_PROC_FS
+static int ip_vs_conn_tab_show(struct seq_file *seq, void *v)
+{
+	struct net *net = seq_file_single_net(seq);
+	struct netns_ipvs *ipvs = net_ipvs(net);
+	const struct ip_vs_conn_stats *s;
+	unsigned long searched = 0, found = 0, restart = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		s = per_cpu_ptr(ipvs->conn_stats, cpu);
+		searched += READ_ONCE(s->searched);
+		found += READ_ONCE(s->found);
+		restart += READ_ONCE(s->search_restart);
+	}
+
+	seq_puts(seq,
+		 " Buckets    Conns  Resizes   Searched      Found Restarts\n");
+	seq_printf(seq, "%8u %8d %8u %10lu %10lu %8lu\n",
+		   1U << READ_ONCE(ipvs->conn_tab_bits),
+		   atomic_read(&ipvs->conn_count),
+		   READ_ONCE(ipvs->conn_tab_resizes),
+		   searched, found, restart);
+	return 0;
 }
 #endif
 
@@ -1451,8 +1784,34 @@ void ip_vs_expire_nodest_conn_flush(struct netns_ipvs *ipvs)
  */
 int __net_init ip_vs_conn_net_init(struct netns_ipvs *ipvs)
 {
+	int idx;
+
 	atomic_set(&ipvs->conn_count, 0);
 
+	ipvs->conn_tab_bits = net_eq(ipvs->net, &init_net) ?
+			      ip_vs_conn_tab_bits : IP_VS_CONN_TAB_BITS_MIN;
+	ipvs->conn_tab = ip_vs_conn_tab_alloc(ipvs->conn_tab_bits);
+	if (!ipvs->conn_tab)
+		goto err_tab;
+	ipvs->conn_tab_old = NULL;
+	spin_lock_init(&ipvs->conn_tab_lock);
+	seqcount_spinlock_init(&ipvs->conn_tab_seq, &ipvs->conn_tab_lock);
+	mutex_init(&ipvs->conn_tab_mutex);
+	INIT_WORK(&ipvs->conn_tab_work, ip_vs_conn_tab_work_handler);
+	ipvs->conn_tab_resizes = 0;
+
+	ipvs->conn_locks = kmalloc_array(CT_LOCKARRAY_SIZE,
+					 sizeof(*ipvs->conn_locks),
+					 GFP_KERNEL);
+	if (!ipvs->conn_locks)
+		goto err_locks;
+	for (idx = 0; idx < CT_LOCKARRAY_SIZE; idx++)
+		spin_lock_init(&ipvs->conn_locks[idx].l);
+
+	ipvs->conn_stats = alloc_percpu(struct ip_vs_conn_stats);
+	if (!ipvs->conn_stats)
+		goto err_stats;
+
 #ifdef CONFIG_PROC_FS
 	if (!proc_create_net("ip_vs_conn", 0, ipvs->net->proc_net,
 			     &ip_vs_conn_seq_ops,
@@ -1463,39 +1822,58 @@ int __net_init ip_vs_conn_net_init(struct netns_ipvs *ipvs)
 			     &ip_vs_conn_sync_seq_ops,
 			     sizeof(struct ip_vs_iter_state)))
 		goto err_conn_sync;
+
+	if (!proc_create_net_single("ip_vs_conn_tab", 0, ipvs->net->proc_net,
+				    ip_vs_conn_tab_show, NULL))
+		goto err_conn_tab;
 #endif
 
 	return 0;
 
 #ifdef CONFIG_PROC_FS
+err_conn_tab:
+	remove_proc_entry("ip_vs_conn_sync", ipvs->net->proc_net);
 err_conn_sync:
 	remove_proc_entry("ip_vs_conn", ipvs->net->proc_net);
 err_conn:
-	return -ENOMEM;
+	free_percpu(ipvs->conn_stats);
 #endif
+err_stats:
+	kfree(ipvs->conn_locks);
+err_locks:
+	kvfree(ipvs->conn_tab);
+err_tab:
+	return -ENOMEM;
 }
 
 void __net_exit ip_vs_conn_net_cleanup(struct netns_ipvs *ipvs)
 {
+	disable_work_sync(&ipvs->conn_tab_work);
 	/* flush all the connection entries first */
 	ip_vs_conn_flush(ipvs);
 #ifdef CONFIG_PROC_FS
 	remove_proc_entry("ip_vs_conn", ipvs->net->proc_net);
 	remove_proc_entry("ip_vs_conn_sync", ipvs->net->proc_net);
+	remove_proc_entry("ip_vs_conn_tab", ipvs->net->proc_net);
 #endif
+	/* No more resizing from sysctl */
+	mutex_lock(&ipvs->conn_tab_mutex);
+	kvfree(ipvs->conn_tab);
+	ipvs->conn_tab = NULL;
+	mutex_unlock(&ipvs->conn_tab_mutex);
+	free_percpu(ipvs->conn_stats);
+	kfree(ipvs->conn_locks);
 }
 
 int __init ip_vs_conn_init(void)
 {
-	size_t tab_array_size;
 	int max_avail;
 #if BITS_PER_LONG > 32
 	int max = 27;
 #else
 	int max = 20;
 #endif
-	int min = 8;
-	int idx;
+	int min = IP_VS_CONN_TAB_BITS_MIN;
 
 	max_avail = order_base_2(totalram_pages()) + PAGE_SHIFT;
 	max_avail -= 2;		/* ~4 in hash row */
@@ -1503,38 +1881,19 @@ int __init ip_vs_conn_init(void)
 	max_avail -= order_base_2(sizeof(struct ip_vs_conn));
 	max = clamp(max_avail, min, max);
 	ip_vs_conn_tab_bits = clamp(ip_vs_conn_tab_bits, min, max);
-	ip_vs_conn_tab_size = 1 << ip_vs_conn_tab_bits;
-	ip_vs_conn_tab_mask = ip_vs_conn_tab_size - 1;
-
-	/*
-	 * Allocate the connection hash table and initialize its list heads
-	 */
-	tab_array_size = array_size(ip_vs_conn_tab_size,
-				    sizeof(*ip_vs_conn_tab));
-	ip_vs_conn_tab = kvmalloc_array(ip_vs_conn_tab_size,
-					sizeof(*ip_vs_conn_tab), GFP_KERNEL);
-	if (!ip_vs_conn_tab)
-		return -ENOMEM;
+	ip_vs_conn_tab_bits_max = max;
 
 	/* Allocate ip_vs_conn slab cache */
 	ip_vs_conn_cachep = KMEM_CACHE(ip_vs_conn, SLAB_HWCACHE_ALIGN);
-	if (!ip_vs_conn_cachep) {
-		kvfree(ip_vs_conn_tab);
+	if (!ip_vs_conn_cachep)
 		return -ENOMEM;
-	}
 
 	pr_info("Connection hash table configured (size=%d, memory=%zdKbytes)\n",
-		ip_vs_conn_tab_size, tab_array_size / 1024);
+		1 << ip_vs_conn_tab_bits,
+		(sizeof(struct hlist_head) << ip_vs_conn_tab_bits) / 1024);
 	IP_VS_DBG(0, "Each connection entry needs %zd bytes at least\n",
 		  sizeof(struct ip_vs_conn));
 
-	for (idx = 0; idx < ip_vs_conn_tab_size; idx++)
-		INIT_HLIST_HEAD(&ip_vs_conn_tab[idx]);
-
-	for (idx = 0; idx < CT_LOCKARRAY_SIZE; idx++)  {
-		spin_lock_init(&__ip_vs_conntbl_lock_array[idx].l);
-	}
-
 	/* calculate the random value for connection hash */
 	get_random_bytes(&ip_vs_conn_rnd, sizeof(ip_vs_conn_rnd));
 
@@ -1547,5 +1906,4 @@ void ip_vs_conn_cleanup(void)
 	rcu_barrier();
 	/* Release the empty cache */
 	kmem_cache_destroy(ip_vs_conn_cachep);
-	kvfree(ip_vs_conn_tab);
 }
@@ -118,8 +118,7 @@ void ip_vs_init_hash_table(struct list_head *table, int rows)
 		INIT_LIST_HEAD(&table[rows]);
 }
 
-static inline void
-ip_vs_in_stats(struct ip_vs_conn *cp, struct sk_buff *skb)
+void ip_vs_in_stats_len(struct ip_vs_conn *cp, unsigned int len)
 {
 	struct ip_vs_dest *dest = cp->dest;
 	struct netns_ipvs *ipvs = cp->ipvs;
@@ -133,26 +132,32 @@ ip_vs_in_stats(struct ip_vs_conn *cp, struct sk_buff *skb)
 		s = this_cpu_ptr(dest->stats.cpustats);
 		u64_stats_update_begin(&s->syncp);
 		u64_stats_inc(&s->cnt.inpkts);
-		u64_stats_add(&s->cnt.inbytes, skb->len);
+		u64_stats_add(&s->cnt.inbytes, len);
 		u64_stats_update_end(&s->syncp);
 
 		svc = rcu_dereference(dest->svc);
 		s = this_cpu_ptr(svc->stats.cpustats);
 		u64_stats_update_begin(&s->syncp);
 		u64_stats_inc(&s->cnt.inpkts);
-		u64_stats_add(&s->cnt.inbytes, skb->len);
+		u64_stats_add(&s->cnt.inbytes, len);
 		u64_stats_update_end(&s->syncp);
 
 		s = this_cpu_ptr(ipvs->tot_stats->s.cpustats);
 		u64_stats_update_begin(&s->syncp);
 		u64_stats_inc(&s->cnt.inpkts);
-		u64_stats_add(&s->cnt.inbytes, skb->len);
+		u64_stats_add(&s->cnt.inbytes, len);
 		u64_stats_update_end(&s->syncp);
 
 		local_bh_enable();
 	}
 }
 
+static inline void
+ip_vs_in_stats(struct ip_vs_conn *cp, struct sk_buff *skb)
+{
+	ip_vs_in_stats_len(cp, skb->len);
+}
+
 
 static inline void
 ip_vs_out_stats(struct ip_vs_conn *cp, struct sk_buff *skb)
@@ -340,6 +345,7 @@ ip_vs_sched_persist(struct ip_vs_service *svc,
 	ct = ip_vs_ct_in_get(&param);
 	if (!ct || !ip_vs_check_template(ct, NULL)) {
 		struct ip_vs_scheduler *sched;
+		bool stable = false;
 
 		/*
 		 * No template found or the dest of the connection
@@ -350,7 +356,11 @@ ip_vs_sched_persist(struct ip_vs_service *svc,
 		if (sched) {
 			/* read svc->sched_data after svc->scheduler */
 			smp_rmb();
-			dest = sched->schedule(svc, skb, iph);
+			if (sched->persist_dest && !param.pe_data &&
+			    sysctl_persist_stateless(svc->ipvs))
+				dest = sched->persist_dest(svc, &snet, &stable);
+			else
+				dest = sched->schedule(svc, skb, iph);
 		} else {
 			dest = NULL;
 		}
@@ -361,6 +371,14 @@ ip_vs_sched_persist(struct ip_vs_service *svc,
 			return NULL;
 		}
 
+		if (stable) {
+			/* The scheduler maps the client network to the same
+			 * dest until the dests change, no template needed.
+			 */
+			ct = NULL;
+			goto new_conn;
+		}
+
 		if (dst_port == svc->port && svc->port != FTPPORT)
 			dport = dest->port;
 
@@ -383,6 +401,7 @@ ip_vs_sched_persist(struct ip_vs_service *svc,
 		kfree(param.pe_data);
 	}
 
+new_conn:
 	dport = dst_port;
 	if (dport == svc->port && dest->port)
 		dport = dest->port;
@@ -400,7 +419,8 @@ ip_vs_sched_persist(struct ip_vs_service *svc,
 	cp = ip_vs_conn_new(&param, dest->af, &dest->addr, dport, flags, dest,
 			    skb->mark);
 	if (cp == NULL) {
-		ip_vs_conn_put(ct);
+		if (ct)
+			ip_vs_conn_put(ct);
 		*ignored = -1;
 		return NULL;
 	}
@@ -408,8 +428,10 @@ ip_vs_sched_persist(struct ip_vs_service *svc,
 	/*
 	 *    Add its control
 	 */
-	ip_vs_control_add(cp, ct);
-	ip_vs_conn_put(ct);
+	if (ct) {
+		ip_vs_control_add(cp, ct);
+		ip_vs_conn_put(ct);
+	}
 
 	ip_vs_conn_stats(cp, svc);
 	return cp;
@@ -2387,6 +2409,10 @@ static struct pernet_operations ipvs_core_dev_ops = {
 /*
  *	Initialize IP Virtual Server
  */
+static const struct nf_ipvs_hook ip_vs_hook = {
+	.prefetch_list	= ip_vs_conn_prefetch_list,
+};
+
 static int __init ip_vs_init(void)
 {
 	int ret;
@@ -2419,10 +2445,20 @@ static int __init ip_vs_init(void)
 		goto cleanup_dev;
 	}
 
+	ret = ip_vs_register_bpf();
+	if (ret < 0) {
+		pr_err("can't register kfuncs.\n");
+		goto cleanup_nl;
+	}
+
+	RCU_INIT_POINTER(nf_ipvs_hook, &ip_vs_hook);
+
 	pr_info("ipvs loaded.\n");
 
 	return ret;
 
+cleanup_nl:
+	ip_vs_unregister_nl_ioctl();
 cleanup_dev:
 	unregister_pernet_device(&ipvs_core_dev_ops);
 cleanup_sub:
@@ -2438,6 +2474,8 @@ static int __init ip_vs_init(void)
 
 static void __exit ip_vs_cleanup(void)
 {
+	RCU_INIT_POINTER(nf_ipvs_hook, NULL);
+	synchronize_net();
 	ip_vs_unregister_nl_ioctl();
 	unregister_pernet_device(&ipvs_core_dev_ops);
 	unregister_pernet_subsys(&ipvs_core_ops);	/* free ip_vs struct */
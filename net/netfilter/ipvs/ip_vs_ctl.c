@@ -30,6 +30,7 @@
 #include <linux/netfilter.h>
 #include <linux/netfilter_ipv4.h>
 #include <linux/mutex.h>
+#include <linux/jhash.h>
 
 #include <net/net_namespace.h>
 #include <linux/nsproxy.h>
@@ -298,13 +299,33 @@ ip_vs_use_count_dec(void)
  *	Hash table: for virtual service lookups
  */
 #define IP_VS_SVC_TAB_BITS 8
-#define IP_VS_SVC_TAB_SIZE (1 << IP_VS_SVC_TAB_BITS)
-#define IP_VS_SVC_TAB_MASK (IP_VS_SVC_TAB_SIZE - 1)
+
+/* Size of the service tables, shared by all netns */
+static int ip_vs_svc_tab_bits = IP_VS_SVC_TAB_BITS;
+module_param_named(svc_tab_bits, ip_vs_svc_tab_bits, int, 0444);
+MODULE_PARM_DESC(svc_tab_bits, "Set services' hash size");
+
+static unsigned int ip_vs_svc_tab_size __read_mostly;
+static unsigned int ip_vs_svc_tab_mask __read_mostly;
+static u32 ip_vs_svc_rnd __read_mostly;
 
 /* the service table hashed by <protocol, addr, port> */
-static struct hlist_head ip_vs_svc_table[IP_VS_SVC_TAB_SIZE];
+static struct hlist_head *ip_vs_svc_table __read_mostly;
 /* the service table hashed by fwmark */
-static struct hlist_head ip_vs_svc_fwm_table[IP_VS_SVC_TAB_SIZE];
+static struct hlist_head *ip_vs_svc_fwm_table __read_mostly;
+
+/* Last service found on a CPU for a packet, NULL for none.  It stays
+ * valid until a service of the netns is hashed or unhashed.
+ */
+struct ip_vs_svc_cache {
+	struct ip_vs_service	*svc;
+	union nf_inet_addr	vaddr;
+	__u32			fwmark;
+	int			gen;
+	__be16			vport;
+	__u16			protocol;
+	int			af;
+};
 
 
 /*
@@ -314,20 +335,16 @@ static inline unsigned int
 ip_vs_svc_hashkey(struct netns_ipvs *ipvs, int af, unsigned int proto,
 		  const union nf_inet_addr *addr, __be16 port)
 {
-	unsigned int porth = ntohs(port);
-	__be32 addr_fold = addr->ip;
-	__u32 ahash;
+	u32 initval = ip_vs_svc_rnd ^ (u32)((size_t)ipvs >> 8);
 
 #ifdef CONFIG_IP_VS_IPV6
 	if (af == AF_INET6)
-		addr_fold = addr->ip6[0]^addr->ip6[1]^
-			    addr->ip6[2]^addr->ip6[3];
+		return jhash_3words(jhash(addr, 16, initval),
+				    (__force u32)port, proto, initval) &
+		       ip_vs_svc_tab_mask;
 #endif
-	ahash = ntohl(addr_fold);
-	ahash ^= ((size_t) ipvs >> 8);
-
-	return (proto ^ ahash ^ (porth >> IP_VS_SVC_TAB_BITS) ^ porth) &
-	       IP_VS_SVC_TAB_MASK;
+	return jhash_3words((__force u32)addr->ip, (__force u32)port, proto,
+			    initval) & ip_vs_svc_tab_mask;
 }
 
 /*
@@ -335,7 +352,8 @@ ip_vs_svc_hashkey(struct netns_ipvs *ipvs, int af, unsigned int proto,
  */
 static inline unsigned int ip_vs_svc_fwm_hashkey(struct netns_ipvs *ipvs, __u32 fwmark)
 {
-	return (((size_t)ipvs>>8) ^ fwmark) & IP_VS_SVC_TAB_MASK;
+	return jhash_1word(fwmark, ip_vs_svc_rnd ^ (u32)((size_t)ipvs >> 8)) &
+	       ip_vs_svc_tab_mask;
 }
 
 /*
@@ -371,6 +389,8 @@ static int ip_vs_svc_hash(struct ip_vs_service *svc)
 	svc->flags |= IP_VS_SVC_F_HASHED;
 	/* increase its refcnt because it is referenced by the svc table */
 	atomic_inc(&svc->refcnt);
+	/* lookups cached before may have missed it */
+	atomic_inc(&svc->ipvs->svc_gen);
 	return 1;
 }
 
@@ -397,6 +417,10 @@ static int ip_vs_svc_unhash(struct ip_vs_service *svc)
 
 	svc->flags &= ~IP_VS_SVC_F_HASHED;
 	atomic_dec(&svc->refcnt);
+	/* the svc is freed after a grace period, when no reader can see
+	 * the old generation anymore
+	 */
+	atomic_inc(&svc->ipvs->svc_gen);
 	return 1;
 }
 
@@ -452,12 +476,58 @@ __ip_vs_svc_fwm_find(struct netns_ipvs *ipvs, int af, __u32 fwmark)
 	return NULL;
 }
 
+/* Few hot VIPs take most of the packets, save the chain walks for them */
+static struct ip_vs_service *
+ip_vs_svc_cache_get(struct netns_ipvs *ipvs, int gen, int af, __u32 fwmark,
+		    __u16 protocol, const union nf_inet_addr *vaddr,
+		    __be16 vport, bool *hit)
+{
+	struct ip_vs_service *svc = NULL;
+	struct ip_vs_svc_cache *c;
+
+	local_bh_disable();
+	c = this_cpu_ptr(ipvs->svc_cache);
+	*hit = c->gen == gen && c->af == af && c->fwmark == fwmark &&
+	       c->protocol == protocol && c->vport == vport &&
+	       ip_vs_addr_equal(af, &c->vaddr, vaddr);
+	if (*hit)
+		svc = c->svc;
+	local_bh_enable();
+	return svc;
+}
+
+static void
+ip_vs_svc_cache_set(struct netns_ipvs *ipvs, int gen, int af, __u32 fwmark,
+		    __u16 protocol, const union nf_inet_addr *vaddr,
+		    __be16 vport, struct ip_vs_service *svc)
+{
+	struct ip_vs_svc_cache *c;
+
+	local_bh_disable();
+	c = this_cpu_ptr(ipvs->svc_cache);
+	c->svc = svc;
+	ip_vs_addr_copy(af, &c->vaddr, vaddr);
+	c->fwmark = fwmark;
+	c->gen = gen;
+	c->vport = vport;
+	c->protocol = protocol;
+	c->af = af;
+	local_bh_enable();
+}
+
 /* Find service, called under RCU lock */
 struct ip_vs_service *
 ip_vs_service_find(struct netns_ipvs *ipvs, int af, __u32 fwmark, __u16 protocol,
 		   const union nf_inet_addr *vaddr, __be16 vport)
 {
+	int gen = atomic_read(&ipvs->svc_gen);
 	struct ip_vs_service *svc;
+	bool hit, cache = true;
+
+	svc = ip_vs_svc_cache_get(ipvs, gen, af, fwmark, protocol, vaddr,
+				  vport, &hit);
+	if (hit)
+		goto out;
 
 	/*
 	 *	Check the table hashed by fwmark first
@@ -465,7 +535,7 @@ ip_vs_service_find(struct netns_ipvs *ipvs, int af, __u32 fwmark, __u16 protocol
 	if (fwmark) {
 		svc = __ip_vs_svc_fwm_find(ipvs, af, fwmark);
 		if (svc)
-			goto out;
+			goto cache;
 	}
 
 	/*
@@ -475,13 +545,22 @@ ip_vs_service_find(struct netns_ipvs *ipvs, int af, __u32 fwmark, __u16 protocol
 	svc = __ip_vs_service_find(ipvs, af, protocol, vaddr, vport);
 
 	if (!svc && protocol == IPPROTO_TCP &&
-	    atomic_read(&ipvs->ftpsvc_counter) &&
-	    (vport == FTPDATA || !inet_port_requires_bind_service(ipvs->net, ntohs(vport)))) {
-		/*
-		 * Check if ftp service entry exists, the packet
-		 * might belong to FTP data connections.
+	    atomic_read(&ipvs->ftpsvc_counter)) {
+		/* Depends on the port sysctls too, which don't bump svc_gen:
+		 * neither a hit nor a miss can be cached.
 		 */
-		svc = __ip_vs_service_find(ipvs, af, protocol, vaddr, FTPPORT);
+		cache = false;
+		if (vport == FTPDATA ||
+		    !inet_port_requires_bind_service(ipvs->net, ntohs(vport))) {
+			/*
+			 * Check if ftp service entry exists, the packet
+			 * might belong to FTP data connections.
+			 */
+			svc = __ip_vs_service_find(ipvs, af, protocol, vaddr,
+						   FTPPORT);
+			if (svc)
+				goto out;
+		}
 	}
 
 	if (svc == NULL
@@ -492,6 +571,10 @@ ip_vs_service_find(struct netns_ipvs *ipvs, int af, __u32 fwmark, __u16 protocol
 		svc = __ip_vs_service_find(ipvs, af, protocol, vaddr, 0);
 	}
 
+  cache:
+	if (cache)
+		ip_vs_svc_cache_set(ipvs, gen, af, fwmark, protocol, vaddr,
+				    vport, svc);
   out:
 	IP_VS_DBG_BUF(9, "lookup service: fwm %u %s %s:%u %s\n",
 		      fwmark, ip_vs_proto_name(protocol),
@@ -873,6 +956,7 @@ ip_vs_copy_stats(struct ip_vs_kstats *dst, struct ip_vs_stats *src)
 
 	spin_lock(&src->lock);
 
+	ip_vs_est_sync_counters(src);
 	IP_VS_SHOW_STATS_COUNTER(conns);
 	IP_VS_SHOW_STATS_COUNTER(inpkts);
 	IP_VS_SHOW_STATS_COUNTER(outpkts);
@@ -904,6 +988,7 @@ ip_vs_zero_stats(struct ip_vs_stats *stats)
 {
 	spin_lock(&stats->lock);
 
+	ip_vs_est_sync_counters(stats);
 	/* get current counters as zero point, rates are zeroed */
 
 #define IP_VS_ZERO_STATS_COUNTER(c) stats->kstats0.c = stats->kstats.c
@@ -999,6 +1084,9 @@ __ip_vs_update_dest(struct ip_vs_service *svc, struct ip_vs_dest *dest,
 	dest->tun_port = udest->tun_port;
 	dest->tun_flags = udest->tun_flags;
 
+	/* read locklessly by the schedulers */
+	WRITE_ONCE(dest->load, udest->load);
+
 	/* set the IP_VS_CONN_F_NOOUTPUT flag if not masquerading/NAT */
 	if ((conn_flags & IP_VS_CONN_F_FWD_MASK) != IP_VS_CONN_F_MASQ) {
 		conn_flags |= IP_VS_CONN_F_NOOUTPUT;
@@ -1701,7 +1789,7 @@ static int ip_vs_flush(struct netns_ipvs *ipvs, bool cleanup)
 	/*
 	 * Flush the service table hashed by <netns,protocol,addr,port>
 	 */
-	for(idx = 0; idx < IP_VS_SVC_TAB_SIZE; idx++) {
+	for(idx = 0; idx < ip_vs_svc_tab_size; idx++) {
 		hlist_for_each_entry_safe(svc, n, &ip_vs_svc_table[idx],
 					  s_list) {
 			if (svc->ipvs == ipvs)
@@ -1712,7 +1800,7 @@ static int ip_vs_flush(struct netns_ipvs *ipvs, bool cleanup)
 	/*
 	 * Flush the service table hashed by fwmark
 	 */
-	for(idx = 0; idx < IP_VS_SVC_TAB_SIZE; idx++) {
+	for(idx = 0; idx < ip_vs_svc_tab_size; idx++) {
 		hlist_for_each_entry_safe(svc, n, &ip_vs_svc_fwm_table[idx],
 					  f_list) {
 			if (svc->ipvs == ipvs)
@@ -1777,7 +1865,7 @@ static int ip_vs_dst_event(struct notifier_block *this, unsigned long event,
 		return NOTIFY_DONE;
 	IP_VS_DBG(3, "%s() dev=%s\n", __func__, dev->name);
 	mutex_lock(&__ip_vs_mutex);
-	for (idx = 0; idx < IP_VS_SVC_TAB_SIZE; idx++) {
+	for (idx = 0; idx < ip_vs_svc_tab_size; idx++) {
 		hlist_for_each_entry(svc, &ip_vs_svc_table[idx], s_list) {
 			if (svc->ipvs == ipvs) {
 				list_for_each_entry(dest, &svc->destinations,
@@ -1826,14 +1914,14 @@ static int ip_vs_zero_all(struct netns_ipvs *ipvs)
 	int idx;
 	struct ip_vs_service *svc;
 
-	for(idx = 0; idx < IP_VS_SVC_TAB_SIZE; idx++) {
+	for(idx = 0; idx < ip_vs_svc_tab_size; idx++) {
 		hlist_for_each_entry(svc, &ip_vs_svc_table[idx], s_list) {
 			if (svc->ipvs == ipvs)
 				ip_vs_zero_service(svc);
 		}
 	}
 
-	for(idx = 0; idx < IP_VS_SVC_TAB_SIZE; idx++) {
+	for(idx = 0; idx < ip_vs_svc_tab_size; idx++) {
 		hlist_for_each_entry(svc, &ip_vs_svc_fwm_table[idx], f_list) {
 			if (svc->ipvs == ipvs)
 				ip_vs_zero_service(svc);
@@ -2068,6 +2156,33 @@ static int ipvs_proc_run_estimation(const struct ctl_table *table, int write,
 	return ret;
 }
 
+static int ipvs_proc_conn_tab_bits(const struct ctl_table *table, int write,
+				   void *buffer, size_t *lenp, loff_t *ppos)
+{
+	struct netns_ipvs *ipvs = table->extra2;
+	int val = READ_ONCE(ipvs->conn_tab_bits);
+	int ret;
+
+	struct ctl_table tmp_table = {
+		.data = &val,
+		.maxlen = sizeof(int),
+		.mode = table->mode,
+	};
+
+	ret = proc_dointvec(&tmp_table, write, buffer, lenp, ppos);
+	if (write && ret >= 0) {
+		if (val < 0)
+			ret = -EINVAL;
+		else
+			ret = ip_vs_conn_tab_resize(ipvs, val);
+	}
+	return ret;
+}
+
+static int ip_vs_mh_tab_index_min = IP_VS_MH_TAB_INDEX_MIN;
+static int ip_vs_mh_tab_index_max = IP_VS_MH_TAB_INDEX_MAX;
+static int ip_vs_twos_load_max = IP_VS_TWOS_LOAD_MAX;
+
 /*
  *	IPVS sysctl table (under the /proc/sys/net/ipv4/vs/)
  *	Do not change order or insert new entries without
@@ -2151,6 +2266,12 @@ static struct ctl_table vs_vars[] = {
 		.mode		= 0644,
 		.proc_handler	= proc_dointvec,
 	},
+	{
+		.procname	= "sync_workers",
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec,
+	},
 	{
 		.procname	= "cache_bypass",
 		.maxlen		= sizeof(int),
@@ -2202,6 +2323,13 @@ static struct ctl_table vs_vars[] = {
 		.extra1		= SYSCTL_ZERO,
 		.extra2		= SYSCTL_THREE,
 	},
+	{
+		.procname	= "sync_rate_limit",
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec_minmax,
+		.extra1		= SYSCTL_ZERO,
+	},
 	{
 		.procname	= "nat_icmp_send",
 		.maxlen		= sizeof(int),
@@ -2238,6 +2366,12 @@ static struct ctl_table vs_vars[] = {
 		.mode		= 0644,
 		.proc_handler	= proc_dointvec,
 	},
+	{
+		.procname	= "persist_stateless",
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec,
+	},
 	{
 		.procname	= "run_estimation",
 		.maxlen		= sizeof(int),
@@ -2256,6 +2390,34 @@ static struct ctl_table vs_vars[] = {
 		.mode		= 0644,
 		.proc_handler	= ipvs_proc_est_nice,
 	},
+	{
+		.procname	= "est_idle_backoff",
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec,
+	},
+	{
+		.procname	= "conn_tab_bits",
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= ipvs_proc_conn_tab_bits,
+	},
+	{
+		.procname	= "mh_tab_index",
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec_minmax,
+		.extra1		= &ip_vs_mh_tab_index_min,
+		.extra2		= &ip_vs_mh_tab_index_max,
+	},
+	{
+		.procname	= "twos_load",
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec_minmax,
+		.extra1		= SYSCTL_ZERO,
+		.extra2		= &ip_vs_twos_load_max,
+	},
 #ifdef CONFIG_IP_VS_DEBUG
 	{
 		.procname	= "debug_level",
@@ -2306,7 +2468,7 @@ static struct ip_vs_service *ip_vs_info_array(struct seq_file *seq, loff_t pos)
 	struct ip_vs_service *svc;
 
 	/* look in hash by protocol */
-	for (idx = 0; idx < IP_VS_SVC_TAB_SIZE; idx++) {
+	for (idx = 0; idx < ip_vs_svc_tab_size; idx++) {
 		hlist_for_each_entry_rcu(svc, &ip_vs_svc_table[idx], s_list) {
 			if ((svc->ipvs == ipvs) && pos-- == 0) {
 				iter->table = ip_vs_svc_table;
@@ -2317,7 +2479,7 @@ static struct ip_vs_service *ip_vs_info_array(struct seq_file *seq, loff_t pos)
 	}
 
 	/* keep looking in fwmark */
-	for (idx = 0; idx < IP_VS_SVC_TAB_SIZE; idx++) {
+	for (idx = 0; idx < ip_vs_svc_tab_size; idx++) {
 		hlist_for_each_entry_rcu(svc, &ip_vs_svc_fwm_table[idx],
 					 f_list) {
 			if ((svc->ipvs == ipvs) && pos-- == 0) {
@@ -2358,7 +2520,7 @@ static void *ip_vs_info_seq_next(struct seq_file *seq, void *v, loff_t *pos)
 		if (e)
 			return hlist_entry(e, struct ip_vs_service, s_list);
 
-		while (++iter->bucket < IP_VS_SVC_TAB_SIZE) {
+		while (++iter->bucket < ip_vs_svc_tab_size) {
 			hlist_for_each_entry_rcu(svc,
 						 &ip_vs_svc_table[iter->bucket],
 						 s_list) {
@@ -2377,7 +2539,7 @@ static void *ip_vs_info_seq_next(struct seq_file *seq, void *v, loff_t *pos)
 		return hlist_entry(e, struct ip_vs_service, f_list);
 
  scan_fwmark:
-	while (++iter->bucket < IP_VS_SVC_TAB_SIZE) {
+	while (++iter->bucket < ip_vs_svc_tab_size) {
 		hlist_for_each_entry_rcu(svc,
 					 &ip_vs_svc_fwm_table[iter->bucket],
 					 f_list)
@@ -2397,9 +2559,12 @@ static void ip_vs_info_seq_stop(struct seq_file *seq, void *v)
 static int ip_vs_info_seq_show(struct seq_file *seq, void *v)
 {
 	if (v == SEQ_START_TOKEN) {
+		struct netns_ipvs *ipvs = net_ipvs(seq_file_net(seq));
+
 		seq_printf(seq,
 			"IP Virtual Server version %d.%d.%d (size=%d)\n",
-			NVERSION(IP_VS_VERSION_CODE), ip_vs_conn_tab_size);
+			NVERSION(IP_VS_VERSION_CODE),
+			1 << READ_ONCE(ipvs->conn_tab_bits));
 		seq_puts(seq,
 			 "Prot LocalAddress:Port Scheduler Flags\n");
 		seq_puts(seq,
@@ -2871,7 +3036,7 @@ __ip_vs_get_service_entries(struct netns_ipvs *ipvs,
 	struct ip_vs_service_entry entry;
 	int ret = 0;
 
-	for (idx = 0; idx < IP_VS_SVC_TAB_SIZE; idx++) {
+	for (idx = 0; idx < ip_vs_svc_tab_size; idx++) {
 		hlist_for_each_entry(svc, &ip_vs_svc_table[idx], s_list) {
 			/* Only expose IPv4 entries to old interface */
 			if (svc->af != AF_INET || (svc->ipvs != ipvs))
@@ -2890,7 +3055,7 @@ __ip_vs_get_service_entries(struct netns_ipvs *ipvs,
 		}
 	}
 
-	for (idx = 0; idx < IP_VS_SVC_TAB_SIZE; idx++) {
+	for (idx = 0; idx < ip_vs_svc_tab_size; idx++) {
 		hlist_for_each_entry(svc, &ip_vs_svc_fwm_table[idx], f_list) {
 			/* Only expose IPv4 entries to old interface */
 			if (svc->af != AF_INET || (svc->ipvs != ipvs))
@@ -3069,7 +3234,8 @@ do_ip_vs_get_ctl(struct sock *sk, int cmd, void __user *user, int *len)
 		char buf[64];
 
 		sprintf(buf, "IP Virtual Server version %d.%d.%d (size=%d)",
-			NVERSION(IP_VS_VERSION_CODE), ip_vs_conn_tab_size);
+			NVERSION(IP_VS_VERSION_CODE),
+			1 << READ_ONCE(ipvs->conn_tab_bits));
 		if (copy_to_user(user, buf, strlen(buf)+1) != 0) {
 			ret = -EFAULT;
 			goto out;
@@ -3082,7 +3248,7 @@ do_ip_vs_get_ctl(struct sock *sk, int cmd, void __user *user, int *len)
 	{
 		struct ip_vs_getinfo info;
 		info.version = IP_VS_VERSION_CODE;
-		info.size = ip_vs_conn_tab_size;
+		info.size = 1 << READ_ONCE(ipvs->conn_tab_bits);
 		info.num_services = ipvs->num_services;
 		if (copy_to_user(user, &info, sizeof(info)) != 0)
 			ret = -EFAULT;
@@ -3205,6 +3371,9 @@ static const struct nla_policy ip_vs_daemon_policy[IPVS_DAEMON_ATTR_MAX + 1] = {
 	[IPVS_DAEMON_ATTR_MCAST_GROUP6]	= { .len = sizeof(struct in6_addr) },
 	[IPVS_DAEMON_ATTR_MCAST_PORT]	= { .type = NLA_U16 },
 	[IPVS_DAEMON_ATTR_MCAST_TTL]	= { .type = NLA_U8 },
+	[IPVS_DAEMON_ATTR_SYNC_TCP]	= { .type = NLA_U8 },
+	[IPVS_DAEMON_ATTR_SYNC_PEER]	= { .type = NLA_U32 },
+	[IPVS_DAEMON_ATTR_SYNC_PEER6]	= { .len = sizeof(struct in6_addr) },
 };
 
 /* Policy used for attributes in nested attribute IPVS_CMD_ATTR_SERVICE */
@@ -3243,6 +3412,7 @@ static const struct nla_policy ip_vs_dest_policy[IPVS_DEST_ATTR_MAX + 1] = {
 	[IPVS_DEST_ATTR_TUN_TYPE]	= { .type = NLA_U8 },
 	[IPVS_DEST_ATTR_TUN_PORT]	= { .type = NLA_U16 },
 	[IPVS_DEST_ATTR_TUN_FLAGS]	= { .type = NLA_U16 },
+	[IPVS_DEST_ATTR_LOAD]		= { .type = NLA_U32 },
 };
 
 static int ip_vs_genl_fill_stats(struct sk_buff *skb, int container_type,
@@ -3397,7 +3567,7 @@ static int ip_vs_genl_dump_services(struct sk_buff *skb,
 	struct netns_ipvs *ipvs = net_ipvs(net);
 
 	mutex_lock(&__ip_vs_mutex);
-	for (i = 0; i < IP_VS_SVC_TAB_SIZE; i++) {
+	for (i = 0; i < ip_vs_svc_tab_size; i++) {
 		hlist_for_each_entry(svc, &ip_vs_svc_table[i], s_list) {
 			if (++idx <= start || (svc->ipvs != ipvs))
 				continue;
@@ -3408,7 +3578,7 @@ static int ip_vs_genl_dump_services(struct sk_buff *skb,
 		}
 	}
 
-	for (i = 0; i < IP_VS_SVC_TAB_SIZE; i++) {
+	for (i = 0; i < ip_vs_svc_tab_size; i++) {
 		hlist_for_each_entry(svc, &ip_vs_svc_fwm_table[i], f_list) {
 			if (++idx <= start || (svc->ipvs != ipvs))
 				continue;
@@ -3553,6 +3723,7 @@ static int ip_vs_genl_fill_dest(struct sk_buff *skb, struct ip_vs_dest *dest)
 			dest->tun_flags) ||
 	    nla_put_u32(skb, IPVS_DEST_ATTR_U_THRESH, dest->u_threshold) ||
 	    nla_put_u32(skb, IPVS_DEST_ATTR_L_THRESH, dest->l_threshold) ||
+	    nla_put_u32(skb, IPVS_DEST_ATTR_LOAD, READ_ONCE(dest->load)) ||
 	    nla_put_u32(skb, IPVS_DEST_ATTR_ACTIVE_CONNS,
 			atomic_read(&dest->activeconns)) ||
 	    nla_put_u32(skb, IPVS_DEST_ATTR_INACT_CONNS,
@@ -3669,7 +3840,7 @@ static int ip_vs_genl_parse_dest(struct ip_vs_dest_user_kern *udest,
 	if (full_entry) {
 		struct nlattr *nla_fwd, *nla_weight, *nla_u_thresh,
 			      *nla_l_thresh, *nla_tun_type, *nla_tun_port,
-			      *nla_tun_flags;
+			      *nla_tun_flags, *nla_load;
 
 		nla_fwd		= attrs[IPVS_DEST_ATTR_FWD_METHOD];
 		nla_weight	= attrs[IPVS_DEST_ATTR_WEIGHT];
@@ -3678,6 +3849,7 @@ static int ip_vs_genl_parse_dest(struct ip_vs_dest_user_kern *udest,
 		nla_tun_type	= attrs[IPVS_DEST_ATTR_TUN_TYPE];
 		nla_tun_port	= attrs[IPVS_DEST_ATTR_TUN_PORT];
 		nla_tun_flags	= attrs[IPVS_DEST_ATTR_TUN_FLAGS];
+		nla_load	= attrs[IPVS_DEST_ATTR_LOAD];
 
 		if (!(nla_fwd && nla_weight && nla_u_thresh && nla_l_thresh))
 			return -EINVAL;
@@ -3696,6 +3868,9 @@ static int ip_vs_genl_parse_dest(struct ip_vs_dest_user_kern *udest,
 
 		if (nla_tun_flags)
 			udest->tun_flags = nla_get_u16(nla_tun_flags);
+
+		if (nla_load)
+			udest->load = nla_get_u32(nla_load);
 	}
 
 	return 0;
@@ -3717,6 +3892,9 @@ static int ip_vs_genl_fill_daemon(struct sk_buff *skb, __u32 state,
 	    nla_put_u16(skb, IPVS_DAEMON_ATTR_MCAST_PORT, c->mcast_port) ||
 	    nla_put_u8(skb, IPVS_DAEMON_ATTR_MCAST_TTL, c->mcast_ttl))
 		goto nla_put_failure;
+	if (c->sync_tcp &&
+	    nla_put_u8(skb, IPVS_DAEMON_ATTR_SYNC_TCP, c->sync_tcp))
+		goto nla_put_failure;
 #ifdef CONFIG_IP_VS_IPV6
 	if (c->mcast_af == AF_INET6) {
 		if (nla_put_in6_addr(skb, IPVS_DAEMON_ATTR_MCAST_GROUP6,
@@ -3728,6 +3906,18 @@ static int ip_vs_genl_fill_daemon(struct sk_buff *skb, __u32 state,
 		    nla_put_in_addr(skb, IPVS_DAEMON_ATTR_MCAST_GROUP,
 				    c->mcast_group.ip))
 			goto nla_put_failure;
+	if (!ipv6_addr_any(&c->sync_peer.in6)) {
+#ifdef CONFIG_IP_VS_IPV6
+		if (c->mcast_af == AF_INET6) {
+			if (nla_put_in6_addr(skb, IPVS_DAEMON_ATTR_SYNC_PEER6,
+					     &c->sync_peer.in6))
+				goto nla_put_failure;
+		} else
+#endif
+			if (nla_put_in_addr(skb, IPVS_DAEMON_ATTR_SYNC_PEER,
+					    c->sync_peer.ip))
+				goto nla_put_failure;
+	}
 	nla_nest_end(skb, nl_daemon);
 
 	return 0;
@@ -3807,11 +3997,16 @@ static int ip_vs_genl_new_daemon(struct netns_ipvs *ipvs, struct nlattr **attrs)
 	if (a)
 		c.sync_maxlen = nla_get_u16(a);
 
+	a = attrs[IPVS_DAEMON_ATTR_SYNC_TCP];
+	if (a)
+		c.sync_tcp = !!nla_get_u8(a);
+
+	/* With TCP the group is the unicast address of the backup */
 	a = attrs[IPVS_DAEMON_ATTR_MCAST_GROUP];
 	if (a) {
 		c.mcast_af = AF_INET;
 		c.mcast_group.ip = nla_get_in_addr(a);
-		if (!ipv4_is_multicast(c.mcast_group.ip))
+		if (!c.sync_tcp && !ipv4_is_multicast(c.mcast_group.ip))
 			return -EINVAL;
 	} else {
 		a = attrs[IPVS_DAEMON_ATTR_MCAST_GROUP6];
@@ -3822,8 +4017,27 @@ static int ip_vs_genl_new_daemon(struct netns_ipvs *ipvs, struct nlattr **attrs)
 			c.mcast_af = AF_INET6;
 			c.mcast_group.in6 = nla_get_in6_addr(a);
 			addr_type = ipv6_addr_type(&c.mcast_group.in6);
-			if (!(addr_type & IPV6_ADDR_MULTICAST))
+			if (!c.sync_tcp && !(addr_type & IPV6_ADDR_MULTICAST))
+				return -EINVAL;
+#else
+			return -EAFNOSUPPORT;
+#endif
+		}
+	}
+
+	/* The master a TCP backup accepts, in the family of the group */
+	a = attrs[IPVS_DAEMON_ATTR_SYNC_PEER];
+	if (a) {
+		if (c.mcast_af != AF_INET)
+			return -EINVAL;
+		c.sync_peer.ip = nla_get_in_addr(a);
+	} else {
+		a = attrs[IPVS_DAEMON_ATTR_SYNC_PEER6];
+		if (a) {
+#ifdef CONFIG_IP_VS_IPV6
+			if (c.mcast_af != AF_INET6)
 				return -EINVAL;
+			c.sync_peer.in6 = nla_get_in6_addr(a);
 #else
 			return -EAFNOSUPPORT;
 #endif
@@ -4111,7 +4325,7 @@ static int ip_vs_genl_get_cmd(struct sk_buff *skb, struct genl_info *info)
 		if (nla_put_u32(msg, IPVS_INFO_ATTR_VERSION,
 				IP_VS_VERSION_CODE) ||
 		    nla_put_u32(msg, IPVS_INFO_ATTR_CONN_TAB_SIZE,
-				ip_vs_conn_tab_size))
+				1 << READ_ONCE(ipvs->conn_tab_bits)))
 			goto nla_put_failure;
 		break;
 	}
@@ -4319,6 +4533,10 @@ static int __net_init ip_vs_control_net_init_sysctl(struct netns_ipvs *ipvs)
 		tbl[idx].mode = 0444;
 	tbl[idx++].data = &ipvs->sysctl_sync_sock_size;
 
+	if (unpriv)
+		tbl[idx].mode = 0444;
+	tbl[idx++].data = &ipvs->sysctl_sync_workers;
+
 	tbl[idx++].data = &ipvs->sysctl_cache_bypass;
 	tbl[idx++].data = &ipvs->sysctl_expire_nodest_conn;
 	tbl[idx++].data = &ipvs->sysctl_sloppy_tcp;
@@ -4333,6 +4551,7 @@ static int __net_init ip_vs_control_net_init_sysctl(struct netns_ipvs *ipvs)
 	tbl[idx++].data = &ipvs->sysctl_sync_refresh_period;
 	ipvs->sysctl_sync_retries = clamp_t(int, DEFAULT_SYNC_RETRIES, 0, 3);
 	tbl[idx++].data = &ipvs->sysctl_sync_retries;
+	tbl[idx++].data = &ipvs->sysctl_sync_rate_limit;
 	tbl[idx++].data = &ipvs->sysctl_nat_icmp_send;
 	ipvs->sysctl_pmtu_disc = 1;
 	tbl[idx++].data = &ipvs->sysctl_pmtu_disc;
@@ -4341,6 +4560,7 @@ static int __net_init ip_vs_control_net_init_sysctl(struct netns_ipvs *ipvs)
 	tbl[idx++].data = &ipvs->sysctl_conn_reuse_mode;
 	tbl[idx++].data = &ipvs->sysctl_schedule_icmp;
 	tbl[idx++].data = &ipvs->sysctl_ignore_tunneled;
+	tbl[idx++].data = &ipvs->sysctl_persist_stateless;
 
 	ipvs->sysctl_run_estimation = 1;
 	if (unpriv)
@@ -4359,6 +4579,15 @@ static int __net_init ip_vs_control_net_init_sysctl(struct netns_ipvs *ipvs)
 		tbl[idx].mode = 0444;
 	tbl[idx].extra2 = ipvs;
 	tbl[idx++].data = &ipvs->sysctl_est_nice;
+	tbl[idx++].data = &ipvs->sysctl_est_idle_backoff;
+
+	if (unpriv)
+		tbl[idx].mode = 0444;
+	tbl[idx].extra2 = ipvs;
+	tbl[idx++].data = &ipvs->conn_tab_bits;
+	ipvs->sysctl_mh_tab_index = IP_VS_MH_TAB_INDEX;
+	tbl[idx++].data = &ipvs->sysctl_mh_tab_index;
+	tbl[idx++].data = &ipvs->sysctl_twos_load;
 
 #ifdef CONFIG_IP_VS_DEBUG
 	/* Global sysctls must be ro in non-init netns */
@@ -4436,13 +4665,18 @@ int __net_init ip_vs_control_net_init(struct netns_ipvs *ipvs)
 	atomic_set(&ipvs->ftpsvc_counter, 0);
 	atomic_set(&ipvs->nullsvc_counter, 0);
 	atomic_set(&ipvs->conn_out_counter, 0);
+	atomic_set(&ipvs->svc_gen, 0);
 
 	INIT_DELAYED_WORK(&ipvs->est_reload_work, est_reload_work_handler);
 
+	ipvs->svc_cache = alloc_percpu(struct ip_vs_svc_cache);
+	if (!ipvs->svc_cache)
+		goto out;
+
 	/* procfs stats */
 	ipvs->tot_stats = kzalloc(sizeof(*ipvs->tot_stats), GFP_KERNEL);
 	if (!ipvs->tot_stats)
-		goto out;
+		goto err_svc_cache;
 	if (ip_vs_stats_init_alloc(&ipvs->tot_stats->s) < 0)
 		goto err_tot_stats;
 
@@ -4482,6 +4716,9 @@ int __net_init ip_vs_control_net_init(struct netns_ipvs *ipvs)
 err_tot_stats:
 	kfree(ipvs->tot_stats);
 
+err_svc_cache:
+	free_percpu(ipvs->svc_cache);
+
 out:
 	return ret;
 }
@@ -4497,6 +4734,7 @@ void __net_exit ip_vs_control_net_cleanup(struct netns_ipvs *ipvs)
 	remove_proc_entry("ip_vs", ipvs->net->proc_net);
 #endif
 	call_rcu(&ipvs->tot_stats->rcu_head, ip_vs_stats_rcu_free);
+	free_percpu(ipvs->svc_cache);
 }
 
 int __init ip_vs_register_nl_ioctl(void)
@@ -4533,8 +4771,25 @@ int __init ip_vs_control_init(void)
 	int idx;
 	int ret;
 
+	/* 256 to 1M buckets, out of range values get the default */
+	if (ip_vs_svc_tab_bits < IP_VS_SVC_TAB_BITS || ip_vs_svc_tab_bits > 20)
+		ip_vs_svc_tab_bits = IP_VS_SVC_TAB_BITS;
+	ip_vs_svc_tab_size = 1 << ip_vs_svc_tab_bits;
+	ip_vs_svc_tab_mask = ip_vs_svc_tab_size - 1;
+	ip_vs_svc_rnd = get_random_u32();
+
+	ip_vs_svc_table = kvmalloc_array(ip_vs_svc_tab_size,
+					 sizeof(*ip_vs_svc_table), GFP_KERNEL);
+	ip_vs_svc_fwm_table = kvmalloc_array(ip_vs_svc_tab_size,
+					     sizeof(*ip_vs_svc_fwm_table),
+					     GFP_KERNEL);
+	if (!ip_vs_svc_table || !ip_vs_svc_fwm_table) {
+		ret = -ENOMEM;
+		goto err_tab;
+	}
+
 	/* Initialize svc_table, ip_vs_svc_fwm_table */
-	for (idx = 0; idx < IP_VS_SVC_TAB_SIZE; idx++) {
+	for (idx = 0; idx < ip_vs_svc_tab_size; idx++) {
 		INIT_HLIST_HEAD(&ip_vs_svc_table[idx]);
 		INIT_HLIST_HEAD(&ip_vs_svc_fwm_table[idx]);
 	}
@@ -4543,9 +4798,14 @@ int __init ip_vs_control_init(void)
 
 	ret = register_netdevice_notifier(&ip_vs_dst_notifier);
 	if (ret < 0)
-		return ret;
+		goto err_tab;
 
 	return 0;
+
+err_tab:
+	kvfree(ip_vs_svc_fwm_table);
+	kvfree(ip_vs_svc_table);
+	return ret;
 }
 
 
@@ -4553,4 +4813,6 @@ void ip_vs_control_cleanup(void)
 {
 	unregister_netdevice_notifier(&ip_vs_dst_notifier);
 	/* relying on common rcu_barrier() in ip_vs_cleanup() */
+	kvfree(ip_vs_svc_fwm_table);
+	kvfree(ip_vs_svc_table);
 }
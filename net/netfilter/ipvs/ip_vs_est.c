@@ -63,6 +63,9 @@
   - kthread tasks are stopped while the cpulist is empty
   - the kthread context holds lists with estimators (chains) which are
     processed every 2 seconds
+  - with est_idle_backoff, estimators that count nothing and have zero
+    rates are sampled every 4, 8, .. 32 seconds, the counters are summed
+    on demand when read
   - as estimators can be added dynamically and in bursts, we try to spread
     them to multiple chains which are estimated at different time
   - on start, kthread 0 enters calculation phase to determine the chain limits
@@ -76,76 +79,115 @@ static struct lock_class_key __ipvs_est_key;
 static void ip_vs_est_calc_phase(struct netns_ipvs *ipvs);
 static void ip_vs_est_drain_temp_list(struct netns_ipvs *ipvs);
 
-static void ip_vs_chain_estimation(struct hlist_head *chain)
+/* Idle estimators are sampled every 2^IPVS_EST_IDLE_MAX periods at most */
+#define IPVS_EST_IDLE_MAX	4
+
+/* Sum the per-cpu counters */
+static void ip_vs_est_sum(struct ip_vs_stats *s, struct ip_vs_kstats *k)
 {
-	struct ip_vs_estimator *e;
 	struct ip_vs_cpu_stats *c;
-	struct ip_vs_stats *s;
-	u64 rate;
+	int i;
 
-	hlist_for_each_entry_rcu(e, chain, list) {
+	k->conns = 0;
+	k->inpkts = 0;
+	k->outpkts = 0;
+	k->inbytes = 0;
+	k->outbytes = 0;
+
+	for_each_possible_cpu(i) {
 		u64 conns, inpkts, outpkts, inbytes, outbytes;
-		u64 kconns = 0, kinpkts = 0, koutpkts = 0;
-		u64 kinbytes = 0, koutbytes = 0;
 		unsigned int start;
-		int i;
 
+		c = per_cpu_ptr(s->cpustats, i);
+		do {
+			start = u64_stats_fetch_begin(&c->syncp);
+			conns = u64_stats_read(&c->cnt.conns);
+			inpkts = u64_stats_read(&c->cnt.inpkts);
+			outpkts = u64_stats_read(&c->cnt.outpkts);
+			inbytes = u64_stats_read(&c->cnt.inbytes);
+			outbytes = u64_stats_read(&c->cnt.outbytes);
+		} while (u64_stats_fetch_retry(&c->syncp, start));
+		k->conns += conns;
+		k->inpkts += inpkts;
+		k->outpkts += outpkts;
+		k->inbytes += inbytes;
+		k->outbytes += outbytes;
+	}
+}
+
+static void ip_vs_chain_estimation(struct hlist_head *chain, bool backoff)
+{
+	struct ip_vs_estimator *e;
+	struct ip_vs_kstats k;
+	struct ip_vs_stats *s;
+	bool idle;
+	u64 rate;
+
+	hlist_for_each_entry_rcu(e, chain, list) {
 		if (kthread_should_stop())
 			break;
 
-		s = container_of(e, struct ip_vs_stats, est);
-		for_each_possible_cpu(i) {
-			c = per_cpu_ptr(s->cpustats, i);
-			do {
-				start = u64_stats_fetch_begin(&c->syncp);
-				conns = u64_stats_read(&c->cnt.conns);
-				inpkts = u64_stats_read(&c->cnt.inpkts);
-				outpkts = u64_stats_read(&c->cnt.outpkts);
-				inbytes = u64_stats_read(&c->cnt.inbytes);
-				outbytes = u64_stats_read(&c->cnt.outbytes);
-			} while (u64_stats_fetch_retry(&c->syncp, start));
-			kconns += conns;
-			kinpkts += inpkts;
-			koutpkts += outpkts;
-			kinbytes += inbytes;
-			koutbytes += outbytes;
+		/* nothing was counted for a while, save the summing */
+		if (e->skip) {
+			e->skip--;
+			continue;
 		}
 
+		s = container_of(e, struct ip_vs_stats, est);
+		ip_vs_est_sum(s, &k);
+
 		spin_lock(&s->lock);
 
-		s->kstats.conns = kconns;
-		s->kstats.inpkts = kinpkts;
-		s->kstats.outpkts = koutpkts;
-		s->kstats.inbytes = kinbytes;
-		s->kstats.outbytes = koutbytes;
+		s->kstats.conns = k.conns;
+		s->kstats.inpkts = k.inpkts;
+		s->kstats.outpkts = k.outpkts;
+		s->kstats.inbytes = k.inbytes;
+		s->kstats.outbytes = k.outbytes;
+
+		idle = !e->cps && !e->inpps && !e->outpps && !e->inbps &&
+		       !e->outbps && e->last_conns == k.conns &&
+		       e->last_inpkts == k.inpkts &&
+		       e->last_outpkts == k.outpkts;
 
-		/* scaled by 2^10, but divided 2 seconds */
-		rate = (s->kstats.conns - e->last_conns) << 9;
+		/* scaled by 2^10, but divided 2 seconds, for each of the
+		 * 2^e->idle periods since the last sample
+		 */
+		rate = ((s->kstats.conns - e->last_conns) << 9) >> e->idle;
 		e->last_conns = s->kstats.conns;
 		e->cps += ((s64)rate - (s64)e->cps) >> 2;
 
-		rate = (s->kstats.inpkts - e->last_inpkts) << 9;
+		rate = ((s->kstats.inpkts - e->last_inpkts) << 9) >> e->idle;
 		e->last_inpkts = s->kstats.inpkts;
 		e->inpps += ((s64)rate - (s64)e->inpps) >> 2;
 
-		rate = (s->kstats.outpkts - e->last_outpkts) << 9;
+		rate = ((s->kstats.outpkts - e->last_outpkts) << 9) >> e->idle;
 		e->last_outpkts = s->kstats.outpkts;
 		e->outpps += ((s64)rate - (s64)e->outpps) >> 2;
 
 		/* scaled by 2^5, but divided 2 seconds */
-		rate = (s->kstats.inbytes - e->last_inbytes) << 4;
+		rate = ((s->kstats.inbytes - e->last_inbytes) << 4) >> e->idle;
 		e->last_inbytes = s->kstats.inbytes;
 		e->inbps += ((s64)rate - (s64)e->inbps) >> 2;
 
-		rate = (s->kstats.outbytes - e->last_outbytes) << 4;
+		rate = ((s->kstats.outbytes - e->last_outbytes) << 4) >> e->idle;
 		e->last_outbytes = s->kstats.outbytes;
 		e->outbps += ((s64)rate - (s64)e->outbps) >> 2;
+
+		/* back off while the rates are zero and nothing is counted,
+		 * ip_vs_est_sync_counters() keeps the counters exact
+		 */
+		if (backoff && idle)
+			e->idle = min(e->idle + 1, IPVS_EST_IDLE_MAX);
+		else
+			e->idle = 0;
+		e->skip = (1 << e->idle) - 1;
 		spin_unlock(&s->lock);
 	}
 }
 
 static void ip_vs_tick_estimation(struct ip_vs_est_kt_data *kd, int row)
 {
+	bool backoff = sysctl_est_idle_backoff(kd->ipvs);
 	struct ip_vs_est_tick_data *td;
 	int cid;
 
@@ -156,7 +198,7 @@ static void ip_vs_tick_estimation(struct ip_vs_est_kt_data *kd, int row)
 	for_each_set_bit(cid, td->present, IPVS_EST_TICK_CHAINS) {
 		if (kthread_should_stop())
 			break;
-		ip_vs_chain_estimation(&td->chains[cid]);
+		ip_vs_chain_estimation(&td->chains[cid], backoff);
 		cond_resched_rcu();
 		td = rcu_dereference(kd->ticks[row]);
 		if (!td)
@@ -670,11 +712,11 @@ static int ip_vs_est_calc_limits(struct netns_ipvs *ipvs, int *chain_max)
 		rcu_read_lock();
 
 		/* Put stats in cache */
-		ip_vs_chain_estimation(&chain);
+		ip_vs_chain_estimation(&chain, false);
 
 		t1 = ktime_get();
 		for (i = loops * cache_factor; i > 0; i--)
-			ip_vs_chain_estimation(&chain);
+			ip_vs_chain_estimation(&chain, false);
 		t2 = ktime_get();
 
 		rcu_read_unlock();
@@ -912,6 +954,19 @@ void ip_vs_zero_estimator(struct ip_vs_stats *stats)
 	est->outpps = 0;
 	est->inbps = 0;
 	est->outbps = 0;
+	est->idle = 0;
+	est->skip = 0;
+}
+
+/* Bring the counters of an estimator that skips idle periods up to date,
+ * caller must hold the stats->lock lock
+ */
+void ip_vs_est_sync_counters(struct ip_vs_stats *stats)
+{
+	if (!stats->est.idle)
+		return;
+
+	ip_vs_est_sum(stats, &stats->kstats);
 }
 
 /* Get decoded rates */
@@ -40,6 +40,7 @@ struct ip_vs_mh_lookup {
 };
 
 struct ip_vs_mh_dest_setup {
+	struct ip_vs_dest *dest;
 	unsigned int	offset; /* starting offset */
 	unsigned int	skip;	/* skip */
 	unsigned int	perm;	/* next_offset */
@@ -50,21 +51,25 @@ struct ip_vs_mh_dest_setup {
 static int primes[] = {251, 509, 1021, 2039, 4093,
 		       8191, 16381, 32749, 65521, 131071};
 
-/* For IPVS MH entry hash table */
-#ifndef CONFIG_IP_VS_MH_TAB_INDEX
-#define CONFIG_IP_VS_MH_TAB_INDEX	12
-#endif
-#define IP_VS_MH_TAB_BITS		(CONFIG_IP_VS_MH_TAB_INDEX / 2)
-#define IP_VS_MH_TAB_INDEX		(CONFIG_IP_VS_MH_TAB_INDEX - 8)
-#define IP_VS_MH_TAB_SIZE               primes[IP_VS_MH_TAB_INDEX]
+/* Lookup table as it was before the last change of the dests */
+struct ip_vs_mh_prev {
+	struct rcu_head			rcu_head;
+	unsigned long			changed;	/* jiffies */
+	struct ip_vs_mh_lookup		lookup[];
+};
 
 struct ip_vs_mh_state {
 	struct rcu_head			rcu_head;
 	struct ip_vs_mh_lookup		*lookup;
+	struct ip_vs_mh_prev __rcu	*prev;
+	/* Setup the lookup table was populated from */
 	struct ip_vs_mh_dest_setup	*dest_setup;
+	int				dest_count;
 	hsiphash_key_t			hash1, hash2;
 	int				gcd;
 	int				rshift;
+	int				tab_size;	/* a prime */
+	int				tab_bits;
 };
 
 static inline void generate_hash_secret(hsiphash_key_t *hash1,
@@ -109,7 +114,7 @@ static void ip_vs_mh_reset(struct ip_vs_mh_state *s)
 	struct ip_vs_dest *dest;
 
 	l = &s->lookup[0];
-	for (i = 0; i < IP_VS_MH_TAB_SIZE; i++) {
+	for (i = 0; i < s->tab_size; i++) {
 		dest = rcu_dereference_protected(l->dest, 1);
 		if (dest) {
 			ip_vs_dest_put(dest);
@@ -119,33 +124,80 @@ static void ip_vs_mh_reset(struct ip_vs_mh_state *s)
 	}
 }
 
+static void ip_vs_mh_free_prev(struct ip_vs_mh_state *s,
+			       struct ip_vs_mh_prev *prev)
+{
+	struct ip_vs_dest *dest;
+	int i;
+
+	for (i = 0; i < s->tab_size; i++) {
+		dest = rcu_dereference_protected(prev->lookup[i].dest, 1);
+		if (dest)
+			ip_vs_dest_put(dest);
+	}
+	kvfree_rcu(prev, rcu_head);
+}
+
+/* Remember the lookup table before it changes, persistent services keep
+ * their clients on the old dests for a persistence timeout.
+ */
+static void ip_vs_mh_save_prev(struct ip_vs_mh_state *s,
+			       struct ip_vs_service *svc)
+{
+	struct ip_vs_mh_prev *prev, *old;
+	struct ip_vs_dest *dest;
+	int i;
+
+	prev = NULL;
+	if (svc->flags & IP_VS_SVC_F_PERSISTENT &&
+	    sysctl_persist_stateless(svc->ipvs))
+		prev = kvmalloc(struct_size(prev, lookup, s->tab_size),
+				GFP_KERNEL);
+	if (prev) {
+		prev->changed = jiffies;
+		for (i = 0; i < s->tab_size; i++) {
+			dest = rcu_dereference_protected(s->lookup[i].dest, 1);
+			if (dest)
+				ip_vs_dest_hold(dest);
+			RCU_INIT_POINTER(prev->lookup[i].dest, dest);
+		}
+	}
+
+	old = rcu_dereference_protected(s->prev, 1);
+	rcu_assign_pointer(s->prev, prev);
+	if (old)
+		ip_vs_mh_free_prev(s, old);
+}
+
 static int ip_vs_mh_permutate(struct ip_vs_mh_state *s,
-			      struct ip_vs_service *svc)
+			      struct ip_vs_service *svc,
+			      struct ip_vs_mh_dest_setup *ds)
 {
 	struct list_head *p;
-	struct ip_vs_mh_dest_setup *ds;
 	struct ip_vs_dest *dest;
 	int lw;
 
-	/* If gcd is smaller then 1, number of dests or
-	 * all last_weight of dests are zero. So, skip
-	 * permutation for the dests.
-	 */
-	if (s->gcd < 1)
-		return 0;
-
 	/* Set dest_setup for the dests permutation */
 	p = &svc->destinations;
-	ds = &s->dest_setup[0];
 	while ((p = p->next) != &svc->destinations) {
 		dest = list_entry(p, struct ip_vs_dest, n_list);
+		ds->dest = dest;
+
+		/* If gcd is smaller then 1, number of dests or
+		 * all last_weight of dests are zero. So, skip
+		 * permutation for the dests.
+		 */
+		if (s->gcd < 1) {
+			ds++;
+			continue;
+		}
 
 		ds->offset = ip_vs_mh_hashkey(svc->af, &dest->addr,
 					      dest->port, &s->hash1, 0) %
-					      IP_VS_MH_TAB_SIZE;
+					      s->tab_size;
 		ds->skip = ip_vs_mh_hashkey(svc->af, &dest->addr,
 					    dest->port, &s->hash2, 0) %
-					    (IP_VS_MH_TAB_SIZE - 1) + 1;
+					    (s->tab_size - 1) + 1;
 		ds->perm = ds->offset;
 
 		lw = atomic_read(&dest->last_weight);
@@ -157,7 +209,8 @@ static int ip_vs_mh_permutate(struct ip_vs_mh_state *s,
 }
 
 static int ip_vs_mh_populate(struct ip_vs_mh_state *s,
-			     struct ip_vs_service *svc)
+			     struct ip_vs_service *svc,
+			     struct ip_vs_mh_dest_setup *dest_setup)
 {
 	int n, c, dt_count;
 	unsigned long *table;
@@ -174,18 +227,18 @@ static int ip_vs_mh_populate(struct ip_vs_mh_state *s,
 		return 0;
 	}
 
-	table = bitmap_zalloc(IP_VS_MH_TAB_SIZE, GFP_KERNEL);
+	table = bitmap_zalloc(s->tab_size, GFP_KERNEL);
 	if (!table)
 		return -ENOMEM;
 
 	p = &svc->destinations;
 	n = 0;
 	dt_count = 0;
-	while (n < IP_VS_MH_TAB_SIZE) {
+	while (n < s->tab_size) {
 		if (p == &svc->destinations)
 			p = p->next;
 
-		ds = &s->dest_setup[0];
+		ds = &dest_setup[0];
 		while (p != &svc->destinations) {
 			/* Ignore added server with zero weight */
 			if (ds->turns < 1) {
@@ -196,10 +249,10 @@ static int ip_vs_mh_populate(struct ip_vs_mh_state *s,
 
 			c = ds->perm;
 			while (test_bit(c, table)) {
-				/* Add skip, mod IP_VS_MH_TAB_SIZE */
+				/* Add skip, mod s->tab_size */
 				ds->perm += ds->skip;
-				if (ds->perm >= IP_VS_MH_TAB_SIZE)
-					ds->perm -= IP_VS_MH_TAB_SIZE;
+				if (ds->perm >= s->tab_size)
+					ds->perm -= s->tab_size;
 				c = ds->perm;
 			}
 
@@ -214,7 +267,7 @@ static int ip_vs_mh_populate(struct ip_vs_mh_state *s,
 				RCU_INIT_POINTER(s->lookup[c].dest, new_dest);
 			}
 
-			if (++n == IP_VS_MH_TAB_SIZE)
+			if (++n == s->tab_size)
 				goto out;
 
 			if (++dt_count >= ds->turns) {
@@ -236,7 +289,7 @@ ip_vs_mh_get(struct ip_vs_service *svc, struct ip_vs_mh_state *s,
 	     const union nf_inet_addr *addr, __be16 port)
 {
 	unsigned int hash = ip_vs_mh_hashkey(svc->af, addr, port, &s->hash1, 0)
-					     % IP_VS_MH_TAB_SIZE;
+					     % s->tab_size;
 	struct ip_vs_dest *dest = rcu_dereference(s->lookup[hash].dest);
 
 	return (!dest || is_unavailable(dest)) ? NULL : dest;
@@ -253,7 +306,7 @@ ip_vs_mh_get_fallback(struct ip_vs_service *svc, struct ip_vs_mh_state *s,
 
 	/* First try the dest it's supposed to go to */
 	ihash = ip_vs_mh_hashkey(svc->af, addr, port,
-				 &s->hash1, 0) % IP_VS_MH_TAB_SIZE;
+				 &s->hash1, 0) % s->tab_size;
 	dest = rcu_dereference(s->lookup[ihash].dest);
 	if (!dest)
 		return NULL;
@@ -266,10 +319,10 @@ ip_vs_mh_get_fallback(struct ip_vs_service *svc, struct ip_vs_mh_state *s,
 	/* If the original dest is unavailable, loop around the table
 	 * starting from ihash to find a new dest
 	 */
-	for (offset = 0; offset < IP_VS_MH_TAB_SIZE; offset++) {
-		roffset = (offset + ihash) % IP_VS_MH_TAB_SIZE;
+	for (offset = 0; offset < s->tab_size; offset++) {
+		roffset = (offset + ihash) % s->tab_size;
 		hash = ip_vs_mh_hashkey(svc->af, addr, port, &s->hash1,
-					roffset) % IP_VS_MH_TAB_SIZE;
+					roffset) % s->tab_size;
 		dest = rcu_dereference(s->lookup[hash].dest);
 		if (!dest)
 			break;
@@ -284,39 +337,69 @@ ip_vs_mh_get_fallback(struct ip_vs_service *svc, struct ip_vs_mh_state *s,
 	return NULL;
 }
 
-/* Assign all the hash buckets of the specified table with the service. */
+/* The table only depends on the dests, in order, and on their turns */
+static bool ip_vs_mh_setup_equal(struct ip_vs_mh_state *s,
+				 struct ip_vs_mh_dest_setup *ds, int count)
+{
+	int i;
+
+	if (count != s->dest_count)
+		return false;
+	for (i = 0; i < count; i++) {
+		if (ds[i].dest != s->dest_setup[i].dest ||
+		    ds[i].turns != s->dest_setup[i].turns)
+			return false;
+	}
+	return true;
+}
+
+/* Assign all the hash buckets of the specified table with the service.
+ * Nothing is done when the table would come out the same, as when a dest
+ * goes to weight 0 and back: last_weight, the weight used here, keeps
+ * its value and the lookup skips the dest meanwhile.  Otherwise only the
+ * slots whose dest changes are written.
+ */
 static int ip_vs_mh_reassign(struct ip_vs_mh_state *s,
-			     struct ip_vs_service *svc)
+			     struct ip_vs_service *svc, bool save_prev)
 {
+	struct ip_vs_mh_dest_setup *ds = NULL;
 	int ret;
 
-	if (svc->num_dests > IP_VS_MH_TAB_SIZE)
+	if (svc->num_dests > s->tab_size)
 		return -EINVAL;
 
 	if (svc->num_dests >= 1) {
-		s->dest_setup = kcalloc(svc->num_dests,
-					sizeof(struct ip_vs_mh_dest_setup),
-					GFP_KERNEL);
-		if (!s->dest_setup)
+		ds = kcalloc(svc->num_dests,
+			     sizeof(struct ip_vs_mh_dest_setup),
+			     GFP_KERNEL);
+		if (!ds)
 			return -ENOMEM;
 	}
 
-	ip_vs_mh_permutate(s, svc);
+	ip_vs_mh_permutate(s, svc, ds);
+
+	if (ip_vs_mh_setup_equal(s, ds, svc->num_dests)) {
+		kfree(ds);
+		return 0;
+	}
+
+	if (save_prev)
+		ip_vs_mh_save_prev(s, svc);
+
+	ret = ip_vs_mh_populate(s, svc, ds);
+	if (ret < 0) {
+		kfree(ds);
+		return ret;
+	}
 
-	ret = ip_vs_mh_populate(s, svc);
-	if (ret < 0)
-		goto out;
+	kfree(s->dest_setup);
+	s->dest_setup = ds;
+	s->dest_count = svc->num_dests;
 
 	IP_VS_DBG_BUF(6, "MH: reassign lookup table of %s:%u\n",
 		      IP_VS_DBG_ADDR(svc->af, &svc->addr),
 		      ntohs(svc->port));
-
-out:
-	if (svc->num_dests >= 1) {
-		kfree(s->dest_setup);
-		s->dest_setup = NULL;
-	}
-	return ret;
+	return 0;
 }
 
 static int ip_vs_mh_gcd_weight(struct ip_vs_service *svc)
@@ -340,7 +423,8 @@ static int ip_vs_mh_gcd_weight(struct ip_vs_service *svc)
 /* To avoid assigning huge weight for the MH table,
  * calculate shift value with gcd.
  */
-static int ip_vs_mh_shift_weight(struct ip_vs_service *svc, int gcd)
+static int ip_vs_mh_shift_weight(struct ip_vs_mh_state *s,
+				 struct ip_vs_service *svc, int gcd)
 {
 	struct ip_vs_dest *dest;
 	int new_weight, weight = 0;
@@ -365,7 +449,7 @@ static int ip_vs_mh_shift_weight(struct ip_vs_service *svc, int gcd)
 	mw = weight / gcd;
 
 	/* shift = occupied bits of weight/gcd - MH highest bits */
-	shift = fls(mw) - IP_VS_MH_TAB_BITS;
+	shift = fls(mw) - s->tab_bits;
 	return (shift >= 0) ? shift : 0;
 }
 
@@ -374,13 +458,14 @@ static void ip_vs_mh_state_free(struct rcu_head *head)
 	struct ip_vs_mh_state *s;
 
 	s = container_of(head, struct ip_vs_mh_state, rcu_head);
-	kfree(s->lookup);
+	kfree(s->dest_setup);
+	kvfree(s->lookup);
 	kfree(s);
 }
 
 static int ip_vs_mh_init_svc(struct ip_vs_service *svc)
 {
-	int ret;
+	int ret, idx;
 	struct ip_vs_mh_state *s;
 
 	/* Allocate the MH table for this service */
@@ -388,8 +473,12 @@ static int ip_vs_mh_init_svc(struct ip_vs_service *svc)
 	if (!s)
 		return -ENOMEM;
 
-	s->lookup = kcalloc(IP_VS_MH_TAB_SIZE, sizeof(struct ip_vs_mh_lookup),
-			    GFP_KERNEL);
+	/* The size of new services follows the mh_tab_index sysctl */
+	idx = sysctl_mh_tab_index(svc->ipvs);
+	s->tab_size = primes[idx - IP_VS_MH_TAB_INDEX_MIN];
+	s->tab_bits = idx / 2;
+	s->lookup = kvcalloc(s->tab_size, sizeof(struct ip_vs_mh_lookup),
+			     GFP_KERNEL);
 	if (!s->lookup) {
 		kfree(s);
 		return -ENOMEM;
@@ -397,14 +486,14 @@ static int ip_vs_mh_init_svc(struct ip_vs_service *svc)
 
 	generate_hash_secret(&s->hash1, &s->hash2);
 	s->gcd = ip_vs_mh_gcd_weight(svc);
-	s->rshift = ip_vs_mh_shift_weight(svc, s->gcd);
+	s->rshift = ip_vs_mh_shift_weight(s, svc, s->gcd);
 
 	IP_VS_DBG(6,
 		  "MH lookup table (memory=%zdbytes) allocated for current service\n",
-		  sizeof(struct ip_vs_mh_lookup) * IP_VS_MH_TAB_SIZE);
+		  sizeof(struct ip_vs_mh_lookup) * s->tab_size);
 
 	/* Assign the lookup table with current dests */
-	ret = ip_vs_mh_reassign(s, svc);
+	ret = ip_vs_mh_reassign(s, svc, false);
 	if (ret < 0) {
 		ip_vs_mh_reset(s);
 		ip_vs_mh_state_free(&s->rcu_head);
@@ -419,13 +508,16 @@ static int ip_vs_mh_init_svc(struct ip_vs_service *svc)
 static void ip_vs_mh_done_svc(struct ip_vs_service *svc)
 {
 	struct ip_vs_mh_state *s = svc->sched_data;
+	struct ip_vs_mh_prev *prev = rcu_dereference_protected(s->prev, 1);
 
 	/* Got to clean up lookup entry here */
 	ip_vs_mh_reset(s);
+	if (prev)
+		ip_vs_mh_free_prev(s, prev);
 
 	call_rcu(&s->rcu_head, ip_vs_mh_state_free);
 	IP_VS_DBG(6, "MH lookup table (memory=%zdbytes) released\n",
-		  sizeof(struct ip_vs_mh_lookup) * IP_VS_MH_TAB_SIZE);
+		  sizeof(struct ip_vs_mh_lookup) * s->tab_size);
 }
 
 static int ip_vs_mh_dest_changed(struct ip_vs_service *svc,
@@ -434,10 +526,10 @@ static int ip_vs_mh_dest_changed(struct ip_vs_service *svc,
 	struct ip_vs_mh_state *s = svc->sched_data;
 
 	s->gcd = ip_vs_mh_gcd_weight(svc);
-	s->rshift = ip_vs_mh_shift_weight(svc, s->gcd);
+	s->rshift = ip_vs_mh_shift_weight(s, svc, s->gcd);
 
 	/* Assign the lookup table with the updated service */
-	return ip_vs_mh_reassign(s, svc);
+	return ip_vs_mh_reassign(s, svc, true);
 }
 
 /* Helper function to get port number */
@@ -507,6 +599,37 @@ ip_vs_mh_schedule(struct ip_vs_service *svc, const struct sk_buff *skb,
 	return dest;
 }
 
+/* Maglev Hashing of a client network for persistent services */
+static struct ip_vs_dest *
+ip_vs_mh_persist_dest(struct ip_vs_service *svc,
+		      const union nf_inet_addr *snet, bool *stable)
+{
+	struct ip_vs_mh_state *s = svc->sched_data;
+	struct ip_vs_mh_prev *prev = rcu_dereference(s->prev);
+	struct ip_vs_dest *dest;
+	unsigned int hash;
+
+	*stable = !prev || time_after_eq(jiffies, prev->changed + svc->timeout);
+	if (!*stable) {
+		/* the client may have been sent to the old dest */
+		hash = ip_vs_mh_hashkey(svc->af, snet, 0, &s->hash1, 0) %
+		       s->tab_size;
+		dest = rcu_dereference(prev->lookup[hash].dest);
+		if (dest && !is_unavailable(dest) &&
+		    dest->flags & IP_VS_DEST_F_AVAILABLE)
+			return dest;
+	}
+
+	if (svc->flags & IP_VS_SVC_F_SCHED_MH_FALLBACK)
+		dest = ip_vs_mh_get_fallback(svc, s, snet, 0);
+	else
+		dest = ip_vs_mh_get(svc, s, snet, 0);
+
+	if (!dest)
+		ip_vs_scheduler_err(svc, "no destination available");
+	return dest;
+}
+
 /* IPVS MH Scheduler structure */
 static struct ip_vs_scheduler ip_vs_mh_scheduler = {
 	.name =			"mh",
@@ -519,10 +642,13 @@ static struct ip_vs_scheduler ip_vs_mh_scheduler = {
 	.del_dest =		ip_vs_mh_dest_changed,
 	.upd_dest =		ip_vs_mh_dest_changed,
 	.schedule =		ip_vs_mh_schedule,
+	.persist_dest =		ip_vs_mh_persist_dest,
 };
 
 static int __init ip_vs_mh_init(void)
 {
+	BUILD_BUG_ON(ARRAY_SIZE(primes) !=
+		     IP_VS_MH_TAB_INDEX_MAX - IP_VS_MH_TAB_INDEX_MIN + 1);
 	return register_ip_vs_scheduler(&ip_vs_mh_scheduler);
 }
 
@@ -65,8 +65,16 @@ struct ip_vs_sh_bucket {
 #define IP_VS_SH_TAB_SIZE               (1 << IP_VS_SH_TAB_BITS)
 #define IP_VS_SH_TAB_MASK               (IP_VS_SH_TAB_SIZE - 1)
 
+/* Hash table as it was before the last change of the dests */
+struct ip_vs_sh_prev {
+	struct rcu_head			rcu_head;
+	unsigned long			changed;	/* jiffies */
+	struct ip_vs_sh_bucket		buckets[IP_VS_SH_TAB_SIZE];
+};
+
 struct ip_vs_sh_state {
 	struct rcu_head			rcu_head;
+	struct ip_vs_sh_prev __rcu	*prev;
 	struct ip_vs_sh_bucket		buckets[IP_VS_SH_TAB_SIZE];
 };
 
@@ -225,6 +233,51 @@ static void ip_vs_sh_flush(struct ip_vs_sh_state *s)
 }
 
 
+static void ip_vs_sh_free_prev(struct ip_vs_sh_prev *prev)
+{
+	struct ip_vs_dest *dest;
+	int i;
+
+	for (i = 0; i < IP_VS_SH_TAB_SIZE; i++) {
+		dest = rcu_dereference_protected(prev->buckets[i].dest, 1);
+		if (dest)
+			ip_vs_dest_put(dest);
+	}
+	kfree_rcu(prev, rcu_head);
+}
+
+/*
+ *      Remember the hash table before it changes, persistent services
+ *      keep their clients on the old dests for a persistence timeout.
+ */
+static void ip_vs_sh_save_prev(struct ip_vs_sh_state *s,
+			       struct ip_vs_service *svc)
+{
+	struct ip_vs_sh_prev *prev, *old;
+	struct ip_vs_dest *dest;
+	int i;
+
+	prev = NULL;
+	if (svc->flags & IP_VS_SVC_F_PERSISTENT &&
+	    sysctl_persist_stateless(svc->ipvs))
+		prev = kmalloc(sizeof(*prev), GFP_KERNEL);
+	if (prev) {
+		prev->changed = jiffies;
+		for (i = 0; i < IP_VS_SH_TAB_SIZE; i++) {
+			dest = rcu_dereference_protected(s->buckets[i].dest, 1);
+			if (dest)
+				ip_vs_dest_hold(dest);
+			RCU_INIT_POINTER(prev->buckets[i].dest, dest);
+		}
+	}
+
+	old = rcu_dereference_protected(s->prev, 1);
+	rcu_assign_pointer(s->prev, prev);
+	if (old)
+		ip_vs_sh_free_prev(old);
+}
+
+
 static int ip_vs_sh_init_svc(struct ip_vs_service *svc)
 {
 	struct ip_vs_sh_state *s;
@@ -249,9 +302,12 @@ static int ip_vs_sh_init_svc(struct ip_vs_service *svc)
 static void ip_vs_sh_done_svc(struct ip_vs_service *svc)
 {
 	struct ip_vs_sh_state *s = svc->sched_data;
+	struct ip_vs_sh_prev *prev = rcu_dereference_protected(s->prev, 1);
 
 	/* got to clean up hash buckets here */
 	ip_vs_sh_flush(s);
+	if (prev)
+		ip_vs_sh_free_prev(prev);
 
 	/* release the table itself */
 	kfree_rcu(s, rcu_head);
@@ -265,6 +321,8 @@ static int ip_vs_sh_dest_changed(struct ip_vs_service *svc,
 {
 	struct ip_vs_sh_state *s = svc->sched_data;
 
+	ip_vs_sh_save_prev(s, svc);
+
 	/* assign the hash buckets with the updated service */
 	ip_vs_sh_reassign(s, svc);
 
@@ -342,6 +400,39 @@ ip_vs_sh_schedule(struct ip_vs_service *svc, const struct sk_buff *skb,
 }
 
 
+/*
+ *      Source Hashing of a client network for persistent services
+ */
+static struct ip_vs_dest *
+ip_vs_sh_persist_dest(struct ip_vs_service *svc,
+		      const union nf_inet_addr *snet, bool *stable)
+{
+	struct ip_vs_sh_state *s = svc->sched_data;
+	struct ip_vs_sh_prev *prev = rcu_dereference(s->prev);
+	struct ip_vs_dest *dest;
+	unsigned int hash;
+
+	*stable = !prev || time_after_eq(jiffies, prev->changed + svc->timeout);
+	if (!*stable) {
+		/* the client may have been sent to the old dest */
+		hash = ip_vs_sh_hashkey(svc->af, snet, 0, 0);
+		dest = rcu_dereference(prev->buckets[hash].dest);
+		if (dest && !is_unavailable(dest) &&
+		    dest->flags & IP_VS_DEST_F_AVAILABLE)
+			return dest;
+	}
+
+	if (svc->flags & IP_VS_SVC_F_SCHED_SH_FALLBACK)
+		dest = ip_vs_sh_get_fallback(svc, s, snet, 0);
+	else
+		dest = ip_vs_sh_get(svc, s, snet, 0);
+
+	if (!dest)
+		ip_vs_scheduler_err(svc, "no destination available");
+	return dest;
+}
+
+
 /*
  *      IPVS SH Scheduler structure
  */
@@ -357,6 +448,7 @@ static struct ip_vs_scheduler ip_vs_sh_scheduler =
 	.del_dest =		ip_vs_sh_dest_changed,
 	.upd_dest =		ip_vs_sh_dest_changed,
 	.schedule =		ip_vs_sh_schedule,
+	.persist_dest =		ip_vs_sh_persist_dest,
 };
 
 
@@ -45,11 +45,13 @@
 #include <linux/in.h>
 #include <linux/igmp.h>                 /* for ip_mc_join_group */
 #include <linux/udp.h>
+#include <linux/tcp.h>
 #include <linux/err.h>
 #include <linux/kthread.h>
 #include <linux/wait.h>
 #include <linux/kernel.h>
 #include <linux/sched/signal.h>
+#include <linux/jhash.h>
 
 #include <linux/unaligned.h>		/* Used for ntoh_seq and hton_seq */
 
@@ -63,6 +65,9 @@
 
 #define SYNC_PROTO_VER  1		/* Protocol version in header */
 
+/* Default message size over TCP, nr_conns limits it to 255 entries */
+#define IPVS_SYNC_TCP_MAXLEN	16384
+
 static struct lock_class_key __ipvs_sync_key;
 /*
  *	IPVS sync connection entry
@@ -200,8 +205,37 @@ struct ip_vs_sync_thread_data {
 	struct socket *sock;
 	char *buf;
 	int id;
+	int ifindex;
+};
+
+/* Received message, shared by the batches of its entries */
+struct ip_vs_sync_rmsg {
+	refcount_t		refcnt;
+	__u8			data[];
+};
+
+/* Entries of one message for one worker, in the order they came */
+struct ip_vs_sync_batch {
+	struct list_head	list;
+	struct ip_vs_sync_rmsg	*rmsg;
+	int			nr;
+	__u16			off[];		/* entry offsets in rmsg */
+};
+
+/* Backup worker, applies the entries of the clients hashed to it */
+struct ip_vs_sync_worker {
+	struct task_struct	*task;
+	struct netns_ipvs	*ipvs;
+	spinlock_t		lock;		/* protects queue */
+	struct list_head	queue;
+	int			queue_len;
+	wait_queue_head_t	wait;		/* for batches */
+	wait_queue_head_t	wait_space;	/* for room in queue */
 };
 
+/* Batches queued to a worker before the receiver waits */
+#define IPVS_SYNC_WORKER_QLEN	64
+
 /* Version 0 definition of packet sizes */
 #define SIMPLE_CONN_SIZE  (sizeof(struct ip_vs_sync_conn_v0))
 #define FULL_CONN_SIZE  \
@@ -448,6 +482,33 @@ static inline bool in_persistence(struct ip_vs_conn *cp)
 	return false;
 }
 
+/* Token bucket of sync_rate_limit entries per second, holding one second
+ * of them.  Credit is kept in 1/HZ entries.
+ */
+static bool ip_vs_sync_rate_ok(struct netns_ipvs *ipvs)
+{
+	int rate = sysctl_sync_rate_limit(ipvs);
+	unsigned long now, elapsed;
+	bool ok;
+
+	if (!rate)
+		return true;
+
+	spin_lock_bh(&ipvs->sync_rate_lock);
+	now = jiffies;
+	elapsed = min_t(unsigned long, now - ipvs->sync_rate_stamp, HZ);
+	ipvs->sync_rate_stamp = now;
+	ipvs->sync_rate_credit = min_t(u64,
+				       ipvs->sync_rate_credit +
+				       (u64)elapsed * rate,
+				       (u64)HZ * rate);
+	ok = ipvs->sync_rate_credit >= HZ;
+	if (ok)
+		ipvs->sync_rate_credit -= HZ;
+	spin_unlock_bh(&ipvs->sync_rate_lock);
+	return ok;
+}
+
 /* Check if conn should be synced.
  * pkts: conn packets, use sysctl_sync_threshold to avoid packet check
  * - (1) sync_refresh_period: reduce sync rate. Additionally, retry
@@ -456,6 +517,10 @@ static inline bool in_persistence(struct ip_vs_conn *cp)
  *	for state changes or only once when pkts matches sync_threshold
  * - (3) templates: rate can be reduced only with sync_refresh_period or
  *	with (2)
+ * - (4) sync_rate_limit bounds the rate of the syncs left by (1) and (2),
+ *	including the move to established of new conns.  Other state
+ *	changes are always sent.  A conn that is held back is synced when a
+ *	later packet qualifies again, old_state is left as it was for that.
  */
 static int ip_vs_sync_conn_needed(struct netns_ipvs *ipvs,
 				  struct ip_vs_conn *cp, int pkts)
@@ -527,6 +592,9 @@ static int ip_vs_sync_conn_needed(struct netns_ipvs *ipvs,
 		   pkts != sysctl_sync_threshold(ipvs))
 		return 0;
 
+	if (!ip_vs_sync_rate_ok(ipvs))
+		return 0;
+
 set:
 	cp->old_state = cp->state;
 	n = cmpxchg(&cp->sync_endtime, orig, n);
@@ -569,8 +637,9 @@ static void ip_vs_sync_conn_v0(struct netns_ipvs *ipvs, struct ip_vs_conn *cp,
 		SIMPLE_CONN_SIZE;
 	if (buff) {
 		m = (struct ip_vs_sync_mesg_v0 *) buff->mesg;
-		/* Send buffer if it is for v1 */
-		if (buff->head + len > buff->end || !m->nr_conns) {
+		/* Send buffer if it is for v1 or if it is full */
+		if (buff->head + len > buff->end || !m->nr_conns ||
+		    m->nr_conns == U8_MAX) {
 			sb_queue_tail(ipvs, ms);
 			ms->sync_buff = NULL;
 			buff = NULL;
@@ -689,8 +758,9 @@ void ip_vs_sync_conn(struct netns_ipvs *ipvs, struct ip_vs_conn *cp, int pkts)
 	if (buff) {
 		m = buff->mesg;
 		pad = (4 - (size_t) buff->head) & 3;
-		/* Send buffer if it is for v0 */
-		if (buff->head + len + pad > buff->end || m->reserved) {
+		/* Send buffer if it is for v0 or if it is full */
+		if (buff->head + len + pad > buff->end || m->reserved ||
+		    m->nr_conns == U8_MAX) {
 			sb_queue_tail(ipvs, ms);
 			ms->sync_buff = NULL;
 			buff = NULL;
@@ -1196,6 +1266,181 @@ static inline int ip_vs_proc_sync_conn(struct netns_ipvs *ipvs, __u8 *p, __u8 *m
 	return retc;
 
 }
+static void ip_vs_sync_rmsg_put(struct ip_vs_sync_rmsg *rmsg)
+{
+	if (refcount_dec_and_test(&rmsg->refcnt))
+		kfree(rmsg);
+}
+
+static void ip_vs_sync_batch_free(struct ip_vs_sync_batch *b)
+{
+	ip_vs_sync_rmsg_put(b->rmsg);
+	kfree(b);
+}
+
+/* All the entries of a client go to the same worker, so that they are
+ * applied in order, templates before their connections.
+ */
+static struct ip_vs_sync_worker *
+ip_vs_sync_select_worker(struct netns_ipvs *ipvs, union ip_vs_sync_conn *s,
+			 unsigned int size)
+{
+	u32 hash;
+
+	if (s->v6.type & STYPE_F_INET6) {
+		if (size < sizeof(s->v6))
+			return &ipvs->backup_workers[0];
+		hash = jhash(&s->v6.caddr, sizeof(s->v6.caddr), 0);
+	} else {
+		hash = jhash_1word((__force u32)s->v4.caddr, 0);
+	}
+	return &ipvs->backup_workers[reciprocal_scale(hash,
+						      ipvs->backup_workers_cnt)];
+}
+
+/* Add an entry to the batch of its worker, false if it can't be */
+static bool ip_vs_sync_batch_add(struct netns_ipvs *ipvs,
+				 struct ip_vs_sync_batch **batch,
+				 struct ip_vs_sync_rmsg *rmsg, int nr_conns,
+				 __u8 *p, unsigned int size)
+{
+	struct ip_vs_sync_worker *w;
+	struct ip_vs_sync_batch *b;
+
+	w = ip_vs_sync_select_worker(ipvs, (union ip_vs_sync_conn *)p, size);
+	b = batch[w - ipvs->backup_workers];
+	if (!b) {
+		b = kmalloc(struct_size(b, off, nr_conns), GFP_KERNEL);
+		if (!b)
+			return false;
+		refcount_inc(&rmsg->refcnt);
+		b->rmsg = rmsg;
+		b->nr = 0;
+		batch[w - ipvs->backup_workers] = b;
+	}
+	b->off[b->nr++] = p - rmsg->data;
+	return true;
+}
+
+static void ip_vs_sync_batch_queue(struct ip_vs_sync_worker *w,
+				   struct ip_vs_sync_batch *b)
+{
+	/* Hold the receiver back when the worker is behind */
+	wait_event_interruptible(w->wait_space,
+				 READ_ONCE(w->queue_len) < IPVS_SYNC_WORKER_QLEN ||
+				 kthread_should_stop());
+	if (unlikely(kthread_should_stop())) {
+		ip_vs_sync_batch_free(b);
+		return;
+	}
+
+	spin_lock(&w->lock);
+	list_add_tail(&b->list, &w->queue);
+	WRITE_ONCE(w->queue_len, w->queue_len + 1);
+	spin_unlock(&w->lock);
+	wake_up(&w->wait);
+}
+
+static struct ip_vs_sync_batch *
+ip_vs_sync_batch_dequeue(struct ip_vs_sync_worker *w)
+{
+	struct ip_vs_sync_batch *b;
+
+	spin_lock(&w->lock);
+	b = list_first_entry_or_null(&w->queue, struct ip_vs_sync_batch,
+				     list);
+	if (b) {
+		list_del(&b->list);
+		WRITE_ONCE(w->queue_len, w->queue_len - 1);
+	}
+	spin_unlock(&w->lock);
+	if (b)
+		wake_up(&w->wait_space);
+	return b;
+}
+
+static int sync_thread_worker(void *data)
+{
+	struct ip_vs_sync_worker *w = data;
+	union ip_vs_sync_conn *s;
+	struct ip_vs_sync_batch *b;
+	unsigned int size;
+	int i, retc;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(w->wait,
+					 READ_ONCE(w->queue_len) ||
+					 kthread_should_stop());
+
+		while ((b = ip_vs_sync_batch_dequeue(w))) {
+			/* Checked by the receiver, except the decoding */
+			for (i = 0; i < b->nr; i++) {
+				s = (union ip_vs_sync_conn *)
+				    (b->rmsg->data + b->off[i]);
+				size = ntohs(s->v4.ver_size) & SVER_MASK;
+				retc = ip_vs_proc_sync_conn(w->ipvs, (__u8 *)s,
+							    (__u8 *)s + size);
+				if (retc < 0)
+					IP_VS_ERR_RL("BACKUP, Dropping entry, Err: %d in decoding\n",
+						     retc);
+			}
+			ip_vs_sync_batch_free(b);
+			cond_resched();
+		}
+	}
+
+	while ((b = ip_vs_sync_batch_dequeue(w)))
+		ip_vs_sync_batch_free(b);
+	return 0;
+}
+
+static void ip_vs_sync_workers_stop(struct netns_ipvs *ipvs)
+{
+	struct ip_vs_sync_worker *w;
+	int id;
+
+	for (id = 0; id < ipvs->backup_workers_cnt; id++) {
+		w = &ipvs->backup_workers[id];
+		if (w->task)
+			kthread_stop(w->task);
+	}
+	kfree(ipvs->backup_workers);
+	ipvs->backup_workers = NULL;
+	ipvs->backup_workers_cnt = 0;
+}
+
+static int ip_vs_sync_workers_start(struct netns_ipvs *ipvs)
+{
+	int count = clamp(sysctl_sync_workers(ipvs), 0, IPVS_SYNC_WORKERS_MAX);
+	struct ip_vs_sync_worker *w;
+	struct task_struct *task;
+	int id;
+
+	if (!count)
+		return 0;
+	ipvs->backup_workers = kcalloc(count, sizeof(*w), GFP_KERNEL);
+	if (!ipvs->backup_workers)
+		return -ENOMEM;
+	ipvs->backup_workers_cnt = count;
+
+	for (id = 0; id < count; id++) {
+		w = &ipvs->backup_workers[id];
+		w->ipvs = ipvs;
+		spin_lock_init(&w->lock);
+		INIT_LIST_HEAD(&w->queue);
+		init_waitqueue_head(&w->wait);
+		init_waitqueue_head(&w->wait_space);
+		task = kthread_run(sync_thread_worker, w, "ipvs-w:%d:%d",
+				   ipvs->gen, id);
+		if (IS_ERR(task)) {
+			ip_vs_sync_workers_stop(ipvs);
+			return PTR_ERR(task);
+		}
+		w->task = task;
+	}
+	return 0;
+}
+
 /*
  *      Process received multicast message and create the corresponding
  *      ip_vs_conn entries.
@@ -1205,6 +1450,8 @@ static void ip_vs_process_message(struct netns_ipvs *ipvs, __u8 *buffer,
 				  const size_t buflen)
 {
 	struct ip_vs_sync_mesg *m2 = (struct ip_vs_sync_mesg *)buffer;
+	struct ip_vs_sync_batch *batch[IPVS_SYNC_WORKERS_MAX] = {};
+	struct ip_vs_sync_rmsg *rmsg = NULL;
 	__u8 *p, *msg_end;
 	int i, nr_conns;
 
@@ -1226,8 +1473,23 @@ static void ip_vs_process_message(struct netns_ipvs *ipvs, __u8 *buffer,
 	if ((m2->version == SYNC_PROTO_VER) && (m2->reserved == 0)
 	    && (m2->spare == 0)) {
 
-		msg_end = buffer + sizeof(struct ip_vs_sync_mesg);
 		nr_conns = m2->nr_conns;
+		/* Leave the entries to the workers, from a copy as the
+		 * buffer is reused for the next message.  Without memory,
+		 * the message is dropped: applying entries here would
+		 * overtake those of the same clients still queued.
+		 */
+		if (ipvs->backup_workers_cnt) {
+			rmsg = kmalloc(sizeof(*rmsg) + buflen, GFP_KERNEL);
+			if (!rmsg) {
+				IP_VS_ERR_RL("BACKUP, Dropping buffer, no memory\n");
+				return;
+			}
+			refcount_set(&rmsg->refcnt, 1);
+			memcpy(rmsg->data, buffer, buflen);
+			buffer = rmsg->data;
+		}
+		msg_end = buffer + sizeof(struct ip_vs_sync_mesg);
 
 		for (i=0; i<nr_conns; i++) {
 			union ip_vs_sync_conn *s;
@@ -1237,7 +1499,7 @@ static void ip_vs_process_message(struct netns_ipvs *ipvs, __u8 *buffer,
 			p = msg_end;
 			if (p + sizeof(s->v4) > buffer+buflen) {
 				IP_VS_ERR_RL("BACKUP, Dropping buffer, too small\n");
-				return;
+				break;
 			}
 			s = (union ip_vs_sync_conn *)p;
 			size = ntohs(s->v4.ver_size) & SVER_MASK;
@@ -1245,23 +1507,40 @@ static void ip_vs_process_message(struct netns_ipvs *ipvs, __u8 *buffer,
 			/* Basic sanity checks */
 			if (msg_end  > buffer+buflen) {
 				IP_VS_ERR_RL("BACKUP, Dropping buffer, msg > buffer\n");
-				return;
+				break;
 			}
 			if (ntohs(s->v4.ver_size) >> SVER_SHIFT) {
 				IP_VS_ERR_RL("BACKUP, Dropping buffer, Unknown version %d\n",
 					      ntohs(s->v4.ver_size) >> SVER_SHIFT);
-				return;
+				break;
 			}
-			/* Process a single sync_conn */
-			retc = ip_vs_proc_sync_conn(ipvs, p, msg_end);
-			if (retc < 0) {
-				IP_VS_ERR_RL("BACKUP, Dropping buffer, Err: %d in decoding\n",
-					     retc);
-				return;
+			if (rmsg) {
+				if (!ip_vs_sync_batch_add(ipvs, batch, rmsg,
+							  nr_conns, p, size)) {
+					IP_VS_ERR_RL("BACKUP, Dropping buffer, no memory\n");
+					break;
+				}
+			} else {
+				/* Process a single sync_conn */
+				retc = ip_vs_proc_sync_conn(ipvs, p, msg_end);
+				if (retc < 0) {
+					IP_VS_ERR_RL("BACKUP, Dropping buffer, Err: %d in decoding\n",
+						     retc);
+					break;
+				}
 			}
 			/* Make sure we have 32 bit alignment */
 			msg_end = p + ((size + 3) & ~3);
 		}
+
+		if (rmsg) {
+			for (i = 0; i < ipvs->backup_workers_cnt; i++) {
+				if (batch[i])
+					ip_vs_sync_batch_queue(&ipvs->backup_workers[i],
+							       batch[i]);
+			}
+			ip_vs_sync_rmsg_put(rmsg);
+		}
 	} else {
 		/* Old type of message */
 		ip_vs_process_message_v0(ipvs, buffer, buflen);
@@ -1568,6 +1847,83 @@ static int make_receive_sock(struct netns_ipvs *ipvs, int id,
 	return result;
 }
 
+/*
+ *      Set up sending socket over TCP, connected to the backup
+ */
+static int make_send_sock_tcp(struct netns_ipvs *ipvs,
+			      struct ip_vs_sync_thread_data *tinfo,
+			      struct socket **sock_ret)
+{
+	union ipvs_sockaddr addr;
+	struct socket *sock;
+	int result, salen;
+
+	result = sock_create_kern(ipvs->net, ipvs->mcfg.mcast_af, SOCK_STREAM,
+				  IPPROTO_TCP, &sock);
+	if (result < 0)
+		return result;
+
+	sock->sk->sk_bound_dev_if = tinfo->ifindex;
+	tcp_sock_set_nodelay(sock->sk);
+	/* Do not block the thread for long on a stuck backup */
+	sock->sk->sk_sndtimeo = IPVS_SYNC_CHECK_PERIOD;
+	result = sysctl_sync_sock_size(ipvs);
+	if (result > 0)
+		set_sock_size(sock->sk, 1, result);
+
+	get_mcast_sockaddr(&addr, &salen, &ipvs->mcfg, tinfo->id);
+	result = kernel_connect(sock, (struct sockaddr *)&addr, salen, 0);
+	if (result < 0) {
+		sock_release(sock);
+		return result;
+	}
+
+	*sock_ret = sock;
+	return 0;
+}
+
+/*
+ *      Set up listening socket over TCP, the master connects to it
+ */
+static int make_receive_sock_tcp(struct netns_ipvs *ipvs, int id,
+				 struct net_device *dev,
+				 struct socket **sock_ret)
+{
+	union ipvs_sockaddr addr;
+	struct socket *sock;
+	int result, salen;
+
+	result = sock_create_kern(ipvs->net, ipvs->bcfg.mcast_af, SOCK_STREAM,
+				  IPPROTO_TCP, &sock);
+	if (result < 0) {
+		pr_err("Error during creation of socket; terminating\n");
+		return result;
+	}
+	*sock_ret = sock;
+	sock->sk->sk_reuse = SK_CAN_REUSE;
+	/* Wake up every period to check whether we have to stop */
+	sock->sk->sk_rcvtimeo = IPVS_SYNC_CHECK_PERIOD;
+	result = sysctl_sync_sock_size(ipvs);
+	if (result > 0)
+		set_sock_size(sock->sk, 0, result);
+
+	get_mcast_sockaddr(&addr, &salen, &ipvs->bcfg, id);
+	sock->sk->sk_bound_dev_if = dev->ifindex;
+	result = kernel_bind(sock, (struct sockaddr *)&addr, salen);
+	if (result < 0) {
+		pr_err("Error binding to the sync addr\n");
+		return result;
+	}
+
+	result = kernel_listen(sock, 1);
+	if (result < 0) {
+		pr_err("Error listening on the sync addr\n");
+		return result;
+	}
+
+	return 0;
+}
+
 
 static int
 ip_vs_send_async(struct socket *sock, const char *buffer, const size_t length)
@@ -1599,6 +1955,58 @@ ip_vs_send_sync_msg(struct socket *sock, struct ip_vs_sync_mesg *msg)
 	return 0;
 }
 
+/* Send a whole message over TCP, (re)connecting to the backup when needed.
+ * Fails only when the thread has to stop.
+ */
+static int
+ip_vs_send_sync_stream(struct ip_vs_sync_thread_data *tinfo,
+		       struct ip_vs_sync_mesg *msg)
+{
+	int msize = ntohs(msg->size);
+	struct kvec iov;
+	int sent, ret;
+
+	for (;;) {
+		if (unlikely(kthread_should_stop()))
+			return -EINTR;
+		if (!tinfo->sock) {
+			ret = make_send_sock_tcp(tinfo->ipvs, tinfo,
+						 &tinfo->sock);
+			if (ret < 0) {
+				IP_VS_DBG(1, "sync connection failed: %d\n",
+					  ret);
+				/* (Ab)use interruptible sleep to avoid
+				 * increasing the load avg.
+				 */
+				schedule_timeout_interruptible(IPVS_SYNC_CHECK_PERIOD);
+				continue;
+			}
+		}
+
+		for (sent = 0; sent < msize; sent += ret) {
+			struct msghdr m = {.msg_flags = MSG_NOSIGNAL};
+
+			iov.iov_base = (char *)msg + sent;
+			iov.iov_len = msize - sent;
+			ret = kernel_sendmsg(tinfo->sock, &m, &iov, 1,
+					     iov.iov_len);
+			if (ret == -EAGAIN && !kthread_should_stop())
+				ret = 0;
+			else if (ret < 0)
+				break;
+		}
+		if (sent == msize)
+			return 0;
+
+		/* A partial message can not be resumed on a new connection,
+		 * the backup drops its part with the old one.
+		 */
+		IP_VS_DBG(1, "sync connection lost: %d\n", ret);
+		sock_release(tinfo->sock);
+		tinfo->sock = NULL;
+	}
+}
+
 static int
 ip_vs_receive(struct socket *sock, char *buffer, const size_t buflen)
 {
@@ -1615,6 +2023,37 @@ ip_vs_receive(struct socket *sock, char *buffer, const size_t buflen)
 	return len;
 }
 
+/* Read exactly buflen bytes from the TCP stream.  -EAGAIN is returned only
+ * when nothing was read and the message has not started yet.
+ */
+static int
+ip_vs_receive_stream(struct socket *sock, char *buffer, const size_t buflen,
+		     bool start)
+{
+	size_t done = 0;
+	int len;
+
+	while (done < buflen) {
+		struct msghdr msg = {NULL,};
+		struct kvec iov = {buffer + done, buflen - done};
+
+		iov_iter_kvec(&msg.msg_iter, ITER_DEST, &iov, 1, buflen - done);
+		len = sock_recvmsg(sock, &msg, MSG_WAITALL);
+		if (len == -EAGAIN && (!start || done)) {
+			if (kthread_should_stop())
+				return -EINTR;
+			continue;
+		}
+		if (len < 0)
+			return len;
+		if (!len)
+			return -ECONNRESET;
+		done += len;
+	}
+
+	return done;
+}
+
 /* Wakeup the master thread for sending */
 static void master_wakeup_work_handler(struct work_struct *work)
 {
@@ -1652,12 +2091,13 @@ static int sync_thread_master(void *data)
 	struct ip_vs_sync_thread_data *tinfo = data;
 	struct netns_ipvs *ipvs = tinfo->ipvs;
 	struct ipvs_master_sync_state *ms = &ipvs->ms[tinfo->id];
-	struct sock *sk = tinfo->sock->sk;
 	struct ip_vs_sync_buff *sb;
+	struct sock *sk;
 
 	pr_info("sync thread started: state = MASTER, mcast_ifn = %s, "
-		"syncid = %d, id = %d\n",
-		ipvs->mcfg.mcast_ifn, ipvs->mcfg.syncid, tinfo->id);
+		"syncid = %d, id = %d%s\n",
+		ipvs->mcfg.mcast_ifn, ipvs->mcfg.syncid, tinfo->id,
+		ipvs->mcfg.sync_tcp ? ", tcp" : "");
 
 	for (;;) {
 		sb = next_sync_buff(ipvs, ms);
@@ -1667,6 +2107,13 @@ static int sync_thread_master(void *data)
 			schedule_timeout(IPVS_SYNC_CHECK_PERIOD);
 			continue;
 		}
+		if (ipvs->mcfg.sync_tcp) {
+			if (ip_vs_send_sync_stream(tinfo, sb->mesg) < 0)
+				goto done;
+			ip_vs_sync_buff_release(sb);
+			continue;
+		}
+		sk = tinfo->sock->sk;
 		while (ip_vs_send_sync_msg(tinfo->sock, sb->mesg) < 0) {
 			/* (Ab)use interruptible sleep to avoid increasing
 			 * the load avg.
@@ -1735,6 +2182,86 @@ static int sync_thread_backup(void *data)
 	return 0;
 }
 
+/* Connections from anything but the configured master are refused */
+static bool ip_vs_sync_peer_allowed(struct netns_ipvs *ipvs,
+				    struct socket *sock)
+{
+	union ipvs_sockaddr addr;
+
+	if (kernel_getpeername(sock, (struct sockaddr *)&addr) < 0)
+		return false;
+
+#ifdef CONFIG_IP_VS_IPV6
+	if (ipvs->bcfg.mcast_af == AF_INET6)
+		return ipv6_addr_equal(&addr.in6.sin6_addr,
+				       &ipvs->bcfg.sync_peer.in6);
+#endif
+	return addr.in.sin_addr.s_addr == ipvs->bcfg.sync_peer.ip;
+}
+
+static int sync_thread_backup_tcp(void *data)
+{
+	const int hlen = sizeof(struct ip_vs_sync_mesg_v0);
+	struct ip_vs_sync_thread_data *tinfo = data;
+	struct netns_ipvs *ipvs = tinfo->ipvs;
+	struct socket *csock = NULL, *nsock;
+	int len, size = 0;
+
+	pr_info("sync thread started: state = BACKUP, mcast_ifn = %s, "
+		"syncid = %d, id = %d, tcp\n",
+		ipvs->bcfg.mcast_ifn, ipvs->bcfg.syncid, tinfo->id);
+
+	while (!kthread_should_stop()) {
+		/* A new connection, from a restarted master, replaces the
+		 * current one.  Wait for one only when there is none.
+		 */
+		if (!kernel_accept(tinfo->sock, &nsock,
+				   csock ? O_NONBLOCK : 0)) {
+			if (!ip_vs_sync_peer_allowed(ipvs, nsock)) {
+				pr_warn_ratelimited("sync connection from an unexpected peer refused\n");
+				sock_release(nsock);
+			} else {
+				if (csock)
+					sock_release(csock);
+				csock = nsock;
+				csock->sk->sk_rcvtimeo = IPVS_SYNC_CHECK_PERIOD;
+			}
+		}
+		if (!csock)
+			continue;
+
+		/* Messages are framed by the size in their header, at the
+		 * same place in both versions.
+		 */
+		len = ip_vs_receive_stream(csock, tinfo->buf, hlen, true);
+		if (len == -EAGAIN)
+			continue;
+		if (len >= 0) {
+			size = ntohs(((struct ip_vs_sync_mesg_v0 *)
+				      tinfo->buf)->size);
+			if (size < hlen || size > ipvs->bcfg.sync_maxlen)
+				len = -EPROTO;
+			else if (size > hlen)
+				len = ip_vs_receive_stream(csock,
+							   tinfo->buf + hlen,
+							   size - hlen, false);
+		}
+		if (len < 0) {
+			if (len != -EINTR && len != -ECONNRESET)
+				pr_err("receiving message error %d\n", len);
+			sock_release(csock);
+			csock = NULL;
+			continue;
+		}
+
+		ip_vs_process_message(ipvs, tinfo->buf, size);
+	}
+
+	if (csock)
+		sock_release(csock);
+	return 0;
+}
+
 
 int start_sync_thread(struct netns_ipvs *ipvs, struct ipvs_sync_daemon_cfg *c,
 		      int state)
@@ -1774,7 +2301,18 @@ int start_sync_thread(struct netns_ipvs *ipvs, struct ipvs_sync_daemon_cfg *c,
 	} else
 		count = ipvs->threads_mask + 1;
 
-	if (c->mcast_af == AF_UNSPEC) {
+	if (c->sync_tcp) {
+		/* The master has to know where the backup is, the backup
+		 * listens on that address only and accepts a single master.
+		 * The peer is zero-filled past an IPv4 address.
+		 */
+		result = -EINVAL;
+		if (c->mcast_af == AF_UNSPEC)
+			goto out_early;
+		if (state == IP_VS_STATE_BACKUP &&
+		    ipv6_addr_any(&c->sync_peer.in6))
+			goto out_early;
+	} else if (c->mcast_af == AF_UNSPEC) {
 		c->mcast_af = AF_INET;
 		c->mcast_group.ip = cpu_to_be32(IP_VS_SYNC_GROUP);
 	}
@@ -1789,12 +2327,20 @@ int start_sync_thread(struct netns_ipvs *ipvs, struct ipvs_sync_daemon_cfg *c,
 		result = -ENODEV;
 		goto out_early;
 	}
-	hlen = (AF_INET6 == c->mcast_af) ?
-	       sizeof(struct ipv6hdr) + sizeof(struct udphdr) :
-	       sizeof(struct iphdr) + sizeof(struct udphdr);
-	mtu = (state == IP_VS_STATE_BACKUP) ?
-		  clamp(dev->mtu, 1500U, 65535U) : 1500U;
-	min_mtu = (state == IP_VS_STATE_BACKUP) ? 1024 : 1;
+	if (c->sync_tcp) {
+		/* No datagram to fit in, the backup accepts any size */
+		hlen = 0;
+		mtu = (state == IP_VS_STATE_BACKUP) ?
+			  65535U : IPVS_SYNC_TCP_MAXLEN;
+		min_mtu = (state == IP_VS_STATE_BACKUP) ? 65535 : 1;
+	} else {
+		hlen = (AF_INET6 == c->mcast_af) ?
+		       sizeof(struct ipv6hdr) + sizeof(struct udphdr) :
+		       sizeof(struct iphdr) + sizeof(struct udphdr);
+		mtu = (state == IP_VS_STATE_BACKUP) ?
+			  clamp(dev->mtu, 1500U, 65535U) : 1500U;
+		min_mtu = (state == IP_VS_STATE_BACKUP) ? 1024 : 1;
+	}
 
 	if (c->sync_maxlen)
 		c->sync_maxlen = clamp_t(unsigned int,
@@ -1818,7 +2364,8 @@ int start_sync_thread(struct netns_ipvs *ipvs, struct ipvs_sync_daemon_cfg *c,
 
 		ipvs->bcfg = *c;
 		name = "ipvs-b:%d:%d";
-		threadfn = sync_thread_backup;
+		threadfn = c->sync_tcp ? sync_thread_backup_tcp :
+					 sync_thread_backup;
 	} else {
 		result = -EINVAL;
 		goto out_early;
@@ -1841,6 +2388,11 @@ int start_sync_thread(struct netns_ipvs *ipvs, struct ipvs_sync_daemon_cfg *c,
 			ms->ipvs = ipvs;
 		}
 	}
+	if (state == IP_VS_STATE_BACKUP) {
+		result = ip_vs_sync_workers_start(ipvs);
+		if (result < 0)
+			goto out;
+	}
 	result = -ENOMEM;
 	ti = kcalloc(count, sizeof(struct ip_vs_sync_thread_data),
 		     GFP_KERNEL);
@@ -1858,8 +2410,15 @@ int start_sync_thread(struct netns_ipvs *ipvs, struct ipvs_sync_daemon_cfg *c,
 				goto out;
 		}
 		tinfo->id = id;
-		if (state == IP_VS_STATE_MASTER)
+		tinfo->ifindex = dev->ifindex;
+		/* Over TCP, the master thread connects by itself */
+		if (state == IP_VS_STATE_MASTER && c->sync_tcp)
+			result = 0;
+		else if (state == IP_VS_STATE_MASTER)
 			result = make_send_sock(ipvs, id, dev, &tinfo->sock);
+		else if (c->sync_tcp)
+			result = make_receive_sock_tcp(ipvs, id, dev,
+						       &tinfo->sock);
 		else
 			result = make_receive_sock(ipvs, id, dev, &tinfo->sock);
 		if (result < 0)
@@ -1900,6 +2459,8 @@ int start_sync_thread(struct netns_ipvs *ipvs, struct ipvs_sync_daemon_cfg *c,
 				kthread_stop(tinfo->task);
 		}
 	}
+	if (state == IP_VS_STATE_BACKUP)
+		ip_vs_sync_workers_stop(ipvs);
 	if (!(ipvs->sync_state & IP_VS_STATE_MASTER)) {
 		kfree(ipvs->ms);
 		ipvs->ms = NULL;
@@ -1991,6 +2552,8 @@ int stop_sync_thread(struct netns_ipvs *ipvs, int state)
 			if (retc >= 0)
 				retc = ret;
 		}
+		/* The receivers are gone, nothing is queued anymore */
+		ip_vs_sync_workers_stop(ipvs);
 		ipvs->backup_tinfo = NULL;
 	} else {
 		goto err;
@@ -2023,6 +2586,7 @@ int __net_init ip_vs_sync_net_init(struct netns_ipvs *ipvs)
 	__mutex_init(&ipvs->sync_mutex, "ipvs->sync_mutex", &__ipvs_sync_key);
 	spin_lock_init(&ipvs->sync_lock);
 	spin_lock_init(&ipvs->sync_buff_lock);
+	spin_lock_init(&ipvs->sync_rate_lock);
 	return 0;
 }
 
@@ -29,9 +29,17 @@
  *      pick choice1 when rweight1 is <= 0
  *      pick choice2 when rweight2 is <= 0
  *
- *    Return choice2 if choice2 has less connections than choice 1 normalized
+ *    Return choice2 if choice2 has less load than choice 1 normalized
  *    by weight
  *
+ *    The twos_load sysctl selects what is compared: the connections
+ *    (the default), the rate of new connections or the traffic in and out
+ *    of the server as measured by the estimator, or a score fed from user
+ *    space with the load of the destinations.  Estimates and scores are
+ *    read without locking, a stale value only makes for a worse choice.
+ *    The rates are only updated while the estimators run, see the
+ *    run_estimation sysctl.
+ *
  * References
  * ----------
  *
@@ -41,13 +49,32 @@
  *    http://www.eecs.harvard.edu/~michaelm/NEWWORK/postscripts/twosurvey.pdf
  *
  */
+
+/* Small enough that weight * load fits in 64 bits */
+static u64 ip_vs_twos_load(struct ip_vs_dest *dest, int type)
+{
+	struct ip_vs_estimator *e = &dest->stats.est;
+
+	switch (type) {
+	case IP_VS_TWOS_LOAD_CPS:
+		return READ_ONCE(e->cps) >> 10;
+	case IP_VS_TWOS_LOAD_BPS:
+		return (READ_ONCE(e->inbps) + READ_ONCE(e->outbps)) >> 15;
+	case IP_VS_TWOS_LOAD_SCORE:
+		return READ_ONCE(dest->load);
+	default:
+		return ip_vs_dest_conn_overhead(dest);
+	}
+}
+
 static struct ip_vs_dest *ip_vs_twos_schedule(struct ip_vs_service *svc,
 					      const struct sk_buff *skb,
 					      struct ip_vs_iphdr *iph)
 {
 	struct ip_vs_dest *dest, *choice1 = NULL, *choice2 = NULL;
-	int rweight1, rweight2, weight1 = -1, weight2 = -1, overhead1 = 0;
-	int overhead2, total_weight = 0, weight;
+	int rweight1, rweight2, weight1 = -1, weight2 = -1, total_weight = 0;
+	int weight, type = sysctl_twos_load(svc->ipvs);
+	u64 overhead1 = 0, overhead2;
 
 	IP_VS_DBG(6, "%s(): Scheduling...\n", __func__);
 
@@ -89,13 +116,13 @@ static struct ip_vs_dest *ip_vs_twos_schedule(struct ip_vs_service *svc,
 		if (rweight1 <= 0 && weight1 == -1) {
 			choice1 = dest;
 			weight1 = weight;
-			overhead1 = ip_vs_dest_conn_overhead(dest);
+			overhead1 = ip_vs_twos_load(dest, type);
 		}
 
 		if (rweight2 <= 0 && weight2 == -1) {
 			choice2 = dest;
 			weight2 = weight;
-			overhead2 = ip_vs_dest_conn_overhead(dest);
+			overhead2 = ip_vs_twos_load(dest, type);
 		}
 
 		if (weight1 != -1 && weight2 != -1)
@@ -103,7 +130,7 @@ static struct ip_vs_dest *ip_vs_twos_schedule(struct ip_vs_service *svc,
 	}
 
 nextstage:
-	if (choice2 && (weight2 * overhead1) > (weight1 * overhead2))
+	if (choice2 && (u64)weight2 * overhead1 > (u64)weight1 * overhead2)
 		choice1 = choice2;
 
 	IP_VS_DBG_BUF(6, "twos: server %s:%u conns %d refcnt %d weight %d\n",
@@ -20,12 +20,14 @@
 #include <linux/slab.h>
 #include <linux/list.h>
 #include <linux/rbtree.h>
+#include <linux/rculist.h>
 #include <linux/module.h>
 #include <linux/random.h>
 #include <linux/skbuff.h>
 #include <linux/spinlock.h>
 #include <linux/netfilter/nf_conntrack_tcp.h>
 #include <linux/netfilter/x_tables.h>
+#include <net/netns/generic.h>
 #include <net/netfilter/nf_conntrack.h>
 #include <net/netfilter/nf_conntrack_count.h>
 #include <net/netfilter/nf_conntrack_core.h>
@@ -37,6 +39,8 @@
 #define CONNCOUNT_GC_MAX_NODES	8
 #define MAX_KEYLEN		5
 
+#define CONNCOUNT_HASH_MAX	(1U << 24)
+
 /* we will save the tuples of all connections we care about */
 struct nf_conncount_tuple {
 	struct list_head		node;
@@ -46,8 +50,12 @@ struct nf_conncount_tuple {
 	u32				jiffies32;
 };
 
+/* node is used by the trees, hnode by the hash table */
 struct nf_conncount_rb {
-	struct rb_node node;
+	union {
+		struct rb_node node;
+		struct hlist_node hnode;
+	};
 	struct nf_conncount_list list;
 	u32 key[MAX_KEYLEN];
 	struct rcu_head rcu_head;
@@ -55,9 +63,17 @@ struct nf_conncount_rb {
 
 static spinlock_t nf_conncount_locks[CONNCOUNT_SLOTS] __cacheline_aligned_in_smp;
 
+/* With nf_conncount_hash_buckets set when the data is created, keys are kept in a hash
+ * table instead of the CONNCOUNT_SLOTS trees.  Lookups don't have to
+ * compare their way down a tree and bucket walks are RCU safe without
+ * retries.  Bucket b belongs to slot b % CONNCOUNT_SLOTS, which protects
+ * it with its lock and is the unit of gc, as a tree is.
+ */
 struct nf_conncount_data {
 	unsigned int keylen;
 	struct rb_root root[CONNCOUNT_SLOTS];
+	struct hlist_head *buckets;
+	unsigned int hmask;
 	struct net *net;
 	struct work_struct gc_work;
 	unsigned long pending_trees[BITS_TO_LONGS(CONNCOUNT_SLOTS)];
@@ -65,6 +81,19 @@ struct nf_conncount_data {
 };
 
 static u_int32_t conncount_rnd __read_mostly;
+
+struct nf_conncount_pernet {
+	struct ctl_table_header	*sysctl_hdr;
+	unsigned int		hash_buckets;	/* 0 for trees */
+};
+
+static unsigned int nf_conncount_pernet_id __read_mostly;
+
+static struct nf_conncount_pernet *nf_conncount_pernet(struct net *net)
+{
+	return net_generic(net, nf_conncount_pernet_id);
+}
+
 static struct kmem_cache *conncount_rb_cachep __read_mostly;
 static struct kmem_cache *conncount_conn_cachep __read_mostly;
 
@@ -452,6 +481,177 @@ count_tree(struct net *net,
 	return insert_tree(net, data, root, hash, key, tuple, zone);
 }
 
+/* caller must hold nf_conncount_locks[] lock of the bucket */
+static void hash_nodes_free(struct nf_conncount_rb *gc_nodes[],
+			    unsigned int gc_count)
+{
+	struct nf_conncount_rb *rbconn;
+
+	while (gc_count) {
+		rbconn = gc_nodes[--gc_count];
+		spin_lock(&rbconn->list.list_lock);
+		if (!rbconn->list.count) {
+			hlist_del_rcu(&rbconn->hnode);
+			call_rcu(&rbconn->rcu_head, __tree_nodes_free);
+		}
+		spin_unlock(&rbconn->list.list_lock);
+	}
+}
+
+static unsigned int
+insert_hash(struct net *net,
+	    struct nf_conncount_data *data,
+	    struct hlist_head *head,
+	    unsigned int slot,
+	    const u32 *key,
+	    const struct nf_conntrack_tuple *tuple,
+	    const struct nf_conntrack_zone *zone)
+{
+	struct nf_conncount_rb *gc_nodes[CONNCOUNT_GC_MAX_NODES];
+	struct nf_conncount_rb *rbconn;
+	struct nf_conncount_tuple *conn;
+	unsigned int count = 0, gc_count = 0;
+
+	spin_lock_bh(&nf_conncount_locks[slot]);
+	hlist_for_each_entry(rbconn, head, hnode) {
+		if (!key_diff(key, rbconn->key, data->keylen)) {
+			int ret;
+
+			ret = nf_conncount_add(net, &rbconn->list, tuple, zone);
+			if (ret)
+				count = 0; /* hotdrop */
+			else
+				count = rbconn->list.count;
+			hash_nodes_free(gc_nodes, gc_count);
+			goto out_unlock;
+		}
+
+		if (gc_count < ARRAY_SIZE(gc_nodes) &&
+		    nf_conncount_gc_list(net, &rbconn->list))
+			gc_nodes[gc_count++] = rbconn;
+	}
+
+	if (gc_count) {
+		hash_nodes_free(gc_nodes, gc_count);
+		schedule_gc_worker(data, slot);
+	}
+
+	rbconn = kmem_cache_alloc(conncount_rb_cachep, GFP_ATOMIC);
+	if (rbconn == NULL)
+		goto out_unlock;
+
+	conn = kmem_cache_alloc(conncount_conn_cachep, GFP_ATOMIC);
+	if (conn == NULL) {
+		kmem_cache_free(conncount_rb_cachep, rbconn);
+		goto out_unlock;
+	}
+
+	conn->tuple = *tuple;
+	conn->zone = *zone;
+	conn->cpu = raw_smp_processor_id();
+	conn->jiffies32 = (u32)jiffies;
+	memcpy(rbconn->key, key, sizeof(u32) * data->keylen);
+
+	nf_conncount_list_init(&rbconn->list);
+	list_add(&conn->node, &rbconn->list.head);
+	count = 1;
+	rbconn->list.count = count;
+
+	hlist_add_head_rcu(&rbconn->hnode, head);
+out_unlock:
+	spin_unlock_bh(&nf_conncount_locks[slot]);
+	return count;
+}
+
+static unsigned int
+count_hash(struct net *net,
+	   struct nf_conncount_data *data,
+	   const u32 *key,
+	   const struct nf_conntrack_tuple *tuple,
+	   const struct nf_conntrack_zone *zone)
+{
+	struct nf_conncount_rb *rbconn;
+	struct hlist_head *head;
+	unsigned int hash;
+
+	hash = jhash2(key, data->keylen, conncount_rnd) & data->hmask;
+	head = &data->buckets[hash];
+
+	hlist_for_each_entry_rcu(rbconn, head, hnode) {
+		int ret;
+
+		if (key_diff(key, rbconn->key, data->keylen))
+			continue;
+
+		if (!tuple) {
+			nf_conncount_gc_list(net, &rbconn->list);
+			return rbconn->list.count;
+		}
+
+		spin_lock_bh(&rbconn->list.list_lock);
+		/* Node might be about to be free'd.
+		 * We need to defer to insert_hash() in this case.
+		 */
+		if (rbconn->list.count == 0) {
+			spin_unlock_bh(&rbconn->list.list_lock);
+			break;
+		}
+
+		ret = __nf_conncount_add(net, &rbconn->list, tuple, zone);
+		spin_unlock_bh(&rbconn->list.list_lock);
+		if (ret)
+			return 0; /* hotdrop */
+		else
+			return rbconn->list.count;
+	}
+
+	if (!tuple)
+		return 0;
+
+	return insert_hash(net, data, head, hash % CONNCOUNT_SLOTS, key,
+			   tuple, zone);
+}
+
+/* Returns the number of empty lists found in the buckets of @slot. */
+static unsigned int hash_gc_lists(struct nf_conncount_data *data,
+				  unsigned int slot)
+{
+	struct nf_conncount_rb *rbconn;
+	unsigned int b, gc_count = 0;
+
+	for (b = slot; b <= data->hmask; b += CONNCOUNT_SLOTS) {
+		hlist_for_each_entry_rcu(rbconn, &data->buckets[b], hnode) {
+			if (nf_conncount_gc_list(data->net, &rbconn->list))
+				gc_count++;
+		}
+	}
+
+	return gc_count;
+}
+
+/* caller must hold nf_conncount_locks[] lock of @slot */
+static void hash_gc_nodes(struct nf_conncount_data *data, unsigned int slot)
+{
+	struct nf_conncount_rb *gc_nodes[CONNCOUNT_GC_MAX_NODES], *rbconn;
+	unsigned int b, gc_count = 0;
+	struct hlist_node *n;
+
+	for (b = slot; b <= data->hmask; b += CONNCOUNT_SLOTS) {
+		hlist_for_each_entry_safe(rbconn, n, &data->buckets[b], hnode) {
+			if (rbconn->list.count > 0)
+				continue;
+
+			gc_nodes[gc_count++] = rbconn;
+			if (gc_count >= ARRAY_SIZE(gc_nodes)) {
+				hash_nodes_free(gc_nodes, gc_count);
+				gc_count = 0;
+			}
+		}
+	}
+
+	hash_nodes_free(gc_nodes, gc_count);
+}
+
 static void tree_gc_worker(struct work_struct *work)
 {
 	struct nf_conncount_data *data = container_of(work, struct nf_conncount_data, gc_work);
@@ -465,10 +665,14 @@ static void tree_gc_worker(struct work_struct *work)
 
 	local_bh_disable();
 	rcu_read_lock();
-	for (node = rb_first(root); node != NULL; node = rb_next(node)) {
-		rbconn = rb_entry(node, struct nf_conncount_rb, node);
-		if (nf_conncount_gc_list(data->net, &rbconn->list))
-			gc_count++;
+	if (data->buckets) {
+		gc_count = hash_gc_lists(data, tree);
+	} else {
+		for (node = rb_first(root); node != NULL; node = rb_next(node)) {
+			rbconn = rb_entry(node, struct nf_conncount_rb, node);
+			if (nf_conncount_gc_list(data->net, &rbconn->list))
+				gc_count++;
+		}
 	}
 	rcu_read_unlock();
 	local_bh_enable();
@@ -479,6 +683,11 @@ static void tree_gc_worker(struct work_struct *work)
 	if (gc_count < ARRAY_SIZE(gc_nodes))
 		goto next; /* do not bother */
 
+	if (data->buckets) {
+		hash_gc_nodes(data, tree);
+		goto next;
+	}
+
 	gc_count = 0;
 	node = rb_first(root);
 	while (node != NULL) {
@@ -520,12 +729,16 @@ unsigned int nf_conncount_count(struct net *net,
 				const struct nf_conntrack_tuple *tuple,
 				const struct nf_conntrack_zone *zone)
 {
+	if (data->buckets)
+		return count_hash(net, data, key, tuple, zone);
+
 	return count_tree(net, data, key, tuple, zone);
 }
 EXPORT_SYMBOL_GPL(nf_conncount_count);
 
 struct nf_conncount_data *nf_conncount_init(struct net *net, unsigned int keylen)
 {
+	unsigned int hsize = READ_ONCE(nf_conncount_pernet(net)->hash_buckets);
 	struct nf_conncount_data *data;
 	int i;
 
@@ -543,6 +756,20 @@ struct nf_conncount_data *nf_conncount_init(struct net *net, unsigned int keylen
 	for (i = 0; i < ARRAY_SIZE(data->root); ++i)
 		data->root[i] = RB_ROOT;
 
+	data->buckets = NULL;
+	if (hsize) {
+		hsize = clamp(hsize, CONNCOUNT_SLOTS, CONNCOUNT_HASH_MAX);
+		hsize = roundup_pow_of_two(hsize);
+
+		data->buckets = kvcalloc(hsize, sizeof(*data->buckets),
+					 GFP_KERNEL);
+		if (!data->buckets) {
+			kfree(data);
+			return ERR_PTR(-ENOMEM);
+		}
+		data->hmask = hsize - 1;
+	}
+
 	data->keylen = keylen / sizeof(u32);
 	data->net = net;
 	INIT_WORK(&data->gc_work, tree_gc_worker);
@@ -576,12 +803,31 @@ static void destroy_tree(struct rb_root *r)
 	}
 }
 
+static void destroy_hash(struct hlist_head *head)
+{
+	struct nf_conncount_rb *rbconn;
+	struct hlist_node *n;
+
+	hlist_for_each_entry_safe(rbconn, n, head, hnode) {
+		nf_conncount_cache_free(&rbconn->list);
+
+		kmem_cache_free(conncount_rb_cachep, rbconn);
+	}
+}
+
 void nf_conncount_destroy(struct net *net, struct nf_conncount_data *data)
 {
 	unsigned int i;
 
 	cancel_work_sync(&data->gc_work);
 
+	if (data->buckets) {
+		for (i = 0; i <= data->hmask; i++)
+			destroy_hash(&data->buckets[i]);
+
+		kvfree(data->buckets);
+	}
+
 	for (i = 0; i < ARRAY_SIZE(data->root); ++i)
 		destroy_tree(&data->root[i]);
 
@@ -589,9 +835,88 @@ void nf_conncount_destroy(struct net *net, struct nf_conncount_data *data)
 }
 EXPORT_SYMBOL_GPL(nf_conncount_destroy);
 
+#ifdef CONFIG_SYSCTL
+static unsigned int conncount_hash_max = CONNCOUNT_HASH_MAX;
+
+static struct ctl_table nf_conncount_sysctl_table[] = {
+	{
+		.procname	= "nf_conncount_hash_buckets",
+		.maxlen		= sizeof(unsigned int),
+		.mode		= 0644,
+		.proc_handler	= proc_douintvec_minmax,
+		.extra2		= &conncount_hash_max,
+	},
+};
+
+static int nf_conncount_sysctl_register(struct net *net)
+{
+	struct nf_conncount_pernet *cnet = nf_conncount_pernet(net);
+	struct ctl_table_header *hdr;
+	struct ctl_table *table;
+
+	table = nf_conncount_sysctl_table;
+	if (!net_eq(net, &init_net)) {
+		table = kmemdup(table, sizeof(nf_conncount_sysctl_table),
+				GFP_KERNEL);
+		if (!table)
+			return -ENOMEM;
+	}
+
+	table[0].data = &cnet->hash_buckets;
+
+	hdr = register_net_sysctl_sz(net, "net/netfilter", table,
+				     ARRAY_SIZE(nf_conncount_sysctl_table));
+	if (!hdr) {
+		if (!net_eq(net, &init_net))
+			kfree(table);
+		return -ENOMEM;
+	}
+
+	cnet->sysctl_hdr = hdr;
+	return 0;
+}
+
+static void nf_conncount_sysctl_unregister(struct net *net)
+{
+	struct nf_conncount_pernet *cnet = nf_conncount_pernet(net);
+	const struct ctl_table *table;
+
+	table = cnet->sysctl_hdr->ctl_table_arg;
+	unregister_net_sysctl_table(cnet->sysctl_hdr);
+	if (!net_eq(net, &init_net))
+		kfree(table);
+}
+#else
+static int nf_conncount_sysctl_register(struct net *net)
+{
+	return 0;
+}
+
+static void nf_conncount_sysctl_unregister(struct net *net)
+{
+}
+#endif
+
+static int __net_init nf_conncount_net_init(struct net *net)
+{
+	return nf_conncount_sysctl_register(net);
+}
+
+static void __net_exit nf_conncount_net_exit(struct net *net)
+{
+	nf_conncount_sysctl_unregister(net);
+}
+
+static struct pernet_operations nf_conncount_net_ops = {
+	.init = nf_conncount_net_init,
+	.exit = nf_conncount_net_exit,
+	.id   = &nf_conncount_pernet_id,
+	.size = sizeof(struct nf_conncount_pernet),
+};
+
 static int __init nf_conncount_modinit(void)
 {
-	int i;
+	int i, err;
 
 	for (i = 0; i < CONNCOUNT_SLOTS; ++i)
 		spin_lock_init(&nf_conncount_locks[i]);
@@ -606,11 +931,19 @@ static int __init nf_conncount_modinit(void)
 		return -ENOMEM;
 	}
 
+	err = register_pernet_subsys(&nf_conncount_net_ops);
+	if (err) {
+		kmem_cache_destroy(conncount_rb_cachep);
+		kmem_cache_destroy(conncount_conn_cachep);
+		return err;
+	}
+
 	return 0;
 }
 
 static void __exit nf_conncount_modexit(void)
 {
+	unregister_pernet_subsys(&nf_conncount_net_ops);
 	kmem_cache_destroy(conncount_conn_cachep);
 	kmem_cache_destroy(conncount_rb_cachep);
 }
@@ -64,6 +64,38 @@ enum {
 	NF_BPF_CT_OPTS_SZ = 16,
 };
 
+/* bpf_ct_batch_entry - Entry of a batched CT lookup
+ *
+ * Members:
+ * @tuple      - Tuple to look up, in the original direction
+ * @family     - Address family of @tuple, AF_INET or AF_INET6
+ * @dir        - Out parameter, direction @tuple was found in
+ * @reserved   - Reserved member, must be 0
+ * @error      - Out parameter, 0 if the entry was found
+ *		 Values:
+ *		   -EINVAL - reserved is not 0
+ *		   -EAFNOSUPPORT - family isn't AF_INET or AF_INET6
+ *		   -ENOENT - Conntrack lookup could not find entry for tuple
+ * @status     - Out parameter, status bits of the entry
+ * @mark       - Out parameter, mark of the entry
+ * @timeout    - Out parameter, time left before the entry expires, in msecs
+ */
+struct bpf_ct_batch_entry {
+	struct bpf_sock_tuple tuple;
+	u8 family;
+	u8 dir;
+	u16 reserved;
+	s32 error;
+	u32 status;
+	u32 mark;
+	u32 timeout;
+};
+
+enum {
+	NF_BPF_CT_BATCH_ENTRY_SZ = 56,
+	NF_BPF_CT_BATCH_MAX = 64,
+};
+
 static int bpf_nf_ct_tuple_parse(struct bpf_sock_tuple *bpf_tuple,
 				 u32 tuple_len, u8 protonum, u8 dir,
 				 struct nf_conntrack_tuple *tuple)
@@ -172,7 +204,7 @@ __bpf_nf_ct_alloc_entry(struct net *net, struct bpf_sock_tuple *bpf_tuple,
 static struct nf_conn *__bpf_nf_ct_lookup(struct net *net,
 					  struct bpf_sock_tuple *bpf_tuple,
 					  u32 tuple_len, struct bpf_ct_opts *opts,
-					  u32 opts_len)
+					  u32 opts_len, bool rcu)
 {
 	struct nf_conntrack_tuple_hash *hash;
 	struct nf_conntrack_tuple tuple;
@@ -216,7 +248,10 @@ static struct nf_conn *__bpf_nf_ct_lookup(struct net *net,
 		ct_zone = nf_ct_zone_dflt;
 	}
 
-	hash = nf_conntrack_find_get(net, &ct_zone, &tuple);
+	if (rcu)
+		hash = nf_conntrack_find_rcu(net, &ct_zone, &tuple);
+	else
+		hash = nf_conntrack_find_get(net, &ct_zone, &tuple);
 	if (opts->netns_id >= 0)
 		put_net(net);
 	if (!hash)
@@ -228,6 +263,127 @@ static struct nf_conn *__bpf_nf_ct_lookup(struct net *net,
 	return ct;
 }
 
+/* Read what the batch entry wants to know about the conntrack entry, then
+ * make sure it wasn't recycled meanwhile, as no reference is taken.
+ */
+static int bpf_nf_ct_batch_fill(struct net *net,
+				const struct nf_conntrack_zone *zone,
+				const struct nf_conntrack_tuple *tuple,
+				struct bpf_ct_batch_entry *entry)
+{
+	struct nf_conntrack_tuple_hash *hash;
+	struct nf_conn *ct;
+
+	hash = nf_conntrack_find_rcu(net, zone, tuple);
+	if (!hash)
+		return -ENOENT;
+
+	ct = nf_ct_tuplehash_to_ctrack(hash);
+	entry->dir = NF_CT_DIRECTION(hash);
+	entry->status = READ_ONCE(ct->status);
+#if defined(CONFIG_NF_CONNTRACK_MARK)
+	entry->mark = READ_ONCE(ct->mark);
+#else
+	entry->mark = 0;
+#endif
+	entry->timeout = jiffies_to_msecs(nf_ct_expires(ct));
+
+	/* TYPESAFE_BY_RCU, pairs with the barriers of the allocation */
+	smp_rmb();
+	if (unlikely(!refcount_read(&ct->ct_general.use) ||
+		     !nf_ct_tuple_equal(tuple, &hash->tuple) ||
+		     !nf_ct_zone_equal(ct, zone, NF_CT_DIRECTION(hash)) ||
+		     !net_eq(net, nf_ct_net(ct))))
+		return -ENOENT;
+
+	return 0;
+}
+
+static int __bpf_nf_ct_lookup_batch(struct net *net,
+				    struct bpf_ct_batch_entry *entries,
+				    u32 entries_len, struct bpf_ct_opts *opts,
+				    u32 opts_len)
+{
+	struct bpf_ct_batch_entry *entry;
+	struct nf_conntrack_tuple tuple;
+	struct nf_conntrack_zone ct_zone;
+	unsigned int i, n, found = 0;
+	u32 tuple_len;
+	int err;
+
+	if (!opts || !entries)
+		return -EINVAL;
+	if (!(opts_len == NF_BPF_CT_OPTS_SZ || opts_len == 12))
+		return -EINVAL;
+	if (opts_len == NF_BPF_CT_OPTS_SZ) {
+		if (opts->reserved[0] || opts->reserved[1] || opts->reserved[2])
+			return -EINVAL;
+	} else {
+		if (opts->ct_zone_id)
+			return -EINVAL;
+	}
+	if (unlikely(opts->l4proto != IPPROTO_TCP && opts->l4proto != IPPROTO_UDP))
+		return -EPROTO;
+	if (unlikely(opts->netns_id < BPF_F_CURRENT_NETNS))
+		return -EINVAL;
+
+	n = entries_len / sizeof(*entries);
+	if (!n || n > NF_BPF_CT_BATCH_MAX || entries_len % sizeof(*entries))
+		return -EINVAL;
+
+	if (opts->netns_id >= 0) {
+		net = get_net_ns_by_id(net, opts->netns_id);
+		if (unlikely(!net))
+			return -ENONET;
+	}
+
+	if (opts_len == NF_BPF_CT_OPTS_SZ) {
+		if (opts->ct_zone_dir == 0)
+			opts->ct_zone_dir = NF_CT_DEFAULT_ZONE_DIR;
+		nf_ct_zone_init(&ct_zone,
+				opts->ct_zone_id, opts->ct_zone_dir, 0);
+	} else {
+		ct_zone = nf_ct_zone_dflt;
+	}
+
+	rcu_read_lock();
+	for (i = 0; i < n; i++) {
+		entry = &entries[i];
+
+		switch (entry->family) {
+		case AF_INET:
+			tuple_len = sizeof(entry->tuple.ipv4);
+			break;
+		case AF_INET6:
+			tuple_len = sizeof(entry->tuple.ipv6);
+			break;
+		default:
+			entry->error = -EAFNOSUPPORT;
+			continue;
+		}
+
+		if (entry->reserved) {
+			entry->error = -EINVAL;
+			continue;
+		}
+
+		err = bpf_nf_ct_tuple_parse(&entry->tuple, tuple_len,
+					    opts->l4proto, IP_CT_DIR_ORIGINAL,
+					    &tuple);
+		if (!err)
+			err = bpf_nf_ct_batch_fill(net, &ct_zone, &tuple, entry);
+		entry->error = err;
+		if (!err)
+			found++;
+	}
+	rcu_read_unlock();
+
+	if (opts->netns_id >= 0)
+		put_net(net);
+
+	return found;
+}
+
 BTF_ID_LIST(btf_nf_conn_ids)
 BTF_ID(struct, nf_conn)
 BTF_ID(struct, nf_conn___init)
@@ -248,6 +404,14 @@ static int _nf_conntrack_btf_struct_access(struct bpf_verifier_log *log,
 		return -EACCES;
 	}
 
+	/* entries of bpf_*_ct_lookup_rcu() are not referenced, and may be
+	 * recycled for another connection under the program
+	 */
+	if (reg->type & MEM_RCU) {
+		bpf_log(log, "no write support to RCU protected nf_conn\n");
+		return -EACCES;
+	}
+
 	/* `struct nf_conn` and `struct nf_conn___init` have the same layout
 	 * so we are safe to simply merge offset checks here
 	 */
@@ -332,7 +496,48 @@ bpf_xdp_ct_lookup(struct xdp_md *xdp_ctx, struct bpf_sock_tuple *bpf_tuple,
 	struct nf_conn *nfct;
 
 	caller_net = dev_net(ctx->rxq->dev);
-	nfct = __bpf_nf_ct_lookup(caller_net, bpf_tuple, tuple__sz, opts, opts__sz);
+	nfct = __bpf_nf_ct_lookup(caller_net, bpf_tuple, tuple__sz, opts, opts__sz,
+				  false);
+	if (IS_ERR(nfct)) {
+		if (opts)
+			opts->error = PTR_ERR(nfct);
+		return NULL;
+	}
+	return nfct;
+}
+
+/* bpf_xdp_ct_lookup_rcu - Lookup CT entry for the given tuple, without
+ *			   acquiring a reference to it
+ *
+ * The entry is only valid within the RCU read section of the program, the
+ * verifier enforces it, and must not be released.  It can be recycled for
+ * another connection at any time, the program has to check the tuple if
+ * that matters.
+ *
+ * Parameters:
+ * @xdp_ctx	- Pointer to ctx (xdp_md) in XDP program
+ *		    Cannot be NULL
+ * @bpf_tuple	- Pointer to memory representing the tuple to look up
+ *		    Cannot be NULL
+ * @tuple__sz	- Length of the tuple structure
+ *		    Must be one of sizeof(bpf_tuple->ipv4) or
+ *		    sizeof(bpf_tuple->ipv6)
+ * @opts	- Additional options for lookup (documented above)
+ *		    Cannot be NULL
+ * @opts__sz	- Length of the bpf_ct_opts structure
+ *		    Must be NF_BPF_CT_OPTS_SZ (16) or 12
+ */
+__bpf_kfunc struct nf_conn *
+bpf_xdp_ct_lookup_rcu(struct xdp_md *xdp_ctx, struct bpf_sock_tuple *bpf_tuple,
+		      u32 tuple__sz, struct bpf_ct_opts *opts, u32 opts__sz)
+{
+	struct xdp_buff *ctx = (struct xdp_buff *)xdp_ctx;
+	struct net *caller_net;
+	struct nf_conn *nfct;
+
+	caller_net = dev_net(ctx->rxq->dev);
+	nfct = __bpf_nf_ct_lookup(caller_net, bpf_tuple, tuple__sz, opts, opts__sz,
+				  true);
 	if (IS_ERR(nfct)) {
 		if (opts)
 			opts->error = PTR_ERR(nfct);
@@ -341,6 +546,46 @@ bpf_xdp_ct_lookup(struct xdp_md *xdp_ctx, struct bpf_sock_tuple *bpf_tuple,
 	return nfct;
 }
 
+/* bpf_xdp_ct_lookup_batch - Lookup CT entries for an array of tuples
+ *
+ * Looks up every entry of @entries in one call, the options being checked
+ * once for all of them, and reports what was found in the entries
+ * themselves.  No reference is taken, so nothing has to be released: the
+ * values reported are a snapshot of the CT entries.
+ *
+ * Parameters:
+ * @xdp_ctx	- Pointer to ctx (xdp_md) in XDP program
+ *		    Cannot be NULL
+ * @entries	- Array of bpf_ct_batch_entry (documented above), the tuples
+ *		  to look up and the results
+ *		    Cannot be NULL
+ * @entries__sz	- Length of the array in bytes
+ *		    Must be a multiple of NF_BPF_CT_BATCH_ENTRY_SZ (56), of
+ *		    at most NF_BPF_CT_BATCH_MAX (64) entries
+ * @opts	- Additional options for lookup (documented above), applied
+ *		  to all entries
+ *		    Cannot be NULL
+ * @opts__sz	- Length of the bpf_ct_opts structure
+ *		    Must be NF_BPF_CT_OPTS_SZ (16) or 12
+ *
+ * Returns the number of entries found, or a negative error also stored
+ * in @opts->error.
+ */
+__bpf_kfunc int
+bpf_xdp_ct_lookup_batch(struct xdp_md *xdp_ctx,
+			struct bpf_ct_batch_entry *entries, u32 entries__sz,
+			struct bpf_ct_opts *opts, u32 opts__sz)
+{
+	struct xdp_buff *ctx = (struct xdp_buff *)xdp_ctx;
+	int ret;
+
+	ret = __bpf_nf_ct_lookup_batch(dev_net(ctx->rxq->dev), entries,
+				       entries__sz, opts, opts__sz);
+	if (ret < 0 && opts)
+		opts->error = ret;
+	return ret;
+}
+
 /* bpf_skb_ct_alloc - Allocate a new CT entry
  *
  * Parameters:
@@ -400,7 +645,45 @@ bpf_skb_ct_lookup(struct __sk_buff *skb_ctx, struct bpf_sock_tuple *bpf_tuple,
 	struct nf_conn *nfct;
 
 	caller_net = skb->dev ? dev_net(skb->dev) : sock_net(skb->sk);
-	nfct = __bpf_nf_ct_lookup(caller_net, bpf_tuple, tuple__sz, opts, opts__sz);
+	nfct = __bpf_nf_ct_lookup(caller_net, bpf_tuple, tuple__sz, opts, opts__sz,
+				  false);
+	if (IS_ERR(nfct)) {
+		if (opts)
+			opts->error = PTR_ERR(nfct);
+		return NULL;
+	}
+	return nfct;
+}
+
+/* bpf_skb_ct_lookup_rcu - Lookup CT entry for the given tuple, without
+ *			   acquiring a reference to it
+ *
+ * See bpf_xdp_ct_lookup_rcu().
+ *
+ * Parameters:
+ * @skb_ctx	- Pointer to ctx (__sk_buff) in TC program
+ *		    Cannot be NULL
+ * @bpf_tuple	- Pointer to memory representing the tuple to look up
+ *		    Cannot be NULL
+ * @tuple__sz	- Length of the tuple structure
+ *		    Must be one of sizeof(bpf_tuple->ipv4) or
+ *		    sizeof(bpf_tuple->ipv6)
+ * @opts	- Additional options for lookup (documented above)
+ *		    Cannot be NULL
+ * @opts__sz	- Length of the bpf_ct_opts structure
+ *		    Must be NF_BPF_CT_OPTS_SZ (16) or 12
+ */
+__bpf_kfunc struct nf_conn *
+bpf_skb_ct_lookup_rcu(struct __sk_buff *skb_ctx, struct bpf_sock_tuple *bpf_tuple,
+		      u32 tuple__sz, struct bpf_ct_opts *opts, u32 opts__sz)
+{
+	struct sk_buff *skb = (struct sk_buff *)skb_ctx;
+	struct net *caller_net;
+	struct nf_conn *nfct;
+
+	caller_net = skb->dev ? dev_net(skb->dev) : sock_net(skb->sk);
+	nfct = __bpf_nf_ct_lookup(caller_net, bpf_tuple, tuple__sz, opts, opts__sz,
+				  true);
 	if (IS_ERR(nfct)) {
 		if (opts)
 			opts->error = PTR_ERR(nfct);
@@ -512,8 +795,11 @@ __bpf_kfunc_end_defs();
 BTF_KFUNCS_START(nf_ct_kfunc_set)
 BTF_ID_FLAGS(func, bpf_xdp_ct_alloc, KF_ACQUIRE | KF_RET_NULL)
 BTF_ID_FLAGS(func, bpf_xdp_ct_lookup, KF_ACQUIRE | KF_RET_NULL)
+BTF_ID_FLAGS(func, bpf_xdp_ct_lookup_batch)
+BTF_ID_FLAGS(func, bpf_xdp_ct_lookup_rcu, KF_RCU_PROTECTED | KF_RET_NULL)
 BTF_ID_FLAGS(func, bpf_skb_ct_alloc, KF_ACQUIRE | KF_RET_NULL)
 BTF_ID_FLAGS(func, bpf_skb_ct_lookup, KF_ACQUIRE | KF_RET_NULL)
+BTF_ID_FLAGS(func, bpf_skb_ct_lookup_rcu, KF_RCU_PROTECTED | KF_RET_NULL)
 BTF_ID_FLAGS(func, bpf_ct_insert_entry, KF_ACQUIRE | KF_RET_NULL | KF_RELEASE)
 BTF_ID_FLAGS(func, bpf_ct_release, KF_RELEASE)
 BTF_ID_FLAGS(func, bpf_ct_set_timeout, KF_TRUSTED_ARGS)
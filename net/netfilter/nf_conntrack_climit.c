@@ -0,0 +1,98 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Connection counts without per-key connection lists.
+ *
+ * nf_conncount keeps a list of tuples per key and walks it, looking up
+ * every tuple, to drop closed connections whenever a new one is added.
+ * Here the conntrack entry counted records the counter in an extension
+ * instead and takes itself out of the count when it is destroyed, adding
+ * a connection is an increment of a percpu counter.
+ *
+ * Entries can only be counted before they are confirmed.  They stay in
+ * the count until they are destroyed, closed TCP connections included.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+
+#include <net/netfilter/nf_conntrack.h>
+#include <net/netfilter/nf_conntrack_climit.h>
+#include <net/netfilter/nf_conntrack_extend.h>
+
+struct nf_ct_climit *nf_ct_climit_alloc(gfp_t gfp)
+{
+	struct nf_ct_climit *climit;
+
+	climit = kmalloc(sizeof(*climit), gfp);
+	if (!climit)
+		return NULL;
+
+	if (percpu_counter_init(&climit->count, 0, gfp)) {
+		kfree(climit);
+		return NULL;
+	}
+
+	refcount_set(&climit->ref, 1);
+	return climit;
+}
+EXPORT_SYMBOL_GPL(nf_ct_climit_alloc);
+
+void nf_ct_climit_put(struct nf_ct_climit *climit)
+{
+	if (!refcount_dec_and_test(&climit->ref))
+		return;
+
+	percpu_counter_destroy(&climit->count);
+	kfree(climit);
+}
+EXPORT_SYMBOL_GPL(nf_ct_climit_put);
+
+/* Called with @ct unconfirmed.  Counting it twice in the same counter is
+ * a no-op.
+ */
+int nf_ct_climit_add(struct nf_conn *ct, struct nf_ct_climit *climit)
+{
+	struct nf_conn_climit *cl;
+	int i;
+
+	cl = nf_ct_ext_find(ct, NF_CT_EXT_CLIMIT);
+	if (!cl) {
+		cl = nf_ct_ext_add(ct, NF_CT_EXT_CLIMIT, GFP_ATOMIC);
+		if (!cl)
+			return -ENOMEM;
+	}
+
+	for (i = 0; i < NF_CT_CLIMIT_MAX; i++) {
+		if (cl->climit[i] == climit)
+			return 0;
+		if (cl->climit[i])
+			continue;
+
+		refcount_inc(&climit->ref);
+		percpu_counter_inc(&climit->count);
+		cl->climit[i] = climit;
+		return 0;
+	}
+
+	return -ENOSPC;
+}
+EXPORT_SYMBOL_GPL(nf_ct_climit_add);
+
+void nf_ct_climit_destroy(struct nf_conn *ct)
+{
+	struct nf_conn_climit *cl;
+	int i;
+
+	/* not nf_ct_ext_find(), the extension must be found whatever
+	 * its genid is.
+	 */
+	if (!ct->ext || !__nf_ct_ext_exist(ct->ext, NF_CT_EXT_CLIMIT))
+		return;
+
+	cl = (void *)ct->ext + ct->ext->offset[NF_CT_EXT_CLIMIT];
+	for (i = 0; i < NF_CT_CLIMIT_MAX && cl->climit[i]; i++) {
+		percpu_counter_dec(&cl->climit[i]->count);
+		nf_ct_climit_put(cl->climit[i]);
+	}
+}
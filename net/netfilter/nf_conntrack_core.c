@@ -41,20 +41,26 @@
 #include <net/netfilter/nf_conntrack_core.h>
 #include <net/netfilter/nf_conntrack_extend.h>
 #include <net/netfilter/nf_conntrack_acct.h>
+#include <net/netfilter/nf_conntrack_climit.h>
 #include <net/netfilter/nf_conntrack_ecache.h>
+#include <net/netfilter/nf_conntrack_sock.h>
 #include <net/netfilter/nf_conntrack_zones.h>
 #include <net/netfilter/nf_conntrack_timestamp.h>
 #include <net/netfilter/nf_conntrack_timeout.h>
 #include <net/netfilter/nf_conntrack_labels.h>
+#include <net/netfilter/nf_conntrack_queue.h>
 #include <net/netfilter/nf_conntrack_synproxy.h>
+#include <net/netfilter/nf_conntrack_wheel.h>
+#include <net/netfilter/nf_conntrack_zone_index.h>
 #include <net/netfilter/nf_nat.h>
 #include <net/netfilter/nf_nat_helper.h>
 #include <net/netns/hash.h>
 #include <net/ip.h>
+#include <trace/events/netfilter.h>
 
 #include "nf_internals.h"
 
-__cacheline_aligned_in_smp spinlock_t nf_conntrack_locks[CONNTRACK_LOCKS];
+struct nf_conntrack_bucket_lock nf_conntrack_locks[CONNTRACK_LOCKS];
 EXPORT_SYMBOL_GPL(nf_conntrack_locks);
 
 __cacheline_aligned_in_smp DEFINE_SPINLOCK(nf_conntrack_expect_lock);
@@ -63,12 +69,26 @@ EXPORT_SYMBOL_GPL(nf_conntrack_expect_lock);
 struct hlist_nulls_head *nf_conntrack_hash __read_mostly;
 EXPORT_SYMBOL_GPL(nf_conntrack_hash);
 
+/* Table that nf_conntrack_hash_resize() is still moving entries out of.
+ * Lock stripes below nf_conntrack_resize_next have been moved to
+ * nf_conntrack_hash already.
+ */
+static struct hlist_nulls_head *nf_conntrack_hash_old __read_mostly;
+static unsigned int nf_conntrack_htable_size_old __read_mostly;
+static unsigned int nf_conntrack_resize_next;
+
+/* The table is split into nf_conntrack_gc_workers equal ranges, each
+ * scanned by its own work item.  next_bucket is relative to the start of
+ * the range so it stays meaningful across a resize.
+ */
 struct conntrack_gc_work {
 	struct delayed_work	dwork;
+	unsigned int		id;
 	u32			next_bucket;
 	u32			avg_timeout;
 	u32			count;
 	u32			start_time;
+	u32			chain_entries;
 	bool			exiting;
 	bool			early_drop;
 };
@@ -96,10 +116,26 @@ static DEFINE_MUTEX(nf_conntrack_mutex);
 #define GC_SCAN_MAX_DURATION	msecs_to_jiffies(10)
 #define GC_SCAN_EXPIRED_MAX	(64000u / HZ)
 
+/* upper bound for the number of parallel gc workers, must be a power of 2
+ * no larger than CONNTRACK_LOCKS.
+ */
+#define GC_WORKERS_MAX		16u
+
 #define MIN_CHAINLEN	50u
 #define MAX_CHAINLEN	(80u - MIN_CHAINLEN)
 
-static struct conntrack_gc_work conntrack_gc_work;
+/* Autosizing doubles the table once a full gc scan sees more than this
+ * many entries per bucket on average, and halves it when there are less
+ * than one per NF_CT_AUTOSIZE_SHRINK buckets.
+ */
+#define NF_CT_AUTOSIZE_GROW	4u
+#define NF_CT_AUTOSIZE_SHRINK	2u
+
+static struct conntrack_gc_work *conntrack_gc_work __read_mostly;
+static unsigned int nf_conntrack_gc_workers __read_mostly;
+
+static struct work_struct nf_conntrack_autosize_work;
+static unsigned int nf_conntrack_autosize_target;
 
 void nf_conntrack_lock(spinlock_t *lock) __acquires(lock)
 {
@@ -126,36 +162,41 @@ void nf_conntrack_lock(spinlock_t *lock) __acquires(lock)
 }
 EXPORT_SYMBOL_GPL(nf_conntrack_lock);
 
-static void nf_conntrack_double_unlock(unsigned int h1, unsigned int h2)
+/* Map a raw tuple hash to its lock stripe.  This is equal to
+ * nf_conntrack_bucket_lock() of the bucket the hash falls into.
+ */
+static unsigned int nf_conntrack_hash_stripe(u32 hash)
+{
+	return reciprocal_scale(hash, CONNTRACK_LOCKS);
+}
+
+static void nf_conntrack_double_unlock(u32 h1, u32 h2)
 {
-	h1 %= CONNTRACK_LOCKS;
-	h2 %= CONNTRACK_LOCKS;
-	spin_unlock(&nf_conntrack_locks[h1]);
+	h1 = nf_conntrack_hash_stripe(h1);
+	h2 = nf_conntrack_hash_stripe(h2);
+	spin_unlock(&nf_conntrack_locks[h1].lock);
 	if (h1 != h2)
-		spin_unlock(&nf_conntrack_locks[h2]);
+		spin_unlock(&nf_conntrack_locks[h2].lock);
 }
 
-/* return true if we need to recompute hashes (in case hash table was resized) */
-static bool nf_conntrack_double_lock(struct net *net, unsigned int h1,
-				     unsigned int h2, unsigned int sequence)
+/* Lock the buckets of the raw hashes @h1 and @h2.  The lock of an entry
+ * doesn't depend on the table size, so there is no need to recompute the
+ * hashes when a resize is in progress.
+ */
+static void nf_conntrack_double_lock(u32 h1, u32 h2)
 {
-	h1 %= CONNTRACK_LOCKS;
-	h2 %= CONNTRACK_LOCKS;
+	h1 = nf_conntrack_hash_stripe(h1);
+	h2 = nf_conntrack_hash_stripe(h2);
 	if (h1 <= h2) {
-		nf_conntrack_lock(&nf_conntrack_locks[h1]);
+		nf_conntrack_lock(&nf_conntrack_locks[h1].lock);
 		if (h1 != h2)
-			spin_lock_nested(&nf_conntrack_locks[h2],
+			spin_lock_nested(&nf_conntrack_locks[h2].lock,
 					 SINGLE_DEPTH_NESTING);
 	} else {
-		nf_conntrack_lock(&nf_conntrack_locks[h2]);
-		spin_lock_nested(&nf_conntrack_locks[h1],
+		nf_conntrack_lock(&nf_conntrack_locks[h2].lock);
+		spin_lock_nested(&nf_conntrack_locks[h1].lock,
 				 SINGLE_DEPTH_NESTING);
 	}
-	if (read_seqcount_retry(&nf_conntrack_generation, sequence)) {
-		nf_conntrack_double_unlock(h1, h2);
-		return true;
-	}
-	return false;
 }
 
 static void nf_conntrack_all_lock(void)
@@ -176,13 +217,13 @@ static void nf_conntrack_all_lock(void)
 	WRITE_ONCE(nf_conntrack_locks_all, true);
 
 	for (i = 0; i < CONNTRACK_LOCKS; i++) {
-		spin_lock(&nf_conntrack_locks[i]);
+		spin_lock(&nf_conntrack_locks[i].lock);
 
 		/* This spin_unlock provides the "release" to ensure that
 		 * nf_conntrack_locks_all==true is visible to everyone that
 		 * acquired spin_lock(&nf_conntrack_locks[]).
 		 */
-		spin_unlock(&nf_conntrack_locks[i]);
+		spin_unlock(&nf_conntrack_locks[i].lock);
 	}
 }
 
@@ -204,14 +245,35 @@ EXPORT_SYMBOL_GPL(nf_conntrack_htable_size);
 
 unsigned int nf_conntrack_max __read_mostly;
 EXPORT_SYMBOL_GPL(nf_conntrack_max);
+
+/* bounds for automatic table sizing, disabled if max is 0 */
+unsigned int nf_conntrack_buckets_min __read_mostly;
+unsigned int nf_conntrack_buckets_max __read_mostly;
+
+/* see early_drop() */
+u8 nf_conntrack_early_drop_policy __read_mostly;
+
+/* allocate new entries on the node of the input device */
+u8 nf_conntrack_numa_placement __read_mostly;
 seqcount_spinlock_t nf_conntrack_generation __read_mostly;
 static siphash_aligned_key_t nf_conntrack_hash_rnd;
 
+/* Splitting the table into per-zone shards, see hash_conntrack_raw() */
+#define NF_CT_ZONE_SHARDS_MAX	64u
+
+static unsigned int nf_conntrack_zone_shards __read_mostly;
+module_param_named(zone_shards, nf_conntrack_zone_shards, uint, 0444);
+MODULE_PARM_DESC(zone_shards, "Number of hash table regions zones are spread over (power of two, at most 64)");
+
+static unsigned int nf_conntrack_zone_bits __read_mostly;
+
 static u32 hash_conntrack_raw(const struct nf_conntrack_tuple *tuple,
 			      unsigned int zoneid,
 			      const struct net *net)
 {
+	unsigned int bits;
 	siphash_key_t key;
+	u32 hash;
 
 	get_random_once(&nf_conntrack_hash_rnd, sizeof(nf_conntrack_hash_rnd));
 
@@ -220,14 +282,21 @@ static u32 hash_conntrack_raw(const struct nf_conntrack_tuple *tuple,
 	key.key[0] ^= zoneid;
 	key.key[1] ^= net_hash_mix(net);
 
-	return siphash((void *)tuple,
-			offsetofend(struct nf_conntrack_tuple, dst.__nfct_hash_offsetend),
-			&key);
-}
+	hash = siphash((void *)tuple,
+		       offsetofend(struct nf_conntrack_tuple, dst.__nfct_hash_offsetend),
+		       &key);
 
-static u32 scale_hash(u32 hash)
-{
-	return reciprocal_scale(hash, nf_conntrack_htable_size);
+	/* The bucket and the lock stripe are picked from the top bits of
+	 * the hash.  With zone sharding, these come from the zone, so all
+	 * entries of a zone live in their own 1/nf_conntrack_zone_shards of
+	 * the table and of the locks, and are scanned by their own gc
+	 * worker if there are as many.
+	 */
+	bits = nf_conntrack_zone_bits;
+	if (bits)
+		hash = (zoneid << (32 - bits)) | (hash >> bits);
+
+	return hash;
 }
 
 static u32 __hash_conntrack(const struct net *net,
@@ -238,11 +307,45 @@ static u32 __hash_conntrack(const struct net *net,
 	return reciprocal_scale(hash_conntrack_raw(tuple, zoneid, net), size);
 }
 
-static u32 hash_conntrack(const struct net *net,
-			  const struct nf_conntrack_tuple *tuple,
-			  unsigned int zoneid)
+/* Like nf_conntrack_get_ht(), also returns the table a resize is still
+ * moving entries out of, if any, and the generation the tables belong to.
+ * Must be called with rcu read lock held.
+ */
+unsigned int nf_conntrack_get_ht_resize(struct hlist_nulls_head **hash,
+					unsigned int *hsize,
+					struct hlist_nulls_head **old_hash,
+					unsigned int *old_hsize)
+{
+	unsigned int sequence;
+
+	do {
+		sequence = read_seqcount_begin(&nf_conntrack_generation);
+		*hash = nf_conntrack_hash;
+		*hsize = nf_conntrack_htable_size;
+		*old_hash = nf_conntrack_hash_old;
+		*old_hsize = nf_conntrack_htable_size_old;
+	} while (read_seqcount_retry(&nf_conntrack_generation, sequence));
+
+	return sequence;
+}
+EXPORT_SYMBOL_GPL(nf_conntrack_get_ht_resize);
+
+/* Return the chain that holds entries with raw hash @hash.
+ *
+ * Caller must hold the bucket lock of @hash: it prevents
+ * nf_conntrack_hash_resize() from moving this stripe meanwhile.
+ */
+static struct hlist_nulls_head *nf_conntrack_hash_bucket(u32 hash)
 {
-	return scale_hash(hash_conntrack_raw(tuple, zoneid, net));
+	struct hlist_nulls_head *old_hash = READ_ONCE(nf_conntrack_hash_old);
+
+	if (unlikely(old_hash) &&
+	    nf_conntrack_hash_stripe(hash) >= READ_ONCE(nf_conntrack_resize_next))
+		return &old_hash[reciprocal_scale(hash,
+						  nf_conntrack_htable_size_old)];
+
+	return &nf_conntrack_hash[reciprocal_scale(hash,
+						   nf_conntrack_htable_size)];
 }
 
 static bool nf_ct_get_tuple_ports(const struct sk_buff *skb,
@@ -515,6 +618,8 @@ clean_from_lists(struct nf_conn *ct)
 {
 	hlist_nulls_del_rcu(&ct->tuplehash[IP_CT_DIR_ORIGINAL].hnnode);
 	hlist_nulls_del_rcu(&ct->tuplehash[IP_CT_DIR_REPLY].hnnode);
+	nf_ct_wheel_del(ct);
+	nf_ct_zone_index_del(ct);
 
 	/* Destroy all pending expectations */
 	nf_ct_remove_expectations(ct);
@@ -595,6 +700,9 @@ void nf_ct_destroy(struct nf_conntrack *nfct)
 	 */
 	nf_ct_remove_expectations(ct);
 
+	nf_ct_climit_destroy(ct);
+	nf_ct_sk_destroy(ct);
+
 	if (ct->master)
 		nf_ct_put(ct->master);
 
@@ -605,18 +713,15 @@ EXPORT_SYMBOL(nf_ct_destroy);
 static void __nf_ct_delete_from_lists(struct nf_conn *ct)
 {
 	struct net *net = nf_ct_net(ct);
-	unsigned int hash, reply_hash;
-	unsigned int sequence;
+	u32 hash, reply_hash;
 
-	do {
-		sequence = read_seqcount_begin(&nf_conntrack_generation);
-		hash = hash_conntrack(net,
-				      &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple,
-				      nf_ct_zone_id(nf_ct_zone(ct), IP_CT_DIR_ORIGINAL));
-		reply_hash = hash_conntrack(net,
-					   &ct->tuplehash[IP_CT_DIR_REPLY].tuple,
-					   nf_ct_zone_id(nf_ct_zone(ct), IP_CT_DIR_REPLY));
-	} while (nf_conntrack_double_lock(net, hash, reply_hash, sequence));
+	hash = hash_conntrack_raw(&ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple,
+				  nf_ct_zone_id(nf_ct_zone(ct), IP_CT_DIR_ORIGINAL),
+				  net);
+	reply_hash = hash_conntrack_raw(&ct->tuplehash[IP_CT_DIR_REPLY].tuple,
+					nf_ct_zone_id(nf_ct_zone(ct), IP_CT_DIR_REPLY),
+					net);
+	nf_conntrack_double_lock(hash, reply_hash);
 
 	clean_from_lists(ct);
 	nf_conntrack_double_unlock(hash, reply_hash);
@@ -661,6 +766,9 @@ bool nf_ct_delete(struct nf_conn *ct, u32 portid, int report)
 			tstamp->stop -= jiffies_to_nsecs(-timeout);
 	}
 
+	/* the destroy event is the last one to report the counters */
+	nf_ct_acct_sync(ct);
+
 	if (nf_conntrack_event_report(IPCT_DESTROY, ct,
 				    portid, report) < 0) {
 		/* destroy event was not delivered. nf_ct_put will
@@ -729,47 +837,82 @@ static void nf_ct_gc_expired(struct nf_conn *ct)
 	nf_ct_put(ct);
 }
 
-/*
- * Warning :
- * - Caller must take a reference on returned object
- *   and recheck nf_ct_tuple_equal(tuple, &h->tuple)
- */
 static struct nf_conntrack_tuple_hash *
-____nf_conntrack_find(struct net *net, const struct nf_conntrack_zone *zone,
-		      const struct nf_conntrack_tuple *tuple, u32 hash)
+nf_conntrack_find_bucket(struct net *net, const struct nf_conntrack_zone *zone,
+			 const struct nf_conntrack_tuple *tuple,
+			 struct hlist_nulls_head *ct_hash, unsigned int bucket,
+			 bool *restart)
 {
 	struct nf_conntrack_tuple_hash *h;
-	struct hlist_nulls_head *ct_hash;
 	struct hlist_nulls_node *n;
-	unsigned int bucket, hsize;
+	unsigned int depth = 0;
 
-begin:
-	nf_conntrack_get_ht(&ct_hash, &hsize);
-	bucket = reciprocal_scale(hash, hsize);
+	*restart = false;
 
 	hlist_nulls_for_each_entry_rcu(h, n, &ct_hash[bucket], hnnode) {
 		struct nf_conn *ct;
 
+		depth++;
 		ct = nf_ct_tuplehash_to_ctrack(h);
 		if (nf_ct_is_expired(ct)) {
 			nf_ct_gc_expired(ct);
 			continue;
 		}
 
-		if (nf_ct_key_equal(h, tuple, zone, net))
+		if (nf_ct_key_equal(h, tuple, zone, net)) {
+			trace_nf_ct_lookup(bucket, depth, true);
 			return h;
+		}
 	}
+	trace_nf_ct_lookup(bucket, depth, false);
 	/*
 	 * if the nulls value we got at the end of this lookup is
 	 * not the expected one, we must restart lookup.
 	 * We probably met an item that was moved to another chain.
 	 */
-	if (get_nulls_value(n) != bucket) {
+	*restart = get_nulls_value(n) != bucket;
+	return NULL;
+}
+
+/*
+ * Warning :
+ * - Caller must take a reference on returned object
+ *   and recheck nf_ct_tuple_equal(tuple, &h->tuple)
+ */
+static struct nf_conntrack_tuple_hash *
+____nf_conntrack_find(struct net *net, const struct nf_conntrack_zone *zone,
+		      const struct nf_conntrack_tuple *tuple, u32 hash)
+{
+	struct hlist_nulls_head *ct_hash, *old_hash;
+	struct nf_conntrack_tuple_hash *h;
+	unsigned int hsize, old_hsize;
+	bool restart;
+
+begin:
+	nf_conntrack_get_ht_resize(&ct_hash, &hsize, &old_hash, &old_hsize);
+
+	/* Resize moves entries from the old table to the new one, search
+	 * the old table first so we don't miss an entry moved meanwhile.
+	 */
+	if (unlikely(old_hash)) {
+		h = nf_conntrack_find_bucket(net, zone, tuple, old_hash,
+					     reciprocal_scale(hash, old_hsize),
+					     &restart);
+		if (h)
+			return h;
+		if (restart)
+			goto restart;
+	}
+
+	h = nf_conntrack_find_bucket(net, zone, tuple, ct_hash,
+				     reciprocal_scale(hash, hsize), &restart);
+	if (unlikely(restart)) {
+restart:
 		NF_CT_STAT_INC_ATOMIC(net, search_restart);
 		goto begin;
 	}
 
-	return NULL;
+	return h;
 }
 
 /* Find a connection corresponding to a tuple. */
@@ -829,14 +972,41 @@ nf_conntrack_find_get(struct net *net, const struct nf_conntrack_zone *zone,
 }
 EXPORT_SYMBOL_GPL(nf_conntrack_find_get);
 
+/* Like nf_conntrack_find_get() without taking a reference, for callers
+ * holding rcu_read_lock that only read a few fields of the entry.  It can
+ * be freed and recycled meanwhile: they have to check its key again once
+ * done reading it.
+ */
+struct nf_conntrack_tuple_hash *
+nf_conntrack_find_rcu(struct net *net, const struct nf_conntrack_zone *zone,
+		      const struct nf_conntrack_tuple *tuple)
+{
+	unsigned int rid, zone_id = nf_ct_zone_id(zone, IP_CT_DIR_ORIGINAL);
+	struct nf_conntrack_tuple_hash *thash;
+
+	thash = ____nf_conntrack_find(net, zone, tuple,
+				      hash_conntrack_raw(tuple, zone_id, net));
+	if (thash)
+		return thash;
+
+	rid = nf_ct_zone_id(zone, IP_CT_DIR_REPLY);
+	if (rid != zone_id)
+		thash = ____nf_conntrack_find(net, zone, tuple,
+					      hash_conntrack_raw(tuple, rid, net));
+	return thash;
+}
+EXPORT_SYMBOL_GPL(nf_conntrack_find_rcu);
+
 static void __nf_conntrack_hash_insert(struct nf_conn *ct,
-				       unsigned int hash,
-				       unsigned int reply_hash)
+				       struct hlist_nulls_head *head,
+				       struct hlist_nulls_head *reply_head)
 {
 	hlist_nulls_add_head_rcu(&ct->tuplehash[IP_CT_DIR_ORIGINAL].hnnode,
-			   &nf_conntrack_hash[hash]);
+				 head);
 	hlist_nulls_add_head_rcu(&ct->tuplehash[IP_CT_DIR_REPLY].hnnode,
-			   &nf_conntrack_hash[reply_hash]);
+				 reply_head);
+	nf_ct_wheel_add(ct);
+	nf_ct_zone_index_add(ct);
 }
 
 static bool nf_ct_ext_valid_pre(const struct nf_ct_ext *ext)
@@ -869,14 +1039,14 @@ static bool nf_ct_ext_valid_post(struct nf_ct_ext *ext)
 int
 nf_conntrack_hash_check_insert(struct nf_conn *ct)
 {
+	struct hlist_nulls_head *head, *reply_head;
 	const struct nf_conntrack_zone *zone;
 	struct net *net = nf_ct_net(ct);
-	unsigned int hash, reply_hash;
 	struct nf_conntrack_tuple_hash *h;
 	struct hlist_nulls_node *n;
 	unsigned int max_chainlen;
 	unsigned int chainlen = 0;
-	unsigned int sequence;
+	u32 hash, reply_hash;
 	int err = -EEXIST;
 
 	zone = nf_ct_zone(ct);
@@ -884,21 +1054,20 @@ nf_conntrack_hash_check_insert(struct nf_conn *ct)
 	if (!nf_ct_ext_valid_pre(ct->ext))
 		return -EAGAIN;
 
-	local_bh_disable();
-	do {
-		sequence = read_seqcount_begin(&nf_conntrack_generation);
-		hash = hash_conntrack(net,
-				      &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple,
-				      nf_ct_zone_id(nf_ct_zone(ct), IP_CT_DIR_ORIGINAL));
-		reply_hash = hash_conntrack(net,
-					   &ct->tuplehash[IP_CT_DIR_REPLY].tuple,
-					   nf_ct_zone_id(nf_ct_zone(ct), IP_CT_DIR_REPLY));
-	} while (nf_conntrack_double_lock(net, hash, reply_hash, sequence));
-
 	max_chainlen = MIN_CHAINLEN + get_random_u32_below(MAX_CHAINLEN);
 
+	hash = hash_conntrack_raw(&ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple,
+				  nf_ct_zone_id(zone, IP_CT_DIR_ORIGINAL), net);
+	reply_hash = hash_conntrack_raw(&ct->tuplehash[IP_CT_DIR_REPLY].tuple,
+					nf_ct_zone_id(zone, IP_CT_DIR_REPLY), net);
+
+	local_bh_disable();
+	nf_conntrack_double_lock(hash, reply_hash);
+	head = nf_conntrack_hash_bucket(hash);
+	reply_head = nf_conntrack_hash_bucket(reply_hash);
+
 	/* See if there's one in the list already, including reverse */
-	hlist_nulls_for_each_entry(h, n, &nf_conntrack_hash[hash], hnnode) {
+	hlist_nulls_for_each_entry(h, n, head, hnnode) {
 		if (nf_ct_key_equal(h, &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple,
 				    zone, net))
 			goto out;
@@ -909,7 +1078,7 @@ nf_conntrack_hash_check_insert(struct nf_conn *ct)
 
 	chainlen = 0;
 
-	hlist_nulls_for_each_entry(h, n, &nf_conntrack_hash[reply_hash], hnnode) {
+	hlist_nulls_for_each_entry(h, n, reply_head, hnnode) {
 		if (nf_ct_key_equal(h, &ct->tuplehash[IP_CT_DIR_REPLY].tuple,
 				    zone, net))
 			goto out;
@@ -932,7 +1101,7 @@ nf_conntrack_hash_check_insert(struct nf_conn *ct)
 	smp_wmb();
 	/* The caller holds a reference to this object */
 	refcount_set(&ct->ct_general.use, 2);
-	__nf_conntrack_hash_insert(ct, hash, reply_hash);
+	__nf_conntrack_hash_insert(ct, head, reply_head);
 	nf_conntrack_double_unlock(hash, reply_hash);
 	NF_CT_STAT_INC(net, insert);
 	local_bh_enable();
@@ -948,6 +1117,117 @@ nf_conntrack_hash_check_insert(struct nf_conn *ct)
 }
 EXPORT_SYMBOL_GPL(nf_conntrack_hash_check_insert);
 
+#ifdef CONFIG_NF_CONNTRACK_ACCT_PCPU
+/* Once a connection sees NF_CT_ACCT_PCPU_THRESH packets per second in
+ * one direction, its counters are updated per cpu and folded into the
+ * shared ones every NF_CT_ACCT_PCPU_BATCH packets, so that a flow spread
+ * over several cpus doesn't bounce a cache line per packet.  Datapath
+ * readers are off by at most NF_CT_ACCT_PCPU_BATCH packets per cpu,
+ * ctnetlink and procfs fold the pending counts before reading.
+ *
+ * The per-cpu counters cost a nf_conn_acct on every possible cpu, at most
+ * NF_CT_ACCT_PCPU_MAX entries of a netns get them.
+ */
+#define NF_CT_ACCT_PCPU_THRESH	1024	/* power of two */
+#define NF_CT_ACCT_PCPU_BATCH	64
+#define NF_CT_ACCT_PCPU_MAX	1024
+
+static void nf_ct_acct_fold(struct nf_conn_counter *counter,
+			    struct nf_conn_counter *pending)
+{
+	atomic64_add(atomic64_xchg(&pending->packets, 0), &counter->packets);
+	atomic64_add(atomic64_xchg(&pending->bytes, 0), &counter->bytes);
+}
+
+static bool nf_ct_acct_add_pcpu(struct nf_conn *ct, struct nf_conn_acct *acct,
+				u32 dir, unsigned int packets,
+				unsigned int bytes)
+{
+	struct nf_conn_acct __percpu *pcpu = READ_ONCE(ct->acct_pcpu);
+	struct nf_conn_counter *pending;
+
+	if (!pcpu)
+		return false;
+
+	pending = &this_cpu_ptr(pcpu)->counter[dir];
+	atomic64_add(bytes, &pending->bytes);
+	if (atomic64_add_return(packets, &pending->packets) >=
+	    NF_CT_ACCT_PCPU_BATCH)
+		nf_ct_acct_fold(&acct->counter[dir], pending);
+
+	return true;
+}
+
+/* Called with the packet count of a direction, checks the rate each time
+ * it crosses a multiple of NF_CT_ACCT_PCPU_THRESH.
+ */
+static void nf_ct_acct_promote(struct nf_conn *ct, u64 packets,
+			       unsigned int added)
+{
+	struct nf_conn_acct __percpu *pcpu;
+	struct nf_conntrack_net *cnet;
+	u32 now, stamp;
+
+	if ((packets ^ (packets - added)) < NF_CT_ACCT_PCPU_THRESH)
+		return;
+
+	now = nfct_time_stamp;
+	stamp = xchg(&ct->acct_stamp, now);
+	if (!stamp || now - stamp > HZ || READ_ONCE(ct->acct_pcpu))
+		return;
+
+	cnet = nf_ct_pernet(nf_ct_net(ct));
+	if (atomic_inc_return(&cnet->acct_pcpu) > NF_CT_ACCT_PCPU_MAX)
+		goto err_dec;
+
+	pcpu = alloc_percpu_gfp(struct nf_conn_acct, GFP_ATOMIC | __GFP_NOWARN);
+	if (!pcpu)
+		goto err_dec;
+
+	if (cmpxchg(&ct->acct_pcpu, NULL, pcpu)) {
+		free_percpu(pcpu);
+		goto err_dec;
+	}
+	return;
+
+err_dec:
+	atomic_dec(&cnet->acct_pcpu);
+}
+
+void nf_ct_acct_sync(const struct nf_conn *ct)
+{
+	struct nf_conn_acct __percpu *pcpu = READ_ONCE(ct->acct_pcpu);
+	struct nf_conn_acct *acct;
+	int cpu, dir;
+
+	if (!pcpu)
+		return;
+
+	acct = nf_conn_acct_find(ct);
+	if (!acct)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		for (dir = 0; dir < IP_CT_DIR_MAX; dir++)
+			nf_ct_acct_fold(&acct->counter[dir],
+					&per_cpu_ptr(pcpu, cpu)->counter[dir]);
+	}
+}
+EXPORT_SYMBOL_GPL(nf_ct_acct_sync);
+#else
+static bool nf_ct_acct_add_pcpu(struct nf_conn *ct, struct nf_conn_acct *acct,
+				u32 dir, unsigned int packets,
+				unsigned int bytes)
+{
+	return false;
+}
+
+static void nf_ct_acct_promote(struct nf_conn *ct, u64 packets,
+			       unsigned int added)
+{
+}
+#endif
+
 void nf_ct_acct_add(struct nf_conn *ct, u32 dir, unsigned int packets,
 		    unsigned int bytes)
 {
@@ -957,8 +1237,13 @@ void nf_ct_acct_add(struct nf_conn *ct, u32 dir, unsigned int packets,
 	if (acct) {
 		struct nf_conn_counter *counter = acct->counter;
 
-		atomic64_add(packets, &counter[dir].packets);
+		if (nf_ct_acct_add_pcpu(ct, acct, dir, packets, bytes))
+			return;
+
 		atomic64_add(bytes, &counter[dir].bytes);
+		nf_ct_acct_promote(ct, atomic64_add_return(packets,
+							   &counter[dir].packets),
+				   packets);
 	}
 }
 EXPORT_SYMBOL_GPL(nf_ct_acct_add);
@@ -1062,6 +1347,7 @@ static int __nf_ct_resolve_clash(struct sk_buff *skb,
 		nf_ct_set(skb, ct, ctinfo);
 
 		NF_CT_STAT_INC(net, clash_resolve);
+		NF_CT_STAT_INC(net, clash_merge);
 		return NF_ACCEPT;
 	}
 
@@ -1072,7 +1358,7 @@ static int __nf_ct_resolve_clash(struct sk_buff *skb,
  * nf_ct_resolve_clash_harder - attempt to insert clashing conntrack entry
  *
  * @skb: skb that causes the collision
- * @repl_idx: hash slot for reply direction
+ * @repl_head: hash chain for reply direction
  *
  * Called when origin or reply direction had a clash.
  * The skb can be handled without packet drop provided the reply direction
@@ -1083,7 +1369,8 @@ static int __nf_ct_resolve_clash(struct sk_buff *skb,
  *
  * Returns NF_DROP if the clash could not be handled.
  */
-static int nf_ct_resolve_clash_harder(struct sk_buff *skb, u32 repl_idx)
+static int nf_ct_resolve_clash_harder(struct sk_buff *skb,
+				      struct hlist_nulls_head *repl_head)
 {
 	struct nf_conn *loser_ct = (struct nf_conn *)skb_nfct(skb);
 	const struct nf_conntrack_zone *zone;
@@ -1097,7 +1384,7 @@ static int nf_ct_resolve_clash_harder(struct sk_buff *skb, u32 repl_idx)
 	/* Reply direction must never result in a clash, unless both origin
 	 * and reply tuples are identical.
 	 */
-	hlist_nulls_for_each_entry(h, n, &nf_conntrack_hash[repl_idx], hnnode) {
+	hlist_nulls_for_each_entry(h, n, repl_head, hnnode) {
 		if (nf_ct_key_equal(h,
 				    &loser_ct->tuplehash[IP_CT_DIR_REPLY].tuple,
 				    zone, net))
@@ -1123,9 +1410,12 @@ static int nf_ct_resolve_clash_harder(struct sk_buff *skb, u32 repl_idx)
 	hlist_nulls_add_fake(&loser_ct->tuplehash[IP_CT_DIR_ORIGINAL].hnnode);
 
 	hlist_nulls_add_head_rcu(&loser_ct->tuplehash[IP_CT_DIR_REPLY].hnnode,
-				 &nf_conntrack_hash[repl_idx]);
+				 repl_head);
+	nf_ct_wheel_add(loser_ct);
+	nf_ct_zone_index_add(loser_ct);
 
 	NF_CT_STAT_INC(net, clash_resolve);
+	NF_CT_STAT_INC(net, clash_harder);
 	return NF_ACCEPT;
 }
 
@@ -1134,7 +1424,8 @@ static int nf_ct_resolve_clash_harder(struct sk_buff *skb, u32 repl_idx)
  *
  * @skb: skb that causes the clash
  * @h: tuplehash of the clashing entry already in table
- * @reply_hash: hash slot for reply direction
+ * @reply_head: hash chain for reply direction
+ * @reply_clash: @h was found in @reply_head
  *
  * A conntrack entry can be inserted to the connection tracking table
  * if there is no existing entry with an identical tuple.
@@ -1158,13 +1449,15 @@ static int nf_ct_resolve_clash_harder(struct sk_buff *skb, u32 repl_idx)
  * The new entry will be added only in the non-clashing REPLY direction,
  * so packets in the ORIGINAL direction will continue to match the existing
  * entry.  The new entry will also have a fixed timeout so it expires --
- * due to the collision, it will only see reply traffic.
+ * due to the collision, it will only see reply traffic.  This isn't
+ * possible if the clash was found in the REPLY direction already, then
+ * rescanning the reply chain is skipped.
  *
  * Returns NF_DROP if the clash could not be resolved.
  */
 static __cold noinline int
 nf_ct_resolve_clash(struct sk_buff *skb, struct nf_conntrack_tuple_hash *h,
-		    u32 reply_hash)
+		    struct hlist_nulls_head *reply_head, bool reply_clash)
 {
 	/* This is the conntrack entry already in hashes that won race. */
 	struct nf_conn *ct = nf_ct_tuplehash_to_ctrack(h);
@@ -1185,11 +1478,14 @@ nf_ct_resolve_clash(struct sk_buff *skb, struct nf_conntrack_tuple_hash *h,
 	if (ret == NF_ACCEPT)
 		return ret;
 
-	ret = nf_ct_resolve_clash_harder(skb, reply_hash);
-	if (ret == NF_ACCEPT)
-		return ret;
+	if (!reply_clash) {
+		ret = nf_ct_resolve_clash_harder(skb, reply_head);
+		if (ret == NF_ACCEPT)
+			return ret;
+	}
 
 drop:
+	NF_CT_STAT_INC(net, clash_drop);
 	NF_CT_STAT_INC(net, drop);
 	NF_CT_STAT_INC(net, insert_failed);
 	return NF_DROP;
@@ -1199,14 +1495,16 @@ nf_ct_resolve_clash(struct sk_buff *skb, struct nf_conntrack_tuple_hash *h,
 int
 __nf_conntrack_confirm(struct sk_buff *skb)
 {
-	unsigned int chainlen = 0, sequence, max_chainlen;
+	struct hlist_nulls_head *head, *reply_head;
+	unsigned int chainlen = 0, max_chainlen;
 	const struct nf_conntrack_zone *zone;
-	unsigned int hash, reply_hash;
 	struct nf_conntrack_tuple_hash *h;
+	u32 hash, reply_hash;
 	struct nf_conn *ct;
 	struct nf_conn_help *help;
 	struct hlist_nulls_node *n;
 	enum ip_conntrack_info ctinfo;
+	bool reply_clash = false;
 	struct net *net;
 	int ret = NF_DROP;
 
@@ -1221,17 +1519,21 @@ __nf_conntrack_confirm(struct sk_buff *skb)
 		return NF_ACCEPT;
 
 	zone = nf_ct_zone(ct);
-	local_bh_disable();
 
-	do {
-		sequence = read_seqcount_begin(&nf_conntrack_generation);
-		/* reuse the hash saved before */
-		hash = *(unsigned long *)&ct->tuplehash[IP_CT_DIR_REPLY].hnnode.pprev;
-		hash = scale_hash(hash);
-		reply_hash = hash_conntrack(net,
-					   &ct->tuplehash[IP_CT_DIR_REPLY].tuple,
-					   nf_ct_zone_id(nf_ct_zone(ct), IP_CT_DIR_REPLY));
-	} while (nf_conntrack_double_lock(net, hash, reply_hash, sequence));
+	/* Pick the chain length limit before taking the bucket locks,
+	 * they are the most contended ones for new connections.
+	 */
+	max_chainlen = MIN_CHAINLEN + get_random_u32_below(MAX_CHAINLEN);
+
+	/* reuse the hash saved before */
+	hash = *(unsigned long *)&ct->tuplehash[IP_CT_DIR_REPLY].hnnode.pprev;
+	reply_hash = hash_conntrack_raw(&ct->tuplehash[IP_CT_DIR_REPLY].tuple,
+					nf_ct_zone_id(zone, IP_CT_DIR_REPLY), net);
+
+	local_bh_disable();
+	nf_conntrack_double_lock(hash, reply_hash);
+	head = nf_conntrack_hash_bucket(hash);
+	reply_head = nf_conntrack_hash_bucket(reply_hash);
 
 	/* We're not in hash table, and we refuse to set up related
 	 * connections for unconfirmed conns.  But packet copies and
@@ -1267,11 +1569,10 @@ __nf_conntrack_confirm(struct sk_buff *skb)
 		goto dying;
 	}
 
-	max_chainlen = MIN_CHAINLEN + get_random_u32_below(MAX_CHAINLEN);
 	/* See if there's one in the list already, including reverse:
 	   NAT could have grabbed it without realizing, since we're
 	   not in the hash.  If there is, we lost race. */
-	hlist_nulls_for_each_entry(h, n, &nf_conntrack_hash[hash], hnnode) {
+	hlist_nulls_for_each_entry(h, n, head, hnnode) {
 		if (nf_ct_key_equal(h, &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple,
 				    zone, net))
 			goto out;
@@ -1280,10 +1581,10 @@ __nf_conntrack_confirm(struct sk_buff *skb)
 	}
 
 	chainlen = 0;
-	hlist_nulls_for_each_entry(h, n, &nf_conntrack_hash[reply_hash], hnnode) {
+	hlist_nulls_for_each_entry(h, n, reply_head, hnnode) {
 		if (nf_ct_key_equal(h, &ct->tuplehash[IP_CT_DIR_REPLY].tuple,
 				    zone, net))
-			goto out;
+			goto out_reply;
 		if (chainlen++ > max_chainlen) {
 chaintoolong:
 			NF_CT_STAT_INC(net, chaintoolong);
@@ -1305,7 +1606,7 @@ __nf_conntrack_confirm(struct sk_buff *skb)
 	 * guarantee that no other CPU can find the conntrack before the above
 	 * stores are visible.
 	 */
-	__nf_conntrack_hash_insert(ct, hash, reply_hash);
+	__nf_conntrack_hash_insert(ct, head, reply_head);
 	nf_conntrack_double_unlock(hash, reply_hash);
 	local_bh_enable();
 
@@ -1327,8 +1628,10 @@ __nf_conntrack_confirm(struct sk_buff *skb)
 				 IPCT_RELATED : IPCT_NEW, ct);
 	return NF_ACCEPT;
 
+out_reply:
+	reply_clash = true;
 out:
-	ret = nf_ct_resolve_clash(skb, h, reply_hash);
+	ret = nf_ct_resolve_clash(skb, h, reply_head, reply_clash);
 dying:
 	nf_conntrack_double_unlock(hash, reply_hash);
 	local_bh_enable();
@@ -1336,28 +1639,21 @@ __nf_conntrack_confirm(struct sk_buff *skb)
 }
 EXPORT_SYMBOL_GPL(__nf_conntrack_confirm);
 
-/* Returns true if a connection corresponds to the tuple (required
-   for NAT). */
-int
-nf_conntrack_tuple_taken(const struct nf_conntrack_tuple *tuple,
-			 const struct nf_conn *ignored_conntrack)
+static int
+nf_conntrack_tuple_taken_bucket(const struct nf_conntrack_tuple *tuple,
+				const struct nf_conn *ignored_conntrack,
+				struct hlist_nulls_head *ct_hash,
+				unsigned int bucket)
 {
 	struct net *net = nf_ct_net(ignored_conntrack);
 	const struct nf_conntrack_zone *zone;
 	struct nf_conntrack_tuple_hash *h;
-	struct hlist_nulls_head *ct_hash;
-	unsigned int hash, hsize;
 	struct hlist_nulls_node *n;
 	struct nf_conn *ct;
 
 	zone = nf_ct_zone(ignored_conntrack);
 
-	rcu_read_lock();
- begin:
-	nf_conntrack_get_ht(&ct_hash, &hsize);
-	hash = __hash_conntrack(net, tuple, nf_ct_zone_id(zone, IP_CT_DIR_REPLY), hsize);
-
-	hlist_nulls_for_each_entry_rcu(h, n, &ct_hash[hash], hnnode) {
+	hlist_nulls_for_each_entry_rcu(h, n, &ct_hash[bucket], hnnode) {
 		ct = nf_ct_tuplehash_to_ctrack(h);
 
 		if (ct == ignored_conntrack)
@@ -1387,23 +1683,67 @@ nf_conntrack_tuple_taken(const struct nf_conntrack_tuple *tuple,
 				continue;
 
 			NF_CT_STAT_INC_ATOMIC(net, found);
-			rcu_read_unlock();
 			return 1;
 		}
 	}
 
-	if (get_nulls_value(n) != hash) {
+	if (get_nulls_value(n) != bucket)
+		return -EAGAIN;
+
+	return 0;
+}
+
+/* Returns true if a connection corresponds to the tuple (required
+   for NAT). */
+int
+nf_conntrack_tuple_taken(const struct nf_conntrack_tuple *tuple,
+			 const struct nf_conn *ignored_conntrack)
+{
+	struct net *net = nf_ct_net(ignored_conntrack);
+	struct hlist_nulls_head *ct_hash, *old_hash;
+	const struct nf_conntrack_zone *zone;
+	unsigned int hsize, old_hsize;
+	u32 hash;
+	int ret;
+
+	zone = nf_ct_zone(ignored_conntrack);
+	hash = hash_conntrack_raw(tuple, nf_ct_zone_id(zone, IP_CT_DIR_REPLY), net);
+
+	rcu_read_lock();
+ begin:
+	nf_conntrack_get_ht_resize(&ct_hash, &hsize, &old_hash, &old_hsize);
+
+	ret = 0;
+	if (unlikely(old_hash))
+		ret = nf_conntrack_tuple_taken_bucket(tuple, ignored_conntrack,
+						      old_hash,
+						      reciprocal_scale(hash, old_hsize));
+	if (ret == 0)
+		ret = nf_conntrack_tuple_taken_bucket(tuple, ignored_conntrack,
+						      ct_hash,
+						      reciprocal_scale(hash, hsize));
+	if (ret < 0) {
 		NF_CT_STAT_INC_ATOMIC(net, search_restart);
 		goto begin;
 	}
 
 	rcu_read_unlock();
 
-	return 0;
+	return ret;
 }
 EXPORT_SYMBOL_GPL(nf_conntrack_tuple_taken);
 
 #define NF_CT_EVICTION_RANGE	8
+#define NF_CT_EVICTION_SAMPLES	16
+
+enum nf_ct_eviction_policy {
+	/* unassured entries in the buckets following the new one */
+	NF_CT_EVICT_NEIGHBOURS,
+	/* best candidate from randomly sampled buckets */
+	NF_CT_EVICT_SAMPLED,
+	/* like NF_CT_EVICT_SAMPLED, but only from the zone of the new entry */
+	NF_CT_EVICT_SAMPLED_ZONE,
+};
 
 /* There's a small race here where we may free a just-assured
    connection.  Too bad: we're in trouble anyway. */
@@ -1452,10 +1792,122 @@ static unsigned int early_drop_list(struct net *net,
 	return drops;
 }
 
-static noinline int early_drop(struct net *net, unsigned int hash)
+/* Higher is a better victim, 0 means the entry must not be evicted. */
+static unsigned int early_drop_rank(const struct nf_conn *ct)
+{
+	const struct nf_conntrack_l4proto *l4proto;
+
+	if (!test_bit(IPS_SEEN_REPLY_BIT, &ct->status))
+		return 3;
+
+	if (!test_bit(IPS_ASSURED_BIT, &ct->status))
+		return 2;
+
+	l4proto = nf_ct_l4proto_find(nf_ct_protonum(ct));
+	if (l4proto->can_early_drop && l4proto->can_early_drop(ct))
+		return 1;
+
+	return 0;
+}
+
+/* Pick one victim out of NF_CT_EVICTION_SAMPLES random buckets: entries
+ * that never saw a reply first, then unassured ones, then those the l4
+ * tracker considers closing.  Entries of the zone the new entry belongs
+ * to are preferred, and with @zone_only nothing else is evictable, so a
+ * zone under attack can only evict its own entries.  Ties go to the entry
+ * closest to its timeout.
+ */
+static bool early_drop_sampled(struct net *net,
+			       const struct nf_conntrack_zone *zone,
+			       bool zone_only)
+{
+	unsigned int i, best_score = 0;
+	long best_expires = LONG_MAX;
+	struct nf_conn *victim = NULL;
+	struct hlist_nulls_head *ct_hash;
+	unsigned int hsize;
+	bool dropped;
+
+	rcu_read_lock();
+	nf_conntrack_get_ht(&ct_hash, &hsize);
+
+	for (i = 0; i < NF_CT_EVICTION_SAMPLES; i++) {
+		unsigned int bucket = get_random_u32_below(hsize);
+		struct nf_conntrack_tuple_hash *h;
+		struct hlist_nulls_node *n;
+
+		hlist_nulls_for_each_entry_rcu(h, n, &ct_hash[bucket], hnnode) {
+			struct nf_conn *tmp = nf_ct_tuplehash_to_ctrack(h);
+			unsigned int score;
+			bool same_zone;
+			long expires;
+
+			if (nf_ct_is_expired(tmp)) {
+				nf_ct_gc_expired(tmp);
+				continue;
+			}
+
+			if (!net_eq(nf_ct_net(tmp), net) ||
+			    !nf_ct_is_confirmed(tmp) ||
+			    nf_ct_is_dying(tmp))
+				continue;
+
+			same_zone = nf_ct_zone_equal_any(tmp, zone);
+			if (zone_only && !same_zone)
+				continue;
+
+			score = early_drop_rank(tmp);
+			if (!score)
+				continue;
+
+			score = score * 2 + same_zone;
+			expires = nf_ct_expires(tmp);
+			if (score < best_score ||
+			    (score == best_score && expires >= best_expires))
+				continue;
+
+			best_score = score;
+			best_expires = expires;
+			victim = tmp;
+		}
+	}
+
+	if (!victim || !refcount_inc_not_zero(&victim->ct_general.use)) {
+		rcu_read_unlock();
+		return false;
+	}
+	rcu_read_unlock();
+
+	/* load ->ct_net and ->status after refcount increase */
+	smp_acquire__after_ctrl_dep();
+
+	/* recheck, the object might have been reused meanwhile */
+	dropped = net_eq(nf_ct_net(victim), net) &&
+		  nf_ct_is_confirmed(victim) &&
+		  (!zone_only || nf_ct_zone_equal_any(victim, zone)) &&
+		  early_drop_rank(victim) &&
+		  nf_ct_delete(victim, 0, 0);
+	nf_ct_put(victim);
+
+	if (dropped)
+		NF_CT_STAT_INC_ATOMIC(net, early_drop);
+
+	return dropped;
+}
+
+static noinline int early_drop(struct net *net,
+			       const struct nf_conntrack_zone *zone,
+			       unsigned int hash)
 {
 	unsigned int i, bucket;
 
+	switch (READ_ONCE(nf_conntrack_early_drop_policy)) {
+	case NF_CT_EVICT_SAMPLED:
+		return early_drop_sampled(net, zone, false);
+	case NF_CT_EVICT_SAMPLED_ZONE:
+		return early_drop_sampled(net, zone, true);
+	}
+
 	for (i = 0; i < NF_CT_EVICTION_RANGE; i++) {
 		struct hlist_nulls_head *ct_hash;
 		unsigned int hsize, drops;
@@ -1499,13 +1951,66 @@ static bool gc_worker_can_early_drop(const struct nf_conn *ct)
 	return false;
 }
 
-static void gc_worker(struct work_struct *work)
+static void nf_conntrack_autosize_work_fn(struct work_struct *work)
 {
-	unsigned int i, hashsz, nf_conntrack_max95 = 0;
-	u32 end_time, start_time = nfct_time_stamp;
-	struct conntrack_gc_work *gc_work;
-	unsigned int expired_count = 0;
-	unsigned long next_run;
+	unsigned int old_size = READ_ONCE(nf_conntrack_htable_size);
+	unsigned int target = READ_ONCE(nf_conntrack_autosize_target);
+
+	if (nf_conntrack_hash_resize(target))
+		return;
+
+	if (nf_conntrack_htable_size > old_size)
+		NF_CT_STAT_INC_ATOMIC(&init_net, buckets_grow);
+	else if (nf_conntrack_htable_size < old_size)
+		NF_CT_STAT_INC_ATOMIC(&init_net, buckets_shrink);
+}
+
+/* Called at the end of a full gc scan of @scanned buckets of a table of
+ * @hashsz buckets that found @entries tuplehash nodes.
+ */
+static void nf_conntrack_autosize(unsigned int entries, unsigned int scanned,
+				  unsigned int hashsz)
+{
+	unsigned int size_max = READ_ONCE(nf_conntrack_buckets_max);
+	unsigned int size_min = READ_ONCE(nf_conntrack_buckets_min);
+	u64 target = 0;
+
+	if (!size_max)
+		return;
+
+	size_max = max_t(unsigned int, size_max, CONNTRACK_LOCKS);
+	size_min = clamp_t(unsigned int, size_min, CONNTRACK_LOCKS, size_max);
+
+	if (entries > (u64)scanned * NF_CT_AUTOSIZE_GROW && hashsz < size_max)
+		target = min_t(u64, (u64)hashsz * 2, size_max);
+	else if (entries < scanned / NF_CT_AUTOSIZE_SHRINK && hashsz > size_min)
+		target = max(hashsz / 2, size_min);
+
+	if (!target)
+		return;
+
+	WRITE_ONCE(nf_conntrack_autosize_target, target);
+	queue_work(system_unbound_wq, &nf_conntrack_autosize_work);
+}
+
+static void gc_worker_set_early_drop(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < nf_conntrack_gc_workers; i++) {
+		if (!conntrack_gc_work[i].early_drop)
+			conntrack_gc_work[i].early_drop = true;
+	}
+}
+
+static void gc_worker(struct work_struct *work)
+{
+	unsigned int i, hashsz, range, first, nf_conntrack_max95 = 0;
+	u32 end_time, start_time = nfct_time_stamp;
+	unsigned int scanned = 0, evicted = 0;
+	struct conntrack_gc_work *gc_work;
+	unsigned int expired_count = 0;
+	unsigned long next_run;
 	s32 delta_time;
 	long count;
 
@@ -1519,6 +2024,7 @@ static void gc_worker(struct work_struct *work)
 		gc_work->avg_timeout = GC_SCAN_INTERVAL_INIT;
 		gc_work->count = GC_SCAN_INITIAL_COUNT;
 		gc_work->start_time = start_time;
+		gc_work->chain_entries = 0;
 	}
 
 	next_run = gc_work->avg_timeout;
@@ -1535,17 +2041,21 @@ static void gc_worker(struct work_struct *work)
 		rcu_read_lock();
 
 		nf_conntrack_get_ht(&ct_hash, &hashsz);
-		if (i >= hashsz) {
+		range = hashsz / nf_conntrack_gc_workers;
+		if (i >= range) {
 			rcu_read_unlock();
 			break;
 		}
+		first = range * gc_work->id;
 
-		hlist_nulls_for_each_entry_rcu(h, n, &ct_hash[i], hnnode) {
+		hlist_nulls_for_each_entry_rcu(h, n, &ct_hash[first + i], hnnode) {
 			struct nf_conntrack_net *cnet;
 			struct net *net;
 			long expires;
 
 			tmp = nf_ct_tuplehash_to_ctrack(h);
+			gc_work->chain_entries++;
+			scanned++;
 
 			if (expired_count > GC_SCAN_EXPIRED_MAX) {
 				rcu_read_unlock();
@@ -1567,6 +2077,8 @@ static void gc_worker(struct work_struct *work)
 				continue;
 			}
 
+			nf_ct_sk_gc(tmp);
+
 			expires = clamp(nf_ct_expires(tmp), GC_SCAN_INTERVAL_MIN, GC_SCAN_INTERVAL_CLAMP);
 			expires = (expires - (long)next_run) / ++count;
 			next_run += expires;
@@ -1576,7 +2088,7 @@ static void gc_worker(struct work_struct *work)
 
 			net = nf_ct_net(tmp);
 			cnet = nf_ct_pernet(net);
-			if (atomic_read(&cnet->count) < nf_conntrack_max95)
+			if (percpu_counter_read_positive(&cnet->count) < nf_conntrack_max95)
 				continue;
 
 			/* need to take reference to avoid possible races */
@@ -1594,6 +2106,7 @@ static void gc_worker(struct work_struct *work)
 			if (gc_worker_can_early_drop(tmp)) {
 				nf_ct_kill(tmp);
 				expired_count++;
+				evicted++;
 			}
 
 			nf_ct_put(tmp);
@@ -1608,17 +2121,25 @@ static void gc_worker(struct work_struct *work)
 		i++;
 
 		delta_time = nfct_time_stamp - end_time;
-		if (delta_time > 0 && i < hashsz) {
+		if (delta_time > 0 && i < range) {
 			gc_work->avg_timeout = next_run;
 			gc_work->count = count;
 			gc_work->next_bucket = i;
 			next_run = 0;
 			goto early_exit;
 		}
-	} while (i < hashsz);
+	} while (i < range);
 
 	gc_work->next_bucket = 0;
 
+	/* the expiry wheel takes care of timed out entries */
+	if (nf_ct_wheel_enabled() && !gc_work->early_drop)
+		next_run = GC_SCAN_INTERVAL_MAX;
+
+	/* the ranges are equally sized, one of them is a good enough sample */
+	if (gc_work->id == 0)
+		nf_conntrack_autosize(gc_work->chain_entries, range, hashsz);
+
 	next_run = clamp(next_run, GC_SCAN_INTERVAL_MIN, GC_SCAN_INTERVAL_MAX);
 
 	delta_time = max_t(s32, nfct_time_stamp - gc_work->start_time, 1);
@@ -1628,6 +2149,9 @@ static void gc_worker(struct work_struct *work)
 		next_run = 1;
 
 early_exit:
+	NF_CT_STAT_ADD_ATOMIC(&init_net, gc_scanned, scanned);
+	NF_CT_STAT_ADD_ATOMIC(&init_net, gc_expired, expired_count - evicted);
+	NF_CT_STAT_ADD_ATOMIC(&init_net, gc_evicted, evicted);
 	if (gc_work->exiting)
 		return;
 
@@ -1637,31 +2161,68 @@ static void gc_worker(struct work_struct *work)
 	queue_delayed_work(system_power_efficient_wq, &gc_work->dwork, next_run);
 }
 
-static void conntrack_gc_work_init(struct conntrack_gc_work *gc_work)
+static void conntrack_gc_work_init(struct conntrack_gc_work *gc_work,
+				   unsigned int id)
 {
 	INIT_DELAYED_WORK(&gc_work->dwork, gc_worker);
+	gc_work->id = id;
 	gc_work->exiting = false;
 }
 
+static int conntrack_gc_start(void)
+{
+	unsigned int i, nr;
+
+	nr = rounddown_pow_of_two(min(num_possible_cpus(), GC_WORKERS_MAX));
+	BUILD_BUG_ON_NOT_POWER_OF_2(GC_WORKERS_MAX);
+	BUILD_BUG_ON(GC_WORKERS_MAX > CONNTRACK_LOCKS);
+
+	conntrack_gc_work = kcalloc(nr, sizeof(*conntrack_gc_work), GFP_KERNEL);
+	if (!conntrack_gc_work)
+		return -ENOMEM;
+
+	nf_conntrack_gc_workers = nr;
+	for (i = 0; i < nr; i++) {
+		conntrack_gc_work_init(&conntrack_gc_work[i], i);
+		/* stagger the first runs */
+		queue_delayed_work(system_power_efficient_wq,
+				   &conntrack_gc_work[i].dwork,
+				   HZ + i * HZ / nr);
+	}
+
+	return 0;
+}
+
+static void conntrack_gc_stop(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < nf_conntrack_gc_workers; i++)
+		cancel_delayed_work_sync(&conntrack_gc_work[i].dwork);
+
+	kfree(conntrack_gc_work);
+	conntrack_gc_work = NULL;
+	nf_conntrack_gc_workers = 0;
+}
+
 static struct nf_conn *
 __nf_conntrack_alloc(struct net *net,
 		     const struct nf_conntrack_zone *zone,
 		     const struct nf_conntrack_tuple *orig,
 		     const struct nf_conntrack_tuple *repl,
-		     gfp_t gfp, u32 hash)
+		     gfp_t gfp, u32 hash, int node)
 {
 	struct nf_conntrack_net *cnet = nf_ct_pernet(net);
-	unsigned int ct_count;
 	struct nf_conn *ct;
 
-	/* We don't want any race condition at early drop stage */
-	ct_count = atomic_inc_return(&cnet->count);
+	percpu_counter_inc(&cnet->count);
 
-	if (nf_conntrack_max && unlikely(ct_count > nf_conntrack_max)) {
-		if (!early_drop(net, hash)) {
-			if (!conntrack_gc_work.early_drop)
-				conntrack_gc_work.early_drop = true;
-			atomic_dec(&cnet->count);
+	/* Only sums up the per-cpu counts when we are close to the limit */
+	if (nf_conntrack_max &&
+	    unlikely(percpu_counter_compare(&cnet->count, nf_conntrack_max) > 0)) {
+		if (!early_drop(net, zone, hash)) {
+			gc_worker_set_early_drop();
+			percpu_counter_dec(&cnet->count);
 			net_warn_ratelimited("nf_conntrack: table full, dropping packet\n");
 			return ERR_PTR(-ENOMEM);
 		}
@@ -1671,7 +2232,7 @@ __nf_conntrack_alloc(struct net *net,
 	 * Do not use kmem_cache_zalloc(), as this cache uses
 	 * SLAB_TYPESAFE_BY_RCU.
 	 */
-	ct = kmem_cache_alloc(nf_conntrack_cachep, gfp);
+	ct = kmem_cache_alloc_node(nf_conntrack_cachep, gfp, node);
 	if (ct == NULL)
 		goto out;
 
@@ -1694,7 +2255,7 @@ __nf_conntrack_alloc(struct net *net,
 	refcount_set(&ct->ct_general.use, 0);
 	return ct;
 out:
-	atomic_dec(&cnet->count);
+	percpu_counter_dec(&cnet->count);
 	return ERR_PTR(-ENOMEM);
 }
 
@@ -1704,7 +2265,8 @@ struct nf_conn *nf_conntrack_alloc(struct net *net,
 				   const struct nf_conntrack_tuple *repl,
 				   gfp_t gfp)
 {
-	return __nf_conntrack_alloc(net, zone, orig, repl, gfp, 0);
+	return __nf_conntrack_alloc(net, zone, orig, repl, gfp, 0,
+				    NUMA_NO_NODE);
 }
 EXPORT_SYMBOL_GPL(nf_conntrack_alloc);
 
@@ -1729,11 +2291,18 @@ void nf_conntrack_free(struct nf_conn *ct)
 	}
 
 	kfree(ct->ext);
-	kmem_cache_free(nf_conntrack_cachep, ct);
 	cnet = nf_ct_pernet(net);
+#ifdef CONFIG_NF_CONNTRACK_ACCT_PCPU
+	if (ct->acct_pcpu) {
+		free_percpu(ct->acct_pcpu);
+		atomic_dec(&cnet->acct_pcpu);
+	}
+#endif
+	kmem_cache_free(nf_conntrack_cachep, ct);
 
-	smp_mb__before_atomic();
-	atomic_dec(&cnet->count);
+	/* cleanup waits for the count to drop to 0 before the cache goes away */
+	smp_wmb();
+	percpu_counter_dec(&cnet->count);
 }
 EXPORT_SYMBOL_GPL(nf_conntrack_free);
 
@@ -1756,14 +2325,20 @@ init_conntrack(struct net *net, struct nf_conn *tmpl,
 	const struct nf_conntrack_zone *zone;
 	struct nf_conn_timeout *timeout_ext;
 	struct nf_conntrack_zone tmp;
-	struct nf_conntrack_net *cnet;
+	int node = NUMA_NO_NODE;
 
 	if (!nf_ct_invert_tuple(&repl_tuple, tuple))
 		return NULL;
 
+	/* the cpu that sees the first packet isn't necessarily close to
+	 * the NIC that receives the rest of the flow.
+	 */
+	if (READ_ONCE(nf_conntrack_numa_placement) && skb->dev)
+		node = dev_to_node(&skb->dev->dev);
+
 	zone = nf_ct_zone_tmpl(tmpl, skb, &tmp);
 	ct = __nf_conntrack_alloc(net, zone, tuple, &repl_tuple, GFP_ATOMIC,
-				  hash);
+				  hash, node);
 	if (IS_ERR(ct))
 		return ERR_CAST(ct);
 
@@ -1781,6 +2356,7 @@ init_conntrack(struct net *net, struct nf_conn *tmpl,
 	nf_ct_acct_ext_add(ct, GFP_ATOMIC);
 	nf_ct_tstamp_ext_add(ct, GFP_ATOMIC);
 	nf_ct_labels_ext_add(ct);
+	nf_ct_queue_ext_add(ct);
 
 #ifdef CONFIG_NF_CONNTRACK_EVENTS
 	ecache = tmpl ? nf_ct_ecache_find(tmpl) : NULL;
@@ -1794,8 +2370,8 @@ init_conntrack(struct net *net, struct nf_conn *tmpl,
 	}
 #endif
 
-	cnet = nf_ct_pernet(net);
-	if (cnet->expect_count) {
+	/* Lockless first, most new connections are not expected */
+	if (__nf_ct_expect_find(net, zone, tuple)) {
 		spin_lock_bh(&nf_conntrack_expect_lock);
 		exp = nf_ct_find_expectation(net, zone, tuple, !tmpl || nf_ct_is_confirmed(tmpl));
 		if (exp) {
@@ -1844,6 +2420,53 @@ init_conntrack(struct net *net, struct nf_conn *tmpl,
 	return &ct->tuplehash[IP_CT_DIR_ORIGINAL];
 }
 
+#define NF_CT_PREFETCH_BATCH	16
+
+/* Tuples parsed and hashed by nf_conntrack_prefetch_list() for the default
+ * zone, written and read with BH disabled only.
+ */
+struct nf_ct_prefetch {
+	unsigned int			n;
+	struct {
+		const struct sk_buff	*skb;
+		const struct net	*net;
+		struct nf_conntrack_tuple tuple;
+		u32			hash;
+	} e[NF_CT_PREFETCH_BATCH];
+};
+
+static DEFINE_PER_CPU(struct nf_ct_prefetch, nf_ct_prefetch);
+
+/* The hash only depends on the tuple, the zone and the netns: an entry
+ * matching all three is good even if the skb was mangled or recycled.
+ */
+static bool nf_ct_prefetched_hash(const struct sk_buff *skb,
+				  const struct net *net,
+				  const struct nf_conntrack_tuple *tuple,
+				  u32 *hash)
+{
+	const struct nf_ct_prefetch *p;
+	unsigned int i;
+
+	if (!in_softirq())
+		return false;
+
+	p = this_cpu_ptr(&nf_ct_prefetch);
+	for (i = 0; i < p->n; i++) {
+		if (p->e[i].skb != skb)
+			continue;
+
+		if (p->e[i].net != net ||
+		    !nf_ct_tuple_equal(&p->e[i].tuple, tuple))
+			return false;
+
+		*hash = p->e[i].hash;
+		return true;
+	}
+
+	return false;
+}
+
 /* On success, returns 0, sets skb->_nfct | ctinfo */
 static int
 resolve_normal_ct(struct nf_conn *tmpl,
@@ -1869,7 +2492,9 @@ resolve_normal_ct(struct nf_conn *tmpl,
 	zone = nf_ct_zone_tmpl(tmpl, skb, &tmp);
 
 	zone_id = nf_ct_zone_id(zone, IP_CT_DIR_ORIGINAL);
-	hash = hash_conntrack_raw(&tuple, zone_id, state->net);
+	if (zone_id != NF_CT_DEFAULT_ZONE_ID ||
+	    !nf_ct_prefetched_hash(skb, state->net, &tuple, &hash))
+		hash = hash_conntrack_raw(&tuple, zone_id, state->net);
 	h = __nf_conntrack_find_get(state->net, zone, &tuple, hash);
 
 	if (!h) {
@@ -1881,6 +2506,13 @@ resolve_normal_ct(struct nf_conn *tmpl,
 		}
 	}
 
+#ifdef CONFIG_NUMA
+	if (h && READ_ONCE(nf_conntrack_numa_placement) &&
+	    num_online_nodes() > 1 &&
+	    page_to_nid(virt_to_page(h)) != numa_node_id())
+		NF_CT_STAT_INC_ATOMIC(state->net, found_remote);
+#endif
+
 	if (!h) {
 		h = init_conntrack(state->net, tmpl, &tuple,
 				   skb, dataoff, hash);
@@ -1997,6 +2629,110 @@ static int nf_conntrack_handle_packet(struct nf_conn *ct,
 	return generic_packet(ct, skb, ctinfo);
 }
 
+/* Referenced entry of a tuple, NULL if none or if the payload of its
+ * packets is inspected or mangled: fragments forwarded without
+ * reassembly only carry part of it.
+ */
+static struct nf_conn *
+nf_conntrack_find_frag(struct net *net, const struct nf_conntrack_zone *zone,
+		       const struct nf_conntrack_tuple *tuple,
+		       enum ip_conntrack_info *ctinfo)
+{
+	const struct nf_conntrack_tuple_hash *h;
+	struct nf_conn *ct;
+
+	h = nf_conntrack_find_get(net, zone, tuple);
+	if (!h)
+		return NULL;
+
+	ct = nf_ct_tuplehash_to_ctrack(h);
+	if (nfct_help(ct) || test_bit(IPS_SEQ_ADJUST_BIT, &ct->status)) {
+		nf_ct_put(ct);
+		return NULL;
+	}
+
+	/* as in resolve_normal_ct() */
+	if (NF_CT_DIRECTION(h) == IP_CT_DIR_REPLY)
+		*ctinfo = IP_CT_ESTABLISHED_REPLY;
+	else if (test_bit(IPS_SEEN_REPLY_BIT, &ct->status))
+		*ctinfo = IP_CT_ESTABLISHED;
+	else
+		*ctinfo = IP_CT_NEW;
+
+	return ct;
+}
+
+/* Can the datagram of this first fragment be forwarded without
+ * reassembly?  @tuple is set to its tuple.
+ */
+static bool nf_conntrack_frag_known(struct net *net,
+				    const struct nf_conntrack_zone *zone,
+				    const struct sk_buff *skb,
+				    struct nf_conntrack_tuple *tuple)
+{
+	enum ip_conntrack_info ctinfo;
+	struct nf_conn *ct;
+	u16 l3num;
+
+	l3num = skb->protocol == htons(ETH_P_IPV6) ? NFPROTO_IPV6 :
+						     NFPROTO_IPV4;
+	if (!nf_ct_get_tuplepr(skb, skb_network_offset(skb), l3num, net,
+			       tuple))
+		return false;
+
+	ct = nf_conntrack_find_frag(net, zone, tuple, &ctinfo);
+	if (!ct)
+		return false;
+
+	nf_ct_put(ct);
+	return true;
+}
+
+/* Fragment without transport header forwarded as is by nf_defrag_ipv4 or
+ * nf_defrag_ipv6: attach the entry of the datagram, found by the tuple of
+ * its first fragment.  Done here rather than on defragmentation, so that
+ * zones set after it are honoured.
+ */
+static bool nf_conntrack_virtual_frag(struct nf_conn *tmpl,
+				      struct sk_buff *skb,
+				      const struct nf_hook_state *state)
+{
+	const struct nf_defrag_hook *defrag_hook;
+	const struct nf_conntrack_zone *zone;
+	struct nf_conntrack_zone tmp;
+	u16 zone_id = NF_CT_DEFAULT_ZONE_ID;
+	struct nf_conntrack_tuple tuple;
+	enum ip_conntrack_info ctinfo;
+	struct nf_conn *ct;
+
+	switch (state->pf) {
+	case NFPROTO_IPV4:
+		defrag_hook = rcu_dereference(nf_defrag_v4_hook);
+		break;
+	case NFPROTO_IPV6:
+		defrag_hook = rcu_dereference(nf_defrag_v6_hook);
+		break;
+	default:
+		return false;
+	}
+
+	/* as nf_ct_defrag_user() does */
+	if (tmpl)
+		zone_id = nf_ct_zone_id(nf_ct_zone(tmpl), IP_CT_DIR_ORIGINAL);
+
+	if (!defrag_hook || !defrag_hook->frag_tuple ||
+	    !defrag_hook->frag_tuple(state, skb, zone_id, &tuple))
+		return false;
+
+	zone = nf_ct_zone_tmpl(tmpl, skb, &tmp);
+	ct = nf_conntrack_find_frag(state->net, zone, &tuple, &ctinfo);
+	if (!ct)
+		return false;
+
+	nf_ct_set(skb, ct, ctinfo);
+	return true;
+}
+
 unsigned int
 nf_conntrack_in(struct sk_buff *skb, const struct nf_hook_state *state)
 {
@@ -2017,6 +2753,11 @@ nf_conntrack_in(struct sk_buff *skb, const struct nf_hook_state *state)
 	/* rcu_read_lock()ed by nf_hook_thresh */
 	dataoff = get_l4proto(skb, skb_network_offset(skb), state->pf, &protonum);
 	if (dataoff <= 0) {
+		if (nf_conntrack_virtual_frag(tmpl, skb, state)) {
+			ret = NF_ACCEPT;
+			goto out;
+		}
+
 		NF_CT_STAT_INC_ATOMIC(state->net, invalid);
 		ret = NF_ACCEPT;
 		goto out;
@@ -2094,9 +2835,18 @@ void __nf_ct_refresh_acct(struct nf_conn *ct,
 		goto acct;
 
 	/* If not in hash table, timer will not be active yet */
-	if (nf_ct_is_confirmed(ct))
+	if (nf_ct_is_confirmed(ct)) {
 		extra_jiffies += nfct_time_stamp;
 
+		/* The expiry wheel has one second resolution, don't dirty
+		 * the cache line on every packet to extend the timeout by
+		 * less than that.
+		 */
+		if (nf_ct_wheel_enabled() &&
+		    extra_jiffies - READ_ONCE(ct->timeout) < HZ)
+			goto acct;
+	}
+
 	if (READ_ONCE(ct->timeout) != extra_jiffies)
 		WRITE_ONCE(ct->timeout, extra_jiffies);
 acct:
@@ -2310,7 +3060,8 @@ get_next_corpse(int (*iter)(struct nf_conn *i, void *data),
 		if (hlist_nulls_empty(hslot))
 			continue;
 
-		lockp = &nf_conntrack_locks[*bucket % CONNTRACK_LOCKS];
+		lockp = nf_conntrack_bucket_lock(*bucket,
+						 nf_conntrack_htable_size);
 		local_bh_disable();
 		nf_conntrack_lock(lockp);
 		hlist_nulls_for_each_entry(h, n, hslot, hnnode) {
@@ -2333,6 +3084,10 @@ get_next_corpse(int (*iter)(struct nf_conn *i, void *data),
 			    !net_eq(iter_data->net, nf_ct_net(ct)))
 				continue;
 
+			if (iter_data->zone &&
+			    !nf_ct_zone_equal_any(ct, iter_data->zone))
+				continue;
+
 			if (iter(ct, iter_data->data))
 				goto found;
 		}
@@ -2376,13 +3131,77 @@ void nf_ct_iterate_cleanup_net(int (*iter)(struct nf_conn *i, void *data),
 
 	might_sleep();
 
-	if (atomic_read(&cnet->count) == 0)
+	if (percpu_counter_sum(&cnet->count) == 0)
 		return;
 
+	if (iter_data->zone && nf_ct_zone_indexed(iter_data->zone)) {
+		nf_ct_zone_index_cleanup(iter, iter_data);
+		return;
+	}
+
 	nf_ct_iterate_cleanup(iter, iter_data);
 }
 EXPORT_SYMBOL_GPL(nf_ct_iterate_cleanup_net);
 
+/**
+ * nf_ct_iterate_net - call a function for each conntrack of a netns
+ * @iter: callback, invoked with the bucket lock held and BHs disabled
+ * @iter_data: netns, zone and data passed to @iter
+ *
+ * Unlike nf_ct_iterate_cleanup_net(), entries stay in the table, which is
+ * walked in a single pass.  @iter can change fields that are not part of
+ * the tuples, such as the mark or the labels, but must not sleep.
+ */
+void nf_ct_iterate_net(void (*iter)(struct nf_conn *i, void *data),
+		       const struct nf_ct_iter_data *iter_data)
+{
+	struct nf_conntrack_net *cnet = nf_ct_pernet(iter_data->net);
+	struct nf_conntrack_tuple_hash *h;
+	struct hlist_nulls_node *n;
+	unsigned int bucket;
+	struct nf_conn *ct;
+	spinlock_t *lockp;
+
+	might_sleep();
+
+	if (percpu_counter_sum(&cnet->count) == 0)
+		return;
+
+	mutex_lock(&nf_conntrack_mutex);
+	for (bucket = 0; bucket < nf_conntrack_htable_size; bucket++) {
+		struct hlist_nulls_head *hslot = &nf_conntrack_hash[bucket];
+
+		if (hlist_nulls_empty(hslot))
+			continue;
+
+		lockp = nf_conntrack_bucket_lock(bucket,
+						 nf_conntrack_htable_size);
+		local_bh_disable();
+		nf_conntrack_lock(lockp);
+		hlist_nulls_for_each_entry(h, n, hslot, hnnode) {
+			/* once per conntrack, see get_next_corpse() */
+			if (NF_CT_DIRECTION(h) != IP_CT_DIR_REPLY)
+				continue;
+
+			ct = nf_ct_tuplehash_to_ctrack(h);
+
+			if (!net_eq(iter_data->net, nf_ct_net(ct)))
+				continue;
+
+			if (iter_data->zone &&
+			    !nf_ct_zone_equal_any(ct, iter_data->zone))
+				continue;
+
+			iter(ct, iter_data->data);
+		}
+		spin_unlock(lockp);
+		local_bh_enable();
+		cond_resched();
+	}
+	mutex_unlock(&nf_conntrack_mutex);
+}
+EXPORT_SYMBOL_GPL(nf_ct_iterate_net);
+
 /**
  * nf_ct_iterate_destroy - destroy unconfirmed conntracks and iterate table
  * @iter: callback to invoke for each conntrack
@@ -2404,7 +3223,7 @@ nf_ct_iterate_destroy(int (*iter)(struct nf_conn *i, void *data), void *data)
 	for_each_net(net) {
 		struct nf_conntrack_net *cnet = nf_ct_pernet(net);
 
-		if (atomic_read(&cnet->count) == 0)
+		if (percpu_counter_sum(&cnet->count) == 0)
 			continue;
 		nf_queue_nf_hook_drop(net);
 	}
@@ -2445,14 +3264,19 @@ static int kill_all(struct nf_conn *i, void *data)
 
 void nf_conntrack_cleanup_start(void)
 {
+	unsigned int i;
+
 	cleanup_nf_conntrack_bpf();
-	conntrack_gc_work.exiting = true;
+	for (i = 0; i < nf_conntrack_gc_workers; i++)
+		conntrack_gc_work[i].exiting = true;
 }
 
 void nf_conntrack_cleanup_end(void)
 {
 	RCU_INIT_POINTER(nf_ct_hook, NULL);
-	cancel_delayed_work_sync(&conntrack_gc_work.dwork);
+	nf_conntrack_wheel_fini();
+	conntrack_gc_stop();
+	cancel_work_sync(&nf_conntrack_autosize_work);
 	kvfree(nf_conntrack_hash);
 
 	nf_conntrack_proto_fini();
@@ -2493,7 +3317,7 @@ void nf_conntrack_cleanup_net_list(struct list_head *net_exit_list)
 
 		iter_data.net = net;
 		nf_ct_iterate_cleanup_net(kill_all, &iter_data);
-		if (atomic_read(&cnet->count) != 0)
+		if (percpu_counter_sum(&cnet->count) != 0)
 			busy = 1;
 	}
 	if (busy) {
@@ -2502,9 +3326,12 @@ void nf_conntrack_cleanup_net_list(struct list_head *net_exit_list)
 	}
 
 	list_for_each_entry(net, net_exit_list, exit_list) {
+		struct nf_conntrack_net *cnet = nf_ct_pernet(net);
+
 		nf_conntrack_ecache_pernet_fini(net);
 		nf_conntrack_expect_pernet_fini(net);
 		free_percpu(net->ct.stat);
+		percpu_counter_destroy(&cnet->count);
 	}
 }
 
@@ -2532,17 +3359,55 @@ void *nf_ct_alloc_hashtable(unsigned int *sizep, int nulls)
 }
 EXPORT_SYMBOL_GPL(nf_ct_alloc_hashtable);
 
-int nf_conntrack_hash_resize(unsigned int hashsize)
+/* Move all entries of lock stripe @stripe from @old_hash to @hash. */
+static void nf_conntrack_hash_move_stripe(unsigned int stripe,
+					  struct hlist_nulls_head *old_hash,
+					  unsigned int old_size,
+					  struct hlist_nulls_head *hash,
+					  unsigned int hashsize)
 {
-	int i, bucket;
-	unsigned int old_size;
-	struct hlist_nulls_head *hash, *old_hash;
+	unsigned int i, bucket, first, last;
 	struct nf_conntrack_tuple_hash *h;
 	struct nf_conn *ct;
 
+	first = stripe * (old_size / CONNTRACK_LOCKS);
+	last = first + old_size / CONNTRACK_LOCKS;
+
+	local_bh_disable();
+	nf_conntrack_lock(&nf_conntrack_locks[stripe].lock);
+
+	for (i = first; i < last; i++) {
+		while (!hlist_nulls_empty(&old_hash[i])) {
+			unsigned int zone_id;
+
+			h = hlist_nulls_entry(old_hash[i].first,
+					      struct nf_conntrack_tuple_hash, hnnode);
+			ct = nf_ct_tuplehash_to_ctrack(h);
+			hlist_nulls_del_rcu(&h->hnnode);
+
+			zone_id = nf_ct_zone_id(nf_ct_zone(ct), NF_CT_DIRECTION(h));
+			bucket = __hash_conntrack(nf_ct_net(ct),
+						  &h->tuple, zone_id, hashsize);
+			hlist_nulls_add_head_rcu(&h->hnnode, &hash[bucket]);
+		}
+	}
+
+	/* new entries of this stripe go to the new table from now on */
+	WRITE_ONCE(nf_conntrack_resize_next, stripe + 1);
+
+	spin_unlock(&nf_conntrack_locks[stripe].lock);
+	local_bh_enable();
+}
+
+int nf_conntrack_hash_resize(unsigned int hashsize)
+{
+	struct hlist_nulls_head *hash, *old_hash;
+	unsigned int old_size, stripe;
+
 	if (!hashsize)
 		return -EINVAL;
 
+	hashsize = roundup(hashsize, CONNTRACK_LOCKS);
 	hash = nf_ct_alloc_hashtable(&hashsize, 1);
 	if (!hash)
 		return -ENOMEM;
@@ -2555,32 +3420,17 @@ int nf_conntrack_hash_resize(unsigned int hashsize)
 		return 0;
 	}
 
+	/* Publish the new table.  Taking all locks makes sure that nobody
+	 * is in the middle of an insert or delete while we switch over.
+	 */
 	local_bh_disable();
 	nf_conntrack_all_lock();
 	write_seqcount_begin(&nf_conntrack_generation);
 
-	/* Lookups in the old hash might happen in parallel, which means we
-	 * might get false negatives during connection lookup. New connections
-	 * created because of a false negative won't make it into the hash
-	 * though since that required taking the locks.
-	 */
-
-	for (i = 0; i < nf_conntrack_htable_size; i++) {
-		while (!hlist_nulls_empty(&nf_conntrack_hash[i])) {
-			unsigned int zone_id;
-
-			h = hlist_nulls_entry(nf_conntrack_hash[i].first,
-					      struct nf_conntrack_tuple_hash, hnnode);
-			ct = nf_ct_tuplehash_to_ctrack(h);
-			hlist_nulls_del_rcu(&h->hnnode);
-
-			zone_id = nf_ct_zone_id(nf_ct_zone(ct), NF_CT_DIRECTION(h));
-			bucket = __hash_conntrack(nf_ct_net(ct),
-						  &h->tuple, zone_id, hashsize);
-			hlist_nulls_add_head_rcu(&h->hnnode, &hash[bucket]);
-		}
-	}
 	old_hash = nf_conntrack_hash;
+	nf_conntrack_hash_old = old_hash;
+	nf_conntrack_htable_size_old = old_size;
+	WRITE_ONCE(nf_conntrack_resize_next, 0);
 
 	nf_conntrack_hash = hash;
 	nf_conntrack_htable_size = hashsize;
@@ -2589,6 +3439,23 @@ int nf_conntrack_hash_resize(unsigned int hashsize)
 	nf_conntrack_all_unlock();
 	local_bh_enable();
 
+	/* Move one lock stripe at a time.  Lookups search both tables
+	 * meanwhile, inserts and deletes only block on the stripe that
+	 * is being moved.
+	 */
+	for (stripe = 0; stripe < CONNTRACK_LOCKS; stripe++) {
+		nf_conntrack_hash_move_stripe(stripe, old_hash, old_size,
+					      hash, hashsize);
+		cond_resched();
+	}
+
+	spin_lock_bh(&nf_conntrack_locks_all_lock);
+	write_seqcount_begin(&nf_conntrack_generation);
+	WRITE_ONCE(nf_conntrack_hash_old, NULL);
+	nf_conntrack_htable_size_old = 0;
+	write_seqcount_end(&nf_conntrack_generation);
+	spin_unlock_bh(&nf_conntrack_locks_all_lock);
+
 	mutex_unlock(&nf_conntrack_mutex);
 
 	synchronize_net();
@@ -2615,6 +3482,23 @@ int nf_conntrack_set_hashsize(const char *val, const struct kernel_param *kp)
 	return nf_conntrack_hash_resize(hashsize);
 }
 
+static void nf_conn_struct_check(void)
+{
+	CACHELINE_ASSERT_GROUP_MEMBER(struct nf_conn, nf_conn_hot, ct_general);
+	CACHELINE_ASSERT_GROUP_MEMBER(struct nf_conn, nf_conn_hot, timeout);
+#ifdef CONFIG_NF_CONNTRACK_ZONES
+	CACHELINE_ASSERT_GROUP_MEMBER(struct nf_conn, nf_conn_hot, zone);
+#endif
+	CACHELINE_ASSERT_GROUP_MEMBER(struct nf_conn, nf_conn_hot, status);
+	CACHELINE_ASSERT_GROUP_MEMBER(struct nf_conn, nf_conn_hot, ct_net);
+
+	/* nf_conn objects are cacheline aligned, the hot group must start
+	 * the object and fit into its first 64 bytes.
+	 */
+	BUILD_BUG_ON(offsetof(struct nf_conn, __cacheline_group_begin__nf_conn_hot) != 0);
+	CACHELINE_ASSERT_GROUP_SIZE(struct nf_conn, nf_conn_hot, 64);
+}
+
 int nf_conntrack_init_start(void)
 {
 	unsigned long nr_pages = totalram_pages();
@@ -2626,7 +3510,7 @@ int nf_conntrack_init_start(void)
 			       &nf_conntrack_locks_all_lock);
 
 	for (i = 0; i < CONNTRACK_LOCKS; i++)
-		spin_lock_init(&nf_conntrack_locks[i]);
+		spin_lock_init(&nf_conntrack_locks[i].lock);
 
 	if (!nf_conntrack_htable_size) {
 		nf_conntrack_htable_size
@@ -2649,12 +3533,28 @@ int nf_conntrack_init_start(void)
 		max_factor = 1;
 	}
 
+	/* fixed for the lifetime of the module, entries are inserted
+	 * according to it.
+	 */
+	BUILD_BUG_ON(CONNTRACK_LOCKS % NF_CT_ZONE_SHARDS_MAX);
+	if (nf_conntrack_zone_shards > 1) {
+		nf_conntrack_zone_shards =
+			rounddown_pow_of_two(min(nf_conntrack_zone_shards,
+						 NF_CT_ZONE_SHARDS_MAX));
+		nf_conntrack_zone_bits = ilog2(nf_conntrack_zone_shards);
+	}
+
+	/* see nf_conntrack_bucket_lock() */
+	nf_conntrack_htable_size = roundup(nf_conntrack_htable_size,
+					   CONNTRACK_LOCKS);
 	nf_conntrack_hash = nf_ct_alloc_hashtable(&nf_conntrack_htable_size, 1);
 	if (!nf_conntrack_hash)
 		return -ENOMEM;
 
 	nf_conntrack_max = max_factor * nf_conntrack_htable_size;
 
+	nf_conn_struct_check();
+
 	nf_conntrack_cachep = kmem_cache_create("nf_conntrack",
 						sizeof(struct nf_conn),
 						NFCT_INFOMASK + 1,
@@ -2674,8 +3574,13 @@ int nf_conntrack_init_start(void)
 	if (ret < 0)
 		goto err_proto;
 
-	conntrack_gc_work_init(&conntrack_gc_work);
-	queue_delayed_work(system_power_efficient_wq, &conntrack_gc_work.dwork, HZ);
+	INIT_WORK(&nf_conntrack_autosize_work, nf_conntrack_autosize_work_fn);
+	ret = conntrack_gc_start();
+	if (ret < 0)
+		goto err_gc;
+
+	nf_conntrack_wheel_init();
+	nf_conntrack_zone_index_init();
 
 	ret = register_nf_conntrack_bpf();
 	if (ret < 0)
@@ -2684,7 +3589,10 @@ int nf_conntrack_init_start(void)
 	return 0;
 
 err_kfunc:
-	cancel_delayed_work_sync(&conntrack_gc_work.dwork);
+	nf_conntrack_wheel_fini();
+	conntrack_gc_stop();
+	cancel_work_sync(&nf_conntrack_autosize_work);
+err_gc:
 	nf_conntrack_proto_fini();
 err_proto:
 	nf_conntrack_helper_fini();
@@ -2708,6 +3616,84 @@ static void nf_conntrack_set_closing(struct nf_conntrack *nfct)
 	}
 }
 
+/* Called for a list of packets before they traverse the prerouting hooks
+ * one by one.  Compute the buckets the lookups in nf_conntrack_in() will
+ * hit and prefetch them, so the cache misses of a burst overlap instead
+ * of being taken one packet at a time.  The tuples and their hashes are
+ * kept for resolve_normal_ct(), which then doesn't hash them again.
+ *
+ * This is only a hint: packets with a template attached may end up in
+ * another zone, and a resize may move the bucket meanwhile.
+ */
+static void nf_conntrack_prefetch_list(const struct list_head *head,
+				       const struct nf_hook_state *state)
+{
+	struct hlist_nulls_head *buckets[NF_CT_PREFETCH_BATCH];
+	struct nf_conntrack_net *cnet = nf_ct_pernet(state->net);
+	struct hlist_nulls_head *ct_hash;
+	struct nf_ct_prefetch *p;
+	unsigned int i, hsize;
+	struct sk_buff *skb;
+
+	switch (state->pf) {
+	case NFPROTO_IPV4:
+		if (!READ_ONCE(cnet->users4))
+			return;
+		break;
+	case NFPROTO_IPV6:
+		if (!READ_ONCE(cnet->users6))
+			return;
+		break;
+	default:
+		return;
+	}
+
+	nf_conntrack_get_ht(&ct_hash, &hsize);
+
+	local_bh_disable();
+	p = this_cpu_ptr(&nf_ct_prefetch);
+	p->n = 0;
+
+	list_for_each_entry(skb, head, list) {
+		struct nf_conntrack_tuple *tuple = &p->e[p->n].tuple;
+		int dataoff;
+		u8 protonum;
+		u32 hash;
+
+		if (skb_nfct(skb))
+			continue;
+
+		dataoff = get_l4proto(skb, skb_network_offset(skb), state->pf,
+				      &protonum);
+		if (dataoff <= 0)
+			continue;
+
+		if (!nf_ct_get_tuple(skb, skb_network_offset(skb), dataoff,
+				     state->pf, protonum, state->net, tuple))
+			continue;
+
+		hash = hash_conntrack_raw(tuple, NF_CT_DEFAULT_ZONE_ID,
+					  state->net);
+		p->e[p->n].skb = skb;
+		p->e[p->n].net = state->net;
+		p->e[p->n].hash = hash;
+
+		buckets[p->n] = &ct_hash[reciprocal_scale(hash, hsize)];
+		prefetch(buckets[p->n]);
+		if (++p->n == NF_CT_PREFETCH_BATCH)
+			break;
+	}
+
+	/* the bucket heads should have arrived by now */
+	for (i = 0; i < p->n; i++) {
+		struct hlist_nulls_node *first = READ_ONCE(buckets[i]->first);
+
+		if (!is_a_nulls(first))
+			prefetch(first);
+	}
+	local_bh_enable();
+}
+
 static const struct nf_ct_hook nf_conntrack_hook = {
 	.update		= nf_conntrack_update,
 	.destroy	= nf_ct_destroy,
@@ -2716,6 +3702,8 @@ static const struct nf_ct_hook nf_conntrack_hook = {
 	.set_closing	= nf_conntrack_set_closing,
 	.confirm	= __nf_conntrack_confirm,
 	.get_id		= nf_conntrack_get_id,
+	.frag_known	= nf_conntrack_frag_known,
+	.prefetch_list	= nf_conntrack_prefetch_list,
 };
 
 void nf_conntrack_init_end(void)
@@ -2735,11 +3723,15 @@ int nf_conntrack_init_net(struct net *net)
 
 	BUILD_BUG_ON(IP_CT_UNTRACKED == IP_CT_NUMBER);
 	BUILD_BUG_ON_NOT_POWER_OF_2(CONNTRACK_LOCKS);
-	atomic_set(&cnet->count, 0);
 
+	ret = percpu_counter_init(&cnet->count, 0, GFP_KERNEL);
+	if (ret < 0)
+		return ret;
+
+	ret = -ENOMEM;
 	net->ct.stat = alloc_percpu(struct ip_conntrack_stat);
 	if (!net->ct.stat)
-		return ret;
+		goto err_stat;
 
 	ret = nf_conntrack_expect_pernet_init(net);
 	if (ret < 0)
@@ -2754,6 +3746,8 @@ int nf_conntrack_init_net(struct net *net)
 
 err_expect:
 	free_percpu(net->ct.stat);
+err_stat:
+	percpu_counter_destroy(&cnet->count);
 	return ret;
 }
 
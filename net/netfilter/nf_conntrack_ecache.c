@@ -137,6 +137,12 @@ static int __nf_conntrack_eventmask_report(struct nf_conntrack_ecache *e,
 	if (!((events | missed) & e->ctmask))
 		return 0;
 
+#ifdef CONFIG_NF_CONNTRACK_EVENTS_RING
+	/* the ring gets each event once, missed ones are ctnetlink's */
+	if (events && nf_ct_evring_active(net))
+		nf_ct_evring_report(events, item->ct, e);
+#endif
+
 	rcu_read_lock();
 
 	notify = rcu_dereference(net->ct.nf_conntrack_event_cb);
@@ -331,7 +337,8 @@ bool nf_ct_ecache_ext_add(struct nf_conn *ct, u16 ctmask, u16 expmask, gfp_t gfp
 			break;
 		return true;
 	case 2: /* autodetect: no event listener, don't allocate extension. */
-		if (!READ_ONCE(nf_ctnetlink_has_listener))
+		if (!READ_ONCE(nf_ctnetlink_has_listener) &&
+		    !nf_ct_evring_active(net))
 			return true;
 		fallthrough;
 	case 1:
@@ -341,6 +348,11 @@ bool nf_ct_ecache_ext_add(struct nf_conn *ct, u16 ctmask, u16 expmask, gfp_t gfp
 			expmask = ~0;
 		}
 		break;
+	case NF_CT_EVENTS_SUMMARY:
+		/* destroy events only, unless ruleset asks for more */
+		if (!ctmask && !expmask)
+			ctmask = 1 << IPCT_DESTROY;
+		break;
 	default:
 		WARN_ON_ONCE(1);
 		return true;
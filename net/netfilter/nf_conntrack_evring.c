@@ -0,0 +1,215 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Connection tracking events through per-cpu relay buffers.
+ *
+ * An alternative to ctnetlink multicast for high event rates: every
+ * event is written as a fixed size struct nf_ct_evring_record into the
+ * relay buffer of the cpu it happens on, consumers mmap() and poll() the
+ * per-cpu files in <debugfs>/nf_conntrack_events/.  Nothing is ever
+ * redelivered, records that don't fit are counted in the "dropped" file.
+ *
+ * With nf_conntrack_events_ring_coalesce set, the new event and the
+ * updates following it within that many milliseconds are held back and
+ * folded into the next record, a flow that ends inside the window
+ * produces a single record.
+ *
+ * Only events of the initial network namespace are recorded.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/atomic.h>
+#include <linux/debugfs.h>
+#include <linux/kernel.h>
+#include <linux/mutex.h>
+#include <linux/relay.h>
+#include <linux/sysctl.h>
+
+#include <net/netfilter/nf_conntrack.h>
+#include <net/netfilter/nf_conntrack_ecache.h>
+#include <linux/netfilter/nf_conntrack_evring.h>
+
+#define NF_CT_EVRING_SUBBUF_SIZE	(64 * 1024)
+#define NF_CT_EVRING_N_SUBBUFS		16
+
+/* e->ring_pending: destroy event recorded, ignore anything else */
+#define NF_CT_EVRING_DONE		BIT(31)
+
+u8 nf_ct_evring_enabled __read_mostly;
+EXPORT_SYMBOL_GPL(nf_ct_evring_enabled);
+
+unsigned int nf_ct_evring_coalesce_ms __read_mostly;
+
+static struct rchan __rcu *nf_ct_evring_chan;
+static struct dentry *nf_ct_evring_dir;
+static atomic_t nf_ct_evring_dropped;
+static DEFINE_MUTEX(nf_ct_evring_mutex);
+
+static int nf_ct_evring_subbuf_start(struct rchan_buf *buf, void *subbuf,
+				     void *prev_subbuf, size_t prev_padding)
+{
+	if (!relay_buf_full(buf))
+		return 1;
+
+	atomic_inc(&nf_ct_evring_dropped);
+	return 0;
+}
+
+static struct dentry *nf_ct_evring_create_buf_file(const char *filename,
+						   struct dentry *parent,
+						   umode_t mode,
+						   struct rchan_buf *buf,
+						   int *is_global)
+{
+	return debugfs_create_file(filename, mode, parent, buf,
+				   &relay_file_operations);
+}
+
+static int nf_ct_evring_remove_buf_file(struct dentry *dentry)
+{
+	debugfs_remove(dentry);
+	return 0;
+}
+
+static const struct rchan_callbacks nf_ct_evring_callbacks = {
+	.subbuf_start		= nf_ct_evring_subbuf_start,
+	.create_buf_file	= nf_ct_evring_create_buf_file,
+	.remove_buf_file	= nf_ct_evring_remove_buf_file,
+};
+
+/* Returns true if @events are held back, otherwise ORs in the events
+ * held back so far.
+ */
+static bool nf_ct_evring_coalesce(struct nf_conntrack_ecache *e, u32 *events)
+{
+	unsigned int window = READ_ONCE(nf_ct_evring_coalesce_ms);
+	bool destroy = *events & (1 << IPCT_DESTROY);
+	u32 now = nfct_time_stamp;
+	u32 old, new;
+	bool hold;
+
+	do {
+		old = READ_ONCE(e->ring_pending);
+		if (old & NF_CT_EVRING_DONE)
+			return true;
+
+		hold = window && !destroy &&
+		       ((*events & (1 << IPCT_NEW)) ||
+			(old && now - READ_ONCE(e->ring_since) <
+				msecs_to_jiffies(window)));
+		if (hold)
+			new = old | *events;
+		else
+			new = destroy ? NF_CT_EVRING_DONE : 0;
+	} while (cmpxchg(&e->ring_pending, old, new) != old);
+
+	if (hold) {
+		if (*events & (1 << IPCT_NEW))
+			WRITE_ONCE(e->ring_since, now);
+		return true;
+	}
+
+	*events |= old;
+	return false;
+}
+
+void nf_ct_evring_report(u32 events, const struct nf_conn *ct,
+			 struct nf_conntrack_ecache *e)
+{
+	struct nf_ct_evring_record rec;
+	struct rchan *chan;
+
+	events &= e->ctmask;
+	if (!events || !net_eq(nf_ct_net(ct), &init_net))
+		return;
+
+	rcu_read_lock();
+	chan = rcu_dereference(nf_ct_evring_chan);
+	if (!chan || nf_ct_evring_coalesce(e, &events))
+		goto out;
+
+	nf_ct_record_fill(&rec, events, ct);
+	relay_write(chan, &rec, sizeof(rec));
+out:
+	rcu_read_unlock();
+}
+
+static int nf_ct_evring_start(void)
+{
+	struct rchan *chan;
+
+	nf_ct_evring_dir = debugfs_create_dir("nf_conntrack_events", NULL);
+	if (IS_ERR(nf_ct_evring_dir))
+		return PTR_ERR(nf_ct_evring_dir);
+
+	atomic_set(&nf_ct_evring_dropped, 0);
+	debugfs_create_atomic_t("dropped", 0444, nf_ct_evring_dir,
+				&nf_ct_evring_dropped);
+
+	chan = relay_open("cpu", nf_ct_evring_dir, NF_CT_EVRING_SUBBUF_SIZE,
+			  NF_CT_EVRING_N_SUBBUFS, &nf_ct_evring_callbacks,
+			  NULL);
+	if (!chan) {
+		debugfs_remove(nf_ct_evring_dir);
+		nf_ct_evring_dir = NULL;
+		return -ENOMEM;
+	}
+
+	rcu_assign_pointer(nf_ct_evring_chan, chan);
+	return 0;
+}
+
+static void nf_ct_evring_stop(void)
+{
+	struct rchan *chan;
+
+	chan = rcu_replace_pointer(nf_ct_evring_chan, NULL,
+				   lockdep_is_held(&nf_ct_evring_mutex));
+	if (!chan)
+		return;
+
+	synchronize_rcu();
+	relay_close(chan);
+	debugfs_remove(nf_ct_evring_dir);
+	nf_ct_evring_dir = NULL;
+}
+
+int nf_ct_evring_sysctl(const struct ctl_table *table, int write,
+			void *buffer, size_t *lenp, loff_t *ppos)
+{
+	u8 val;
+	struct ctl_table tmp = {
+		.data	= &val,
+		.maxlen	= sizeof(val),
+		.extra1	= SYSCTL_ZERO,
+		.extra2	= SYSCTL_ONE,
+	};
+	int ret;
+
+	mutex_lock(&nf_ct_evring_mutex);
+	val = nf_ct_evring_enabled;
+	ret = proc_dou8vec_minmax(&tmp, write, buffer, lenp, ppos);
+	if (ret < 0 || !write || val == nf_ct_evring_enabled)
+		goto out;
+
+	if (val) {
+		ret = nf_ct_evring_start();
+		if (ret < 0)
+			goto out;
+	} else {
+		nf_ct_evring_stop();
+	}
+
+	WRITE_ONCE(nf_ct_evring_enabled, val);
+out:
+	mutex_unlock(&nf_ct_evring_mutex);
+	return ret;
+}
+
+void nf_conntrack_evring_fini(void)
+{
+	mutex_lock(&nf_ct_evring_mutex);
+	WRITE_ONCE(nf_ct_evring_enabled, 0);
+	nf_ct_evring_stop();
+	mutex_unlock(&nf_ct_evring_mutex);
+}
@@ -20,6 +20,7 @@
 #include <linux/siphash.h>
 #include <linux/moduleparam.h>
 #include <linux/export.h>
+#include <linux/nsproxy.h>
 #include <net/net_namespace.h>
 #include <net/netns/hash.h>
 
@@ -43,6 +44,30 @@ unsigned int nf_ct_expect_max __read_mostly;
 static struct kmem_cache *nf_ct_expect_cachep __read_mostly;
 static siphash_aligned_key_t nf_ct_expect_hashrnd;
 
+/* nf_ct_expect_hash_resize() moves the expectations over under
+ * nf_conntrack_expect_lock, lockless lookups retry if they raced with it.
+ */
+static seqcount_spinlock_t nf_ct_expect_seq =
+	SEQCNT_SPINLOCK_ZERO(nf_ct_expect_seq, &nf_conntrack_expect_lock);
+
+/* The destination of an expectation is never masked, so a new connection
+ * can only be expected if its slot is in use: most new connections skip
+ * the hash lookup even while a helper keeps expectations around.
+ */
+static unsigned int
+nf_ct_expect_port_slot(const struct nf_conntrack_tuple *tuple)
+{
+	return ((__force u16)tuple->dst.u.all ^ tuple->dst.protonum) %
+	       NF_CT_EXPECT_PORT_SLOTS;
+}
+
+static bool nf_ct_expect_maybe(const struct nf_conntrack_net *cnet,
+			       const struct nf_conntrack_tuple *tuple)
+{
+	return READ_ONCE(cnet->expect_count) &&
+	       READ_ONCE(cnet->expect_ports[nf_ct_expect_port_slot(tuple)]);
+}
+
 /* nf_conntrack_expect helper functions */
 void nf_ct_unlink_expect_report(struct nf_conntrack_expect *exp,
 				u32 portid, int report)
@@ -50,6 +75,7 @@ void nf_ct_unlink_expect_report(struct nf_conntrack_expect *exp,
 	struct nf_conn_help *master_help = nfct_help(exp->master);
 	struct net *net = nf_ct_exp_net(exp);
 	struct nf_conntrack_net *cnet;
+	unsigned int *ports;
 
 	WARN_ON(!master_help);
 	WARN_ON(timer_pending(&exp->timeout));
@@ -57,7 +83,9 @@ void nf_ct_unlink_expect_report(struct nf_conntrack_expect *exp,
 	hlist_del_rcu(&exp->hnode);
 
 	cnet = nf_ct_pernet(net);
-	cnet->expect_count--;
+	WRITE_ONCE(cnet->expect_count, cnet->expect_count - 1);
+	ports = &cnet->expect_ports[nf_ct_expect_port_slot(&exp->tuple)];
+	WRITE_ONCE(*ports, *ports - 1);
 
 	hlist_del_rcu(&exp->lnode);
 	master_help->expecting[exp->class]--;
@@ -79,7 +107,8 @@ static void nf_ct_expectation_timed_out(struct timer_list *t)
 	nf_ct_expect_put(exp);
 }
 
-static unsigned int nf_ct_expect_dst_hash(const struct net *n, const struct nf_conntrack_tuple *tuple)
+static u32 __nf_ct_expect_dst_hash(const struct net *n,
+				   const struct nf_conntrack_tuple *tuple)
 {
 	struct {
 		union nf_inet_addr dst_addr;
@@ -88,7 +117,6 @@ static unsigned int nf_ct_expect_dst_hash(const struct net *n, const struct nf_c
 		u8 l3num;
 		u8 protonum;
 	} __aligned(SIPHASH_ALIGNMENT) combined;
-	u32 hash;
 
 	get_random_once(&nf_ct_expect_hashrnd, sizeof(nf_ct_expect_hashrnd));
 
@@ -100,9 +128,15 @@ static unsigned int nf_ct_expect_dst_hash(const struct net *n, const struct nf_c
 	combined.l3num = tuple->src.l3num;
 	combined.protonum = tuple->dst.protonum;
 
-	hash = siphash(&combined, sizeof(combined), &nf_ct_expect_hashrnd);
+	return siphash(&combined, sizeof(combined), &nf_ct_expect_hashrnd);
+}
 
-	return reciprocal_scale(hash, nf_ct_expect_hsize);
+/* With nf_conntrack_expect_lock held */
+static unsigned int nf_ct_expect_dst_hash(const struct net *n,
+					  const struct nf_conntrack_tuple *tuple)
+{
+	return reciprocal_scale(__nf_ct_expect_dst_hash(n, tuple),
+				nf_ct_expect_hsize);
 }
 
 static bool
@@ -134,16 +168,21 @@ __nf_ct_expect_find(struct net *net,
 {
 	struct nf_conntrack_net *cnet = nf_ct_pernet(net);
 	struct nf_conntrack_expect *i;
-	unsigned int h;
+	unsigned int seq;
+	u32 hash;
 
-	if (!cnet->expect_count)
+	if (!nf_ct_expect_maybe(cnet, tuple))
 		return NULL;
 
-	h = nf_ct_expect_dst_hash(net, tuple);
-	hlist_for_each_entry_rcu(i, &nf_ct_expect_hash[h], hnode) {
-		if (nf_ct_exp_equal(tuple, i, zone, net))
-			return i;
-	}
+	hash = __nf_ct_expect_dst_hash(net, tuple);
+	do {
+		seq = read_seqcount_begin(&nf_ct_expect_seq);
+		hlist_for_each_entry_rcu(i, nf_ct_expect_bucket(hash), hnode) {
+			if (nf_ct_exp_equal(tuple, i, zone, net))
+				return i;
+		}
+	} while (read_seqcount_retry(&nf_ct_expect_seq, seq));
+
 	return NULL;
 }
 EXPORT_SYMBOL_GPL(__nf_ct_expect_find);
@@ -177,7 +216,7 @@ nf_ct_find_expectation(struct net *net,
 	struct nf_conntrack_expect *i, *exp = NULL;
 	unsigned int h;
 
-	if (!cnet->expect_count)
+	if (!nf_ct_expect_maybe(cnet, tuple))
 		return NULL;
 
 	h = nf_ct_expect_dst_hash(net, tuple);
@@ -231,8 +270,10 @@ void nf_ct_remove_expectations(struct nf_conn *ct)
 	struct nf_conntrack_expect *exp;
 	struct hlist_node *next;
 
-	/* Optimization: most connection never expect any others. */
-	if (!help)
+	/* Optimization: most connection never expect any others, and
+	 * most of those with a helper have none pending.
+	 */
+	if (!help || hlist_empty(&help->expectations))
 		return;
 
 	spin_lock_bh(&nf_conntrack_expect_lock);
@@ -389,6 +430,7 @@ static void nf_ct_expect_insert(struct nf_conntrack_expect *exp)
 	struct nf_conntrack_helper *helper;
 	struct net *net = nf_ct_exp_net(exp);
 	unsigned int h = nf_ct_expect_dst_hash(net, &exp->tuple);
+	unsigned int *ports;
 
 	/* two references : one for hash insert, one for the timer */
 	refcount_add(2, &exp->use);
@@ -407,7 +449,9 @@ static void nf_ct_expect_insert(struct nf_conntrack_expect *exp)
 
 	hlist_add_head_rcu(&exp->hnode, &nf_ct_expect_hash[h]);
 	cnet = nf_ct_pernet(net);
-	cnet->expect_count++;
+	WRITE_ONCE(cnet->expect_count, cnet->expect_count + 1);
+	ports = &cnet->expect_ports[nf_ct_expect_port_slot(&exp->tuple)];
+	WRITE_ONCE(*ports, *ports + 1);
 
 	NF_CT_STAT_INC(net, expect_create);
 }
@@ -572,8 +616,11 @@ static struct hlist_node *ct_expect_get_first(struct seq_file *seq)
 	struct ct_expect_iter_state *st = seq->private;
 	struct hlist_node *n;
 
-	for (st->bucket = 0; st->bucket < nf_ct_expect_hsize; st->bucket++) {
-		n = rcu_dereference(hlist_first_rcu(&nf_ct_expect_hash[st->bucket]));
+	struct hlist_head *head;
+
+	for (st->bucket = 0;
+	     (head = nf_ct_expect_bucket_nr(st->bucket)); st->bucket++) {
+		n = rcu_dereference(hlist_first_rcu(head));
 		if (n)
 			return n;
 	}
@@ -584,12 +631,14 @@ static struct hlist_node *ct_expect_get_next(struct seq_file *seq,
 					     struct hlist_node *head)
 {
 	struct ct_expect_iter_state *st = seq->private;
+	struct hlist_head *bucket;
 
 	head = rcu_dereference(hlist_next_rcu(head));
 	while (head == NULL) {
-		if (++st->bucket >= nf_ct_expect_hsize)
+		bucket = nf_ct_expect_bucket_nr(++st->bucket);
+		if (!bucket)
 			return NULL;
-		head = rcu_dereference(hlist_first_rcu(&nf_ct_expect_hash[st->bucket]));
+		head = rcu_dereference(hlist_first_rcu(bucket));
 	}
 	return head;
 }
@@ -702,7 +751,80 @@ static void exp_proc_remove(struct net *net)
 #endif /* CONFIG_NF_CONNTRACK_PROCFS */
 }
 
-module_param_named(expect_hashsize, nf_ct_expect_hsize, uint, 0400);
+/* Only grows: a lockless reader that sees the new size also sees the new
+ * table, see nf_ct_expect_bucket_nr(), and one still using the old size
+ * stays within either table.
+ */
+static int nf_ct_expect_hash_resize(unsigned int hashsize)
+{
+	struct hlist_head *hash, *old_hash;
+	struct nf_conntrack_expect *exp;
+	struct hlist_node *next;
+	unsigned int i, old_size;
+	u32 h;
+
+	if (hashsize <= READ_ONCE(nf_ct_expect_hsize))
+		return -EINVAL;
+
+	hash = nf_ct_alloc_hashtable(&hashsize, 0);
+	if (!hash)
+		return -ENOMEM;
+
+	spin_lock_bh(&nf_conntrack_expect_lock);
+	old_size = nf_ct_expect_hsize;
+	old_hash = nf_ct_expect_hash;
+	if (hashsize <= old_size) {
+		spin_unlock_bh(&nf_conntrack_expect_lock);
+		kvfree(hash);
+		return -EINVAL;
+	}
+
+	write_seqcount_begin(&nf_ct_expect_seq);
+	for (i = 0; i < old_size; i++) {
+		hlist_for_each_entry_safe(exp, next, &old_hash[i], hnode) {
+			h = __nf_ct_expect_dst_hash(nf_ct_exp_net(exp),
+						    &exp->tuple);
+			hlist_del_rcu(&exp->hnode);
+			hlist_add_head_rcu(&exp->hnode,
+					   &hash[reciprocal_scale(h, hashsize)]);
+		}
+	}
+	WRITE_ONCE(nf_ct_expect_hash, hash);
+	smp_store_release(&nf_ct_expect_hsize, hashsize);
+	write_seqcount_end(&nf_ct_expect_seq);
+
+	/* the limit follows the table, unless set by hand */
+	if (READ_ONCE(nf_ct_expect_max) == old_size * 4)
+		WRITE_ONCE(nf_ct_expect_max, hashsize * 4);
+	spin_unlock_bh(&nf_conntrack_expect_lock);
+
+	synchronize_net();
+	kvfree(old_hash);
+	return 0;
+}
+
+static int nf_ct_expect_set_hashsize(const char *val,
+				     const struct kernel_param *kp)
+{
+	unsigned int hashsize;
+	int rc;
+
+	if (current->nsproxy->net_ns != &init_net)
+		return -EOPNOTSUPP;
+
+	/* On boot, we can set this without any fancy locking. */
+	if (!nf_ct_expect_hash)
+		return param_set_uint(val, kp);
+
+	rc = kstrtouint(val, 0, &hashsize);
+	if (rc)
+		return rc;
+
+	return nf_ct_expect_hash_resize(hashsize);
+}
+
+module_param_call(expect_hashsize, nf_ct_expect_set_hashsize, param_get_uint,
+		  &nf_ct_expect_hsize, 0600);
 
 int nf_conntrack_expect_pernet_init(struct net *net)
 {
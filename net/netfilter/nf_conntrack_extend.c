@@ -23,6 +23,8 @@
 #include <net/netfilter/nf_conntrack_labels.h>
 #include <net/netfilter/nf_conntrack_synproxy.h>
 #include <net/netfilter/nf_conntrack_act_ct.h>
+#include <net/netfilter/nf_conntrack_climit.h>
+#include <net/netfilter/nf_conntrack_queue.h>
 #include <net/netfilter/nf_nat.h>
 
 #define NF_CT_EXT_PREALLOC	128u /* conntrack events are on by default */
@@ -54,12 +56,18 @@ static const u8 nf_ct_ext_type_len[NF_CT_EXT_NUM] = {
 #if IS_ENABLED(CONFIG_NET_ACT_CT)
 	[NF_CT_EXT_ACT_CT] = sizeof(struct nf_conn_act_ct_ext),
 #endif
+#ifdef CONFIG_NF_CONNTRACK_CLIMIT
+	[NF_CT_EXT_CLIMIT] = sizeof(struct nf_conn_climit),
+#endif
+#if IS_ENABLED(CONFIG_NETFILTER_NETLINK_QUEUE)
+	[NF_CT_EXT_QUEUE] = sizeof(struct nf_conn_queue),
+#endif
 };
 
 static __always_inline unsigned int total_extension_size(void)
 {
 	/* remember to add new extensions below */
-	BUILD_BUG_ON(NF_CT_EXT_NUM > 10);
+	BUILD_BUG_ON(NF_CT_EXT_NUM > 12);
 
 	return sizeof(struct nf_ct_ext) +
 	       sizeof(struct nf_conn_help)
@@ -85,13 +93,20 @@ static __always_inline unsigned int total_extension_size(void)
 #endif
 #if IS_ENABLED(CONFIG_NET_ACT_CT)
 		+ sizeof(struct nf_conn_act_ct_ext)
+#endif
+#ifdef CONFIG_NF_CONNTRACK_CLIMIT
+		+ sizeof(struct nf_conn_climit)
+#endif
+#if IS_ENABLED(CONFIG_NETFILTER_NETLINK_QUEUE)
+		+ sizeof(struct nf_conn_queue)
 #endif
 	;
 }
 
 void *nf_ct_ext_add(struct nf_conn *ct, enum nf_ct_ext_id id, gfp_t gfp)
 {
-	unsigned int newlen, newoff, oldlen, alloc;
+	struct nf_conntrack_net *cnet = nf_ct_pernet(nf_ct_net(ct));
+	unsigned int newlen, newoff, oldlen, alloc, prealloc;
 	struct nf_ct_ext *new;
 
 	/* Conntrack must not be confirmed to avoid races on reallocation. */
@@ -113,7 +128,16 @@ void *nf_ct_ext_add(struct nf_conn *ct, enum nf_ct_ext_id id, gfp_t gfp)
 	newoff = ALIGN(oldlen, __alignof__(struct nf_ct_ext));
 	newlen = newoff + nf_ct_ext_type_len[id];
 
-	alloc = max(newlen, NF_CT_EXT_PREALLOC);
+	/* The set of extensions a netns uses rarely changes, but each
+	 * code path adds its own.  Remember the largest area needed so
+	 * far and allocate that much upfront for the next conntrack,
+	 * krealloc() is then a no-op for the remaining extensions.
+	 */
+	prealloc = READ_ONCE(cnet->ext_prealloc);
+	if (newlen > prealloc)
+		WRITE_ONCE(cnet->ext_prealloc, newlen);
+
+	alloc = max3(newlen, NF_CT_EXT_PREALLOC, prealloc);
 	new = krealloc(ct->ext, alloc, gfp);
 	if (!new)
 		return NULL;
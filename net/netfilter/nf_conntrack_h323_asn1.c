@@ -72,6 +72,8 @@
 #define OPEN 8
 #define OPT 16
 
+/* Nesting bound of constructed types, the type tables go 16 levels deep */
+#define MAX_LEVEL 32
 
 /* ASN.1 Field Structure */
 typedef struct field_t {
@@ -332,6 +334,8 @@ static int decode_int(struct bitstr *bs, const struct field_t *f,
 			return H323_ERROR_BOUND;
 		len = get_bits(bs, 2) + 1;
 		BYTE_ALIGN(bs);
+		if (nf_h323_error_boundary(bs, len, 0))
+			return H323_ERROR_BOUND;
 		if (base && (f->attr & DECODE)) {	/* timeToLive */
 			unsigned int v = get_uint(bs, len) + f->lb;
 			PRINT(" = %u", v);
@@ -522,6 +526,9 @@ static int decode_seq(struct bitstr *bs, const struct field_t *f,
 
 	PRINT("%*.s%s\n", level * TAB_SIZE, " ", f->name);
 
+	if (level > MAX_LEVEL)
+		return H323_ERROR_RANGE;
+
 	/* Decode? */
 	base = (base && (f->attr & DECODE)) ? base + f->offset : NULL;
 
@@ -655,6 +662,9 @@ static int decode_seqof(struct bitstr *bs, const struct field_t *f,
 
 	PRINT("%*.s%s\n", level * TAB_SIZE, " ", f->name);
 
+	if (level > MAX_LEVEL)
+		return H323_ERROR_RANGE;
+
 	/* Decode? */
 	base = (base && (f->attr & DECODE)) ? base + f->offset : NULL;
 
@@ -751,6 +761,9 @@ static int decode_choice(struct bitstr *bs, const struct field_t *f,
 
 	PRINT("%*.s%s\n", level * TAB_SIZE, " ", f->name);
 
+	if (level > MAX_LEVEL)
+		return H323_ERROR_RANGE;
+
 	/* Decode? */
 	base = (base && (f->attr & DECODE)) ? base + f->offset : NULL;
 
@@ -796,7 +809,7 @@ static int decode_choice(struct bitstr *bs, const struct field_t *f,
 
 	if (ext || (son->attr & OPEN)) {
 		BYTE_ALIGN(bs);
-		if (nf_h323_error_boundary(bs, len, 0))
+		if (nf_h323_error_boundary(bs, 2, 0))
 			return H323_ERROR_BOUND;
 		len = get_len(bs);
 		if (nf_h323_error_boundary(bs, len, 0))
@@ -918,7 +931,8 @@ int DecodeQ931(unsigned char *buf, size_t sz, Q931 *q931)
 			len = *p++ << 8;
 			len |= *p++;
 			sz -= 3;
-			if (sz < len)
+			/* protocol discriminator, then the UUIE */
+			if (len < 1 || sz < len)
 				break;
 			p++;
 			len--;
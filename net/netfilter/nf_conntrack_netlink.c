@@ -53,6 +53,7 @@
 
 #include <linux/netfilter/nfnetlink.h>
 #include <linux/netfilter/nfnetlink_conntrack.h>
+#include <linux/netfilter/nfnetlink_conntrack_update.h>
 
 #include "nf_internals.h"
 
@@ -297,6 +298,8 @@ ctnetlink_dump_acct(struct sk_buff *skb, const struct nf_conn *ct, int type)
 	if (!acct)
 		return 0;
 
+	nf_ct_acct_sync(ct);
+
 	if (dump_counters(skb, acct, IP_CT_DIR_ORIGINAL, type) < 0)
 		return -1;
 	if (dump_counters(skb, acct, IP_CT_DIR_REPLY, type) < 0)
@@ -741,40 +744,15 @@ static size_t ctnetlink_nlmsg_size(const struct nf_conn *ct)
 }
 
 static int
-ctnetlink_conntrack_event(unsigned int events, const struct nf_ct_event *item)
+ctnetlink_conntrack_event_fill(struct sk_buff *skb, unsigned int events,
+			       const struct nf_ct_event *item,
+			       unsigned int type, unsigned int flags)
 {
 	const struct nf_conntrack_zone *zone;
-	struct net *net;
 	struct nlmsghdr *nlh;
 	struct nlattr *nest_parms;
 	struct nf_conn *ct = item->ct;
-	struct sk_buff *skb;
-	unsigned int type;
-	unsigned int flags = 0, group;
-	int err;
-
-	if (events & (1 << IPCT_DESTROY)) {
-		type = IPCTNL_MSG_CT_DELETE;
-		group = NFNLGRP_CONNTRACK_DESTROY;
-	} else if (events & ((1 << IPCT_NEW) | (1 << IPCT_RELATED))) {
-		type = IPCTNL_MSG_CT_NEW;
-		flags = NLM_F_CREATE|NLM_F_EXCL;
-		group = NFNLGRP_CONNTRACK_NEW;
-	} else if (events) {
-		type = IPCTNL_MSG_CT_NEW;
-		group = NFNLGRP_CONNTRACK_UPDATE;
-	} else
-		return 0;
-
-	net = nf_ct_net(ct);
-	if (!item->report && !nfnetlink_has_listeners(net, group))
-		return 0;
 
-	skb = nlmsg_new(ctnetlink_nlmsg_size(ct), GFP_ATOMIC);
-	if (skb == NULL)
-		goto errout;
-
-	type = nfnl_msg_type(NFNL_SUBSYS_CTNETLINK, type);
 	nlh = nfnl_msg_put(skb, item->portid, 0, type, flags, nf_ct_l3num(ct),
 			   NFNETLINK_V0, 0);
 	if (!nlh)
@@ -863,6 +841,176 @@ ctnetlink_conntrack_event(unsigned int events, const struct nf_ct_event *item)
 		goto nla_put_failure;
 
 	nlmsg_end(skb, nlh);
+	return 0;
+
+nla_put_failure:
+	nlmsg_cancel(skb, nlh);
+nlmsg_failure:
+	return -EMSGSIZE;
+}
+
+/* In flow summary mode (nf_conntrack_events=3) destroy events are queued
+ * into a per-cpu skb holding many messages, which is sent once it is full
+ * or after CTNETLINK_BATCH_DELAY.  Such events are not redelivered.
+ */
+#define CTNETLINK_BATCH_DELAY	(HZ / 10)
+
+struct ctnetlink_batch {
+	spinlock_t		lock;
+	struct sk_buff		*skb;
+	struct net		*net;
+};
+
+static DEFINE_PER_CPU(struct ctnetlink_batch, ctnetlink_destroy_batch);
+static struct delayed_work ctnetlink_batch_work;
+
+/* caller holds b->lock */
+static struct sk_buff *ctnetlink_batch_take(struct ctnetlink_batch *b,
+					    struct net **net)
+{
+	struct sk_buff *skb = b->skb;
+
+	*net = b->net;
+	b->skb = NULL;
+	b->net = NULL;
+
+	return skb;
+}
+
+static void ctnetlink_batch_send(struct sk_buff *skb, struct net *net)
+{
+	nfnetlink_send(skb, net, 0, NFNLGRP_CONNTRACK_DESTROY, 0, GFP_ATOMIC);
+}
+
+static int ctnetlink_batch_event(struct net *net, unsigned int events,
+				 const struct nf_ct_event *item,
+				 unsigned int type)
+{
+	struct sk_buff *skb, *full = NULL;
+	struct ctnetlink_batch *b;
+	struct net *full_net;
+	bool queued = false;
+
+	local_bh_disable();
+	b = this_cpu_ptr(&ctnetlink_destroy_batch);
+	spin_lock(&b->lock);
+
+	if (b->skb) {
+		if (net_eq(b->net, net) &&
+		    ctnetlink_conntrack_event_fill(b->skb, events, item,
+						   type, 0) == 0)
+			queued = true;
+		else
+			full = ctnetlink_batch_take(b, &full_net);
+	}
+
+	if (!queued) {
+		skb = nlmsg_new(NLMSG_GOODSIZE, GFP_ATOMIC);
+		if (skb &&
+		    ctnetlink_conntrack_event_fill(skb, events, item,
+						   type, 0) == 0) {
+			b->skb = skb;
+			b->net = net;
+			queued = true;
+		} else {
+			kfree_skb(skb);
+		}
+	}
+
+	spin_unlock(&b->lock);
+
+	if (full)
+		ctnetlink_batch_send(full, full_net);
+	if (queued)
+		queue_delayed_work(system_wq, &ctnetlink_batch_work,
+				   CTNETLINK_BATCH_DELAY);
+	local_bh_enable();
+
+	return queued ? 0 : -ENOBUFS;
+}
+
+/* Flush the queued messages of @net, or of all netns if NULL */
+static void ctnetlink_batch_flush(const struct net *net, bool send)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct ctnetlink_batch *b = per_cpu_ptr(&ctnetlink_destroy_batch, cpu);
+		struct sk_buff *skb = NULL;
+		struct net *skb_net;
+
+		spin_lock_bh(&b->lock);
+		if (b->skb && (!net || net_eq(b->net, net)))
+			skb = ctnetlink_batch_take(b, &skb_net);
+		spin_unlock_bh(&b->lock);
+
+		if (!skb)
+			continue;
+
+		if (send)
+			ctnetlink_batch_send(skb, skb_net);
+		else
+			kfree_skb(skb);
+	}
+}
+
+static void ctnetlink_batch_work_fn(struct work_struct *work)
+{
+	ctnetlink_batch_flush(NULL, true);
+}
+
+static void ctnetlink_batch_init(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		spin_lock_init(&per_cpu_ptr(&ctnetlink_destroy_batch, cpu)->lock);
+
+	INIT_DELAYED_WORK(&ctnetlink_batch_work, ctnetlink_batch_work_fn);
+}
+
+static int
+ctnetlink_conntrack_event(unsigned int events, const struct nf_ct_event *item)
+{
+	struct net *net;
+	struct nf_conn *ct = item->ct;
+	struct sk_buff *skb;
+	unsigned int type;
+	unsigned int flags = 0, group;
+	int err;
+
+	if (events & (1 << IPCT_DESTROY)) {
+		type = IPCTNL_MSG_CT_DELETE;
+		group = NFNLGRP_CONNTRACK_DESTROY;
+	} else if (events & ((1 << IPCT_NEW) | (1 << IPCT_RELATED))) {
+		type = IPCTNL_MSG_CT_NEW;
+		flags = NLM_F_CREATE|NLM_F_EXCL;
+		group = NFNLGRP_CONNTRACK_NEW;
+	} else if (events) {
+		type = IPCTNL_MSG_CT_NEW;
+		group = NFNLGRP_CONNTRACK_UPDATE;
+	} else
+		return 0;
+
+	net = nf_ct_net(ct);
+	if (!item->report && !nfnetlink_has_listeners(net, group))
+		return 0;
+
+	type = nfnl_msg_type(NFNL_SUBSYS_CTNETLINK, type);
+
+	if (group == NFNLGRP_CONNTRACK_DESTROY && !item->report &&
+	    !item->portid && nf_ct_events_summary(net))
+		return ctnetlink_batch_event(net, events, item, type);
+
+	skb = nlmsg_new(ctnetlink_nlmsg_size(ct), GFP_ATOMIC);
+	if (skb == NULL)
+		goto errout;
+
+	if (ctnetlink_conntrack_event_fill(skb, events, item, type, flags) < 0) {
+		kfree_skb(skb);
+		goto errout;
+	}
+
 	err = nfnetlink_send(skb, net, item->portid, group, item->report,
 			     GFP_ATOMIC);
 	if (err == -ENOBUFS || err == -EAGAIN)
@@ -870,10 +1018,6 @@ ctnetlink_conntrack_event(unsigned int events, const struct nf_ct_event *item)
 
 	return 0;
 
-nla_put_failure:
-	nlmsg_cancel(skb, nlh);
-nlmsg_failure:
-	kfree_skb(skb);
 errout:
 	if (nfnetlink_set_err(net, 0, group, -ENOBUFS) > 0)
 		return -ENOBUFS;
@@ -884,8 +1028,6 @@ ctnetlink_conntrack_event(unsigned int events, const struct nf_ct_event *item)
 
 static int ctnetlink_done(struct netlink_callback *cb)
 {
-	if (cb->args[1])
-		nf_ct_put((struct nf_conn *)cb->args[1]);
 	kfree(cb->data);
 	return 0;
 }
@@ -895,6 +1037,12 @@ struct ctnetlink_filter_u32 {
 	u32 mask;
 };
 
+/* address masks of a tuple filter, all ones unless given */
+struct ctnetlink_filter_mask {
+	union nf_inet_addr src;
+	union nf_inet_addr dst;
+};
+
 struct ctnetlink_filter {
 	u8 family;
 	bool zone_filter;
@@ -904,28 +1052,82 @@ struct ctnetlink_filter {
 
 	struct nf_conntrack_tuple orig;
 	struct nf_conntrack_tuple reply;
+	struct ctnetlink_filter_mask orig_mask;
+	struct ctnetlink_filter_mask reply_mask;
 	struct nf_conntrack_zone zone;
 
 	struct ctnetlink_filter_u32 mark;
 	struct ctnetlink_filter_u32 status;
+
+	/* protocol state, l4proto == 0 if not filtered */
+	u8 l4proto;
+	u8 l4state;
 };
 
-static const struct nla_policy cta_filter_nla_policy[CTA_FILTER_MAX + 1] = {
+static const struct nla_policy cta_filter_nla_policy[CTA_FILTER_REPLY_MASK + 1] = {
 	[CTA_FILTER_ORIG_FLAGS]		= { .type = NLA_U32 },
 	[CTA_FILTER_REPLY_FLAGS]	= { .type = NLA_U32 },
+	[CTA_FILTER_ORIG_MASK]		= { .type = NLA_NESTED },
+	[CTA_FILTER_REPLY_MASK]		= { .type = NLA_NESTED },
 };
 
+/* Address masks, in a CTA_TUPLE_IP like nest, for prefix matching */
+static int ctnetlink_parse_filter_mask(const struct nlattr *attr,
+				       struct ctnetlink_filter_mask *mask,
+				       u8 family)
+{
+	struct nlattr *tb[CTA_IP_MAX + 1];
+	int ret;
+
+	memset(mask, 0xff, sizeof(*mask));
+	if (!attr)
+		return 0;
+
+	ret = nla_parse_nested(tb, CTA_IP_MAX, attr, cta_ip_nla_policy, NULL);
+	if (ret < 0)
+		return ret;
+
+	switch (family) {
+	case NFPROTO_IPV4:
+		if (tb[CTA_IP_V4_SRC])
+			mask->src.ip = nla_get_in_addr(tb[CTA_IP_V4_SRC]);
+		if (tb[CTA_IP_V4_DST])
+			mask->dst.ip = nla_get_in_addr(tb[CTA_IP_V4_DST]);
+		break;
+	case NFPROTO_IPV6:
+		if (tb[CTA_IP_V6_SRC])
+			mask->src.in6 = nla_get_in6_addr(tb[CTA_IP_V6_SRC]);
+		if (tb[CTA_IP_V6_DST])
+			mask->dst.in6 = nla_get_in6_addr(tb[CTA_IP_V6_DST]);
+		break;
+	default:
+		return -EOPNOTSUPP;
+	}
+
+	return 0;
+}
+
 static int ctnetlink_parse_filter(const struct nlattr *attr,
 				  struct ctnetlink_filter *filter)
 {
-	struct nlattr *tb[CTA_FILTER_MAX + 1];
+	struct nlattr *tb[CTA_FILTER_REPLY_MASK + 1];
 	int ret = 0;
 
-	ret = nla_parse_nested(tb, CTA_FILTER_MAX, attr, cta_filter_nla_policy,
-			       NULL);
+	ret = nla_parse_nested(tb, CTA_FILTER_REPLY_MASK, attr,
+			       cta_filter_nla_policy, NULL);
 	if (ret)
 		return ret;
 
+	ret = ctnetlink_parse_filter_mask(tb[CTA_FILTER_ORIG_MASK],
+					  &filter->orig_mask, filter->family);
+	if (ret < 0)
+		return ret;
+
+	ret = ctnetlink_parse_filter_mask(tb[CTA_FILTER_REPLY_MASK],
+					  &filter->reply_mask, filter->family);
+	if (ret < 0)
+		return ret;
+
 	if (tb[CTA_FILTER_ORIG_FLAGS]) {
 		filter->orig_flags = nla_get_u32(tb[CTA_FILTER_ORIG_FLAGS]);
 		if (filter->orig_flags & ~CTA_FILTER_F_ALL)
@@ -989,6 +1191,86 @@ static int ctnetlink_filter_parse_status(struct ctnetlink_filter_u32 *status,
 	return 0;
 }
 
+static const struct nla_policy filter_protoinfo_policy[CTA_PROTOINFO_MAX + 1] = {
+	[CTA_PROTOINFO_TCP]	= { .type = NLA_NESTED },
+	[CTA_PROTOINFO_DCCP]	= { .type = NLA_NESTED },
+	[CTA_PROTOINFO_SCTP]	= { .type = NLA_NESTED },
+};
+
+static const struct nla_policy filter_state_policy[CTA_PROTOINFO_TCP_STATE + 1] = {
+	[CTA_PROTOINFO_TCP_STATE]	= { .type = NLA_U8 },
+};
+
+/* CTA_PROTOINFO in a dump request restricts the dump to entries in the
+ * given TCP, DCCP or SCTP state.  The state is the first attribute of
+ * each of the nests.
+ */
+static int ctnetlink_filter_parse_l4state(struct ctnetlink_filter *filter,
+					  const struct nlattr * const cda[])
+{
+	struct nlattr *tb[CTA_PROTOINFO_MAX + 1];
+	struct nlattr *tbs[CTA_PROTOINFO_TCP_STATE + 1];
+	const struct nlattr *attr;
+	int err;
+
+	BUILD_BUG_ON(CTA_PROTOINFO_TCP_STATE != 1 ||
+		     CTA_PROTOINFO_DCCP_STATE != 1 ||
+		     CTA_PROTOINFO_SCTP_STATE != 1);
+
+	if (!cda[CTA_PROTOINFO])
+		return 0;
+
+	err = nla_parse_nested(tb, CTA_PROTOINFO_MAX, cda[CTA_PROTOINFO],
+			       filter_protoinfo_policy, NULL);
+	if (err < 0)
+		return err;
+
+	if (tb[CTA_PROTOINFO_TCP]) {
+		filter->l4proto = IPPROTO_TCP;
+		attr = tb[CTA_PROTOINFO_TCP];
+	} else if (tb[CTA_PROTOINFO_DCCP]) {
+		filter->l4proto = IPPROTO_DCCP;
+		attr = tb[CTA_PROTOINFO_DCCP];
+	} else if (tb[CTA_PROTOINFO_SCTP]) {
+		filter->l4proto = IPPROTO_SCTP;
+		attr = tb[CTA_PROTOINFO_SCTP];
+	} else {
+		return -EINVAL;
+	}
+
+	err = nla_parse_nested_deprecated(tbs, CTA_PROTOINFO_TCP_STATE, attr,
+					  filter_state_policy, NULL);
+	if (err < 0)
+		return err;
+	if (!tbs[CTA_PROTOINFO_TCP_STATE])
+		return -EINVAL;
+
+	filter->l4state = nla_get_u8(tbs[CTA_PROTOINFO_TCP_STATE]);
+	return 0;
+}
+
+static bool ctnetlink_filter_match_l4state(const struct ctnetlink_filter *filter,
+					   const struct nf_conn *ct)
+{
+	if (nf_ct_protonum(ct) != filter->l4proto)
+		return false;
+
+	switch (filter->l4proto) {
+	case IPPROTO_TCP:
+		return READ_ONCE(ct->proto.tcp.state) == filter->l4state;
+#ifdef CONFIG_NF_CT_PROTO_DCCP
+	case IPPROTO_DCCP:
+		return READ_ONCE(ct->proto.dccp.state) == filter->l4state;
+#endif
+#ifdef CONFIG_NF_CT_PROTO_SCTP
+	case IPPROTO_SCTP:
+		return READ_ONCE(ct->proto.sctp.state) == filter->l4state;
+#endif
+	}
+
+	return false;
+}
+
 static struct ctnetlink_filter *
 ctnetlink_alloc_filter(const struct nlattr * const cda[], u8 family)
 {
@@ -1014,6 +1296,10 @@ ctnetlink_alloc_filter(const struct nlattr * const cda[], u8 family)
 	if (err)
 		goto err_filter;
 
+	err = ctnetlink_filter_parse_l4state(filter, cda);
+	if (err)
+		goto err_filter;
+
 	if (cda[CTA_ZONE]) {
 		err = ctnetlink_parse_zone(cda[CTA_ZONE], &filter->zone);
 		if (err < 0)
@@ -1068,7 +1354,8 @@ ctnetlink_alloc_filter(const struct nlattr * const cda[], u8 family)
 
 static bool ctnetlink_needs_filter(u8 family, const struct nlattr * const *cda)
 {
-	return family || cda[CTA_MARK] || cda[CTA_FILTER] || cda[CTA_STATUS] || cda[CTA_ZONE];
+	return family || cda[CTA_MARK] || cda[CTA_FILTER] || cda[CTA_STATUS] ||
+	       cda[CTA_ZONE] || cda[CTA_PROTOINFO];
 }
 
 static int ctnetlink_start(struct netlink_callback *cb)
@@ -1090,27 +1377,32 @@ static int ctnetlink_start(struct netlink_callback *cb)
 
 static int ctnetlink_filter_match_tuple(struct nf_conntrack_tuple *filter_tuple,
 					struct nf_conntrack_tuple *ct_tuple,
+					const struct ctnetlink_filter_mask *mask,
 					u_int32_t flags, int family)
 {
 	switch (family) {
 	case NFPROTO_IPV4:
 		if ((flags & CTA_FILTER_FLAG(CTA_IP_SRC)) &&
-		    filter_tuple->src.u3.ip != ct_tuple->src.u3.ip)
+		    (filter_tuple->src.u3.ip ^ ct_tuple->src.u3.ip) &
+		    mask->src.ip)
 			return  0;
 
 		if ((flags & CTA_FILTER_FLAG(CTA_IP_DST)) &&
-		    filter_tuple->dst.u3.ip != ct_tuple->dst.u3.ip)
+		    (filter_tuple->dst.u3.ip ^ ct_tuple->dst.u3.ip) &
+		    mask->dst.ip)
 			return  0;
 		break;
 	case NFPROTO_IPV6:
 		if ((flags & CTA_FILTER_FLAG(CTA_IP_SRC)) &&
-		    !ipv6_addr_cmp(&filter_tuple->src.u3.in6,
-				   &ct_tuple->src.u3.in6))
+		    ipv6_masked_addr_cmp(&filter_tuple->src.u3.in6,
+					 &mask->src.in6,
+					 &ct_tuple->src.u3.in6))
 			return 0;
 
 		if ((flags & CTA_FILTER_FLAG(CTA_IP_DST)) &&
-		    !ipv6_addr_cmp(&filter_tuple->dst.u3.in6,
-				   &ct_tuple->dst.u3.in6))
+		    ipv6_masked_addr_cmp(&filter_tuple->dst.u3.in6,
+					 &mask->dst.in6,
+					 &ct_tuple->dst.u3.in6))
 			return 0;
 		break;
 	}
@@ -1180,6 +1472,7 @@ static int ctnetlink_filter_match(struct nf_conn *ct, void *data)
 	if (filter->orig_flags) {
 		tuple = nf_ct_tuple(ct, IP_CT_DIR_ORIGINAL);
 		if (!ctnetlink_filter_match_tuple(&filter->orig, tuple,
+						  &filter->orig_mask,
 						  filter->orig_flags,
 						  filter->family))
 			goto ignore_entry;
@@ -1188,6 +1481,7 @@ static int ctnetlink_filter_match(struct nf_conn *ct, void *data)
 	if (filter->reply_flags) {
 		tuple = nf_ct_tuple(ct, IP_CT_DIR_REPLY);
 		if (!ctnetlink_filter_match_tuple(&filter->reply, tuple,
+						  &filter->reply_mask,
 						  filter->reply_flags,
 						  filter->family))
 			goto ignore_entry;
@@ -1201,6 +1495,10 @@ static int ctnetlink_filter_match(struct nf_conn *ct, void *data)
 	if ((status & filter->status.mask) != filter->status.val)
 		goto ignore_entry;
 
+	if (filter->l4proto &&
+	    !ctnetlink_filter_match_l4state(filter, ct))
+		goto ignore_entry;
+
 out:
 	return 1;
 
@@ -1208,96 +1506,136 @@ static int ctnetlink_filter_match(struct nf_conn *ct, void *data)
 	return 0;
 }
 
-static int
-ctnetlink_dump_table(struct sk_buff *skb, struct netlink_callback *cb)
+/* Dump the entries of chain @chain, bucket @bucket of its table, that
+ * follow the one with id cb->args[1] if cb->args[2] is set.  If that entry
+ * went away meanwhile, the whole chain is dumped again: entries may show
+ * up twice, but none is skipped.
+ */
+static int ctnetlink_dump_chain(struct sk_buff *skb, struct netlink_callback *cb,
+				struct hlist_nulls_head *chain,
+				unsigned int bucket, struct nlmsghdr **last)
 {
 	unsigned int flags = cb->data ? NLM_F_DUMP_FILTERED : 0;
 	struct net *net = sock_net(skb->sk);
-	struct nf_conn *ct, *last;
 	struct nf_conntrack_tuple_hash *h;
 	struct hlist_nulls_node *n;
-	struct nf_conn *nf_ct_evict[8];
-	int res, i;
-	spinlock_t *lockp;
-
-	last = (struct nf_conn *)cb->args[1];
-	i = 0;
+	struct nlmsghdr *nlh;
+	struct nf_conn *ct;
+	bool skip;
+	int res;
 
-	local_bh_disable();
-	for (; cb->args[0] < nf_conntrack_htable_size; cb->args[0]++) {
 restart:
-		while (i) {
-			i--;
-			if (nf_ct_should_gc(nf_ct_evict[i]))
-				nf_ct_kill(nf_ct_evict[i]);
-			nf_ct_put(nf_ct_evict[i]);
-		}
+	skip = cb->args[2];
+	hlist_nulls_for_each_entry_rcu(h, n, chain, hnnode) {
+		ct = nf_ct_tuplehash_to_ctrack(h);
 
-		lockp = &nf_conntrack_locks[cb->args[0] % CONNTRACK_LOCKS];
-		nf_conntrack_lock(lockp);
-		if (cb->args[0] >= nf_conntrack_htable_size) {
-			spin_unlock(lockp);
-			goto out;
+		if (skip) {
+			if (nf_ct_get_id(ct) == cb->args[1])
+				skip = false;
+			continue;
 		}
-		hlist_nulls_for_each_entry(h, n, &nf_conntrack_hash[cb->args[0]],
-					   hnnode) {
-			ct = nf_ct_tuplehash_to_ctrack(h);
-			if (nf_ct_is_expired(ct)) {
-				/* need to defer nf_ct_kill() until lock is released */
-				if (i < ARRAY_SIZE(nf_ct_evict) &&
-				    refcount_inc_not_zero(&ct->ct_general.use))
-					nf_ct_evict[i++] = ct;
-				continue;
-			}
 
-			if (!net_eq(net, nf_ct_net(ct)))
-				continue;
+		if (NF_CT_DIRECTION(h) != IP_CT_DIR_ORIGINAL ||
+		    !net_eq(net, nf_ct_net(ct)))
+			continue;
 
-			if (NF_CT_DIRECTION(h) != IP_CT_DIR_ORIGINAL)
-				continue;
+		/* filter before taking a reference */
+		if (!ctnetlink_filter_match(ct, cb->data) &&
+		    !nf_ct_is_expired(ct))
+			continue;
 
-			if (cb->args[1]) {
-				if (ct != last)
-					continue;
-				cb->args[1] = 0;
-			}
-			if (!ctnetlink_filter_match(ct, cb->data))
-				continue;
+		if (!refcount_inc_not_zero(&ct->ct_general.use))
+			continue;
 
-			res =
-			ctnetlink_fill_info(skb, NETLINK_CB(cb->skb).portid,
-					    cb->nlh->nlmsg_seq,
-					    NFNL_MSG_TYPE(cb->nlh->nlmsg_type),
-					    ct, true, flags);
-			if (res < 0) {
-				nf_conntrack_get(&ct->ct_general);
-				cb->args[1] = (unsigned long)ct;
-				spin_unlock(lockp);
-				goto out;
-			}
+		/* load ->status after refcount increase */
+		smp_acquire__after_ctrl_dep();
+
+		if (nf_ct_should_gc(ct)) {
+			nf_ct_kill(ct);
+			nf_ct_put(ct);
+			continue;
 		}
-		spin_unlock(lockp);
-		if (cb->args[1]) {
-			cb->args[1] = 0;
-			goto restart;
+
+		/* entry was recycled meanwhile */
+		if (!nf_ct_is_confirmed(ct) ||
+		    !net_eq(net, nf_ct_net(ct)) ||
+		    !ctnetlink_filter_match(ct, cb->data)) {
+			nf_ct_put(ct);
+			continue;
+		}
+
+		nlh = (struct nlmsghdr *)skb_tail_pointer(skb);
+		res =
+		ctnetlink_fill_info(skb, NETLINK_CB(cb->skb).portid,
+				    cb->nlh->nlmsg_seq,
+				    NFNL_MSG_TYPE(cb->nlh->nlmsg_type),
+				    ct, true, flags);
+		if (res < 0) {
+			nf_ct_put(ct);
+			return res;
 		}
+
+		nl_dump_check_consistent(cb, nlh);
+		*last = nlh;
+		cb->args[1] = nf_ct_get_id(ct);
+		cb->args[2] = 1;
+		nf_ct_put(ct);
 	}
-out:
-	local_bh_enable();
-	if (last) {
-		/* nf ct hash resize happened, now clear the leftover. */
-		if ((struct nf_conn *)cb->args[1] == last)
-			cb->args[1] = 0;
 
-		nf_ct_put(last);
+	/* the chain was left for another one, resume */
+	if (get_nulls_value(n) != bucket)
+		goto restart;
+
+	/* the last entry dumped is gone */
+	if (skip) {
+		cb->args[2] = 0;
+		goto restart;
+	}
+
+	return 0;
+}
+
+/* The table is walked under RCU only.  cb->args[0] is the bucket, and
+ * cb->args[1] the id of the last entry dumped from it if cb->args[2] is
+ * set.  While a resize is in progress, the buckets of the old table come
+ * first.  Entries moved by a resize meanwhile can be missed: the dump is
+ * flagged NLM_F_DUMP_INTR whenever the conntrack generation changed.
+ */
+static int
+ctnetlink_dump_table(struct sk_buff *skb, struct netlink_callback *cb)
+{
+	struct hlist_nulls_head *hash, *old_hash, *chain;
+	unsigned int hsize, old_hsize, seq, bucket;
+	struct nlmsghdr *last = NULL;
+
+	rcu_read_lock();
+	seq = nf_conntrack_get_ht_resize(&hash, &hsize, &old_hash, &old_hsize);
+	if (!old_hash)
+		old_hsize = 0;
+
+	/* 0 is not a valid sequence for nl_dump_check_consistent() */
+	cb->seq = seq + 1;
+
+	for (; cb->args[0] < old_hsize + hsize;
+	     cb->args[0]++, cb->args[2] = 0) {
+		if (cb->args[0] < old_hsize) {
+			bucket = cb->args[0];
+			chain = &old_hash[bucket];
+		} else {
+			bucket = cb->args[0] - old_hsize;
+			chain = &hash[bucket];
+		}
+
+		if (ctnetlink_dump_chain(skb, cb, chain, bucket, &last) < 0)
+			break;
 	}
 
-	while (i) {
-		i--;
-		if (nf_ct_should_gc(nf_ct_evict[i]))
-			nf_ct_kill(nf_ct_evict[i]);
-		nf_ct_put(nf_ct_evict[i]);
+	/* a resize started or ended during this part */
+	if (read_seqcount_retry(&nf_conntrack_generation, seq) && last) {
+		cb->seq = raw_read_seqcount(&nf_conntrack_generation) + 1;
+		nl_dump_check_consistent(cb, last);
 	}
+	rcu_read_unlock();
 
 	return skb->len;
 }
@@ -1559,7 +1897,7 @@ static int ctnetlink_parse_help(const struct nlattr *attr, char **helper_name,
 	return 0;
 }
 
-static const struct nla_policy ct_nla_policy[CTA_MAX+1] = {
+static const struct nla_policy ct_nla_policy[CTA_UPDATE + 1] = {
 	[CTA_TUPLE_ORIG]	= { .type = NLA_NESTED },
 	[CTA_TUPLE_REPLY]	= { .type = NLA_NESTED },
 	[CTA_STATUS] 		= { .type = NLA_U32 },
@@ -1582,6 +1920,7 @@ static const struct nla_policy ct_nla_policy[CTA_MAX+1] = {
 	[CTA_FILTER]		= { .type = NLA_NESTED },
 	[CTA_STATUS_MASK]	= { .type = NLA_U32 },
 	[CTA_TIMESTAMP_EVENT]	= { .type = NLA_REJECT },
+	[CTA_UPDATE]		= { .type = NLA_NESTED },
 };
 
 static int ctnetlink_flush_iterate(struct nf_conn *ct, void *data)
@@ -1606,6 +1945,8 @@ static int ctnetlink_flush_conntrack(struct net *net,
 			return PTR_ERR(filter);
 
 		iter.data = filter;
+		if (filter->zone_filter)
+			iter.zone = &filter->zone;
 	}
 
 	nf_ct_iterate_cleanup_net(ctnetlink_flush_iterate, &iter);
@@ -2267,7 +2608,8 @@ ctnetlink_create_conntrack(struct net *net,
 	struct nf_conn_tstamp *tstamp;
 	u64 timeout;
 
-	ct = nf_conntrack_alloc(net, zone, otuple, rtuple, GFP_ATOMIC);
+	/* process context, serialized by the ctnetlink mutex */
+	ct = nf_conntrack_alloc(net, zone, otuple, rtuple, GFP_KERNEL);
 	if (IS_ERR(ct))
 		return ERR_PTR(-ENOMEM);
 
@@ -2412,6 +2754,49 @@ ctnetlink_create_conntrack(struct net *net,
 	return ERR_PTR(err);
 }
 
+static int
+ctnetlink_create_conntrack_report(struct sk_buff *skb,
+				  const struct nfnl_info *info,
+				  const struct nlattr * const cda[],
+				  const struct nf_conntrack_zone *zone,
+				  struct nf_conntrack_tuple *otuple,
+				  struct nf_conntrack_tuple *rtuple)
+{
+	enum ip_conntrack_events events;
+	struct nf_conn *ct;
+
+	if (otuple->dst.protonum != rtuple->dst.protonum)
+		return -EINVAL;
+
+	ct = ctnetlink_create_conntrack(info->net, zone, cda, otuple, rtuple,
+					info->nfmsg->nfgen_family);
+	if (IS_ERR(ct))
+		return PTR_ERR(ct);
+
+	if (test_bit(IPS_EXPECTED_BIT, &ct->status))
+		events = 1 << IPCT_RELATED;
+	else
+		events = 1 << IPCT_NEW;
+
+	if (cda[CTA_LABELS] &&
+	    ctnetlink_attach_labels(ct, cda) == 0)
+		events |= (1 << IPCT_LABEL);
+
+	nf_conntrack_eventmask_report((1 << IPCT_REPLY) |
+				      (1 << IPCT_ASSURED) |
+				      (1 << IPCT_HELPER) |
+				      (1 << IPCT_PROTOINFO) |
+				      (1 << IPCT_SEQADJ) |
+				      (1 << IPCT_MARK) |
+				      (1 << IPCT_SYNPROXY) |
+				      events,
+				      ct, NETLINK_CB(skb).portid,
+				      nlmsg_report(info->nlh));
+	nf_ct_put(ct);
+
+	return 0;
+}
+
 static int ctnetlink_new_conntrack(struct sk_buff *skb,
 				   const struct nfnl_info *info,
 				   const struct nlattr * const cda[])
@@ -2441,50 +2826,30 @@ static int ctnetlink_new_conntrack(struct sk_buff *skb,
 			return err;
 	}
 
+	/* Restoring state, e.g. conntrackd on failover, sends
+	 * NLM_F_CREATE|NLM_F_EXCL.  Insertion checks for clashes under the
+	 * bucket locks anyway, so skip the lookup and let it report -EEXIST.
+	 */
+	if ((info->nlh->nlmsg_flags & (NLM_F_CREATE | NLM_F_EXCL)) ==
+	    (NLM_F_CREATE | NLM_F_EXCL) &&
+	    cda[CTA_TUPLE_ORIG] && cda[CTA_TUPLE_REPLY])
+		return ctnetlink_create_conntrack_report(skb, info, cda, &zone,
+							 &otuple, &rtuple);
+
 	if (cda[CTA_TUPLE_ORIG])
 		h = nf_conntrack_find_get(info->net, &zone, &otuple);
 	else if (cda[CTA_TUPLE_REPLY])
 		h = nf_conntrack_find_get(info->net, &zone, &rtuple);
 
 	if (h == NULL) {
-		err = -ENOENT;
-		if (info->nlh->nlmsg_flags & NLM_F_CREATE) {
-			enum ip_conntrack_events events;
-
-			if (!cda[CTA_TUPLE_ORIG] || !cda[CTA_TUPLE_REPLY])
-				return -EINVAL;
-			if (otuple.dst.protonum != rtuple.dst.protonum)
-				return -EINVAL;
-
-			ct = ctnetlink_create_conntrack(info->net, &zone, cda,
-							&otuple, &rtuple, u3);
-			if (IS_ERR(ct))
-				return PTR_ERR(ct);
-
-			err = 0;
-			if (test_bit(IPS_EXPECTED_BIT, &ct->status))
-				events = 1 << IPCT_RELATED;
-			else
-				events = 1 << IPCT_NEW;
-
-			if (cda[CTA_LABELS] &&
-			    ctnetlink_attach_labels(ct, cda) == 0)
-				events |= (1 << IPCT_LABEL);
+		if (!(info->nlh->nlmsg_flags & NLM_F_CREATE))
+			return -ENOENT;
 
-			nf_conntrack_eventmask_report((1 << IPCT_REPLY) |
-						      (1 << IPCT_ASSURED) |
-						      (1 << IPCT_HELPER) |
-						      (1 << IPCT_PROTOINFO) |
-						      (1 << IPCT_SEQADJ) |
-						      (1 << IPCT_MARK) |
-						      (1 << IPCT_SYNPROXY) |
-						      events,
-						      ct, NETLINK_CB(skb).portid,
-						      nlmsg_report(info->nlh));
-			nf_ct_put(ct);
-		}
+		if (!cda[CTA_TUPLE_ORIG] || !cda[CTA_TUPLE_REPLY])
+			return -EINVAL;
 
-		return err;
+		return ctnetlink_create_conntrack_report(skb, info, cda, &zone,
+							 &otuple, &rtuple);
 	}
 	/* implicit 'else' */
 
@@ -2510,6 +2875,126 @@ static int ctnetlink_new_conntrack(struct sk_buff *skb,
 	return err;
 }
 
+struct ctnetlink_update {
+	struct ctnetlink_filter	*filter;
+	struct nlattr		*cda[CTA_MAX + 1];
+	u32			portid;
+	int			report;
+};
+
+static int ctnetlink_update_parse(struct ctnetlink_update *u,
+				  const struct nlattr *attr)
+{
+	const struct nlattr **cda = (const struct nlattr **)u->cda;
+	int err;
+
+	err = nla_parse_nested(u->cda, CTA_MAX, attr, ct_nla_policy, NULL);
+	if (err < 0)
+		return err;
+
+	if (!cda[CTA_MARK] && !cda[CTA_LABELS])
+		return -EINVAL;
+
+#ifndef CONFIG_NF_CONNTRACK_MARK
+	if (cda[CTA_MARK])
+		return -EOPNOTSUPP;
+#endif
+	if (cda[CTA_LABELS]) {
+#ifdef CONFIG_NF_CONNTRACK_LABELS
+		/* as checked by ctnetlink_attach_labels() */
+		if (nla_len(cda[CTA_LABELS]) & (sizeof(u32) - 1))
+			return -EINVAL;
+
+		if (cda[CTA_LABELS_MASK] &&
+		    nla_len(cda[CTA_LABELS_MASK]) != nla_len(cda[CTA_LABELS]))
+			return -EINVAL;
+#else
+		return -EOPNOTSUPP;
+#endif
+	}
+
+	return 0;
+}
+
+/* Under the bucket lock: only the mark and the labels are changed, which
+ * are updated locklessly anyway, unlike ctnetlink_change_conntrack().
+ */
+static void ctnetlink_update_iterate(struct nf_conn *ct, void *data)
+{
+	struct ctnetlink_update *u = data;
+	const struct nlattr **cda = (const struct nlattr **)u->cda;
+	unsigned int events = 0;
+#ifdef CONFIG_NF_CONNTRACK_LABELS
+	struct nf_conn_labels old, *labels;
+#endif
+#ifdef CONFIG_NF_CONNTRACK_MARK
+	u32 mark;
+#endif
+
+	if (nf_ct_is_dying(ct) || !ctnetlink_filter_match(ct, u->filter))
+		return;
+
+#ifdef CONFIG_NF_CONNTRACK_MARK
+	if (cda[CTA_MARK]) {
+		mark = READ_ONCE(ct->mark);
+		ctnetlink_change_mark(ct, cda);
+		if (READ_ONCE(ct->mark) != mark)
+			events |= 1 << IPCT_MARK;
+	}
+#endif
+#ifdef CONFIG_NF_CONNTRACK_LABELS
+	/* the extension can't be added once the entry is confirmed */
+	labels = nf_ct_labels_find(ct);
+	if (cda[CTA_LABELS] && labels) {
+		old = *labels;
+		if (!ctnetlink_attach_labels(ct, cda) &&
+		    memcmp(&old, labels, sizeof(old)))
+			events |= 1 << IPCT_LABEL;
+	}
+#endif
+
+	if (events)
+		nf_conntrack_eventmask_report(events, ct, u->portid,
+					      u->report);
+}
+
+static int ctnetlink_update_conntrack(struct sk_buff *skb,
+				      const struct nfnl_info *info,
+				      const struct nlattr * const cda[])
+{
+	u8 family = info->nfmsg->nfgen_family;
+	struct ctnetlink_update u = {
+		.portid	= NETLINK_CB(skb).portid,
+		.report	= nlmsg_report(info->nlh),
+	};
+	struct nf_ct_iter_data iter = {
+		.net	= info->net,
+		.data	= &u,
+	};
+	int err;
+
+	if (!cda[CTA_UPDATE])
+		return -EINVAL;
+
+	err = ctnetlink_update_parse(&u, cda[CTA_UPDATE]);
+	if (err < 0)
+		return err;
+
+	if (ctnetlink_needs_filter(family, cda)) {
+		u.filter = ctnetlink_alloc_filter(cda, family);
+		if (IS_ERR(u.filter))
+			return PTR_ERR(u.filter);
+
+		if (u.filter->zone_filter)
+			iter.zone = &u.filter->zone;
+	}
+
+	nf_ct_iterate_net(ctnetlink_update_iterate, &iter);
+	kfree(u.filter);
+
+	return 0;
+}
+
 static int
 ctnetlink_ct_stat_cpu_fill_info(struct sk_buff *skb, u32 portid, u32 seq,
 				__u16 cpu, const struct ip_conntrack_stat *st)
@@ -3183,13 +3668,13 @@ ctnetlink_exp_dump_table(struct sk_buff *skb, struct netlink_callback *cb)
 	struct nf_conntrack_expect *exp, *last;
 	struct nfgenmsg *nfmsg = nlmsg_data(cb->nlh);
 	u_int8_t l3proto = nfmsg->nfgen_family;
+	struct hlist_head *head;
 
 	rcu_read_lock();
 	last = (struct nf_conntrack_expect *)cb->args[1];
-	for (; cb->args[0] < nf_ct_expect_hsize; cb->args[0]++) {
+	for (; (head = nf_ct_expect_bucket_nr(cb->args[0])); cb->args[0]++) {
 restart:
-		hlist_for_each_entry_rcu(exp, &nf_ct_expect_hash[cb->args[0]],
-					 hnode) {
+		hlist_for_each_entry_rcu(exp, head, hnode) {
 			if (l3proto && exp->tuple.src.l3num != l3proto)
 				continue;
 
@@ -3785,7 +4270,7 @@ static struct nf_ct_event_notifier ctnl_notifier = {
 };
 #endif
 
-static const struct nfnl_callback ctnl_cb[IPCTNL_MSG_MAX] = {
+static const struct nfnl_callback ctnl_cb[IPCTNL_MSG_CT_UPDATE + 1] = {
 	[IPCTNL_MSG_CT_NEW]	= {
 		.call		= ctnetlink_new_conntrack,
 		.type		= NFNL_CB_MUTEX,
@@ -3826,6 +4311,12 @@ static const struct nfnl_callback ctnl_cb[IPCTNL_MSG_MAX] = {
 		.call		= ctnetlink_get_ct_unconfirmed,
 		.type		= NFNL_CB_MUTEX,
 	},
+	[IPCTNL_MSG_CT_UPDATE]	= {
+		.call		= ctnetlink_update_conntrack,
+		.type		= NFNL_CB_MUTEX,
+		.attr_count	= CTA_UPDATE,
+		.policy		= ct_nla_policy
+	},
 };
 
 static const struct nfnl_callback ctnl_exp_cb[IPCTNL_MSG_EXP_MAX] = {
@@ -3856,7 +4347,7 @@ static const struct nfnl_callback ctnl_exp_cb[IPCTNL_MSG_EXP_MAX] = {
 static const struct nfnetlink_subsystem ctnl_subsys = {
 	.name				= "conntrack",
 	.subsys_id			= NFNL_SUBSYS_CTNETLINK,
-	.cb_count			= IPCTNL_MSG_MAX,
+	.cb_count			= ARRAY_SIZE(ctnl_cb),
 	.cb				= ctnl_cb,
 };
 
@@ -3886,9 +4377,18 @@ static void ctnetlink_net_pre_exit(struct net *net)
 #endif
 }
 
+static void __net_exit ctnetlink_net_exit(struct net *net)
+{
+#ifdef CONFIG_NF_CONNTRACK_EVENTS
+	/* no event can be in flight anymore, see pre_exit */
+	ctnetlink_batch_flush(net, false);
+#endif
+}
+
 static struct pernet_operations ctnetlink_net_ops = {
 	.init		= ctnetlink_net_init,
 	.pre_exit	= ctnetlink_net_pre_exit,
+	.exit		= ctnetlink_net_exit,
 };
 
 static int __init ctnetlink_init(void)
@@ -3896,6 +4396,13 @@ static int __init ctnetlink_init(void)
 	int ret;
 
 	NL_ASSERT_CTX_FITS(struct ctnetlink_list_dump_ctx);
+	BUILD_BUG_ON(IPCTNL_MSG_CT_UPDATE < IPCTNL_MSG_MAX);
+	BUILD_BUG_ON(CTA_UPDATE <= CTA_MAX);
+	BUILD_BUG_ON(CTA_FILTER_ORIG_MASK <= CTA_FILTER_MAX);
+
+#ifdef CONFIG_NF_CONNTRACK_EVENTS
+	ctnetlink_batch_init();
+#endif
 
 	ret = nfnetlink_subsys_register(&ctnl_subsys);
 	if (ret < 0) {
@@ -3931,6 +4438,9 @@ static int __init ctnetlink_init(void)
 static void __exit ctnetlink_exit(void)
 {
 	unregister_pernet_subsys(&ctnetlink_net_ops);
+#ifdef CONFIG_NF_CONNTRACK_EVENTS
+	cancel_delayed_work_sync(&ctnetlink_batch_work);
+#endif
 	nfnetlink_subsys_unregister(&ctnl_exp_subsys);
 	nfnetlink_subsys_unregister(&ctnl_subsys);
 #ifdef CONFIG_NETFILTER_NETLINK_GLUE_CT
@@ -160,12 +160,17 @@ unsigned int nf_confirm(void *priv,
 
 	switch (nf_ct_l3num(ct)) {
 	case NFPROTO_IPV4:
+		/* fragments forwarded as is by nf_defrag_ipv4 */
+		if (ip_is_fragment(ip_hdr(skb)))
+			return nf_conntrack_confirm(skb);
+
 		protoff = skb_network_offset(skb) + ip_hdrlen(skb);
 		break;
 	case NFPROTO_IPV6:
 		pnum = ipv6_hdr(skb)->nexthdr;
 		start = ipv6_skip_exthdr(skb, sizeof(struct ipv6hdr), &pnum, &frag_off);
-		if (start < 0 || (frag_off & htons(~0x7)) != 0)
+		/* first fragments too, forwarded as is by nf_defrag_ipv6 */
+		if (start < 0 || frag_off)
 			return nf_conntrack_confirm(skb);
 
 		protoff = start;
@@ -583,6 +588,10 @@ int nf_ct_netns_get(struct net *net, u8 nfproto)
 {
 	int err;
 
+	err = nf_conntrack_standalone_register_net(net);
+	if (err < 0)
+		return err;
+
 	switch (nfproto) {
 	case NFPROTO_INET:
 		err = nf_ct_netns_inet_get(net);
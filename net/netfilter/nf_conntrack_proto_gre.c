@@ -27,6 +27,7 @@
 #include <linux/types.h>
 #include <linux/timer.h>
 #include <linux/list.h>
+#include <linux/jhash.h>
 #include <linux/seq_file.h>
 #include <linux/in.h>
 #include <linux/netdevice.h>
@@ -35,6 +36,7 @@
 #include <net/dst.h>
 #include <net/net_namespace.h>
 #include <net/netns/generic.h>
+#include <net/netns/hash.h>
 #include <net/netfilter/nf_conntrack_l4proto.h>
 #include <net/netfilter/nf_conntrack_helper.h>
 #include <net/netfilter/nf_conntrack_core.h>
@@ -50,6 +52,10 @@ static const unsigned int gre_timeouts[GRE_CT_MAX] = {
 /* used when expectation is added */
 static DEFINE_SPINLOCK(keymap_lock);
 
+/* keymaps of all netns, looked up for every PPTP GRE packet */
+#define GRE_KEYMAP_HASH_BITS	10
+static struct hlist_head gre_keymap_hash[1 << GRE_KEYMAP_HASH_BITS];
+
 static inline struct nf_gre_net *gre_pernet(struct net *net)
 {
 	return &net->ct.nf_ct_proto.gre;
@@ -65,15 +71,32 @@ static inline int gre_key_cmpfn(const struct nf_ct_gre_keymap *km,
 	       km->tuple.dst.u.all == t->dst.u.all;
 }
 
+/* on the fields compared by gre_key_cmpfn() */
+static u32 gre_keymap_hashfn(const struct net *net,
+			     const struct nf_conntrack_tuple *t)
+{
+	u32 hash;
+
+	hash = jhash2((__force const u32 *)t->src.u3.all,
+		      ARRAY_SIZE(t->src.u3.all),
+		      net_hash_mix(net) ^ (__force u16)t->dst.u.all);
+	hash = jhash2((__force const u32 *)t->dst.u3.all,
+		      ARRAY_SIZE(t->dst.u3.all),
+		      hash ^ (t->src.l3num << 8 | t->dst.protonum));
+
+	return hash >> (32 - GRE_KEYMAP_HASH_BITS);
+}
+
 /* look up the source key for a given tuple */
 static __be16 gre_keymap_lookup(struct net *net, struct nf_conntrack_tuple *t)
 {
-	struct nf_gre_net *net_gre = gre_pernet(net);
 	struct nf_ct_gre_keymap *km;
+	struct hlist_head *head;
 	__be16 key = 0;
 
-	list_for_each_entry_rcu(km, &net_gre->keymap_list, list) {
-		if (gre_key_cmpfn(km, t)) {
+	head = &gre_keymap_hash[gre_keymap_hashfn(net, t)];
+	hlist_for_each_entry_rcu(km, head, hnode) {
+		if (net_eq(read_pnet(&km->net), net) && gre_key_cmpfn(km, t)) {
 			key = km->tuple.src.u.gre.key;
 			break;
 		}
@@ -90,17 +113,15 @@ int nf_ct_gre_keymap_add(struct nf_conn *ct, enum ip_conntrack_dir dir,
 			 struct nf_conntrack_tuple *t)
 {
 	struct net *net = nf_ct_net(ct);
-	struct nf_gre_net *net_gre = gre_pernet(net);
 	struct nf_ct_pptp_master *ct_pptp_info = nfct_help_data(ct);
 	struct nf_ct_gre_keymap **kmp, *km;
 
 	kmp = &ct_pptp_info->keymap[dir];
 	if (*kmp) {
 		/* check whether it's a retransmission */
-		list_for_each_entry_rcu(km, &net_gre->keymap_list, list) {
-			if (gre_key_cmpfn(km, t) && km == *kmp)
-				return 0;
-		}
+		if (gre_key_cmpfn(*kmp, t))
+			return 0;
+
 		pr_debug("trying to override keymap_%s for ct %p\n",
 			 dir == IP_CT_DIR_REPLY ? "reply" : "orig", ct);
 		return -EEXIST;
@@ -110,13 +131,15 @@ int nf_ct_gre_keymap_add(struct nf_conn *ct, enum ip_conntrack_dir dir,
 	if (!km)
 		return -ENOMEM;
 	memcpy(&km->tuple, t, sizeof(*t));
+	write_pnet(&km->net, net);
 	*kmp = km;
 
 	pr_debug("adding new entry %p: ", km);
 	nf_ct_dump_tuple(&km->tuple);
 
 	spin_lock_bh(&keymap_lock);
-	list_add_tail(&km->list, &net_gre->keymap_list);
+	hlist_add_head_rcu(&km->hnode,
+			   &gre_keymap_hash[gre_keymap_hashfn(net, t)]);
 	spin_unlock_bh(&keymap_lock);
 
 	return 0;
@@ -134,9 +157,9 @@ void nf_ct_gre_keymap_destroy(struct nf_conn *ct)
 	spin_lock_bh(&keymap_lock);
 	for (dir = IP_CT_DIR_ORIGINAL; dir < IP_CT_DIR_MAX; dir++) {
 		if (ct_pptp_info->keymap[dir]) {
-			pr_debug("removing %p from list\n",
+			pr_debug("removing %p from hash\n",
 				 ct_pptp_info->keymap[dir]);
-			list_del_rcu(&ct_pptp_info->keymap[dir]->list);
+			hlist_del_rcu(&ct_pptp_info->keymap[dir]->hnode);
 			kfree_rcu(ct_pptp_info->keymap[dir], rcu);
 			ct_pptp_info->keymap[dir] = NULL;
 		}
@@ -296,7 +319,6 @@ void nf_conntrack_gre_init_net(struct net *net)
 	struct nf_gre_net *net_gre = gre_pernet(net);
 	int i;
 
-	INIT_LIST_HEAD(&net_gre->keymap_list);
 	for (i = 0; i < GRE_CT_MAX; i++)
 		net_gre->timeouts[i] = gre_timeouts[i];
 }
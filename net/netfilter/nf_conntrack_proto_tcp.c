@@ -321,6 +321,9 @@ static inline __u32 segment_seq_plus_len(__u32 seq,
 		+ (tcph->syn ? 1 : 0) + (tcph->fin ? 1 : 0));
 }
 
+/* tcp_be_liberal value: don't track windows */
+#define TCP_LOOSE_TRACKING		2
+
 /* Fixme: what about big packets? */
 #define MAXACKWINCONST			66000
 #define MAXACKWINDOW(sender)						\
@@ -959,6 +962,107 @@ static void nf_ct_tcp_state_reset(struct ip_ct_tcp_state *state)
 	state->flags		&= IP_CT_TCP_FLAG_BE_LIBERAL;
 }
 
+/* Short path of tcp_in_window() for the common case: a segment of an
+ * assured, established connection without SYN, FIN or RST and without
+ * sequence adjustment, that carries new data or acknowledges new data
+ * and stays within the current windows.
+ *
+ * The segment is first checked against the windows without ct->lock,
+ * read-only: everything else, including retransmissions, returns false
+ * and goes through the state machine.  The checks are then repeated
+ * under ct->lock, which the update of the window edges, the
+ * retransmission bookkeeping and the timeout refresh are done with, so
+ * that they can't race with a state change done by the locked path.
+ */
+static bool tcp_in_window_fast(struct nf_conn *ct, enum ip_conntrack_info ctinfo,
+			       const struct sk_buff *skb, unsigned int dataoff,
+			       const struct tcphdr *tcph,
+			       const unsigned int *timeouts)
+{
+	enum ip_conntrack_dir dir = CTINFO2DIR(ctinfo);
+	struct ip_ct_tcp *state = &ct->proto.tcp;
+	struct ip_ct_tcp_state *sender = &state->seen[dir];
+	struct ip_ct_tcp_state *receiver = &state->seen[!dir];
+	u32 seq, ack, sack, end, win, swin;
+	unsigned int timeout;
+	u16 win_raw;
+
+	if (READ_ONCE(state->state) != TCP_CONNTRACK_ESTABLISHED ||
+	    !test_bit(IPS_ASSURED_BIT, &ct->status) ||
+	    test_bit(IPS_SEQ_ADJUST_BIT, &ct->status) ||
+	    get_conntrack_index(tcph) != TCP_ACK_SET)
+		return false;
+
+	if (!(READ_ONCE(sender->flags) & IP_CT_TCP_FLAG_MAXACK_SET) ||
+	    !READ_ONCE(sender->td_maxwin) || !READ_ONCE(receiver->td_maxwin))
+		return false;
+
+	seq = ntohl(tcph->seq);
+	ack = sack = ntohl(tcph->ack_seq);
+	win_raw = ntohs(tcph->window);
+	end = segment_seq_plus_len(seq, skb->len, dataoff, tcph);
+	if (!win_raw)
+		return false;
+
+	if (READ_ONCE(receiver->flags) & IP_CT_TCP_FLAG_SACK_PERM)
+		tcp_sack(skb, dataoff, tcph, &sack);
+
+	/* retransmission or duplicate ack */
+	if (!after(end, READ_ONCE(sender->td_end)) &&
+	    !after(ack, READ_ONCE(sender->td_maxack)))
+		return false;
+
+	spin_lock_bh(&ct->lock);
+
+	/* the bounds tcp_in_window() checks, tightened so that they
+	 * don't need to move receiver->td_maxwin
+	 */
+	if (state->state != TCP_CONNTRACK_ESTABLISHED ||
+	    !sender->td_maxwin || !receiver->td_maxwin ||
+	    (!after(end, sender->td_end) && !after(ack, sender->td_maxack)) ||
+	    after(end, sender->td_maxend) ||
+	    !before(sack, receiver->td_end + 1) ||
+	    !after(end, sender->td_end - receiver->td_maxwin - 1) ||
+	    !after(sack, receiver->td_end - MAXACKWINDOW(sender) - 1)) {
+		spin_unlock_bh(&ct->lock);
+		return false;
+	}
+
+	win = win_raw << sender->td_scale;
+	swin = win + (sack - ack);
+	if (sender->td_maxwin < swin)
+		sender->td_maxwin = swin;
+	if (after(end, sender->td_end)) {
+		sender->td_end = end;
+		sender->flags |= IP_CT_TCP_FLAG_DATA_UNACKNOWLEDGED;
+	}
+	if (after(ack, sender->td_maxack))
+		sender->td_maxack = ack;
+	if (after(sack + win, receiver->td_maxend - 1))
+		receiver->td_maxend = sack + win;
+	if (ack == receiver->td_end)
+		receiver->flags &= ~IP_CT_TCP_FLAG_DATA_UNACKNOWLEDGED;
+
+	/* new data or a new ack, this is not a retransmission */
+	state->last_dir = dir;
+	state->last_seq = seq;
+	state->last_ack = ack;
+	state->last_end = end;
+	state->last_win = win_raw;
+	state->retrans = 0;
+
+	timeout = timeouts[TCP_CONNTRACK_ESTABLISHED];
+	if ((sender->flags | receiver->flags) &
+	    IP_CT_TCP_FLAG_DATA_UNACKNOWLEDGED &&
+	    timeout > timeouts[TCP_CONNTRACK_UNACK])
+		timeout = timeouts[TCP_CONNTRACK_UNACK];
+
+	nf_ct_refresh_acct(ct, ctinfo, skb, timeout);
+	spin_unlock_bh(&ct->lock);
+
+	return true;
+}
+
 /* Returns verdict for packet, or -1 for invalid. */
 int nf_conntrack_tcp_packet(struct nf_conn *ct,
 			    struct sk_buff *skb,
@@ -986,6 +1090,15 @@ int nf_conntrack_tcp_packet(struct nf_conn *ct,
 	if (!nf_ct_is_confirmed(ct) && !tcp_new(ct, skb, dataoff, th, state))
 		return -NF_ACCEPT;
 
+	if (READ_ONCE(tn->tcp_fastpath) && nf_ct_is_confirmed(ct)) {
+		timeouts = nf_ct_timeout_lookup(ct);
+		if (!timeouts)
+			timeouts = tn->timeouts;
+
+		if (tcp_in_window_fast(ct, ctinfo, skb, dataoff, th, timeouts))
+			return NF_ACCEPT;
+	}
+
 	spin_lock_bh(&ct->lock);
 	old_state = ct->proto.tcp.state;
 	dir = CTINFO2DIR(ctinfo);
@@ -1250,6 +1363,9 @@ int nf_conntrack_tcp_packet(struct nf_conn *ct,
 		break;
 	}
 
+	if (tn->tcp_be_liberal == TCP_LOOSE_TRACKING)
+		goto in_window;
+
 	res = tcp_in_window(ct, dir, index,
 			    skb, dataoff, th, state);
 	switch (res) {
@@ -1599,12 +1715,20 @@ void nf_conntrack_tcp_init_net(struct net *net)
 	/* "Be conservative in what you do,
 	 *  be liberal in what you accept from others."
 	 * If it's non-zero, we mark only out of window RST segments as INVALID.
+	 * With TCP_LOOSE_TRACKING, windows aren't tracked at all and only
+	 * the flags drive the state machine, e.g. for asymmetric routing
+	 * where one direction is never seen.
 	 */
 	tn->tcp_be_liberal = 0;
 
 	/* If it's non-zero, we turn off RST sequence number check */
 	tn->tcp_ignore_invalid_rst = 0;
 
+	/* If it's non-zero, in-window segments of assured connections skip
+	 * the state machine, see tcp_in_window_fast().
+	 */
+	tn->tcp_fastpath = 0;
+
 	/* Max number of the retransmitted packets without receiving an (acceptable)
 	 * ACK from the destination. If this number is reached, a shorter timer
 	 * will be started.
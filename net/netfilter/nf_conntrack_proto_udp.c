@@ -29,11 +29,60 @@ static const unsigned int udp_timeouts[UDP_CT_MAX] = {
 	[UDP_CT_REPLIED]	= 120*HZ,
 };
 
+/* UDP_CT_UNREPLIED applies to unreplied UDP/443 and to handshakes */
+static const unsigned int udp_quic_timeouts[UDP_CT_MAX] = {
+	[UDP_CT_UNREPLIED]	= 10*HZ,
+	[UDP_CT_REPLIED]	= 180*HZ,
+};
+
+#define QUIC_PORT		443
+/* RFC 9000, 14.1: datagrams carrying a client Initial are padded to 1200 */
+#define QUIC_MIN_INITIAL	1200
+
+enum {
+	UDP_QUIC_INITIAL	= BIT(0),	/* opened with a client Initial */
+	UDP_QUIC_SHORT_ORIG	= BIT(1),	/* 1-RTT seen, original dir */
+	UDP_QUIC_SHORT_REPLY	= BIT(2),	/* 1-RTT seen, reply dir */
+};
+
+#define UDP_QUIC_ESTABLISHED	(UDP_QUIC_SHORT_ORIG | UDP_QUIC_SHORT_REPLY)
+
+enum udp_quic_hdr {
+	QUIC_HDR_NONE,
+	QUIC_HDR_SHORT,
+	QUIC_HDR_LONG,
+};
+
 static unsigned int *udp_get_timeouts(struct net *net)
 {
 	return nf_udp_pernet(net)->timeouts;
 }
 
+/* The policy is looked up once and copied into the conntrack, the copy is
+ * dropped when a policy is replaced or detached, see nf_ct_timeout_genid.
+ */
+static const unsigned int *udp_ct_timeouts(struct nf_conn *ct)
+{
+#ifdef CONFIG_NF_CONNTRACK_TIMEOUT
+	struct nf_ct_udp *udp = &ct->proto.udp;
+	u32 genid = atomic_read(&nf_ct_timeout_genid);
+	const unsigned int *timeouts;
+
+	if (smp_load_acquire(&udp->timeout_genid) != genid) {
+		timeouts = nf_ct_timeout_lookup(ct);
+		udp->has_timeouts = !!timeouts;
+		if (timeouts)
+			memcpy(udp->timeouts, timeouts, sizeof(udp->timeouts));
+		smp_store_release(&udp->timeout_genid, genid);
+		if (timeouts)
+			return timeouts;
+	} else if (udp->has_timeouts) {
+		return udp->timeouts;
+	}
+#endif
+	return udp_get_timeouts(nf_ct_net(ct));
+}
+
 static void udp_error_log(const struct sk_buff *skb,
 			  const struct nf_hook_state *state,
 			  const char *msg)
@@ -80,6 +129,88 @@ static bool udp_error(struct sk_buff *skb,
 	return false;
 }
 
+/* RFC 8999: the high bit selects the long header.  The fixed bit is set
+ * in a client's first Initial, but peers may grease it afterwards
+ * (RFC 9287), so it is only tested when @fixed is set.
+ */
+static enum udp_quic_hdr udp_quic_header(const struct sk_buff *skb,
+					 unsigned int dataoff, bool fixed)
+{
+	const u8 *b;
+	u8 _b;
+
+	b = skb_header_pointer(skb, dataoff + sizeof(struct udphdr),
+			       sizeof(_b), &_b);
+	if (!b || (fixed && !(*b & 0x40)))
+		return QUIC_HDR_NONE;
+
+	return *b & 0x80 ? QUIC_HDR_LONG : QUIC_HDR_SHORT;
+}
+
+/* Flows to UDP/443 opened with a client Initial are assured once 1-RTT
+ * packets, short headers, went both ways: the handshake is complete.
+ * Unreplied UDP/443 and handshakes that don't complete keep the short
+ * timeout, so that junk and scans don't hold on to the table.
+ * Returns false to handle the packet as plain UDP.
+ */
+static bool udp_quic_packet(struct nf_conn *ct, struct sk_buff *skb,
+			    unsigned int dataoff, enum ip_conntrack_info ctinfo,
+			    unsigned long status)
+{
+	const struct nf_udp_net *un = nf_udp_pernet(nf_ct_net(ct));
+	struct nf_ct_udp *udp = &ct->proto.udp;
+	enum udp_quic_hdr hdr;
+	u8 quic, old;
+
+	if (ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u.udp.port !=
+	    htons(QUIC_PORT))
+		return false;
+
+	old = READ_ONCE(udp->quic);
+	quic = old;
+	hdr = udp_quic_header(skb, dataoff, !(quic & UDP_QUIC_INITIAL));
+
+	if ((status & IPS_CONFIRMED) == 0) {
+		if (hdr == QUIC_HDR_LONG &&
+		    skb->len - dataoff >= sizeof(struct udphdr) + QUIC_MIN_INITIAL)
+			quic |= UDP_QUIC_INITIAL;
+	} else if ((quic & UDP_QUIC_INITIAL) && hdr == QUIC_HDR_SHORT) {
+		if (CTINFO2DIR(ctinfo) == IP_CT_DIR_ORIGINAL)
+			quic |= UDP_QUIC_SHORT_ORIG;
+		else
+			quic |= UDP_QUIC_SHORT_REPLY;
+	}
+
+	/* racing updates may lose a bit, the next 1-RTT packet sets it again */
+	if (quic != old)
+		WRITE_ONCE(udp->quic, quic);
+
+	if (!(quic & UDP_QUIC_INITIAL)) {
+		if (status & IPS_SEEN_REPLY)
+			return false;
+
+		nf_ct_refresh_acct(ct, ctinfo, skb,
+				   READ_ONCE(un->quic_timeouts[UDP_CT_UNREPLIED]));
+		return true;
+	}
+
+	if ((quic & UDP_QUIC_ESTABLISHED) != UDP_QUIC_ESTABLISHED) {
+		nf_ct_refresh_acct(ct, ctinfo, skb,
+				   READ_ONCE(un->quic_timeouts[UDP_CT_UNREPLIED]));
+		return true;
+	}
+
+	nf_ct_refresh_acct(ct, ctinfo, skb,
+			   READ_ONCE(un->quic_timeouts[UDP_CT_REPLIED]));
+
+	/* never set ASSURED for IPS_NAT_CLASH, they time out soon */
+	if (likely(!(status & IPS_NAT_CLASH)) &&
+	    !test_and_set_bit(IPS_ASSURED_BIT, &ct->status))
+		nf_conntrack_event_cache(IPCT_ASSURED, ct);
+
+	return true;
+}
+
 /* Returns verdict for packet, and may modify conntracktype */
 int nf_conntrack_udp_packet(struct nf_conn *ct,
 			    struct sk_buff *skb,
@@ -87,20 +218,24 @@ int nf_conntrack_udp_packet(struct nf_conn *ct,
 			    enum ip_conntrack_info ctinfo,
 			    const struct nf_hook_state *state)
 {
-	unsigned int *timeouts;
+	const unsigned int *timeouts;
 	unsigned long status;
 
 	if (udp_error(skb, dataoff, state))
 		return -NF_ACCEPT;
 
-	timeouts = nf_ct_timeout_lookup(ct);
-	if (!timeouts)
-		timeouts = udp_get_timeouts(nf_ct_net(ct));
+	timeouts = udp_ct_timeouts(ct);
 
 	status = READ_ONCE(ct->status);
 	if ((status & IPS_CONFIRMED) == 0)
 		ct->proto.udp.stream_ts = 2 * HZ + jiffies;
 
+	/* an explicit timeout policy overrides the QUIC timeouts */
+	if (READ_ONCE(nf_udp_pernet(nf_ct_net(ct))->quic) &&
+	    timeouts == udp_get_timeouts(nf_ct_net(ct)) &&
+	    udp_quic_packet(ct, skb, dataoff, ctinfo, status))
+		return NF_ACCEPT;
+
 	/* If we've seen traffic both ways, this is some kind of UDP
 	 * stream. Set Assured.
 	 */
@@ -186,14 +321,12 @@ int nf_conntrack_udplite_packet(struct nf_conn *ct,
 				enum ip_conntrack_info ctinfo,
 				const struct nf_hook_state *state)
 {
-	unsigned int *timeouts;
+	const unsigned int *timeouts;
 
 	if (udplite_error(skb, dataoff, state))
 		return -NF_ACCEPT;
 
-	timeouts = nf_ct_timeout_lookup(ct);
-	if (!timeouts)
-		timeouts = udp_get_timeouts(nf_ct_net(ct));
+	timeouts = udp_ct_timeouts(ct);
 
 	/* If we've seen traffic both ways, this is some kind of UDP
 	   stream.  Extend timeout. */
@@ -271,8 +404,10 @@ void nf_conntrack_udp_init_net(struct net *net)
 	struct nf_udp_net *un = nf_udp_pernet(net);
 	int i;
 
-	for (i = 0; i < UDP_CT_MAX; i++)
+	for (i = 0; i < UDP_CT_MAX; i++) {
 		un->timeouts[i] = udp_timeouts[i];
+		un->quic_timeouts[i] = udp_quic_timeouts[i];
+	}
 
 #if IS_ENABLED(CONFIG_NF_FLOW_TABLE)
 	un->offload_timeout = 30 * HZ;
@@ -309,6 +309,38 @@ static const struct sip_header ct_sip_hdrs[] = {
 	[SIP_HDR_CALL_ID]		= SIP_HDR("Call-Id", "i", NULL, callid_len),
 };
 
+#define SIP_INDEX_NONE	UINT_MAX
+
+/* Offset of the end of the line preceding the first SIP and SDP header of
+ * each type in the message being processed, SIP_INDEX_NONE if there is none.
+ * Built once per message by sip_index_msg(), so that the lookups starting
+ * from the beginning of the message don't scan it again and again, and kept
+ * in sync by ct_sip_index_mangled() while the NAT helper rewrites it.
+ */
+struct sip_msg_index {
+	const char	*dptr;
+	unsigned int	datalen;
+	unsigned int	sip[SIP_HDR_CALL_ID + 1];
+	unsigned int	sdp[SDP_HDR_MEDIA + 1];
+};
+
+static DEFINE_PER_CPU(struct sip_msg_index, sip_msg_index);
+
+/* Only valid while process_sip_msg() runs, with BHs disabled */
+static struct sip_msg_index *sip_index_get(const char *dptr,
+					   unsigned int datalen)
+{
+	struct sip_msg_index *idx;
+
+	if (!in_softirq())
+		return NULL;
+
+	idx = this_cpu_ptr(&sip_msg_index);
+	if (idx->dptr != dptr || idx->datalen != datalen)
+		return NULL;
+	return idx;
+}
+
 static const char *sip_follow_continuation(const char *dptr, const char *limit)
 {
 	/* Walk past newline */
@@ -369,10 +401,18 @@ int ct_sip_get_header(const struct nf_conn *ct, const char *dptr,
 		      enum sip_header_types type,
 		      unsigned int *matchoff, unsigned int *matchlen)
 {
+	const struct sip_msg_index *idx = sip_index_get(dptr, datalen);
 	const struct sip_header *hdr = &ct_sip_hdrs[type];
 	const char *start = dptr, *limit = dptr + datalen;
 	int shift = 0;
 
+	/* Go straight to the first header of this type */
+	if (idx && dataoff <= idx->sip[type]) {
+		if (idx->sip[type] == SIP_INDEX_NONE)
+			return 0;
+		dataoff = idx->sip[type];
+	}
+
 	for (dptr += dataoff; dptr < limit; dptr++) {
 		/* Find beginning of line */
 		if (*dptr != '\r' && *dptr != '\n')
@@ -707,6 +747,105 @@ static const struct sip_header ct_sdp_hdrs_v6[] = {
 	[SDP_HDR_MEDIA]		= SDP_HDR("m=", NULL, media_len),
 };
 
+static bool sip_index_match(const struct sip_header *hdr, const char *dptr,
+			    const char *limit)
+{
+	if (limit - dptr >= hdr->len &&
+	    strncasecmp(dptr, hdr->name, hdr->len) == 0)
+		return true;
+	return hdr->cname && limit - dptr >= hdr->clen + 1 &&
+	       strncasecmp(dptr, hdr->cname, hdr->clen) == 0 &&
+	       !isalpha(*(dptr + hdr->clen));
+}
+
+/* Walk the lines of the message once, the way ct_sip_get_header() and
+ * ct_sip_get_sdp_header() do, and record where each header type first
+ * shows up.  SDP header names are the same for both families.
+ */
+static void sip_index_msg(struct sip_msg_index *idx, const char *dptr,
+			  unsigned int datalen)
+{
+	const char *start = dptr, *limit = dptr + datalen, *eol;
+	unsigned int i;
+
+	idx->dptr = dptr;
+	idx->datalen = datalen;
+	for (i = 0; i < ARRAY_SIZE(idx->sip); i++)
+		idx->sip[i] = SIP_INDEX_NONE;
+	for (i = 0; i < ARRAY_SIZE(idx->sdp); i++)
+		idx->sdp[i] = SIP_INDEX_NONE;
+
+	for (; dptr < limit; dptr++) {
+		if (*dptr != '\r' && *dptr != '\n')
+			continue;
+		eol = dptr;
+		if (++dptr >= limit)
+			break;
+		if (*(dptr - 1) == '\r' && *dptr == '\n') {
+			if (++dptr >= limit)
+				break;
+		}
+
+		for (i = SDP_HDR_VERSION; i < ARRAY_SIZE(idx->sdp); i++) {
+			if (idx->sdp[i] == SIP_INDEX_NONE &&
+			    sip_index_match(&ct_sdp_hdrs_v4[i], dptr, limit))
+				idx->sdp[i] = eol - start;
+		}
+
+		if (*dptr == ' ' || *dptr == '\t')
+			continue;
+
+		for (i = 0; i < ARRAY_SIZE(idx->sip); i++) {
+			if (idx->sip[i] == SIP_INDEX_NONE &&
+			    sip_index_match(&ct_sip_hdrs[i], dptr, limit))
+				idx->sip[i] = eol - start;
+		}
+	}
+}
+
+static bool sip_index_shift(unsigned int *off, unsigned int n,
+			    unsigned int matchoff, unsigned int matchlen,
+			    int diff)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		if (off[i] == SIP_INDEX_NONE || off[i] < matchoff)
+			continue;
+		/* a line boundary was rewritten */
+		if (off[i] < matchoff + matchlen)
+			return false;
+		off[i] += diff;
+	}
+	return true;
+}
+
+/* The NAT helper replaced @matchlen bytes at @matchoff of the message
+ * @olddptr, the result is @dptr of @datalen bytes.
+ */
+void ct_sip_index_mangled(const char *olddptr, unsigned int olddatalen,
+			  const char *dptr, unsigned int datalen,
+			  unsigned int matchoff, unsigned int matchlen)
+{
+	struct sip_msg_index *idx = sip_index_get(olddptr, olddatalen);
+	int diff = datalen - olddatalen;
+
+	if (!idx)
+		return;
+
+	if (!sip_index_shift(idx->sip, ARRAY_SIZE(idx->sip),
+			     matchoff, matchlen, diff) ||
+	    !sip_index_shift(idx->sdp, ARRAY_SIZE(idx->sdp),
+			     matchoff, matchlen, diff)) {
+		idx->dptr = NULL;
+		return;
+	}
+
+	idx->dptr = dptr;
+	idx->datalen = datalen;
+}
+EXPORT_SYMBOL_GPL(ct_sip_index_mangled);
+
 /* Linear string search within SDP header values */
 static const char *ct_sdp_header_search(const char *dptr, const char *limit,
 					const char *needle, unsigned int len)
@@ -730,14 +869,28 @@ int ct_sip_get_sdp_header(const struct nf_conn *ct, const char *dptr,
 			  enum sdp_header_types term,
 			  unsigned int *matchoff, unsigned int *matchlen)
 {
-	const struct sip_header *hdrs, *hdr, *thdr;
+	const struct sip_msg_index *idx = sip_index_get(dptr, datalen);
 	const char *start = dptr, *limit = dptr + datalen;
+	const struct sip_header *hdrs, *hdr, *thdr;
+	unsigned int first;
 	int shift = 0;
 
 	hdrs = nf_ct_l3num(ct) == NFPROTO_IPV4 ? ct_sdp_hdrs_v4 : ct_sdp_hdrs_v6;
 	hdr = &hdrs[type];
 	thdr = &hdrs[term];
 
+	/* Go straight to the first header of this type or the term one */
+	if (idx) {
+		first = idx->sdp[type];
+		if (term != SDP_HDR_UNSPEC)
+			first = min(first, idx->sdp[term]);
+		if (dataoff <= first) {
+			if (first == SIP_INDEX_NONE)
+				return 0;
+			dataoff = first;
+		}
+	}
+
 	for (dptr += dataoff; dptr < limit; dptr++) {
 		/* Find beginning of line */
 		if (*dptr != '\r' && *dptr != '\n')
@@ -1510,8 +1663,13 @@ static int process_sip_msg(struct sk_buff *skb, struct nf_conn *ct,
 			   const char **dptr, unsigned int *datalen)
 {
 	const struct nf_nat_sip_hooks *hooks;
+	struct sip_msg_index *idx;
 	int ret;
 
+	local_bh_disable();
+	idx = this_cpu_ptr(&sip_msg_index);
+	sip_index_msg(idx, *dptr, *datalen);
+
 	if (strncasecmp(*dptr, "SIP/2.0 ", strlen("SIP/2.0 ")) != 0)
 		ret = process_sip_request(skb, protoff, dataoff, dptr, datalen);
 	else
@@ -1526,6 +1684,9 @@ static int process_sip_msg(struct sk_buff *skb, struct nf_conn *ct,
 		}
 	}
 
+	idx->dptr = NULL;
+	local_bh_enable();
+
 	return ret;
 }
 
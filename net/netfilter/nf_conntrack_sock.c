@@ -0,0 +1,116 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Established socket of a connection, cached in its conntrack entry.
+ *
+ * nft_socket and nft_tproxy look the local socket of a packet up in the
+ * socket tables, for every packet.  Once the socket of the original
+ * direction of a connection is established, the entry keeps a reference
+ * to it and later packets of that direction take it from there.  The
+ * reference is dropped when the entry is destroyed, or as soon as a packet
+ * or the conntrack gc worker finds the socket is no longer established:
+ * a closed socket, and the netns it holds, is not pinned for the lifetime
+ * of the entry.
+ *
+ * Entries with NAT are left alone, their packets may be looked up with
+ * different addresses at different hooks.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <net/sock.h>
+#include <net/tcp_states.h>
+
+#include <net/netfilter/nf_conntrack.h>
+#include <net/netfilter/nf_conntrack_sock.h>
+
+static struct nf_conn *nf_ct_sk_ct(const struct sk_buff *skb)
+{
+	enum ip_conntrack_info ctinfo;
+	struct nf_conn *ct;
+
+	ct = nf_ct_get(skb, &ctinfo);
+	if (!ct || (ctinfo != IP_CT_NEW && ctinfo != IP_CT_ESTABLISHED))
+		return NULL;
+
+	if (READ_ONCE(ct->status) & IPS_NAT_MASK)
+		return NULL;
+
+	return ct;
+}
+
+static void nf_ct_sk_drop(struct nf_conn *ct, struct sock *sk)
+{
+	if (unrcu_pointer(cmpxchg(&ct->sk, RCU_INITIALIZER(sk), NULL)) == sk)
+		sock_put(sk);
+}
+
+/* Returns a reference to the cached socket, like the socket lookups. */
+struct sock *nf_ct_sk_get(const struct sk_buff *skb)
+{
+	struct nf_conn *ct = nf_ct_sk_ct(skb);
+	struct sock *sk;
+
+	if (!ct || !rcu_access_pointer(ct->sk))
+		return NULL;
+
+	/* socket slabs are SLAB_TYPESAFE_BY_RCU: if the reference of the
+	 * entry is dropped in the mean time, this is at worst another socket,
+	 * which the check below catches.
+	 */
+	rcu_read_lock();
+	sk = rcu_dereference(ct->sk);
+	if (sk && !refcount_inc_not_zero(&sk->sk_refcnt))
+		sk = NULL;
+	rcu_read_unlock();
+
+	if (!sk)
+		return NULL;
+
+	if (READ_ONCE(sk->sk_state) == TCP_ESTABLISHED &&
+	    rcu_access_pointer(ct->sk) == sk)
+		return sk;
+
+	nf_ct_sk_drop(ct, sk);
+	sock_put(sk);
+	return NULL;
+}
+EXPORT_SYMBOL_GPL(nf_ct_sk_get);
+
+void nf_ct_sk_set(const struct sk_buff *skb, struct sock *sk)
+{
+	struct nf_conn *ct;
+
+	if (!sk || !sk_fullsock(sk) ||
+	    READ_ONCE(sk->sk_state) != TCP_ESTABLISHED)
+		return;
+
+	ct = nf_ct_sk_ct(skb);
+	if (!ct || rcu_access_pointer(ct->sk) ||
+	    !net_eq(nf_ct_net(ct), sock_net(sk)))
+		return;
+
+	sock_hold(sk);
+	if (unrcu_pointer(cmpxchg(&ct->sk, NULL, RCU_INITIALIZER(sk))))
+		sock_put(sk);
+}
+EXPORT_SYMBOL_GPL(nf_ct_sk_set);
+
+/* Called by the gc worker under RCU, @ct may be freed meanwhile: the
+ * socket slabs are SLAB_TYPESAFE_BY_RCU and only one of the callers
+ * swapping the pointer out drops the reference.
+ */
+void nf_ct_sk_gc(struct nf_conn *ct)
+{
+	struct sock *sk = rcu_dereference(ct->sk);
+
+	if (sk && READ_ONCE(sk->sk_state) != TCP_ESTABLISHED)
+		nf_ct_sk_drop(ct, sk);
+}
+
+void nf_ct_sk_destroy(struct nf_conn *ct)
+{
+	struct sock *sk = unrcu_pointer(xchg(&ct->sk, NULL));
+
+	if (sk)
+		sock_put(sk);
+}
@@ -9,6 +9,7 @@
 #include <linux/percpu.h>
 #include <linux/netdevice.h>
 #include <linux/security.h>
+#include <linux/uaccess.h>
 #include <net/net_namespace.h>
 #ifdef CONFIG_SYSCTL
 #include <linux/sysctl.h>
@@ -20,16 +21,76 @@
 #include <net/netfilter/nf_conntrack_expect.h>
 #include <net/netfilter/nf_conntrack_helper.h>
 #include <net/netfilter/nf_conntrack_acct.h>
+#include <net/netfilter/nf_conntrack_ecache.h>
 #include <net/netfilter/nf_conntrack_zones.h>
 #include <net/netfilter/nf_conntrack_timestamp.h>
+#include <net/netfilter/nf_conntrack_wheel.h>
+#include <linux/netfilter/nf_conntrack_evring.h>
 #include <linux/rculist_nulls.h>
 
 static bool enable_hooks __read_mostly;
 MODULE_PARM_DESC(enable_hooks, "Always enable conntrack hooks");
 module_param(enable_hooks, bool, 0000);
 
+static bool lazy_pernet __read_mostly;
+MODULE_PARM_DESC(lazy_pernet, "Register sysctls and proc files of a new netns when conntrack is first used in it");
+module_param(lazy_pernet, bool, 0444);
+
+/* serializes nf_conntrack_standalone_register_net() */
+static DEFINE_MUTEX(nf_ct_register_mutex);
+
 unsigned int nf_conntrack_net_id __read_mostly;
 
+/* Fill a fixed size record, as used by the event ring and the binary
+ * snapshot of the table, from @ct.
+ */
+void nf_ct_record_fill(struct nf_ct_evring_record *rec, u32 events,
+		       const struct nf_conn *ct)
+{
+	const struct nf_conn_tstamp *tstamp;
+	const struct nf_conn_acct *acct;
+	int dir;
+
+	memset(rec, 0, sizeof(*rec));
+
+	rec->events = events;
+	rec->status = READ_ONCE(ct->status);
+	rec->id = nf_ct_get_id(ct);
+#ifdef CONFIG_NF_CONNTRACK_MARK
+	rec->mark = READ_ONCE(ct->mark);
+#endif
+	rec->zone = nf_ct_zone(ct)->id;
+	rec->l3num = nf_ct_l3num(ct);
+	rec->l4num = nf_ct_protonum(ct);
+	rec->timeout = nf_ct_expires(ct) / HZ;
+	rec->timestamp = ktime_get_real_ns();
+
+	tstamp = nf_conn_tstamp_find(ct);
+	if (tstamp) {
+		rec->start = tstamp->start;
+		rec->stop = tstamp->stop;
+	}
+
+	acct = nf_conn_acct_find(ct);
+	if (acct)
+		nf_ct_acct_sync(ct);
+
+	for (dir = 0; dir < IP_CT_DIR_MAX; dir++) {
+		const struct nf_conntrack_tuple *t = &ct->tuplehash[dir].tuple;
+
+		BUILD_BUG_ON(sizeof(rec->tuple[dir].src) != sizeof(t->src.u3));
+		memcpy(rec->tuple[dir].src, &t->src.u3, sizeof(t->src.u3));
+		memcpy(rec->tuple[dir].dst, &t->dst.u3, sizeof(t->dst.u3));
+		rec->tuple[dir].sport = t->src.u.all;
+		rec->tuple[dir].dport = t->dst.u.all;
+
+		if (acct) {
+			rec->packets[dir] = atomic64_read(&acct->counter[dir].packets);
+			rec->bytes[dir] = atomic64_read(&acct->counter[dir].bytes);
+		}
+	}
+}
+
 #ifdef CONFIG_NF_CONNTRACK_PROCFS
 void
 print_tuple(struct seq_file *s, const struct nf_conntrack_tuple *tuple,
@@ -299,6 +360,8 @@ seq_print_acct(struct seq_file *s, const struct nf_conn *ct, int dir)
 	if (!acct)
 		return;
 
+	nf_ct_acct_sync(ct);
+
 	counter = acct->counter;
 	seq_printf(s, "packets=%llu bytes=%llu ",
 		   (unsigned long long)atomic64_read(&counter[dir].packets),
@@ -401,6 +464,170 @@ static const struct seq_operations ct_seq_ops = {
 	.show  = ct_seq_show
 };
 
+/* /proc/net/nf_conntrack_snapshot: one struct nf_ct_evring_record per
+ * entry, with events set to 0 and the same timestamp for all records
+ * returned by a read().
+ *
+ * This doesn't go through seq_file: records are filled into a buffer
+ * of the open file and copied out once per read(), which only returns
+ * whole records.  Reading at offset 0 starts over.
+ */
+#define CT_SNAPSHOT_BATCH	128
+/* buckets walked per rcu read side section */
+#define CT_SNAPSHOT_BUCKETS	1024
+
+struct ct_snapshot_state {
+	struct net *net;
+	struct mutex lock;
+	unsigned int bucket;
+	/* entries of the bucket already dumped */
+	unsigned int skip_elems;
+	bool eof;
+	struct nf_ct_evring_record rec[CT_SNAPSHOT_BATCH];
+};
+
+/* Fill up to @max records, resuming after the last entry dumped. */
+static unsigned int ct_snapshot_fill(struct ct_snapshot_state *st,
+				     unsigned int max, u64 now)
+{
+	unsigned int htable_size, end, skip, num = 0;
+	struct nf_conntrack_tuple_hash *h;
+	struct hlist_nulls_head *hash;
+	struct hlist_nulls_node *n;
+	struct nf_conn *ct;
+
+	rcu_read_lock();
+	nf_conntrack_get_ht(&hash, &htable_size);
+
+	end = min(st->bucket + CT_SNAPSHOT_BUCKETS, htable_size);
+	for (; st->bucket < end; st->bucket++) {
+restart:
+		skip = 0;
+		hlist_nulls_for_each_entry_rcu(h, n, &hash[st->bucket], hnnode) {
+			if (NF_CT_DIRECTION(h))
+				continue;
+
+			ct = nf_ct_tuplehash_to_ctrack(h);
+			if (!net_eq(nf_ct_net(ct), st->net))
+				continue;
+
+			if (++skip <= st->skip_elems)
+				continue;
+
+			if (num == max)
+				goto out;
+
+			st->skip_elems = skip;
+
+			if (unlikely(!refcount_inc_not_zero(&ct->ct_general.use)))
+				continue;
+
+			/* load ->status after refcount increase */
+			smp_acquire__after_ctrl_dep();
+
+			if (nf_ct_should_gc(ct)) {
+				nf_ct_kill(ct);
+			} else if (net_eq(nf_ct_net(ct), st->net)) {
+				nf_ct_record_fill(&st->rec[num], 0, ct);
+				st->rec[num].timestamp = now;
+				num++;
+			}
+
+			nf_ct_put(ct);
+		}
+
+		/* moved to another chain, entries are skipped or dumped
+		 * twice, like with /proc/net/nf_conntrack
+		 */
+		if (get_nulls_value(n) != st->bucket)
+			goto restart;
+
+		st->skip_elems = 0;
+	}
+
+	if (st->bucket >= htable_size)
+		st->eof = true;
+out:
+	rcu_read_unlock();
+	return num;
+}
+
+static ssize_t ct_snapshot_read(struct file *file, char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct ct_snapshot_state *st = file->private_data;
+	unsigned int max, num = 0;
+	u64 now;
+	size_t len;
+
+	max = min_t(size_t, count / sizeof(st->rec[0]), CT_SNAPSHOT_BATCH);
+	if (!max)
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&st->lock))
+		return -ERESTARTSYS;
+
+	if (*ppos == 0) {
+		st->bucket = 0;
+		st->skip_elems = 0;
+		st->eof = false;
+	}
+
+	now = ktime_get_real_ns();
+	while (!num && !st->eof) {
+		num = ct_snapshot_fill(st, max, now);
+		cond_resched();
+	}
+
+	len = num * sizeof(st->rec[0]);
+	if (len && copy_to_user(buf, st->rec, len)) {
+		mutex_unlock(&st->lock);
+		return -EFAULT;
+	}
+
+	*ppos += len;
+	mutex_unlock(&st->lock);
+	return len;
+}
+
+static int ct_snapshot_open(struct inode *inode, struct file *file)
+{
+	struct ct_snapshot_state *st;
+	struct net *net;
+
+	net = maybe_get_net(PDE_NET(PDE(inode)));
+	if (!net)
+		return -ENXIO;
+
+	st = kvzalloc(sizeof(*st), GFP_KERNEL_ACCOUNT);
+	if (!st) {
+		put_net(net);
+		return -ENOMEM;
+	}
+
+	st->net = net;
+	mutex_init(&st->lock);
+	file->private_data = st;
+	return 0;
+}
+
+static int ct_snapshot_release(struct inode *inode, struct file *file)
+{
+	struct ct_snapshot_state *st = file->private_data;
+
+	put_net(st->net);
+	mutex_destroy(&st->lock);
+	kvfree(st);
+	return 0;
+}
+
+static const struct proc_ops ct_snapshot_proc_ops = {
+	.proc_open	= ct_snapshot_open,
+	.proc_read	= ct_snapshot_read,
+	.proc_lseek	= default_llseek,
+	.proc_release	= ct_snapshot_release,
+};
+
 static void *ct_cpu_seq_start(struct seq_file *seq, loff_t *pos)
 {
 	struct net *net = seq_file_net(seq);
@@ -445,14 +672,15 @@ static int ct_cpu_seq_show(struct seq_file *seq, void *v)
 	unsigned int nr_conntracks;
 
 	if (v == SEQ_START_TOKEN) {
-		seq_puts(seq, "entries  clashres found new invalid ignore delete chainlength insert insert_failed drop early_drop icmp_error  expect_new expect_create expect_delete search_restart\n");
+		seq_puts(seq, "entries  clashres found new invalid ignore delete chainlength insert insert_failed drop early_drop icmp_error  expect_new expect_create expect_delete search_restart buckets_grow buckets_shrink gc_scanned gc_expired gc_evicted found_remote clash_merge clash_harder clash_drop\n");
 		return 0;
 	}
 
 	nr_conntracks = nf_conntrack_count(net);
 
 	seq_printf(seq, "%08x  %08x %08x %08x %08x %08x %08x %08x "
-			"%08x %08x %08x %08x %08x  %08x %08x %08x %08x\n",
+			"%08x %08x %08x %08x %08x  %08x %08x %08x %08x "
+			"%08x %08x %08x %08x %08x %08x %08x %08x %08x\n",
 		   nr_conntracks,
 		   st->clash_resolve,
 		   st->found,
@@ -470,7 +698,16 @@ static int ct_cpu_seq_show(struct seq_file *seq, void *v)
 		   st->expect_new,
 		   st->expect_create,
 		   st->expect_delete,
-		   st->search_restart
+		   st->search_restart,
+		   st->buckets_grow,
+		   st->buckets_shrink,
+		   st->gc_scanned,
+		   st->gc_expired,
+		   st->gc_evicted,
+		   st->found_remote,
+		   st->clash_merge,
+		   st->clash_harder,
+		   st->clash_drop
 		);
 	return 0;
 }
@@ -498,6 +735,14 @@ static int nf_conntrack_standalone_init_proc(struct net *net)
 	if (uid_valid(root_uid) && gid_valid(root_gid))
 		proc_set_user(pde, root_uid, root_gid);
 
+	pde = proc_create("nf_conntrack_snapshot", 0440, net->proc_net,
+			  &ct_snapshot_proc_ops);
+	if (!pde)
+		goto out_nf_conntrack_snapshot;
+
+	if (uid_valid(root_uid) && gid_valid(root_gid))
+		proc_set_user(pde, root_uid, root_gid);
+
 	pde = proc_create_net("nf_conntrack", 0444, net->proc_net_stat,
 			&ct_cpu_seq_ops, sizeof(struct seq_net_private));
 	if (!pde)
@@ -505,6 +750,8 @@ static int nf_conntrack_standalone_init_proc(struct net *net)
 	return 0;
 
 out_stat_nf_conntrack:
+	remove_proc_entry("nf_conntrack_snapshot", net->proc_net);
+out_nf_conntrack_snapshot:
 	remove_proc_entry("nf_conntrack", net->proc_net);
 out_nf_conntrack:
 	return -ENOMEM;
@@ -513,6 +760,7 @@ static int nf_conntrack_standalone_init_proc(struct net *net)
 static void nf_conntrack_standalone_fini_proc(struct net *net)
 {
 	remove_proc_entry("nf_conntrack", net->proc_net_stat);
+	remove_proc_entry("nf_conntrack_snapshot", net->proc_net);
 	remove_proc_entry("nf_conntrack", net->proc_net);
 }
 #else
@@ -528,9 +776,13 @@ static void nf_conntrack_standalone_fini_proc(struct net *net)
 
 u32 nf_conntrack_count(const struct net *net)
 {
-	const struct nf_conntrack_net *cnet = nf_ct_pernet(net);
+	struct nf_conntrack_net *cnet = nf_ct_pernet(net);
+
+	/* sysctl is registered before nf_conntrack_init_net() */
+	if (!percpu_counter_initialized(&cnet->count))
+		return 0;
 
-	return atomic_read(&cnet->count);
+	return percpu_counter_sum_positive(&cnet->count);
 }
 EXPORT_SYMBOL_GPL(nf_conntrack_count);
 
@@ -561,12 +813,32 @@ nf_conntrack_hash_sysctl(const struct ctl_table *table, int write,
 	return ret;
 }
 
+static int
+nf_conntrack_count_sysctl(const struct ctl_table *table, int write,
+			  void *buffer, size_t *lenp, loff_t *ppos)
+{
+	unsigned int count = nf_conntrack_count(table->data);
+	struct ctl_table tmp = {
+		.data	= &count,
+		.maxlen	= sizeof(count),
+	};
+
+	return proc_douintvec(&tmp, write, buffer, lenp, ppos);
+}
+
 static struct ctl_table_header *nf_ct_netfilter_header;
 
 enum nf_ct_sysctl_index {
 	NF_SYSCTL_CT_MAX,
 	NF_SYSCTL_CT_COUNT,
 	NF_SYSCTL_CT_BUCKETS,
+	NF_SYSCTL_CT_BUCKETS_MIN,
+	NF_SYSCTL_CT_BUCKETS_MAX,
+	NF_SYSCTL_CT_EARLY_DROP_POLICY,
+	NF_SYSCTL_CT_NUMA_PLACEMENT,
+#ifdef CONFIG_NF_CONNTRACK_EXPIRY_WHEEL
+	NF_SYSCTL_CT_EXPIRY_WHEEL,
+#endif
 	NF_SYSCTL_CT_CHECKSUM,
 	NF_SYSCTL_CT_LOG_INVALID,
 	NF_SYSCTL_CT_EXPECT_MAX,
@@ -574,6 +846,10 @@ enum nf_ct_sysctl_index {
 #ifdef CONFIG_NF_CONNTRACK_EVENTS
 	NF_SYSCTL_CT_EVENTS,
 #endif
+#ifdef CONFIG_NF_CONNTRACK_EVENTS_RING
+	NF_SYSCTL_CT_EVENTS_RING,
+	NF_SYSCTL_CT_EVENTS_RING_COALESCE,
+#endif
 #ifdef CONFIG_NF_CONNTRACK_TIMESTAMP
 	NF_SYSCTL_CT_TIMESTAMP,
 #endif
@@ -594,9 +870,13 @@ enum nf_ct_sysctl_index {
 	NF_SYSCTL_CT_PROTO_TCP_LOOSE,
 	NF_SYSCTL_CT_PROTO_TCP_LIBERAL,
 	NF_SYSCTL_CT_PROTO_TCP_IGNORE_INVALID_RST,
+	NF_SYSCTL_CT_PROTO_TCP_FASTPATH,
 	NF_SYSCTL_CT_PROTO_TCP_MAX_RETRANS,
 	NF_SYSCTL_CT_PROTO_TIMEOUT_UDP,
 	NF_SYSCTL_CT_PROTO_TIMEOUT_UDP_STREAM,
+	NF_SYSCTL_CT_PROTO_UDP_QUIC,
+	NF_SYSCTL_CT_PROTO_TIMEOUT_UDP_QUIC,
+	NF_SYSCTL_CT_PROTO_TIMEOUT_UDP_QUIC_STREAM,
 #if IS_ENABLED(CONFIG_NF_FLOW_TABLE)
 	NF_SYSCTL_CT_PROTO_TIMEOUT_UDP_OFFLOAD,
 #endif
@@ -644,7 +924,7 @@ static struct ctl_table nf_ct_sysctl_table[] = {
 		.procname	= "nf_conntrack_count",
 		.maxlen		= sizeof(int),
 		.mode		= 0444,
-		.proc_handler	= proc_dointvec,
+		.proc_handler	= nf_conntrack_count_sysctl,
 	},
 	[NF_SYSCTL_CT_BUCKETS] = {
 		.procname       = "nf_conntrack_buckets",
@@ -653,6 +933,49 @@ static struct ctl_table nf_ct_sysctl_table[] = {
 		.mode           = 0644,
 		.proc_handler   = nf_conntrack_hash_sysctl,
 	},
+	[NF_SYSCTL_CT_BUCKETS_MIN] = {
+		.procname	= "nf_conntrack_buckets_min",
+		.data		= &nf_conntrack_buckets_min,
+		.maxlen		= sizeof(unsigned int),
+		.mode		= 0644,
+		.proc_handler	= proc_douintvec,
+	},
+	[NF_SYSCTL_CT_BUCKETS_MAX] = {
+		.procname	= "nf_conntrack_buckets_max",
+		.data		= &nf_conntrack_buckets_max,
+		.maxlen		= sizeof(unsigned int),
+		.mode		= 0644,
+		.proc_handler	= proc_douintvec,
+	},
+	[NF_SYSCTL_CT_EARLY_DROP_POLICY] = {
+		.procname	= "nf_conntrack_early_drop_policy",
+		.data		= &nf_conntrack_early_drop_policy,
+		.maxlen		= sizeof(u8),
+		.mode		= 0644,
+		.proc_handler	= proc_dou8vec_minmax,
+		.extra1		= SYSCTL_ZERO,
+		.extra2		= SYSCTL_TWO,
+	},
+	[NF_SYSCTL_CT_NUMA_PLACEMENT] = {
+		.procname	= "nf_conntrack_numa_placement",
+		.data		= &nf_conntrack_numa_placement,
+		.maxlen		= sizeof(u8),
+		.mode		= 0644,
+		.proc_handler	= proc_dou8vec_minmax,
+		.extra1		= SYSCTL_ZERO,
+		.extra2		= SYSCTL_ONE,
+	},
+#ifdef CONFIG_NF_CONNTRACK_EXPIRY_WHEEL
+	[NF_SYSCTL_CT_EXPIRY_WHEEL] = {
+		.procname	= "nf_conntrack_expiry_wheel",
+		.data		= &nf_conntrack_expiry_wheel,
+		.maxlen		= sizeof(u8),
+		.mode		= 0644,
+		.proc_handler	= proc_dou8vec_minmax,
+		.extra1		= SYSCTL_ZERO,
+		.extra2		= SYSCTL_ONE,
+	},
+#endif
 	[NF_SYSCTL_CT_CHECKSUM] = {
 		.procname	= "nf_conntrack_checksum",
 		.data		= &init_net.ct.sysctl_checksum,
@@ -695,9 +1018,24 @@ static struct ctl_table nf_ct_sysctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= proc_dou8vec_minmax,
 		.extra1 	= SYSCTL_ZERO,
-		.extra2		= SYSCTL_TWO,
+		.extra2		= SYSCTL_THREE,
+	},
+#ifdef CONFIG_NF_CONNTRACK_EVENTS_RING
+	[NF_SYSCTL_CT_EVENTS_RING] = {
+		.procname	= "nf_conntrack_events_ring",
+		.maxlen		= sizeof(u8),
+		.mode		= 0644,
+		.proc_handler	= nf_ct_evring_sysctl,
+	},
+	[NF_SYSCTL_CT_EVENTS_RING_COALESCE] = {
+		.procname	= "nf_conntrack_events_ring_coalesce",
+		.data		= &nf_ct_evring_coalesce_ms,
+		.maxlen		= sizeof(unsigned int),
+		.mode		= 0644,
+		.proc_handler	= proc_douintvec,
 	},
 #endif
+#endif
 #ifdef CONFIG_NF_CONNTRACK_TIMESTAMP
 	[NF_SYSCTL_CT_TIMESTAMP] = {
 		.procname	= "nf_conntrack_timestamp",
@@ -797,7 +1135,7 @@ static struct ctl_table nf_ct_sysctl_table[] = {
 		.mode           = 0644,
 		.proc_handler	= proc_dou8vec_minmax,
 		.extra1 	= SYSCTL_ZERO,
-		.extra2 	= SYSCTL_ONE,
+		.extra2 	= SYSCTL_TWO,
 	},
 	[NF_SYSCTL_CT_PROTO_TCP_IGNORE_INVALID_RST] = {
 		.procname	= "nf_conntrack_tcp_ignore_invalid_rst",
@@ -807,6 +1145,14 @@ static struct ctl_table nf_ct_sysctl_table[] = {
 		.extra1		= SYSCTL_ZERO,
 		.extra2		= SYSCTL_ONE,
 	},
+	[NF_SYSCTL_CT_PROTO_TCP_FASTPATH] = {
+		.procname	= "nf_conntrack_tcp_fastpath",
+		.maxlen		= sizeof(u8),
+		.mode		= 0644,
+		.proc_handler	= proc_dou8vec_minmax,
+		.extra1		= SYSCTL_ZERO,
+		.extra2		= SYSCTL_ONE,
+	},
 	[NF_SYSCTL_CT_PROTO_TCP_MAX_RETRANS] = {
 		.procname	= "nf_conntrack_tcp_max_retrans",
 		.maxlen		= sizeof(u8),
@@ -825,6 +1171,26 @@ static struct ctl_table nf_ct_sysctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= proc_dointvec_jiffies,
 	},
+	[NF_SYSCTL_CT_PROTO_UDP_QUIC] = {
+		.procname	= "nf_conntrack_udp_quic",
+		.maxlen		= sizeof(u8),
+		.mode		= 0644,
+		.proc_handler	= proc_dou8vec_minmax,
+		.extra1		= SYSCTL_ZERO,
+		.extra2		= SYSCTL_ONE,
+	},
+	[NF_SYSCTL_CT_PROTO_TIMEOUT_UDP_QUIC] = {
+		.procname	= "nf_conntrack_udp_timeout_quic",
+		.maxlen		= sizeof(unsigned int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec_jiffies,
+	},
+	[NF_SYSCTL_CT_PROTO_TIMEOUT_UDP_QUIC_STREAM] = {
+		.procname	= "nf_conntrack_udp_timeout_quic_stream",
+		.maxlen		= sizeof(unsigned int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec_jiffies,
+	},
 #if IS_ENABLED(CONFIG_NF_FLOW_TABLE)
 	[NF_SYSCTL_CT_PROTO_TIMEOUT_UDP_OFFLOAD] = {
 		.procname	= "nf_flowtable_udp_timeout",
@@ -1002,6 +1368,7 @@ static void nf_conntrack_standalone_init_tcp_sysctl(struct net *net,
 	XASSIGN(LIBERAL, &tn->tcp_be_liberal);
 	XASSIGN(MAX_RETRANS, &tn->tcp_max_retrans);
 	XASSIGN(IGNORE_INVALID_RST, &tn->tcp_ignore_invalid_rst);
+	XASSIGN(FASTPATH, &tn->tcp_fastpath);
 #undef XASSIGN
 
 #if IS_ENABLED(CONFIG_NF_FLOW_TABLE)
@@ -1079,7 +1446,7 @@ static int nf_conntrack_standalone_init_sysctl(struct net *net)
 	if (!table)
 		return -ENOMEM;
 
-	table[NF_SYSCTL_CT_COUNT].data = &cnet->count;
+	table[NF_SYSCTL_CT_COUNT].data = net;
 	table[NF_SYSCTL_CT_CHECKSUM].data = &net->ct.sysctl_checksum;
 	table[NF_SYSCTL_CT_LOG_INVALID].data = &net->ct.sysctl_log_invalid;
 	table[NF_SYSCTL_CT_ACCT].data = &net->ct.sysctl_acct;
@@ -1094,6 +1461,9 @@ static int nf_conntrack_standalone_init_sysctl(struct net *net)
 	table[NF_SYSCTL_CT_PROTO_TIMEOUT_ICMPV6].data = &nf_icmpv6_pernet(net)->timeout;
 	table[NF_SYSCTL_CT_PROTO_TIMEOUT_UDP].data = &un->timeouts[UDP_CT_UNREPLIED];
 	table[NF_SYSCTL_CT_PROTO_TIMEOUT_UDP_STREAM].data = &un->timeouts[UDP_CT_REPLIED];
+	table[NF_SYSCTL_CT_PROTO_UDP_QUIC].data = &un->quic;
+	table[NF_SYSCTL_CT_PROTO_TIMEOUT_UDP_QUIC].data = &un->quic_timeouts[UDP_CT_UNREPLIED];
+	table[NF_SYSCTL_CT_PROTO_TIMEOUT_UDP_QUIC_STREAM].data = &un->quic_timeouts[UDP_CT_REPLIED];
 #if IS_ENABLED(CONFIG_NF_FLOW_TABLE)
 	table[NF_SYSCTL_CT_PROTO_TIMEOUT_UDP_OFFLOAD].data = &un->offload_timeout;
 #endif
@@ -1108,6 +1478,17 @@ static int nf_conntrack_standalone_init_sysctl(struct net *net)
 		table[NF_SYSCTL_CT_MAX].mode = 0444;
 		table[NF_SYSCTL_CT_EXPECT_MAX].mode = 0444;
 		table[NF_SYSCTL_CT_BUCKETS].mode = 0444;
+		table[NF_SYSCTL_CT_BUCKETS_MIN].mode = 0444;
+		table[NF_SYSCTL_CT_BUCKETS_MAX].mode = 0444;
+		table[NF_SYSCTL_CT_EARLY_DROP_POLICY].mode = 0444;
+		table[NF_SYSCTL_CT_NUMA_PLACEMENT].mode = 0444;
+#ifdef CONFIG_NF_CONNTRACK_EVENTS_RING
+		table[NF_SYSCTL_CT_EVENTS_RING].mode = 0444;
+		table[NF_SYSCTL_CT_EVENTS_RING_COALESCE].mode = 0444;
+#endif
+#ifdef CONFIG_NF_CONNTRACK_EXPIRY_WHEEL
+		table[NF_SYSCTL_CT_EXPIRY_WHEEL].mode = 0444;
+#endif
 	}
 
 	cnet->sysctl_header = register_net_sysctl_sz(net, "net/netfilter",
@@ -1143,13 +1524,64 @@ static void nf_conntrack_standalone_fini_sysctl(struct net *net)
 }
 #endif /* CONFIG_SYSCTL */
 
+static int __nf_conntrack_standalone_register_net(struct net *net)
+{
+	struct nf_conntrack_net *cnet = nf_ct_pernet(net);
+	int ret;
+
+	ret = nf_conntrack_standalone_init_sysctl(net);
+	if (ret < 0)
+		return ret;
+
+	ret = nf_conntrack_standalone_init_proc(net);
+	if (ret < 0) {
+		nf_conntrack_standalone_fini_sysctl(net);
+		return ret;
+	}
+
+	WRITE_ONCE(cnet->registered, true);
+	return 0;
+}
+
+/* With lazy_pernet, the sysctls and proc files of a netns other than
+ * init_net are only registered once conntrack is used in it, from
+ * nf_ct_netns_get().  Containers that never track a connection don't
+ * pay for them.
+ */
+int nf_conntrack_standalone_register_net(struct net *net)
+{
+	struct nf_conntrack_net *cnet = nf_ct_pernet(net);
+	int ret = 0;
+
+	if (READ_ONCE(cnet->registered))
+		return 0;
+
+	mutex_lock(&nf_ct_register_mutex);
+	if (!cnet->registered)
+		ret = __nf_conntrack_standalone_register_net(net);
+	mutex_unlock(&nf_ct_register_mutex);
+
+	return ret;
+}
+
+static void nf_conntrack_standalone_unregister_net(struct net *net)
+{
+	struct nf_conntrack_net *cnet = nf_ct_pernet(net);
+
+	if (!cnet->registered)
+		return;
+
+	nf_conntrack_standalone_fini_proc(net);
+	nf_conntrack_standalone_fini_sysctl(net);
+	cnet->registered = false;
+}
+
 static void nf_conntrack_fini_net(struct net *net)
 {
 	if (enable_hooks)
 		nf_ct_netns_put(net, NFPROTO_INET);
 
-	nf_conntrack_standalone_fini_proc(net);
-	nf_conntrack_standalone_fini_sysctl(net);
+	nf_conntrack_standalone_unregister_net(net);
 }
 
 static int nf_conntrack_pernet_init(struct net *net)
@@ -1158,13 +1590,11 @@ static int nf_conntrack_pernet_init(struct net *net)
 
 	net->ct.sysctl_checksum = 1;
 
-	ret = nf_conntrack_standalone_init_sysctl(net);
-	if (ret < 0)
-		return ret;
-
-	ret = nf_conntrack_standalone_init_proc(net);
-	if (ret < 0)
-		goto out_proc;
+	if (!lazy_pernet || net_eq(net, &init_net)) {
+		ret = __nf_conntrack_standalone_register_net(net);
+		if (ret < 0)
+			return ret;
+	}
 
 	ret = nf_conntrack_init_net(net);
 	if (ret < 0)
@@ -1181,9 +1611,7 @@ static int nf_conntrack_pernet_init(struct net *net)
 out_hooks:
 	nf_conntrack_cleanup_net(net);
 out_init_net:
-	nf_conntrack_standalone_fini_proc(net);
-out_proc:
-	nf_conntrack_standalone_fini_sysctl(net);
+	nf_conntrack_standalone_unregister_net(net);
 	return ret;
 }
 
@@ -1249,6 +1677,7 @@ static void __exit nf_conntrack_standalone_fini(void)
 #ifdef CONFIG_SYSCTL
 	unregister_net_sysctl_table(nf_ct_netfilter_header);
 #endif
+	nf_conntrack_evring_fini();
 	nf_conntrack_cleanup_end();
 }
 
@@ -25,6 +25,16 @@
 const struct nf_ct_timeout_hooks __rcu *nf_ct_timeout_hook __read_mostly;
 EXPORT_SYMBOL_GPL(nf_ct_timeout_hook);
 
+atomic_t nf_ct_timeout_genid __read_mostly = ATOMIC_INIT(1);
+EXPORT_SYMBOL_GPL(nf_ct_timeout_genid);
+
+void nf_ct_timeout_bump_genid(void)
+{
+	if (atomic_inc_return(&nf_ct_timeout_genid) == 0)
+		atomic_set(&nf_ct_timeout_genid, 1);
+}
+EXPORT_SYMBOL_GPL(nf_ct_timeout_bump_genid);
+
 static int untimeout(struct nf_conn *ct, void *timeout)
 {
 	struct nf_conn_timeout *timeout_ext = nf_ct_timeout_find(ct);
@@ -50,6 +60,7 @@ void nf_ct_untimeout(struct net *net, struct nf_ct_timeout *timeout)
 	};
 
 	nf_ct_iterate_cleanup_net(untimeout, &iter_data);
+	nf_ct_timeout_bump_genid();
 }
 EXPORT_SYMBOL_GPL(nf_ct_untimeout);
 
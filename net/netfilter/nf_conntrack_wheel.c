@@ -0,0 +1,211 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Expiry wheel for confirmed conntrack entries.
+ *
+ * Each cpu has a wheel of NF_CT_WHEEL_SLOTS slots, one per second.  An
+ * entry is filed at confirm time into the slot its timeout falls into, or
+ * into the furthest one.  Timeout updates don't touch the wheel: once the
+ * slot comes due, a refreshed entry is filed again and an expired one is
+ * removed.  The cost of expiry is thus proportional to the number of
+ * entries coming due and not to the size of the table.
+ *
+ * The gc worker keeps running, but at its slowest rate.
+ */
+
+#include <linux/kernel.h>
+#include <linux/percpu.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+
+#include <net/netfilter/nf_conntrack.h>
+#include <net/netfilter/nf_conntrack_wheel.h>
+
+#define NF_CT_WHEEL_SLOTS	512u
+#define NF_CT_WHEEL_TICK	HZ
+
+struct nf_ct_wheel {
+	spinlock_t		lock;
+	/* slot processed next and when it is due */
+	u32			tick;
+	u32			due;
+	struct hlist_head	slots[NF_CT_WHEEL_SLOTS];
+};
+
+u8 nf_conntrack_expiry_wheel __read_mostly;
+
+static DEFINE_PER_CPU(struct nf_ct_wheel, nf_ct_wheel);
+static struct delayed_work nf_ct_wheel_work;
+
+/* ct->wheel_slot is the slot index + 1, 0 when the entry isn't filed.
+ * ct->wheel_cpu is the cpu + 1 of the wheel the entry was filed on, it
+ * doesn't change once set.
+ */
+static void nf_ct_wheel_file(struct nf_ct_wheel *wheel, struct nf_conn *ct)
+{
+	s32 delta = READ_ONCE(ct->timeout) - nfct_time_stamp;
+	u32 slot;
+
+	lockdep_assert_held(&wheel->lock);
+
+	/* never the slot processed right now */
+	delta = clamp_t(s32, delta / NF_CT_WHEEL_TICK, 0, NF_CT_WHEEL_SLOTS - 2);
+	slot = (wheel->tick + 1 + delta) % NF_CT_WHEEL_SLOTS;
+
+	hlist_add_head(&ct->wheel_node, &wheel->slots[slot]);
+	ct->wheel_slot = slot + 1;
+}
+
+/* Called with bh disabled and the hash bucket locks of @ct held. */
+void nf_ct_wheel_add(struct nf_conn *ct)
+{
+	unsigned int cpu = raw_smp_processor_id();
+	struct nf_ct_wheel *wheel;
+
+	if (!nf_ct_wheel_enabled())
+		return;
+
+	wheel = per_cpu_ptr(&nf_ct_wheel, cpu);
+
+	spin_lock(&wheel->lock);
+	ct->wheel_cpu = cpu + 1;
+	nf_ct_wheel_file(wheel, ct);
+	spin_unlock(&wheel->lock);
+}
+
+/* Called with bh disabled and the hash bucket locks of @ct held.
+ *
+ * An entry that is filed but has wheel_slot == 0 is being processed by
+ * nf_ct_wheel_run(), which holds a reference and won't file it again once
+ * it is dying.
+ */
+void nf_ct_wheel_del(struct nf_conn *ct)
+{
+	struct nf_ct_wheel *wheel;
+
+	if (!ct->wheel_cpu)
+		return;
+
+	wheel = per_cpu_ptr(&nf_ct_wheel, ct->wheel_cpu - 1);
+
+	spin_lock(&wheel->lock);
+	if (ct->wheel_slot) {
+		hlist_del(&ct->wheel_node);
+		ct->wheel_slot = 0;
+	}
+	spin_unlock(&wheel->lock);
+}
+
+static void nf_ct_wheel_run(struct nf_ct_wheel *wheel)
+{
+	unsigned int budget = NF_CT_WHEEL_SLOTS;
+
+	while (budget--) {
+		unsigned int expired = 0;
+		struct hlist_node *n;
+		HLIST_HEAD(due);
+		struct nf_conn *ct;
+
+		spin_lock_bh(&wheel->lock);
+		if ((s32)(nfct_time_stamp - wheel->due) < 0) {
+			spin_unlock_bh(&wheel->lock);
+			return;
+		}
+
+		hlist_for_each_entry_safe(ct, n,
+					  &wheel->slots[wheel->tick % NF_CT_WHEEL_SLOTS],
+					  wheel_node) {
+			hlist_del(&ct->wheel_node);
+
+			if (!nf_ct_is_expired(ct)) {
+				nf_ct_wheel_file(wheel, ct);
+				continue;
+			}
+
+			ct->wheel_slot = 0;
+
+			/* can't happen, nf_ct_delete() unfiles the entry
+			 * before the hash table reference is dropped.
+			 */
+			if (!refcount_inc_not_zero(&ct->ct_general.use))
+				continue;
+
+			hlist_add_head(&ct->wheel_node, &due);
+		}
+
+		wheel->tick++;
+		wheel->due += NF_CT_WHEEL_TICK;
+		spin_unlock_bh(&wheel->lock);
+
+		hlist_for_each_entry_safe(ct, n, &due, wheel_node) {
+			hlist_del(&ct->wheel_node);
+
+			/* load ->status after refcount increase */
+			smp_acquire__after_ctrl_dep();
+
+			if (nf_ct_should_gc(ct)) {
+				nf_ct_kill(ct);
+				expired++;
+			} else if (!nf_ct_is_dying(ct)) {
+				/* refreshed in the mean time */
+				spin_lock_bh(&wheel->lock);
+				if (!nf_ct_is_dying(ct))
+					nf_ct_wheel_file(wheel, ct);
+				spin_unlock_bh(&wheel->lock);
+			}
+
+			nf_ct_put(ct);
+		}
+
+		if (expired)
+			NF_CT_STAT_ADD_ATOMIC(&init_net, gc_expired, expired);
+
+		cond_resched();
+	}
+
+	/* way behind, e.g. after a long stall.  Catch up, entries in the
+	 * slots skipped are handled when the wheel comes around again.
+	 */
+	spin_lock_bh(&wheel->lock);
+	wheel->due = nfct_time_stamp;
+	spin_unlock_bh(&wheel->lock);
+}
+
+static void nf_ct_wheel_work_fn(struct work_struct *work)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		nf_ct_wheel_run(per_cpu_ptr(&nf_ct_wheel, cpu));
+
+	queue_delayed_work(system_power_efficient_wq, &nf_ct_wheel_work,
+			   NF_CT_WHEEL_TICK);
+}
+
+void nf_conntrack_wheel_init(void)
+{
+	u32 now = nfct_time_stamp;
+	int cpu;
+
+	BUILD_BUG_ON(NR_CPUS >= U16_MAX);
+	BUILD_BUG_ON(NF_CT_WHEEL_SLOTS >= U16_MAX);
+
+	for_each_possible_cpu(cpu) {
+		struct nf_ct_wheel *wheel = per_cpu_ptr(&nf_ct_wheel, cpu);
+		unsigned int i;
+
+		spin_lock_init(&wheel->lock);
+		wheel->tick = 0;
+		wheel->due = now + NF_CT_WHEEL_TICK;
+		for (i = 0; i < NF_CT_WHEEL_SLOTS; i++)
+			INIT_HLIST_HEAD(&wheel->slots[i]);
+	}
+
+	INIT_DELAYED_WORK(&nf_ct_wheel_work, nf_ct_wheel_work_fn);
+	queue_delayed_work(system_power_efficient_wq, &nf_ct_wheel_work,
+			   NF_CT_WHEEL_TICK);
+}
+
+void nf_conntrack_wheel_fini(void)
+{
+	cancel_delayed_work_sync(&nf_ct_wheel_work);
+}
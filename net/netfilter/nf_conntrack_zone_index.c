@@ -0,0 +1,171 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Index of confirmed conntrack entries by zone.
+ *
+ * Entries of a zone other than the default one are linked, at confirm
+ * time, into a list hashed by netns and zone id.  The lists are per cpu,
+ * an entry stays on the one of the cpu that confirmed it, so that new
+ * flows of a busy zone don't serialize on one lock.  Flushing a zone, e.g.
+ * through ctnetlink with CTA_ZONE, walks that list instead of the whole
+ * table, so its cost is proportional to the number of entries in the
+ * zone, plus a list per cpu.  The other criteria of the flush are checked on each of them.
+ */
+
+#include <linux/hash.h>
+#include <linux/kernel.h>
+#include <linux/spinlock.h>
+#include <net/netns/hash.h>
+
+#include <net/netfilter/nf_conntrack.h>
+#include <net/netfilter/nf_conntrack_zone_index.h>
+
+#define NF_CT_ZONE_INDEX_BITS	8
+/* entries deleted per pass over a list */
+#define NF_CT_ZONE_INDEX_BATCH	64
+
+struct nf_ct_zone_bucket {
+	spinlock_t		lock;
+	struct hlist_head	head;
+};
+
+struct nf_ct_zone_index {
+	struct nf_ct_zone_bucket	buckets[1 << NF_CT_ZONE_INDEX_BITS];
+};
+
+static DEFINE_PER_CPU(struct nf_ct_zone_index, nf_ct_zone_index);
+
+static struct nf_ct_zone_bucket *nf_ct_zone_bucket(int cpu,
+						   const struct net *net,
+						   u16 zone_id)
+{
+	u32 hash = hash_32(net_hash_mix(net) ^ zone_id, NF_CT_ZONE_INDEX_BITS);
+
+	return &per_cpu(nf_ct_zone_index, cpu).buckets[hash];
+}
+
+/* Called with bh disabled and the hash bucket locks of @ct held. */
+void nf_ct_zone_index_add(struct nf_conn *ct)
+{
+	const struct nf_conntrack_zone *zone = nf_ct_zone(ct);
+	struct nf_ct_zone_bucket *b;
+
+	if (!nf_ct_zone_indexed(zone))
+		return;
+
+	ct->zone_cpu = smp_processor_id();
+	b = nf_ct_zone_bucket(ct->zone_cpu, nf_ct_net(ct), zone->id);
+
+	spin_lock(&b->lock);
+	hlist_add_head(&ct->zone_node, &b->head);
+	spin_unlock(&b->lock);
+}
+
+/* Called with bh disabled and the hash bucket locks of @ct held. */
+void nf_ct_zone_index_del(struct nf_conn *ct)
+{
+	struct nf_ct_zone_bucket *b;
+
+	if (hlist_unhashed(&ct->zone_node))
+		return;
+
+	b = nf_ct_zone_bucket(ct->zone_cpu, nf_ct_net(ct), nf_ct_zone(ct)->id);
+
+	spin_lock(&b->lock);
+	hlist_del_init(&ct->zone_node);
+	spin_unlock(&b->lock);
+}
+
+/* Delete the entries of iter_data->zone in @b that @iter matches.
+ *
+ * They are collected, with a reference, under the list lock and deleted
+ * in batches once it is released, deletion takes the lock too.  The walk
+ * resumes from the entry it stopped at, which is held meanwhile, or from
+ * the start of the list if that one was deleted in the mean time.
+ */
+static void
+nf_ct_zone_index_cleanup_bucket(struct nf_ct_zone_bucket *b,
+				int (*iter)(struct nf_conn *i, void *data),
+				const struct nf_ct_iter_data *iter_data)
+{
+	u16 zone_id = iter_data->zone->id;
+	struct nf_conn *batch[NF_CT_ZONE_INDEX_BATCH];
+	struct nf_conn *ct, *prev, *cursor = NULL;
+	unsigned int i, num;
+	bool more;
+
+	do {
+		num = 0;
+		prev = cursor;
+
+		spin_lock_bh(&b->lock);
+		if (prev && !hlist_unhashed(&prev->zone_node))
+			ct = prev;
+		else
+			ct = hlist_entry_safe(b->head.first, struct nf_conn,
+					      zone_node);
+
+		hlist_for_each_entry_from(ct, zone_node) {
+			if (num == NF_CT_ZONE_INDEX_BATCH)
+				break;
+
+			if (!net_eq(nf_ct_net(ct), iter_data->net) ||
+			    nf_ct_zone(ct)->id != zone_id)
+				continue;
+
+			if (!iter(ct, iter_data->data))
+				continue;
+
+			if (refcount_inc_not_zero(&ct->ct_general.use))
+				batch[num++] = ct;
+		}
+
+		/* ct is NULL once the end of the list is reached, start
+		 * over if the entry to resume from is already dying.
+		 */
+		more = !!ct;
+		cursor = NULL;
+		if (ct && refcount_inc_not_zero(&ct->ct_general.use))
+			cursor = ct;
+		spin_unlock_bh(&b->lock);
+
+		if (prev)
+			nf_ct_put(prev);
+
+		for (i = 0; i < num; i++) {
+			nf_ct_delete(batch[i], iter_data->portid,
+				     iter_data->report);
+			nf_ct_put(batch[i]);
+		}
+
+		cond_resched();
+	} while (more);
+}
+
+void nf_ct_zone_index_cleanup(int (*iter)(struct nf_conn *i, void *data),
+			      const struct nf_ct_iter_data *iter_data)
+{
+	struct nf_ct_zone_bucket *b;
+	int cpu;
+
+	might_sleep();
+
+	for_each_possible_cpu(cpu) {
+		b = nf_ct_zone_bucket(cpu, iter_data->net, iter_data->zone->id);
+		nf_ct_zone_index_cleanup_bucket(b, iter, iter_data);
+	}
+}
+
+void nf_conntrack_zone_index_init(void)
+{
+	struct nf_ct_zone_bucket *b;
+	unsigned int i;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		for (i = 0; i < 1U << NF_CT_ZONE_INDEX_BITS; i++) {
+			b = &per_cpu(nf_ct_zone_index, cpu).buckets[i];
+			spin_lock_init(&b->lock);
+			INIT_HLIST_HEAD(&b->head);
+		}
+	}
+}
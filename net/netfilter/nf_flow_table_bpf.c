@@ -11,8 +11,16 @@
 #include <linux/init.h>
 #include <linux/module.h>
 #include <net/netfilter/nf_flow_table.h>
+#include <net/netfilter/nf_conntrack_acct.h>
 #include <linux/bpf.h>
 #include <linux/btf.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
+#include <net/checksum.h>
+#include <net/ip.h>
 #include <net/xdp.h>
 
 /* bpf_flowtable_opts - options for bpf flowtable helpers
@@ -50,7 +58,8 @@ bpf_xdp_flow_tuple_lookup(struct net_device *dev,
 
 	nf_flow = container_of(tuplehash, struct flow_offload,
 			       tuplehash[tuplehash->tuple.dir]);
-	flow_offload_refresh(nf_flow_table, nf_flow, false);
+	flow_offload_refresh(nf_flow_table, nf_flow, tuplehash->tuple.dir,
+			     false);
 
 	return tuplehash;
 }
@@ -100,12 +109,201 @@ bpf_xdp_flow_lookup(struct xdp_md *ctx, struct bpf_fib_lookup *fib_tuple,
 	return tuplehash;
 }
 
+static void bpf_xdp_flow_csum_replace(__sum16 *sum, const __be32 *from,
+				      const __be32 *to, unsigned int words)
+{
+	unsigned int i;
+
+	for (i = 0; i < words; i++)
+		csum_replace4(sum, from[i], to[i]);
+}
+
+/* Rewrite addresses and ports as the reverse of the other direction, which
+ * is what SNAT and DNAT in nf_flow_nat_ip() and nf_flow_nat_ipv6() amount
+ * to.  No-op for the addresses and ports that aren't mangled.
+ */
+static void bpf_xdp_flow_nat(const struct flow_offload *flow,
+			     enum flow_offload_tuple_dir dir, __be32 *saddr,
+			     __be32 *daddr, unsigned int words, __sum16 *l3sum,
+			     struct flow_ports *ports, __sum16 *l4sum)
+{
+	const struct flow_offload_tuple *rtuple = &flow->tuplehash[!dir].tuple;
+	const __be32 *new_saddr = (const __be32 *)&rtuple->dst_v6;
+	const __be32 *new_daddr = (const __be32 *)&rtuple->src_v6;
+	__be16 new_sport = rtuple->dst_port;
+	__be16 new_dport = rtuple->src_port;
+
+	if (!test_bit(NF_FLOW_SNAT, &flow->flags) &&
+	    !test_bit(NF_FLOW_DNAT, &flow->flags))
+		return;
+
+	if (l4sum) {
+		bpf_xdp_flow_csum_replace(l4sum, saddr, new_saddr, words);
+		bpf_xdp_flow_csum_replace(l4sum, daddr, new_daddr, words);
+		csum_replace2(l4sum, ports->source, new_sport);
+		csum_replace2(l4sum, ports->dest, new_dport);
+	}
+	if (l3sum) {
+		bpf_xdp_flow_csum_replace(l3sum, saddr, new_saddr, words);
+		bpf_xdp_flow_csum_replace(l3sum, daddr, new_daddr, words);
+	}
+
+	memcpy(saddr, new_saddr, words * sizeof(__be32));
+	memcpy(daddr, new_daddr, words * sizeof(__be32));
+	ports->source = new_sport;
+	ports->dest = new_dport;
+}
+
+/**
+ * bpf_xdp_flow_forward - forward a packet of a flow found by bpf_xdp_flow_lookup()
+ * @ctx: XDP context, starting with the ethernet header
+ * @tuplehash: the result of bpf_xdp_flow_lookup() for this packet
+ *
+ * Performs what the flowtable fast path does for the packet: TCP state
+ * check, NAT, TTL or hop limit decrement and link layer header rewrite.
+ * Only flows transmitted directly, without encapsulation, are supported.
+ * The caller redirects the packet to the returned interface, e.g. with
+ * bpf_redirect(), or passes it to the stack on error.
+ *
+ * Returns: the output interface index, or a negative errno with the packet
+ * left untouched.
+ */
+__bpf_kfunc int
+bpf_xdp_flow_forward(struct xdp_md *ctx,
+		     struct flow_offload_tuple_rhash *tuplehash)
+{
+	struct xdp_buff *xdp = (struct xdp_buff *)ctx;
+	void *data_end = xdp->data_end, *data = xdp->data;
+	const struct flow_offload_tuple *tuple = &tuplehash->tuple;
+	enum flow_offload_tuple_dir dir = tuple->dir;
+	__sum16 *l3sum = NULL, *l4sum = NULL;
+	__be32 *saddr, *daddr;
+	struct nf_flowtable *flow_table;
+	struct flow_offload *flow;
+	unsigned int words, len;
+	struct flow_ports *ports;
+	struct ethhdr *eth = data;
+	struct ipv6hdr *ip6h;
+	struct iphdr *iph;
+	void *l4hdr;
+	u8 l4proto;
+
+	flow = container_of(tuplehash, struct flow_offload, tuplehash[dir]);
+
+	if (tuple->xmit_type != FLOW_OFFLOAD_XMIT_DIRECT ||
+	    tuple->encap_num || tuple->in_vlan_ingress ||
+	    tuple->tun.proto || tuple->out.tun.proto)
+		return -EOPNOTSUPP;
+
+	if ((void *)(eth + 1) > data_end)
+		return -EINVAL;
+
+	len = xdp_get_buff_len(xdp) - sizeof(*eth);
+	if (len > tuple->mtu)
+		return -EMSGSIZE;
+
+	switch (tuple->l3proto) {
+	case AF_INET:
+		iph = (struct iphdr *)(eth + 1);
+		if (eth->h_proto != htons(ETH_P_IP) ||
+		    (void *)(iph + 1) > data_end ||
+		    iph->ihl != 5 || ip_is_fragment(iph) || iph->ttl <= 1 ||
+		    iph->saddr != tuple->src_v4.s_addr ||
+		    iph->daddr != tuple->dst_v4.s_addr)
+			return -EINVAL;
+
+		l4proto = iph->protocol;
+		l4hdr = iph + 1;
+		saddr = &iph->saddr;
+		daddr = &iph->daddr;
+		l3sum = &iph->check;
+		words = 1;
+		break;
+	case AF_INET6:
+		ip6h = (struct ipv6hdr *)(eth + 1);
+		if (eth->h_proto != htons(ETH_P_IPV6) ||
+		    (void *)(ip6h + 1) > data_end ||
+		    ip6h->hop_limit <= 1 ||
+		    !ipv6_addr_equal(&ip6h->saddr, &tuple->src_v6) ||
+		    !ipv6_addr_equal(&ip6h->daddr, &tuple->dst_v6))
+			return -EINVAL;
+
+		l4proto = ip6h->nexthdr;
+		l4hdr = ip6h + 1;
+		saddr = ip6h->saddr.s6_addr32;
+		daddr = ip6h->daddr.s6_addr32;
+		words = 4;
+		break;
+	default:
+		return -EAFNOSUPPORT;
+	}
+
+	if (l4proto != tuple->l4proto)
+		return -EINVAL;
+
+	switch (l4proto) {
+	case IPPROTO_TCP: {
+		struct tcphdr *tcph = l4hdr;
+
+		if ((void *)(tcph + 1) > data_end)
+			return -EINVAL;
+
+		if (tcph->syn && test_bit(NF_FLOW_CLOSING, &flow->flags)) {
+			flow_offload_teardown(flow);
+			return -ECONNRESET;
+		}
+		if ((tcph->fin || tcph->rst) &&
+		    !test_bit(NF_FLOW_CLOSING, &flow->flags))
+			set_bit(NF_FLOW_CLOSING, &flow->flags);
+
+		l4sum = &tcph->check;
+		break;
+	}
+	case IPPROTO_UDP: {
+		struct udphdr *udph = l4hdr;
+
+		if ((void *)(udph + 1) > data_end)
+			return -EINVAL;
+
+		if (udph->check || words == 4)
+			l4sum = &udph->check;
+		break;
+	}
+	default:
+		return -EOPNOTSUPP;
+	}
+
+	ports = l4hdr;
+	if (ports->source != tuple->src_port ||
+	    ports->dest != tuple->dst_port)
+		return -EINVAL;
+
+	bpf_xdp_flow_nat(flow, dir, saddr, daddr, words, l3sum, ports, l4sum);
+	if (l3sum)
+		ip_decrease_ttl((struct iphdr *)(eth + 1));
+	else
+		((struct ipv6hdr *)(eth + 1))->hop_limit--;
+
+	if (l4proto == IPPROTO_UDP && l4sum && !*l4sum)
+		*l4sum = CSUM_MANGLED_0;
+
+	memcpy(eth->h_dest, tuple->out.h_dest, ETH_ALEN);
+	memcpy(eth->h_source, tuple->out.h_source, ETH_ALEN);
+
+	flow_table = nf_flowtable_by_dev(xdp->rxq->dev);
+	if (flow_table && flow_table->flags & NF_FLOWTABLE_COUNTER)
+		nf_ct_acct_update(flow->ct, dir, len);
+
+	return tuple->out.ifidx;
+}
+
 __diag_pop()
 
 __bpf_kfunc_end_defs();
 
 BTF_KFUNCS_START(nf_ft_kfunc_set)
 BTF_ID_FLAGS(func, bpf_xdp_flow_lookup, KF_TRUSTED_ARGS | KF_RET_NULL)
+BTF_ID_FLAGS(func, bpf_xdp_flow_forward, KF_TRUSTED_ARGS)
 BTF_KFUNCS_END(nf_ft_kfunc_set)
 
 static const struct btf_kfunc_id_set nf_flow_kfunc_set = {
@@ -4,6 +4,9 @@
 #include <linux/module.h>
 #include <linux/netfilter.h>
 #include <linux/rhashtable.h>
+#include <linux/jhash.h>
+#include <linux/local_lock.h>
+#include <linux/percpu.h>
 #include <linux/netdevice.h>
 #include <net/ip.h>
 #include <net/ip6_route.h>
@@ -17,6 +20,27 @@
 static DEFINE_MUTEX(flowtable_lock);
 static LIST_HEAD(flowtables);
 
+/* Per-cpu direct-mapped cache of lookup results in front of the
+ * rhashtable, for long lived flows.  An entry is only ever used after
+ * comparing the full tuple, flow_offload_del() removes the entries of a
+ * flow before it is freed.
+ */
+#define FLOW_OFFLOAD_CACHE_BITS		8
+
+struct flow_offload_cache_slot {
+	struct flow_offload_tuple_rhash	*tuplehash;
+	const struct nf_flowtable	*flow_table;
+};
+
+struct flow_offload_cache {
+	local_lock_t			bh_lock;
+	struct flow_offload_cache_slot	slots[1 << FLOW_OFFLOAD_CACHE_BITS];
+};
+
+static DEFINE_PER_CPU(struct flow_offload_cache, flow_offload_cache) = {
+	.bh_lock	= INIT_LOCAL_LOCK(bh_lock),
+};
+
 static void
 flow_offload_fill_dir(struct flow_offload *flow,
 		      enum flow_offload_tuple_dir dir)
@@ -101,7 +125,8 @@ static int flow_offload_fill_route(struct flow_offload *flow,
 	struct dst_entry *dst = nft_route_dst_fetch(route, dir);
 	int i, j = 0;
 
-	switch (flow_tuple->l3proto) {
+	/* bridged flows have no route, the mtu is checked on transmit */
+	switch (dst ? flow_tuple->l3proto : NFPROTO_UNSPEC) {
 	case NFPROTO_IPV4:
 		flow_tuple->mtu = ip_dst_mtu_maybe_forward(dst, true);
 		break;
@@ -119,15 +144,18 @@ static int flow_offload_fill_route(struct flow_offload *flow,
 		j++;
 	}
 	flow_tuple->encap_num = route->tuple[dir].in.num_encaps;
+	flow_tuple->tun = route->tuple[dir].in.tun;
 
 	switch (route->tuple[dir].xmit_type) {
 	case FLOW_OFFLOAD_XMIT_DIRECT:
+	case FLOW_OFFLOAD_XMIT_BRIDGE:
 		memcpy(flow_tuple->out.h_dest, route->tuple[dir].out.h_dest,
 		       ETH_ALEN);
 		memcpy(flow_tuple->out.h_source, route->tuple[dir].out.h_source,
 		       ETH_ALEN);
 		flow_tuple->out.ifidx = route->tuple[dir].out.ifindex;
 		flow_tuple->out.hw_ifidx = route->tuple[dir].out.hw_ifindex;
+		flow_tuple->out.tun = route->tuple[dir].out.tun;
 		dst_release(dst);
 		break;
 	case FLOW_OFFLOAD_XMIT_XFRM:
@@ -161,8 +189,25 @@ void flow_offload_route_init(struct flow_offload *flow,
 }
 EXPORT_SYMBOL_GPL(flow_offload_route_init);
 
-static inline bool nf_flow_has_expired(const struct flow_offload *flow)
+/* The datapath only stamps the direction a packet was seen in, fold the
+ * most recent stamp into the timeout.
+ */
+static void flow_offload_update_timeout(struct flow_offload *flow)
 {
+	u32 orig = READ_ONCE(flow->tuplehash[FLOW_OFFLOAD_DIR_ORIGINAL].last_used);
+	u32 reply = READ_ONCE(flow->tuplehash[FLOW_OFFLOAD_DIR_REPLY].last_used);
+	u32 timeout;
+
+	timeout = ((s32)(reply - orig) > 0 ? reply : orig) +
+		  flow_offload_get_timeout(flow);
+	if ((s32)(timeout - READ_ONCE(flow->timeout)) > 0)
+		WRITE_ONCE(flow->timeout, timeout);
+}
+
+static inline bool nf_flow_has_expired(struct flow_offload *flow)
+{
+	flow_offload_update_timeout(flow);
+
 	return nf_flow_timeout_delta(flow->timeout) <= 0;
 }
 
@@ -297,6 +342,54 @@ static const struct rhashtable_params nf_flow_offload_rhash_params = {
 	.automatic_shrinking	= true,
 };
 
+/* Every flow is filed in the gc wheel slot of the tick it is due at,
+ * flow->gc_slot being the slot + 1.  It is 0 while the flow isn't filed:
+ * before it is added, and while the gc processes it.
+ */
+static void nf_flow_gc_file(struct nf_flowtable *flow_table,
+			    struct flow_offload *flow, s32 delay)
+{
+	u32 slot;
+
+	lockdep_assert_held(&flow_table->gc_lock);
+
+	if (flow->gc_slot)
+		hlist_del(&flow->gc_node);
+
+	delay = clamp_t(s32, delay / HZ, 0, NF_FLOW_GC_SLOTS - 1);
+	slot = (flow_table->gc_tick + delay) % NF_FLOW_GC_SLOTS;
+	hlist_add_head(&flow->gc_node, &flow_table->gc_slots[slot]);
+	flow->gc_slot = slot + 1;
+}
+
+static void nf_flow_gc_unfile(struct nf_flowtable *flow_table,
+			      struct flow_offload *flow)
+{
+	spin_lock_bh(&flow_table->gc_lock);
+	if (flow->gc_slot) {
+		hlist_del(&flow->gc_node);
+		flow->gc_slot = 0;
+	}
+	spin_unlock_bh(&flow_table->gc_lock);
+}
+
+static void nf_flow_gc_refile(struct nf_flowtable *flow_table,
+			      struct flow_offload *flow)
+{
+	s32 delay = 0;
+
+	if (!test_bit(NF_FLOW_TEARDOWN, &flow->flags)) {
+		delay = nf_flow_timeout_delta(READ_ONCE(flow->timeout));
+		/* leave time for a stats request to extend the timeout */
+		if (test_bit(NF_FLOW_HW, &flow->flags))
+			delay /= 2;
+	}
+
+	spin_lock_bh(&flow_table->gc_lock);
+	nf_flow_gc_file(flow_table, flow, delay);
+	spin_unlock_bh(&flow_table->gc_lock);
+}
+
 unsigned long flow_offload_get_timeout(struct flow_offload *flow)
 {
 	unsigned long timeout = NF_FLOW_TIMEOUT;
@@ -321,6 +414,8 @@ int flow_offload_add(struct nf_flowtable *flow_table, struct flow_offload *flow)
 	int err;
 
 	flow->timeout = nf_flowtable_time_stamp + flow_offload_get_timeout(flow);
+	flow->tuplehash[FLOW_OFFLOAD_DIR_ORIGINAL].last_used = nf_flowtable_time_stamp;
+	flow->tuplehash[FLOW_OFFLOAD_DIR_REPLY].last_used = nf_flowtable_time_stamp;
 
 	err = rhashtable_insert_fast(&flow_table->rhashtable,
 				     &flow->tuplehash[0].node,
@@ -340,7 +435,12 @@ int flow_offload_add(struct nf_flowtable *flow_table, struct flow_offload *flow)
 
 	nf_ct_refresh(flow->ct, NF_CT_DAY);
 
-	if (nf_flowtable_hw_offload(flow_table)) {
+	WRITE_ONCE(flow->flowtable, flow_table);
+	spin_lock_bh(&flow_table->gc_lock);
+	nf_flow_gc_file(flow_table, flow, flow_offload_get_timeout(flow));
+	spin_unlock_bh(&flow_table->gc_lock);
+
+	if (nf_flowtable_hw_offload(flow_table) && !nf_flow_is_tunnel(flow)) {
 		__set_bit(NF_FLOW_HW, &flow->flags);
 		nf_flow_offload_add(flow_table, flow);
 	}
@@ -349,18 +449,24 @@ int flow_offload_add(struct nf_flowtable *flow_table, struct flow_offload *flow)
 }
 EXPORT_SYMBOL_GPL(flow_offload_add);
 
+/* Only the stamp of @dir is written, and at most once per second, so the
+ * cpus handling the two directions don't share a written cache line.  The
+ * timeout is updated from it by the garbage collector.
+ */
 void flow_offload_refresh(struct nf_flowtable *flow_table,
-			  struct flow_offload *flow, bool force)
+			  struct flow_offload *flow,
+			  enum flow_offload_tuple_dir dir, bool force)
 {
-	u32 timeout;
+	u32 *last_used = &flow->tuplehash[dir].last_used;
+	u32 now = nf_flowtable_time_stamp;
 
-	timeout = nf_flowtable_time_stamp + flow_offload_get_timeout(flow);
-	if (force || timeout - READ_ONCE(flow->timeout) > HZ)
-		WRITE_ONCE(flow->timeout, timeout);
+	if (force || now - READ_ONCE(*last_used) > HZ)
+		WRITE_ONCE(*last_used, now);
 	else
 		return;
 
 	if (likely(!nf_flowtable_hw_offload(flow_table)) ||
+	    !test_bit(NF_FLOW_HW, &flow->flags) ||
 	    test_bit(NF_FLOW_CLOSING, &flow->flags))
 		return;
 
@@ -368,6 +474,83 @@ void flow_offload_refresh(struct nf_flowtable *flow_table,
 }
 EXPORT_SYMBOL_GPL(flow_offload_refresh);
 
+/* Not the hash function of the table, only cheap to compute.  The upper
+ * address words are zero for IPv4.
+ */
+static u32 flow_offload_cache_hash(const struct flow_offload_tuple *tuple)
+{
+	const u32 *src = (const u32 *)&tuple->src_v6;
+	const u32 *dst = (const u32 *)&tuple->dst_v6;
+
+	u32 ports = (__force u32)tuple->src_port << 16 |
+		    (__force u32)tuple->dst_port;
+
+	return jhash_3words(src[0] ^ src[1] ^ src[2] ^ src[3],
+			    dst[0] ^ dst[1] ^ dst[2] ^ dst[3],
+			    ports ^ tuple->iifidx ^ tuple->l4proto, 0) &
+	       (BIT(FLOW_OFFLOAD_CACHE_BITS) - 1);
+}
+
+static struct flow_offload_tuple_rhash *
+flow_offload_cache_lookup(const struct nf_flowtable *flow_table,
+			  const struct flow_offload_tuple *tuple, u32 hash)
+{
+	struct flow_offload_tuple_rhash *tuplehash;
+	struct flow_offload_cache_slot *slot;
+
+	slot = this_cpu_ptr(&flow_offload_cache.slots[hash]);
+	tuplehash = READ_ONCE(slot->tuplehash);
+	if (!tuplehash || slot->flow_table != flow_table ||
+	    memcmp(&tuplehash->tuple, tuple,
+		   offsetof(struct flow_offload_tuple, __hash)))
+		return NULL;
+
+	return tuplehash;
+}
+
+static void flow_offload_cache_store(const struct nf_flowtable *flow_table,
+				     struct flow_offload_tuple_rhash *tuplehash,
+				     u32 hash)
+{
+	struct flow_offload_cache_slot *slot;
+	struct flow_offload *flow;
+
+	flow = container_of(tuplehash, struct flow_offload,
+			    tuplehash[tuplehash->tuple.dir]);
+
+	slot = this_cpu_ptr(&flow_offload_cache.slots[hash]);
+	slot->flow_table = flow_table;
+	WRITE_ONCE(slot->tuplehash, tuplehash);
+
+	/* Pairs with smp_mb__after_atomic() in flow_offload_cache_remove(),
+	 * either it sees this entry or we see the flow is gone.
+	 */
+	smp_mb();
+	if (test_bit(NF_FLOW_REMOVED, &flow->flags))
+		cmpxchg(&slot->tuplehash, tuplehash, NULL);
+}
+
+static void flow_offload_cache_remove(struct flow_offload *flow)
+{
+	u32 hash[FLOW_OFFLOAD_DIR_MAX];
+	int cpu, dir;
+
+	set_bit(NF_FLOW_REMOVED, &flow->flags);
+	smp_mb__after_atomic();
+
+	for (dir = 0; dir < FLOW_OFFLOAD_DIR_MAX; dir++)
+		hash[dir] = flow_offload_cache_hash(&flow->tuplehash[dir].tuple);
+
+	for_each_possible_cpu(cpu) {
+		struct flow_offload_cache *cache;
+
+		cache = per_cpu_ptr(&flow_offload_cache, cpu);
+		for (dir = 0; dir < FLOW_OFFLOAD_DIR_MAX; dir++)
+			cmpxchg(&cache->slots[hash[dir]].tuplehash,
+				&flow->tuplehash[dir], NULL);
+	}
+}
+
 static void flow_offload_del(struct nf_flowtable *flow_table,
 			     struct flow_offload *flow)
 {
@@ -377,14 +560,30 @@ static void flow_offload_del(struct nf_flowtable *flow_table,
 	rhashtable_remove_fast(&flow_table->rhashtable,
 			       &flow->tuplehash[FLOW_OFFLOAD_DIR_REPLY].node,
 			       nf_flow_offload_rhash_params);
+	nf_flow_gc_unfile(flow_table, flow);
+	flow_offload_cache_remove(flow);
 	flow_offload_free(flow);
 }
 
 void flow_offload_teardown(struct flow_offload *flow)
 {
+	struct nf_flowtable *flow_table;
+
 	clear_bit(IPS_OFFLOAD_BIT, &flow->ct->status);
-	if (!test_and_set_bit(NF_FLOW_TEARDOWN, &flow->flags))
-		flow_offload_fixup_ct(flow);
+	if (test_and_set_bit(NF_FLOW_TEARDOWN, &flow->flags))
+		return;
+
+	flow_offload_fixup_ct(flow);
+
+	/* due on the next gc run, unless the gc is processing it already */
+	flow_table = READ_ONCE(flow->flowtable);
+	if (!flow_table)
+		return;
+
+	spin_lock_bh(&flow_table->gc_lock);
+	if (flow->gc_slot)
+		nf_flow_gc_file(flow_table, flow, 0);
+	spin_unlock_bh(&flow_table->gc_lock);
 }
 EXPORT_SYMBOL_GPL(flow_offload_teardown);
 
@@ -392,12 +591,29 @@ struct flow_offload_tuple_rhash *
 flow_offload_lookup(struct nf_flowtable *flow_table,
 		    struct flow_offload_tuple *tuple)
 {
+	struct net *net = read_pnet(&flow_table->net);
 	struct flow_offload_tuple_rhash *tuplehash;
 	struct flow_offload *flow;
+	u32 hash;
 	int dir;
 
-	tuplehash = rhashtable_lookup(&flow_table->rhashtable, tuple,
-				      nf_flow_offload_rhash_params);
+	hash = flow_offload_cache_hash(tuple);
+
+	local_bh_disable();
+	local_lock_nested_bh(&flow_offload_cache.bh_lock);
+	tuplehash = flow_offload_cache_lookup(flow_table, tuple, hash);
+	if (tuplehash) {
+		NF_FLOW_TABLE_STAT_INC(net, count_cache_hit);
+	} else {
+		NF_FLOW_TABLE_STAT_INC(net, count_cache_miss);
+		tuplehash = rhashtable_lookup(&flow_table->rhashtable, tuple,
+					      nf_flow_offload_rhash_params);
+		if (tuplehash)
+			flow_offload_cache_store(flow_table, tuplehash, hash);
+	}
+	local_unlock_nested_bh(&flow_offload_cache.bh_lock);
+	local_bh_enable();
+
 	if (!tuplehash)
 		return NULL;
 
@@ -567,12 +783,15 @@ static void nf_flow_offload_gc_step(struct nf_flowtable *flow_table,
 
 	if (teardown) {
 		if (test_bit(NF_FLOW_HW, &flow->flags)) {
-			if (!test_bit(NF_FLOW_HW_DYING, &flow->flags))
+			if (!test_bit(NF_FLOW_HW_DYING, &flow->flags)) {
 				nf_flow_offload_del(flow_table, flow);
-			else if (test_bit(NF_FLOW_HW_DEAD, &flow->flags))
+			} else if (test_bit(NF_FLOW_HW_DEAD, &flow->flags)) {
 				flow_offload_del(flow_table, flow);
+				return;
+			}
 		} else {
 			flow_offload_del(flow_table, flow);
+			return;
 		}
 	} else if (test_bit(NF_FLOW_CLOSING, &flow->flags) &&
 		   test_bit(NF_FLOW_HW, &flow->flags) &&
@@ -581,6 +800,8 @@ static void nf_flow_offload_gc_step(struct nf_flowtable *flow_table,
 	} else if (test_bit(NF_FLOW_HW, &flow->flags)) {
 		nf_flow_offload_stats(flow_table, flow);
 	}
+
+	nf_flow_gc_refile(flow_table, flow);
 }
 
 void nf_flow_table_gc_run(struct nf_flowtable *flow_table)
@@ -588,12 +809,45 @@ void nf_flow_table_gc_run(struct nf_flowtable *flow_table)
 	nf_flow_table_iterate(flow_table, nf_flow_offload_gc_step, NULL);
 }
 
+/* Every NF_FLOW_GC_SWEEP runs, all flows are visited, for those whose
+ * conntrack entry died or that the flowtable type wants to be removed.
+ */
+#define NF_FLOW_GC_SWEEP	10
+
+static void nf_flow_table_gc_due(struct nf_flowtable *flow_table)
+{
+	struct flow_offload *flow;
+	struct hlist_node *n;
+	HLIST_HEAD(due);
+
+	spin_lock_bh(&flow_table->gc_lock);
+	hlist_move_list(&flow_table->gc_slots[flow_table->gc_tick %
+					      NF_FLOW_GC_SLOTS], &due);
+	hlist_for_each_entry(flow, &due, gc_node)
+		flow->gc_slot = 0;
+	flow_table->gc_tick++;
+	spin_unlock_bh(&flow_table->gc_lock);
+
+	hlist_for_each_entry_safe(flow, n, &due, gc_node) {
+		hlist_del(&flow->gc_node);
+		nf_flow_offload_gc_step(flow_table, flow, NULL);
+		cond_resched();
+	}
+}
+
+/* Only the flows of the current slot of the wheel are processed, that is
+ * those whose timeout is due and those torn down since the last run.
+ */
 static void nf_flow_offload_work_gc(struct work_struct *work)
 {
 	struct nf_flowtable *flow_table;
 
 	flow_table = container_of(work, struct nf_flowtable, gc_work.work);
-	nf_flow_table_gc_run(flow_table);
+	if (++flow_table->gc_sweep >= NF_FLOW_GC_SWEEP) {
+		flow_table->gc_sweep = 0;
+		nf_flow_table_gc_run(flow_table);
+	}
+	nf_flow_table_gc_due(flow_table);
 	queue_delayed_work(system_power_efficient_wq, &flow_table->gc_work, HZ);
 }
 
@@ -687,7 +941,13 @@ EXPORT_SYMBOL_GPL(nf_flow_dnat_port);
 
 int nf_flow_table_init(struct nf_flowtable *flowtable)
 {
-	int err;
+	int err, i;
+
+	spin_lock_init(&flowtable->gc_lock);
+	flowtable->gc_tick = 0;
+	flowtable->gc_sweep = 0;
+	for (i = 0; i < NF_FLOW_GC_SLOTS; i++)
+		INIT_HLIST_HEAD(&flowtable->gc_slots[i]);
 
 	INIT_DELAYED_WORK(&flowtable->gc_work, nf_flow_offload_work_gc);
 	flow_block_init(&flowtable->flow_block);
@@ -729,6 +989,8 @@ void nf_flow_table_gc_cleanup(struct nf_flowtable *flowtable,
 			      struct net_device *dev)
 {
 	nf_flow_table_iterate(flowtable, nf_flow_table_do_cleanup, dev);
+	/* run now, after the flows torn down above have been filed */
+	mod_delayed_work(system_power_efficient_wq, &flowtable->gc_work, 0);
 	flush_delayed_work(&flowtable->gc_work);
 	nf_flow_table_offload_flush(flowtable);
 }
@@ -3,6 +3,7 @@
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/netfilter.h>
+#include <linux/netfilter_netdev.h>
 #include <linux/rhashtable.h>
 #include <linux/ip.h>
 #include <linux/ipv6.h>
@@ -12,6 +13,7 @@
 #include <net/ip.h>
 #include <net/ipv6.h>
 #include <net/ip6_route.h>
+#include <net/ip_tunnels.h>
 #include <net/neighbour.h>
 #include <net/netfilter/nf_flow_table.h>
 #include <net/netfilter/nf_conntrack_acct.h>
@@ -174,6 +176,31 @@ struct nf_flowtable_ctx {
 	u32			hdrsize;
 };
 
+/* The outer header of an IPIP packet is part of the key, the lookup is
+ * done on the inner header.
+ */
+static int nf_flow_tuple_ip_tunnel(struct nf_flowtable_ctx *ctx,
+				   struct sk_buff *skb,
+				   struct flow_offload_tuple *tuple)
+{
+	struct iphdr *iph;
+
+	iph = (struct iphdr *)(skb_network_header(skb) + ctx->offset);
+	if (ip_is_fragment(iph) ||
+	    unlikely(ip_has_options(iph->ihl * 4)))
+		return -1;
+
+	tuple->tun.src_v4 = iph->saddr;
+	tuple->tun.dst_v4 = iph->daddr;
+	tuple->tun.proto = IPPROTO_IPIP;
+	ctx->offset += sizeof(*iph);
+
+	if (!pskb_may_pull(skb, sizeof(*iph) + ctx->offset))
+		return -1;
+
+	return 0;
+}
+
 static int nf_flow_tuple_ip(struct nf_flowtable_ctx *ctx, struct sk_buff *skb,
 			    struct flow_offload_tuple *tuple)
 {
@@ -186,6 +213,12 @@ static int nf_flow_tuple_ip(struct nf_flowtable_ctx *ctx, struct sk_buff *skb,
 		return -1;
 
 	iph = (struct iphdr *)(skb_network_header(skb) + ctx->offset);
+	if (iph->protocol == IPPROTO_IPIP) {
+		if (nf_flow_tuple_ip_tunnel(ctx, skb, tuple) < 0)
+			return -1;
+
+		iph = (struct iphdr *)(skb_network_header(skb) + ctx->offset);
+	}
 	thoff = (iph->ihl * 4);
 
 	if (ip_is_fragment(iph) ||
@@ -246,7 +279,10 @@ static int nf_flow_tuple_ip(struct nf_flowtable_ctx *ctx, struct sk_buff *skb,
 	return 0;
 }
 
-/* Based on ip_exceeds_mtu(). */
+/* Based on ip_exceeds_mtu().  GSO skbs whose segments fit are forwarded
+ * intact, NAT and ttl are applied to the head only: the output device or
+ * software segmentation propagates them to the segments.
+ */
 static bool nf_flow_exceeds_mtu(const struct sk_buff *skb, unsigned int mtu)
 {
 	if (skb->len <= mtu)
@@ -333,6 +369,83 @@ static void nf_flow_encap_pop(struct sk_buff *skb,
 	}
 }
 
+static int nf_flow_tunnel_pop(struct sk_buff *skb,
+			      struct flow_offload_tuple_rhash *tuplehash)
+{
+	if (!tuplehash->tuple.tun.proto)
+		return 0;
+
+	skb_pull_rcsum(skb, sizeof(struct iphdr));
+	skb_reset_network_header(skb);
+
+	return iptunnel_pull_offloads(skb);
+}
+
+/* Based on ip_tunnel_xmit(), the inner header is already forwarded. */
+static int nf_flow_tunnel_push(struct net *net, struct sk_buff *skb,
+			       const struct flow_offload_tuple *tuple)
+{
+	const struct flow_offload_tunnel *tun = &tuple->out.tun;
+	const struct iphdr *inner;
+	struct iphdr *iph;
+	__be16 df;
+	u8 tos;
+
+	if (skb_cow_head(skb, sizeof(*iph) + LL_MAX_HEADER))
+		return -1;
+
+	if (likely(!skb->encapsulation)) {
+		skb_reset_inner_headers(skb);
+		skb->encapsulation = 1;
+	}
+
+	if (skb_is_gso(skb)) {
+		if (skb_header_unclone(skb, GFP_ATOMIC))
+			return -1;
+		skb_shinfo(skb)->gso_type |= SKB_GSO_IPXIP4;
+	} else if (skb->ip_summed != CHECKSUM_PARTIAL) {
+		skb->ip_summed = CHECKSUM_NONE;
+		skb->encapsulation = 0;
+	}
+	skb_set_inner_ipproto(skb, IPPROTO_IPIP);
+
+	inner = ip_hdr(skb);
+	tos = tun->tos;
+	if (tos & 0x1)
+		tos = inner->tos;
+	tos = ip_tunnel_ecn_encap(tos, inner, skb);
+	df = (tun->df ? htons(IP_DF) : 0) | (inner->frag_off & htons(IP_DF));
+
+	skb_push(skb, sizeof(*iph));
+	skb_reset_network_header(skb);
+
+	iph = ip_hdr(skb);
+	iph->version	= 4;
+	iph->ihl	= sizeof(*iph) >> 2;
+	iph->tos	= tos;
+	iph->tot_len	= htons(skb->len);
+	iph->frag_off	= df;
+	iph->ttl	= tun->ttl ? : inner->ttl;
+	iph->protocol	= IPPROTO_IPIP;
+	iph->saddr	= tun->src_v4;
+	iph->daddr	= tun->dst_v4;
+	__ip_select_ident(net, iph, skb_shinfo(skb)->gso_segs ?: 1);
+	ip_send_check(iph);
+
+	return 0;
+}
+
+/* For packets received as a list, the transmit is held back until the end
+ * of it, see nf_ingress_xmit_defer().
+ */
+static void nf_flow_neigh_xmit(int neigh_table, struct net_device *outdev,
+			       const void *nexthop, unsigned int len,
+			       struct sk_buff *skb)
+{
+	if (!nf_ingress_xmit_defer(skb, neigh_table, nexthop, len))
+		neigh_xmit(neigh_table, outdev, nexthop, skb);
+}
+
 static unsigned int nf_flow_queue_xmit(struct net *net, struct sk_buff *skb,
 				       const struct flow_offload_tuple_rhash *tuplehash,
 				       unsigned short type)
@@ -346,7 +459,8 @@ static unsigned int nf_flow_queue_xmit(struct net *net, struct sk_buff *skb,
 	skb->dev = outdev;
 	dev_hard_header(skb, skb->dev, type, tuplehash->tuple.out.h_dest,
 			tuplehash->tuple.out.h_source, skb->len);
-	dev_queue_xmit(skb);
+	if (!nf_ingress_xmit_defer(skb, NF_INGRESS_XMIT_DEV, NULL, 0))
+		dev_queue_xmit(skb);
 
 	return NF_STOLEN;
 }
@@ -397,9 +511,11 @@ static int nf_flow_offload_forward(struct nf_flowtable_ctx *ctx,
 	if (skb_try_make_writable(skb, thoff + ctx->hdrsize))
 		return -1;
 
-	flow_offload_refresh(flow_table, flow, false);
+	flow_offload_refresh(flow_table, flow, dir, false);
 
 	nf_flow_encap_pop(skb, tuplehash);
+	if (nf_flow_tunnel_pop(skb, tuplehash) < 0)
+		return -1;
 	thoff -= ctx->offset;
 
 	iph = ip_hdr(skb);
@@ -458,10 +574,16 @@ nf_flow_offload_ip_hook(void *priv, struct sk_buff *skb,
 		skb->dev = outdev;
 		nexthop = rt_nexthop(rt, flow->tuplehash[!dir].tuple.src_v4.s_addr);
 		skb_dst_set_noref(skb, &rt->dst);
-		neigh_xmit(NEIGH_ARP_TABLE, outdev, &nexthop, skb);
+		nf_flow_neigh_xmit(NEIGH_ARP_TABLE, outdev, &nexthop,
+				   sizeof(nexthop), skb);
 		ret = NF_STOLEN;
 		break;
 	case FLOW_OFFLOAD_XMIT_DIRECT:
+		if (tuplehash->tuple.out.tun.proto &&
+		    nf_flow_tunnel_push(state->net, skb, &tuplehash->tuple) < 0) {
+			ret = NF_DROP;
+			break;
+		}
 		ret = nf_flow_queue_xmit(state->net, skb, tuplehash, ETH_P_IP);
 		if (ret == NF_DROP)
 			flow_offload_teardown(flow);
@@ -676,7 +798,7 @@ static int nf_flow_offload_ipv6_forward(struct nf_flowtable_ctx *ctx,
 	if (skb_try_make_writable(skb, thoff + ctx->hdrsize))
 		return -1;
 
-	flow_offload_refresh(flow_table, flow, false);
+	flow_offload_refresh(flow_table, flow, dir, false);
 
 	nf_flow_encap_pop(skb, tuplehash);
 
@@ -753,7 +875,8 @@ nf_flow_offload_ipv6_hook(void *priv, struct sk_buff *skb,
 		skb->dev = outdev;
 		nexthop = rt6_nexthop(rt, &flow->tuplehash[!dir].tuple.src_v6);
 		skb_dst_set_noref(skb, &rt->dst);
-		neigh_xmit(NEIGH_ND_TABLE, outdev, nexthop, skb);
+		nf_flow_neigh_xmit(NEIGH_ND_TABLE, outdev, nexthop,
+				   sizeof(*nexthop), skb);
 		ret = NF_STOLEN;
 		break;
 	case FLOW_OFFLOAD_XMIT_DIRECT:
@@ -770,3 +893,77 @@ nf_flow_offload_ipv6_hook(void *priv, struct sk_buff *skb,
 	return ret;
 }
 EXPORT_SYMBOL_GPL(nf_flow_offload_ipv6_hook);
+
+/* Bridged flows are forwarded as received: the ethernet header and the
+ * vlan tag are kept, there is no NAT and no ttl to decrement.  The vlan
+ * tag, if any, was moved out of the packet before the ingress hook.
+ */
+unsigned int
+nf_flow_offload_bridge_hook(void *priv, struct sk_buff *skb,
+			    const struct nf_hook_state *state)
+{
+	struct flow_offload_tuple_rhash *tuplehash;
+	struct nf_flowtable *flow_table = priv;
+	struct flow_offload_tuple tuple = {};
+	enum flow_offload_tuple_dir dir;
+	struct nf_flowtable_ctx ctx = {
+		.in	= state->in,
+	};
+	struct flow_offload *flow;
+	struct net_device *outdev;
+	unsigned int thoff;
+	u8 l4proto;
+
+	switch (skb->protocol) {
+	case htons(ETH_P_IP):
+		if (nf_flow_tuple_ip(&ctx, skb, &tuple) < 0 || tuple.tun.proto)
+			return NF_ACCEPT;
+
+		thoff = ip_hdrlen(skb);
+		l4proto = ip_hdr(skb)->protocol;
+		break;
+	case htons(ETH_P_IPV6):
+		if (nf_flow_tuple_ipv6(&ctx, skb, &tuple) < 0)
+			return NF_ACCEPT;
+
+		thoff = sizeof(struct ipv6hdr);
+		l4proto = ipv6_hdr(skb)->nexthdr;
+		break;
+	default:
+		return NF_ACCEPT;
+	}
+
+	tuplehash = flow_offload_lookup(flow_table, &tuple);
+	if (!tuplehash ||
+	    tuplehash->tuple.xmit_type != FLOW_OFFLOAD_XMIT_BRIDGE)
+		return NF_ACCEPT;
+
+	dir = tuplehash->tuple.dir;
+	flow = container_of(tuplehash, struct flow_offload, tuplehash[dir]);
+
+	outdev = dev_get_by_index_rcu(state->net, tuplehash->tuple.out.ifidx);
+	if (!outdev || !netif_is_bridge_port(outdev)) {
+		flow_offload_teardown(flow);
+		return NF_ACCEPT;
+	}
+
+	if (unlikely(nf_flow_exceeds_mtu(skb, outdev->mtu)))
+		return NF_ACCEPT;
+
+	if (nf_flow_state_check(flow, l4proto, skb, thoff))
+		return NF_ACCEPT;
+
+	flow_offload_refresh(flow_table, flow, dir, false);
+	skb_clear_tstamp(skb);
+
+	if (flow_table->flags & NF_FLOWTABLE_COUNTER)
+		nf_ct_acct_update(flow->ct, dir, skb->len);
+
+	skb_push(skb, skb->mac_len);
+	skb->dev = outdev;
+	if (!nf_ingress_xmit_defer(skb, NF_INGRESS_XMIT_DEV, NULL, 0))
+		dev_queue_xmit(skb);
+
+	return NF_STOLEN;
+}
+EXPORT_SYMBOL_GPL(nf_flow_offload_bridge_hook);
@@ -22,9 +22,32 @@ struct flow_offload_work {
 	enum flow_cls_command	cmd;
 	struct nf_flowtable	*flowtable;
 	struct flow_offload	*flow;
+};
+
+/* Requests are queued per cpu and per command, one work item runs all the
+ * requests queued so far.  Add and stats requests are refused once
+ * NF_FLOW_OFFLOAD_QUEUE_LEN of them are waiting, the flow stays in the
+ * software path and is retried on its next refresh.
+ */
+enum {
+	NF_FLOW_OFFLOAD_QUEUE_ADD,
+	NF_FLOW_OFFLOAD_QUEUE_DEL,
+	NF_FLOW_OFFLOAD_QUEUE_STATS,
+	__NF_FLOW_OFFLOAD_QUEUE_MAX
+};
+
+#define NF_FLOW_OFFLOAD_QUEUE_LEN	4096
+
+struct flow_offload_queue {
+	spinlock_t		lock;
+	struct list_head	list;
+	unsigned int		len;
 	struct work_struct	work;
 };
 
+static DEFINE_PER_CPU(struct flow_offload_queue,
+		      nf_flow_offload_queue[__NF_FLOW_OFFLOAD_QUEUE_MAX]);
+
 #define NF_FLOW_DISSECTOR(__match, __type, __field)	\
 	(__match)->dissector.offset[__type] =		\
 		offsetof(struct nf_flow_key, __field)
@@ -846,12 +869,13 @@ static int nf_flow_offload_tuple(struct nf_flowtable *flowtable,
 	__be16 proto = ETH_P_ALL;
 	int err, i = 0;
 
+	lockdep_assert_held(&flowtable->flow_block_lock);
+
 	nf_flow_offload_init(&cls_flow, proto, priority, cmd,
 			     &flow->tuplehash[dir].tuple, &extack);
 	if (cmd == FLOW_CLS_REPLACE)
 		cls_flow.rule = flow_rule->rule;
 
-	down_read(&flowtable->flow_block_lock);
 	list_for_each_entry(block_cb, block_cb_list, list) {
 		err = block_cb->cb(TC_SETUP_CLSFLOWER, &cls_flow,
 				   block_cb->cb_priv);
@@ -860,7 +884,6 @@ static int nf_flow_offload_tuple(struct nf_flowtable *flowtable,
 
 		i++;
 	}
-	up_read(&flowtable->flow_block_lock);
 
 	if (cmd == FLOW_CLS_STATS)
 		memcpy(stats, &cls_flow.stats, sizeof(*stats));
@@ -968,12 +991,16 @@ static void flow_offload_work_stats(struct flow_offload_work *offload)
 	}
 }
 
-static void flow_offload_work_handler(struct work_struct *work)
+static void flow_offload_work_free(struct flow_offload_work *offload)
+{
+	clear_bit(NF_FLOW_HW_PENDING, &offload->flow->flags);
+	kfree(offload);
+}
+
+static void flow_offload_work_run(struct flow_offload_work *offload)
 {
-	struct flow_offload_work *offload;
 	struct net *net;
 
-	offload = container_of(work, struct flow_offload_work, work);
 	net = read_pnet(&offload->flowtable->net);
 	switch (offload->cmd) {
 		case FLOW_CLS_REPLACE:
@@ -992,24 +1019,103 @@ static void flow_offload_work_handler(struct work_struct *work)
 			WARN_ON_ONCE(1);
 	}
 
-	clear_bit(NF_FLOW_HW_PENDING, &offload->flow->flags);
-	kfree(offload);
+	flow_offload_work_free(offload);
+}
+
+/* The block callback list lock is held across consecutive requests of the
+ * same flowtable.
+ */
+static void flow_offload_work_handler(struct work_struct *work)
+{
+	struct flow_offload_work *offload, *next;
+	struct nf_flowtable *locked = NULL;
+	struct flow_offload_queue *queue;
+	LIST_HEAD(batch);
+
+	queue = container_of(work, struct flow_offload_queue, work);
+
+	spin_lock_bh(&queue->lock);
+	list_splice_init(&queue->list, &batch);
+	queue->len = 0;
+	spin_unlock_bh(&queue->lock);
+
+	list_for_each_entry_safe(offload, next, &batch, list) {
+		if (offload->flowtable != locked) {
+			if (locked)
+				up_read(&locked->flow_block_lock);
+			locked = offload->flowtable;
+			down_read(&locked->flow_block_lock);
+		}
+
+		flow_offload_work_run(offload);
+
+		if (need_resched()) {
+			up_read(&locked->flow_block_lock);
+			locked = NULL;
+			cond_resched();
+		}
+	}
+
+	if (locked)
+		up_read(&locked->flow_block_lock);
 }
 
-static void flow_offload_queue_work(struct flow_offload_work *offload)
+static bool flow_offload_queue_work(struct flow_offload_work *offload)
 {
 	struct net *net = read_pnet(&offload->flowtable->net);
+	struct flow_offload_queue *queue;
+	struct workqueue_struct *wq;
+	int idx;
 
-	if (offload->cmd == FLOW_CLS_REPLACE) {
+	switch (offload->cmd) {
+	case FLOW_CLS_REPLACE:
+		idx = NF_FLOW_OFFLOAD_QUEUE_ADD;
+		wq = nf_flow_offload_add_wq;
+		break;
+	case FLOW_CLS_DESTROY:
+		idx = NF_FLOW_OFFLOAD_QUEUE_DEL;
+		wq = nf_flow_offload_del_wq;
+		break;
+	default:
+		idx = NF_FLOW_OFFLOAD_QUEUE_STATS;
+		wq = nf_flow_offload_stats_wq;
+		break;
+	}
+
+	queue = get_cpu_ptr(&nf_flow_offload_queue[idx]);
+	spin_lock_bh(&queue->lock);
+	if (idx != NF_FLOW_OFFLOAD_QUEUE_DEL &&
+	    queue->len >= NF_FLOW_OFFLOAD_QUEUE_LEN) {
+		spin_unlock_bh(&queue->lock);
+		put_cpu_ptr(queue);
+
+		if (idx == NF_FLOW_OFFLOAD_QUEUE_ADD)
+			NF_FLOW_TABLE_STAT_INC_ATOMIC(net, count_wq_add_busy);
+		else
+			NF_FLOW_TABLE_STAT_INC_ATOMIC(net, count_wq_stats_busy);
+		return false;
+	}
+
+	list_add_tail(&offload->list, &queue->list);
+	queue->len++;
+	spin_unlock_bh(&queue->lock);
+
+	switch (idx) {
+	case NF_FLOW_OFFLOAD_QUEUE_ADD:
 		NF_FLOW_TABLE_STAT_INC_ATOMIC(net, count_wq_add);
-		queue_work(nf_flow_offload_add_wq, &offload->work);
-	} else if (offload->cmd == FLOW_CLS_DESTROY) {
+		break;
+	case NF_FLOW_OFFLOAD_QUEUE_DEL:
 		NF_FLOW_TABLE_STAT_INC_ATOMIC(net, count_wq_del);
-		queue_work(nf_flow_offload_del_wq, &offload->work);
-	} else {
+		break;
+	default:
 		NF_FLOW_TABLE_STAT_INC_ATOMIC(net, count_wq_stats);
-		queue_work(nf_flow_offload_stats_wq, &offload->work);
+		break;
 	}
+
+	queue_work(wq, &queue->work);
+	put_cpu_ptr(queue);
+
+	return true;
 }
 
 static struct flow_offload_work *
@@ -1030,7 +1136,6 @@ nf_flow_offload_work_alloc(struct nf_flowtable *flowtable,
 	offload->cmd = cmd;
 	offload->flow = flow;
 	offload->flowtable = flowtable;
-	INIT_WORK(&offload->work, flow_offload_work_handler);
 
 	return offload;
 }
@@ -1045,7 +1150,8 @@ void nf_flow_offload_add(struct nf_flowtable *flowtable,
 	if (!offload)
 		return;
 
-	flow_offload_queue_work(offload);
+	if (!flow_offload_queue_work(offload))
+		flow_offload_work_free(offload);
 }
 
 void nf_flow_offload_del(struct nf_flowtable *flowtable,
@@ -1075,7 +1181,8 @@ void nf_flow_offload_stats(struct nf_flowtable *flowtable,
 	if (!offload)
 		return;
 
-	flow_offload_queue_work(offload);
+	if (!flow_offload_queue_work(offload))
+		flow_offload_work_free(offload);
 }
 
 void nf_flow_table_offload_flush_cleanup(struct nf_flowtable *flowtable)
@@ -1209,8 +1316,23 @@ EXPORT_SYMBOL_GPL(nf_flow_table_offload_setup);
 
 int nf_flow_table_offload_init(void)
 {
+	int cpu, i;
+
+	for_each_possible_cpu(cpu) {
+		for (i = 0; i < __NF_FLOW_OFFLOAD_QUEUE_MAX; i++) {
+			struct flow_offload_queue *queue;
+
+			queue = per_cpu_ptr(&nf_flow_offload_queue[i], cpu);
+			spin_lock_init(&queue->lock);
+			INIT_LIST_HEAD(&queue->list);
+			INIT_WORK(&queue->work, flow_offload_work_handler);
+		}
+	}
+
+	/* new flows go first, ahead of stats requests */
 	nf_flow_offload_add_wq  = alloc_workqueue("nf_ft_offload_add",
-						  WQ_UNBOUND | WQ_SYSFS, 0);
+						  WQ_UNBOUND | WQ_SYSFS |
+						  WQ_HIGHPRI, 0);
 	if (!nf_flow_offload_add_wq)
 		return -ENOMEM;
 
@@ -45,14 +45,18 @@ static int nf_flow_table_cpu_seq_show(struct seq_file *seq, void *v)
 	const struct nf_flow_table_stat *st = v;
 
 	if (v == SEQ_START_TOKEN) {
-		seq_puts(seq, "wq_add   wq_del   wq_stats\n");
+		seq_puts(seq, "wq_add   wq_del   wq_stats add_busy stats_busy cache_hit cache_miss\n");
 		return 0;
 	}
 
-	seq_printf(seq, "%8d %8d %8d\n",
+	seq_printf(seq, "%8d %8d %8d %8u %10u %9u %10u\n",
 		   st->count_wq_add,
 		   st->count_wq_del,
-		   st->count_wq_stats
+		   st->count_wq_stats,
+		   st->count_wq_add_busy,
+		   st->count_wq_stats_busy,
+		   st->count_cache_hit,
+		   st->count_cache_miss
 		);
 	return 0;
 }
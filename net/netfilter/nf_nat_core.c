@@ -23,13 +23,19 @@
 #include <net/netfilter/nf_conntrack_zones.h>
 #include <net/netfilter/nf_nat.h>
 #include <net/netfilter/nf_nat_helper.h>
+#include <net/netfilter/nf_nat_masquerade.h>
+#include <net/netfilter/nf_nat_pool.h>
 #include <uapi/linux/netfilter/nf_nat.h>
+#include <trace/events/netfilter.h>
 
 #include "nf_internals.h"
 
 #define NF_NAT_MAX_ATTEMPTS	128
 #define NF_NAT_HARDER_THRESH	(NF_NAT_MAX_ATTEMPTS / 4)
 
+/* Bysource entries are locked by the stripe of their raw hash, which
+ * doesn't depend on the table size.
+ */
 static spinlock_t nf_nat_locks[CONNTRACK_LOCKS];
 
 static DEFINE_MUTEX(nf_nat_proto_mutex);
@@ -39,6 +45,17 @@ static struct hlist_head *nf_nat_bysource __read_mostly;
 static unsigned int nf_nat_htable_size __read_mostly;
 static siphash_aligned_key_t nf_nat_hash_rnd;
 
+/* Table that nf_nat_bysource_resize() is still moving entries out of.
+ * Lock stripes below nf_nat_resize_next have been moved to
+ * nf_nat_bysource already.  nf_nat_bysource_seq covers the table
+ * pointers and sizes.
+ */
+static struct hlist_head *nf_nat_bysource_old __read_mostly;
+static unsigned int nf_nat_htable_size_old __read_mostly;
+static unsigned int nf_nat_resize_next;
+static DEFINE_SEQLOCK(nf_nat_bysource_seq);
+static DEFINE_MUTEX(nf_nat_resize_mutex);
+
 struct nf_nat_lookup_hook_priv {
 	struct nf_hook_entries __rcu *entries;
 
@@ -151,8 +168,10 @@ static void __nf_nat_decode_session(struct sk_buff *skb, struct flowi *fl)
 }
 #endif /* CONFIG_XFRM */
 
-/* We keep an extra hash for each conntrack, for fast searching. */
-static unsigned int
+/* We keep an extra hash for each conntrack, for fast searching.
+ * Returns the raw hash, see nf_nat_bysource_bucket().
+ */
+static u32
 hash_by_src(const struct net *net,
 	    const struct nf_conntrack_zone *zone,
 	    const struct nf_conntrack_tuple *tuple)
@@ -178,9 +197,45 @@ hash_by_src(const struct net *net,
 	if (zone->dir == NF_CT_DEFAULT_ZONE_DIR)
 		combined.zone = zone->id;
 
-	hash = siphash(&combined, sizeof(combined), &nf_nat_hash_rnd);
+	return siphash(&combined, sizeof(combined), &nf_nat_hash_rnd);
+}
 
-	return reciprocal_scale(hash, nf_nat_htable_size);
+static unsigned int nf_nat_hash_stripe(u32 hash)
+{
+	return reciprocal_scale(hash, CONNTRACK_LOCKS);
+}
+
+static void nf_nat_get_tables(struct hlist_head **hash, unsigned int *hsize,
+			      struct hlist_head **old_hash,
+			      unsigned int *old_hsize)
+{
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin(&nf_nat_bysource_seq);
+		*hash = nf_nat_bysource;
+		*hsize = nf_nat_htable_size;
+		*old_hash = nf_nat_bysource_old;
+		*old_hsize = nf_nat_htable_size_old;
+	} while (read_seqretry(&nf_nat_bysource_seq, seq));
+}
+
+/* Return the chain that holds entries with raw hash @hash.
+ *
+ * Caller must hold the lock of the stripe of @hash: it prevents
+ * nf_nat_bysource_resize() from moving this stripe meanwhile.
+ */
+static struct hlist_head *nf_nat_bysource_bucket(u32 hash)
+{
+	struct hlist_head *table, *old_table;
+	unsigned int size, old_size;
+
+	nf_nat_get_tables(&table, &size, &old_table, &old_size);
+	if (unlikely(old_table) &&
+	    nf_nat_hash_stripe(hash) >= READ_ONCE(nf_nat_resize_next))
+		return &old_table[reciprocal_scale(hash, old_size)];
+
+	return &table[reciprocal_scale(hash, size)];
 }
 
 /**
@@ -212,7 +267,7 @@ hash_by_src(const struct net *net,
  *
  * @return: true if the proposed NAT mapping collides with an existing entry.
  */
-static int
+int
 nf_nat_used_tuple(const struct nf_conntrack_tuple *tuple,
 		  const struct nf_conn *ignored_conntrack)
 {
@@ -404,8 +459,8 @@ nf_nat_used_tuple_harder(const struct nf_conntrack_tuple *tuple,
 	return taken;
 }
 
-static bool nf_nat_inet_in_range(const struct nf_conntrack_tuple *t,
-				 const struct nf_nat_range2 *range)
+bool nf_nat_inet_in_range(const struct nf_conntrack_tuple *t,
+			  const struct nf_nat_range2 *range)
 {
 	if (t->src.l3num == NFPROTO_IPV4)
 		return ntohl(t->src.u3.ip) >= ntohl(range->min_addr.ip) &&
@@ -478,18 +533,17 @@ same_src(const struct nf_conn *ct,
 		t->src.u.all == tuple->src.u.all);
 }
 
-/* Only called for SRC manip */
 static int
-find_appropriate_src(struct net *net,
-		     const struct nf_conntrack_zone *zone,
-		     const struct nf_conntrack_tuple *tuple,
-		     struct nf_conntrack_tuple *result,
-		     const struct nf_nat_range2 *range)
+find_appropriate_src_chain(struct net *net,
+			   const struct nf_conntrack_zone *zone,
+			   const struct nf_conntrack_tuple *tuple,
+			   struct nf_conntrack_tuple *result,
+			   const struct nf_nat_range2 *range,
+			   const struct hlist_head *chain)
 {
-	unsigned int h = hash_by_src(net, zone, tuple);
 	const struct nf_conn *ct;
 
-	hlist_for_each_entry_rcu(ct, &nf_nat_bysource[h], nat_bysource) {
+	hlist_for_each_entry_rcu(ct, chain, nat_bysource) {
 		if (same_src(ct, tuple) &&
 		    net_eq(net, nf_ct_net(ct)) &&
 		    nf_ct_zone_equal(ct, zone, IP_CT_DIR_ORIGINAL)) {
@@ -505,6 +559,35 @@ find_appropriate_src(struct net *net,
 	return 0;
 }
 
+/* Only called for SRC manip.
+ *
+ * Lockless: while the table is resized, the old one is searched before
+ * the new one, so an entry that moves in between is found in the latter.
+ * Entries moved during the walk of a chain may still be missed, which
+ * only costs the reuse of their mapping.
+ */
+static int
+find_appropriate_src(struct net *net,
+		     const struct nf_conntrack_zone *zone,
+		     const struct nf_conntrack_tuple *tuple,
+		     struct nf_conntrack_tuple *result,
+		     const struct nf_nat_range2 *range)
+{
+	u32 hash = hash_by_src(net, zone, tuple);
+	struct hlist_head *table, *old_table;
+	unsigned int size, old_size;
+
+	nf_nat_get_tables(&table, &size, &old_table, &old_size);
+
+	if (unlikely(old_table) &&
+	    find_appropriate_src_chain(net, zone, tuple, result, range,
+				       &old_table[reciprocal_scale(hash, old_size)]))
+		return 1;
+
+	return find_appropriate_src_chain(net, zone, tuple, result, range,
+					  &table[reciprocal_scale(hash, size)]);
+}
+
 /* For [FUTURE] fragmentation handling, we want the least-used
  * src-ip/dst-ip/proto triple.  Fairness doesn't come into it.  Thus
  * if the range specifies 1.2.3.4 ports 10000-10005 and 1.2.3.5 ports
@@ -522,7 +605,7 @@ find_best_ips_proto(const struct nf_conntrack_zone *zone,
 	unsigned int i, max;
 	/* Host order */
 	u32 minip, maxip, j, dist;
-	bool full_range;
+	bool full_range, persistent;
 
 	/* No IP mapping?  Do nothing. */
 	if (!(range->flags & NF_NAT_RANGE_MAP_IPS))
@@ -550,9 +633,13 @@ find_best_ips_proto(const struct nf_conntrack_zone *zone,
 	 * anyway).  The consistency means that servers see the same
 	 * client coming from the same IP (some Internet Banking sites
 	 * like this), even across reboots.
+	 *
+	 * Port blocks are per source, so is the address for them.
 	 */
+	persistent = range->flags & (NF_NAT_RANGE_PERSISTENT |
+				     NF_NAT_RANGE_PROTO_BLOCK);
 	j = jhash2((u32 *)&tuple->src.u3, sizeof(tuple->src.u3) / sizeof(u32),
-		   range->flags & NF_NAT_RANGE_PERSISTENT ?
+		   persistent ?
 			0 : (__force u32)tuple->dst.u3.all[max] ^ zone->id);
 
 	full_range = false;
@@ -574,11 +661,93 @@ find_best_ips_proto(const struct nf_conntrack_zone *zone,
 		if (var_ipp->all[i] != range->max_addr.all[i])
 			full_range = true;
 
-		if (!(range->flags & NF_NAT_RANGE_PERSISTENT))
+		if (!persistent)
 			j ^= (__force u32)tuple->dst.u3.all[i];
 	}
 }
 
+/* Ports handed out from a pool are marked in its bitmap, so finding a free
+ * one doesn't take more lookups as the range fills up.  The bitmap doesn't
+ * know about ports used otherwise, the conntrack table has the final word.
+ */
+static bool nf_nat_pool_unique_tuple(struct nf_conntrack_tuple *tuple,
+				     struct nf_conn *ct, __be16 *keyptr,
+				     unsigned int min, unsigned int range_size)
+{
+	struct nf_conn_nat *nat;
+	struct nf_nat_pool *pool;
+	unsigned int i;
+	u32 start;
+	int port;
+
+	if (!nf_nat_pool_enabled())
+		return false;
+
+	nat = nf_ct_nat_ext_add(ct);
+	if (!nat || nat->pool || nat->block)
+		return false;
+
+	pool = nf_nat_pool_get(nf_ct_net(ct), tuple, min, range_size, 0);
+	if (!pool)
+		return false;
+
+	start = get_random_u32_below(range_size);
+	for (i = 0; i < NF_NAT_HARDER_THRESH; i++) {
+		port = nf_nat_pool_claim(pool, start);
+		if (port < 0)
+			break;
+
+		*keyptr = htons(min + port);
+		if (!nf_nat_used_tuple(tuple, ct)) {
+			/* the pool reference is now the one of the port */
+			nat->pool = pool;
+			nat->pool_port = port;
+			return true;
+		}
+
+		nf_nat_pool_unclaim(pool, port);
+		start = port + 1;
+	}
+
+	nf_nat_pool_put(pool);
+	return false;
+}
+
+/* Port of the subscriber's block, for source NAT with
+ * NF_NAT_RANGE_PROTO_BLOCK.  Falls back to the regular allocation when the
+ * NAT address has no block left.
+ */
+static bool nf_nat_block_tuple(struct nf_conntrack_tuple *tuple,
+			       const struct nf_nat_range2 *range,
+			       struct nf_conn *ct)
+{
+	unsigned int min, max;
+
+	switch (tuple->dst.protonum) {
+	case IPPROTO_UDP:
+	case IPPROTO_UDPLITE:
+	case IPPROTO_TCP:
+	case IPPROTO_SCTP:
+	case IPPROTO_DCCP:
+		break;
+	default:
+		return false;
+	}
+
+	if (range->flags & NF_NAT_RANGE_PROTO_SPECIFIED) {
+		min = ntohs(range->min_proto.all);
+		max = ntohs(range->max_proto.all);
+		if (unlikely(max < min))
+			swap(max, min);
+	} else {
+		min = 1024;
+		max = 65535;
+	}
+
+	return nf_nat_block_unique_tuple(tuple, range, ct, min,
+					 max - min + 1);
+}
+
 /* Alter the per-proto part of the tuple (depending on maniptype), to
  * give a unique tuple in the given range if possible.
  *
@@ -589,7 +758,7 @@ static void nf_nat_l4proto_unique_tuple(struct nf_conntrack_tuple *tuple,
 					enum nf_nat_manip_type maniptype,
 					const struct nf_conn *ct)
 {
-	unsigned int range_size, min, max, i, attempts;
+	unsigned int range_size, min, max, i, attempts, probes = 0;
 	__be16 *keyptr;
 	u16 off;
 
@@ -670,6 +839,11 @@ static void nf_nat_l4proto_unique_tuple(struct nf_conntrack_tuple *tuple,
 		range_size = max - min + 1;
 	}
 
+	if (maniptype == NF_NAT_MANIP_SRC &&
+	    !(range->flags & NF_NAT_RANGE_PROTO_OFFSET) &&
+	    nf_nat_pool_unique_tuple(tuple, ct, keyptr, min, range_size))
+		return;
+
 find_free_id:
 	if (range->flags & NF_NAT_RANGE_PROTO_OFFSET)
 		off = (ntohs(*keyptr) - ntohs(range->base_proto.all));
@@ -692,12 +866,20 @@ static void nf_nat_l4proto_unique_tuple(struct nf_conntrack_tuple *tuple,
 another_round:
 	for (i = 0; i < attempts; i++, off++) {
 		*keyptr = htons(min + off % range_size);
-		if (!nf_nat_used_tuple_harder(tuple, ct, attempts - i))
+		probes++;
+		if (!nf_nat_used_tuple_harder(tuple, ct, attempts - i)) {
+			trace_nf_nat_unique_tuple(tuple->dst.protonum,
+						  maniptype, range_size,
+						  probes, true);
 			return;
+		}
 	}
 
-	if (attempts >= range_size || attempts < 16)
+	if (attempts >= range_size || attempts < 16) {
+		trace_nf_nat_unique_tuple(tuple->dst.protonum, maniptype,
+					  range_size, probes, false);
 		return;
+	}
 	attempts /= 2;
 	off = get_random_u16();
 	goto another_round;
@@ -728,9 +910,13 @@ get_unique_tuple(struct nf_conntrack_tuple *tuple,
 	 * This is only required for source (ie. NAT/masq) mappings.
 	 * So far, we don't do local source mappings, so multiple
 	 * manips not an issue.
+	 *
+	 * Ports outside of the blocks of a subscriber would not show up
+	 * in the block log, so block mappings always come from there.
 	 */
 	if (maniptype == NF_NAT_MANIP_SRC &&
-	    !(range->flags & NF_NAT_RANGE_PROTO_RANDOM_ALL)) {
+	    !(range->flags & (NF_NAT_RANGE_PROTO_RANDOM_ALL |
+			      NF_NAT_RANGE_PROTO_BLOCK))) {
 		/* try the original tuple first */
 		if (nf_in_range(orig_tuple, range)) {
 			if (!nf_nat_used_tuple_new(orig_tuple, ct)) {
@@ -749,6 +935,11 @@ get_unique_tuple(struct nf_conntrack_tuple *tuple,
 	*tuple = *orig_tuple;
 	find_best_ips_proto(zone, tuple, range, ct, maniptype);
 
+	if (maniptype == NF_NAT_MANIP_SRC &&
+	    (range->flags & NF_NAT_RANGE_PROTO_BLOCK) &&
+	    nf_nat_block_tuple(tuple, range, ct))
+		return;
+
 	/* 3) The per-protocol part of the manip is made to map into
 	 * the range to make a unique tuple.
 	 */
@@ -827,20 +1018,22 @@ nf_nat_setup_info(struct nf_conn *ct,
 			ct->status |= IPS_DST_NAT;
 
 		if (nfct_help(ct) && !nfct_seqadj(ct))
-			if (!nfct_seqadj_ext_add(ct))
+			if (!nfct_seqadj_ext_add(ct)) {
+				nf_nat_pool_release(ct);
 				return NF_DROP;
+			}
 	}
 
 	if (maniptype == NF_NAT_MANIP_SRC) {
-		unsigned int srchash;
 		spinlock_t *lock;
+		u32 srchash;
 
 		srchash = hash_by_src(net, nf_ct_zone(ct),
 				      &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple);
-		lock = &nf_nat_locks[srchash % CONNTRACK_LOCKS];
+		lock = &nf_nat_locks[nf_nat_hash_stripe(srchash)];
 		spin_lock_bh(lock);
 		hlist_add_head_rcu(&ct->nat_bysource,
-				   &nf_nat_bysource[srchash]);
+				   nf_nat_bysource_bucket(srchash));
 		spin_unlock_bh(lock);
 	}
 
@@ -1012,12 +1205,16 @@ static int nf_nat_proto_remove(struct nf_conn *i, void *data)
 
 static void nf_nat_cleanup_conntrack(struct nf_conn *ct)
 {
-	unsigned int h;
+	unsigned int stripe;
 
-	h = hash_by_src(nf_ct_net(ct), nf_ct_zone(ct), &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple);
-	spin_lock_bh(&nf_nat_locks[h % CONNTRACK_LOCKS]);
+	nf_nat_pool_release(ct);
+	nf_nat_masquerade_unindex(ct);
+
+	stripe = nf_nat_hash_stripe(hash_by_src(nf_ct_net(ct), nf_ct_zone(ct),
+						&ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple));
+	spin_lock_bh(&nf_nat_locks[stripe]);
 	hlist_del_rcu(&ct->nat_bysource);
-	spin_unlock_bh(&nf_nat_locks[h % CONNTRACK_LOCKS]);
+	spin_unlock_bh(&nf_nat_locks[stripe]);
 }
 
 static int nf_nat_proto_clean(struct nf_conn *ct, void *data)
@@ -1323,6 +1520,117 @@ static struct pernet_operations nat_net_ops = {
 	.size = sizeof(struct nat_net),
 };
 
+/* Move all entries of lock stripe @stripe from @old_hash to @hash. */
+static void nf_nat_bysource_move_stripe(unsigned int stripe,
+					struct hlist_head *old_hash,
+					unsigned int old_size,
+					struct hlist_head *hash,
+					unsigned int hashsize)
+{
+	unsigned int i, first, last;
+	struct nf_conn *ct;
+	u32 h;
+
+	first = stripe * (old_size / CONNTRACK_LOCKS);
+	last = first + old_size / CONNTRACK_LOCKS;
+
+	spin_lock_bh(&nf_nat_locks[stripe]);
+
+	for (i = first; i < last; i++) {
+		while (!hlist_empty(&old_hash[i])) {
+			ct = hlist_entry(old_hash[i].first, struct nf_conn,
+					 nat_bysource);
+			hlist_del_rcu(&ct->nat_bysource);
+
+			h = hash_by_src(nf_ct_net(ct), nf_ct_zone(ct),
+					&ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple);
+			hlist_add_head_rcu(&ct->nat_bysource,
+					   &hash[reciprocal_scale(h, hashsize)]);
+		}
+	}
+
+	/* new entries of this stripe go to the new table from now on */
+	WRITE_ONCE(nf_nat_resize_next, stripe + 1);
+
+	spin_unlock_bh(&nf_nat_locks[stripe]);
+}
+
+/* Same scheme as nf_conntrack_hash_resize(): the new table is published
+ * first, then entries are moved over one lock stripe at a time, so that
+ * neither lookups nor inserts have to wait for the whole table.
+ */
+static int nf_nat_bysource_resize(unsigned int hashsize)
+{
+	struct hlist_head *hash, *old_hash;
+	unsigned int old_size, stripe;
+
+	if (!hashsize)
+		return -EINVAL;
+
+	hashsize = roundup(hashsize, CONNTRACK_LOCKS);
+	hash = nf_ct_alloc_hashtable(&hashsize, 0);
+	if (!hash)
+		return -ENOMEM;
+
+	mutex_lock(&nf_nat_resize_mutex);
+	old_size = nf_nat_htable_size;
+	if (old_size == hashsize) {
+		mutex_unlock(&nf_nat_resize_mutex);
+		kvfree(hash);
+		return 0;
+	}
+
+	old_hash = nf_nat_bysource;
+	WRITE_ONCE(nf_nat_resize_next, 0);
+
+	write_seqlock_bh(&nf_nat_bysource_seq);
+	nf_nat_bysource_old = old_hash;
+	nf_nat_htable_size_old = old_size;
+	nf_nat_bysource = hash;
+	nf_nat_htable_size = hashsize;
+	write_sequnlock_bh(&nf_nat_bysource_seq);
+
+	for (stripe = 0; stripe < CONNTRACK_LOCKS; stripe++) {
+		nf_nat_bysource_move_stripe(stripe, old_hash, old_size,
+					    hash, hashsize);
+		cond_resched();
+	}
+
+	write_seqlock_bh(&nf_nat_bysource_seq);
+	nf_nat_bysource_old = NULL;
+	nf_nat_htable_size_old = 0;
+	write_sequnlock_bh(&nf_nat_bysource_seq);
+
+	mutex_unlock(&nf_nat_resize_mutex);
+
+	synchronize_net();
+	kvfree(old_hash);
+	return 0;
+}
+
+static int nf_nat_set_hashsize(const char *val, const struct kernel_param *kp)
+{
+	unsigned int hashsize;
+	int rc;
+
+	if (current->nsproxy->net_ns != &init_net)
+		return -EOPNOTSUPP;
+
+	/* On boot, we can set this without any fancy locking. */
+	if (!nf_nat_bysource)
+		return param_set_uint(val, kp);
+
+	rc = kstrtouint(val, 0, &hashsize);
+	if (rc)
+		return rc;
+
+	return nf_nat_bysource_resize(hashsize);
+}
+
+module_param_call(hashsize, nf_nat_set_hashsize, param_get_uint,
+		  &nf_nat_htable_size, 0600);
+MODULE_PARM_DESC(hashsize, "size of the source NAT mapping table");
+
 static const struct nf_nat_hook nat_hook = {
 	.parse_nat_setup	= nfnetlink_parse_nat_setup,
 #ifdef CONFIG_XFRM
@@ -1335,10 +1643,14 @@ static int __init nf_nat_init(void)
 {
 	int ret, i;
 
-	/* Leave them the same for the moment. */
-	nf_nat_htable_size = nf_conntrack_htable_size;
-	if (nf_nat_htable_size < CONNTRACK_LOCKS)
-		nf_nat_htable_size = CONNTRACK_LOCKS;
+	/* Same as conntrack, unless set on the command line.  A multiple of
+	 * the number of locks, see nf_nat_bysource_move_stripe().
+	 */
+	if (!nf_nat_htable_size)
+		nf_nat_htable_size = nf_conntrack_htable_size;
+	nf_nat_htable_size = roundup(max_t(unsigned int, nf_nat_htable_size,
+					   CONNTRACK_LOCKS),
+				     CONNTRACK_LOCKS);
 
 	nf_nat_bysource = nf_ct_alloc_hashtable(&nf_nat_htable_size, 0);
 	if (!nf_nat_bysource)
@@ -1353,6 +1665,21 @@ static int __init nf_nat_init(void)
 		return ret;
 	}
 
+	ret = nf_nat_pool_init();
+	if (ret < 0) {
+		unregister_pernet_subsys(&nat_net_ops);
+		kvfree(nf_nat_bysource);
+		return ret;
+	}
+
+	ret = nf_nat_masquerade_init();
+	if (ret < 0) {
+		nf_nat_pool_fini();
+		unregister_pernet_subsys(&nat_net_ops);
+		kvfree(nf_nat_bysource);
+		return ret;
+	}
+
 	nf_ct_helper_expectfn_register(&follow_master_nat);
 
 	WARN_ON(nf_nat_hook != NULL);
@@ -1363,6 +1690,8 @@ static int __init nf_nat_init(void)
 		RCU_INIT_POINTER(nf_nat_hook, NULL);
 		nf_ct_helper_expectfn_unregister(&follow_master_nat);
 		synchronize_net();
+		nf_nat_masquerade_fini();
+		nf_nat_pool_fini();
 		unregister_pernet_subsys(&nat_net_ops);
 		kvfree(nf_nat_bysource);
 	}
@@ -1380,6 +1709,8 @@ static void __exit nf_nat_cleanup(void)
 	RCU_INIT_POINTER(nf_nat_hook, NULL);
 
 	synchronize_net();
+	nf_nat_masquerade_fini();
+	nf_nat_pool_fini();
 	kvfree(nf_nat_bysource);
 	unregister_pernet_subsys(&nat_net_ops);
 }
@@ -6,6 +6,8 @@
 #include <linux/netfilter.h>
 #include <linux/netfilter_ipv4.h>
 #include <linux/netfilter_ipv6.h>
+#include <linux/rhashtable.h>
+#include <net/netns/hash.h>
 
 #include <net/netfilter/nf_nat_masquerade.h>
 
@@ -24,6 +26,133 @@ static DEFINE_MUTEX(masq_mutex);
 static unsigned int masq_refcnt __read_mostly;
 static atomic_t masq_worker_count __read_mostly;
 
+/* Index of the masqueraded conntracks by device, so that the ones to
+ * forget when a device or an address goes away are found without walking
+ * the whole conntrack table.  Entries are linked in a bucket per device
+ * and netns of the cpu that set up the NAT binding, so that new flows on
+ * different cpus don't contend for the lock of one uplink, and found back
+ * from their conntrack on destruction through an rhashtable.  If an entry
+ * can't be allocated, the conntrack is counted as missing and cleanups
+ * walk the table until it is gone.
+ */
+enum {
+	MASQ_STATE_NONE,
+	MASQ_STATE_INDEXED,
+	MASQ_STATE_MISSING,
+};
+
+struct masq_entry {
+	struct rhash_head	hnode;
+	struct hlist_node	node;
+	struct nf_conn		*ct;
+	int			ifindex;
+	int			cpu;
+	struct rcu_head		rcu;
+};
+
+struct masq_bucket {
+	spinlock_t		lock;
+	struct hlist_head	head;
+};
+
+#define MASQ_INDEX_BITS		8
+
+struct masq_index {
+	struct masq_bucket	buckets[1 << MASQ_INDEX_BITS];
+};
+
+/* conntracks killed per pass over a bucket */
+#define MASQ_CLEANUP_BATCH	64
+
+static struct masq_index __percpu *masq_pcpu_index __read_mostly;
+static struct rhashtable masq_entries;
+static atomic_t masq_missing __read_mostly;
+
+static const struct rhashtable_params masq_entries_params = {
+	.head_offset		= offsetof(struct masq_entry, hnode),
+	.key_offset		= offsetof(struct masq_entry, ct),
+	.key_len		= sizeof_field(struct masq_entry, ct),
+	.automatic_shrinking	= true,
+};
+
+static struct masq_bucket *masq_bucket(int cpu, const struct net *net,
+				       int ifindex)
+{
+	struct masq_index *idx = per_cpu_ptr(masq_pcpu_index, cpu);
+
+	return &idx->buckets[hash_32(net_hash_mix(net) ^ ifindex,
+				     MASQ_INDEX_BITS)];
+}
+
+static void masq_index_add(struct nf_conn *ct, struct nf_conn_nat *nat,
+			   int ifindex)
+{
+	struct masq_bucket *b;
+	struct masq_entry *e;
+
+	if (nat->masq_state != MASQ_STATE_NONE ||
+	    !(ct->status & IPS_SRC_NAT_DONE))
+		return;
+
+	e = kmalloc(sizeof(*e), GFP_ATOMIC);
+	if (!e)
+		goto missing;
+
+	e->ct = ct;
+	e->ifindex = ifindex;
+	e->cpu = raw_smp_processor_id();
+	if (rhashtable_insert_fast(&masq_entries, &e->hnode,
+				   masq_entries_params)) {
+		kfree(e);
+		goto missing;
+	}
+
+	b = masq_bucket(e->cpu, nf_ct_net(ct), ifindex);
+	spin_lock_bh(&b->lock);
+	hlist_add_head(&e->node, &b->head);
+	spin_unlock_bh(&b->lock);
+
+	nat->masq_state = MASQ_STATE_INDEXED;
+	return;
+missing:
+	atomic_inc(&masq_missing);
+	nat->masq_state = MASQ_STATE_MISSING;
+}
+
+/* Called when @ct is freed, or its source NAT binding removed. */
+void nf_nat_masquerade_unindex(struct nf_conn *ct)
+{
+	struct nf_conn_nat *nat = nfct_nat(ct);
+	struct masq_bucket *b;
+	struct masq_entry *e;
+
+	if (!nat)
+		return;
+
+	switch (nat->masq_state) {
+	case MASQ_STATE_INDEXED:
+		e = rhashtable_lookup_fast(&masq_entries, &ct,
+					   masq_entries_params);
+		if (WARN_ON_ONCE(!e))
+			break;
+
+		b = masq_bucket(e->cpu, nf_ct_net(ct), e->ifindex);
+		spin_lock_bh(&b->lock);
+		hlist_del_init(&e->node);
+		spin_unlock_bh(&b->lock);
+
+		rhashtable_remove_fast(&masq_entries, &e->hnode,
+				       masq_entries_params);
+		kfree_rcu(e, rcu);
+		break;
+	case MASQ_STATE_MISSING:
+		atomic_dec(&masq_missing);
+		break;
+	}
+
+	nat->masq_state = MASQ_STATE_NONE;
+}
+
 unsigned int
 nf_nat_masquerade_ipv4(struct sk_buff *skb, unsigned int hooknum,
 		       const struct nf_nat_range2 *range,
@@ -35,6 +164,7 @@ nf_nat_masquerade_ipv4(struct sk_buff *skb, unsigned int hooknum,
 	struct nf_nat_range2 newrange;
 	const struct rtable *rt;
 	__be32 newsrc, nh;
+	unsigned int ret;
 
 	WARN_ON(hooknum != NF_INET_POST_ROUTING);
 
@@ -71,10 +201,71 @@ nf_nat_masquerade_ipv4(struct sk_buff *skb, unsigned int hooknum,
 	newrange.max_proto   = range->max_proto;
 
 	/* Hand modified range to generic setup. */
-	return nf_nat_setup_info(ct, &newrange, NF_NAT_MANIP_SRC);
+	ret = nf_nat_setup_info(ct, &newrange, NF_NAT_MANIP_SRC);
+	if (ret == NF_ACCEPT && nat)
+		masq_index_add(ct, nat, out->ifindex);
+
+	return ret;
 }
 EXPORT_SYMBOL_GPL(nf_nat_masquerade_ipv4);
 
+/* Kill the conntracks of the bucket of the device that @w->iter matches.
+ * They are unlinked from the bucket, with a reference, under its lock and
+ * killed in batches once it is released: destruction takes the lock too.
+ */
+static void masq_index_cleanup_bucket(struct masq_dev_work *w,
+				      struct masq_bucket *b)
+{
+	struct nf_conn *batch[MASQ_CLEANUP_BATCH];
+	struct masq_entry *e;
+	struct hlist_node *n;
+	unsigned int i, num;
+	struct nf_conn *ct;
+
+	do {
+		num = 0;
+
+		spin_lock_bh(&b->lock);
+		hlist_for_each_entry_safe(e, n, &b->head, node) {
+			ct = e->ct;
+
+			/* like nf_ct_iterate_cleanup_net(), which only
+			 * walks confirmed conntracks
+			 */
+			if (e->ifindex != w->ifindex ||
+			    !net_eq(nf_ct_net(ct), w->net) ||
+			    !nf_ct_is_confirmed(ct) || nf_ct_is_dying(ct) ||
+			    !w->iter(ct, w))
+				continue;
+
+			if (!refcount_inc_not_zero(&ct->ct_general.use))
+				continue;
+
+			hlist_del_init(&e->node);
+			batch[num++] = ct;
+			if (num == MASQ_CLEANUP_BATCH)
+				break;
+		}
+		spin_unlock_bh(&b->lock);
+
+		for (i = 0; i < num; i++) {
+			nf_ct_kill(batch[i]);
+			nf_ct_put(batch[i]);
+		}
+
+		cond_resched();
+	} while (num == MASQ_CLEANUP_BATCH);
+}
+
+static void masq_index_cleanup(struct masq_dev_work *w)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		masq_index_cleanup_bucket(w, masq_bucket(cpu, w->net,
+							 w->ifindex));
+}
+
 static void iterate_cleanup_work(struct work_struct *work)
 {
 	struct nf_ct_iter_data iter_data = {};
@@ -82,9 +273,13 @@ static void iterate_cleanup_work(struct work_struct *work)
 
 	w = container_of(work, struct masq_dev_work, work);
 
-	iter_data.net = w->net;
-	iter_data.data = (void *)w;
-	nf_ct_iterate_cleanup_net(w->iter, &iter_data);
+	if (atomic_read(&masq_missing)) {
+		iter_data.net = w->net;
+		iter_data.data = (void *)w;
+		nf_ct_iterate_cleanup_net(w->iter, &iter_data);
+	} else {
+		masq_index_cleanup(w);
+	}
 
 	put_net_track(w->net, &w->ns_tracker);
 	kfree(w);
@@ -92,8 +287,9 @@ static void iterate_cleanup_work(struct work_struct *work)
 	module_put(THIS_MODULE);
 }
 
-/* Iterate conntrack table in the background and remove conntrack entries
- * that use the device/address being removed.
+/* Look up the index, or iterate the conntrack table if it is incomplete,
+ * in the background and remove conntrack entries that use the
+ * device/address being removed.
  *
  * In case too many work items have been queued already or memory allocation
  * fails iteration is skipped, conntrack entries will time out eventually.
@@ -154,7 +350,7 @@ static int masq_device_event(struct notifier_block *this,
 	struct net *net = dev_net(dev);
 
 	if (event == NETDEV_DOWN) {
-		/* Device was downed.  Search entire table for
+		/* Device was downed.  Search the index for
 		 * conntracks which were associated with that device,
 		 * and forget them.
 		 */
@@ -246,6 +442,7 @@ nf_nat_masquerade_ipv6(struct sk_buff *skb, const struct nf_nat_range2 *range,
 	struct in6_addr src;
 	struct nf_conn *ct;
 	struct nf_nat_range2 newrange;
+	unsigned int ret;
 
 	ct = nf_ct_get(skb, &ctinfo);
 	WARN_ON(!(ct && (ctinfo == IP_CT_NEW || ctinfo == IP_CT_RELATED ||
@@ -265,7 +462,11 @@ nf_nat_masquerade_ipv6(struct sk_buff *skb, const struct nf_nat_range2 *range,
 	newrange.min_proto	= range->min_proto;
 	newrange.max_proto	= range->max_proto;
 
-	return nf_nat_setup_info(ct, &newrange, NF_NAT_MANIP_SRC);
+	ret = nf_nat_setup_info(ct, &newrange, NF_NAT_MANIP_SRC);
+	if (ret == NF_ACCEPT && nat)
+		masq_index_add(ct, nat, out->ifindex);
+
+	return ret;
 }
 EXPORT_SYMBOL_GPL(nf_nat_masquerade_ipv6);
 
@@ -366,3 +567,40 @@ void nf_nat_masquerade_inet_unregister_notifiers(void)
 	mutex_unlock(&masq_mutex);
 }
 EXPORT_SYMBOL_GPL(nf_nat_masquerade_inet_unregister_notifiers);
+
+static void masq_entry_free(void *ptr, void *arg)
+{
+	kfree(ptr);
+}
+
+int nf_nat_masquerade_init(void)
+{
+	struct masq_bucket *b;
+	unsigned int i;
+	int cpu, err;
+
+	masq_pcpu_index = alloc_percpu(struct masq_index);
+	if (!masq_pcpu_index)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		for (i = 0; i < 1 << MASQ_INDEX_BITS; i++) {
+			b = &per_cpu_ptr(masq_pcpu_index, cpu)->buckets[i];
+			spin_lock_init(&b->lock);
+			INIT_HLIST_HEAD(&b->head);
+		}
+	}
+
+	err = rhashtable_init(&masq_entries, &masq_entries_params);
+	if (err < 0)
+		free_percpu(masq_pcpu_index);
+
+	return err;
+}
+
+/* Conntracks destroyed after the nat hook is gone are not unindexed */
+void nf_nat_masquerade_fini(void)
+{
+	rhashtable_free_and_destroy(&masq_entries, masq_entry_free, NULL);
+	free_percpu(masq_pcpu_index);
+}
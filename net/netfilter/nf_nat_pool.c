@@ -0,0 +1,662 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Port pools for source NAT.
+ *
+ * With nf_nat_port_pool set, a source NAT port that has to be chosen is
+ * taken from a bitmap of the ports handed out so far for the same
+ * address, protocol and port range.  Finding a free one is a scan of the
+ * bitmap from a random position instead of conntrack lookups of random
+ * ports, which get expensive and then fail once most of the range is in
+ * use.
+ *
+ * A port is held until its conntrack entry is freed, entries to other
+ * destinations don't get it in the mean time: the pool gives up the per
+ * destination reuse of ports for a bounded allocation cost.  Once the
+ * pool is exhausted, the regular search is done and still finds ports
+ * that can be reused towards another destination.
+ *
+ * With NF_NAT_RANGE_PROTO_BLOCK, ports are instead handed out from
+ * blocks of base_proto ports.  A subscriber, the original source address,
+ * gets a block of a NAT address on its first connection and further ones
+ * when those are full.  The pool of the NAT address then tracks blocks
+ * rather than ports.  Only block allocation and release are reported, as
+ * AUDIT_NETFILTER_NAT records, which is enough to map a NAT address and
+ * port back to a subscriber.
+ *
+ * Pools and blocks are created on demand and freed with their last port,
+ * /proc/net/nf_nat_pools lists the pools with the number of times they
+ * were found exhausted.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/audit.h>
+#include <linux/bitmap.h>
+#include <linux/jhash.h>
+#include <linux/kernel.h>
+#include <linux/proc_fs.h>
+#include <linux/random.h>
+#include <linux/ratelimit.h>
+#include <linux/seq_file_net.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/sysctl.h>
+
+#include <net/net_namespace.h>
+#include <net/netfilter/nf_conntrack_zones.h>
+#include <net/netfilter/nf_nat.h>
+#include <net/netfilter/nf_nat_pool.h>
+
+#define NF_NAT_POOL_HSIZE	256
+#define NF_NAT_BLOCK_HSIZE	4096
+
+struct nf_nat_pool {
+	struct hlist_node	node;
+	possible_net_t		net;
+	union nf_inet_addr	addr;
+	u8			l3num;
+	u8			l4num;
+	u16			min;
+	/* ports per block, 0 if the pool tracks ports */
+	u16			block;
+	/* number of ports or blocks */
+	u32			size;
+	/* one per port or block in use, plus the ones of allocations in
+	 * progress
+	 */
+	refcount_t		ref;
+	spinlock_t		lock;
+	u32			used;
+	u64			exhausted;
+	struct rcu_head		rcu;
+	unsigned long		map[];
+};
+
+struct nf_nat_block {
+	struct hlist_node	node;
+	possible_net_t		net;
+	union nf_inet_addr	src;
+	u16			zone;
+	u8			l3num;
+	u8			l4num;
+	struct nf_nat_pool	*pool;
+	u32			index;
+	u16			first;
+	u16			size;
+	/* one per port in use, plus the ones of lookups in progress */
+	refcount_t		ref;
+	spinlock_t		lock;
+	struct rcu_head		rcu;
+	unsigned long		map[];
+};
+
+u8 nf_nat_port_pool __read_mostly;
+
+static struct hlist_head nf_nat_pool_hash[NF_NAT_POOL_HSIZE];
+static DEFINE_SPINLOCK(nf_nat_pool_lock);
+static struct hlist_head nf_nat_block_hash[NF_NAT_BLOCK_HSIZE];
+static DEFINE_SPINLOCK(nf_nat_block_lock);
+static u32 nf_nat_pool_rnd __read_mostly;
+static struct ctl_table_header *nf_nat_pool_sysctl_header;
+
+/* Block events are few by design, the limit only guards the kernel log
+ * against a subscriber cycling through blocks while audit is disabled.
+ */
+static DEFINE_RATELIMIT_STATE(nf_nat_block_ratelimit, HZ, 1000);
+
+static u32 nf_nat_pool_hashfn(const struct net *net,
+			      const struct nf_conntrack_tuple *tuple,
+			      u16 min, u32 size, u16 block)
+{
+	u32 hash;
+
+	hash = jhash2(tuple->src.u3.all, ARRAY_SIZE(tuple->src.u3.all),
+		      nf_nat_pool_rnd ^ net_hash_mix(net));
+	hash = jhash_3words(hash, tuple->dst.protonum << 16 | min, size,
+			    block);
+
+	return reciprocal_scale(hash, NF_NAT_POOL_HSIZE);
+}
+
+static bool nf_nat_pool_match(const struct nf_nat_pool *pool,
+			      const struct net *net,
+			      const struct nf_conntrack_tuple *tuple,
+			      u16 min, u32 size, u16 block)
+{
+	return net_eq(read_pnet(&pool->net), net) &&
+	       nf_inet_addr_cmp(&pool->addr, &tuple->src.u3) &&
+	       pool->l3num == tuple->src.l3num &&
+	       pool->l4num == tuple->dst.protonum &&
+	       pool->min == min && pool->size == size &&
+	       pool->block == block;
+}
+
+/* Pool of the source address, protocol and port range of @tuple, with a
+ * reference taken.  With @block set, the pool hands out the @size blocks
+ * of @block ports starting at @min.
+ */
+struct nf_nat_pool *nf_nat_pool_get(struct net *net,
+				    const struct nf_conntrack_tuple *tuple,
+				    u16 min, u32 size, u16 block)
+{
+	u32 hash = nf_nat_pool_hashfn(net, tuple, min, size, block);
+	struct nf_nat_pool *pool, *old;
+
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(pool, &nf_nat_pool_hash[hash], node) {
+		if (nf_nat_pool_match(pool, net, tuple, min, size, block) &&
+		    refcount_inc_not_zero(&pool->ref)) {
+			rcu_read_unlock();
+			return pool;
+		}
+	}
+	rcu_read_unlock();
+
+	pool = kzalloc(struct_size(pool, map, BITS_TO_LONGS(size)),
+		       GFP_ATOMIC);
+	if (!pool)
+		return NULL;
+
+	write_pnet(&pool->net, net);
+	pool->addr = tuple->src.u3;
+	pool->l3num = tuple->src.l3num;
+	pool->l4num = tuple->dst.protonum;
+	pool->min = min;
+	pool->block = block;
+	pool->size = size;
+	refcount_set(&pool->ref, 1);
+	spin_lock_init(&pool->lock);
+
+	spin_lock_bh(&nf_nat_pool_lock);
+	hlist_for_each_entry(old, &nf_nat_pool_hash[hash], node) {
+		/* raced with another cpu */
+		if (nf_nat_pool_match(old, net, tuple, min, size, block) &&
+		    refcount_inc_not_zero(&old->ref)) {
+			spin_unlock_bh(&nf_nat_pool_lock);
+			kfree(pool);
+			return old;
+		}
+	}
+	hlist_add_head_rcu(&pool->node, &nf_nat_pool_hash[hash]);
+	spin_unlock_bh(&nf_nat_pool_lock);
+
+	return pool;
+}
+
+void nf_nat_pool_put(struct nf_nat_pool *pool)
+{
+	if (!refcount_dec_and_test(&pool->ref))
+		return;
+
+	spin_lock_bh(&nf_nat_pool_lock);
+	hlist_del_rcu(&pool->node);
+	spin_unlock_bh(&nf_nat_pool_lock);
+
+	kfree_rcu(pool, rcu);
+}
+
+/* Marks the first free bit from @start on in use, wrapping around.
+ * Returns it or -1 if there is none.
+ */
+static int nf_nat_map_claim(unsigned long *map, u32 size, u32 start)
+{
+	unsigned long bit;
+
+	if (start >= size)
+		start = 0;
+
+	bit = find_next_zero_bit(map, size, start);
+	if (bit >= size) {
+		bit = find_first_zero_bit(map, start);
+		if (bit >= start)
+			return -1;
+	}
+
+	__set_bit(bit, map);
+	return bit;
+}
+
+/* Returns the offset of the port or block marked in use, or -1 if the
+ * pool is exhausted.
+ */
+int nf_nat_pool_claim(struct nf_nat_pool *pool, u32 start)
+{
+	int port;
+
+	spin_lock_bh(&pool->lock);
+	port = nf_nat_map_claim(pool->map, pool->size, start);
+	if (port < 0)
+		pool->exhausted++;
+	else
+		pool->used++;
+	spin_unlock_bh(&pool->lock);
+
+	return port;
+}
+
+void nf_nat_pool_unclaim(struct nf_nat_pool *pool, u32 port)
+{
+	spin_lock_bh(&pool->lock);
+	__clear_bit(port, pool->map);
+	pool->used--;
+	spin_unlock_bh(&pool->lock);
+}
+
+/* Audit records aren't rate limited, and their loss is accounted for and
+ * handled according to the audit failure mode.  The kernel log only gets
+ * the events while audit is disabled.
+ */
+static void nf_nat_block_log(const struct nf_nat_block *block,
+			     const char *event)
+{
+	struct audit_buffer *ab;
+
+	if (audit_enabled) {
+		ab = audit_log_start(NULL, GFP_ATOMIC, AUDIT_NETFILTER_NAT);
+		if (!ab)
+			return;
+
+		if (block->l3num == NFPROTO_IPV4)
+			audit_log_format(ab, "op=block-%s src=%pI4 zone=%u proto=%u nat=%pI4 ports=%u-%u",
+					 event, &block->src.ip, block->zone,
+					 block->l4num, &block->pool->addr.ip,
+					 block->first,
+					 block->first + block->size - 1);
+		else
+			audit_log_format(ab, "op=block-%s src=%pI6c zone=%u proto=%u nat=%pI6c ports=%u-%u",
+					 event, &block->src.in6, block->zone,
+					 block->l4num, &block->pool->addr.in6,
+					 block->first,
+					 block->first + block->size - 1);
+		audit_log_end(ab);
+		return;
+	}
+
+	if (!__ratelimit(&nf_nat_block_ratelimit))
+		return;
+
+	if (block->l3num == NFPROTO_IPV4)
+		pr_info("block %s: src=%pI4 zone=%u proto=%u nat=%pI4 ports=%u-%u\n",
+			event, &block->src.ip, block->zone, block->l4num,
+			&block->pool->addr.ip, block->first,
+			block->first + block->size - 1);
+	else
+		pr_info("block %s: src=%pI6c zone=%u proto=%u nat=%pI6c ports=%u-%u\n",
+			event, &block->src.in6, block->zone, block->l4num,
+			&block->pool->addr.in6, block->first,
+			block->first + block->size - 1);
+}
+
+static u32 nf_nat_block_hashfn(const struct net *net,
+			       const struct nf_conntrack_tuple *orig,
+			       u16 zone)
+{
+	u32 hash;
+
+	hash = jhash2(orig->src.u3.all, ARRAY_SIZE(orig->src.u3.all),
+		      nf_nat_pool_rnd ^ net_hash_mix(net));
+	hash = jhash_2words(hash, orig->dst.protonum << 16 | zone, 0);
+
+	return reciprocal_scale(hash, NF_NAT_BLOCK_HSIZE);
+}
+
+static bool nf_nat_block_match(const struct nf_nat_block *block,
+			       const struct net *net,
+			       const struct nf_conntrack_tuple *orig, u16 zone,
+			       const struct nf_nat_range2 *range,
+			       u16 min, u32 size, u16 bsize)
+{
+	const struct nf_nat_pool *pool = block->pool;
+	struct nf_conntrack_tuple t;
+
+	if (!net_eq(read_pnet(&block->net), net) ||
+	    !nf_inet_addr_cmp(&block->src, &orig->src.u3) ||
+	    block->zone != zone ||
+	    block->l3num != orig->src.l3num ||
+	    block->l4num != orig->dst.protonum ||
+	    pool->min != min || pool->block != bsize ||
+	    pool->size != size / bsize)
+		return false;
+
+	if (!(range->flags & NF_NAT_RANGE_MAP_IPS))
+		return true;
+
+	/* the rule may have changed since */
+	t.src.l3num = pool->l3num;
+	t.src.u3 = pool->addr;
+	return nf_nat_inet_in_range(&t, range);
+}
+
+static void nf_nat_block_put(struct nf_nat_block *block)
+{
+	if (!refcount_dec_and_test(&block->ref))
+		return;
+
+	spin_lock_bh(&nf_nat_block_lock);
+	hlist_del_rcu(&block->node);
+	spin_unlock_bh(&nf_nat_block_lock);
+
+	nf_nat_block_log(block, "release");
+
+	nf_nat_pool_unclaim(block->pool, block->index);
+	nf_nat_pool_put(block->pool);
+	kfree_rcu(block, rcu);
+}
+
+static bool nf_nat_block_has_room(struct nf_nat_block *block)
+{
+	bool room;
+
+	spin_lock(&block->lock);
+	room = find_first_zero_bit(block->map, block->size) < block->size;
+	spin_unlock(&block->lock);
+
+	return room;
+}
+
+/* A new block for the subscriber of @ct, on the NAT address of @tuple, or
+ * the one another cpu added meanwhile if it still has room.
+ */
+static struct nf_nat_block *
+nf_nat_block_alloc(struct net *net, const struct nf_conn *ct,
+		   const struct nf_conntrack_tuple *tuple,
+		   const struct nf_nat_range2 *range, u16 zone,
+		   u16 min, u32 size, u16 bsize)
+{
+	const struct nf_conntrack_tuple *orig;
+	struct nf_nat_block *block, *old;
+	struct nf_nat_pool *pool;
+	int index;
+	u32 hash;
+
+	pool = nf_nat_pool_get(net, tuple, min, size / bsize, bsize);
+	if (!pool)
+		return NULL;
+
+	index = nf_nat_pool_claim(pool, get_random_u32_below(pool->size));
+	if (index < 0)
+		goto err_pool;
+
+	block = kzalloc(struct_size(block, map, BITS_TO_LONGS(bsize)),
+			GFP_ATOMIC);
+	if (!block)
+		goto err_claim;
+
+	orig = &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple;
+	write_pnet(&block->net, net);
+	block->src = orig->src.u3;
+	block->zone = zone;
+	block->l3num = orig->src.l3num;
+	block->l4num = orig->dst.protonum;
+	block->pool = pool;
+	block->index = index;
+	block->first = min + index * bsize;
+	block->size = bsize;
+	refcount_set(&block->ref, 1);
+	spin_lock_init(&block->lock);
+
+	hash = nf_nat_block_hashfn(net, orig, zone);
+	spin_lock_bh(&nf_nat_block_lock);
+	hlist_for_each_entry(old, &nf_nat_block_hash[hash], node) {
+		/* raced with another cpu */
+		if (nf_nat_block_match(old, net, orig, zone, range,
+				       min, size, bsize) &&
+		    nf_nat_block_has_room(old) &&
+		    refcount_inc_not_zero(&old->ref)) {
+			spin_unlock_bh(&nf_nat_block_lock);
+			kfree(block);
+			nf_nat_pool_unclaim(pool, index);
+			nf_nat_pool_put(pool);
+			return old;
+		}
+	}
+	hlist_add_head_rcu(&block->node, &nf_nat_block_hash[hash]);
+	spin_unlock_bh(&nf_nat_block_lock);
+
+	nf_nat_block_log(block, "alloc");
+	return block;
+
+err_claim:
+	nf_nat_pool_unclaim(pool, index);
+err_pool:
+	nf_nat_pool_put(pool);
+	return NULL;
+}
+
+/* Takes a port of @block that makes @tuple unique.  The reference the
+ * caller holds on @block is the one of the port then.
+ */
+static bool nf_nat_block_port(struct nf_nat_block *block,
+			      struct nf_conntrack_tuple *tuple,
+			      struct nf_conn *ct, struct nf_conn_nat *nat)
+{
+	u32 start = get_random_u32_below(block->size);
+	unsigned int attempts;
+	int port;
+
+	tuple->src.u3 = block->pool->addr;
+
+	for (attempts = 0; attempts < block->size; attempts++) {
+		spin_lock_bh(&block->lock);
+		port = nf_nat_map_claim(block->map, block->size, start);
+		spin_unlock_bh(&block->lock);
+		if (port < 0)
+			return false;
+
+		tuple->src.u.all = htons(block->first + port);
+		if (!nf_nat_used_tuple(tuple, ct)) {
+			nat->block = block;
+			nat->pool_port = port;
+			return true;
+		}
+
+		/* in use by a mapping outside of the block, skip it */
+		spin_lock_bh(&block->lock);
+		__clear_bit(port, block->map);
+		spin_unlock_bh(&block->lock);
+
+		start = port + 1;
+	}
+
+	return false;
+}
+
+/* Source NAT mapping of @ct from a block of its subscriber.  @tuple has the
+ * NAT address, used when a new block is needed, and the port range is
+ * @size ports from @min.
+ */
+bool nf_nat_block_unique_tuple(struct nf_conntrack_tuple *tuple,
+			       const struct nf_nat_range2 *range,
+			       struct nf_conn *ct, u16 min, u32 size)
+{
+	const struct nf_conntrack_tuple *orig;
+	u16 bsize = ntohs(range->base_proto.all);
+	struct net *net = nf_ct_net(ct);
+	struct nf_nat_block *block;
+	struct nf_conn_nat *nat;
+	u16 zone;
+	u32 hash;
+
+	if (!bsize || bsize > size)
+		return false;
+
+	nat = nf_ct_nat_ext_add(ct);
+	if (!nat || nat->pool || nat->block)
+		return false;
+
+	orig = &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple;
+	zone = nf_ct_zone_id(nf_ct_zone(ct), IP_CT_DIR_ORIGINAL);
+	hash = nf_nat_block_hashfn(net, orig, zone);
+
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(block, &nf_nat_block_hash[hash], node) {
+		if (!nf_nat_block_match(block, net, orig, zone, range,
+					min, size, bsize) ||
+		    !refcount_inc_not_zero(&block->ref))
+			continue;
+
+		if (nf_nat_block_port(block, tuple, ct, nat)) {
+			rcu_read_unlock();
+			return true;
+		}
+		nf_nat_block_put(block);
+	}
+	rcu_read_unlock();
+
+	block = nf_nat_block_alloc(net, ct, tuple, range, zone, min, size,
+				   bsize);
+	if (!block)
+		return false;
+
+	if (nf_nat_block_port(block, tuple, ct, nat))
+		return true;
+
+	nf_nat_block_put(block);
+	return false;
+}
+
+/* Called when @ct is freed, or its source NAT binding removed. */
+void nf_nat_pool_release(struct nf_conn *ct)
+{
+	struct nf_conn_nat *nat = nfct_nat(ct);
+	struct nf_nat_block *block;
+	struct nf_nat_pool *pool;
+
+	if (!nat)
+		return;
+
+	if (nat->pool) {
+		pool = nat->pool;
+		nat->pool = NULL;
+
+		nf_nat_pool_unclaim(pool, nat->pool_port);
+		nf_nat_pool_put(pool);
+	}
+
+	if (nat->block) {
+		block = nat->block;
+		nat->block = NULL;
+
+		spin_lock_bh(&block->lock);
+		__clear_bit(nat->pool_port, block->map);
+		spin_unlock_bh(&block->lock);
+		nf_nat_block_put(block);
+	}
+}
+
+#ifdef CONFIG_PROC_FS
+static int nf_nat_pool_show(struct seq_file *s, void *v)
+{
+	struct net *net = seq_file_single_net(s);
+	struct nf_nat_pool *pool;
+	unsigned int i;
+
+	rcu_read_lock();
+	for (i = 0; i < NF_NAT_POOL_HSIZE; i++) {
+		hlist_for_each_entry_rcu(pool, &nf_nat_pool_hash[i], node) {
+			if (!net_eq(read_pnet(&pool->net), net))
+				continue;
+
+			if (pool->l3num == NFPROTO_IPV4)
+				seq_printf(s, "%pI4", &pool->addr.ip);
+			else
+				seq_printf(s, "%pI6c", &pool->addr.in6);
+
+			spin_lock_bh(&pool->lock);
+			seq_printf(s, " proto=%u ports=%u-%u", pool->l4num,
+				   pool->min, pool->block ?
+				   pool->min + pool->size * pool->block - 1 :
+				   pool->min + pool->size - 1);
+			if (pool->block)
+				seq_printf(s, " block=%u", pool->block);
+			seq_printf(s, " used=%u exhausted=%llu\n",
+				   pool->used, pool->exhausted);
+			spin_unlock_bh(&pool->lock);
+		}
+	}
+	rcu_read_unlock();
+
+	return 0;
+}
+#endif
+
+static int __net_init nf_nat_pool_net_init(struct net *net)
+{
+#ifdef CONFIG_PROC_FS
+	if (!proc_create_net_single("nf_nat_pools", 0440, net->proc_net,
+				    nf_nat_pool_show, NULL))
+		return -ENOMEM;
+#endif
+	return 0;
+}
+
+static void __net_exit nf_nat_pool_net_exit(struct net *net)
+{
+	remove_proc_entry("nf_nat_pools", net->proc_net);
+}
+
+static struct pernet_operations nf_nat_pool_net_ops = {
+	.init	= nf_nat_pool_net_init,
+	.exit	= nf_nat_pool_net_exit,
+};
+
+static struct ctl_table nf_nat_pool_sysctl_table[] = {
+	{
+		.procname	= "nf_nat_port_pool",
+		.data		= &nf_nat_port_pool,
+		.maxlen		= sizeof(u8),
+		.mode		= 0644,
+		.proc_handler	= proc_dou8vec_minmax,
+		.extra1		= SYSCTL_ZERO,
+		.extra2		= SYSCTL_ONE,
+	},
+};
+
+int nf_nat_pool_init(void)
+{
+	int ret;
+
+	nf_nat_pool_rnd = get_random_u32();
+
+	ret = register_pernet_subsys(&nf_nat_pool_net_ops);
+	if (ret < 0)
+		return ret;
+
+	nf_nat_pool_sysctl_header = register_net_sysctl(&init_net,
+							"net/netfilter",
+							nf_nat_pool_sysctl_table);
+	if (!nf_nat_pool_sysctl_header) {
+		unregister_pernet_subsys(&nf_nat_pool_net_ops);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/* Called after the bindings were removed, pools and blocks still around
+ * belong to entries that won't release them anymore.
+ */
+void nf_nat_pool_fini(void)
+{
+	struct nf_nat_block *block;
+	struct nf_nat_pool *pool;
+	struct hlist_node *n;
+	unsigned int i;
+
+	unregister_net_sysctl_table(nf_nat_pool_sysctl_header);
+	unregister_pernet_subsys(&nf_nat_pool_net_ops);
+
+	for (i = 0; i < NF_NAT_BLOCK_HSIZE; i++) {
+		hlist_for_each_entry_safe(block, n, &nf_nat_block_hash[i], node) {
+			hlist_del(&block->node);
+			kfree(block);
+		}
+	}
+
+	for (i = 0; i < NF_NAT_POOL_HSIZE; i++) {
+		hlist_for_each_entry_safe(pool, n, &nf_nat_pool_hash[i], node) {
+			hlist_del(&pool->node);
+			kfree(pool);
+		}
+	}
+}
@@ -364,7 +364,11 @@ static bool nf_nat_ipv4_manip_pkt(struct sk_buff *skb,
 	iph = (void *)skb->data + iphdroff;
 	hdroff = iphdroff + iph->ihl * 4;
 
-	if (!l4proto_manip_pkt(skb, iphdroff, hdroff, target, maniptype))
+	/* only the first fragment has the transport header, the others go
+	 * through unreassembled with nf_conntrack_frag4_virtual set
+	 */
+	if (!(iph->frag_off & htons(IP_OFFSET)) &&
+	    !l4proto_manip_pkt(skb, iphdroff, hdroff, target, maniptype))
 		return false;
 	iph = (void *)skb->data + iphdroff;
 
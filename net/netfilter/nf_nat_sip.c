@@ -39,6 +39,9 @@ static unsigned int mangle_packet(struct sk_buff *skb, unsigned int protoff,
 {
 	enum ip_conntrack_info ctinfo;
 	struct nf_conn *ct = nf_ct_get(skb, &ctinfo);
+	unsigned int olddatalen = *datalen;
+	const char *olddptr = *dptr;
+	unsigned int moff = matchoff;
 	struct tcphdr *th;
 	unsigned int baseoff;
 
@@ -64,6 +67,9 @@ static unsigned int mangle_packet(struct sk_buff *skb, unsigned int protoff,
 	/* Reload data pointer and adjust datalen value */
 	*dptr = skb->data + dataoff;
 	*datalen += buflen - matchlen;
+
+	ct_sip_index_mangled(olddptr, olddatalen, *dptr, *datalen,
+			     moff, matchlen);
 	return 1;
 }
 
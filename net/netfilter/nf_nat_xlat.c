@@ -0,0 +1,658 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Stateless IPv4/IPv6 translation, RFC 7915.
+ *
+ * Both addresses are translated with the same /96 prefix, RFC 6052: an
+ * IPv6 address of the prefix maps to the IPv4 address in its last 32 bits
+ * and back.  TCP, UDP and ICMP are translated, packets with IPv4 options,
+ * fragments or IPv6 extension headers are not.  ICMP errors also get the
+ * header of the packet they quote translated, so that the receiver can
+ * match them to its socket.
+ *
+ * The translation is done in place: the header shrinks or grows by 20
+ * bytes in front of the transport header, which stays where it is, so
+ * checksum offloads still apply after the pseudo header is adjusted.
+ */
+
+#include <linux/icmp.h>
+#include <linux/icmpv6.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/random.h>
+#include <linux/skbuff.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
+#include <net/checksum.h>
+#include <net/ip.h>
+#include <net/ip6_checksum.h>
+#include <net/ipv6.h>
+#include <net/netfilter/nf_nat_xlat.h>
+
+#define NF_NAT_XLAT_HDR_DIFF	(sizeof(struct ipv6hdr) - sizeof(struct iphdr))
+
+/* Translated IPv4 packets up to this size don't get DF, RFC 7915 5.1 */
+#define NF_NAT_XLAT_DF_MAX	1260
+
+#define NF_NAT_XLAT_GSO_TCP	(SKB_GSO_TCPV4 | SKB_GSO_TCPV6 | \
+				 SKB_GSO_TCP_ECN | SKB_GSO_TCP_FIXEDID | \
+				 SKB_GSO_DODGY)
+#define NF_NAT_XLAT_GSO_UDP	(SKB_GSO_UDP_L4 | SKB_GSO_DODGY)
+
+static bool nf_nat_xlat_addr_6to4(const struct in6_addr *prefix,
+				  const struct in6_addr *addr, __be32 *v4)
+{
+	if (addr->s6_addr32[0] != prefix->s6_addr32[0] ||
+	    addr->s6_addr32[1] != prefix->s6_addr32[1] ||
+	    addr->s6_addr32[2] != prefix->s6_addr32[2])
+		return false;
+
+	*v4 = addr->s6_addr32[3];
+	return true;
+}
+
+static void nf_nat_xlat_addr_4to6(const struct in6_addr *prefix, __be32 v4,
+				  struct in6_addr *addr)
+{
+	addr->s6_addr32[0] = prefix->s6_addr32[0];
+	addr->s6_addr32[1] = prefix->s6_addr32[1];
+	addr->s6_addr32[2] = prefix->s6_addr32[2];
+	addr->s6_addr32[3] = v4;
+}
+
+/* Difference of the TCP/UDP pseudo header sums.  Length and protocol add
+ * up to the same in both families, only the addresses differ.
+ */
+static __wsum nf_nat_xlat_pseudo_diff(const __be32 *from, unsigned int nfrom,
+				      const __be32 *to, unsigned int nto)
+{
+	__wsum diff = 0;
+	unsigned int i;
+
+	for (i = 0; i < nfrom; i++)
+		diff = csum_sub(diff, (__force __wsum)from[i]);
+	for (i = 0; i < nto; i++)
+		diff = csum_add(diff, (__force __wsum)to[i]);
+
+	return diff;
+}
+
+static void nf_nat_xlat_build_iph(struct iphdr *iph,
+				  const struct ipv6hdr *ip6h,
+				  const __be32 *addr)
+{
+	unsigned int len = sizeof(*iph) + ntohs(ip6h->payload_len);
+
+	iph->version = 4;
+	iph->ihl = sizeof(*iph) / 4;
+	iph->tos = ipv6_get_dsfield(ip6h);
+	iph->tot_len = htons(len);
+	if (len <= NF_NAT_XLAT_DF_MAX) {
+		iph->id = (__force __be16)get_random_u16();
+		iph->frag_off = 0;
+	} else {
+		iph->id = 0;
+		iph->frag_off = htons(IP_DF);
+	}
+	iph->ttl = ip6h->hop_limit;
+	iph->protocol = ip6h->nexthdr == IPPROTO_ICMPV6 ?
+			IPPROTO_ICMP : ip6h->nexthdr;
+	iph->saddr = addr[0];
+	iph->daddr = addr[1];
+	ip_send_check(iph);
+}
+
+static void nf_nat_xlat_build_ip6h(struct ipv6hdr *ip6h,
+				   const struct iphdr *iph,
+				   const struct in6_addr *prefix)
+{
+	ip6_flow_hdr(ip6h, iph->tos, 0);
+	ip6h->payload_len = htons(ntohs(iph->tot_len) - sizeof(*iph));
+	ip6h->nexthdr = iph->protocol == IPPROTO_ICMP ?
+			IPPROTO_ICMPV6 : iph->protocol;
+	ip6h->hop_limit = iph->ttl;
+	nf_nat_xlat_addr_4to6(prefix, iph->saddr, &ip6h->saddr);
+	nf_nat_xlat_addr_4to6(prefix, iph->daddr, &ip6h->daddr);
+}
+
+/* Types and codes of RFC 7915 4.2, false for messages that are dropped. */
+static bool nf_nat_xlat_icmp_type_4to6(u8 *type, u8 *code, __be32 *un,
+				       bool *error)
+{
+	u32 mtu;
+
+	*error = true;
+
+	switch (*type) {
+	case ICMP_ECHO:
+		*type = ICMPV6_ECHO_REQUEST;
+		*error = false;
+		return true;
+	case ICMP_ECHOREPLY:
+		*type = ICMPV6_ECHO_REPLY;
+		*error = false;
+		return true;
+	case ICMP_DEST_UNREACH:
+		break;
+	case ICMP_TIME_EXCEEDED:
+		*type = ICMPV6_TIME_EXCEED;
+		*un = 0;
+		return true;
+	default:
+		return false;
+	}
+
+	switch (*code) {
+	case ICMP_NET_UNREACH:
+	case ICMP_HOST_UNREACH:
+	case ICMP_SR_FAILED:
+	case ICMP_NET_UNKNOWN:
+	case ICMP_HOST_UNKNOWN:
+	case ICMP_HOST_ISOLATED:
+	case ICMP_NET_UNR_TOS:
+	case ICMP_HOST_UNR_TOS:
+		*type = ICMPV6_DEST_UNREACH;
+		*code = ICMPV6_NOROUTE;
+		*un = 0;
+		break;
+	case ICMP_PROT_UNREACH:
+		*type = ICMPV6_PARAMPROB;
+		*code = ICMPV6_UNK_NEXTHDR;
+		*un = htonl(offsetof(struct ipv6hdr, nexthdr));
+		break;
+	case ICMP_PORT_UNREACH:
+		*type = ICMPV6_DEST_UNREACH;
+		*code = ICMPV6_PORT_UNREACH;
+		*un = 0;
+		break;
+	case ICMP_FRAG_NEEDED:
+		mtu = ntohl(*un) & 0xffff;
+		*type = ICMPV6_PKT_TOOBIG;
+		*code = 0;
+		*un = htonl(max_t(u32, mtu + NF_NAT_XLAT_HDR_DIFF,
+				  IPV6_MIN_MTU));
+		break;
+	case ICMP_NET_ANO:
+	case ICMP_HOST_ANO:
+	case ICMP_PKT_FILTERED:
+	case ICMP_PREC_CUTOFF:
+		*type = ICMPV6_DEST_UNREACH;
+		*code = ICMPV6_ADM_PROHIBITED;
+		*un = 0;
+		break;
+	default:
+		return false;
+	}
+
+	return true;
+}
+
+/* Types and codes of RFC 7915 5.2, false for messages that are dropped. */
+static bool nf_nat_xlat_icmp_type_6to4(u8 *type, u8 *code, __be32 *un,
+				       bool *error)
+{
+	u32 mtu;
+
+	*error = true;
+
+	switch (*type) {
+	case ICMPV6_ECHO_REQUEST:
+		*type = ICMP_ECHO;
+		*error = false;
+		return true;
+	case ICMPV6_ECHO_REPLY:
+		*type = ICMP_ECHOREPLY;
+		*error = false;
+		return true;
+	case ICMPV6_DEST_UNREACH:
+		*type = ICMP_DEST_UNREACH;
+		switch (*code) {
+		case ICMPV6_NOROUTE:
+		case ICMPV6_NOT_NEIGHBOUR:
+		case ICMPV6_ADDR_UNREACH:
+			*code = ICMP_HOST_UNREACH;
+			break;
+		case ICMPV6_ADM_PROHIBITED:
+			*code = ICMP_HOST_ANO;
+			break;
+		case ICMPV6_PORT_UNREACH:
+			*code = ICMP_PORT_UNREACH;
+			break;
+		default:
+			return false;
+		}
+		*un = 0;
+		return true;
+	case ICMPV6_PKT_TOOBIG:
+		mtu = ntohl(*un);
+		*type = ICMP_DEST_UNREACH;
+		*code = ICMP_FRAG_NEEDED;
+		*un = htonl(min_t(u32, mtu - NF_NAT_XLAT_HDR_DIFF, 0xffff));
+		return mtu >= IPV6_MIN_MTU;
+	case ICMPV6_TIME_EXCEED:
+		*type = ICMP_TIME_EXCEEDED;
+		*un = 0;
+		return true;
+	case ICMPV6_PARAMPROB:
+		if (*code != ICMPV6_UNK_NEXTHDR)
+			return false;
+		*type = ICMP_DEST_UNREACH;
+		*code = ICMP_PROT_UNREACH;
+		*un = 0;
+		return true;
+	}
+
+	return false;
+}
+
+/* Transport header of a packet quoted by an ICMP error, it is usually
+ * truncated.  The checksum of a quoted ICMP message is only adjusted for
+ * the type, receivers don't verify it.
+ */
+static void nf_nat_xlat_inner_l4(struct sk_buff *skb, unsigned int thoff,
+				 u8 proto, __wsum diff)
+{
+	unsigned int len = skb->len - thoff;
+	void *l4 = skb->data + thoff;
+	struct icmphdr *icmph = l4;
+	struct udphdr *uh = l4;
+	struct tcphdr *th = l4;
+	u8 type;
+
+	switch (proto) {
+	case IPPROTO_TCP:
+		if (len >= offsetofend(struct tcphdr, check))
+			csum_replace_by_diff(&th->check, diff);
+		break;
+	case IPPROTO_UDP:
+		if (len >= sizeof(*uh) && uh->check)
+			csum_replace_by_diff(&uh->check, diff);
+		break;
+	case IPPROTO_ICMP:
+	case IPPROTO_ICMPV6:
+		if (len < sizeof(*icmph))
+			break;
+
+		if (proto == IPPROTO_ICMP && icmph->type == ICMP_ECHO)
+			type = ICMPV6_ECHO_REQUEST;
+		else if (proto == IPPROTO_ICMP && icmph->type == ICMP_ECHOREPLY)
+			type = ICMPV6_ECHO_REPLY;
+		else if (icmph->type == ICMPV6_ECHO_REQUEST)
+			type = ICMP_ECHO;
+		else if (icmph->type == ICMPV6_ECHO_REPLY)
+			type = ICMP_ECHOREPLY;
+		else
+			break;
+
+		csum_replace2(&icmph->checksum,
+			      htons(icmph->type << 8 | icmph->code),
+			      htons(type << 8 | icmph->code));
+		icmph->type = type;
+		break;
+	}
+}
+
+/* Translates the IPv4 header quoted by the ICMP error at @thoff, the skb
+ * is linear and grows by NF_NAT_XLAT_HDR_DIFF.
+ */
+static int nf_nat_xlat_inner_4to6(struct sk_buff *skb, unsigned int thoff,
+				  const struct in6_addr *prefix)
+{
+	unsigned int inoff = thoff + sizeof(struct icmphdr);
+	struct ipv6hdr ip6h;
+	struct iphdr *iph;
+	__wsum diff;
+
+	if (skb->len < inoff + sizeof(*iph))
+		return -EINVAL;
+
+	iph = (struct iphdr *)(skb->data + inoff);
+	if (iph->version != 4 || iph->ihl != sizeof(*iph) / 4)
+		return -EINVAL;
+
+	if (skb_tailroom(skb) < NF_NAT_XLAT_HDR_DIFF &&
+	    pskb_expand_head(skb, 0, NF_NAT_XLAT_HDR_DIFF, GFP_ATOMIC))
+		return -ENOMEM;
+
+	iph = (struct iphdr *)(skb->data + inoff);
+	nf_nat_xlat_build_ip6h(&ip6h, iph, prefix);
+	diff = nf_nat_xlat_pseudo_diff(&iph->saddr, 2,
+				       ip6h.saddr.s6_addr32, 8);
+	nf_nat_xlat_inner_l4(skb, inoff + sizeof(*iph), iph->protocol, diff);
+
+	__skb_put(skb, NF_NAT_XLAT_HDR_DIFF);
+	memmove(skb->data + inoff + sizeof(ip6h),
+		skb->data + inoff + sizeof(*iph),
+		skb->len - inoff - sizeof(ip6h));
+	memcpy(skb->data + inoff, &ip6h, sizeof(ip6h));
+
+	return 0;
+}
+
+/* Translates the IPv6 header quoted by the ICMPv6 error at @thoff, the
+ * skb is linear and shrinks by NF_NAT_XLAT_HDR_DIFF.
+ */
+static int nf_nat_xlat_inner_6to4(struct sk_buff *skb, unsigned int thoff,
+				  const struct in6_addr *prefix)
+{
+	unsigned int inoff = thoff + sizeof(struct icmp6hdr);
+	struct ipv6hdr *ip6h;
+	struct iphdr iph;
+	__be32 addr[2];
+	__wsum diff;
+
+	if (skb->len < inoff + sizeof(*ip6h))
+		return -EINVAL;
+
+	ip6h = (struct ipv6hdr *)(skb->data + inoff);
+	if (!nf_nat_xlat_addr_6to4(prefix, &ip6h->saddr, &addr[0]) ||
+	    !nf_nat_xlat_addr_6to4(prefix, &ip6h->daddr, &addr[1]))
+		return -EINVAL;
+
+	nf_nat_xlat_build_iph(&iph, ip6h, addr);
+	diff = nf_nat_xlat_pseudo_diff(ip6h->saddr.s6_addr32, 8, addr, 2);
+	nf_nat_xlat_inner_l4(skb, inoff + sizeof(*ip6h), ip6h->nexthdr, diff);
+
+	memmove(skb->data + inoff + sizeof(iph),
+		skb->data + inoff + sizeof(*ip6h),
+		skb->len - inoff - sizeof(*ip6h));
+	memcpy(skb->data + inoff, &iph, sizeof(iph));
+	__skb_trim(skb, skb->len - NF_NAT_XLAT_HDR_DIFF);
+
+	return 0;
+}
+
+static int nf_nat_xlat_icmp_4to6(struct sk_buff *skb, unsigned int thoff,
+				 const struct in6_addr *prefix)
+{
+	struct icmphdr *icmph = (struct icmphdr *)(skb->data + thoff);
+	__be32 un = icmph->un.gateway;
+	u8 type = icmph->type;
+	u8 code = icmph->code;
+	bool error;
+	int err;
+
+	if (!nf_nat_xlat_icmp_type_4to6(&type, &code, &un, &error))
+		return -EPROTONOSUPPORT;
+
+	if (error) {
+		if (skb_linearize(skb))
+			return -ENOMEM;
+
+		err = nf_nat_xlat_inner_4to6(skb, thoff, prefix);
+		if (err < 0)
+			return err;
+
+		/* RFC 4443 2.4 (c), the outer header grows later */
+		if (skb->len + NF_NAT_XLAT_HDR_DIFF > IPV6_MIN_MTU)
+			__skb_trim(skb, IPV6_MIN_MTU - NF_NAT_XLAT_HDR_DIFF);
+	}
+
+	icmph = (struct icmphdr *)(skb->data + thoff);
+	icmph->type = type;
+	icmph->code = code;
+	icmph->un.gateway = un;
+
+	return 0;
+}
+
+static int nf_nat_xlat_icmp_6to4(struct sk_buff *skb, unsigned int thoff,
+				 const struct in6_addr *prefix)
+{
+	struct icmp6hdr *icmp6h = (struct icmp6hdr *)(skb->data + thoff);
+	__be32 un = icmp6h->icmp6_dataun.un_data32[0];
+	u8 type = icmp6h->icmp6_type;
+	u8 code = icmp6h->icmp6_code;
+	bool error;
+	int err;
+
+	if (!nf_nat_xlat_icmp_type_6to4(&type, &code, &un, &error))
+		return -EPROTONOSUPPORT;
+
+	if (error) {
+		if (skb_linearize(skb))
+			return -ENOMEM;
+
+		err = nf_nat_xlat_inner_6to4(skb, thoff, prefix);
+		if (err < 0)
+			return err;
+	}
+
+	icmp6h = (struct icmp6hdr *)(skb->data + thoff);
+	icmp6h->icmp6_type = type;
+	icmp6h->icmp6_code = code;
+	icmp6h->icmp6_dataun.un_data32[0] = un;
+
+	return 0;
+}
+
+/* The ICMP checksum doesn't cover a pseudo header in IPv4, the ICMPv6 one
+ * does, it has to be computed from scratch.
+ */
+static void nf_nat_xlat_icmp_csum(struct sk_buff *skb)
+{
+	unsigned int thoff = skb_transport_offset(skb);
+	unsigned int len = skb->len - thoff;
+	struct icmphdr *icmph = icmp_hdr(skb);
+	__wsum csum;
+
+	icmph->checksum = 0;
+	csum = skb_checksum(skb, thoff, len, 0);
+	if (skb->protocol == htons(ETH_P_IPV6))
+		icmph->checksum = csum_ipv6_magic(&ipv6_hdr(skb)->saddr,
+						  &ipv6_hdr(skb)->daddr, len,
+						  IPPROTO_ICMPV6, csum);
+	else
+		icmph->checksum = csum_fold(csum);
+
+	skb->ip_summed = CHECKSUM_NONE;
+}
+
+/* UDP checksums are optional in IPv4 only. */
+static void nf_nat_xlat_udp6_csum(struct sk_buff *skb)
+{
+	unsigned int thoff = skb_transport_offset(skb);
+	unsigned int len = skb->len - thoff;
+	struct udphdr *uh = udp_hdr(skb);
+
+	uh->check = csum_ipv6_magic(&ipv6_hdr(skb)->saddr,
+				    &ipv6_hdr(skb)->daddr, len, IPPROTO_UDP,
+				    skb_checksum(skb, thoff, len, 0));
+	if (!uh->check)
+		uh->check = CSUM_MANGLED_0;
+
+	skb->ip_summed = CHECKSUM_NONE;
+}
+
+static void nf_nat_xlat_l4_csum(struct sk_buff *skb, unsigned int thoff,
+				u8 proto, __wsum diff)
+{
+	__sum16 *check;
+
+	if (proto == IPPROTO_TCP)
+		check = &((struct tcphdr *)(skb->data + thoff))->check;
+	else
+		check = &((struct udphdr *)(skb->data + thoff))->check;
+
+	inet_proto_csum_replace_by_diff(check, skb, diff, true, false);
+	if (proto == IPPROTO_UDP && skb->ip_summed != CHECKSUM_PARTIAL &&
+	    !*check)
+		*check = CSUM_MANGLED_0;
+}
+
+/* Makes the transport header writable.  -EPROTONOSUPPORT and -EINVAL
+ * mean the packet is not translated and was left alone.
+ */
+static int nf_nat_xlat_prepare(struct sk_buff *skb, unsigned int thoff,
+			       u8 proto, u8 icmp_proto)
+{
+	unsigned int len, gso_mask;
+
+	if (proto == icmp_proto) {
+		len = sizeof(struct icmphdr);
+		gso_mask = 0;
+	} else if (proto == IPPROTO_TCP) {
+		len = sizeof(struct tcphdr);
+		gso_mask = NF_NAT_XLAT_GSO_TCP;
+	} else if (proto == IPPROTO_UDP) {
+		len = sizeof(struct udphdr);
+		gso_mask = NF_NAT_XLAT_GSO_UDP;
+	} else {
+		return -EPROTONOSUPPORT;
+	}
+
+	if (skb_is_gso(skb) &&
+	    (!gso_mask || skb_shinfo(skb)->gso_type & ~gso_mask))
+		return -EPROTONOSUPPORT;
+
+	if (!pskb_may_pull(skb, thoff + len))
+		return -EINVAL;
+
+	/* no checksum to adjust in the segments */
+	if (proto == IPPROTO_UDP && skb_is_gso(skb) &&
+	    !((struct udphdr *)(skb->data + thoff))->check)
+		return -EPROTONOSUPPORT;
+
+	if (skb_ensure_writable(skb, thoff + len))
+		return -ENOMEM;
+
+	/* the network header is rewritten */
+	if (skb->ip_summed == CHECKSUM_COMPLETE)
+		skb->ip_summed = CHECKSUM_NONE;
+
+	return 0;
+}
+
+static void nf_nat_xlat_gso(struct sk_buff *skb)
+{
+	struct skb_shared_info *shinfo = skb_shinfo(skb);
+
+	if (!skb_is_gso(skb))
+		return;
+
+	if (shinfo->gso_type & SKB_GSO_TCPV4) {
+		shinfo->gso_type &= ~(SKB_GSO_TCPV4 | SKB_GSO_TCP_FIXEDID);
+		shinfo->gso_type |= SKB_GSO_TCPV6;
+	} else if (shinfo->gso_type & SKB_GSO_TCPV6) {
+		shinfo->gso_type &= ~SKB_GSO_TCPV6;
+		shinfo->gso_type |= SKB_GSO_TCPV4;
+	}
+}
+
+/**
+ * nf_nat_xlat_4to6 - translate an IPv4 packet to IPv6
+ * @skb: packet, starting at the IPv4 header
+ * @prefix: /96 prefix to embed the addresses into
+ *
+ * Returns 0, -EPROTONOSUPPORT or -EINVAL if the packet is not translated
+ * and was left alone, or another error if it has to be dropped.
+ */
+int nf_nat_xlat_4to6(struct sk_buff *skb, const struct in6_addr *prefix)
+{
+	unsigned int thoff = sizeof(struct iphdr);
+	struct ipv6hdr ip6h;
+	bool udp_nocsum;
+	struct iphdr iph;
+	__wsum diff;
+	int err;
+
+	if (!pskb_may_pull(skb, sizeof(iph)))
+		return -EINVAL;
+
+	iph = *ip_hdr(skb);
+	if (iph.ihl != sizeof(iph) / 4 || ip_is_fragment(&iph))
+		return -EPROTONOSUPPORT;
+
+	err = nf_nat_xlat_prepare(skb, thoff, iph.protocol, IPPROTO_ICMP);
+	if (err < 0)
+		return err;
+
+	if (skb_cow_head(skb, NF_NAT_XLAT_HDR_DIFF))
+		return -ENOMEM;
+
+	nf_nat_xlat_build_ip6h(&ip6h, &iph, prefix);
+
+	udp_nocsum = iph.protocol == IPPROTO_UDP &&
+		     !((struct udphdr *)(skb->data + thoff))->check;
+
+	if (iph.protocol == IPPROTO_ICMP) {
+		err = nf_nat_xlat_icmp_4to6(skb, thoff, prefix);
+		if (err < 0)
+			return err;
+	} else if (!udp_nocsum) {
+		diff = nf_nat_xlat_pseudo_diff(&iph.saddr, 2,
+					       ip6h.saddr.s6_addr32, 8);
+		nf_nat_xlat_l4_csum(skb, thoff, iph.protocol, diff);
+	}
+
+	ip6h.payload_len = htons(skb->len - thoff);
+
+	skb_push(skb, NF_NAT_XLAT_HDR_DIFF);
+	skb_reset_network_header(skb);
+	skb_set_transport_header(skb, sizeof(ip6h));
+	memcpy(ipv6_hdr(skb), &ip6h, sizeof(ip6h));
+	skb->protocol = htons(ETH_P_IPV6);
+
+	if (iph.protocol == IPPROTO_ICMP)
+		nf_nat_xlat_icmp_csum(skb);
+	else if (udp_nocsum)
+		nf_nat_xlat_udp6_csum(skb);
+
+	nf_nat_xlat_gso(skb);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(nf_nat_xlat_4to6);
+
+/**
+ * nf_nat_xlat_6to4 - translate an IPv6 packet to IPv4
+ * @skb: packet, starting at the IPv6 header
+ * @prefix: /96 prefix both addresses must be in
+ *
+ * Returns as nf_nat_xlat_4to6().
+ */
+int nf_nat_xlat_6to4(struct sk_buff *skb, const struct in6_addr *prefix)
+{
+	unsigned int thoff = sizeof(struct ipv6hdr);
+	struct ipv6hdr ip6h;
+	struct iphdr iph;
+	__be32 addr[2];
+	__wsum diff;
+	int err;
+
+	if (!pskb_may_pull(skb, sizeof(ip6h)))
+		return -EINVAL;
+
+	ip6h = *ipv6_hdr(skb);
+	if (!nf_nat_xlat_addr_6to4(prefix, &ip6h.saddr, &addr[0]) ||
+	    !nf_nat_xlat_addr_6to4(prefix, &ip6h.daddr, &addr[1]))
+		return -EINVAL;
+
+	err = nf_nat_xlat_prepare(skb, thoff, ip6h.nexthdr, IPPROTO_ICMPV6);
+	if (err < 0)
+		return err;
+
+	if (ip6h.nexthdr == IPPROTO_ICMPV6) {
+		err = nf_nat_xlat_icmp_6to4(skb, thoff, prefix);
+		if (err < 0)
+			return err;
+	} else {
+		diff = nf_nat_xlat_pseudo_diff(ip6h.saddr.s6_addr32, 8,
+					       addr, 2);
+		nf_nat_xlat_l4_csum(skb, thoff, ip6h.nexthdr, diff);
+	}
+
+	ip6h.payload_len = htons(skb->len - thoff);
+	nf_nat_xlat_build_iph(&iph, &ip6h, addr);
+
+	skb_pull(skb, NF_NAT_XLAT_HDR_DIFF);
+	skb_reset_network_header(skb);
+	skb_set_transport_header(skb, sizeof(iph));
+	memcpy(ip_hdr(skb), &iph, sizeof(iph));
+	skb->protocol = htons(ETH_P_IP);
+
+	if (ip6h.nexthdr == IPPROTO_ICMPV6)
+		nf_nat_xlat_icmp_csum(skb);
+
+	nf_nat_xlat_gso(skb);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(nf_nat_xlat_6to4);
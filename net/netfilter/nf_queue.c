@@ -18,6 +18,10 @@
 #include <net/protocol.h>
 #include <net/netfilter/nf_queue.h>
 #include <net/dst.h>
+#if IS_ENABLED(CONFIG_NF_CONNTRACK)
+#include <net/netfilter/nf_conntrack.h>
+#include <net/netfilter/nf_conntrack_queue.h>
+#endif
 
 #include "nf_internals.h"
 
@@ -231,12 +235,41 @@ static int __nf_queue(struct sk_buff *skb, const struct nf_hook_state *state,
 	return 0;
 }
 
+/* Userspace need not see more of this flow on this queue and hook, see
+ * NFQA_VERDICT_F_FLOW_BYPASS.
+ */
+static bool nf_queue_flow_bypass(const struct sk_buff *skb,
+				 const struct nf_hook_state *state,
+				 unsigned int queuenum)
+{
+#if IS_ENABLED(CONFIG_NF_CONNTRACK) && IS_ENABLED(CONFIG_NETFILTER_NETLINK_QUEUE)
+	const struct nf_conn *ct = (void *)skb_nfct(skb);
+	const struct nf_conn_queue *cq;
+	u64 bypass;
+
+	if (!ct)
+		return false;
+
+	cq = nf_ct_queue_find(ct);
+	if (!cq)
+		return false;
+
+	bypass = READ_ONCE(cq->bypass);
+	return bypass && bypass == nf_queue_bypass_scope(state, queuenum);
+#else
+	return false;
+#endif
+}
+
 /* Packets leaving via this function must come back through nf_reinject(). */
 int nf_queue(struct sk_buff *skb, struct nf_hook_state *state,
 	     unsigned int index, unsigned int verdict)
 {
 	int ret;
 
+	if (nf_queue_flow_bypass(skb, state, verdict >> NF_VERDICT_QBITS))
+		return 1;
+
 	ret = __nf_queue(skb, state, index, verdict >> NF_VERDICT_QBITS);
 	if (ret < 0) {
 		if (ret == -ESRCH &&
@@ -9,6 +9,10 @@
 #include <net/tcp.h>
 #include <net/netns/generic.h>
 #include <linux/proc_fs.h>
+#include <linux/bpf.h>
+#include <linux/btf.h>
+#include <linux/btf_ids.h>
+#include <net/xdp.h>
 
 #include <linux/netfilter_ipv6.h>
 #include <linux/netfilter/nf_synproxy.h>
@@ -24,20 +28,10 @@
 unsigned int synproxy_net_id;
 EXPORT_SYMBOL_GPL(synproxy_net_id);
 
-bool
-synproxy_parse_options(const struct sk_buff *skb, unsigned int doff,
-		       const struct tcphdr *th, struct synproxy_options *opts)
+static void
+__synproxy_parse_options(const u8 *ptr, int length,
+			 struct synproxy_options *opts)
 {
-	int length = (th->doff * 4) - sizeof(*th);
-	u8 buf[40], *ptr;
-
-	if (unlikely(length < 0))
-		return false;
-
-	ptr = skb_header_pointer(skb, doff + sizeof(*th), length, buf);
-	if (ptr == NULL)
-		return false;
-
 	opts->options = 0;
 	while (length > 0) {
 		int opcode = *ptr++;
@@ -45,18 +39,18 @@ synproxy_parse_options(const struct sk_buff *skb, unsigned int doff,
 
 		switch (opcode) {
 		case TCPOPT_EOL:
-			return true;
+			return;
 		case TCPOPT_NOP:
 			length--;
 			continue;
 		default:
 			if (length < 2)
-				return true;
+				return;
 			opsize = *ptr++;
 			if (opsize < 2)
-				return true;
+				return;
 			if (opsize > length)
-				return true;
+				return;
 
 			switch (opcode) {
 			case TCPOPT_MSS:
@@ -90,6 +84,23 @@ synproxy_parse_options(const struct sk_buff *skb, unsigned int doff,
 			length -= opsize;
 		}
 	}
+}
+
+bool
+synproxy_parse_options(const struct sk_buff *skb, unsigned int doff,
+		       const struct tcphdr *th, struct synproxy_options *opts)
+{
+	int length = (th->doff * 4) - sizeof(*th);
+	u8 buf[40], *ptr;
+
+	if (unlikely(length < 0))
+		return false;
+
+	ptr = skb_header_pointer(skb, doff + sizeof(*th), length, buf);
+	if (ptr == NULL)
+		return false;
+
+	__synproxy_parse_options(ptr, length, opts);
 	return true;
 }
 EXPORT_SYMBOL_GPL(synproxy_parse_options);
@@ -112,9 +123,8 @@ synproxy_options_size(const struct synproxy_options *opts)
 }
 
 static void
-synproxy_build_options(struct tcphdr *th, const struct synproxy_options *opts)
+__synproxy_build_options(__be32 *ptr, const struct synproxy_options *opts)
 {
-	__be32 *ptr = (__be32 *)(th + 1);
 	u8 options = opts->options;
 
 	if (options & NF_SYNPROXY_OPT_MSS)
@@ -149,6 +159,12 @@ synproxy_build_options(struct tcphdr *th, const struct synproxy_options *opts)
 			       opts->wscale);
 }
 
+static void
+synproxy_build_options(struct tcphdr *th, const struct synproxy_options *opts)
+{
+	__synproxy_build_options((__be32 *)(th + 1), opts);
+}
+
 void synproxy_init_timestamp_cookie(const struct nf_synproxy_info *info,
 				    struct synproxy_options *opts)
 {
@@ -379,9 +395,132 @@ static struct pernet_operations synproxy_net_ops = {
 	.size		= sizeof(struct synproxy_net),
 };
 
+#if (IS_BUILTIN(CONFIG_NETFILTER_SYNPROXY) && IS_ENABLED(CONFIG_DEBUG_INFO_BTF)) || \
+    (IS_MODULE(CONFIG_NETFILTER_SYNPROXY) && IS_ENABLED(CONFIG_DEBUG_INFO_BTF_MODULES))
+/* bpf_synproxy_opts - SYN-ACK options built by bpf_xdp_synproxy_synack_opts
+ * @options: in, NF_SYNPROXY_OPT_* supported by the server; out, those of
+ *	     the SYN-ACK
+ * @wscale: in, window scale of the server
+ * @mss: in, MSS of the server
+ * @len: out, length of @data
+ * @data: out, TCP options of the SYN-ACK
+ */
+struct bpf_synproxy_opts {
+	u8	options;
+	u8	wscale;
+	u16	mss;
+	u8	len;
+	u8	reserved[3];
+	__be32	data[5];
+};
+
+enum {
+	NF_BPF_SYNPROXY_OPTS_SZ = 28,
+};
+
+__bpf_kfunc_start_defs();
+
+/* bpf_xdp_synproxy_synack_opts - TCP options of the SYN-ACK to a SYN
+ *
+ * Lets an XDP program answer SYNs at the driver with the SYN-ACK the
+ * SYNPROXY target would send: same options, same timestamp cookie.  The
+ * sequence number is the one of bpf_tcp_raw_gen_syncookie_ipv4/6(), which
+ * share the cookie secrets with SYNPROXY, and ECE is to be set if
+ * NF_SYNPROXY_OPT_ECN is in @opts->options on return.  The program checks
+ * the cookie of the final ACK with bpf_tcp_raw_check_syncookie_ipv4/6()
+ * and passes the valid ones to the stack, where SYNPROXY decodes the
+ * timestamp cookie and does the handshake with the server.
+ *
+ * Parameters:
+ * @ctx		- XDP context of the SYN
+ * @th		- TCP header of the SYN, with its options
+ * @th__sz	- Length of @th, th->doff * 4
+ * @opts	- Settings of the server in, SYN-ACK options out
+ * @opts__sz	- Length of @opts, must be NF_BPF_SYNPROXY_OPTS_SZ
+ *
+ * Returns 0, or -EINVAL if the arguments are bad or @th is not a SYN.
+ */
+__bpf_kfunc int bpf_xdp_synproxy_synack_opts(struct xdp_md *ctx,
+					     struct tcphdr *th, u32 th__sz,
+					     struct bpf_synproxy_opts *opts,
+					     u32 opts__sz)
+{
+	struct xdp_buff *xdp = (struct xdp_buff *)ctx;
+	struct synproxy_net *snet = synproxy_pernet(dev_net(xdp->rxq->dev));
+	struct synproxy_options sopts = {};
+	struct nf_synproxy_info info;
+
+	if (opts__sz != NF_BPF_SYNPROXY_OPTS_SZ ||
+	    th__sz < sizeof(*th) || th__sz != th->doff * 4)
+		return -EINVAL;
+
+	if (!th->syn || th->ack || th->fin || th->rst)
+		return -EINVAL;
+
+	__synproxy_parse_options((const u8 *)(th + 1), th__sz - sizeof(*th),
+				 &sopts);
+	this_cpu_inc(snet->stats->syn_received);
+
+	info.options = opts->options;
+	info.wscale = opts->wscale;
+	info.mss = opts->mss;
+
+	/* as for the initial SYN in synproxy_tg4() */
+	if (th->ece && th->cwr)
+		sopts.options |= NF_SYNPROXY_OPT_ECN;
+
+	sopts.options &= info.options;
+	sopts.mss_encode = sopts.mss_option;
+	sopts.mss_option = info.mss;
+	if (sopts.options & NF_SYNPROXY_OPT_TIMESTAMP)
+		synproxy_init_timestamp_cookie(&info, &sopts);
+	else
+		sopts.options &= ~(NF_SYNPROXY_OPT_WSCALE |
+				   NF_SYNPROXY_OPT_SACK_PERM |
+				   NF_SYNPROXY_OPT_ECN);
+
+	opts->options = sopts.options;
+	opts->len = synproxy_options_size(&sopts);
+	__synproxy_build_options(opts->data, &sopts);
+	return 0;
+}
+
+__bpf_kfunc_end_defs();
+
+BTF_KFUNCS_START(nf_synproxy_kfunc_set)
+BTF_ID_FLAGS(func, bpf_xdp_synproxy_synack_opts)
+BTF_KFUNCS_END(nf_synproxy_kfunc_set)
+
+static const struct btf_kfunc_id_set nf_synproxy_bpf_kfunc_set = {
+	.owner = THIS_MODULE,
+	.set   = &nf_synproxy_kfunc_set,
+};
+
+static int register_nf_synproxy_bpf(void)
+{
+	return register_btf_kfunc_id_set(BPF_PROG_TYPE_XDP,
+					 &nf_synproxy_bpf_kfunc_set);
+}
+#else
+static inline int register_nf_synproxy_bpf(void)
+{
+	return 0;
+}
+#endif
+
 static int __init synproxy_core_init(void)
 {
-	return register_pernet_subsys(&synproxy_net_ops);
+	int err;
+
+	err = register_pernet_subsys(&synproxy_net_ops);
+	if (err)
+		return err;
+
+	err = register_nf_synproxy_bpf();
+	if (err)
+		unregister_pernet_subsys(&synproxy_net_ops);
+
+	return err;
 }
 
 static void __exit synproxy_core_exit(void)
@@ -481,8 +620,14 @@ synproxy_send_client_synack(struct net *net,
 
 	synproxy_build_options(nth, opts);
 
-	synproxy_send_tcp(net, skb, nskb, skb_nfct(skb),
-			  IP_CT_ESTABLISHED_REPLY, niph, nth, tcp_hdr_size);
+	/* Never with the conntrack of the SYN: when it isn't NOTRACKed, the
+	 * entry would be confirmed on output and every SYN of a flood would
+	 * take a slot of the table.  The entry is only created once the
+	 * cookie of the ACK checks out, from snet->tmpl, see
+	 * synproxy_send_server_syn().
+	 */
+	nf_ct_set(nskb, NULL, IP_CT_UNTRACKED);
+	synproxy_send_tcp(net, skb, nskb, NULL, 0, niph, nth, tcp_hdr_size);
 }
 EXPORT_SYMBOL_GPL(synproxy_send_client_synack);
 
@@ -894,8 +1039,9 @@ synproxy_send_client_synack_ipv6(struct net *net,
 
 	synproxy_build_options(nth, opts);
 
-	synproxy_send_tcp_ipv6(net, skb, nskb, skb_nfct(skb),
-			       IP_CT_ESTABLISHED_REPLY, niph, nth,
+	/* see synproxy_send_client_synack() */
+	nf_ct_set(nskb, NULL, IP_CT_UNTRACKED);
+	synproxy_send_tcp_ipv6(net, skb, nskb, NULL, 0, niph, nth,
 			       tcp_hdr_size);
 }
 EXPORT_SYMBOL_GPL(synproxy_send_client_synack_ipv6);
@@ -11,11 +11,19 @@
 #include <linux/skbuff.h>
 #include <linux/netlink.h>
 #include <linux/vmalloc.h>
+#include <linux/sizes.h>
+#include <linux/file.h>
 #include <linux/rhashtable.h>
 #include <linux/audit.h>
+#include <linux/memcontrol.h>
+#include <linux/sched/mm.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <kunit/visibility.h>
 #include <linux/netfilter.h>
 #include <linux/netfilter/nfnetlink.h>
 #include <linux/netfilter/nf_tables.h>
+#include <linux/netfilter/nf_tables_bulk.h>
 #include <net/netfilter/nf_flow_table.h>
 #include <net/netfilter/nf_tables_core.h>
 #include <net/netfilter/nf_tables.h>
@@ -31,6 +39,9 @@
 
 unsigned int nf_tables_net_id __read_mostly;
 
+/* one per rule added or removed, kmalloc would round them up */
+static struct kmem_cache *nft_trans_rule_cachep __read_mostly;
+
 static LIST_HEAD(nf_tables_expressions);
 static LIST_HEAD(nf_tables_objects);
 static LIST_HEAD(nf_tables_flowtables);
@@ -140,6 +151,8 @@ static void nft_ctx_init(struct nft_ctx *ctx,
 	ctx->net	= net;
 	ctx->family	= family;
 	ctx->level	= 0;
+	ctx->jumps	= 0;
+	ctx->vseq	= 0;
 	ctx->table	= table;
 	ctx->chain	= chain;
 	ctx->nla   	= nla;
@@ -151,15 +164,9 @@ static void nft_ctx_init(struct nft_ctx *ctx,
 	bitmap_zero(ctx->reg_inited, NFT_REG32_NUM);
 }
 
-static struct nft_trans *nft_trans_alloc_gfp(const struct nft_ctx *ctx,
-					     int msg_type, u32 size, gfp_t gfp)
+static void nft_trans_init(struct nft_trans *trans, const struct nft_ctx *ctx,
+			   int msg_type)
 {
-	struct nft_trans *trans;
-
-	trans = kzalloc(size, gfp);
-	if (trans == NULL)
-		return NULL;
-
 	INIT_LIST_HEAD(&trans->list);
 	trans->msg_type = msg_type;
 
@@ -168,6 +175,18 @@ static struct nft_trans *nft_trans_alloc_gfp(const struct nft_ctx *ctx,
 	trans->seq = ctx->seq;
 	trans->flags = ctx->flags;
 	trans->report = ctx->report;
+}
+
+static struct nft_trans *nft_trans_alloc_gfp(const struct nft_ctx *ctx,
+					     int msg_type, u32 size, gfp_t gfp)
+{
+	struct nft_trans *trans;
+
+	trans = kzalloc(size, gfp);
+	if (trans == NULL)
+		return NULL;
+
+	nft_trans_init(trans, ctx, msg_type);
 
 	return trans;
 }
@@ -427,6 +446,38 @@ static void nf_tables_unregister_hook(struct net *net,
 	return __nf_tables_unregister_hook(net, table, chain, false);
 }
 
+static bool nft_chain_hook_batched(const struct nft_table *table,
+				   const struct nft_chain *chain)
+{
+	const struct nft_base_chain *basechain;
+
+	if (!nft_is_base_chain(chain))
+		return false;
+
+	basechain = nft_base_chain(chain);
+
+	return !basechain->type->ops_unregister &&
+	       !nft_base_chain_netdev(table->family, basechain->ops.hooknum);
+}
+
+/* Unregister the hook of a chain deleted by the commit, the hook blob is
+ * compacted once for all of them by nf_tables_commit_shrink_hooks().
+ */
+static void nf_tables_commit_unregister_hook(struct net *net,
+					     const struct nft_table *table,
+					     struct nft_chain *chain)
+{
+	if (table->flags & NFT_TABLE_F_DORMANT)
+		return;
+
+	if (!nft_chain_hook_batched(table, chain)) {
+		nf_tables_unregister_hook(net, table, chain);
+		return;
+	}
+
+	nf_unregister_net_hook_noshrink(net, &nft_base_chain(chain)->ops);
+}
+
 static bool nft_trans_collapse_set_elem_allowed(const struct nft_trans_elem *a, const struct nft_trans_elem *b)
 {
 	/* NB: the ->bound equality check is defensive, at this time we only merge
@@ -678,10 +729,13 @@ static struct nft_trans *nft_trans_rule_add(struct nft_ctx *ctx, int msg_type,
 {
 	struct nft_trans *trans;
 
-	trans = nft_trans_alloc(ctx, msg_type, sizeof(struct nft_trans_rule));
+	/* freed with kfree() like any other transaction */
+	trans = kmem_cache_zalloc(nft_trans_rule_cachep, GFP_KERNEL);
 	if (trans == NULL)
 		return NULL;
 
+	nft_trans_init(trans, ctx, msg_type);
+
 	if (msg_type == NFT_MSG_NEWRULE && ctx->nla[NFTA_RULE_ID] != NULL) {
 		nft_trans_rule_id(trans) =
 			ntohl(nla_get_be32(ctx->nla[NFTA_RULE_ID]));
@@ -3618,6 +3672,90 @@ static const struct nla_policy nft_rule_policy[NFTA_RULE_MAX + 1] = {
 	[NFTA_RULE_CHAIN_ID]	= { .type = NLA_U32 },
 };
 
+/* The expressions of a rule don't change once it is in place, only the
+ * names of chains it jumps to do: renames bump nft_net->rule_dump_gen.
+ * Rules with stateful expressions or in offloaded chains are never cached.
+ */
+struct nft_rule_dump {
+	struct rcu_head		rcu;
+	unsigned int		gen;
+	u32			len;
+	/* 64 bit attribute padding depends on the alignment */
+	u8			align;
+	u8			data[];
+};
+
+/* see nla_need_padding_for_64bit() */
+static u8 nft_rule_dump_align(const u8 *p)
+{
+	if (IS_ENABLED(CONFIG_HAVE_EFFICIENT_UNALIGNED_ACCESS))
+		return 0;
+
+	return (unsigned long)p & 7;
+}
+
+static bool nft_rule_dump_cacheable(const struct nft_chain *chain,
+				    const struct nft_rule *rule)
+{
+	const struct nft_expr *expr, *next;
+
+	if (chain->flags & NFT_CHAIN_HW_OFFLOAD)
+		return false;
+
+	nft_rule_for_each_expr(expr, next, rule) {
+		if (expr->ops->type->flags & NFT_EXPR_STATEFUL)
+			return false;
+	}
+
+	return true;
+}
+
+/* Returns 1 if the cached form was appended, 0 if there is none. */
+static int nft_rule_dump_put(struct sk_buff *skb, const struct net *net,
+			     const struct nft_rule *rule)
+{
+	const struct nft_rule_dump *dump;
+
+	dump = rcu_dereference_check(rule->dump,
+				     lockdep_commit_lock_is_held(net));
+	if (!dump ||
+	    dump->gen != READ_ONCE(nft_pernet(net)->rule_dump_gen) ||
+	    dump->align != nft_rule_dump_align(skb_tail_pointer(skb)))
+		return 0;
+
+	if (skb_tailroom(skb) < dump->len)
+		return -EMSGSIZE;
+
+	skb_put_data(skb, dump->data, dump->len);
+	return 1;
+}
+
+static void nft_rule_dump_store(const struct net *net,
+				const struct nft_chain *chain,
+				const struct nft_rule *rule,
+				const u8 *start, u32 len)
+{
+	struct nft_rule *r = (struct nft_rule *)rule;
+	struct nft_rule_dump *dump, *old;
+
+	if (!nft_rule_dump_cacheable(chain, rule))
+		return;
+
+	dump = kmalloc(struct_size(dump, data, len), GFP_ATOMIC | __GFP_NOWARN);
+	if (!dump)
+		return;
+
+	dump->gen = READ_ONCE(nft_pernet(net)->rule_dump_gen);
+	dump->len = len;
+	dump->align = nft_rule_dump_align(start);
+	memcpy(dump->data, start, len);
+
+	/* concurrent dumps may race, the last one wins */
+	old = unrcu_pointer(xchg(&r->dump, RCU_INITIALIZER(dump)));
+	if (old)
+		kfree_rcu(old, rcu);
+}
+
 static int nf_tables_fill_rule_info(struct sk_buff *skb, struct net *net,
 				    u32 portid, u32 seq, int event,
 				    u32 flags, int family,
@@ -3630,6 +3768,8 @@ static int nf_tables_fill_rule_info(struct sk_buff *skb, struct net *net,
 	const struct nft_expr *expr, *next;
 	struct nlattr *list;
 	u16 type = nfnl_msg_type(NFNL_SUBSYS_NFTABLES, event);
+	const u8 *start;
+	int cached;
 
 	nlh = nfnl_msg_put(skb, portid, seq, type, flags, family, NFNETLINK_V0,
 			   nft_base_seq(net));
@@ -3653,6 +3793,15 @@ static int nf_tables_fill_rule_info(struct sk_buff *skb, struct net *net,
 	if (chain->flags & NFT_CHAIN_HW_OFFLOAD)
 		nft_flow_rule_stats(chain, rule);
 
+	if (!reset) {
+		cached = nft_rule_dump_put(skb, net, rule);
+		if (cached < 0)
+			goto nla_put_failure;
+		if (cached)
+			goto out;
+	}
+
+	start = skb_tail_pointer(skb);
 	list = nla_nest_start_noflag(skb, NFTA_RULE_EXPRESSIONS);
 	if (list == NULL)
 		goto nla_put_failure;
@@ -3669,6 +3818,10 @@ static int nf_tables_fill_rule_info(struct sk_buff *skb, struct net *net,
 			goto nla_put_failure;
 	}
 
+	if (!reset)
+		nft_rule_dump_store(net, chain, rule, start,
+				    skb_tail_pointer(skb) - start);
+out:
 	nlmsg_end(skb, nlh);
 	return 0;
 
@@ -4033,6 +4186,8 @@ void nf_tables_rule_destroy(const struct nft_ctx *ctx, struct nft_rule *rule)
 		nf_tables_expr_destroy(ctx, expr);
 		expr = next;
 	}
+	free_percpu(rule->profile);
+	kfree(rcu_dereference_raw(rule->dump));
 	kfree(rule);
 }
 
@@ -4045,6 +4200,19 @@ static void nf_tables_rule_release(const struct nft_ctx *ctx, struct nft_rule *r
 	nf_tables_rule_destroy(ctx, rule);
 }
 
+static const struct nft_rule *nft_chain_last_rule(const struct net *net,
+						  const struct nft_chain *chain)
+{
+	const struct nft_rule *rule;
+
+	list_for_each_entry_reverse(rule, &chain->rules, list) {
+		if (nft_is_active_next(net, rule))
+			return rule;
+	}
+
+	return NULL;
+}
+
 /** nft_chain_validate - loop detection and hook validation
  *
  * @ctx: context containing call depth and base chain
@@ -4053,16 +4221,35 @@ static void nf_tables_rule_release(const struct nft_ctx *ctx, struct nft_rule *r
  * Walk through the rules of the given chain and chase all jumps/gotos
  * and set lookups until either the jump limit is hit or all reachable
  * chains have been validated.
+ *
+ * ctx->level counts all chains on the path and bounds it to
+ * nf_tables_chain_depth, ctx->jumps only those that take a jump stack
+ * slot in nft_do_chain(): gotos and jumps from the last rule of a chain,
+ * turned into gotos when the rule blob is built, don't.
+ *
+ * Within a validation pass (ctx->vseq), a chain reached again at no
+ * larger level and jump count than already validated is skipped: with
+ * the same base chain, its result can only be the same.
  */
 int nft_chain_validate(const struct nft_ctx *ctx, const struct nft_chain *chain)
 {
+	struct nft_ctx *pctx = (struct nft_ctx *)ctx;
+	struct nft_chain *vchain = (struct nft_chain *)chain;
+	const struct nft_rule *tail;
 	struct nft_expr *expr, *last;
 	struct nft_rule *rule;
 	int err;
 
-	if (ctx->level == NFT_JUMP_STACK_SIZE)
+	if (ctx->level >= READ_ONCE(nft_chain_depth) ||
+	    ctx->jumps == NFT_JUMP_STACK_SIZE)
 		return -EMLINK;
 
+	if (ctx->vseq && chain->vseq == ctx->vseq &&
+	    ctx->level <= chain->vlevel && ctx->jumps <= chain->vjumps)
+		return 0;
+
+	tail = nft_chain_last_rule(ctx->net, chain);
+
 	list_for_each_entry(rule, &chain->rules, list) {
 		if (fatal_signal_pending(current))
 			return -EINTR;
@@ -4075,18 +4262,44 @@ int nft_chain_validate(const struct nft_ctx *ctx, const struct nft_chain *chain)
 				continue;
 
 			/* This may call nft_chain_validate() recursively,
-			 * callers that do so must increment ctx->level.
+			 * callers that do so must increment ctx->level, and
+			 * ctx->jumps unless ctx->tail is set or for gotos.
 			 */
+			pctx->tail = rule == tail;
 			err = expr->ops->validate(ctx, expr);
 			if (err < 0)
 				return err;
 		}
 	}
 
+	/* level and jumps limits are checked separately on each path, a
+	 * chain that passed with both maximums seen passes with any pair.
+	 */
+	if (ctx->vseq) {
+		if (chain->vseq != ctx->vseq) {
+			vchain->vseq = ctx->vseq;
+			vchain->vlevel = ctx->level;
+			vchain->vjumps = ctx->jumps;
+		} else {
+			vchain->vlevel = max(chain->vlevel, ctx->level);
+			vchain->vjumps = max(chain->vjumps, ctx->jumps);
+		}
+	}
+
 	return 0;
 }
 EXPORT_SYMBOL_GPL(nft_chain_validate);
 
+static u32 nft_validate_seq_next(struct net *net)
+{
+	struct nftables_pernet *nft_net = nft_pernet(net);
+
+	while (++nft_net->validate_seq == 0)
+		;
+
+	return nft_net->validate_seq;
+}
+
 static int nft_table_validate(struct net *net, const struct nft_table *table)
 {
 	struct nft_chain *chain;
@@ -4100,6 +4313,8 @@ static int nft_table_validate(struct net *net, const struct nft_table *table)
 		if (!nft_is_base_chain(chain))
 			continue;
 
+		/* one pass per base chain, hooks differ between them */
+		ctx.vseq = nft_validate_seq_next(net);
 		ctx.chain = chain;
 		err = nft_chain_validate(&ctx, chain);
 		if (err < 0)
@@ -4130,6 +4345,14 @@ int nft_setelem_validate(const struct nft_ctx *ctx, struct nft_set *set,
 	data = nft_set_ext_data(ext);
 	switch (data->verdict.code) {
 	case NFT_JUMP:
+		pctx->level++;
+		pctx->jumps++;
+		err = nft_chain_validate(ctx, data->verdict.chain);
+		if (err < 0)
+			return err;
+		pctx->jumps--;
+		pctx->level--;
+		break;
 	case NFT_GOTO:
 		pctx->level++;
 		err = nft_chain_validate(ctx, data->verdict.chain);
@@ -4194,6 +4417,7 @@ static int nf_tables_newrule(struct sk_buff *skb, const struct nfnl_info *info,
 	struct nft_expr *expr;
 	struct nft_ctx ctx;
 	struct nlattr *tmp;
+	bool validate = false;
 	int err, rem;
 
 	lockdep_assert_held(&nft_net->commit_mutex);
@@ -4327,8 +4551,10 @@ static int nf_tables_newrule(struct sk_buff *skb, const struct nfnl_info *info,
 			goto err_release_rule;
 		}
 
-		if (expr_info[i].ops->validate)
+		if (expr_info[i].ops->validate) {
 			nft_validate_state_update(table, NFT_VALIDATE_NEED);
+			validate = true;
+		}
 
 		expr_info[i].ops = NULL;
 		expr = nft_expr_next(expr);
@@ -4384,10 +4610,20 @@ static int nf_tables_newrule(struct sk_buff *skb, const struct nfnl_info *info,
 	}
 	kvfree(expr_info);
 
+	/* the rule before might have held a tail call */
+	if (list_is_last(&rule->list, &chain->rules) &&
+	    !list_is_first(&rule->list, &chain->rules)) {
+		nft_validate_state_update(table, NFT_VALIDATE_NEED);
+		validate = true;
+	}
+
 	if (flow)
 		nft_trans_flow_rule(trans) = flow;
 
-	if (table->validate_state == NFT_VALIDATE_DO)
+	/* The batch is replayed to find the culprit, a rule without
+	 * anything to validate can't be it.
+	 */
+	if (validate && table->validate_state == NFT_VALIDATE_DO)
 		return nft_table_validate(net, table);
 
 	return 0;
@@ -4510,23 +4746,30 @@ static int nf_tables_delrule(struct sk_buff *skb, const struct nfnl_info *info,
 /*
  * Sets
  */
-static const struct nft_set_type *nft_set_types[] = {
+VISIBLE_IF_KUNIT const struct nft_set_type *nft_set_types[] = {
+	&nft_set_ohash_type,
 	&nft_set_hash_fast_type,
 	&nft_set_hash_type,
 	&nft_set_rhash_type,
 	&nft_set_bitmap_type,
+	&nft_set_bitmap_tree_type,
 	&nft_set_rbtree_type,
 #if defined(CONFIG_X86_64) && !defined(CONFIG_UML)
 	&nft_set_pipapo_avx2_type,
+#endif
+#if defined(CONFIG_ARM64) && defined(CONFIG_KERNEL_MODE_NEON)
+	&nft_set_pipapo_neon_type,
 #endif
 	&nft_set_pipapo_type,
 };
+VISIBLE_IF_KUNIT const unsigned int nft_set_types_num = ARRAY_SIZE(nft_set_types);
 
 #define NFT_SET_FEATURES	(NFT_SET_INTERVAL | NFT_SET_MAP | \
 				 NFT_SET_TIMEOUT | NFT_SET_OBJECT | \
 				 NFT_SET_EVAL)
 
-static bool nft_set_ops_candidate(const struct nft_set_type *type, u32 flags)
+VISIBLE_IF_KUNIT bool nft_set_ops_candidate(const struct nft_set_type *type,
+				       u32 flags)
 {
 	return (flags & type->features) == (flags & NFT_SET_FEATURES);
 }
@@ -4536,25 +4779,20 @@ static bool nft_set_ops_candidate(const struct nft_set_type *type, u32 flags)
  * given policy. The total memory use might not be known if no size is
  * given, in that case the amount of memory per element is used.
  */
-static const struct nft_set_ops *
-nft_select_set_ops(const struct nft_ctx *ctx, u32 flags,
-		   const struct nft_set_desc *desc)
+VISIBLE_IF_KUNIT const struct nft_set_ops *
+__nft_select_set_ops(u32 flags, const struct nft_set_desc *desc)
 {
-	struct nftables_pernet *nft_net = nft_pernet(ctx->net);
 	const struct nft_set_ops *ops, *bops;
 	struct nft_set_estimate est, best;
 	const struct nft_set_type *type;
 	int i;
 
-	lockdep_assert_held(&nft_net->commit_mutex);
-	lockdep_nfnl_nft_mutex_not_held();
-
 	bops	    = NULL;
 	best.size   = ~0;
 	best.lookup = ~0;
 	best.space  = ~0;
 
-	for (i = 0; i < ARRAY_SIZE(nft_set_types); i++) {
+	for (i = 0; i < nft_set_types_num; i++) {
 		type = nft_set_types[i];
 		ops = &type->ops;
 
@@ -4596,6 +4834,18 @@ nft_select_set_ops(const struct nft_ctx *ctx, u32 flags,
 	return ERR_PTR(-EOPNOTSUPP);
 }
 
+static const struct nft_set_ops *
+nft_select_set_ops(const struct nft_ctx *ctx, u32 flags,
+		   const struct nft_set_desc *desc)
+{
+	struct nftables_pernet *nft_net = nft_pernet(ctx->net);
+
+	lockdep_assert_held(&nft_net->commit_mutex);
+	lockdep_nfnl_nft_mutex_not_held();
+
+	return __nft_select_set_ops(flags, desc);
+}
+
 static const struct nla_policy nft_set_policy[NFTA_SET_MAX + 1] = {
 	[NFTA_SET_TABLE]		= { .type = NLA_STRING,
 					    .len = NFT_TABLE_MAXNAMELEN - 1 },
@@ -4805,6 +5055,21 @@ static int nf_tables_fill_set_concat(struct sk_buff *skb,
 	return 0;
 }
 
+/* Element count without the room reserved per cpu by nft_dynset */
+static u32 nft_set_nelems(const struct nft_set *set)
+{
+	int nelems = atomic_read(&set->nelems);
+	int cpu;
+
+	if (!set->nelems_credit)
+		return nelems;
+
+	for_each_possible_cpu(cpu)
+		nelems -= READ_ONCE(*per_cpu_ptr(set->nelems_credit, cpu));
+
+	return max(nelems, 0);
+}
+
 static u32 nft_set_userspace_size(const struct nft_set_ops *ops, u32 size)
 {
 	if (ops->usize)
@@ -4830,7 +5095,7 @@ nf_tables_fill_set_info(struct sk_buff *skb, const struct nft_set *set)
 	if (nla_put_string(skb, NFTA_SET_TYPE, str))
 		return -EMSGSIZE;
 
-	nelems = nft_set_userspace_size(set->ops, atomic_read(&set->nelems));
+	nelems = nft_set_userspace_size(set->ops, nft_set_nelems(set));
 	return nla_put_be32(skb, NFTA_SET_COUNT, htonl(nelems));
 }
 
@@ -5276,8 +5541,8 @@ static bool nft_set_is_same(const struct nft_set *set,
 	return true;
 }
 
-static u32 nft_set_kernel_size(const struct nft_set_ops *ops,
-			       const struct nft_set_desc *desc)
+VISIBLE_IF_KUNIT u32 nft_set_kernel_size(const struct nft_set_ops *ops,
+					 const struct nft_set_desc *desc)
 {
 	if (ops->ksize)
 		return ops->ksize(desc->size);
@@ -5610,8 +5875,20 @@ static void nft_set_put(struct nft_set *set)
 	}
 }
 
+static void nft_set_prefilter_free(struct nft_set_prefilter *pf)
+{
+	kvfree(pf->bits);
+	kfree(pf);
+}
+
+static void nft_set_prefilter_free_rcu(struct rcu_head *rcu)
+{
+	nft_set_prefilter_free(container_of(rcu, struct nft_set_prefilter, rcu));
+}
+
 static void nft_set_destroy(const struct nft_ctx *ctx, struct nft_set *set)
 {
+	struct nft_set_prefilter *pf;
 	int i;
 
 	if (WARN_ON(set->use > 0))
@@ -5622,6 +5899,13 @@ static void nft_set_destroy(const struct nft_ctx *ctx, struct nft_set *set)
 
 	set->ops->destroy(ctx, set);
 	nft_set_catchall_destroy(ctx, set);
+
+	pf = rcu_dereference_protected(set->prefilter, true);
+	if (pf)
+		nft_set_prefilter_free(pf);
+	free_percpu(set->prefilter_stats);
+	free_percpu(set->nelems_credit);
+
 	nft_set_put(set);
 }
 
@@ -5753,6 +6037,7 @@ int nf_tables_bind_set(const struct nft_ctx *ctx, struct nft_set *set,
 		iter.type	= NFT_ITER_UPDATE;
 		iter.skip 	= 0;
 		iter.count	= 0;
+		iter.pos	= 0;
 		iter.err	= 0;
 		iter.fn		= nf_tables_bind_check_setelem;
 
@@ -5952,13 +6237,16 @@ static const struct nla_policy nft_set_elem_policy[NFTA_SET_ELEM_MAX + 1] = {
 	[NFTA_SET_ELEM_EXPRESSIONS]	= NLA_POLICY_NESTED_ARRAY(nft_expr_policy),
 };
 
-static const struct nla_policy nft_set_elem_list_policy[NFTA_SET_ELEM_LIST_MAX + 1] = {
+#define NFT_SET_ELEM_LIST_ATTR_MAX	NFTA_SET_ELEM_LIST_FD
+
+static const struct nla_policy nft_set_elem_list_policy[NFT_SET_ELEM_LIST_ATTR_MAX + 1] = {
 	[NFTA_SET_ELEM_LIST_TABLE]	= { .type = NLA_STRING,
 					    .len = NFT_TABLE_MAXNAMELEN - 1 },
 	[NFTA_SET_ELEM_LIST_SET]	= { .type = NLA_STRING,
 					    .len = NFT_SET_MAXNAMELEN - 1 },
 	[NFTA_SET_ELEM_LIST_ELEMENTS]	= NLA_POLICY_NESTED_ARRAY(nft_set_elem_policy),
 	[NFTA_SET_ELEM_LIST_SET_ID]	= { .type = NLA_U32 },
+	[NFTA_SET_ELEM_LIST_FD]		= { .type = NLA_U32 },
 };
 
 static int nft_set_elem_expr_dump(struct sk_buff *skb,
@@ -6163,12 +6451,15 @@ static int nf_tables_dump_set(struct sk_buff *skb, struct netlink_callback *cb)
 	bool set_found = false;
 	struct nlmsghdr *nlh;
 	struct nlattr *nest;
+	unsigned int gc_seq;
 	u32 portid, seq;
+	unsigned long pos;
 	int event;
 
 	rcu_read_lock();
 	nft_net = nft_pernet(net);
 	cb->seq = READ_ONCE(nft_net->base_seq);
+	gc_seq = READ_ONCE(nft_net->gc_seq);
 
 	list_for_each_entry_rcu(table, &nft_net->tables, list) {
 		if (dump_ctx->ctx.family != NFPROTO_UNSPEC &&
@@ -6217,9 +6508,23 @@ static int nf_tables_dump_set(struct sk_buff *skb, struct netlink_callback *cb)
 	args.iter.type		= NFT_ITER_READ;
 	args.iter.skip		= cb->args[0];
 	args.iter.count		= 0;
+	/* Elements are only unlinked while gc_seq is odd. If it stayed even
+	 * and unchanged since the previous part walked, the walk can resume
+	 * where it stopped instead of skipping over the elements already
+	 * dumped: base_seq is bumped before the unlinking starts.
+	 */
+	args.iter.pos		= !(gc_seq & 1) && cb->args[3] == gc_seq ?
+				  cb->args[1] : 0;
+	args.iter.pos_gen	= cb->args[2];
 	args.iter.err		= 0;
 	args.iter.fn		= nf_tables_dump_setelem;
 	set->ops->walk(&dump_ctx->ctx, set, &args.iter);
+	pos = args.iter.err ? args.iter.pos : 0;
+
+	/* a commit started during the walk, @pos may be unlinked already */
+	smp_rmb();
+	if ((gc_seq & 1) || READ_ONCE(nft_net->gc_seq) != gc_seq)
+		pos = 0;
 
 	if (!args.iter.err && args.iter.count == cb->args[0])
 		args.iter.err = nft_set_catchall_dump(net, skb, set,
@@ -6235,6 +6540,9 @@ static int nf_tables_dump_set(struct sk_buff *skb, struct netlink_callback *cb)
 		return 0;
 
 	cb->args[0] = args.iter.count;
+	cb->args[1] = pos;
+	cb->args[2] = args.iter.pos_gen;
+	cb->args[3] = gc_seq;
 	return skb->len;
 
 nla_put_failure:
@@ -6958,6 +7266,38 @@ static int nft_setelem_catchall_insert(const struct net *net,
 	return 0;
 }
 
+static bool nft_set_prefilter_eligible(const struct nft_set *set)
+{
+	/* packet path insertions would race with rebuilds */
+	return READ_ONCE(nft_set_prefilter_min) &&
+	       !(set->flags & (NFT_SET_INTERVAL | NFT_SET_EVAL));
+}
+
+static void nft_set_prefilter_add(struct nft_set_prefilter *pf,
+				  const struct nft_set *set, const u32 *key)
+{
+	u32 hash = nft_set_prefilter_hash(pf, set, key);
+	int i;
+
+	for (i = 0; i < NFT_SET_PREFILTER_K; i++)
+		set_bit(nft_set_prefilter_bit(pf, hash, i), pf->bits);
+
+	pf->nkeys++;
+}
+
+/* Before the element can be found: it's active in the next generation */
+static void nft_set_prefilter_insert(const struct net *net,
+				     const struct nft_set *set,
+				     const struct nft_set_elem *elem)
+{
+	struct nft_set_prefilter *pf;
+
+	pf = rcu_dereference_protected(set->prefilter,
+				       lockdep_commit_lock_is_held(net));
+	if (pf)
+		nft_set_prefilter_add(pf, set, elem->key.val.data);
+}
+
 static int nft_setelem_insert(const struct net *net,
 			      struct nft_set *set,
 			      const struct nft_set_elem *elem,
@@ -6966,10 +7306,12 @@ static int nft_setelem_insert(const struct net *net,
 {
 	int ret;
 
-	if (flags & NFT_SET_ELEM_CATCHALL)
+	if (flags & NFT_SET_ELEM_CATCHALL) {
 		ret = nft_setelem_catchall_insert(net, set, elem, elem_priv);
-	else
+	} else {
+		nft_set_prefilter_insert(net, set, elem);
 		ret = set->ops->insert(net, set, elem, elem_priv);
+	}
 
 	return ret;
 }
@@ -7172,112 +7514,225 @@ static u32 nft_set_maxsize(const struct nft_set *set)
 	return maxsize;
 }
 
-static int nft_add_set_elem(struct nft_ctx *ctx, struct nft_set *set,
-			    const struct nlattr *attr, u32 nlmsg_flags)
+static int nft_setelem_parse_timeout(const struct nft_set *set,
+				     struct nlattr **nla, u32 flags,
+				     u64 *timeout, u64 *expiration)
 {
-	struct nft_expr *expr_array[NFT_SET_EXPR_MAX] = {};
-	struct nlattr *nla[NFTA_SET_ELEM_MAX + 1];
-	u8 genmask = nft_genmask_next(ctx->net);
-	u32 flags = 0, size = 0, num_exprs = 0;
-	struct nft_set_ext_tmpl tmpl;
-	struct nft_set_ext *ext, *ext2;
-	struct nft_set_elem elem;
-	struct nft_set_binding *binding;
-	struct nft_elem_priv *elem_priv;
-	struct nft_object *obj = NULL;
-	struct nft_userdata *udata;
-	struct nft_data_desc desc;
-	enum nft_registers dreg;
-	struct nft_trans *trans;
-	u64 expiration;
-	u64 timeout;
-	int err, i;
-	u8 ulen;
-
-	err = nla_parse_nested_deprecated(nla, NFTA_SET_ELEM_MAX, attr,
-					  nft_set_elem_policy, NULL);
-	if (err < 0)
-		return err;
-
-	nft_set_ext_prepare(&tmpl);
-
-	err = nft_setelem_parse_flags(set, nla[NFTA_SET_ELEM_FLAGS], &flags);
-	if (err < 0)
-		return err;
-
-	if (((flags & NFT_SET_ELEM_CATCHALL) && nla[NFTA_SET_ELEM_KEY]) ||
-	    (!(flags & NFT_SET_ELEM_CATCHALL) && !nla[NFTA_SET_ELEM_KEY]))
-		return -EINVAL;
-
-	if (flags != 0) {
-		err = nft_set_ext_add(&tmpl, NFT_SET_EXT_FLAGS);
-		if (err < 0)
-			return err;
-	}
-
-	if (set->flags & NFT_SET_MAP) {
-		if (nla[NFTA_SET_ELEM_DATA] == NULL &&
-		    !(flags & NFT_SET_ELEM_INTERVAL_END))
-			return -EINVAL;
-	} else {
-		if (nla[NFTA_SET_ELEM_DATA] != NULL)
-			return -EINVAL;
-	}
-
-	if (set->flags & NFT_SET_OBJECT) {
-		if (!nla[NFTA_SET_ELEM_OBJREF] &&
-		    !(flags & NFT_SET_ELEM_INTERVAL_END))
-			return -EINVAL;
-	} else {
-		if (nla[NFTA_SET_ELEM_OBJREF])
-			return -EINVAL;
-	}
-
-	if (!nft_setelem_valid_key_end(set, nla, flags))
-		return -EINVAL;
-
-	if ((flags & NFT_SET_ELEM_INTERVAL_END) &&
-	     (nla[NFTA_SET_ELEM_DATA] ||
-	      nla[NFTA_SET_ELEM_OBJREF] ||
-	      nla[NFTA_SET_ELEM_TIMEOUT] ||
-	      nla[NFTA_SET_ELEM_EXPIRATION] ||
-	      nla[NFTA_SET_ELEM_USERDATA] ||
-	      nla[NFTA_SET_ELEM_EXPR] ||
-	      nla[NFTA_SET_ELEM_KEY_END] ||
-	      nla[NFTA_SET_ELEM_EXPRESSIONS]))
-		return -EINVAL;
+	int err;
 
-	timeout = 0;
+	*timeout = 0;
 	if (nla[NFTA_SET_ELEM_TIMEOUT] != NULL) {
 		if (!(set->flags & NFT_SET_TIMEOUT))
 			return -EINVAL;
 		err = nf_msecs_to_jiffies64(nla[NFTA_SET_ELEM_TIMEOUT],
-					    &timeout);
+					    timeout);
 		if (err)
 			return err;
 	} else if (set->flags & NFT_SET_TIMEOUT &&
 		   !(flags & NFT_SET_ELEM_INTERVAL_END)) {
-		timeout = set->timeout;
+		*timeout = set->timeout;
 	}
 
-	expiration = 0;
+	*expiration = 0;
 	if (nla[NFTA_SET_ELEM_EXPIRATION] != NULL) {
 		if (!(set->flags & NFT_SET_TIMEOUT))
 			return -EINVAL;
-		if (timeout == 0)
+		if (*timeout == 0)
 			return -EOPNOTSUPP;
 
 		err = nf_msecs_to_jiffies64(nla[NFTA_SET_ELEM_EXPIRATION],
-					    &expiration);
+					    expiration);
 		if (err)
 			return err;
 
-		if (expiration > timeout)
+		if (*expiration > *timeout)
 			return -ERANGE;
 	}
 
-	if (nla[NFTA_SET_ELEM_EXPR]) {
-		struct nft_expr *expr;
+	return 0;
+}
+
+/* Second half of nft_add_set_elem(): insert the element allocated from
+ * the netlink attributes and queue its transaction.
+ *
+ * Returns 1 if the element is not needed, because an identical one
+ * exists already, which may have been updated, and 0 if it was inserted.
+ */
+static int nft_add_set_elem_insert(struct nft_ctx *ctx, struct nft_set *set,
+				   const struct nft_set_elem *elem, u32 flags,
+				   u64 timeout, u64 expiration, u32 nlmsg_flags)
+{
+	struct nft_set_ext *ext = nft_set_elem_ext(set, elem->priv);
+	struct nft_elem_priv *elem_priv;
+	struct nft_set_ext *ext2;
+	struct nft_trans *trans;
+	int err;
+
+	trans = nft_trans_elem_alloc(ctx, NFT_MSG_NEWSETELEM, set);
+	if (trans == NULL)
+		return -ENOMEM;
+
+	ext->genmask = nft_genmask_cur(ctx->net);
+
+	err = nft_setelem_insert(ctx->net, set, elem, &elem_priv, flags);
+	if (err) {
+		if (err == -EEXIST) {
+			ext2 = nft_set_elem_ext(set, elem_priv);
+			if (nft_set_ext_exists(ext, NFT_SET_EXT_DATA) ^
+			    nft_set_ext_exists(ext2, NFT_SET_EXT_DATA) ||
+			    nft_set_ext_exists(ext, NFT_SET_EXT_OBJREF) ^
+			    nft_set_ext_exists(ext2, NFT_SET_EXT_OBJREF))
+				goto err_element_clash;
+			if ((nft_set_ext_exists(ext, NFT_SET_EXT_DATA) &&
+			     nft_set_ext_exists(ext2, NFT_SET_EXT_DATA) &&
+			     memcmp(nft_set_ext_data(ext),
+				    nft_set_ext_data(ext2), set->dlen) != 0) ||
+			    (nft_set_ext_exists(ext, NFT_SET_EXT_OBJREF) &&
+			     nft_set_ext_exists(ext2, NFT_SET_EXT_OBJREF) &&
+			     *nft_set_ext_obj(ext) != *nft_set_ext_obj(ext2)))
+				goto err_element_clash;
+			else if (!(nlmsg_flags & NLM_F_EXCL)) {
+				err = 0;
+				if (nft_set_ext_exists(ext2, NFT_SET_EXT_TIMEOUT)) {
+					struct nft_elem_update update = { };
+
+					if (timeout != nft_set_ext_timeout(ext2)->timeout) {
+						update.timeout = timeout;
+						if (expiration == 0)
+							expiration = timeout;
+
+						update.flags |= NFT_TRANS_UPD_TIMEOUT;
+					}
+					if (expiration) {
+						update.expiration = expiration;
+						update.flags |= NFT_TRANS_UPD_EXPIRATION;
+					}
+
+					if (update.flags) {
+						struct nft_trans_one_elem *ue;
+
+						ue = &nft_trans_container_elem(trans)->elems[0];
+
+						ue->update = kmemdup(&update, sizeof(update), GFP_KERNEL);
+						if (!ue->update) {
+							err = -ENOMEM;
+							goto err_element_clash;
+						}
+
+						ue->priv = elem_priv;
+						nft_trans_commit_list_add_elem(ctx->net, trans, GFP_KERNEL);
+						return 1;
+					}
+				}
+			}
+		} else if (err == -ENOTEMPTY) {
+			/* ENOTEMPTY reports overlapping between this element
+			 * and an existing one.
+			 */
+			err = -EEXIST;
+		}
+		goto err_element_clash;
+	}
+
+	if (!(flags & NFT_SET_ELEM_CATCHALL)) {
+		unsigned int max = nft_set_maxsize(set);
+
+		if (!atomic_add_unless(&set->nelems, 1, max)) {
+			err = -ENFILE;
+			goto err_set_full;
+		}
+	}
+
+	nft_trans_container_elem(trans)->elems[0].priv = elem->priv;
+	nft_trans_commit_list_add_elem(ctx->net, trans, GFP_KERNEL);
+	return 0;
+
+err_set_full:
+	nft_setelem_remove(ctx->net, set, elem->priv);
+err_element_clash:
+	kfree(trans);
+	return err ? err : 1;
+}
+
+static int nft_add_set_elem(struct nft_ctx *ctx, struct nft_set *set,
+			    const struct nlattr *attr, u32 nlmsg_flags)
+{
+	struct nft_expr *expr_array[NFT_SET_EXPR_MAX] = {};
+	struct nlattr *nla[NFTA_SET_ELEM_MAX + 1];
+	u8 genmask = nft_genmask_next(ctx->net);
+	u32 flags = 0, size = 0, num_exprs = 0;
+	struct nft_set_ext_tmpl tmpl;
+	struct nft_set_elem elem;
+	struct nft_set_binding *binding;
+	struct nft_object *obj = NULL;
+	struct nft_userdata *udata;
+	struct nft_data_desc desc;
+	enum nft_registers dreg;
+	struct nft_set_ext *ext;
+	u64 expiration;
+	u64 timeout;
+	int err, i;
+	u8 ulen;
+
+	err = nla_parse_nested_deprecated(nla, NFTA_SET_ELEM_MAX, attr,
+					  nft_set_elem_policy, NULL);
+	if (err < 0)
+		return err;
+
+	nft_set_ext_prepare(&tmpl);
+
+	err = nft_setelem_parse_flags(set, nla[NFTA_SET_ELEM_FLAGS], &flags);
+	if (err < 0)
+		return err;
+
+	if (((flags & NFT_SET_ELEM_CATCHALL) && nla[NFTA_SET_ELEM_KEY]) ||
+	    (!(flags & NFT_SET_ELEM_CATCHALL) && !nla[NFTA_SET_ELEM_KEY]))
+		return -EINVAL;
+
+	if (flags != 0) {
+		err = nft_set_ext_add(&tmpl, NFT_SET_EXT_FLAGS);
+		if (err < 0)
+			return err;
+	}
+
+	if (set->flags & NFT_SET_MAP) {
+		if (nla[NFTA_SET_ELEM_DATA] == NULL &&
+		    !(flags & NFT_SET_ELEM_INTERVAL_END))
+			return -EINVAL;
+	} else {
+		if (nla[NFTA_SET_ELEM_DATA] != NULL)
+			return -EINVAL;
+	}
+
+	if (set->flags & NFT_SET_OBJECT) {
+		if (!nla[NFTA_SET_ELEM_OBJREF] &&
+		    !(flags & NFT_SET_ELEM_INTERVAL_END))
+			return -EINVAL;
+	} else {
+		if (nla[NFTA_SET_ELEM_OBJREF])
+			return -EINVAL;
+	}
+
+	if (!nft_setelem_valid_key_end(set, nla, flags))
+		return -EINVAL;
+
+	if ((flags & NFT_SET_ELEM_INTERVAL_END) &&
+	     (nla[NFTA_SET_ELEM_DATA] ||
+	      nla[NFTA_SET_ELEM_OBJREF] ||
+	      nla[NFTA_SET_ELEM_TIMEOUT] ||
+	      nla[NFTA_SET_ELEM_EXPIRATION] ||
+	      nla[NFTA_SET_ELEM_USERDATA] ||
+	      nla[NFTA_SET_ELEM_EXPR] ||
+	      nla[NFTA_SET_ELEM_KEY_END] ||
+	      nla[NFTA_SET_ELEM_EXPRESSIONS]))
+		return -EINVAL;
+
+	err = nft_setelem_parse_timeout(set, nla, flags, &timeout, &expiration);
+	if (err < 0)
+		return err;
+
+	if (nla[NFTA_SET_ELEM_EXPR]) {
+		struct nft_expr *expr;
 
 		if (set->num_exprs && set->num_exprs != 1)
 			return -EOPNOTSUPP;
@@ -7475,107 +7930,451 @@ static int nft_add_set_elem(struct nft_ctx *ctx, struct nft_set *set,
 	if (err < 0)
 		goto err_elem_free;
 
-	trans = nft_trans_elem_alloc(ctx, NFT_MSG_NEWSETELEM, set);
-	if (trans == NULL) {
-		err = -ENOMEM;
-		goto err_elem_free;
+	err = nft_add_set_elem_insert(ctx, set, &elem, flags, timeout,
+				      expiration, nlmsg_flags);
+	if (err == 0)
+		return 0;
+	if (err > 0)
+		err = 0;
+err_elem_free:
+	nf_tables_set_elem_destroy(ctx, set, elem.priv);
+err_parse_data:
+	if (nla[NFTA_SET_ELEM_DATA] != NULL)
+		nft_data_release(&elem.data.val, desc.type);
+err_parse_key_end:
+	if (obj)
+		nft_use_dec_restore(&obj->use);
+
+	nft_data_release(&elem.key_end.val, NFT_DATA_VALUE);
+err_parse_key:
+	nft_data_release(&elem.key.val, NFT_DATA_VALUE);
+err_set_elem_expr:
+	for (i = 0; i < num_exprs && expr_array[i]; i++)
+		nft_expr_destroy(ctx, expr_array[i]);
+err_set_elem_expr_clone:
+	return err;
+}
+
+/* Large element lists are parsed and allocated by several workers before
+ * the elements are inserted in order, under the commit mutex as usual.
+ */
+#define NFT_SETELEM_PARALLEL_MIN	1024
+#define NFT_SETELEM_PARALLEL_CHUNK	512
+#define NFT_SETELEM_PARALLEL_WORKERS	16
+
+struct nft_setelem_prep {
+	const struct nlattr	*attr;
+	struct nft_elem_priv	*priv;
+	u64			timeout;
+	u64			expiration;
+	int			err;
+};
+
+struct nft_setelem_prep_work {
+	struct work_struct	work;
+	struct nft_ctx		*ctx;
+	struct nft_set		*set;
+	struct mem_cgroup	*memcg;
+	struct nft_setelem_prep	*prep;
+	unsigned int		nelems;
+};
+
+static bool nft_setelem_parallel(const struct nft_set *set,
+				 const struct nlattr *list)
+{
+	const struct nlattr *attr;
+	unsigned int n = 0;
+	int rem;
+
+	if (set->flags & (NFT_SET_INTERVAL | NFT_SET_OBJECT) ||
+	    set->num_exprs || set->dtype == NFT_DATA_VERDICT ||
+	    num_online_cpus() == 1)
+		return false;
+
+	nla_for_each_nested(attr, list, rem) {
+		if (++n == NFT_SETELEM_PARALLEL_MIN)
+			return true;
 	}
 
-	ext->genmask = nft_genmask_cur(ctx->net);
+	return false;
+}
 
-	err = nft_setelem_insert(ctx->net, set, &elem, &elem_priv, flags);
-	if (err) {
-		if (err == -EEXIST) {
-			ext2 = nft_set_elem_ext(set, elem_priv);
-			if (nft_set_ext_exists(ext, NFT_SET_EXT_DATA) ^
-			    nft_set_ext_exists(ext2, NFT_SET_EXT_DATA) ||
-			    nft_set_ext_exists(ext, NFT_SET_EXT_OBJREF) ^
-			    nft_set_ext_exists(ext2, NFT_SET_EXT_OBJREF))
-				goto err_element_clash;
-			if ((nft_set_ext_exists(ext, NFT_SET_EXT_DATA) &&
-			     nft_set_ext_exists(ext2, NFT_SET_EXT_DATA) &&
-			     memcmp(nft_set_ext_data(ext),
-				    nft_set_ext_data(ext2), set->dlen) != 0) ||
-			    (nft_set_ext_exists(ext, NFT_SET_EXT_OBJREF) &&
-			     nft_set_ext_exists(ext2, NFT_SET_EXT_OBJREF) &&
-			     *nft_set_ext_obj(ext) != *nft_set_ext_obj(ext2)))
-				goto err_element_clash;
-			else if (!(nlmsg_flags & NLM_F_EXCL)) {
-				err = 0;
-				if (nft_set_ext_exists(ext2, NFT_SET_EXT_TIMEOUT)) {
-					struct nft_elem_update update = { };
+/* First half of nft_add_set_elem() for the elements made of a key, and of
+ * data, a timeout or user data, nothing that takes references.  -EAGAIN
+ * leaves the others to nft_add_set_elem().
+ */
+static int nft_setelem_prepare(struct nft_ctx *ctx, struct nft_set *set,
+			       struct nft_setelem_prep *p)
+{
+	struct nlattr *nla[NFTA_SET_ELEM_MAX + 1];
+	struct nft_set_binding *binding;
+	struct nft_set_ext_tmpl tmpl;
+	struct nft_userdata *udata;
+	struct nft_data_desc desc;
+	struct nft_data key, data;
+	struct nft_elem_priv *priv;
+	enum nft_registers dreg;
+	struct nft_set_ext *ext;
+	u8 ulen = 0;
+	int err;
 
-					if (timeout != nft_set_ext_timeout(ext2)->timeout) {
-						update.timeout = timeout;
-						if (expiration == 0)
-							expiration = timeout;
+	err = nla_parse_nested_deprecated(nla, NFTA_SET_ELEM_MAX, p->attr,
+					  nft_set_elem_policy, NULL);
+	if (err < 0)
+		return err;
 
-						update.flags |= NFT_TRANS_UPD_TIMEOUT;
-					}
-					if (expiration) {
-						update.expiration = expiration;
-						update.flags |= NFT_TRANS_UPD_EXPIRATION;
-					}
+	if (nla[NFTA_SET_ELEM_FLAGS] ||
+	    nla[NFTA_SET_ELEM_KEY_END] ||
+	    nla[NFTA_SET_ELEM_OBJREF] ||
+	    nla[NFTA_SET_ELEM_EXPR] ||
+	    nla[NFTA_SET_ELEM_EXPRESSIONS] ||
+	    !nla[NFTA_SET_ELEM_KEY])
+		return -EAGAIN;
 
-					if (update.flags) {
-						struct nft_trans_one_elem *ue;
+	if (!(set->flags & NFT_SET_MAP) != !nla[NFTA_SET_ELEM_DATA])
+		return -EINVAL;
 
-						ue = &nft_trans_container_elem(trans)->elems[0];
+	err = nft_setelem_parse_timeout(set, nla, 0, &p->timeout,
+					&p->expiration);
+	if (err < 0)
+		return err;
 
-						ue->update = kmemdup(&update, sizeof(update), GFP_KERNEL);
-						if (!ue->update) {
-							err = -ENOMEM;
-							goto err_element_clash;
-						}
+	nft_set_ext_prepare(&tmpl);
 
-						ue->priv = elem_priv;
-						nft_trans_commit_list_add_elem(ctx->net, trans, GFP_KERNEL);
-						goto err_elem_free;
-					}
-				}
+	err = nft_setelem_parse_key(ctx, set, &key, nla[NFTA_SET_ELEM_KEY]);
+	if (err < 0)
+		return err;
+
+	err = nft_set_ext_add_length(&tmpl, NFT_SET_EXT_KEY, set->klen);
+	if (err < 0)
+		return err;
+
+	if (set->flags & NFT_SET_TIMEOUT) {
+		err = nft_set_ext_add(&tmpl, NFT_SET_EXT_TIMEOUT);
+		if (err < 0)
+			return err;
+	}
+
+	if (nla[NFTA_SET_ELEM_DATA]) {
+		err = nft_setelem_parse_data(ctx, set, &desc, &data,
+					     nla[NFTA_SET_ELEM_DATA]);
+		if (err < 0)
+			return err;
+
+		dreg = nft_type_to_reg(set->dtype);
+		list_for_each_entry(binding, &set->bindings, list) {
+			struct nft_ctx bind_ctx = {
+				.net	= ctx->net,
+				.family	= ctx->family,
+				.table	= ctx->table,
+				.chain	= (struct nft_chain *)binding->chain,
+			};
+
+			if (!(binding->flags & NFT_SET_MAP))
+				continue;
+
+			err = nft_validate_register_store(&bind_ctx, dreg,
+							  &data, desc.type,
+							  desc.len);
+			if (err < 0)
+				return err;
+		}
+
+		err = nft_set_ext_add_length(&tmpl, NFT_SET_EXT_DATA, desc.len);
+		if (err < 0)
+			return err;
+	}
+
+	if (nla[NFTA_SET_ELEM_USERDATA]) {
+		ulen = nla_len(nla[NFTA_SET_ELEM_USERDATA]);
+		if (ulen > 0) {
+			err = nft_set_ext_add_length(&tmpl, NFT_SET_EXT_USERDATA,
+						     ulen);
+			if (err < 0)
+				return err;
+		}
+	}
+
+	priv = nft_set_elem_init(set, &tmpl, key.data, NULL, data.data,
+				 p->timeout, p->expiration, GFP_KERNEL_ACCOUNT);
+	if (IS_ERR(priv))
+		return PTR_ERR(priv);
+
+	if (ulen > 0) {
+		if (nft_set_ext_check(&tmpl, NFT_SET_EXT_USERDATA, ulen) < 0) {
+			kfree(priv);
+			return -EINVAL;
+		}
+		ext = nft_set_elem_ext(set, priv);
+		udata = nft_set_ext_userdata(ext);
+		udata->len = ulen - 1;
+		nla_memcpy(&udata->data, nla[NFTA_SET_ELEM_USERDATA], ulen);
+	}
+
+	p->priv = priv;
+
+	return 0;
+}
+
+static void nft_setelem_prep_work(struct work_struct *work)
+{
+	struct nft_setelem_prep_work *w;
+	struct mem_cgroup *old_memcg;
+	unsigned int i;
+
+	w = container_of(work, struct nft_setelem_prep_work, work);
+
+	/* charge the elements to the sender, not to the worker */
+	old_memcg = set_active_memcg(w->memcg);
+	for (i = 0; i < w->nelems; i++) {
+		w->prep[i].err = nft_setelem_prepare(w->ctx, w->set,
+						     &w->prep[i]);
+		cond_resched();
+	}
+	set_active_memcg(old_memcg);
+}
+
+static int nft_add_set_elems_parallel(struct nft_ctx *ctx, struct nft_set *set,
+				      const struct nlattr *list, u32 nlmsg_flags,
+				      struct netlink_ext_ack *extack)
+{
+	struct nft_setelem_prep_work *works;
+	unsigned int i, n = 0, nworks, chunk;
+	struct nft_setelem_prep *prep;
+	const struct nlattr *attr;
+	struct nft_set_elem elem;
+	struct nft_set_ext *ext;
+	struct mem_cgroup *memcg;
+	int rem, err = 0;
+
+	nla_for_each_nested(attr, list, rem)
+		n++;
+
+	prep = kvcalloc(n, sizeof(*prep), GFP_KERNEL_ACCOUNT);
+	if (!prep)
+		return -ENOMEM;
+
+	i = 0;
+	nla_for_each_nested(attr, list, rem)
+		prep[i++].attr = attr;
+
+	nworks = min3(num_online_cpus(), NFT_SETELEM_PARALLEL_WORKERS,
+		      DIV_ROUND_UP(n, NFT_SETELEM_PARALLEL_CHUNK));
+	works = kcalloc(nworks, sizeof(*works), GFP_KERNEL);
+	if (!works) {
+		kvfree(prep);
+		return -ENOMEM;
+	}
+
+	memcg = get_mem_cgroup_from_current();
+	chunk = DIV_ROUND_UP(n, nworks);
+	for (i = 0; i < nworks; i++) {
+		works[i].ctx = ctx;
+		works[i].set = set;
+		works[i].memcg = memcg;
+		works[i].prep = &prep[i * chunk];
+		works[i].nelems = min(chunk, n - i * chunk);
+		INIT_WORK(&works[i].work, nft_setelem_prep_work);
+		queue_work(system_unbound_wq, &works[i].work);
+	}
+	for (i = 0; i < nworks; i++)
+		flush_work(&works[i].work);
+	mem_cgroup_put(memcg);
+	kfree(works);
+
+	for (i = 0; i < n; i++) {
+		if (prep[i].err == -EAGAIN) {
+			err = nft_add_set_elem(ctx, set, prep[i].attr,
+					       nlmsg_flags);
+		} else if (prep[i].err) {
+			err = prep[i].err;
+		} else {
+			ext = nft_set_elem_ext(set, prep[i].priv);
+			elem.priv = prep[i].priv;
+			memcpy(elem.key.val.data, nft_set_ext_key(ext),
+			       set->klen);
+
+			err = nft_add_set_elem_insert(ctx, set, &elem, 0,
+						      prep[i].timeout,
+						      prep[i].expiration,
+						      nlmsg_flags);
+			if (err) {
+				nf_tables_set_elem_destroy(ctx, set,
+							   prep[i].priv);
+				if (err > 0)
+					err = 0;
 			}
-		} else if (err == -ENOTEMPTY) {
-			/* ENOTEMPTY reports overlapping between this element
-			 * and an existing one.
-			 */
-			err = -EEXIST;
+			prep[i].priv = NULL;
 		}
-		goto err_element_clash;
+
+		if (err < 0) {
+			NL_SET_BAD_ATTR(extack, prep[i].attr);
+			break;
+		}
+	}
+
+	for (; i < n; i++) {
+		if (prep[i].priv)
+			nf_tables_set_elem_destroy(ctx, set, prep[i].priv);
+	}
+	kvfree(prep);
+
+	return err;
+}
+
+static int nft_set_flush(struct nft_ctx *ctx, struct nft_set *set,
+			 u8 genmask);
+
+/* One record of a bulk load, added as nft_add_set_elem() would */
+static int nft_set_bulk_add(struct nft_ctx *ctx, struct nft_set *set,
+			    const struct nft_set_ext_tmpl *tmpl,
+			    const u8 *rec, u64 timeout, u32 nlmsg_flags)
+{
+	struct nft_set_elem elem = {};
+	int err;
+
+	memcpy(elem.key.val.data, rec, set->klen);
+	if (set->flags & NFT_SET_MAP)
+		memcpy(elem.data.val.data, rec + set->klen, set->dlen);
+
+	elem.priv = nft_set_elem_init(set, tmpl, elem.key.val.data, NULL,
+				      elem.data.val.data, timeout, 0,
+				      GFP_KERNEL_ACCOUNT);
+	if (IS_ERR(elem.priv))
+		return PTR_ERR(elem.priv);
+
+	err = nft_add_set_elem_insert(ctx, set, &elem, 0, timeout, 0,
+				      nlmsg_flags);
+	if (err) {
+		nf_tables_set_elem_destroy(ctx, set, elem.priv);
+		if (err > 0)
+			err = 0;
+	}
+
+	return err;
+}
+
+/* Elements given as a flat array of keys and data in a file, see
+ * nf_tables_bulk.h.  Only sets whose elements are a key and plain data
+ * can be loaded that way.
+ */
+static int nft_set_bulk_load(struct nft_ctx *ctx, struct nft_set *set,
+			     const struct nlattr *attr, u32 nlmsg_flags)
+{
+	struct nft_set_binding *binding;
+	struct nft_set_bulk_hdr hdr;
+	struct nft_set_ext_tmpl tmpl;
+	unsigned int batch, n, i;
+	struct file *file;
+	u64 timeout = 0;
+	loff_t pos = 0;
+	size_t rec_len;
+	ssize_t ret;
+	u32 done;
+	int err;
+	u8 *buf;
+
+	if (set->flags & (NFT_SET_INTERVAL | NFT_SET_OBJECT) ||
+	    set->num_exprs || set->dtype == NFT_DATA_VERDICT)
+		return -EOPNOTSUPP;
+
+	file = fget(ntohl(nla_get_be32(attr)));
+	if (!file)
+		return -EBADF;
+
+	ret = kernel_read(file, &hdr, sizeof(hdr), &pos);
+	if (ret != sizeof(hdr)) {
+		err = ret < 0 ? ret : -EINVAL;
+		goto err_fput;
+	}
+
+	err = -EINVAL;
+	if (hdr.magic != NFT_SET_BULK_MAGIC ||
+	    hdr.flags & ~NFT_SET_BULK_F_REPLACE ||
+	    hdr.klen != set->klen ||
+	    hdr.dlen != (set->flags & NFT_SET_MAP ? set->dlen : 0))
+		goto err_fput;
+
+	nft_set_ext_prepare(&tmpl);
+	err = nft_set_ext_add_length(&tmpl, NFT_SET_EXT_KEY, set->klen);
+	if (err < 0)
+		goto err_fput;
+
+	if (set->flags & NFT_SET_MAP) {
+		list_for_each_entry(binding, &set->bindings, list) {
+			struct nft_ctx bind_ctx = {
+				.net	= ctx->net,
+				.family	= ctx->family,
+				.table	= ctx->table,
+				.chain	= (struct nft_chain *)binding->chain,
+			};
+
+			if (!(binding->flags & NFT_SET_MAP))
+				continue;
+
+			err = nft_validate_register_store(&bind_ctx,
+							  nft_type_to_reg(set->dtype),
+							  NULL, NFT_DATA_VALUE,
+							  set->dlen);
+			if (err < 0)
+				goto err_fput;
+		}
+
+		err = nft_set_ext_add_length(&tmpl, NFT_SET_EXT_DATA,
+					     set->dlen);
+		if (err < 0)
+			goto err_fput;
+	}
+
+	if (set->flags & NFT_SET_TIMEOUT) {
+		timeout = READ_ONCE(set->timeout);
+		err = nft_set_ext_add(&tmpl, NFT_SET_EXT_TIMEOUT);
+		if (err < 0)
+			goto err_fput;
+	}
+
+	if (hdr.flags & NFT_SET_BULK_F_REPLACE) {
+		/* the packet path may add elements meanwhile */
+		if (set->flags & NFT_SET_EVAL) {
+			err = -EOPNOTSUPP;
+			goto err_fput;
+		}
+
+		/* the old elements go in the same batch, one transaction
+		 * for each array of them, as for a flush from userspace.
+		 */
+		err = nft_set_flush(ctx, set, nft_genmask_next(ctx->net));
+		if (err < 0)
+			goto err_fput;
+	}
+
+	rec_len = hdr.klen + hdr.dlen;
+	batch = SZ_64K / rec_len;
+	buf = kvmalloc(batch * rec_len, GFP_KERNEL);
+	if (!buf) {
+		err = -ENOMEM;
+		goto err_fput;
 	}
 
-	if (!(flags & NFT_SET_ELEM_CATCHALL)) {
-		unsigned int max = nft_set_maxsize(set);
+	err = 0;
+	for (done = 0; done < hdr.count && !err; done += n) {
+		n = min(batch, hdr.count - done);
 
-		if (!atomic_add_unless(&set->nelems, 1, max)) {
-			err = -ENFILE;
-			goto err_set_full;
+		ret = kernel_read(file, buf, n * rec_len, &pos);
+		if (ret != (ssize_t)(n * rec_len)) {
+			err = ret < 0 ? ret : -EINVAL;
+			break;
 		}
-	}
-
-	nft_trans_container_elem(trans)->elems[0].priv = elem.priv;
-	nft_trans_commit_list_add_elem(ctx->net, trans, GFP_KERNEL);
-	return 0;
 
-err_set_full:
-	nft_setelem_remove(ctx->net, set, elem.priv);
-err_element_clash:
-	kfree(trans);
-err_elem_free:
-	nf_tables_set_elem_destroy(ctx, set, elem.priv);
-err_parse_data:
-	if (nla[NFTA_SET_ELEM_DATA] != NULL)
-		nft_data_release(&elem.data.val, desc.type);
-err_parse_key_end:
-	if (obj)
-		nft_use_dec_restore(&obj->use);
+		for (i = 0; i < n && !err; i++)
+			err = nft_set_bulk_add(ctx, set, &tmpl, buf + i * rec_len,
+					       timeout, nlmsg_flags);
+		cond_resched();
+	}
 
-	nft_data_release(&elem.key_end.val, NFT_DATA_VALUE);
-err_parse_key:
-	nft_data_release(&elem.key.val, NFT_DATA_VALUE);
-err_set_elem_expr:
-	for (i = 0; i < num_exprs && expr_array[i]; i++)
-		nft_expr_destroy(ctx, expr_array[i]);
-err_set_elem_expr_clone:
+	kvfree(buf);
+err_fput:
+	fput(file);
 	return err;
 }
 
@@ -7593,7 +8392,7 @@ static int nf_tables_newsetelem(struct sk_buff *skb,
 	struct nft_ctx ctx;
 	int rem, err;
 
-	if (nla[NFTA_SET_ELEM_LIST_ELEMENTS] == NULL)
+	if (!nla[NFTA_SET_ELEM_LIST_ELEMENTS] == !nla[NFTA_SET_ELEM_LIST_FD])
 		return -EINVAL;
 
 	table = nft_table_lookup(net, nla[NFTA_SET_ELEM_LIST_TABLE], family,
@@ -7616,6 +8415,21 @@ static int nf_tables_newsetelem(struct sk_buff *skb,
 
 	nft_ctx_init(&ctx, net, skb, info->nlh, family, table, NULL, nla);
 
+	if (nla[NFTA_SET_ELEM_LIST_FD]) {
+		err = nft_set_bulk_load(&ctx, set, nla[NFTA_SET_ELEM_LIST_FD],
+					info->nlh->nlmsg_flags);
+		if (err < 0)
+			NL_SET_BAD_ATTR(extack, nla[NFTA_SET_ELEM_LIST_FD]);
+		return err;
+	}
+
+	/* no verdict maps there, nothing to validate afterwards */
+	if (nft_setelem_parallel(set, nla[NFTA_SET_ELEM_LIST_ELEMENTS]))
+		return nft_add_set_elems_parallel(&ctx, set,
+						  nla[NFTA_SET_ELEM_LIST_ELEMENTS],
+						  info->nlh->nlmsg_flags,
+						  extack);
+
 	nla_for_each_nested(attr, nla[NFTA_SET_ELEM_LIST_ELEMENTS], rem) {
 		err = nft_add_set_elem(&ctx, set, attr, info->nlh->nlmsg_flags);
 		if (err < 0) {
@@ -7624,7 +8438,9 @@ static int nf_tables_newsetelem(struct sk_buff *skb,
 		}
 	}
 
-	if (table->validate_state == NFT_VALIDATE_DO)
+	/* only verdict maps lead to other chains */
+	if (set->dtype == NFT_DATA_VERDICT &&
+	    table->validate_state == NFT_VALIDATE_DO)
 		return nft_table_validate(net, table);
 
 	return 0;
@@ -9872,8 +10688,9 @@ static void nf_tables_gen_notify(struct net *net, struct sk_buff *skb,
 		goto err;
 	}
 
-	nfnetlink_send(skb2, net, NETLINK_CB(skb).portid, NFNLGRP_NFTABLES,
-		       nlmsg_report(nlh), GFP_KERNEL);
+	/* sent after the events of the batch, see nft_commit_notify() */
+	nft_notify_enqueue(skb2, nlmsg_report(nlh),
+			   &nft_pernet(net)->notify_list);
 	return;
 err:
 	nfnetlink_set_err(net, NETLINK_CB(skb).portid, NFNLGRP_NFTABLES,
@@ -10008,7 +10825,7 @@ static const struct nfnl_callback nf_tables_cb[NFT_MSG_MAX] = {
 	[NFT_MSG_NEWSETELEM] = {
 		.call		= nf_tables_newsetelem,
 		.type		= NFNL_CB_BATCH,
-		.attr_count	= NFTA_SET_ELEM_LIST_MAX,
+		.attr_count	= NFT_SET_ELEM_LIST_ATTR_MAX,
 		.policy		= nft_set_elem_list_policy,
 	},
 	[NFT_MSG_GETSETELEM] = {
@@ -10146,10 +10963,15 @@ static void nft_chain_commit_update(struct nft_trans_chain *trans)
 	struct nft_base_chain *basechain;
 
 	if (trans->name) {
+		struct net *net = trans->nft_trans_binding.nft_trans.net;
+
 		rhltable_remove(&table->chains_ht,
 				&trans->chain->rhlhead,
 				nft_chain_ht_params);
 		swap(trans->chain->name, trans->name);
+		/* jumps to it are cached under the old name */
+		WRITE_ONCE(nft_pernet(net)->rule_dump_gen,
+			   nft_pernet(net)->rule_dump_gen + 1);
 		rhltable_insert_key(&table->chains_ht,
 				    trans->chain->name,
 				    &trans->chain->rhlhead,
@@ -10257,9 +11079,11 @@ static void nf_tables_trans_destroy_work(struct work_struct *w)
 
 	synchronize_rcu();
 
+	/* a table can come with millions of set elements and rules */
 	list_for_each_entry_safe(trans, next, &head, list) {
 		nft_trans_list_del(trans);
 		nft_commit_release(trans);
+		cond_resched();
 	}
 }
 
@@ -10281,42 +11105,84 @@ static int nf_tables_commit_chain_prepare(struct net *net, struct nft_chain *cha
 {
 	const struct nft_expr *expr, *last;
 	struct nft_regs_track track = {};
-	unsigned int size, data_size;
-	void *data, *data_boundary;
+	unsigned int size, data_size, fused, min, run;
+	void *data, *data_boundary, *table;
+	struct nft_rule *rule, *tail = NULL;
+	struct nft_classify *cls = NULL;
 	struct nft_rule_dp *prule;
-	struct nft_rule *rule;
+	size_t table_size;
+	bool profile;
 
 	/* already handled or inactive chain? */
 	if (chain->blob_next || !nft_is_active_next(net, chain))
 		return 0;
 
+	/* classifier tables go after the blob trailer */
+	min = READ_ONCE(nft_classify_min_rules);
+	profile = static_key_enabled(&nft_rule_profile_enabled);
 	data_size = 0;
+	table_size = 0;
+	run = 0;
 	list_for_each_entry(rule, &chain->rules, list) {
 		if (nft_is_active_next(net, rule)) {
+			if (!run) {
+				run = nft_classify_run(net, chain, rule, min);
+				if (run) {
+					data_size += NFT_CLASSIFY_RULE_SIZE;
+					table_size += nft_classify_size(run);
+				}
+			}
+			if (run)
+				run--;
+
+			tail = rule;
 			data_size += sizeof(*prule) + rule->dlen;
-			if (data_size > INT_MAX)
+			if (profile)
+				data_size += NFT_RULE_PROFILE_SIZE;
+			if (data_size > INT_MAX || table_size > INT_MAX)
 				return -ENOMEM;
 		}
 	}
 
-	chain->blob_next = nf_tables_chain_alloc_rules(chain, data_size);
+	if (data_size + table_size > INT_MAX)
+		return -ENOMEM;
+
+	chain->blob_next = nf_tables_chain_alloc_rules(chain,
+						       data_size + table_size);
 	if (!chain->blob_next)
 		return -ENOMEM;
 
 	data = (void *)chain->blob_next->data;
 	data_boundary = data + data_size;
+	table = data_boundary + sizeof(struct nft_rule_dp_last);
 	size = 0;
 
 	list_for_each_entry(rule, &chain->rules, list) {
 		if (!nft_is_active_next(net, rule))
 			continue;
 
+		if (!run) {
+			run = nft_classify_run(net, chain, rule, min);
+			if (run) {
+				if (WARN_ON_ONCE(data + NFT_CLASSIFY_RULE_SIZE > data_boundary))
+					return -ENOMEM;
+
+				cls = nft_classify_init(data, table, rule, run);
+				data += NFT_CLASSIFY_RULE_SIZE;
+				table += nft_classify_size(run);
+				chain->blob_next->size += NFT_CLASSIFY_RULE_SIZE;
+			}
+		}
+
 		prule = (struct nft_rule_dp *)data;
 		data += offsetof(struct nft_rule_dp, data);
 		if (WARN_ON_ONCE(data > data_boundary))
 			return -ENOMEM;
 
 		size = 0;
+		if (profile)
+			size += nft_rule_profile_init(data, rule);
+
 		track.last = nft_expr_last(rule);
 		nft_rule_for_each_expr(expr, last, rule) {
 			track.cur = expr;
@@ -10326,10 +11192,18 @@ static int nf_tables_commit_chain_prepare(struct net *net, struct nft_chain *cha
 				continue;
 			}
 
+			fused = nft_expr_fuse(data + size, &expr, last);
+			if (fused) {
+				size += fused;
+				continue;
+			}
+
 			if (WARN_ON_ONCE(data + size + expr->ops->size > data_boundary))
 				return -ENOMEM;
 
 			memcpy(data + size, expr, expr->ops->size);
+			if (rule == tail)
+				nft_expr_tail_call(data + size);
 			size += expr->ops->size;
 		}
 		if (WARN_ON_ONCE(size >= 1 << 12))
@@ -10342,6 +11216,12 @@ static int nf_tables_commit_chain_prepare(struct net *net, struct nft_chain *cha
 		data += size;
 		size = 0;
 		chain->blob_next->size += (unsigned long)(data - (void *)prule);
+
+		if (run) {
+			nft_classify_add(cls, rule, prule);
+			if (!--run)
+				nft_classify_done(cls, data);
+		}
 	}
 
 	if (WARN_ON_ONCE(data > data_boundary))
@@ -10490,34 +11370,33 @@ static void nft_trans_gc_trans_free(struct rcu_head *rcu)
 	nft_trans_gc_destroy(trans);
 }
 
+/* Called with the commit mutex of trans->net held */
 static bool nft_trans_gc_work_done(struct nft_trans_gc *trans)
 {
-	struct nftables_pernet *nft_net;
+	struct nftables_pernet *nft_net = nft_pernet(trans->net);
 	struct nft_ctx ctx = {};
 
-	nft_net = nft_pernet(trans->net);
-
-	mutex_lock(&nft_net->commit_mutex);
-
 	/* Check for race with transaction, otherwise this batch refers to
 	 * stale objects that might not be there anymore. Skip transaction if
 	 * set has been destroyed from control plane transaction in case gc
 	 * worker loses race.
 	 */
-	if (READ_ONCE(nft_net->gc_seq) != trans->seq || trans->set->dead) {
-		mutex_unlock(&nft_net->commit_mutex);
+	if (READ_ONCE(nft_net->gc_seq) != trans->seq || trans->set->dead)
 		return false;
-	}
 
 	ctx.net = trans->net;
 	ctx.table = trans->set->table;
 
 	nft_trans_gc_setelem_remove(&ctx, trans);
-	mutex_unlock(&nft_net->commit_mutex);
 
 	return true;
 }
 
+/* Batches for the same netns are handled under a single hold of the commit
+ * mutex, up to NFT_TRANS_GC_WORK_MAX of them before letting transactions in.
+ */
+#define NFT_TRANS_GC_WORK_MAX	64
+
 static void nft_trans_gc_work(struct work_struct *work)
 {
 	struct nft_trans_gc *trans, *next;
@@ -10527,13 +11406,44 @@ static void nft_trans_gc_work(struct work_struct *work)
 	list_splice_init(&nf_tables_gc_list, &trans_gc_list);
 	spin_unlock(&nf_tables_gc_list_lock);
 
-	list_for_each_entry_safe(trans, next, &trans_gc_list, list) {
-		list_del(&trans->list);
-		if (!nft_trans_gc_work_done(trans)) {
+	while (!list_empty(&trans_gc_list)) {
+		unsigned int budget = NFT_TRANS_GC_WORK_MAX;
+		struct nftables_pernet *nft_net;
+		LIST_HEAD(stale_list);
+		LIST_HEAD(done_list);
+		struct net *net;
+
+		net = list_first_entry(&trans_gc_list, struct nft_trans_gc,
+				       list)->net;
+		nft_net = nft_pernet(net);
+
+		mutex_lock(&nft_net->commit_mutex);
+		list_for_each_entry_safe(trans, next, &trans_gc_list, list) {
+			if (trans->net != net)
+				continue;
+
+			if (nft_trans_gc_work_done(trans))
+				list_move_tail(&trans->list, &done_list);
+			else
+				list_move_tail(&trans->list, &stale_list);
+
+			if (!--budget)
+				break;
+		}
+		mutex_unlock(&nft_net->commit_mutex);
+
+		/* this might drop the last reference to net */
+		list_for_each_entry_safe(trans, next, &stale_list, list) {
+			list_del(&trans->list);
 			nft_trans_gc_destroy(trans);
-			continue;
 		}
-		call_rcu(&trans->rcu, nft_trans_gc_trans_free);
+
+		list_for_each_entry_safe(trans, next, &done_list, list) {
+			list_del(&trans->list);
+			call_rcu(&trans->rcu, nft_trans_gc_trans_free);
+		}
+
+		cond_resched();
 	}
 }
 
@@ -10700,6 +11610,24 @@ static void nf_tables_module_autoload_cleanup(struct net *net)
 	}
 }
 
+static void nf_tables_commit_shrink_hooks(struct net *net)
+{
+	struct nftables_pernet *nft_net = nft_pernet(net);
+	struct nft_trans *trans;
+	struct nft_chain *chain;
+
+	list_for_each_entry(trans, &nft_net->commit_list, list) {
+		if ((trans->msg_type != NFT_MSG_DELCHAIN &&
+		     trans->msg_type != NFT_MSG_DESTROYCHAIN) ||
+		    nft_trans_chain_update(trans))
+			continue;
+
+		chain = nft_trans_chain(trans);
+		if (nft_chain_hook_batched(trans->table, chain))
+			nf_hook_shrink(net, &nft_base_chain(chain)->ops);
+	}
+}
+
 static void nf_tables_commit_release(struct net *net)
 {
 	struct nftables_pernet *nft_net = nft_pernet(net);
@@ -10734,14 +11662,21 @@ static void nf_tables_commit_release(struct net *net)
 	mutex_unlock(&nft_net->commit_mutex);
 }
 
-static void nft_commit_notify(struct net *net, u32 portid)
+/* Called with nft_net->notify_mutex held but not the commit mutex:
+ * delivery to the listeners doesn't hold up the next transaction, and
+ * the notify mutex, taken before the commit mutex is released, keeps
+ * batches in commit order.
+ */
+static void nft_commit_notify(struct net *net, u32 portid,
+			      struct list_head *notify_list)
 {
-	struct nftables_pernet *nft_net = nft_pernet(net);
 	struct sk_buff *batch_skb = NULL, *nskb, *skb;
 	unsigned char *data;
 	int len;
 
-	list_for_each_entry_safe(skb, nskb, &nft_net->notify_list, list) {
+	lockdep_assert_held(&nft_pernet(net)->notify_mutex);
+
+	list_for_each_entry_safe(skb, nskb, notify_list, list) {
 		if (!batch_skb) {
 new_batch:
 			batch_skb = skb;
@@ -10767,7 +11702,7 @@ static void nft_commit_notify(struct net *net, u32 portid)
 			       NFT_CB(batch_skb).report, GFP_KERNEL);
 	}
 
-	WARN_ON_ONCE(!list_empty(&nft_net->notify_list));
+	WARN_ON_ONCE(!list_empty(notify_list));
 }
 
 static int nf_tables_commit_audit_alloc(struct list_head *adl,
@@ -10846,17 +11781,168 @@ static void nf_tables_commit_audit_log(struct list_head *adl, u32 generation)
 	}
 }
 
-static void nft_set_commit_update(struct list_head *set_update_list)
+static u32 nft_set_prefilter_blocks(u32 nelems)
+{
+	u64 val = DIV_ROUND_UP_ULL((u64)max(nelems, 1U) *
+				   NFT_SET_PREFILTER_BITS_PER_KEY,
+				   NFT_SET_PREFILTER_BLOCK_BITS);
+
+	if (val >= NFT_SET_PREFILTER_MAX_BLOCKS)
+		return NFT_SET_PREFILTER_MAX_BLOCKS;
+
+	return roundup_pow_of_two(val);
+}
+
+struct nft_set_prefilter_iter {
+	struct nft_set_iter		iter;
+	struct nft_set_prefilter	*pf;
+};
+
+static int nft_set_prefilter_walk(const struct nft_ctx *ctx,
+				  struct nft_set *set,
+				  const struct nft_set_iter *iter,
+				  struct nft_elem_priv *elem_priv)
+{
+	const struct nft_set_ext *ext = nft_set_elem_ext(set, elem_priv);
+	struct nft_set_prefilter_iter *piter;
+
+	piter = container_of(iter, struct nft_set_prefilter_iter, iter);
+	nft_set_prefilter_add(piter->pf, set, nft_set_ext_key(ext)->data);
+
+	return 0;
+}
+
+/* Elements of any generation are added, extra keys are harmless */
+static struct nft_set_prefilter *nft_set_prefilter_build(struct net *net,
+							 struct nft_set *set,
+							 u32 nblocks)
+{
+	struct nft_set_prefilter_iter piter = {
+		.iter = {
+			.genmask	= NFT_GENMASK_ANY,
+			.type		= NFT_ITER_READ,
+			.fn		= nft_set_prefilter_walk,
+		},
+	};
+	struct nft_ctx ctx = {
+		.net	= net,
+		.table	= set->table,
+		.family	= set->table->family,
+	};
+	struct nft_set_prefilter *pf;
+
+	pf = kzalloc(sizeof(*pf), GFP_KERNEL_ACCOUNT);
+	if (!pf)
+		return NULL;
+
+	pf->bits = kvcalloc((size_t)nblocks * NFT_SET_PREFILTER_BLOCK_BITS /
+			    BITS_PER_LONG, sizeof(unsigned long),
+			    GFP_KERNEL_ACCOUNT);
+	if (!pf->bits)
+		goto err;
+
+	get_random_bytes(&pf->seed, sizeof(pf->seed));
+	pf->nblocks = nblocks;
+
+	piter.pf = pf;
+	set->ops->walk(&ctx, set, &piter.iter);
+	if (piter.iter.err < 0)
+		goto err;
+
+	return pf;
+err:
+	nft_set_prefilter_free(pf);
+	return NULL;
+}
+
+/* Attach, resize, rebuild or drop the prefilter of a set whose elements
+ * were changed by this transaction.  The filter in use stays if this fails:
+ * it holds all the keys of the set anyway.
+ */
+static void nft_set_prefilter_commit(struct net *net, struct nft_set *set)
+{
+	unsigned int min = READ_ONCE(nft_set_prefilter_min);
+	u32 nelems = atomic_read(&set->nelems), nblocks;
+	struct nft_set_prefilter *pf, *old;
+
+	old = rcu_dereference_protected(set->prefilter,
+					lockdep_commit_lock_is_held(net));
+
+	if (!nft_set_prefilter_eligible(set) ||
+	    nelems < (old ? min / 2 : min)) {
+		if (old) {
+			RCU_INIT_POINTER(set->prefilter, NULL);
+			call_rcu(&old->rcu, nft_set_prefilter_free_rcu);
+		}
+		return;
+	}
+
+	nblocks = nft_set_prefilter_blocks(nelems);
+	if (old && nblocks <= old->nblocks && nblocks * 2 > old->nblocks &&
+	    old->nkeys <= nelems + nelems / 2)
+		return;
+
+	if (!set->prefilter_stats) {
+		struct nft_set_prefilter_stats __percpu *stats;
+
+		stats = alloc_percpu_gfp(struct nft_set_prefilter_stats,
+					 GFP_KERNEL_ACCOUNT);
+		if (!stats)
+			return;
+
+		WRITE_ONCE(set->prefilter_stats, stats);
+	}
+
+	pf = nft_set_prefilter_build(net, set, nblocks);
+	if (!pf)
+		return;
+
+	rcu_assign_pointer(set->prefilter, pf);
+	if (old)
+		call_rcu(&old->rcu, nft_set_prefilter_free_rcu);
+}
+
+static bool nft_set_commit_needed(const struct nft_set *set)
+{
+	return set->ops->commit || rcu_access_pointer(set->prefilter) ||
+	       nft_set_prefilter_eligible(set);
+}
+
+static void nft_set_commit_update(struct net *net,
+				  struct list_head *set_update_list)
 {
 	struct nft_set *set, *next;
 
 	list_for_each_entry_safe(set, next, set_update_list, pending_update) {
 		list_del_init(&set->pending_update);
 
-		if (!set->ops->commit || set->dead)
+		if (set->dead)
+			continue;
+
+		nft_set_prefilter_commit(net, set);
+
+		if (set->ops->commit)
+			set->ops->commit(set);
+	}
+}
+
+/* The chains of tables not changed by this commit or the previous one
+ * have the same blob in both generations, skip them.  Must be called
+ * before every flip of the generation cursor.
+ */
+static void nf_tables_commit_chains(struct net *net)
+{
+	struct nftables_pernet *nft_net = nft_pernet(net);
+	struct nft_chain *chain;
+	struct nft_table *table;
+
+	list_for_each_entry(table, &nft_net->tables, list) {
+		if (!table->blob_commits)
 			continue;
 
-		set->ops->commit(set);
+		table->blob_commits--;
+		list_for_each_entry(chain, &table->chains, list)
+			nf_tables_commit_chain(net, chain);
 	}
 }
 
@@ -10884,9 +11970,9 @@ static int nf_tables_commit(struct net *net, struct sk_buff *skb)
 	struct nft_trans *trans, *next;
 	unsigned int base_seq, gc_seq;
 	LIST_HEAD(set_update_list);
+	LIST_HEAD(notify_list);
 	struct nft_trans_elem *te;
 	struct nft_chain *chain;
-	struct nft_table *table;
 	struct nft_ctx ctx;
 	LIST_HEAD(adl);
 	int err;
@@ -10954,14 +12040,16 @@ static int nf_tables_commit(struct net *net, struct sk_buff *skb)
 				nf_tables_commit_audit_free(&adl);
 				return ret;
 			}
+
+			/* this commit swaps in the new blob, the next one
+			 * drops the old.
+			 */
+			chain->table->blob_commits = 2;
 		}
 	}
 
-	/* step 2.  Make rules_gen_X visible to packet path */
-	list_for_each_entry(table, &nft_net->tables, list) {
-		list_for_each_entry(chain, &table->chains, list)
-			nf_tables_commit_chain(net, chain);
-	}
+	/* step 2.  Make rules_gen_X visible to packet path. */
+	nf_tables_commit_chains(net);
 
 	/*
 	 * Bump generation counter, invalidate any dump in progress.
@@ -10977,6 +12065,7 @@ static int nf_tables_commit(struct net *net, struct sk_buff *skb)
 
 	/* step 3. Start new generation, rules_gen_X now in use. */
 	net->nft.gencursor = nft_gencursor_next(net);
+	nft_genid_bump(net);
 
 	list_for_each_entry_safe(trans, next, &nft_net->commit_list, list) {
 		struct nft_table *table = trans->table;
@@ -11035,8 +12124,8 @@ static int nf_tables_commit(struct net *net, struct sk_buff *skb)
 				nft_chain_del(nft_trans_chain(trans));
 				nf_tables_chain_notify(&ctx, NFT_MSG_DELCHAIN,
 						       NULL);
-				nf_tables_unregister_hook(ctx.net, ctx.table,
-							  nft_trans_chain(trans));
+				nf_tables_commit_unregister_hook(ctx.net, ctx.table,
+								 nft_trans_chain(trans));
 			}
 			break;
 		case NFT_MSG_NEWRULE:
@@ -11094,7 +12183,7 @@ static int nf_tables_commit(struct net *net, struct sk_buff *skb)
 
 			nft_trans_elems_add(&ctx, te);
 
-			if (te->set->ops->commit &&
+			if (nft_set_commit_needed(te->set) &&
 			    list_empty(&te->set->pending_update)) {
 				list_add_tail(&te->set->pending_update,
 					      &set_update_list);
@@ -11107,7 +12196,7 @@ static int nf_tables_commit(struct net *net, struct sk_buff *skb)
 
 			nft_trans_elems_remove(&ctx, te);
 
-			if (te->set->ops->commit &&
+			if (nft_set_commit_needed(te->set) &&
 			    list_empty(&te->set->pending_update)) {
 				list_add_tail(&te->set->pending_update,
 					      &set_update_list);
@@ -11176,16 +12265,23 @@ static int nf_tables_commit(struct net *net, struct sk_buff *skb)
 		}
 	}
 
-	nft_set_commit_update(&set_update_list);
+	nft_set_commit_update(net, &set_update_list);
+	nf_tables_commit_shrink_hooks(net);
 
-	nft_commit_notify(net, NETLINK_CB(skb).portid);
 	nf_tables_gen_notify(net, skb, NFT_MSG_NEWGEN);
+	list_splice_init(&nft_net->notify_list, &notify_list);
 	nf_tables_commit_audit_log(&adl, nft_net->base_seq);
 
 	nft_gc_seq_end(nft_net, gc_seq);
 	nft_net->validate_state = NFT_VALIDATE_SKIP;
+	nft_flow_rule_offload_queue(net);
+
+	mutex_lock(&nft_net->notify_mutex);
 	nf_tables_commit_release(net);
 
+	nft_commit_notify(net, NETLINK_CB(skb).portid, &notify_list);
+	mutex_unlock(&nft_net->notify_mutex);
+
 	return 0;
 }
 
@@ -11272,6 +12368,8 @@ static int __nf_tables_abort(struct net *net, enum nfnl_abort_action action)
 	    nf_tables_validate(net) < 0)
 		err = -EAGAIN;
 
+	nft_flow_rule_offload_cancel(net);
+
 	list_for_each_entry_safe_reverse(trans, next, &nft_net->commit_list,
 					 list) {
 		struct nft_table *table = trans->table;
@@ -12022,6 +13120,7 @@ static void __nft_release_table(struct net *net, struct nft_table *table)
 
 	ctx.family = table->family;
 	ctx.table = table;
+	nft_flow_rule_offload_flush(net);
 	list_for_each_entry(chain, &table->chains, list) {
 		if (nft_chain_binding(chain))
 			continue;
@@ -12130,6 +13229,128 @@ static struct notifier_block nft_nl_notifier = {
 	.notifier_call  = nft_rcv_nl_event,
 };
 
+#ifdef CONFIG_PROC_FS
+static int nf_tables_rule_profile_show(struct seq_file *s, void *v)
+{
+	struct nftables_pernet *nft_net = nft_pernet(seq_file_single_net(s));
+	const struct nft_table *table;
+	const struct nft_chain *chain;
+	const struct nft_rule *rule;
+
+	seq_puts(s, "family table chain handle evals cycles\n");
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(table, &nft_net->tables, list) {
+		list_for_each_entry_rcu(chain, &table->chains, list) {
+			list_for_each_entry_rcu(rule, &chain->rules, list) {
+				struct nft_rule_profile __percpu *profile;
+				u64 evals = 0, cycles = 0;
+				int cpu;
+
+				profile = READ_ONCE(rule->profile);
+				if (!profile)
+					continue;
+
+				for_each_possible_cpu(cpu) {
+					const struct nft_rule_profile *p;
+
+					p = per_cpu_ptr(profile, cpu);
+					evals += READ_ONCE(p->evals);
+					cycles += READ_ONCE(p->cycles);
+				}
+
+				seq_printf(s, "%u %s %s %llu %llu %llu\n",
+					   table->family, table->name,
+					   chain->name, (u64)rule->handle,
+					   evals, cycles);
+			}
+		}
+	}
+	rcu_read_unlock();
+
+	return 0;
+}
+
+/* Hardware offload state of the rules, see offload_async */
+static int nf_tables_offload_show(struct seq_file *s, void *v)
+{
+	struct nftables_pernet *nft_net = nft_pernet(seq_file_single_net(s));
+	const struct nft_table *table;
+	const struct nft_chain *chain;
+	const struct nft_rule *rule;
+	const char *state;
+
+	seq_puts(s, "family table chain handle state\n");
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(table, &nft_net->tables, list) {
+		list_for_each_entry_rcu(chain, &table->chains, list) {
+			if (!(chain->flags & NFT_CHAIN_HW_OFFLOAD))
+				continue;
+
+			list_for_each_entry_rcu(rule, &chain->rules, list) {
+				if (rule->hw_pending)
+					state = "pending";
+				else if (rule->hw_failed)
+					state = "failed";
+				else
+					state = "done";
+
+				seq_printf(s, "%u %s %s %llu %s\n",
+					   table->family, table->name,
+					   chain->name, (u64)rule->handle,
+					   state);
+			}
+		}
+	}
+	rcu_read_unlock();
+
+	return 0;
+}
+
+static int nf_tables_set_prefilter_show(struct seq_file *s, void *v)
+{
+	struct nftables_pernet *nft_net = nft_pernet(seq_file_single_net(s));
+	const struct nft_table *table;
+	const struct nft_set *set;
+
+	seq_puts(s, "family table set blocks keys checked rejected "
+		    "false_positives\n");
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(table, &nft_net->tables, list) {
+		list_for_each_entry_rcu(set, &table->sets, list) {
+			struct nft_set_prefilter_stats __percpu *stats;
+			const struct nft_set_prefilter *pf;
+			u64 checked = 0, rejected = 0, fp = 0;
+			int cpu;
+
+			stats = READ_ONCE(set->prefilter_stats);
+			if (!stats)
+				continue;
+
+			for_each_possible_cpu(cpu) {
+				const struct nft_set_prefilter_stats *st;
+
+				st = per_cpu_ptr(stats, cpu);
+				checked += READ_ONCE(st->checked);
+				rejected += READ_ONCE(st->rejected);
+				fp += READ_ONCE(st->false_positives);
+			}
+
+			pf = rcu_dereference(set->prefilter);
+			seq_printf(s, "%u %s %s %u %u %llu %llu %llu\n",
+				   table->family, table->name, set->name,
+				   pf ? pf->nblocks : 0, pf ? pf->nkeys : 0,
+				   checked, rejected, fp);
+		}
+	}
+	rcu_read_unlock();
+
+	return 0;
+}
+#endif
+
 static int __net_init nf_tables_init_net(struct net *net)
 {
 	struct nftables_pernet *nft_net = nft_pernet(net);
@@ -12141,13 +13362,47 @@ static int __net_init nf_tables_init_net(struct net *net)
 	INIT_LIST_HEAD(&nft_net->binding_list);
 	INIT_LIST_HEAD(&nft_net->module_list);
 	INIT_LIST_HEAD(&nft_net->notify_list);
+	mutex_init(&nft_net->notify_mutex);
 	mutex_init(&nft_net->commit_mutex);
 	nft_net->base_seq = 1;
+	net->nft.genid = 1;
 	nft_net->gc_seq = 0;
 	nft_net->validate_state = NFT_VALIDATE_SKIP;
 	INIT_WORK(&nft_net->destroy_work, nf_tables_trans_destroy_work);
+	INIT_LIST_HEAD(&nft_net->offload_pending);
+	INIT_LIST_HEAD(&nft_net->offload_list);
+	INIT_WORK(&nft_net->offload_work, nft_flow_rule_offload_work);
+
+#ifdef CONFIG_PROC_FS
+	if (!proc_create_net_single("nf_tables_rule_profile", 0440,
+				    net->proc_net,
+				    nf_tables_rule_profile_show, NULL))
+		return -ENOMEM;
 
+	if (!proc_create_net_single("nf_tables_set_prefilter", 0440,
+				    net->proc_net,
+				    nf_tables_set_prefilter_show, NULL))
+		goto err_prefilter;
+
+	if (!proc_create_net_single("nf_tables_offload", 0440,
+				    net->proc_net,
+				    nf_tables_offload_show, NULL))
+		goto err_offload;
+
+	if (!nft_trace_ring_proc_create(net))
+		goto err_trace;
+#endif
 	return 0;
+
+#ifdef CONFIG_PROC_FS
+err_trace:
+	remove_proc_entry("nf_tables_offload", net->proc_net);
+err_offload:
+	remove_proc_entry("nf_tables_set_prefilter", net->proc_net);
+err_prefilter:
+	remove_proc_entry("nf_tables_rule_profile", net->proc_net);
+	return -ENOMEM;
+#endif
 }
 
 static void __net_exit nf_tables_pre_exit_net(struct net *net)
@@ -12164,6 +13419,14 @@ static void __net_exit nf_tables_exit_net(struct net *net)
 	struct nftables_pernet *nft_net = nft_pernet(net);
 	unsigned int gc_seq;
 
+#ifdef CONFIG_PROC_FS
+	remove_proc_entry("nf_tables_trace", net->proc_net);
+	remove_proc_entry("nf_tables_offload", net->proc_net);
+	remove_proc_entry("nf_tables_set_prefilter", net->proc_net);
+	remove_proc_entry("nf_tables_rule_profile", net->proc_net);
+#endif
+	/* the remaining commands are run by __nft_release_tables() */
+	cancel_work_sync(&nft_net->offload_work);
 	mutex_lock(&nft_net->commit_mutex);
 
 	gc_seq = nft_gc_seq_begin(nft_net);
@@ -12185,6 +13448,7 @@ static void __net_exit nf_tables_exit_net(struct net *net)
 	WARN_ON_ONCE(!list_empty(&nft_net->module_list));
 	WARN_ON_ONCE(!list_empty(&nft_net->notify_list));
 	WARN_ON_ONCE(!list_empty(&nft_net->destroy_list));
+	WARN_ON_ONCE(nft_net->trace_users);
 }
 
 static void nf_tables_exit_batch(struct list_head *net_exit_list)
@@ -12212,10 +13476,15 @@ static int __init nf_tables_module_init(void)
 	BUILD_BUG_ON(offsetof(struct nft_trans_elem, nft_trans) != 0);
 	BUILD_BUG_ON(offsetof(struct nft_trans_obj, nft_trans) != 0);
 	BUILD_BUG_ON(offsetof(struct nft_trans_flowtable, nft_trans) != 0);
+	BUILD_BUG_ON(NFTA_SET_ELEM_LIST_FD <= NFTA_SET_ELEM_LIST_MAX);
+
+	nft_trans_rule_cachep = KMEM_CACHE(nft_trans_rule, 0);
+	if (!nft_trans_rule_cachep)
+		return -ENOMEM;
 
 	err = register_pernet_subsys(&nf_tables_net_ops);
 	if (err < 0)
-		return err;
+		goto err_pernet;
 
 	err = nft_chain_filter_init();
 	if (err < 0)
@@ -12264,6 +13533,8 @@ static int __init nf_tables_module_init(void)
 	nft_chain_filter_fini();
 err_chain_filter:
 	unregister_pernet_subsys(&nf_tables_net_ops);
+err_pernet:
+	kmem_cache_destroy(nft_trans_rule_cachep);
 	return err;
 }
 
@@ -12280,6 +13551,7 @@ static void __exit nf_tables_module_exit(void)
 	rcu_barrier();
 	rhltable_destroy(&nft_objname_ht);
 	nf_tables_core_module_exit();
+	kmem_cache_destroy(nft_trans_rule_cachep);
 }
 
 module_init(nf_tables_module_init);
@@ -9,17 +9,25 @@
 #include <linux/module.h>
 #include <linux/init.h>
 #include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/timex.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
 #include <linux/rculist.h>
+#include <linux/sizes.h>
 #include <linux/skbuff.h>
 #include <linux/netlink.h>
 #include <linux/netfilter.h>
 #include <linux/static_key.h>
+#include <linux/sysctl.h>
 #include <linux/netfilter/nfnetlink.h>
 #include <linux/netfilter/nf_tables.h>
 #include <net/netfilter/nf_tables_core.h>
 #include <net/netfilter/nf_tables.h>
 #include <net/netfilter/nf_log.h>
 #include <net/netfilter/nft_meta.h>
+#include <net/net_namespace.h>
 
 #ifdef CONFIG_MITIGATION_RETPOLINE
 static struct static_key_false nf_tables_skip_direct_calls;
@@ -71,26 +79,48 @@ static inline void nft_trace_copy_nftrace(const struct nft_pktinfo *pkt,
 		info->nf_trace = pkt->skb->nf_trace;
 }
 
-static void nft_bitwise_fast_eval(const struct nft_expr *expr,
-				  struct nft_regs *regs)
+static void __nft_bitwise_fast_eval(const struct nft_bitwise_fast_expr *priv,
+				    struct nft_regs *regs)
 {
-	const struct nft_bitwise_fast_expr *priv = nft_expr_priv(expr);
 	u32 *src = &regs->data[priv->sreg];
 	u32 *dst = &regs->data[priv->dreg];
 
 	*dst = (*src & priv->mask) ^ priv->xor;
 }
 
-static void nft_cmp_fast_eval(const struct nft_expr *expr,
-			      struct nft_regs *regs)
+static void nft_bitwise_fast_eval(const struct nft_expr *expr,
+				  struct nft_regs *regs)
+{
+	__nft_bitwise_fast_eval(nft_expr_priv(expr), regs);
+}
+
+static void nft_bitwise16_fast_eval(const struct nft_expr *expr,
+				    struct nft_regs *regs)
 {
-	const struct nft_cmp_fast_expr *priv = nft_expr_priv(expr);
+	const struct nft_bitwise16_fast_expr *priv = nft_expr_priv(expr);
+	const u64 *src = (const u64 *)&regs->data[priv->sreg];
+	u64 *dst = (u64 *)&regs->data[priv->dreg];
+	const u64 *mask = (const u64 *)&priv->mask;
+	const u64 *xor = (const u64 *)&priv->xor;
+
+	dst[0] = (src[0] & mask[0]) ^ xor[0];
+	dst[1] = (src[1] & mask[1]) ^ xor[1];
+}
 
+static void __nft_cmp_fast_eval(const struct nft_cmp_fast_expr *priv,
+				struct nft_regs *regs)
+{
 	if (((regs->data[priv->sreg] & priv->mask) == priv->data) ^ priv->inv)
 		return;
 	regs->verdict.code = NFT_BREAK;
 }
 
+static void nft_cmp_fast_eval(const struct nft_expr *expr,
+			      struct nft_regs *regs)
+{
+	__nft_cmp_fast_eval(nft_expr_priv(expr), regs);
+}
+
 static void nft_cmp16_fast_eval(const struct nft_expr *expr,
 				struct nft_regs *regs)
 {
@@ -173,6 +203,122 @@ static bool nft_payload_fast_eval(const struct nft_expr *expr,
 	return true;
 }
 
+static void nft_payload_cmp_eval(const struct nft_expr *expr,
+				 struct nft_regs *regs,
+				 const struct nft_pktinfo *pkt)
+{
+	const struct nft_payload_cmp_expr *priv = nft_expr_priv(expr);
+
+	if (!nft_payload_fast_eval(expr, regs, pkt)) {
+		nft_payload_eval(expr, regs, pkt);
+		if (regs->verdict.code != NFT_CONTINUE)
+			return;
+	}
+
+	__nft_cmp_fast_eval(&priv->cmp, regs);
+}
+
+static void nft_meta_lookup_eval(const struct nft_expr *expr,
+				 struct nft_regs *regs,
+				 const struct nft_pktinfo *pkt)
+{
+	const struct nft_meta_lookup_expr *priv = nft_expr_priv(expr);
+
+	nft_meta_get_eval(expr, regs, pkt);
+	if (regs->verdict.code != NFT_CONTINUE)
+		return;
+
+	__nft_lookup_eval(&priv->lookup, regs, pkt);
+}
+
+#if IS_ENABLED(CONFIG_NFT_CT)
+static void nft_ct_state_cmp_eval(const struct nft_expr *expr,
+				  struct nft_regs *regs,
+				  const struct nft_pktinfo *pkt)
+{
+	const struct nft_ct_state_cmp_expr *priv = nft_expr_priv(expr);
+
+	/* never breaks for NFT_CT_STATE */
+	nft_ct_get_fast_eval(expr, regs, pkt);
+	__nft_bitwise_fast_eval(&priv->bitwise, regs);
+	__nft_cmp_fast_eval(&priv->cmp, regs);
+}
+#endif
+
+#define NFT_CLASSIFY_FIELDS_MAX	4
+
+/* A payload or meta expression as found in the rules, laid out so that
+ * it can be passed to their eval functions.
+ */
+struct nft_classify_field {
+	const struct nft_expr_ops	*ops;
+	union {
+		struct nft_payload	payload;
+		struct nft_meta		meta;
+	} __aligned(__alignof__(u64));
+	u32				mask;
+	u8				dreg;
+};
+
+struct nft_classify_entry {
+	const struct nft_rule_dp	*rule;
+	u32				key[NFT_CLASSIFY_FIELDS_MAX];
+};
+
+struct nft_classify {
+	const struct nft_rule_dp	*miss;
+	u32				seed;
+	u32				hmask;
+	unsigned int			nfields;
+	struct nft_classify_field	fields[NFT_CLASSIFY_FIELDS_MAX];
+	struct nft_classify_entry	entries[];
+};
+
+static u32 nft_classify_hash(const struct nft_classify *cls, const u32 *key)
+{
+	return jhash2(key, NFT_CLASSIFY_FIELDS_MAX, cls->seed) & cls->hmask;
+}
+
+/* Returns the first rule of the run that can match, or the rule after
+ * the run.
+ */
+static const struct nft_rule_dp *nft_classify_eval(const struct nft_expr *expr,
+						   struct nft_regs *regs,
+						   const struct nft_pktinfo *pkt)
+{
+	const struct nft_classify_expr *priv = nft_expr_priv(expr);
+	const struct nft_classify *cls = priv->cls;
+	u32 key[NFT_CLASSIFY_FIELDS_MAX] = {};
+	unsigned int i;
+	u32 hash;
+
+	for (i = 0; i < cls->nfields; i++) {
+		const struct nft_classify_field *f = &cls->fields[i];
+		const struct nft_expr *load = (const struct nft_expr *)f;
+
+		if (f->ops != &nft_payload_fast_ops)
+			nft_meta_get_eval(load, regs, pkt);
+		else if (!nft_payload_fast_eval(load, regs, pkt))
+			nft_payload_eval(load, regs, pkt);
+
+		/* none of the rules can match */
+		if (regs->verdict.code != NFT_CONTINUE)
+			return cls->miss;
+
+		key[i] = regs->data[f->dreg] & f->mask;
+	}
+
+	hash = nft_classify_hash(cls, key);
+	while (cls->entries[hash].rule) {
+		if (!memcmp(cls->entries[hash].key, key, sizeof(key)))
+			return cls->entries[hash].rule;
+
+		hash = (hash + 1) & cls->hmask;
+	}
+
+	return cls->miss;
+}
+
 DEFINE_STATIC_KEY_FALSE(nft_counters_enabled);
 
 static noinline void nft_update_chain_stats(const struct nft_chain *chain,
@@ -196,6 +342,8 @@ static noinline void nft_update_chain_stats(const struct nft_chain *chain,
 	}
 }
 
+DEFINE_STATIC_KEY_FALSE(nft_rule_profile_enabled);
+
 struct nft_jumpstack {
 	const struct nft_rule_dp *rule;
 };
@@ -246,6 +394,28 @@ static void expr_call_ops_eval(const struct nft_expr *expr,
              (expr) != (last); \
              (expr) = nft_rule_expr_next(expr))
 
+static noinline void nft_rule_profile_end(const struct nft_rule_dp *rule,
+					  cycles_t start)
+{
+	const struct nft_expr *expr = nft_rule_expr_first(rule);
+	const struct nft_rule_profile_expr *priv;
+
+	if (!rule->dlen || expr->ops != &nft_rule_profile_ops)
+		return;
+
+	priv = nft_expr_priv(expr);
+	this_cpu_inc(priv->profile->evals);
+	this_cpu_add(priv->profile->cycles, get_cycles() - start);
+}
+
+/* The rule blob is interpreted: each expression is dispatched through
+ * its ops, with the most common ones evaluated inline (see above) and
+ * the others called directly when retpolines are in use.  Expressions
+ * may be rewritten when the blob is built at commit time, see
+ * nf_tables_commit_chain_prepare(), but are never compiled to native
+ * code: most of them call into other subsystems (sets, conntrack,
+ * routing) that native code would have to call back into anyway.
+ */
 unsigned int
 nft_do_chain(struct nft_pktinfo *pkt, void *priv)
 {
@@ -259,6 +429,7 @@ nft_do_chain(struct nft_pktinfo *pkt, void *priv)
 	bool genbit = READ_ONCE(net->nft.gencursor);
 	struct nft_rule_blob *blob;
 	struct nft_traceinfo info;
+	cycles_t start = 0;
 
 	info.trace = false;
 	if (static_branch_unlikely(&nft_trace_enabled))
@@ -273,6 +444,9 @@ nft_do_chain(struct nft_pktinfo *pkt, void *priv)
 next_rule:
 	regs.verdict.code = NFT_CONTINUE;
 	for (; !rule->is_last ; rule = nft_rule_next(rule)) {
+		if (static_branch_unlikely(&nft_rule_profile_enabled))
+			start = get_cycles();
+
 		nft_rule_dp_for_each_expr(expr, last, rule) {
 			if (expr->ops == &nft_cmp_fast_ops)
 				nft_cmp_fast_eval(expr, &regs);
@@ -280,14 +454,32 @@ nft_do_chain(struct nft_pktinfo *pkt, void *priv)
 				nft_cmp16_fast_eval(expr, &regs);
 			else if (expr->ops == &nft_bitwise_fast_ops)
 				nft_bitwise_fast_eval(expr, &regs);
-			else if (expr->ops != &nft_payload_fast_ops ||
-				 !nft_payload_fast_eval(expr, &regs, pkt))
+			else if (expr->ops == &nft_bitwise16_fast_ops)
+				nft_bitwise16_fast_eval(expr, &regs);
+			else if (expr->ops == &nft_payload_cmp_ops)
+				nft_payload_cmp_eval(expr, &regs, pkt);
+			else if (expr->ops == &nft_meta_lookup_ops)
+				nft_meta_lookup_eval(expr, &regs, pkt);
+#if IS_ENABLED(CONFIG_NFT_CT)
+			else if (expr->ops == &nft_ct_state_cmp_ops)
+				nft_ct_state_cmp_eval(expr, &regs, pkt);
+#endif
+			else if (expr->ops == &nft_rule_profile_ops)
+				continue;
+			else if (expr->ops == &nft_classify_ops) {
+				rule = nft_classify_eval(expr, &regs, pkt);
+				goto next_rule;
+			} else if (expr->ops != &nft_payload_fast_ops ||
+				   !nft_payload_fast_eval(expr, &regs, pkt))
 				expr_call_ops_eval(expr, &regs, pkt);
 
 			if (regs.verdict.code != NFT_CONTINUE)
 				break;
 		}
 
+		if (static_branch_unlikely(&nft_rule_profile_enabled))
+			nft_rule_profile_end(rule, start);
+
 		switch (regs.verdict.code) {
 		case NFT_BREAK:
 			regs.verdict.code = NFT_CONTINUE;
@@ -347,6 +539,547 @@ nft_do_chain(struct nft_pktinfo *pkt, void *priv)
 }
 EXPORT_SYMBOL_GPL(nft_do_chain);
 
+const struct nft_expr_ops nft_payload_cmp_ops = {
+	.type		= &nft_payload_type,
+	.size		= NFT_EXPR_SIZE(sizeof(struct nft_payload_cmp_expr)),
+	.eval		= NULL, /* inlined */
+};
+
+const struct nft_expr_ops nft_meta_lookup_ops = {
+	.type		= &nft_meta_type,
+	.size		= NFT_EXPR_SIZE(sizeof(struct nft_meta_lookup_expr)),
+	.eval		= NULL, /* inlined */
+};
+
+#if IS_ENABLED(CONFIG_NFT_CT)
+const struct nft_expr_ops nft_ct_state_cmp_ops = {
+	.type		= &nft_cmp_type,
+	.size		= NFT_EXPR_SIZE(sizeof(struct nft_ct_state_cmp_expr)),
+	.eval		= NULL, /* inlined */
+};
+#endif
+
+const struct nft_expr_ops nft_rule_profile_ops = {
+	.type		= &nft_counter_type,
+	.size		= NFT_RULE_PROFILE_SIZE,
+	.eval		= NULL, /* inlined */
+};
+
+/**
+ *	nft_rule_profile_init - write the profile expression of a rule
+ *
+ *	@dst: where to write the expression, NFT_RULE_PROFILE_SIZE bytes
+ *	@rule: rule the expression leads in the blob
+ *
+ *	The counters are allocated along with the first blob built while
+ *	profiling is on and stay with the rule.  Returns the size of the
+ *	expression, 0 if the counters can't be allocated.
+ */
+unsigned int nft_rule_profile_init(void *dst, struct nft_rule *rule)
+{
+	struct nft_rule_profile_expr *priv;
+	struct nft_expr *expr = dst;
+
+	if (!rule->profile) {
+		struct nft_rule_profile __percpu *profile;
+
+		profile = alloc_percpu_gfp(struct nft_rule_profile,
+					   GFP_KERNEL_ACCOUNT);
+		if (!profile)
+			return 0;
+
+		WRITE_ONCE(rule->profile, profile);
+	}
+
+	expr->ops = &nft_rule_profile_ops;
+	priv = nft_expr_priv(expr);
+	priv->profile = rule->profile;
+
+	return NFT_RULE_PROFILE_SIZE;
+}
+
+const struct nft_expr_ops nft_classify_ops = {
+	.type		= &nft_lookup_type,
+	.size		= NFT_EXPR_SIZE(sizeof(struct nft_classify_expr)),
+	.eval		= NULL, /* inlined */
+};
+
+static u8 nft_expr_fusion __read_mostly = 1;
+u8 nft_classify_min_rules __read_mostly = 16;
+unsigned int nft_set_prefilter_min __read_mostly;
+unsigned int nft_set_gc_budget __read_mostly;
+unsigned int nft_counter_fold_ms __read_mostly;
+unsigned int nft_quota_percpu_slack __read_mostly;
+EXPORT_SYMBOL_GPL(nft_quota_percpu_slack);
+u8 nft_fib_cache __read_mostly;
+EXPORT_SYMBOL_GPL(nft_fib_cache);
+
+static const struct nft_expr *nft_expr_fuse_next(const struct nft_expr *expr,
+						 const struct nft_expr *last)
+{
+	expr = nft_expr_next(expr);
+	return expr != last ? expr : NULL;
+}
+
+static bool nft_payload_cmp_fuse(struct nft_expr *fused,
+				 const struct nft_expr *expr,
+				 const struct nft_expr *next)
+{
+	struct nft_payload_cmp_expr *priv = nft_expr_priv(fused);
+	const struct nft_payload *payload = nft_expr_priv(expr);
+	const struct nft_cmp_fast_expr *cmp = nft_expr_priv(next);
+
+	if (expr->ops != &nft_payload_fast_ops ||
+	    next->ops != &nft_cmp_fast_ops ||
+	    cmp->sreg != payload->dreg)
+		return false;
+
+	fused->ops = &nft_payload_cmp_ops;
+	priv->payload = *payload;
+	priv->cmp = *cmp;
+	return true;
+}
+
+static bool nft_meta_lookup_fuse(struct nft_expr *fused,
+				 const struct nft_expr *expr,
+				 const struct nft_expr *next)
+{
+	struct nft_meta_lookup_expr *priv = nft_expr_priv(fused);
+	const struct nft_meta *meta = nft_expr_priv(expr);
+	const struct nft_lookup *lookup = nft_expr_priv(next);
+
+	if (expr->ops->eval != nft_meta_get_eval ||
+	    next->ops->eval != nft_lookup_eval ||
+	    lookup->sreg != meta->dreg)
+		return false;
+
+	fused->ops = &nft_meta_lookup_ops;
+	priv->meta = *meta;
+	priv->lookup = *lookup;
+	return true;
+}
+
+#if IS_ENABLED(CONFIG_NFT_CT)
+static bool nft_ct_state_cmp_fuse(struct nft_expr *fused,
+				  const struct nft_expr *expr,
+				  const struct nft_expr *next,
+				  const struct nft_expr *last)
+{
+	struct nft_ct_state_cmp_expr *priv = nft_expr_priv(fused);
+	const struct nft_bitwise_fast_expr *bitwise;
+	const struct nft_cmp_fast_expr *cmp;
+	const struct nft_ct *ct;
+
+	if (expr->ops->eval != nft_ct_get_fast_eval ||
+	    next->ops != &nft_bitwise_fast_ops)
+		return false;
+
+	ct = nft_expr_priv(expr);
+	bitwise = nft_expr_priv(next);
+	if (ct->key != NFT_CT_STATE || bitwise->sreg != ct->dreg)
+		return false;
+
+	next = nft_expr_fuse_next(next, last);
+	if (!next || next->ops != &nft_cmp_fast_ops)
+		return false;
+
+	cmp = nft_expr_priv(next);
+	if (cmp->sreg != bitwise->dreg)
+		return false;
+
+	fused->ops = &nft_ct_state_cmp_ops;
+	priv->ct = *ct;
+	priv->bitwise = *bitwise;
+	priv->cmp = *cmp;
+	return true;
+}
+#endif
+
+/**
+ *	nft_expr_fuse - fuse expressions of a rule into a single one
+ *
+ *	@dst: where to write the fused expression
+ *	@expr: first expression, updated to the last one fused
+ *	@last: end of the rule
+ *
+ *	Called when the rule blob is built, the fused expression is
+ *	evaluated in one step by nft_do_chain().  Only ever writes to @dst
+ *	as many bytes as taken by the expressions fused.
+ *
+ *	Returns the size of the fused expression, or 0 if @expr doesn't
+ *	start a sequence that can be fused.
+ */
+unsigned int nft_expr_fuse(void *dst, const struct nft_expr **expr,
+			   const struct nft_expr *last)
+{
+	const struct nft_expr *next;
+	struct nft_expr *fused = dst;
+
+	BUILD_BUG_ON(NFT_EXPR_SIZE(sizeof(struct nft_payload_cmp_expr)) >
+		     NFT_EXPR_SIZE(sizeof(struct nft_payload)) +
+		     NFT_EXPR_SIZE(sizeof(struct nft_cmp_fast_expr)));
+	BUILD_BUG_ON(NFT_EXPR_SIZE(sizeof(struct nft_meta_lookup_expr)) >
+		     NFT_EXPR_SIZE(sizeof(struct nft_meta)) +
+		     NFT_EXPR_SIZE(sizeof(struct nft_lookup)));
+	BUILD_BUG_ON(NFT_EXPR_SIZE(sizeof(struct nft_ct_state_cmp_expr)) >
+		     NFT_EXPR_SIZE(sizeof(struct nft_ct)) +
+		     NFT_EXPR_SIZE(sizeof(struct nft_bitwise_fast_expr)) +
+		     NFT_EXPR_SIZE(sizeof(struct nft_cmp_fast_expr)));
+
+	if (!READ_ONCE(nft_expr_fusion))
+		return 0;
+
+	next = nft_expr_fuse_next(*expr, last);
+	if (!next)
+		return 0;
+
+	if (nft_payload_cmp_fuse(fused, *expr, next) ||
+	    nft_meta_lookup_fuse(fused, *expr, next)) {
+		*expr = next;
+		return fused->ops->size;
+	}
+
+#if IS_ENABLED(CONFIG_NFT_CT)
+	if (nft_ct_state_cmp_fuse(fused, *expr, next, last)) {
+		*expr = nft_expr_next(next);
+		return fused->ops->size;
+	}
+#endif
+	return 0;
+}
+
+/* Rules taken into a classifier match on payload or meta fields with
+ * equality only, and then always end the chain: counters and a
+ * terminal verdict.  Within a run of such rules matching on the same
+ * fields, the first rule that matches is thus the first one whose
+ * values are those of the packet, and no rule matches if there is no
+ * such rule.
+ */
+static unsigned int nft_classify_parse(const struct nft_rule *rule,
+				       struct nft_classify_field *fields,
+				       u32 *key)
+{
+	const struct nft_expr *expr, *last, *next;
+	const struct nft_immediate_expr *imm;
+	bool counted = false;
+	unsigned int n = 0;
+
+	memset(fields, 0, sizeof(*fields) * NFT_CLASSIFY_FIELDS_MAX);
+	memset(key, 0, sizeof(*key) * NFT_CLASSIFY_FIELDS_MAX);
+
+	nft_rule_for_each_expr(expr, last, rule) {
+		const struct nft_cmp_fast_expr *cmp;
+
+		if (expr->ops == &nft_payload_fast_ops ||
+		    (expr->ops->eval == nft_meta_get_eval &&
+		     ((const struct nft_meta *)nft_expr_priv(expr))->key != NFT_META_PRANDOM)) {
+			/* counters must not see packets failing a later field */
+			if (counted)
+				return 0;
+
+			next = nft_expr_next(expr);
+			if (n == NFT_CLASSIFY_FIELDS_MAX || next == last ||
+			    next->ops != &nft_cmp_fast_ops)
+				return 0;
+
+			cmp = nft_expr_priv(next);
+			if (cmp->inv)
+				return 0;
+
+			fields[n].ops = expr->ops;
+			if (expr->ops == &nft_payload_fast_ops) {
+				fields[n].payload = *(const struct nft_payload *)nft_expr_priv(expr);
+				fields[n].dreg = fields[n].payload.dreg;
+			} else {
+				fields[n].meta = *(const struct nft_meta *)nft_expr_priv(expr);
+				fields[n].dreg = fields[n].meta.dreg;
+			}
+
+			if (cmp->sreg != fields[n].dreg)
+				return 0;
+
+			fields[n].mask = cmp->mask;
+			key[n++] = cmp->data;
+			expr = next;
+			continue;
+		}
+
+		if (!n)
+			return 0;
+
+		if (expr->ops->eval == nft_counter_eval) {
+			counted = true;
+			continue;
+		}
+
+		if (expr->ops->eval != nft_immediate_eval ||
+		    nft_expr_next(expr) != last)
+			return 0;
+
+		imm = nft_expr_priv(expr);
+		if (imm->dreg != NFT_REG_VERDICT)
+			return 0;
+
+		switch (imm->data.verdict.code) {
+		case NF_ACCEPT:
+		case NF_DROP:
+		case NFT_GOTO:
+		case NFT_RETURN:
+			return n;
+		}
+		return 0;
+	}
+
+	return 0;
+}
+
+/**
+ *	nft_classify_run - count the rules that can be taken into a classifier
+ *
+ *	@net: net namespace
+ *	@chain: chain the rules are in
+ *	@rule: first rule
+ *	@min: minimum number of rules for a classifier, 0 for none
+ *
+ *	Returns the number of next generation rules starting at @rule that
+ *	match on the same fields and that a single lookup can decide on, 0
+ *	if those are less than @min.
+ */
+unsigned int nft_classify_run(const struct net *net,
+			      const struct nft_chain *chain,
+			      const struct nft_rule *rule, unsigned int min)
+{
+	struct nft_classify_field fields[NFT_CLASSIFY_FIELDS_MAX];
+	struct nft_classify_field f[NFT_CLASSIFY_FIELDS_MAX];
+	u32 key[NFT_CLASSIFY_FIELDS_MAX];
+	unsigned int n, nrules = 0;
+
+	BUILD_BUG_ON(offsetof(struct nft_classify_field, payload) !=
+		     offsetof(struct nft_expr, data));
+
+	if (!min)
+		return 0;
+
+	n = nft_classify_parse(rule, fields, key);
+	if (!n)
+		return 0;
+
+	list_for_each_entry_from(rule, &chain->rules, list) {
+		if (!nft_is_active_next(net, rule))
+			continue;
+
+		if (nft_classify_parse(rule, f, key) != n ||
+		    memcmp(f, fields, sizeof(fields)))
+			break;
+
+		nrules++;
+	}
+
+	return nrules >= min ? nrules : 0;
+}
+
+static unsigned int nft_classify_slots(unsigned int nrules)
+{
+	return roundup_pow_of_two(2 * nrules);
+}
+
+size_t nft_classify_size(unsigned int nrules)
+{
+	struct nft_classify *cls;
+
+	return ALIGN(struct_size(cls, entries, nft_classify_slots(nrules)),
+		     __alignof__(struct nft_classify));
+}
+
+/**
+ *	nft_classify_init - set up a classifier for a run of rules
+ *
+ *	@data: where to write the classifier rule, NFT_CLASSIFY_RULE_SIZE bytes
+ *	@table: nft_classify_size() bytes for the lookup table
+ *	@rule: first rule of the run
+ *	@nrules: as returned by nft_classify_run()
+ *
+ *	The rules of the run are then added with nft_classify_add() as
+ *	they are written to the blob.
+ */
+struct nft_classify *nft_classify_init(void *data, void *table,
+				       const struct nft_rule *rule,
+				       unsigned int nrules)
+{
+	struct nft_rule_dp *prule = data;
+	struct nft_classify *cls = table;
+	struct nft_classify_expr *priv;
+	struct nft_expr *expr;
+	u32 key[NFT_CLASSIFY_FIELDS_MAX];
+
+	memset(cls, 0, nft_classify_size(nrules));
+	cls->nfields = nft_classify_parse(rule, cls->fields, key);
+	cls->hmask = nft_classify_slots(nrules) - 1;
+	cls->seed = get_random_u32();
+
+	prule->is_last = 0;
+	prule->handle = 0;
+	prule->dlen = NFT_EXPR_SIZE(sizeof(*priv));
+
+	expr = (struct nft_expr *)prule->data;
+	expr->ops = &nft_classify_ops;
+	priv = nft_expr_priv(expr);
+	priv->cls = cls;
+
+	return cls;
+}
+
+void nft_classify_add(struct nft_classify *cls, const struct nft_rule *rule,
+		      const struct nft_rule_dp *prule)
+{
+	struct nft_classify_field fields[NFT_CLASSIFY_FIELDS_MAX];
+	u32 key[NFT_CLASSIFY_FIELDS_MAX];
+	u32 hash;
+
+	nft_classify_parse(rule, fields, key);
+
+	hash = nft_classify_hash(cls, key);
+	while (cls->entries[hash].rule) {
+		/* same values as an earlier rule: never reached */
+		if (!memcmp(cls->entries[hash].key, key, sizeof(key)))
+			return;
+
+		hash = (hash + 1) & cls->hmask;
+	}
+
+	cls->entries[hash].rule = prule;
+	memcpy(cls->entries[hash].key, key, sizeof(key));
+}
+
+void nft_classify_done(struct nft_classify *cls,
+		       const struct nft_rule_dp *miss)
+{
+	cls->miss = miss;
+}
+
+/* A jump from the last rule of a chain returns to the end of the chain,
+ * i.e. it is a goto and doesn't need a jump stack slot.  Only called on
+ * the copy in the rule blob.
+ */
+void nft_expr_tail_call(struct nft_expr *expr)
+{
+	struct nft_immediate_expr *priv = nft_expr_priv(expr);
+
+	if (expr->ops->eval != nft_immediate_eval ||
+	    priv->dreg != NFT_REG_VERDICT)
+		return;
+
+	if (priv->data.verdict.code == NFT_JUMP)
+		priv->data.verdict.code = NFT_GOTO;
+}
+
+u8 nft_chain_depth __read_mostly = NFT_JUMP_STACK_SIZE;
+
+#ifdef CONFIG_SYSCTL
+static unsigned int nft_chain_depth_min = NFT_JUMP_STACK_SIZE;
+static unsigned int nft_chain_depth_max = NFT_CHAIN_DEPTH_MAX;
+static unsigned int nft_quota_percpu_slack_max = SZ_16M;
+
+static u8 nft_rule_profile __read_mostly;
+static DEFINE_MUTEX(nft_rule_profile_mutex);
+
+static int nft_rule_profile_sysctl(const struct ctl_table *table, int write,
+				   void *buffer, size_t *lenp, loff_t *ppos)
+{
+	int ret;
+
+	mutex_lock(&nft_rule_profile_mutex);
+	ret = proc_dou8vec_minmax(table, write, buffer, lenp, ppos);
+	if (ret < 0 || !write)
+		goto out;
+
+	if (nft_rule_profile)
+		static_branch_enable(&nft_rule_profile_enabled);
+	else
+		static_branch_disable(&nft_rule_profile_enabled);
+out:
+	mutex_unlock(&nft_rule_profile_mutex);
+	return ret;
+}
+
+static struct ctl_table nft_core_sysctl_table[] = {
+	{
+		.procname	= "nf_tables_expr_fusion",
+		.data		= &nft_expr_fusion,
+		.maxlen		= sizeof(u8),
+		.mode		= 0644,
+		.proc_handler	= proc_dou8vec_minmax,
+		.extra1		= SYSCTL_ZERO,
+		.extra2		= SYSCTL_ONE,
+	},
+	{
+		.procname	= "nf_tables_classify_min_rules",
+		.data		= &nft_classify_min_rules,
+		.maxlen		= sizeof(u8),
+		.mode		= 0644,
+		.proc_handler	= proc_dou8vec_minmax,
+	},
+	{
+		.procname	= "nf_tables_chain_depth",
+		.data		= &nft_chain_depth,
+		.maxlen		= sizeof(u8),
+		.mode		= 0644,
+		.proc_handler	= proc_dou8vec_minmax,
+		.extra1		= &nft_chain_depth_min,
+		.extra2		= &nft_chain_depth_max,
+	},
+	{
+		.procname	= "nf_tables_rule_profile",
+		.data		= &nft_rule_profile,
+		.maxlen		= sizeof(u8),
+		.mode		= 0644,
+		.proc_handler	= nft_rule_profile_sysctl,
+		.extra1		= SYSCTL_ZERO,
+		.extra2		= SYSCTL_ONE,
+	},
+	{
+		.procname	= "nf_tables_set_prefilter_min",
+		.data		= &nft_set_prefilter_min,
+		.maxlen		= sizeof(unsigned int),
+		.mode		= 0644,
+		.proc_handler	= proc_douintvec,
+	},
+	{
+		.procname	= "nf_tables_set_gc_budget",
+		.data		= &nft_set_gc_budget,
+		.maxlen		= sizeof(unsigned int),
+		.mode		= 0644,
+		.proc_handler	= proc_douintvec,
+	},
+	{
+		.procname	= "nf_tables_counter_fold_ms",
+		.data		= &nft_counter_fold_ms,
+		.maxlen		= sizeof(unsigned int),
+		.mode		= 0644,
+		.proc_handler	= proc_douintvec,
+	},
+	{
+		.procname	= "nf_tables_quota_percpu_slack",
+		.data		= &nft_quota_percpu_slack,
+		.maxlen		= sizeof(unsigned int),
+		.mode		= 0644,
+		.proc_handler	= proc_douintvec_minmax,
+		.extra2		= &nft_quota_percpu_slack_max,
+	},
+	{
+		.procname	= "nf_tables_fib_cache",
+		.data		= &nft_fib_cache,
+		.maxlen		= sizeof(u8),
+		.mode		= 0644,
+		.proc_handler	= proc_dou8vec_minmax,
+		.extra1		= SYSCTL_ZERO,
+		.extra2		= SYSCTL_ONE,
+	},
+};
+
+static struct ctl_table_header *nft_core_sysctl_header;
+#endif
+
 static struct nft_expr_type *nft_basic_types[] = {
 	&nft_imm_type,
 	&nft_cmp_type,
@@ -390,6 +1123,14 @@ int __init nf_tables_core_module_init(void)
 			goto err;
 	}
 
+#ifdef CONFIG_SYSCTL
+	nft_core_sysctl_header = register_net_sysctl(&init_net, "net/netfilter",
+						     nft_core_sysctl_table);
+	if (!nft_core_sysctl_header) {
+		err = -ENOMEM;
+		goto err;
+	}
+#endif
 	nf_skip_indirect_calls_enable();
 
 	return 0;
@@ -408,6 +1149,10 @@ void nf_tables_core_module_exit(void)
 {
 	int i;
 
+#ifdef CONFIG_SYSCTL
+	unregister_net_sysctl_table(nft_core_sysctl_header);
+#endif
+
 	i = ARRAY_SIZE(nft_basic_types);
 	while (i-- > 0)
 		nft_unregister_expr(nft_basic_types[i]);
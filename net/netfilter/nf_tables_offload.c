@@ -4,9 +4,23 @@
 #include <linux/netfilter.h>
 #include <net/flow_offload.h>
 #include <net/netfilter/nf_tables.h>
+#include <net/netfilter/nf_tables_core.h>
 #include <net/netfilter/nf_tables_offload.h>
 #include <net/pkt_cls.h>
 
+static bool offload_async __read_mostly;
+module_param(offload_async, bool, 0644);
+MODULE_PARM_DESC(offload_async,
+		 "Push rules to hardware after the commit, from a work queue");
+
+struct nft_flow_rule_cmd {
+	struct list_head	list;
+	const struct nft_chain	*chain;
+	struct nft_rule		*rule;
+	struct nft_flow_rule	*flow;
+	enum flow_cls_command	command;
+};
+
 static struct nft_flow_rule *nft_flow_rule_alloc(int num_actions)
 {
 	struct nft_flow_rule *flow;
@@ -45,6 +59,89 @@ void nft_flow_rule_set_addr_type(struct nft_flow_rule *flow,
 		offsetof(struct nft_flow_key, control);
 }
 
+/* A rule looking up a set is offloaded as one flow rule per element of the
+ * set: the flow rule built from the rule is a template, its match on the
+ * key of the set is filled in from each element, and so is its verdict for
+ * a verdict map.  These flow rules are identified by their element, hence
+ * a set can only be offloaded through a single rule.
+ */
+int nft_flow_rule_set_lookup(struct nft_offload_ctx *ctx,
+			     struct nft_flow_rule *flow, struct nft_set *set,
+			     u8 sreg, bool verdict)
+{
+	struct nft_offload_reg *reg = &ctx->regs[sreg];
+	u8 *mask = (u8 *)&flow->match.mask;
+
+	if (flow->set || !reg->len || reg->len != set->klen ||
+	    reg->flags & NFT_OFFLOAD_F_NETWORK2HOST)
+		return -EOPNOTSUPP;
+
+	/* exact matches only */
+	if (set->flags & (NFT_SET_INTERVAL | NFT_SET_CONCAT | NFT_SET_TIMEOUT |
+			  NFT_SET_EVAL | NFT_SET_OBJECT) ||
+	    (set->flags & NFT_SET_MAP && !verdict) ||
+	    set->use > 1 || !list_empty(&set->catchall_list))
+		return -EOPNOTSUPP;
+
+	flow->set = set;
+	flow->set_reg = *reg;
+	flow->set_action = verdict ? ctx->num_actions++ : -1;
+
+	memcpy(mask + reg->offset, &reg->mask, reg->len);
+	flow->match.dissector.used_keys |= BIT_ULL(reg->key);
+	flow->match.dissector.offset[reg->key] = reg->base_offset;
+
+	return 0;
+}
+
+static int nft_flow_rule_set_elem(struct nft_flow_rule *flow,
+				  const struct nft_set_ext *ext)
+{
+	const struct nft_offload_reg *reg = &flow->set_reg;
+	struct flow_action_entry *entry;
+	u8 *key = (u8 *)&flow->match.key;
+
+	if (nft_set_ext_exists(ext, NFT_SET_EXT_FLAGS) &&
+	    *nft_set_ext_flags(ext) & NFT_SET_ELEM_CATCHALL)
+		return -EOPNOTSUPP;
+
+	memcpy(key + reg->offset, nft_set_ext_key(ext), reg->len);
+
+	if (flow->set_action < 0)
+		return 0;
+
+	entry = &flow->rule->action.entries[flow->set_action];
+	switch (nft_set_ext_data(ext)->verdict.code) {
+	case NF_ACCEPT:
+		entry->id = FLOW_ACTION_ACCEPT;
+		break;
+	case NF_DROP:
+		entry->id = FLOW_ACTION_DROP;
+		break;
+	default:
+		return -EOPNOTSUPP;
+	}
+
+	return 0;
+}
+
+/* The set an offloaded rule looks up, if any */
+static struct nft_set *nft_flow_rule_set(const struct nft_rule *rule)
+{
+	const struct nft_lookup *priv;
+	struct nft_expr *expr, *next;
+
+	nft_rule_for_each_expr(expr, next, rule) {
+		if (expr->ops->type != &nft_lookup_type)
+			continue;
+
+		priv = nft_expr_priv(expr);
+		return priv->set;
+	}
+
+	return NULL;
+}
+
 struct nft_offload_ethertype {
 	__be16 value;
 	__be16 mask;
@@ -148,6 +245,9 @@ void nft_flow_rule_destroy(struct nft_flow_rule *flow)
 	struct flow_action_entry *entry;
 	int i;
 
+	if (!flow)
+		return;
+
 	flow_action_for_each(i, entry, &flow->rule->action) {
 		switch (entry->id) {
 		case FLOW_ACTION_REDIRECT:
@@ -245,7 +345,7 @@ bool nft_chain_offload_support(const struct nft_base_chain *basechain)
 
 static void nft_flow_cls_offload_setup(struct flow_cls_offload *cls_flow,
 				       const struct nft_base_chain *basechain,
-				       const struct nft_rule *rule,
+				       unsigned long cookie,
 				       const struct nft_flow_rule *flow,
 				       struct netlink_ext_ack *extack,
 				       enum flow_cls_command command)
@@ -260,7 +360,7 @@ static void nft_flow_cls_offload_setup(struct flow_cls_offload *cls_flow,
 	nft_flow_offload_common_init(&cls_flow->common, proto,
 				     basechain->ops.priority, extack);
 	cls_flow->command = command;
-	cls_flow->cookie = (unsigned long) rule;
+	cls_flow->cookie = cookie;
 	if (flow)
 		cls_flow->rule = flow->rule;
 }
@@ -278,21 +378,133 @@ static int nft_flow_offload_cmd(const struct nft_chain *chain,
 		return -EOPNOTSUPP;
 
 	basechain = nft_base_chain(chain);
-	nft_flow_cls_offload_setup(cls_flow, basechain, rule, flow, &extack,
-				   command);
+	nft_flow_cls_offload_setup(cls_flow, basechain, (unsigned long)rule,
+				   flow, &extack, command);
 
 	return nft_setup_cb_call(TC_SETUP_CLSFLOWER, cls_flow,
 				 &basechain->flow_block.cb_list);
 }
 
+static int nft_flow_offload_set_elem(const struct nft_base_chain *basechain,
+				     struct list_head *cb_list,
+				     struct nft_flow_rule *flow,
+				     const struct nft_set *set,
+				     const struct nft_elem_priv *elem_priv,
+				     enum flow_cls_command command,
+				     struct flow_cls_offload *cls_flow)
+{
+	struct netlink_ext_ack extack = {};
+	int err;
+
+	if (flow) {
+		err = nft_flow_rule_set_elem(flow,
+					     nft_set_elem_ext(set, elem_priv));
+		if (err < 0)
+			return err;
+	}
+
+	nft_flow_cls_offload_setup(cls_flow, basechain,
+				   (unsigned long)elem_priv, flow, &extack,
+				   command);
+
+	return nft_setup_cb_call(TC_SETUP_CLSFLOWER, cls_flow, cb_list);
+}
+
+struct nft_flow_set_walk {
+	struct nft_set_iter		iter;
+	const struct nft_base_chain	*basechain;
+	struct list_head		*cb_list;
+	const struct nft_rule		*rule;
+	struct nft_flow_rule		*flow;
+	enum flow_cls_command		command;
+};
+
+static int nft_flow_set_walk_elem(const struct nft_ctx *ctx,
+				  struct nft_set *set,
+				  const struct nft_set_iter *iter,
+				  struct nft_elem_priv *elem_priv)
+{
+	const struct nft_flow_set_walk *walk;
+	struct flow_cls_offload cls_flow = {};
+	struct nft_expr *expr, *next;
+	int err;
+
+	walk = container_of(iter, struct nft_flow_set_walk, iter);
+	if (!nft_set_elem_active(nft_set_elem_ext(set, elem_priv),
+				 iter->genmask))
+		return 0;
+
+	err = nft_flow_offload_set_elem(walk->basechain, walk->cb_list,
+					walk->flow, set, elem_priv,
+					walk->command, &cls_flow);
+	/* remove as many flow rules as possible */
+	if (walk->command == FLOW_CLS_DESTROY)
+		return 0;
+	if (err < 0 || walk->command != FLOW_CLS_STATS)
+		return err;
+
+	nft_rule_for_each_expr(expr, next, walk->rule) {
+		if (expr->ops->offload_stats)
+			expr->ops->offload_stats(expr, &cls_flow.stats);
+	}
+
+	return 0;
+}
+
+/* Run @command for the flow rules of the elements of @set active in
+ * @genmask.
+ */
+static int nft_flow_offload_set(const struct nft_base_chain *basechain,
+				struct list_head *cb_list,
+				const struct nft_rule *rule,
+				struct nft_set *set,
+				struct nft_flow_rule *flow,
+				enum flow_cls_command command, u8 genmask)
+{
+	struct nft_flow_set_walk walk = {
+		.iter = {
+			.genmask	= genmask,
+			.type		= NFT_ITER_READ,
+			.fn		= nft_flow_set_walk_elem,
+		},
+		.basechain	= basechain,
+		.cb_list	= cb_list,
+		.rule		= rule,
+		.flow		= flow,
+		.command	= command,
+	};
+	struct nft_ctx ctx = {
+		.net	= read_pnet(&set->net),
+		.family	= set->table->family,
+		.table	= set->table,
+	};
+
+	set->ops->walk(&ctx, set, &walk.iter);
+
+	return walk.iter.err;
+}
+
 static int nft_flow_offload_rule(const struct nft_chain *chain,
 				 struct nft_rule *rule,
 				 struct nft_flow_rule *flow,
-				 enum flow_cls_command command)
+				 enum flow_cls_command command, u8 genmask)
 {
+	struct nft_base_chain *basechain;
 	struct flow_cls_offload cls_flow;
+	struct nft_set *set;
+
+	set = flow ? flow->set : nft_flow_rule_set(rule);
+	if (!set)
+		return nft_flow_offload_cmd(chain, rule, flow, command,
+					    &cls_flow);
+
+	if (!nft_is_base_chain(chain))
+		return -EOPNOTSUPP;
+
+	basechain = nft_base_chain(chain);
 
-	return nft_flow_offload_cmd(chain, rule, flow, command, &cls_flow);
+	return nft_flow_offload_set(basechain, &basechain->flow_block.cb_list,
+				    rule, set, flow, command, genmask);
 }
 
 int nft_flow_rule_stats(const struct nft_chain *chain,
@@ -300,8 +512,20 @@ int nft_flow_rule_stats(const struct nft_chain *chain,
 {
 	struct flow_cls_offload cls_flow = {};
 	struct nft_expr *expr, *next;
+	struct nft_set *set;
 	int err;
 
+	set = nft_flow_rule_set(rule);
+	if (set) {
+		if (!nft_is_base_chain(chain))
+			return -EOPNOTSUPP;
+
+		return nft_flow_offload_set(nft_base_chain(chain),
+					    &nft_base_chain(chain)->flow_block.cb_list,
+					    rule, set, NULL, FLOW_CLS_STATS,
+					    nft_genmask_cur(read_pnet(&set->net)));
+	}
+
 	err = nft_flow_offload_cmd(chain, rule, NULL, FLOW_CLS_STATS,
 				   &cls_flow);
 	if (err < 0)
@@ -330,11 +554,21 @@ static int nft_flow_offload_unbind(struct flow_block_offload *bo,
 	struct netlink_ext_ack extack;
 	struct nft_chain *chain;
 	struct nft_rule *rule;
+	struct nft_set *set;
 
 	chain = &basechain->chain;
 	list_for_each_entry(rule, &chain->rules, list) {
+		set = nft_flow_rule_set(rule);
+		if (set) {
+			nft_flow_offload_set(basechain, &bo->cb_list, rule, set,
+					     NULL, FLOW_CLS_DESTROY,
+					     nft_genmask_cur(bo->net));
+			continue;
+		}
+
 		memset(&extack, 0, sizeof(extack));
-		nft_flow_cls_offload_setup(&cls_flow, basechain, rule, NULL,
+		nft_flow_cls_offload_setup(&cls_flow, basechain,
+					   (unsigned long)rule, NULL,
 					   &extack, FLOW_CLS_DESTROY);
 		nft_setup_cb_call(TC_SETUP_CLSFLOWER, &cls_flow, &bo->cb_list);
 	}
@@ -513,8 +747,202 @@ static int nft_flow_offload_chain(struct nft_chain *chain, u8 *ppolicy,
 	return nft_flow_block_chain(basechain, NULL, cmd);
 }
 
+/* Elements added to or removed from a set that is offloaded through a rule
+ * already in hardware, and staying there.  The flow rules of the elements
+ * of a rule added or removed in the same transaction are taken care of
+ * along with the rule.
+ */
+static int nft_flow_offload_set_elems(struct net *net, struct nft_trans *trans,
+				      enum flow_cls_command command)
+{
+	struct nft_trans_elem *te = nft_trans_container_elem(trans);
+	struct flow_cls_offload cls_flow;
+	struct nft_base_chain *basechain;
+	struct nft_set *set = te->set;
+	struct nft_set_binding *binding;
+	struct nft_flow_rule *flow = NULL;
+	struct nft_rule *rule = NULL;
+	unsigned int i;
+	int err = 0;
+
+	list_for_each_entry(binding, &set->bindings, list) {
+		if (!nft_is_base_chain(binding->chain) ||
+		    !(binding->chain->flags & NFT_CHAIN_HW_OFFLOAD))
+			continue;
+
+		list_for_each_entry(rule, &binding->chain->rules, list) {
+			if (nft_is_active(net, rule) &&
+			    nft_is_active_next(net, rule) &&
+			    nft_flow_rule_set(rule) == set)
+				goto found;
+		}
+	}
+	return 0;
+
+found:
+	basechain = nft_base_chain(binding->chain);
+	if (command == FLOW_CLS_REPLACE) {
+		flow = nft_flow_rule_create(net, rule);
+		if (IS_ERR(flow))
+			return PTR_ERR(flow);
+	}
+
+	for (i = 0; i < te->nelems; i++) {
+		if (te->elems[i].update)
+			continue;
+
+		err = nft_flow_offload_set_elem(basechain,
+						&basechain->flow_block.cb_list,
+						flow, set, te->elems[i].priv,
+						command, &cls_flow);
+		if (err < 0 && command == FLOW_CLS_REPLACE)
+			break;
+		err = 0;
+	}
+
+	if (flow)
+		nft_flow_rule_destroy(flow);
+
+	return err;
+}
+
+/* With offload_async, rules that don't look up a set are not handed to
+ * drivers while the transaction is committed: the commands are queued on
+ * offload_pending, and moved to offload_list once the new generation is
+ * in place.  The software path takes care of the packets until then.
+ * Set rules and set elements depend on the generation mask at the time
+ * of the commit, they are still done synchronously.
+ */
+static bool nft_flow_rule_deferred(bool async, const struct nft_rule *rule)
+{
+	return async && !nft_flow_rule_set(rule);
+}
+
+static int nft_flow_rule_offload_defer(struct net *net,
+				       const struct nft_chain *chain,
+				       struct nft_rule *rule,
+				       struct nft_flow_rule *flow,
+				       enum flow_cls_command command)
+{
+	struct nftables_pernet *nft_net = nft_pernet(net);
+	struct nft_flow_rule_cmd *cmd;
+
+	cmd = kzalloc(sizeof(*cmd), GFP_KERNEL_ACCOUNT);
+	if (!cmd)
+		return -ENOMEM;
+
+	cmd->chain = chain;
+	cmd->rule = rule;
+	cmd->flow = flow;
+	cmd->command = command;
+	list_add_tail(&cmd->list, &nft_net->offload_pending);
+
+	if (command == FLOW_CLS_REPLACE) {
+		rule->hw_pending = 1;
+		rule->hw_failed = 0;
+	}
+
+	return 0;
+}
+
+static void nft_flow_rule_cmd_free(struct nft_flow_rule_cmd *cmd)
+{
+	list_del(&cmd->list);
+	if (cmd->flow)
+		nft_flow_rule_destroy(cmd->flow);
+	kfree(cmd);
+}
+
+/* Drop the pending commands of a rule that is gone before reaching the
+ * hardware: added and deleted in the same transaction, or part of a chain
+ * that is unbound.
+ */
+static void nft_flow_rule_offload_drop(struct net *net,
+				       const struct nft_chain *chain,
+				       const struct nft_rule *rule)
+{
+	struct nftables_pernet *nft_net = nft_pernet(net);
+	struct nft_flow_rule_cmd *cmd, *next;
+
+	list_for_each_entry_safe(cmd, next, &nft_net->offload_pending, list) {
+		if (cmd->chain != chain || (rule && cmd->rule != rule))
+			continue;
+
+		cmd->rule->hw_pending = 0;
+		nft_flow_rule_cmd_free(cmd);
+	}
+}
+
+static void nft_flow_rule_offload_run(struct nft_flow_rule_cmd *cmd)
+{
+	struct flow_cls_offload cls_flow;
+	int err;
+
+	err = nft_flow_offload_cmd(cmd->chain, cmd->rule, cmd->flow,
+				   cmd->command, &cls_flow);
+	if (cmd->command == FLOW_CLS_REPLACE) {
+		cmd->rule->hw_pending = 0;
+		cmd->rule->hw_failed = err < 0;
+	}
+}
+
+/* Run the queued commands, in the order of the transactions they come
+ * from.  The caller holds the commit mutex: the rules and chains of the
+ * commands can't go away while they are run, nft_flow_rule_offload_flush()
+ * is called before any of them is released.
+ */
+static void __nft_flow_rule_offload_flush(struct nftables_pernet *nft_net)
+{
+	struct nft_flow_rule_cmd *cmd, *next;
+
+	list_for_each_entry_safe(cmd, next, &nft_net->offload_list, list) {
+		nft_flow_rule_offload_run(cmd);
+		nft_flow_rule_cmd_free(cmd);
+		cond_resched();
+	}
+}
+
+void nft_flow_rule_offload_flush(struct net *net)
+{
+	__nft_flow_rule_offload_flush(nft_pernet(net));
+}
+
+void nft_flow_rule_offload_work(struct work_struct *work)
+{
+	struct nftables_pernet *nft_net;
+
+	nft_net = container_of(work, struct nftables_pernet, offload_work);
+
+	mutex_lock(&nft_net->commit_mutex);
+	__nft_flow_rule_offload_flush(nft_net);
+	mutex_unlock(&nft_net->commit_mutex);
+}
+
+/* Called once the transaction can't be aborted anymore. */
+void nft_flow_rule_offload_queue(struct net *net)
+{
+	struct nftables_pernet *nft_net = nft_pernet(net);
+
+	if (list_empty(&nft_net->offload_pending))
+		return;
+
+	list_splice_tail_init(&nft_net->offload_pending, &nft_net->offload_list);
+	queue_work(system_unbound_wq, &nft_net->offload_work);
+}
+
+void nft_flow_rule_offload_cancel(struct net *net)
+{
+	struct nftables_pernet *nft_net = nft_pernet(net);
+	struct nft_flow_rule_cmd *cmd, *next;
+
+	list_for_each_entry_safe(cmd, next, &nft_net->offload_pending, list) {
+		cmd->rule->hw_pending = 0;
+		nft_flow_rule_cmd_free(cmd);
+	}
+}
+
 static void nft_flow_rule_offload_abort(struct net *net,
-					struct nft_trans *trans)
+					struct nft_trans *trans, bool async)
 {
 	struct nftables_pernet *nft_net = nft_pernet(net);
 	int err = 0;
@@ -540,21 +968,33 @@ static void nft_flow_rule_offload_abort(struct net *net,
 						     FLOW_BLOCK_BIND);
 			break;
 		case NFT_MSG_NEWRULE:
-			if (!(nft_trans_rule_chain(trans)->flags & NFT_CHAIN_HW_OFFLOAD))
+			if (!(nft_trans_rule_chain(trans)->flags & NFT_CHAIN_HW_OFFLOAD) ||
+			    nft_flow_rule_deferred(async, nft_trans_rule(trans)))
 				continue;
 
 			err = nft_flow_offload_rule(nft_trans_rule_chain(trans),
 						    nft_trans_rule(trans),
-						    NULL, FLOW_CLS_DESTROY);
+						    NULL, FLOW_CLS_DESTROY,
+						    nft_genmask_next(net));
 			break;
 		case NFT_MSG_DELRULE:
-			if (!(nft_trans_rule_chain(trans)->flags & NFT_CHAIN_HW_OFFLOAD))
+			if (!(nft_trans_rule_chain(trans)->flags & NFT_CHAIN_HW_OFFLOAD) ||
+			    nft_flow_rule_deferred(async, nft_trans_rule(trans)))
 				continue;
 
 			err = nft_flow_offload_rule(nft_trans_rule_chain(trans),
 						    nft_trans_rule(trans),
 						    nft_trans_flow_rule(trans),
-						    FLOW_CLS_REPLACE);
+						    FLOW_CLS_REPLACE,
+						    nft_genmask_cur(net));
+			break;
+		case NFT_MSG_NEWSETELEM:
+			err = nft_flow_offload_set_elems(net, trans,
+							 FLOW_CLS_DESTROY);
+			break;
+		case NFT_MSG_DELSETELEM:
+			err = nft_flow_offload_set_elems(net, trans,
+							 FLOW_CLS_REPLACE);
 			break;
 		}
 
@@ -566,10 +1006,15 @@ static void nft_flow_rule_offload_abort(struct net *net,
 int nft_flow_rule_offload_commit(struct net *net)
 {
 	struct nftables_pernet *nft_net = nft_pernet(net);
+	bool async = READ_ONCE(offload_async);
 	struct nft_trans *trans;
+	struct nft_rule *rule;
 	int err = 0;
 	u8 policy;
 
+	/* the rules of the previous transactions go first */
+	__nft_flow_rule_offload_flush(nft_net);
+
 	list_for_each_entry(trans, &nft_net->commit_list, list) {
 		if (trans->table->family != NFPROTO_NETDEV)
 			continue;
@@ -588,6 +1033,9 @@ int nft_flow_rule_offload_commit(struct net *net)
 			if (!(nft_trans_chain(trans)->flags & NFT_CHAIN_HW_OFFLOAD))
 				continue;
 
+			/* unbinding removes all the rules of the chain */
+			nft_flow_rule_offload_drop(net, nft_trans_chain(trans),
+						   NULL);
 			policy = nft_trans_chain_policy(trans);
 			err = nft_flow_offload_chain(nft_trans_chain(trans), &policy,
 						     FLOW_BLOCK_UNBIND);
@@ -601,23 +1049,60 @@ int nft_flow_rule_offload_commit(struct net *net)
 				err = -EOPNOTSUPP;
 				break;
 			}
+
+			rule = nft_trans_rule(trans);
+			if (nft_flow_rule_deferred(async, rule)) {
+				err = nft_flow_rule_offload_defer(net,
+								  nft_trans_rule_chain(trans),
+								  rule,
+								  nft_trans_flow_rule(trans),
+								  FLOW_CLS_REPLACE);
+				/* now owned by the command */
+				if (!err)
+					nft_trans_flow_rule(trans) = NULL;
+				break;
+			}
 			err = nft_flow_offload_rule(nft_trans_rule_chain(trans),
 						    nft_trans_rule(trans),
 						    nft_trans_flow_rule(trans),
-						    FLOW_CLS_REPLACE);
+						    FLOW_CLS_REPLACE,
+						    nft_genmask_next(net));
 			break;
 		case NFT_MSG_DELRULE:
 			if (!(nft_trans_rule_chain(trans)->flags & NFT_CHAIN_HW_OFFLOAD))
 				continue;
 
+			rule = nft_trans_rule(trans);
+			if (nft_flow_rule_deferred(async, rule)) {
+				if (!nft_is_active(net, rule)) {
+					nft_flow_rule_offload_drop(net,
+								   nft_trans_rule_chain(trans),
+								   rule);
+					break;
+				}
+				err = nft_flow_rule_offload_defer(net,
+								  nft_trans_rule_chain(trans),
+								  rule, NULL,
+								  FLOW_CLS_DESTROY);
+				break;
+			}
 			err = nft_flow_offload_rule(nft_trans_rule_chain(trans),
 						    nft_trans_rule(trans),
-						    NULL, FLOW_CLS_DESTROY);
+						    NULL, FLOW_CLS_DESTROY,
+						    nft_genmask_cur(net));
+			break;
+		case NFT_MSG_NEWSETELEM:
+			err = nft_flow_offload_set_elems(net, trans,
+							 FLOW_CLS_REPLACE);
+			break;
+		case NFT_MSG_DELSETELEM:
+			err = nft_flow_offload_set_elems(net, trans,
+							 FLOW_CLS_DESTROY);
 			break;
 		}
 
 		if (err) {
-			nft_flow_rule_offload_abort(net, trans);
+			nft_flow_rule_offload_abort(net, trans, async);
 			break;
 		}
 	}
@@ -11,6 +11,9 @@
 #include <linux/if_vlan.h>
 #include <linux/init.h>
 #include <linux/skbuff.h>
+#include <linux/seq_file.h>
+#include <linux/proc_fs.h>
+#include <linux/log2.h>
 #include <linux/netlink.h>
 #include <linux/netfilter.h>
 #include <linux/netfilter/nfnetlink.h>
@@ -26,6 +29,39 @@
 DEFINE_STATIC_KEY_FALSE(nft_trace_enabled);
 EXPORT_SYMBOL_GPL(nft_trace_enabled);
 
+static unsigned int trace_sample __read_mostly;
+module_param(trace_sample, uint, 0644);
+MODULE_PARM_DESC(trace_sample,
+		 "Trace one in N of the packets with nftrace set (default: all)");
+
+static unsigned int trace_ring __read_mostly;
+module_param(trace_ring, uint, 0444);
+MODULE_PARM_DESC(trace_ring,
+		 "Trace records kept per cpu instead of netlink events (default: 0, use netlink)");
+
+/* serialises the allocation and release of the rings of all netns */
+static DEFINE_MUTEX(nft_trace_ring_mutex);
+
+#define NFT_TRACE_RING_MAX	(1U << 16)
+
+/* Compact form of a trace event, chain and rule are identified by their
+ * handle.
+ */
+struct nft_trace_record {
+	u64	chain;
+	u64	rule;
+	u32	id;
+	s32	verdict;
+	u8	type;
+	u8	nfproto;
+};
+
+struct nft_trace_ring {
+	atomic_long_t		head;
+	unsigned int		mask;
+	struct nft_trace_record	rec[];
+};
+
 static int trace_fill_header(struct sk_buff *nlskb, u16 type,
 			     const struct sk_buff *skb,
 			     int off, unsigned int len)
@@ -167,10 +203,9 @@ static int nf_trace_fill_pkt_info(struct sk_buff *nlskb,
 				 skb, off, len);
 }
 
-static int nf_trace_fill_rule_info(struct sk_buff *nlskb,
-				   const struct nft_verdict *verdict,
-				   const struct nft_rule_dp *rule,
-				   const struct nft_traceinfo *info)
+static u64 nf_trace_rule_handle(const struct nft_verdict *verdict,
+				const struct nft_rule_dp *rule,
+				const struct nft_traceinfo *info)
 {
 	if (!rule || rule->is_last)
 		return 0;
@@ -184,8 +219,21 @@ static int nf_trace_fill_rule_info(struct sk_buff *nlskb,
 	    verdict->code == NFT_CONTINUE)
 		return 0;
 
+	return rule->handle;
+}
+
+static int nf_trace_fill_rule_info(struct sk_buff *nlskb,
+				   const struct nft_verdict *verdict,
+				   const struct nft_rule_dp *rule,
+				   const struct nft_traceinfo *info)
+{
+	u64 handle = nf_trace_rule_handle(verdict, rule, info);
+
+	if (!handle)
+		return 0;
+
 	return nla_put_be64(nlskb, NFTA_TRACE_RULE_HANDLE,
-			    cpu_to_be64(rule->handle),
+			    cpu_to_be64(handle),
 			    NFTA_TRACE_PAD);
 }
 
@@ -230,11 +278,40 @@ static const struct nft_chain *nft_trace_get_chain(const struct nft_rule_dp *rul
 	return last->chain;
 }
 
+/* Nothing is allocated nor copied from the packet: the record is
+ * overwritten once the ring of the cpu has wrapped around, and may be
+ * read while being written.
+ */
+static void nft_trace_ring_record(struct nft_trace_ring **rings,
+				  const struct nft_pktinfo *pkt,
+				  const struct nft_verdict *verdict,
+				  const struct nft_rule_dp *rule,
+				  const struct nft_traceinfo *info)
+{
+	struct nft_trace_ring *ring = rings[raw_smp_processor_id()];
+	struct nft_trace_record *rec;
+	unsigned long head;
+
+	head = atomic_long_inc_return(&ring->head) - 1;
+	rec = &ring->rec[head & ring->mask];
+
+	rec->chain = nft_trace_get_chain(rule, info)->handle;
+	rec->rule = nf_trace_rule_handle(verdict, rule, info);
+	rec->id = info->skbid;
+	rec->type = info->type;
+	rec->nfproto = nft_pf(pkt);
+	if (info->type == NFT_TRACETYPE_POLICY)
+		rec->verdict = info->basechain->policy;
+	else
+		rec->verdict = verdict->code;
+}
+
 void nft_trace_notify(const struct nft_pktinfo *pkt,
 		      const struct nft_verdict *verdict,
 		      const struct nft_rule_dp *rule,
 		      struct nft_traceinfo *info)
 {
+	struct nft_trace_ring **rings;
 	const struct nft_chain *chain;
 	struct nlmsghdr *nlh;
 	struct sk_buff *skb;
@@ -242,6 +319,12 @@ void nft_trace_notify(const struct nft_pktinfo *pkt,
 	u32 mark = 0;
 	u16 event;
 
+	rings = rcu_dereference(nft_pernet(nft_net(pkt))->trace_ring);
+	if (rings) {
+		nft_trace_ring_record(rings, pkt, verdict, rule, info);
+		return;
+	}
+
 	if (!nfnetlink_has_listeners(nft_net(pkt), NFNLGRP_NFTRACE))
 		return;
 
@@ -359,6 +442,7 @@ void nft_trace_init(struct nft_traceinfo *info, const struct nft_pktinfo *pkt,
 		    const struct nft_chain *chain)
 {
 	static siphash_key_t trace_key __read_mostly;
+	unsigned int sample = READ_ONCE(trace_sample);
 	struct sk_buff *skb = pkt->skb;
 
 	info->basechain = nft_base_chain(chain);
@@ -372,4 +456,207 @@ void nft_trace_init(struct nft_traceinfo *info, const struct nft_pktinfo *pkt,
 					skb_get_hash_net(nft_net(pkt), skb),
 					skb->skb_iif,
 					&trace_key);
+
+	/* all the events of a packet, or none */
+	if (sample > 1 && reciprocal_scale(info->skbid, sample))
+		info->trace = false;
+}
+
+static void nft_trace_ring_free(struct nft_trace_ring **rings)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		kvfree(rings[cpu]);
+	kfree(rings);
+}
+
+/* The rings of a netns only exist while rules set nftrace in it: they are
+ * allocated with the first of these rules and released with the last.
+ */
+int nft_trace_ring_get(struct net *net)
+{
+	struct nftables_pernet *nft_net = nft_pernet(net);
+	unsigned int size = READ_ONCE(trace_ring);
+	struct nft_trace_ring **rings;
+	int cpu, err = 0;
+
+	mutex_lock(&nft_trace_ring_mutex);
+	if (nft_net->trace_users++ || !size)
+		goto out;
+
+	size = roundup_pow_of_two(min(size, NFT_TRACE_RING_MAX));
+
+	err = -ENOMEM;
+	rings = kcalloc(nr_cpu_ids, sizeof(*rings), GFP_KERNEL_ACCOUNT);
+	if (!rings)
+		goto err_rings;
+
+	for_each_possible_cpu(cpu) {
+		struct nft_trace_ring *ring;
+
+		ring = kvzalloc_node(struct_size(ring, rec, size),
+				     GFP_KERNEL_ACCOUNT, cpu_to_node(cpu));
+		if (!ring)
+			goto err_alloc;
+
+		ring->mask = size - 1;
+		rings[cpu] = ring;
+	}
+
+	rcu_assign_pointer(nft_net->trace_ring, rings);
+	err = 0;
+out:
+	mutex_unlock(&nft_trace_ring_mutex);
+	return err;
+
+err_alloc:
+	nft_trace_ring_free(rings);
+err_rings:
+	nft_net->trace_users--;
+	mutex_unlock(&nft_trace_ring_mutex);
+	return err;
+}
+
+void nft_trace_ring_put(struct net *net)
+{
+	struct nftables_pernet *nft_net = nft_pernet(net);
+	struct nft_trace_ring **rings;
+
+	mutex_lock(&nft_trace_ring_mutex);
+	if (--nft_net->trace_users) {
+		mutex_unlock(&nft_trace_ring_mutex);
+		return;
+	}
+
+	rings = rcu_dereference_protected(nft_net->trace_ring,
+					  lockdep_is_held(&nft_trace_ring_mutex));
+	RCU_INIT_POINTER(nft_net->trace_ring, NULL);
+	mutex_unlock(&nft_trace_ring_mutex);
+
+	if (!rings)
+		return;
+
+	/* packets traced and readers of the rings are done with them */
+	synchronize_rcu();
+	nft_trace_ring_free(rings);
+}
+
+/* The rings are walked a record at a time, each cpu from its oldest
+ * record up to the head seen when the walk reached it.
+ */
+struct nft_trace_iter {
+	struct seq_net_private	p;
+	loff_t			pos;
+	int			cpu;
+	unsigned long		i;
+	unsigned long		end;
+};
+
+static void nft_trace_iter_cpu(struct nft_trace_iter *it,
+			       struct nft_trace_ring **rings, int cpu)
+{
+	it->cpu = cpu;
+	if (cpu >= nr_cpu_ids)
+		return;
+
+	it->end = atomic_long_read(&rings[cpu]->head);
+	it->i = it->end > rings[cpu]->mask ?
+		it->end - rings[cpu]->mask - 1 : 0;
+}
+
+static const struct nft_trace_record *
+nft_trace_iter_get(struct nft_trace_iter *it, struct nft_trace_ring **rings)
+{
+	while (it->cpu < nr_cpu_ids) {
+		const struct nft_trace_ring *ring = rings[it->cpu];
+
+		if (it->i != it->end)
+			return &ring->rec[it->i & ring->mask];
+
+		nft_trace_iter_cpu(it, rings,
+				   cpumask_next(it->cpu, cpu_possible_mask));
+	}
+
+	return NULL;
+}
+
+static void *nft_trace_seq_start(struct seq_file *s, loff_t *pos)
+	__acquires(RCU)
+{
+	struct nft_trace_ring **rings;
+	struct nft_trace_iter *it = s->private;
+	loff_t n;
+
+	rcu_read_lock();
+	if (!*pos)
+		return SEQ_START_TOKEN;
+
+	rings = rcu_dereference(nft_pernet(seq_file_net(s))->trace_ring);
+	if (!rings)
+		return NULL;
+
+	/* restarted somewhere else than where the last read stopped */
+	if (*pos != it->pos) {
+		nft_trace_iter_cpu(it, rings, cpumask_first(cpu_possible_mask));
+		for (n = 1; n < *pos && nft_trace_iter_get(it, rings); n++)
+			it->i++;
+		it->pos = *pos;
+	}
+
+	return (void *)nft_trace_iter_get(it, rings);
+}
+
+static void *nft_trace_seq_next(struct seq_file *s, void *v, loff_t *pos)
+{
+	struct nft_trace_ring **rings;
+	struct nft_trace_iter *it = s->private;
+
+	rings = rcu_dereference(nft_pernet(seq_file_net(s))->trace_ring);
+	it->pos = ++*pos;
+	if (!rings)
+		return NULL;
+
+	if (v == SEQ_START_TOKEN)
+		nft_trace_iter_cpu(it, rings, cpumask_first(cpu_possible_mask));
+	else
+		it->i++;
+
+	return (void *)nft_trace_iter_get(it, rings);
+}
+
+static void nft_trace_seq_stop(struct seq_file *s, void *v)
+	__releases(RCU)
+{
+	rcu_read_unlock();
+}
+
+static int nft_trace_seq_show(struct seq_file *s, void *v)
+{
+	const struct nft_trace_iter *it = s->private;
+	const struct nft_trace_record *rec = v;
+
+	if (v == SEQ_START_TOKEN) {
+		seq_puts(s, "cpu id nfproto chain rule type verdict\n");
+		return 0;
+	}
+
+	seq_printf(s, "%d %08x %u %llu %llu %u %d\n",
+		   it->cpu, rec->id, rec->nfproto, rec->chain,
+		   rec->rule, rec->type, rec->verdict);
+	return 0;
+}
+
+static const struct seq_operations nft_trace_seq_ops = {
+	.start	= nft_trace_seq_start,
+	.next	= nft_trace_seq_next,
+	.stop	= nft_trace_seq_stop,
+	.show	= nft_trace_seq_show,
+};
+
+bool nft_trace_ring_proc_create(struct net *net)
+{
+	return proc_create_net("nf_tables_trace", 0440, net->proc_net,
+			       &nft_trace_seq_ops,
+			       sizeof(struct nft_trace_iter));
 }
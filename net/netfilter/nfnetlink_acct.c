@@ -14,6 +14,7 @@
 #include <linux/slab.h>
 #include <linux/types.h>
 #include <linux/errno.h>
+#include <linux/u64_stats_sync.h>
 #include <net/netlink.h>
 #include <net/sock.h>
 #include <net/netns/generic.h>
@@ -26,9 +27,21 @@ MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Pablo Neira Ayuso <pablo@netfilter.org>");
 MODULE_DESCRIPTION("nfacct: Extended Netfilter accounting infrastructure");
 
+/* Counters are per cpu and folded when dumped.  With a quota, every cpu
+ * accumulates up to @slack packets or bytes in @pending before adding them
+ * to the shared @used, which is what the quota is checked against, along
+ * with the pending amount of the local cpu.
+ */
+struct nf_acct_cpu {
+	u64_stats_t		pkts;
+	u64_stats_t		bytes;
+	u64			pending;
+};
+
 struct nf_acct {
-	atomic64_t		pkts;
-	atomic64_t		bytes;
+	struct nf_acct_cpu __percpu *cpu;
+	atomic64_t		used;
+	u32			slack;
 	unsigned long		flags;
 	struct list_head	head;
 	refcount_t		refcnt;
@@ -56,12 +69,87 @@ static inline struct nfnl_acct_net *nfnl_acct_pernet(struct net *net)
 #define NFACCT_F_QUOTA (NFACCT_F_QUOTA_PKTS | NFACCT_F_QUOTA_BYTES)
 #define NFACCT_OVERQUOTA_BIT	2	/* NFACCT_F_OVERQUOTA */
 
+/* upper bounds of the slack, which is also kept under 1/16 of the quota
+ * across all cpus.
+ */
+#define NFACCT_SLACK_PKTS	32
+#define NFACCT_SLACK_BYTES	(64 * 1024)
+
+static DEFINE_PER_CPU(struct u64_stats_sync, nfnl_acct_sync);
+/* serializes folding and resetting the counters */
+static DEFINE_SPINLOCK(nfnl_acct_reset_lock);
+
+static void nfnl_acct_fetch(const struct nf_acct *acct, u64 *pkts, u64 *bytes)
+{
+	const struct nf_acct_cpu *this_cpu;
+	u64 p, b;
+	unsigned int seq;
+	int cpu;
+
+	*pkts = 0;
+	*bytes = 0;
+	for_each_possible_cpu(cpu) {
+		struct u64_stats_sync *sync = per_cpu_ptr(&nfnl_acct_sync, cpu);
+
+		this_cpu = per_cpu_ptr(acct->cpu, cpu);
+		do {
+			seq = u64_stats_fetch_begin(sync);
+			p = u64_stats_read(&this_cpu->pkts);
+			b = u64_stats_read(&this_cpu->bytes);
+		} while (u64_stats_fetch_retry(sync, seq));
+
+		*pkts += p;
+		*bytes += b;
+	}
+}
+
+/* Subtract what was folded from the local cpu, the sum is what counts. */
+static void nfnl_acct_sub(struct nf_acct *acct, u64 pkts, u64 bytes)
+{
+	struct u64_stats_sync *sync;
+	struct nf_acct_cpu *this_cpu;
+
+	local_bh_disable();
+	this_cpu = this_cpu_ptr(acct->cpu);
+	sync = this_cpu_ptr(&nfnl_acct_sync);
+
+	u64_stats_update_begin(sync);
+	u64_stats_add(&this_cpu->pkts, -pkts);
+	u64_stats_add(&this_cpu->bytes, -bytes);
+	u64_stats_update_end(sync);
+
+	local_bh_enable();
+}
+
+static void nfnl_acct_reset(struct nf_acct *acct, u64 *pkts, u64 *bytes)
+{
+	int cpu;
+
+	spin_lock_bh(&nfnl_acct_reset_lock);
+	nfnl_acct_fetch(acct, pkts, bytes);
+	nfnl_acct_sub(acct, *pkts, *bytes);
+	for_each_possible_cpu(cpu)
+		WRITE_ONCE(per_cpu_ptr(acct->cpu, cpu)->pending, 0);
+	atomic64_set(&acct->used, 0);
+	spin_unlock_bh(&nfnl_acct_reset_lock);
+}
+
+static void nfnl_acct_free_rcu(struct rcu_head *head)
+{
+	struct nf_acct *acct = container_of(head, struct nf_acct, rcu_head);
+
+	free_percpu(acct->cpu);
+	kfree(acct);
+}
+
 static int nfnl_acct_new(struct sk_buff *skb, const struct nfnl_info *info,
 			 const struct nlattr * const tb[])
 {
 	struct nfnl_acct_net *nfnl_acct_net = nfnl_acct_pernet(info->net);
 	struct nf_acct *nfacct, *matching = NULL;
+	struct nf_acct_cpu *this_cpu;
 	unsigned int size = 0;
+	u64 pkts, bytes;
 	char *acct_name;
 	u32 flags = 0;
 
@@ -86,8 +174,7 @@ static int nfnl_acct_new(struct sk_buff *skb, const struct nfnl_info *info,
 	if (matching) {
 		if (info->nlh->nlmsg_flags & NLM_F_REPLACE) {
 			/* reset counters if you request a replacement. */
-			atomic64_set(&matching->pkts, 0);
-			atomic64_set(&matching->bytes, 0);
+			nfnl_acct_reset(matching, &pkts, &bytes);
 			smp_mb__before_atomic();
 			/* reset overquota flag if quota is enabled. */
 			if ((matching->flags & NFACCT_F_QUOTA))
@@ -116,23 +203,38 @@ static int nfnl_acct_new(struct sk_buff *skb, const struct nfnl_info *info,
 	if (nfacct == NULL)
 		return -ENOMEM;
 
+	nfacct->cpu = alloc_percpu(struct nf_acct_cpu);
+	if (nfacct->cpu == NULL) {
+		kfree(nfacct);
+		return -ENOMEM;
+	}
+
 	if (flags & NFACCT_F_QUOTA) {
 		u64 *quota = (u64 *)nfacct->data;
 
 		*quota = be64_to_cpu(nla_get_be64(tb[NFACCT_QUOTA]));
 		nfacct->flags = flags;
+		nfacct->slack = min_t(u64, div_u64(*quota, 16 * num_possible_cpus()),
+				      flags & NFACCT_F_QUOTA_PKTS ?
+				      NFACCT_SLACK_PKTS : NFACCT_SLACK_BYTES);
 	}
 
 	nla_strscpy(nfacct->name, tb[NFACCT_NAME], NFACCT_NAME_MAX);
 
+	this_cpu = raw_cpu_ptr(nfacct->cpu);
 	if (tb[NFACCT_BYTES]) {
-		atomic64_set(&nfacct->bytes,
-			     be64_to_cpu(nla_get_be64(tb[NFACCT_BYTES])));
+		u64_stats_set(&this_cpu->bytes,
+			      be64_to_cpu(nla_get_be64(tb[NFACCT_BYTES])));
 	}
 	if (tb[NFACCT_PKTS]) {
-		atomic64_set(&nfacct->pkts,
-			     be64_to_cpu(nla_get_be64(tb[NFACCT_PKTS])));
+		u64_stats_set(&this_cpu->pkts,
+			      be64_to_cpu(nla_get_be64(tb[NFACCT_PKTS])));
 	}
+	/* restored objects keep their quota progress */
+	if (flags & NFACCT_F_QUOTA)
+		atomic64_set(&nfacct->used, flags & NFACCT_F_QUOTA_PKTS ?
+			     u64_stats_read(&this_cpu->pkts) :
+			     u64_stats_read(&this_cpu->bytes));
 	refcount_set(&nfacct->refcnt, 1);
 	list_add_tail_rcu(&nfacct->head, &nfnl_acct_net->nfnl_acct_list);
 	return 0;
@@ -158,14 +260,12 @@ nfnl_acct_fill_info(struct sk_buff *skb, u32 portid, u32 seq, u32 type,
 
 	old_flags = acct->flags;
 	if (type == NFNL_MSG_ACCT_GET_CTRZERO) {
-		pkts = atomic64_xchg(&acct->pkts, 0);
-		bytes = atomic64_xchg(&acct->bytes, 0);
+		nfnl_acct_reset(acct, &pkts, &bytes);
 		smp_mb__before_atomic();
 		if (acct->flags & NFACCT_F_QUOTA)
 			clear_bit(NFACCT_OVERQUOTA_BIT, &acct->flags);
 	} else {
-		pkts = atomic64_read(&acct->pkts);
-		bytes = atomic64_read(&acct->bytes);
+		nfnl_acct_fetch(acct, &pkts, &bytes);
 	}
 	if (nla_put_be64(skb, NFACCT_PKTS, cpu_to_be64(pkts),
 			 NFACCT_PAD) ||
@@ -333,7 +433,7 @@ static int nfnl_acct_try_del(struct nf_acct *cur)
 	if (refcount_dec_if_one(&cur->refcnt)) {
 		/* We are protected by nfnl mutex. */
 		list_del_rcu(&cur->head);
-		kfree_rcu(cur, rcu_head);
+		call_rcu(&cur->rcu_head, nfnl_acct_free_rcu);
 	} else {
 		ret = -EBUSY;
 	}
@@ -444,7 +544,7 @@ EXPORT_SYMBOL_GPL(nfnl_acct_find_get);
 void nfnl_acct_put(struct nf_acct *acct)
 {
 	if (refcount_dec_and_test(&acct->refcnt))
-		kfree_rcu(acct, rcu_head);
+		call_rcu(&acct->rcu_head, nfnl_acct_free_rcu);
 
 	module_put(THIS_MODULE);
 }
@@ -452,8 +552,28 @@ EXPORT_SYMBOL_GPL(nfnl_acct_put);
 
 void nfnl_acct_update(const struct sk_buff *skb, struct nf_acct *nfacct)
 {
-	atomic64_inc(&nfacct->pkts);
-	atomic64_add(skb->len, &nfacct->bytes);
+	struct u64_stats_sync *sync;
+	struct nf_acct_cpu *this_cpu;
+
+	local_bh_disable();
+	this_cpu = this_cpu_ptr(nfacct->cpu);
+	sync = this_cpu_ptr(&nfnl_acct_sync);
+
+	u64_stats_update_begin(sync);
+	u64_stats_inc(&this_cpu->pkts);
+	u64_stats_add(&this_cpu->bytes, skb->len);
+	u64_stats_update_end(sync);
+
+	if (nfacct->flags & NFACCT_F_QUOTA) {
+		this_cpu->pending += nfacct->flags & NFACCT_F_QUOTA_PKTS ?
+				     1 : skb->len;
+		if (this_cpu->pending >= nfacct->slack) {
+			atomic64_add(this_cpu->pending, &nfacct->used);
+			this_cpu->pending = 0;
+		}
+	}
+
+	local_bh_enable();
 }
 EXPORT_SYMBOL_GPL(nfnl_acct_update);
 
@@ -486,8 +606,7 @@ int nfnl_acct_overquota(struct net *net, struct nf_acct *nfacct)
 		return NFACCT_NO_QUOTA;
 
 	quota = (u64 *)nfacct->data;
-	now = (nfacct->flags & NFACCT_F_QUOTA_PKTS) ?
-	       atomic64_read(&nfacct->pkts) : atomic64_read(&nfacct->bytes);
+	now = atomic64_read(&nfacct->used) + this_cpu_read(nfacct->cpu->pending);
 
 	ret = now > *quota;
 
@@ -516,7 +635,7 @@ static void __net_exit nfnl_acct_net_exit(struct net *net)
 		list_del_rcu(&cur->head);
 
 		if (refcount_dec_and_test(&cur->refcnt))
-			kfree_rcu(cur, rcu_head);
+			call_rcu(&cur->rcu_head, nfnl_acct_free_rcu);
 	}
 }
 
@@ -554,6 +673,7 @@ static void __exit nfnl_acct_exit(void)
 {
 	nfnetlink_subsys_unregister(&nfnl_acct_subsys);
 	unregister_pernet_subsys(&nfnl_acct_ops);
+	rcu_barrier(); /* Wait for completion of call_rcu()'s */
 }
 
 module_init(nfnl_acct_init);
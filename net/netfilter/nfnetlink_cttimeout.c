@@ -137,10 +137,13 @@ static int cttimeout_new_timeout(struct sk_buff *skb,
 			    matching->timeout.l4proto->l4proto != l4num)
 				return -EINVAL;
 
-			return ctnl_timeout_parse_policy(&matching->timeout.data,
-							 matching->timeout.l4proto,
-							 info->net,
-							 cda[CTA_TIMEOUT_DATA]);
+			ret = ctnl_timeout_parse_policy(&matching->timeout.data,
+							matching->timeout.l4proto,
+							info->net,
+							cda[CTA_TIMEOUT_DATA]);
+			/* conntracks may have copied the old values */
+			nf_ct_timeout_bump_genid();
+			return ret;
 		}
 
 		return -EBUSY;
@@ -674,6 +677,7 @@ static void __exit cttimeout_exit(void)
 	RCU_INIT_POINTER(nf_ct_timeout_hook, NULL);
 
 	nf_ct_iterate_destroy(untimeout, NULL);
+	nf_ct_timeout_bump_genid();
 }
 
 module_init(cttimeout_init);
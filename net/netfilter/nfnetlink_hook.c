@@ -19,6 +19,7 @@
 
 #include <linux/netfilter/nfnetlink.h>
 #include <linux/netfilter/nfnetlink_hook.h>
+#include <linux/netfilter/nfnetlink_hook_stats.h>
 
 #include <net/netfilter/nf_tables.h>
 #include <net/sock.h>
@@ -153,11 +154,29 @@ static int nfnl_hook_put_nft_chain_info(struct sk_buff *nlskb,
 	return -EMSGSIZE;
 }
 
+static int nfnl_hook_put_stats(struct sk_buff *nlskb,
+			       const struct nf_hook_entries *e, unsigned int i)
+{
+#ifdef CONFIG_NETFILTER_HOOK_STATS
+	struct nf_hook_entry_stats sum;
+
+	nf_hook_entry_stats_get(e, i, &sum);
+
+	if (nla_put_be64(nlskb, NFNLA_HOOK_PACKETS, cpu_to_be64(sum.packets),
+			 NFNLA_HOOK_PAD) ||
+	    nla_put_be64(nlskb, NFNLA_HOOK_CYCLES, cpu_to_be64(sum.cycles),
+			 NFNLA_HOOK_PAD))
+		return -EMSGSIZE;
+#endif
+	return 0;
+}
+
 static int nfnl_hook_dump_one(struct sk_buff *nlskb,
 			      const struct nfnl_dump_hook_data *ctx,
-			      const struct nf_hook_ops *ops,
+			      const struct nf_hook_entries *e, unsigned int i,
 			      int family, unsigned int seq)
 {
+	const struct nf_hook_ops *ops = nf_hook_entries_get_hook_ops(e)[i];
 	u16 event = nfnl_msg_type(NFNL_SUBSYS_HOOK, NFNL_MSG_HOOK_GET);
 	unsigned int portid = NETLINK_CB(nlskb).portid;
 	struct nlmsghdr *nlh;
@@ -213,6 +232,10 @@ static int nfnl_hook_dump_one(struct sk_buff *nlskb,
 	if (ret)
 		goto nla_put_failure;
 
+	ret = nfnl_hook_put_stats(nlskb, e, i);
+	if (ret)
+		goto nla_put_failure;
+
 	switch (ops->hook_ops_type) {
 	case NF_HOOK_OP_NF_TABLES:
 		ret = nfnl_hook_put_nft_chain_info(nlskb, ctx, seq, ops->priv);
@@ -306,7 +329,6 @@ static int nfnl_hook_dump(struct sk_buff *nlskb,
 	struct nfnl_dump_hook_data *ctx = cb->data;
 	int err, family = nfmsg->nfgen_family;
 	struct net *net = sock_net(nlskb->sk);
-	struct nf_hook_ops * const *ops;
 	const struct nf_hook_entries *e;
 	unsigned int i = cb->args[0];
 
@@ -324,10 +346,8 @@ static int nfnl_hook_dump(struct sk_buff *nlskb,
 	if ((unsigned long)e != ctx->headv || i >= e->num_hook_entries)
 		cb->seq++;
 
-	ops = nf_hook_entries_get_hook_ops(e);
-
 	for (; i < e->num_hook_entries; i++) {
-		err = nfnl_hook_dump_one(nlskb, ctx, ops[i], family,
+		err = nfnl_hook_dump_one(nlskb, ctx, e, i, family,
 					 cb->nlh->nlmsg_seq);
 		if (err)
 			break;
@@ -432,6 +452,8 @@ MODULE_ALIAS_NFNL_SUBSYS(NFNL_SUBSYS_HOOK);
 
 static int __init nfnetlink_hook_init(void)
 {
+	BUILD_BUG_ON(NFNLA_HOOK_PACKETS <= NFNLA_HOOK_MAX);
+
 	return nfnetlink_subsys_register(&nfhook_subsys);
 }
 
@@ -24,6 +24,7 @@
 #include <net/netlink.h>
 #include <linux/netfilter/nfnetlink.h>
 #include <linux/netfilter/nfnetlink_log.h>
+#include <linux/netfilter/nfnetlink_log_ring.h>
 #include <linux/netfilter/nf_conntrack_common.h>
 #include <linux/spinlock.h>
 #include <linux/sysctl.h>
@@ -37,6 +38,9 @@
 
 #include <linux/atomic.h>
 #include <linux/refcount.h>
+#include <linux/debugfs.h>
+#include <linux/relay.h>
+#include <linux/workqueue.h>
 
 
 #if IS_ENABLED(CONFIG_BRIDGE_NETFILTER)
@@ -54,6 +58,9 @@
 /* max packet size is limited by 16-bit struct nfattr nfa_len field */
 #define NFULNL_COPY_RANGE_MAX	(0xFFFF - NLA_HDRLEN)
 
+/* Packets an aggregated record stands for, NLA_U32 */
+#define NFULA_COUNT		(NFULA_MAX + 1)
+
 #define PRINTR(x, args...)	do { if (net_ratelimit()) \
 				     printk(x, ## args); } while (0);
 
@@ -80,6 +87,10 @@ struct nfulnl_instance {
 	u_int16_t flags;
 	u_int8_t copy_mode;
 	struct rcu_head rcu;
+#ifdef CONFIG_NETFILTER_NETLINK_LOG_RING
+	struct nfulnl_ring __rcu *ring;	/* NFULNL_CFG_F_RING */
+	struct work_struct free_work;
+#endif
 };
 
 #define INSTANCE_BUCKETS	16
@@ -146,14 +157,257 @@ instance_lookup_get(const struct nfnl_log_net *log, u16 group_num)
 	return inst;
 }
 
+static void nfulnl_instance_free(struct nfulnl_instance *inst)
+{
+	put_net_track(inst->net, &inst->ns_tracker);
+	kfree(inst);
+	module_put(THIS_MODULE);
+}
+
+#ifdef CONFIG_NETFILTER_NETLINK_LOG_RING
+#define NFULNL_RING_SUBBUF_SIZE	(64 * 1024)
+#define NFULNL_RING_N_SUBBUFS	16
+
+struct nfulnl_ring {
+	struct rchan *chan;
+	struct dentry *dir;		/* <debugfs>/nfnetlink_log/<group> */
+	u32 size;			/* record size */
+	atomic_t dropped;
+	u32 __percpu *lost;		/* dropped since the last record */
+};
+
+static struct dentry *nfulnl_ring_root;
+
+static int nfulnl_ring_subbuf_start(struct rchan_buf *buf, void *subbuf,
+				    void *prev_subbuf, size_t prev_padding)
+{
+	/* drops are accounted by nfulnl_ring_log() */
+	return !relay_buf_full(buf);
+}
+
+static struct dentry *nfulnl_ring_create_buf_file(const char *filename,
+						  struct dentry *parent,
+						  umode_t mode,
+						  struct rchan_buf *buf,
+						  int *is_global)
+{
+	return debugfs_create_file(filename, mode, parent, buf,
+				   &relay_file_operations);
+}
+
+static int nfulnl_ring_remove_buf_file(struct dentry *dentry)
+{
+	debugfs_remove(dentry);
+	return 0;
+}
+
+static const struct rchan_callbacks nfulnl_ring_callbacks = {
+	.subbuf_start		= nfulnl_ring_subbuf_start,
+	.create_buf_file	= nfulnl_ring_create_buf_file,
+	.remove_buf_file	= nfulnl_ring_remove_buf_file,
+};
+
+static struct nfulnl_ring *nfulnl_ring_create(u16 group_num, u32 copy_range)
+{
+	struct nfulnl_ring *ring;
+	char name[8];
+	int err;
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (!ring)
+		return ERR_PTR(-ENOMEM);
+
+	ring->lost = alloc_percpu(u32);
+	if (!ring->lost) {
+		err = -ENOMEM;
+		goto err_free;
+	}
+
+	/* payload room is fixed by the copy range in effect now */
+	ring->size = sizeof(struct nfulnl_ring_record) +
+		     ALIGN(min_t(u32, copy_range, NFULNL_RING_PAYLOAD_MAX), 8);
+
+	snprintf(name, sizeof(name), "%u", group_num);
+	ring->dir = debugfs_create_dir(name, nfulnl_ring_root);
+	if (IS_ERR(ring->dir)) {
+		err = PTR_ERR(ring->dir);
+		goto err_free;
+	}
+
+	debugfs_create_atomic_t("dropped", 0444, ring->dir, &ring->dropped);
+	debugfs_create_u32("record_size", 0444, ring->dir, &ring->size);
+
+	ring->chan = relay_open("cpu", ring->dir, NFULNL_RING_SUBBUF_SIZE,
+				NFULNL_RING_N_SUBBUFS, &nfulnl_ring_callbacks,
+				NULL);
+	if (!ring->chan) {
+		err = -ENOMEM;
+		goto err_dir;
+	}
+
+	return ring;
+
+err_dir:
+	debugfs_remove(ring->dir);
+err_free:
+	free_percpu(ring->lost);
+	kfree(ring);
+	return ERR_PTR(err);
+}
+
+static void nfulnl_ring_destroy(struct nfulnl_ring *ring)
+{
+	relay_close(ring->chan);
+	debugfs_remove(ring->dir);
+	free_percpu(ring->lost);
+	kfree(ring);
+}
+
+/* called with nfnl mutex held */
+static int nfulnl_set_ring(struct nfulnl_instance *inst, bool on)
+{
+	struct nfulnl_ring *ring;
+
+	ring = rcu_dereference_protected(inst->ring,
+					 lockdep_nfnl_is_held(NFNL_SUBSYS_ULOG));
+	if (!!ring == on)
+		return 0;
+
+	if (on) {
+		ring = nfulnl_ring_create(inst->group_num, inst->copy_range);
+		if (IS_ERR(ring))
+			return PTR_ERR(ring);
+
+		rcu_assign_pointer(inst->ring, ring);
+		return 0;
+	}
+
+	RCU_INIT_POINTER(inst->ring, NULL);
+	synchronize_rcu();
+	nfulnl_ring_destroy(ring);
+	return 0;
+}
+
+/* Returns false if the instance has no ring, called under rcu_read_lock() */
+static bool
+nfulnl_ring_log(struct nfulnl_instance *inst, const struct nf_loginfo *li,
+		u_int8_t pf, unsigned int hooknum, const struct sk_buff *skb,
+		const struct net_device *in, const struct net_device *out,
+		const char *prefix)
+{
+	struct nfulnl_ring_record *rec;
+	struct nfulnl_ring *ring;
+	unsigned int data_len;
+	unsigned long flags;
+
+	ring = rcu_dereference(inst->ring);
+	if (!ring)
+		return false;
+
+	switch (READ_ONCE(inst->copy_mode)) {
+	case NFULNL_COPY_META:
+	case NFULNL_COPY_NONE:
+		data_len = 0;
+		break;
+
+	case NFULNL_COPY_PACKET:
+		data_len = min_t(unsigned int, READ_ONCE(inst->copy_range),
+				 ring->size - sizeof(*rec));
+		if ((li->u.ulog.flags & NF_LOG_F_COPY_LEN) &&
+		    (li->u.ulog.copy_len < data_len))
+			data_len = li->u.ulog.copy_len;
+
+		if (data_len > skb->len)
+			data_len = skb->len;
+		break;
+
+	case NFULNL_COPY_DISABLED:
+	default:
+		return true;
+	}
+
+	/* relay buffers are per cpu, this may run from any context */
+	local_irq_save(flags);
+	rec = relay_reserve(ring->chan, ring->size);
+	if (!rec) {
+		__this_cpu_inc(*ring->lost);
+		atomic_inc(&ring->dropped);
+		goto out;
+	}
+
+	rec->timestamp	= ktime_get_real_ns();
+	rec->lost	= __this_cpu_read(*ring->lost);
+	rec->mark	= skb->mark;
+	rec->indev	= in ? in->ifindex : 0;
+	rec->outdev	= out ? out->ifindex : 0;
+	rec->pkt_len	= skb->len;
+	rec->hw_protocol = skb->protocol;
+	rec->group	= inst->group_num;
+	rec->pf		= pf;
+	rec->hook	= hooknum;
+	rec->count	= li->u.ulog.count ?: 1;
+	strscpy_pad(rec->prefix, prefix ? prefix : "", sizeof(rec->prefix));
+
+	if (data_len && skb_copy_bits(skb, 0, rec + 1, data_len))
+		data_len = 0;
+	rec->caplen	= data_len;
+
+	__this_cpu_write(*ring->lost, 0);
+out:
+	local_irq_restore(flags);
+	return true;
+}
+
+static void nfulnl_instance_free_work(struct work_struct *work)
+{
+	struct nfulnl_instance *inst =
+		container_of(work, struct nfulnl_instance, free_work);
+
+	nfulnl_ring_destroy(rcu_dereference_protected(inst->ring, 1));
+	nfulnl_instance_free(inst);
+}
+
+static void nfulnl_ring_init(void)
+{
+	nfulnl_ring_root = debugfs_create_dir("nfnetlink_log", NULL);
+}
+
+static void nfulnl_ring_fini(void)
+{
+	debugfs_remove(nfulnl_ring_root);
+}
+#else
+static inline int nfulnl_set_ring(struct nfulnl_instance *inst, bool on)
+{
+	return on ? -EOPNOTSUPP : 0;
+}
+
+static inline bool
+nfulnl_ring_log(struct nfulnl_instance *inst, const struct nf_loginfo *li,
+		u_int8_t pf, unsigned int hooknum, const struct sk_buff *skb,
+		const struct net_device *in, const struct net_device *out,
+		const char *prefix)
+{
+	return false;
+}
+
+static inline void nfulnl_ring_init(void) {}
+static inline void nfulnl_ring_fini(void) {}
+#endif /* CONFIG_NETFILTER_NETLINK_LOG_RING */
+
 static void nfulnl_instance_free_rcu(struct rcu_head *head)
 {
 	struct nfulnl_instance *inst =
 		container_of(head, struct nfulnl_instance, rcu);
 
-	put_net_track(inst->net, &inst->ns_tracker);
-	kfree(inst);
-	module_put(THIS_MODULE);
+#ifdef CONFIG_NETFILTER_NETLINK_LOG_RING
+	/* relay_close() sleeps */
+	if (rcu_access_pointer(inst->ring)) {
+		schedule_work(&inst->free_work);
+		return;
+	}
+#endif
+	nfulnl_instance_free(inst);
 }
 
 static void
@@ -197,6 +451,9 @@ instance_create(struct net *net, u_int16_t group_num,
 	refcount_set(&inst->use, 2);
 
 	timer_setup(&inst->timer, nfulnl_timer, 0);
+#ifdef CONFIG_NETFILTER_NETLINK_LOG_RING
+	INIT_WORK(&inst->free_work, nfulnl_instance_free_work);
+#endif
 
 	inst->net = get_net_track(net, &inst->ns_tracker, GFP_ATOMIC);
 	inst->peer_user_ns = user_ns;
@@ -450,6 +707,13 @@ static int nfulnl_put_bridge(struct nfulnl_instance *inst, const struct sk_buff
 	return -1;
 }
 
+/* skb_zerocopy() would orphan the frags of a zerocopy sender, i.e. copy them
+ * into the logged skb, which the logger must leave alone. */
+static bool nfulnl_can_zerocopy(const struct sk_buff *skb)
+{
+	return !(skb_shinfo(skb)->flags & SKBFL_ZEROCOPY_ENABLE);
+}
+
 /* This is an inline function, we don't really care about a long
  * list of arguments */
 static inline int
@@ -457,17 +721,19 @@ __build_packet_message(struct nfnl_log_net *log,
 			struct nfulnl_instance *inst,
 			const struct sk_buff *skb,
 			unsigned int data_len,
+			bool zerocopy, unsigned int hlen,
 			u_int8_t pf,
 			unsigned int hooknum,
 			const struct net_device *indev,
 			const struct net_device *outdev,
 			const char *prefix, unsigned int plen,
+			u32 count,
 			const struct nfnl_ct_hook *nfnl_ct,
 			struct nf_conn *ct, enum ip_conntrack_info ctinfo)
 {
 	struct nfulnl_msg_packet_hdr pmsg;
 	struct nlmsghdr *nlh;
-	sk_buff_data_t old_tail = inst->skb->tail;
+	unsigned int old_len = inst->skb->len;
 	struct sock *sk;
 	const unsigned char *hwhdrp;
 
@@ -566,6 +832,10 @@ __build_packet_message(struct nfnl_log_net *log,
 	    nla_put_be32(inst->skb, NFULA_MARK, htonl(skb->mark)))
 		goto nla_put_failure;
 
+	if (count &&
+	    nla_put_be32(inst->skb, NFULA_COUNT, htonl(count)))
+		goto nla_put_failure;
+
 	if (indev && skb->dev &&
 	    skb_mac_header_was_set(skb) &&
 	    skb_mac_header_len(skb) != 0) {
@@ -645,7 +915,22 @@ __build_packet_message(struct nfnl_log_net *log,
 	    nfulnl_put_bridge(inst, skb) < 0)
 		goto nla_put_failure;
 
-	if (data_len) {
+	if (data_len && zerocopy) {
+		struct nlattr *nla;
+
+		if (skb_tailroom(inst->skb) < sizeof(*nla) + hlen)
+			goto nla_put_failure;
+
+		/* last attribute of the only message in this skb, so no
+		 * padding is needed after the payload */
+		nla = skb_put(inst->skb, sizeof(*nla));
+		nla->nla_type = NFULA_PAYLOAD;
+		nla->nla_len = nla_attr_size(data_len);
+
+		if (skb_zerocopy(inst->skb, (struct sk_buff *)skb,
+				 data_len, hlen))
+			goto nla_put_failure;
+	} else if (data_len) {
 		struct nlattr *nla;
 		int size = nla_attr_size(data_len);
 
@@ -660,7 +945,7 @@ __build_packet_message(struct nfnl_log_net *log,
 			BUG();
 	}
 
-	nlh->nlmsg_len = inst->skb->tail - old_tail;
+	nlh->nlmsg_len = inst->skb->len - old_len;
 	return 0;
 
 nla_put_failure:
@@ -696,6 +981,8 @@ nfulnl_log_packet(struct net *net,
 	const struct nf_loginfo *li;
 	unsigned int qthreshold;
 	unsigned int plen = 0;
+	unsigned int hlen = 0;
+	bool zerocopy = false;
 	struct nfnl_log_net *log = nfnl_log_pernet(net);
 	const struct nfnl_ct_hook *nfnl_ct = NULL;
 	enum ip_conntrack_info ctinfo = 0;
@@ -710,6 +997,11 @@ nfulnl_log_packet(struct net *net,
 	if (!inst)
 		return;
 
+	if (nfulnl_ring_log(inst, li, pf, hooknum, skb, in, out, prefix)) {
+		instance_put(inst);
+		return;
+	}
+
 	if (prefix)
 		plen = strlen(prefix) + 1;
 
@@ -725,6 +1017,7 @@ nfulnl_log_packet(struct net *net,
 		+ nla_total_size(sizeof(u_int32_t))	/* ifindex */
 #endif
 		+ nla_total_size(sizeof(u_int32_t))	/* mark */
+		+ nla_total_size(sizeof(u_int32_t))	/* count */
 		+ nla_total_size(sizeof(u_int32_t))	/* uid */
 		+ nla_total_size(sizeof(u_int32_t))	/* gid */
 		+ nla_total_size(plen)			/* prefix */
@@ -779,7 +1072,16 @@ nfulnl_log_packet(struct net *net,
 		if (data_len > skb->len)
 			data_len = skb->len;
 
-		size += nla_total_size(data_len);
+		/* a message that is sent on its own can carry the payload
+		 * by page reference, nothing may be appended after it */
+		if (data_len && qthreshold <= 1 && nfulnl_can_zerocopy(skb)) {
+			zerocopy = true;
+			hlen = min_t(unsigned int, skb_zerocopy_headlen(skb),
+				     data_len);
+			size += sizeof(struct nlattr) + hlen;
+		} else {
+			size += nla_total_size(data_len);
+		}
 		break;
 
 	case NFULNL_COPY_DISABLED:
@@ -787,24 +1089,26 @@ nfulnl_log_packet(struct net *net,
 		goto unlock_and_release;
 	}
 
-	if (inst->skb && size > skb_tailroom(inst->skb)) {
-		/* either the queue len is too high or we don't have
-		 * enough room in the skb left. flush to userspace. */
+	if (inst->skb && (zerocopy || size > skb_tailroom(inst->skb))) {
+		/* either the queue len is too high, we don't have
+		 * enough room in the skb left or the payload has to go
+		 * last. flush to userspace. */
 		__nfulnl_flush(inst);
 	}
 
 	if (!inst->skb) {
 		inst->skb = nfulnl_alloc_skb(net, inst->peer_portid,
-					     inst->nlbufsiz, size);
+					     zerocopy ? 0 : inst->nlbufsiz,
+					     size);
 		if (!inst->skb)
 			goto alloc_failure;
 	}
 
 	inst->qlen++;
 
-	__build_packet_message(log, inst, skb, data_len, pf,
+	__build_packet_message(log, inst, skb, data_len, zerocopy, hlen, pf,
 				hooknum, in, out, prefix, plen,
-				nfnl_ct, ct, ctinfo);
+				li->u.ulog.count, nfnl_ct, ct, ctinfo);
 
 	if (inst->qlen >= qthreshold)
 		__nfulnl_flush(inst);
@@ -929,6 +1233,14 @@ static int nfulnl_recv_config(struct sk_buff *skb, const struct nfnl_info *info,
 			ret = -EOPNOTSUPP;
 			goto out_put;
 		}
+
+		/* relay files are not per network namespace */
+		if ((flags & NFULNL_CFG_F_RING) &&
+		    (!IS_ENABLED(CONFIG_NETFILTER_NETLINK_LOG_RING) ||
+		     !net_eq(info->net, &init_net))) {
+			ret = -EOPNOTSUPP;
+			goto out_put;
+		}
 	}
 
 	if (cmd != NULL) {
@@ -990,8 +1302,11 @@ static int nfulnl_recv_config(struct sk_buff *skb, const struct nfnl_info *info,
 		nfulnl_set_qthresh(inst, ntohl(qthresh));
 	}
 
-	if (nfula[NFULA_CFG_FLAGS])
-		nfulnl_set_flags(inst, flags);
+	if (nfula[NFULA_CFG_FLAGS]) {
+		ret = nfulnl_set_ring(inst, flags & NFULNL_CFG_F_RING);
+		if (ret == 0)
+			nfulnl_set_flags(inst, flags);
+	}
 
 out_put:
 	instance_put(inst);
@@ -1171,6 +1486,8 @@ static int __init nfnetlink_log_init(void)
 		goto out;
 	}
 
+	nfulnl_ring_init();
+
 	netlink_register_notifier(&nfulnl_rtnl_notifier);
 	status = nfnetlink_subsys_register(&nfulnl_subsys);
 	if (status < 0) {
@@ -1190,6 +1507,7 @@ static int __init nfnetlink_log_init(void)
 	nfnetlink_subsys_unregister(&nfulnl_subsys);
 cleanup_netlink_notifier:
 	netlink_unregister_notifier(&nfulnl_rtnl_notifier);
+	nfulnl_ring_fini();
 	unregister_pernet_subsys(&nfnl_log_net_ops);
 out:
 	return status;
@@ -1201,6 +1519,7 @@ static void __exit nfnetlink_log_fini(void)
 	netlink_unregister_notifier(&nfulnl_rtnl_notifier);
 	unregister_pernet_subsys(&nfnl_log_net_ops);
 	nf_log_unregister(&nfulnl_logger);
+	nfulnl_ring_fini();
 }
 
 MODULE_DESCRIPTION("netfilter userspace logging");
@@ -19,6 +19,7 @@
 #include <linux/spinlock.h>
 #include <linux/slab.h>
 #include <linux/notifier.h>
+#include <linux/nsproxy.h>
 #include <linux/netdevice.h>
 #include <linux/netfilter.h>
 #include <linux/proc_fs.h>
@@ -27,9 +28,16 @@
 #include <linux/netfilter_bridge.h>
 #include <linux/netfilter/nfnetlink.h>
 #include <linux/netfilter/nfnetlink_queue.h>
+#include <linux/netfilter/nfnetlink_queue_ext.h>
+#include <linux/netfilter/nfnetlink_queue_ring.h>
 #include <linux/netfilter/nf_conntrack_common.h>
 #include <linux/list.h>
+#include <linux/log2.h>
 #include <linux/cgroup-defs.h>
+#include <linux/miscdevice.h>
+#include <linux/poll.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 #include <net/gso.h>
 #include <net/sock.h>
 #include <net/tcp_states.h>
@@ -44,10 +52,33 @@
 
 #if IS_ENABLED(CONFIG_NF_CONNTRACK)
 #include <net/netfilter/nf_conntrack.h>
+#include <net/netfilter/nf_conntrack_queue.h>
 #endif
 
 #define NFQNL_QMAX_DEFAULT 1024
 
+/* Verdicts find their packet in a hash indexed by id.  Ids are handed out
+ * sequentially, so with about as many buckets as the queue can hold
+ * packets, chains stay short however verdicts are reordered.
+ */
+#define NFQNL_HASH_MIN		16
+#define NFQNL_HASH_MAX		65536
+
+/* Packets are spread over per-cpu shards, each with its own lock, so that
+ * CPUs queueing to the same instance do not serialize.  The low bits of
+ * the packet id tell the shard, the others are a sequence shared by the
+ * shards so that batch verdicts keep their meaning.  Each shard has its
+ * slice of the id hash.
+ */
+#define NFQNL_SHARDS_MAX	64
+
+struct nfqnl_shard {
+	spinlock_t		lock;
+	struct list_head	queue_list;	/* packets in queue */
+	struct hlist_head	*queue_hash;	/* same, by id */
+	unsigned int		queue_hash_mask;
+} ____cacheline_aligned_in_smp;
+
 /* We're using struct nlattr which has 16bit nla_len. Note that nla_len
  * includes the header length. Thus, the maximum packet length that we
  * support is 65531 bytes. We send truncated packets if the specified length
@@ -56,6 +87,42 @@
  */
 #define NFQNL_MAX_COPY_RANGE (0xffff - NLA_HDRLEN)
 
+#define NFQNL_CFG_F_MAX		(NFQA_CFG_F_GSO_HDR << 1)
+
+#define NFQNL_ATTR_MAX		NFQA_VERDICT_FLAGS
+
+#ifdef CONFIG_NETFILTER_NETLINK_QUEUE_RING
+/* Upper bound for the mapped area of a ring */
+#define NFQNL_RING_MAX_SIZE (1UL << 30)
+
+struct nfqnl_ring {
+	refcount_t		refcnt;		/* file, queue and work */
+	struct net		*net;
+	u16			queue_num;
+
+	void			*mem;		/* set once by NFQ_RING_SETUP */
+	struct nfq_ring_hdr	*hdr;
+	struct nfq_ring_desc	*rx;
+	struct nfq_ring_verdict	*cq;
+	void			*frames;
+	u32			nr_frames;
+	u32			frame_size;
+	u8			frame_bits;
+
+	/* protected by the lock of shard 0, which ring packets go to */
+	struct nf_queue_entry	**entries;	/* by frame */
+	u32			*free;		/* stack of free frames */
+	u32			nr_free;
+	u32			rx_head;
+
+	struct mutex		mutex;		/* setup and completions */
+	u32			cq_tail;
+	void			*bounce;	/* payload verdicts, a frame */
+	struct work_struct	work;
+	wait_queue_head_t	wait;
+};
+#endif
+
 struct nfqnl_instance {
 	struct hlist_node hlist;		/* global list of queues */
 	struct rcu_head rcu;
@@ -63,21 +130,25 @@ struct nfqnl_instance {
 	u32 peer_portid;
 	unsigned int queue_maxlen;
 	unsigned int copy_range;
-	unsigned int queue_dropped;
-	unsigned int queue_user_dropped;
+	atomic_t queue_dropped;
+	atomic_t queue_user_dropped;
 
 
 	u_int16_t queue_num;			/* number of this queue */
 	u_int8_t copy_mode;
 	u_int32_t flags;			/* Set using NFQA_CFG_FLAGS */
+	spinlock_t lock;			/* configuration */
+	struct nfqnl_shard *shards;
+	u8 shard_bits;
 /*
  * Following fields are dirtied for each queued packet,
  * keep them in same cache line if possible.
  */
-	spinlock_t	lock	____cacheline_aligned_in_smp;
-	unsigned int	queue_total;
-	unsigned int	id_sequence;		/* 'sequence' of pkt ids */
-	struct list_head queue_list;		/* packets in queue */
+	atomic_t	queue_total	____cacheline_aligned_in_smp;
+	atomic_t	id_sequence;		/* 'sequence' of pkt ids */
+#ifdef CONFIG_NETFILTER_NETLINK_QUEUE_RING
+	struct nfqnl_ring *ring;		/* packets go to this ring */
+#endif
 };
 
 typedef int (*nfqnl_cmpfn)(struct nf_queue_entry *, unsigned long);
@@ -114,11 +185,83 @@ instance_lookup(struct nfnl_queue_net *q, u_int16_t queue_num)
 	return NULL;
 }
 
+static unsigned int nfqnl_nr_shards(void)
+{
+	return roundup_pow_of_two(min_t(unsigned int, nr_cpu_ids,
+					NFQNL_SHARDS_MAX));
+}
+
+static unsigned int nfqnl_hash_size(unsigned int maxlen)
+{
+	unsigned int min = nfqnl_nr_shards() * NFQNL_HASH_MIN;
+
+	return roundup_pow_of_two(clamp_t(unsigned int, maxlen,
+					  min, NFQNL_HASH_MAX));
+}
+
+static unsigned int nfqnl_shard_mask(const struct nfqnl_instance *queue)
+{
+	return (1U << queue->shard_bits) - 1;
+}
+
+static struct nfqnl_shard *
+nfqnl_shard(const struct nfqnl_instance *queue, unsigned int id)
+{
+	return &queue->shards[id & nfqnl_shard_mask(queue)];
+}
+
+static struct hlist_head *
+nfqnl_hash_bucket(const struct nfqnl_instance *queue,
+		  const struct nfqnl_shard *shard, unsigned int id)
+{
+	return &shard->queue_hash[(id >> queue->shard_bits) &
+				  shard->queue_hash_mask];
+}
+
+/* Gives each shard its slice of a table of size buckets, rehashing the
+ * packets already queued.  Returns the previous table.
+ */
+static struct hlist_head *
+nfqnl_hash_resize(struct nfqnl_instance *queue, struct hlist_head *hash,
+		  unsigned int size)
+{
+	struct hlist_head *old = queue->shards[0].queue_hash;
+	unsigned int i, slice = size >> queue->shard_bits;
+	struct nf_queue_entry *entry;
+
+	for (i = 0; i <= nfqnl_shard_mask(queue); i++) {
+		struct nfqnl_shard *shard = &queue->shards[i];
+
+		spin_lock_bh(&shard->lock);
+		shard->queue_hash = hash + i * slice;
+		shard->queue_hash_mask = slice - 1;
+		list_for_each_entry(entry, &shard->queue_list, list)
+			hlist_add_head(&entry->hnode,
+				       nfqnl_hash_bucket(queue, shard,
+							 entry->id));
+		spin_unlock_bh(&shard->lock);
+	}
+
+	return old;
+}
+
+static unsigned int nfqnl_hash_cur_size(const struct nfqnl_instance *queue)
+{
+	return (queue->shards[0].queue_hash_mask + 1) << queue->shard_bits;
+}
+
+static struct hlist_head *nfqnl_hash_alloc(unsigned int size)
+{
+	return kvcalloc(size, sizeof(struct hlist_head), GFP_KERNEL);
+}
+
+/* Takes over hash, of nfqnl_hash_size(NFQNL_QMAX_DEFAULT) buckets */
 static struct nfqnl_instance *
-instance_create(struct nfnl_queue_net *q, u_int16_t queue_num, u32 portid)
+instance_create(struct nfnl_queue_net *q, u_int16_t queue_num, u32 portid,
+		struct hlist_head *hash)
 {
+	unsigned int h, i, nr_shards = nfqnl_nr_shards();
 	struct nfqnl_instance *inst;
-	unsigned int h;
 	int err;
 
 	spin_lock(&q->instances_lock);
@@ -139,7 +282,18 @@ instance_create(struct nfnl_queue_net *q, u_int16_t queue_num, u32 portid)
 	inst->copy_range = NFQNL_MAX_COPY_RANGE;
 	inst->copy_mode = NFQNL_COPY_NONE;
 	spin_lock_init(&inst->lock);
-	INIT_LIST_HEAD(&inst->queue_list);
+
+	inst->shards = kcalloc(nr_shards, sizeof(*inst->shards), GFP_ATOMIC);
+	if (!inst->shards) {
+		err = -ENOMEM;
+		goto out_free;
+	}
+	inst->shard_bits = ilog2(nr_shards);
+	for (i = 0; i < nr_shards; i++) {
+		spin_lock_init(&inst->shards[i].lock);
+		INIT_LIST_HEAD(&inst->shards[i].queue_list);
+	}
+	nfqnl_hash_resize(inst, hash, nfqnl_hash_size(NFQNL_QMAX_DEFAULT));
 
 	if (!try_module_get(THIS_MODULE)) {
 		err = -EAGAIN;
@@ -154,6 +308,7 @@ instance_create(struct nfnl_queue_net *q, u_int16_t queue_num, u32 portid)
 	return inst;
 
 out_free:
+	kfree(inst->shards);
 	kfree(inst);
 out_unlock:
 	spin_unlock(&q->instances_lock);
@@ -162,6 +317,7 @@ instance_create(struct nfnl_queue_net *q, u_int16_t queue_num, u32 portid)
 
 static void nfqnl_flush(struct nfqnl_instance *queue, nfqnl_cmpfn cmpfn,
 			unsigned long data);
+static void nfqnl_ring_destroy(struct nfqnl_instance *queue);
 
 static void
 instance_destroy_rcu(struct rcu_head *head)
@@ -170,8 +326,11 @@ instance_destroy_rcu(struct rcu_head *head)
 						   rcu);
 
 	rcu_read_lock();
+	nfqnl_ring_destroy(inst);
 	nfqnl_flush(inst, NULL, 0);
 	rcu_read_unlock();
+	kvfree(inst->shards[0].queue_hash);
+	kfree(inst->shards);
 	kfree(inst);
 	module_put(THIS_MODULE);
 }
@@ -191,28 +350,53 @@ instance_destroy(struct nfnl_queue_net *q, struct nfqnl_instance *inst)
 	spin_unlock(&q->instances_lock);
 }
 
+#ifdef CONFIG_NETFILTER_NETLINK_QUEUE_RING
+static u32 nfqnl_ring_frame(const struct nfqnl_instance *queue,
+			    const struct nfqnl_ring *ring, unsigned int id)
+{
+	return (id >> queue->shard_bits) & (ring->nr_frames - 1);
+}
+#endif
+
 static inline void
-__enqueue_entry(struct nfqnl_instance *queue, struct nf_queue_entry *entry)
+__enqueue_entry(struct nfqnl_instance *queue, struct nfqnl_shard *shard,
+		struct nf_queue_entry *entry)
 {
-       list_add_tail(&entry->list, &queue->queue_list);
-       queue->queue_total++;
+	list_add_tail(&entry->list, &shard->queue_list);
+	hlist_add_head(&entry->hnode, nfqnl_hash_bucket(queue, shard, entry->id));
+	atomic_inc(&queue->queue_total);
 }
 
 static void
-__dequeue_entry(struct nfqnl_instance *queue, struct nf_queue_entry *entry)
+__dequeue_entry(struct nfqnl_instance *queue, struct nfqnl_shard *shard,
+		struct nf_queue_entry *entry)
 {
 	list_del(&entry->list);
-	queue->queue_total--;
+	hlist_del(&entry->hnode);
+	atomic_dec(&queue->queue_total);
+#ifdef CONFIG_NETFILTER_NETLINK_QUEUE_RING
+	if (queue->ring && shard == queue->shards) {
+		struct nfqnl_ring *ring = queue->ring;
+		u32 frame = nfqnl_ring_frame(queue, ring, entry->id);
+
+		/* not a packet sent over netlink before the ring came */
+		if (ring->entries[frame] == entry) {
+			ring->entries[frame] = NULL;
+			ring->free[ring->nr_free++] = frame;
+		}
+	}
+#endif
 }
 
 static struct nf_queue_entry *
 find_dequeue_entry(struct nfqnl_instance *queue, unsigned int id)
 {
+	struct nfqnl_shard *shard = nfqnl_shard(queue, id);
 	struct nf_queue_entry *entry = NULL, *i;
 
-	spin_lock_bh(&queue->lock);
+	spin_lock_bh(&shard->lock);
 
-	list_for_each_entry(i, &queue->queue_list, list) {
+	hlist_for_each_entry(i, nfqnl_hash_bucket(queue, shard, id), hnode) {
 		if (i->id == id) {
 			entry = i;
 			break;
@@ -220,9 +404,9 @@ find_dequeue_entry(struct nfqnl_instance *queue, unsigned int id)
 	}
 
 	if (entry)
-		__dequeue_entry(queue, entry);
+		__dequeue_entry(queue, shard, entry);
 
-	spin_unlock_bh(&queue->lock);
+	spin_unlock_bh(&shard->lock);
 
 	return entry;
 }
@@ -399,20 +583,50 @@ static void nfqnl_reinject(struct nf_queue_entry *entry, unsigned int verdict)
 	nf_reinject(entry, verdict);
 }
 
+/* Only the queue and hook that the verdict comes from are skipped, a later
+ * bypass verdict of the same flow elsewhere replaces it.  Entries created
+ * before a queue was bound in the netns have no room for the bypass, their
+ * packets keep being queued.
+ */
+static void nfqnl_flow_bypass(const struct nfqnl_instance *queue,
+			      struct nf_queue_entry *entry,
+			      unsigned int verdict)
+{
+#if IS_ENABLED(CONFIG_NF_CONNTRACK)
+	struct nf_conn *ct = (void *)skb_nfct(entry->skb);
+	struct nf_conn_queue *cq;
+
+	if (!ct || nf_ct_is_template(ct) ||
+	    (verdict & NF_VERDICT_MASK) != NF_ACCEPT)
+		return;
+
+	cq = nf_ct_queue_find(ct);
+	if (cq)
+		WRITE_ONCE(cq->bypass,
+			   nf_queue_bypass_scope(&entry->state,
+						 queue->queue_num));
+#endif
+}
+
 static void
 nfqnl_flush(struct nfqnl_instance *queue, nfqnl_cmpfn cmpfn, unsigned long data)
 {
 	struct nf_queue_entry *entry, *next;
+	struct nfqnl_shard *shard;
+	unsigned int i;
 
-	spin_lock_bh(&queue->lock);
-	list_for_each_entry_safe(entry, next, &queue->queue_list, list) {
-		if (!cmpfn || cmpfn(entry, data)) {
-			list_del(&entry->list);
-			queue->queue_total--;
-			nfqnl_reinject(entry, NF_DROP);
+	for (i = 0; i <= nfqnl_shard_mask(queue); i++) {
+		shard = &queue->shards[i];
+
+		spin_lock_bh(&shard->lock);
+		list_for_each_entry_safe(entry, next, &shard->queue_list, list) {
+			if (!cmpfn || cmpfn(entry, data)) {
+				__dequeue_entry(queue, shard, entry);
+				nfqnl_reinject(entry, NF_DROP);
+			}
 		}
+		spin_unlock_bh(&shard->lock);
 	}
-	spin_unlock_bh(&queue->lock);
 }
 
 static int
@@ -548,6 +762,48 @@ static int nf_queue_checksum_help(struct sk_buff *entskb)
 	return skb_checksum_help(entskb);
 }
 
+/* Length of the headers of a GSO packet, 0 if unknown */
+static unsigned int nfqnl_gso_hdrlen(const struct sk_buff *skb)
+{
+	unsigned int gso_type = skb_shinfo(skb)->gso_type;
+
+	if (skb->encapsulation) {
+		if (gso_type & (SKB_GSO_TCPV4 | SKB_GSO_TCPV6))
+			return skb_inner_tcp_all_headers(skb);
+		return 0;
+	}
+
+	if (gso_type & (SKB_GSO_TCPV4 | SKB_GSO_TCPV6))
+		return skb_tcp_all_headers(skb);
+	if (gso_type & SKB_GSO_UDP_L4)
+		return skb_transport_offset(skb) + sizeof(struct udphdr);
+
+	return 0;
+}
+
+static unsigned int nfqnl_copy_len(const struct nfqnl_instance *queue,
+				   const struct sk_buff *skb)
+{
+	unsigned int len = min(READ_ONCE(queue->copy_range), skb->len);
+	unsigned int hdrlen;
+
+	if ((queue->flags & NFQA_CFG_F_GSO_HDR) && skb_is_gso(skb)) {
+		hdrlen = nfqnl_gso_hdrlen(skb);
+		if (hdrlen)
+			len = min(len, hdrlen);
+	}
+
+	return len;
+}
+
+/* The verdict payload only covers the headers of the packet */
+static bool nfqnl_gso_hdr_only(const struct nfqnl_instance *queue,
+			       const struct sk_buff *skb, unsigned int len)
+{
+	return (queue->flags & NFQA_CFG_F_GSO_HDR) && skb_is_gso(skb) &&
+	       len < skb->len;
+}
+
 static struct sk_buff *
 nfqnl_build_packet_message(struct net *net, struct nfqnl_instance *queue,
 			   struct nf_queue_entry *entry,
@@ -613,9 +869,7 @@ nfqnl_build_packet_message(struct net *net, struct nfqnl_instance *queue,
 		    nf_queue_checksum_help(entskb))
 			return NULL;
 
-		data_len = READ_ONCE(queue->copy_range);
-		if (data_len > entskb->len)
-			data_len = entskb->len;
+		data_len = nfqnl_copy_len(queue, entskb);
 
 		hlen = skb_zerocopy_headlen(entskb);
 		hlen = min_t(unsigned int, hlen, data_len);
@@ -869,37 +1123,53 @@ static bool nf_ct_drop_unconfirmed(const struct nf_queue_entry *entry)
 	return false;
 }
 
+#ifdef CONFIG_NETFILTER_NETLINK_QUEUE_RING
+static int nfqnl_ring_enqueue(struct nfqnl_instance *queue,
+			      struct nf_queue_entry *entry);
+#endif
+
 static int
 __nfqnl_enqueue_packet(struct net *net, struct nfqnl_instance *queue,
 			struct nf_queue_entry *entry)
 {
+	struct nfqnl_shard *shard;
 	struct sk_buff *nskb;
 	int err = -ENOBUFS;
 	__be32 *packet_id_ptr;
 	int failopen = 0;
+	unsigned int i;
 
+#ifdef CONFIG_NETFILTER_NETLINK_QUEUE_RING
+	if (READ_ONCE(queue->ring))
+		return nfqnl_ring_enqueue(queue, entry);
+#endif
 	nskb = nfqnl_build_packet_message(net, queue, entry, &packet_id_ptr);
 	if (nskb == NULL) {
 		err = -ENOMEM;
 		goto err_out;
 	}
-	spin_lock_bh(&queue->lock);
+
+	/* any shard will do, this one is likely not contended */
+	i = raw_smp_processor_id() & nfqnl_shard_mask(queue);
+	shard = &queue->shards[i];
+	spin_lock_bh(&shard->lock);
 
 	if (nf_ct_drop_unconfirmed(entry))
 		goto err_out_free_nskb;
 
-	if (queue->queue_total >= queue->queue_maxlen) {
+	if (atomic_read(&queue->queue_total) >= queue->queue_maxlen) {
 		if (queue->flags & NFQA_CFG_F_FAIL_OPEN) {
 			failopen = 1;
 			err = 0;
 		} else {
-			queue->queue_dropped++;
+			atomic_inc(&queue->queue_dropped);
 			net_warn_ratelimited("nf_queue: full at %d entries, dropping packets(s)\n",
-					     queue->queue_total);
+					     atomic_read(&queue->queue_total));
 		}
 		goto err_out_free_nskb;
 	}
-	entry->id = ++queue->id_sequence;
+	entry->id = (atomic_inc_return(&queue->id_sequence) <<
+		     queue->shard_bits) | i;
 	*packet_id_ptr = htonl(entry->id);
 
 	/* nfnetlink_unicast will either free the nskb or add it to a socket */
@@ -909,20 +1179,20 @@ __nfqnl_enqueue_packet(struct net *net, struct nfqnl_instance *queue,
 			failopen = 1;
 			err = 0;
 		} else {
-			queue->queue_user_dropped++;
+			atomic_inc(&queue->queue_user_dropped);
 		}
 		goto err_out_unlock;
 	}
 
-	__enqueue_entry(queue, entry);
+	__enqueue_entry(queue, shard, entry);
 
-	spin_unlock_bh(&queue->lock);
+	spin_unlock_bh(&shard->lock);
 	return 0;
 
 err_out_free_nskb:
 	kfree_skb(nskb);
 err_out_unlock:
-	spin_unlock_bh(&queue->lock);
+	spin_unlock_bh(&shard->lock);
 	if (failopen)
 		nfqnl_reinject(entry, NF_ACCEPT);
 err_out:
@@ -1058,6 +1328,80 @@ nfqnl_enqueue_packet(struct nf_queue_entry *entry, unsigned int queuenum)
 	return err;
 }
 
+/* The network header at @nh and the transport header at @th of @data must
+ * keep the layout the skb was set up for: same IP version, header length,
+ * extension headers and protocol, same TCP data offset.
+ */
+static bool nfqnl_gso_hdr_valid(const u8 *data, const u8 *old,
+				unsigned int nh, unsigned int th, bool tcp)
+{
+	if ((data[nh] ^ old[nh]) & 0xf0)
+		return false;
+
+	switch (old[nh] >> 4) {
+	case 4:
+		if (th - nh < sizeof(struct iphdr) ||
+		    data[nh] != old[nh] ||
+		    data[nh + offsetof(struct iphdr, protocol)] !=
+		    old[nh + offsetof(struct iphdr, protocol)])
+			return false;
+		break;
+	case 6:
+		if (th - nh < sizeof(struct ipv6hdr) ||
+		    data[nh + offsetof(struct ipv6hdr, nexthdr)] !=
+		    old[nh + offsetof(struct ipv6hdr, nexthdr)] ||
+		    memcmp(data + nh + sizeof(struct ipv6hdr),
+			   old + nh + sizeof(struct ipv6hdr),
+			   th - nh - sizeof(struct ipv6hdr)))
+			return false;
+		break;
+	default:
+		return false;
+	}
+
+	/* doff is the upper nibble of the byte following the sequence
+	 * numbers
+	 */
+	if (tcp && (data[th + 12] ^ old[th + 12]) & 0xf0)
+		return false;
+
+	return true;
+}
+
+static int
+nfqnl_mangle_gso_hdr(void *data, unsigned int data_len,
+		     struct nf_queue_entry *e)
+{
+	struct sk_buff *skb = e->skb;
+	unsigned int nh, th;
+	bool tcp;
+
+	if (data_len != nfqnl_gso_hdrlen(skb))
+		return -EINVAL;
+
+	if (skb_ensure_writable(skb, data_len))
+		return -ENOMEM;
+
+	/* segmentation relies on the offsets and gso_type of the skb */
+	tcp = skb_shinfo(skb)->gso_type & (SKB_GSO_TCPV4 | SKB_GSO_TCPV6);
+	if (skb->encapsulation) {
+		/* outer headers are left alone */
+		nh = skb_inner_network_offset(skb);
+		th = skb_inner_transport_offset(skb);
+	} else {
+		nh = skb_network_offset(skb);
+		th = skb_transport_offset(skb);
+	}
+
+	if (memcmp(data, skb->data, nh) ||
+	    !nfqnl_gso_hdr_valid(data, skb->data, nh, th, tcp))
+		return -EINVAL;
+
+	/* checksums are left to userspace, ip_summed must stay partial */
+	skb_copy_to_linear_data(skb, data, data_len);
+	return 0;
+}
+
 static int
 nfqnl_mangle(void *data, unsigned int data_len, struct nf_queue_entry *e, int diff)
 {
@@ -1091,6 +1435,542 @@ nfqnl_mangle(void *data, unsigned int data_len, struct nf_queue_entry *e, int di
 	return 0;
 }
 
+#ifdef CONFIG_NETFILTER_NETLINK_QUEUE_RING
+/* Shared memory rings: packets are copied once to a frame mapped by
+ * userspace instead of being built into a netlink message, verdicts come
+ * back in batches through the completion ring.  The ring holds a reference
+ * for its file, one while attached to a queue and one while the work is
+ * pending.
+ */
+static struct workqueue_struct *nfqnl_ring_wq;
+
+static void nfqnl_ring_put(struct nfqnl_ring *ring)
+{
+	if (!refcount_dec_and_test(&ring->refcnt))
+		return;
+
+	put_net(ring->net);
+	vfree(ring->mem);
+	kvfree(ring->entries);
+	kvfree(ring->free);
+	kvfree(ring->bounce);
+	kfree(ring);
+}
+
+/* called with the lock of shard 0 held */
+static void nfqnl_ring_kick(struct nfqnl_ring *ring)
+{
+	refcount_inc(&ring->refcnt);
+	if (!queue_work(nfqnl_ring_wq, &ring->work))
+		refcount_dec(&ring->refcnt);
+}
+
+static int nfqnl_ring_enqueue(struct nfqnl_instance *queue,
+			      struct nf_queue_entry *entry)
+{
+	struct nfqnl_shard *shard = queue->shards;
+	struct sk_buff *skb = entry->skb;
+	struct nfq_ring_desc *desc;
+	struct nfqnl_ring *ring;
+	unsigned int len = 0;
+	int err = -ENOBUFS;
+	int failopen = 0;
+	u32 frame;
+
+	if (READ_ONCE(queue->copy_mode) == NFQNL_COPY_PACKET) {
+		if (!(queue->flags & NFQA_CFG_F_GSO) &&
+		    skb->ip_summed == CHECKSUM_PARTIAL &&
+		    nf_queue_checksum_help(skb))
+			return -ENOMEM;
+
+		len = nfqnl_copy_len(queue, skb);
+	}
+
+	spin_lock_bh(&shard->lock);
+
+	if (nf_ct_drop_unconfirmed(entry))
+		goto err_out_unlock;
+
+	if (atomic_read(&queue->queue_total) >= queue->queue_maxlen) {
+		if (queue->flags & NFQA_CFG_F_FAIL_OPEN) {
+			failopen = 1;
+			err = 0;
+		} else {
+			atomic_inc(&queue->queue_dropped);
+			net_warn_ratelimited("nf_queue: full at %d entries, dropping packets(s)\n",
+					     atomic_read(&queue->queue_total));
+		}
+		goto err_out_unlock;
+	}
+
+	/* detached meanwhile, no verdicts from userspace or descriptors not
+	 * consumed yet, as if the netlink socket was full.
+	 */
+	ring = queue->ring;
+	if (!ring || !ring->nr_free ||
+	    ring->rx_head - READ_ONCE(ring->hdr->rx_consumer) >=
+	    ring->nr_frames) {
+		if (queue->flags & NFQA_CFG_F_FAIL_OPEN) {
+			failopen = 1;
+			err = 0;
+		} else {
+			atomic_inc(&queue->queue_user_dropped);
+		}
+		goto err_out_unlock;
+	}
+
+	frame = ring->free[--ring->nr_free];
+	len = min(len, ring->frame_size);
+	if (skb_copy_bits(skb, 0, ring->frames + (size_t)frame * ring->frame_size,
+			  len)) {
+		ring->free[ring->nr_free++] = frame;
+		err = -ENOMEM;
+		goto err_out_unlock;
+	}
+
+	/* the frame is found back from the id, the shard bits are 0 */
+	entry->id = ((atomic_inc_return(&queue->id_sequence) <<
+		      ring->frame_bits) | frame) << queue->shard_bits;
+
+	desc = &ring->rx[ring->rx_head & (ring->nr_frames - 1)];
+	desc->id = entry->id;
+	desc->frame = frame;
+	desc->len = len;
+	desc->pkt_len = skb->len;
+	desc->mark = skb->mark;
+	desc->priority = skb->priority;
+	desc->indev = entry->state.in ? entry->state.in->ifindex : 0;
+	desc->outdev = entry->state.out ? entry->state.out->ifindex : 0;
+	desc->hw_protocol = skb->protocol;
+	desc->pf = entry->state.pf;
+	desc->hook = entry->state.hook;
+	smp_store_release(&ring->hdr->rx_producer, ++ring->rx_head);
+
+	ring->entries[frame] = entry;
+	__enqueue_entry(queue, shard, entry);
+
+	/* pick up verdicts without waiting for userspace to ask */
+	if (READ_ONCE(ring->hdr->cq_producer) != READ_ONCE(ring->cq_tail))
+		nfqnl_ring_kick(ring);
+
+	if (wq_has_sleeper(&ring->wait))
+		wake_up_interruptible_poll(&ring->wait, EPOLLIN | EPOLLRDNORM);
+
+	spin_unlock_bh(&shard->lock);
+	return 0;
+
+err_out_unlock:
+	spin_unlock_bh(&shard->lock);
+	if (failopen)
+		nfqnl_reinject(entry, NF_ACCEPT);
+	return err;
+}
+
+static void nfqnl_ring_seq_adjust(struct nf_queue_entry *entry, int diff)
+{
+#if IS_ENABLED(CONFIG_NF_CONNTRACK)
+	const struct nfnl_ct_hook *nfnl_ct;
+	enum ip_conntrack_info ctinfo;
+	struct nf_conn *ct;
+
+	nfnl_ct = rcu_dereference(nfnl_ct_hook);
+	ct = nf_ct_get(entry->skb, &ctinfo);
+	if (nfnl_ct && ct)
+		nfnl_ct->seq_adjust(entry->skb, ct, ctinfo, diff);
+#endif
+}
+
+static void nfqnl_ring_verdict(struct nfqnl_instance *queue,
+			       struct nfqnl_ring *ring,
+			       const struct nfq_ring_verdict *v)
+{
+	u32 id = READ_ONCE(v->id), flags = READ_ONCE(v->flags);
+	u32 frame = nfqnl_ring_frame(queue, ring, id);
+	struct nfqnl_shard *shard = queue->shards;
+	u32 verdict = READ_ONCE(v->verdict);
+	struct nf_queue_entry *entry;
+
+	if ((verdict & NF_VERDICT_MASK) > NF_MAX_VERDICT ||
+	    (verdict & NF_VERDICT_MASK) == NF_STOLEN)
+		return;
+
+	spin_lock_bh(&shard->lock);
+	entry = ring->entries[frame];
+	if (!entry || entry->id != id) {
+		spin_unlock_bh(&shard->lock);
+		return;
+	}
+
+	if (!(flags & NFQ_RING_VF_PAYLOAD)) {
+		__dequeue_entry(queue, shard, entry);
+		spin_unlock_bh(&shard->lock);
+	} else {
+		void *data = ring->frames + (size_t)frame * ring->frame_size;
+		u32 len = READ_ONCE(v->len);
+		int err = -EINVAL;
+
+		/* userspace can still write to the frame, only the copy
+		 * taken here is checked and applied.  The ring mutex
+		 * serializes users of the bounce buffer.
+		 */
+		if (len <= ring->frame_size) {
+			memcpy(ring->bounce, data, len);
+			data = ring->bounce;
+		}
+
+		/* keep the frame until the new payload is copied */
+		list_del(&entry->list);
+		hlist_del(&entry->hnode);
+		atomic_dec(&queue->queue_total);
+		ring->entries[frame] = NULL;
+		spin_unlock_bh(&shard->lock);
+
+		if (len <= ring->frame_size) {
+			if (nfqnl_gso_hdr_only(queue, entry->skb, len)) {
+				err = nfqnl_mangle_gso_hdr(data, len, entry);
+			} else {
+				int diff = len - entry->skb->len;
+
+				err = nfqnl_mangle(data, len, entry, diff);
+				/* as for netlink verdicts, without NFQA_CT */
+				if (!err && diff)
+					nfqnl_ring_seq_adjust(entry, diff);
+			}
+		}
+		if (err < 0)
+			verdict = NF_DROP;
+
+		spin_lock_bh(&shard->lock);
+		ring->free[ring->nr_free++] = frame;
+		spin_unlock_bh(&shard->lock);
+	}
+
+	if (flags & NFQ_RING_VF_MARK)
+		entry->skb->mark = READ_ONCE(v->mark);
+
+	if (flags & NFQ_RING_VF_FLOW_BYPASS)
+		nfqnl_flow_bypass(queue, entry, verdict);
+
+	nfqnl_reinject(entry, verdict);
+}
+
+/* Verdicts applied under one rcu_read_lock() section */
+#define NFQ_RING_VERDICT_BATCH	64
+
+/* Applies the verdicts posted so far, fails if the ring is not attached.
+ * The queue cannot lose its ring meanwhile: the file side detaches under
+ * the ring mutex and instance_destroy_rcu() waits for us.  The queue is
+ * looked up again for each batch of verdicts, with a reschedule point in
+ * between.
+ */
+static int nfqnl_ring_complete(struct nfqnl_ring *ring)
+{
+	struct nfnl_queue_net *q = nfnl_queue_pernet(ring->net);
+	struct nfqnl_instance *queue;
+	u32 head, tail, budget, n;
+	int err = -ENODEV;
+
+	mutex_lock(&ring->mutex);
+	if (!ring->mem)
+		goto out;
+
+	/* the producer index comes from userspace */
+	budget = ring->nr_frames;
+	tail = ring->cq_tail;
+	head = smp_load_acquire(&ring->hdr->cq_producer);
+	do {
+		rcu_read_lock();
+		queue = instance_lookup(q, ring->queue_num);
+		if (!queue || READ_ONCE(queue->ring) != ring) {
+			rcu_read_unlock();
+			goto out;
+		}
+
+		for (n = 0; tail != head && budget && n < NFQ_RING_VERDICT_BATCH;
+		     n++, budget--, tail++)
+			nfqnl_ring_verdict(queue, ring,
+					   &ring->cq[tail & (ring->nr_frames - 1)]);
+		rcu_read_unlock();
+
+		WRITE_ONCE(ring->cq_tail, tail);
+		smp_store_release(&ring->hdr->cq_consumer, tail);
+		cond_resched();
+	} while (tail != head && budget);
+	err = 0;
+out:
+	mutex_unlock(&ring->mutex);
+	return err;
+}
+
+static void nfqnl_ring_work(struct work_struct *work)
+{
+	struct nfqnl_ring *ring = container_of(work, struct nfqnl_ring, work);
+
+	nfqnl_ring_complete(ring);
+	nfqnl_ring_put(ring);
+}
+
+/* Packets still in the ring are dropped, as for a closed netlink socket */
+static void nfqnl_ring_detach(struct nfqnl_instance *queue,
+			      struct nfqnl_ring *ring)
+{
+	spin_lock_bh(&queue->shards[0].lock);
+	if (queue->ring != ring) {
+		spin_unlock_bh(&queue->shards[0].lock);
+		return;
+	}
+	WRITE_ONCE(queue->ring, NULL);
+	spin_unlock_bh(&queue->shards[0].lock);
+
+	nfqnl_flush(queue, NULL, 0);
+	wake_up_interruptible_poll(&ring->wait, EPOLLERR | EPOLLHUP);
+	nfqnl_ring_put(ring);
+}
+
+static void nfqnl_ring_destroy(struct nfqnl_instance *queue)
+{
+	struct nfqnl_ring *ring = READ_ONCE(queue->ring);
+
+	if (ring)
+		nfqnl_ring_detach(queue, ring);
+}
+
+static int nfqnl_ring_setup(struct nfqnl_ring *ring,
+			    struct nfq_ring_setup __user *arg)
+{
+	struct nfnl_queue_net *q = nfnl_queue_pernet(ring->net);
+	struct nfqnl_instance *queue;
+	struct nfq_ring_setup setup;
+	size_t size;
+	u32 i, nr;
+	int err;
+
+	if (!ns_capable(ring->net->user_ns, CAP_NET_ADMIN))
+		return -EPERM;
+
+	if (copy_from_user(&setup, arg, sizeof(setup)))
+		return -EFAULT;
+
+	nr = setup.nr_frames;
+	if (!is_power_of_2(nr) || nr > NFQ_RING_MAX_FRAMES ||
+	    !is_power_of_2(setup.frame_size) ||
+	    setup.frame_size < NFQ_RING_MIN_FRAME_SIZE ||
+	    setup.frame_size > NFQ_RING_MAX_FRAME_SIZE)
+		return -EINVAL;
+
+	setup.rx_offset = PAGE_ALIGN(sizeof(struct nfq_ring_hdr));
+	setup.cq_offset = setup.rx_offset +
+			  PAGE_ALIGN(nr * sizeof(struct nfq_ring_desc));
+	setup.frames_offset = setup.cq_offset +
+			      PAGE_ALIGN(nr * sizeof(struct nfq_ring_verdict));
+	size = setup.frames_offset + (size_t)nr * setup.frame_size;
+	if (size > NFQNL_RING_MAX_SIZE)
+		return -EINVAL;
+	setup.mmap_size = size;
+
+	mutex_lock(&ring->mutex);
+	err = -EBUSY;
+	if (ring->mem)
+		goto out;
+
+	err = -ENOMEM;
+	ring->mem = vmalloc_user(size);
+	ring->entries = kvcalloc(nr, sizeof(*ring->entries), GFP_KERNEL);
+	ring->free = kvmalloc_array(nr, sizeof(*ring->free), GFP_KERNEL);
+	ring->bounce = kvmalloc(setup.frame_size, GFP_KERNEL);
+	if (!ring->mem || !ring->entries || !ring->free || !ring->bounce)
+		goto out_free;
+
+	ring->hdr = ring->mem;
+	ring->rx = ring->mem + setup.rx_offset;
+	ring->cq = ring->mem + setup.cq_offset;
+	ring->frames = ring->mem + setup.frames_offset;
+	ring->nr_frames = nr;
+	ring->frame_size = setup.frame_size;
+	ring->frame_bits = ilog2(nr);
+	for (i = 0; i < nr; i++)
+		ring->free[i] = nr - 1 - i;
+	ring->nr_free = nr;
+	ring->queue_num = setup.queue_num;
+
+	rcu_read_lock();
+	queue = instance_lookup(q, setup.queue_num);
+	if (!queue) {
+		err = -ENODEV;
+	} else {
+		spin_lock_bh(&queue->shards[0].lock);
+		if (queue->ring || atomic_read(&queue->queue_total)) {
+			err = -EBUSY;
+		} else {
+			refcount_inc(&ring->refcnt);
+			WRITE_ONCE(queue->ring, ring);
+			err = 0;
+		}
+		spin_unlock_bh(&queue->shards[0].lock);
+	}
+	rcu_read_unlock();
+	if (err < 0)
+		goto out_free;
+
+	mutex_unlock(&ring->mutex);
+
+	if (copy_to_user(arg, &setup, sizeof(setup)))
+		return -EFAULT;
+
+	return 0;
+
+out_free:
+	vfree(ring->mem);
+	kvfree(ring->entries);
+	kvfree(ring->free);
+	kvfree(ring->bounce);
+	ring->mem = NULL;
+	ring->entries = NULL;
+	ring->free = NULL;
+	ring->bounce = NULL;
+out:
+	mutex_unlock(&ring->mutex);
+	return err;
+}
+
+static int nfqnl_ring_open(struct inode *inode, struct file *file)
+{
+	struct nfqnl_ring *ring;
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (!ring)
+		return -ENOMEM;
+
+	refcount_set(&ring->refcnt, 1);
+	ring->net = get_net(current->nsproxy->net_ns);
+	mutex_init(&ring->mutex);
+	INIT_WORK(&ring->work, nfqnl_ring_work);
+	init_waitqueue_head(&ring->wait);
+
+	file->private_data = ring;
+	return 0;
+}
+
+static int nfqnl_ring_release(struct inode *inode, struct file *file)
+{
+	struct nfqnl_ring *ring = file->private_data;
+	struct nfnl_queue_net *q = nfnl_queue_pernet(ring->net);
+	struct nfqnl_instance *queue;
+
+	mutex_lock(&ring->mutex);
+	if (ring->mem) {
+		rcu_read_lock();
+		queue = instance_lookup(q, ring->queue_num);
+		if (queue)
+			nfqnl_ring_detach(queue, ring);
+		rcu_read_unlock();
+	}
+	mutex_unlock(&ring->mutex);
+
+	if (cancel_work_sync(&ring->work))
+		nfqnl_ring_put(ring);
+
+	nfqnl_ring_put(ring);
+	return 0;
+}
+
+static long nfqnl_ring_ioctl(struct file *file, unsigned int cmd,
+			     unsigned long arg)
+{
+	struct nfqnl_ring *ring = file->private_data;
+
+	switch (cmd) {
+	case NFQ_RING_SETUP:
+		return nfqnl_ring_setup(ring, (void __user *)arg);
+	case NFQ_RING_KICK:
+		return nfqnl_ring_complete(ring);
+	}
+
+	return -ENOTTY;
+}
+
+static int nfqnl_ring_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct nfqnl_ring *ring = file->private_data;
+	int err = -EINVAL;
+
+	mutex_lock(&ring->mutex);
+	if (ring->mem)
+		err = remap_vmalloc_range(vma, ring->mem, vma->vm_pgoff);
+	mutex_unlock(&ring->mutex);
+
+	return err;
+}
+
+/* Waiting for packets also hands back the verdicts posted so far */
+static __poll_t nfqnl_ring_poll(struct file *file, poll_table *wait)
+{
+	struct nfqnl_ring *ring = file->private_data;
+
+	poll_wait(file, &ring->wait, wait);
+
+	if (nfqnl_ring_complete(ring) < 0)
+		return EPOLLERR | EPOLLHUP;
+
+	if (READ_ONCE(ring->rx_head) != READ_ONCE(ring->hdr->rx_consumer))
+		return EPOLLIN | EPOLLRDNORM;
+
+	return 0;
+}
+
+static const struct file_operations nfqnl_ring_fops = {
+	.owner		= THIS_MODULE,
+	.open		= nfqnl_ring_open,
+	.release	= nfqnl_ring_release,
+	.unlocked_ioctl	= nfqnl_ring_ioctl,
+	.compat_ioctl	= compat_ptr_ioctl,
+	.mmap		= nfqnl_ring_mmap,
+	.poll		= nfqnl_ring_poll,
+	.llseek		= noop_llseek,
+};
+
+static struct miscdevice nfqnl_ring_dev = {
+	.minor		= MISC_DYNAMIC_MINOR,
+	.name		= "nfqueue",
+	.fops		= &nfqnl_ring_fops,
+	.mode		= 0600,
+};
+
+static int __init nfqnl_ring_init(void)
+{
+	int err;
+
+	nfqnl_ring_wq = alloc_workqueue("nfqnl_ring", WQ_HIGHPRI, 0);
+	if (!nfqnl_ring_wq)
+		return -ENOMEM;
+
+	err = misc_register(&nfqnl_ring_dev);
+	if (err < 0)
+		destroy_workqueue(nfqnl_ring_wq);
+
+	return err;
+}
+
+static void nfqnl_ring_fini(void)
+{
+	misc_deregister(&nfqnl_ring_dev);
+	destroy_workqueue(nfqnl_ring_wq);
+}
+#else
+static void nfqnl_ring_destroy(struct nfqnl_instance *queue)
+{
+}
+
+static int __init nfqnl_ring_init(void)
+{
+	return 0;
+}
+
+static void nfqnl_ring_fini(void)
+{
+}
+#endif /* CONFIG_NETFILTER_NETLINK_QUEUE_RING */
+
 static int
 nfqnl_set_mode(struct nfqnl_instance *queue,
 	       unsigned char mode, unsigned int range)
@@ -1228,6 +2108,7 @@ nfqnl_rcv_nl_event(struct notifier_block *this,
 			}
 		}
 		spin_unlock(&q->instances_lock);
+		nf_queue_bypass_flush(n->net);
 	}
 	return NOTIFY_DONE;
 }
@@ -1241,7 +2122,7 @@ static const struct nla_policy nfqa_vlan_policy[NFQA_VLAN_MAX + 1] = {
 	[NFQA_VLAN_PROTO]	= { .type = NLA_U16},
 };
 
-static const struct nla_policy nfqa_verdict_policy[NFQA_MAX+1] = {
+static const struct nla_policy nfqa_verdict_policy[NFQNL_ATTR_MAX+1] = {
 	[NFQA_VERDICT_HDR]	= { .len = sizeof(struct nfqnl_msg_verdict_hdr) },
 	[NFQA_MARK]		= { .type = NLA_U32 },
 	[NFQA_PAYLOAD]		= { .type = NLA_UNSPEC },
@@ -1249,12 +2130,14 @@ static const struct nla_policy nfqa_verdict_policy[NFQA_MAX+1] = {
 	[NFQA_EXP]		= { .type = NLA_UNSPEC },
 	[NFQA_VLAN]		= { .type = NLA_NESTED },
 	[NFQA_PRIORITY]		= { .type = NLA_U32 },
+	[NFQA_VERDICT_FLAGS]	= { .type = NLA_U32 },
 };
 
-static const struct nla_policy nfqa_verdict_batch_policy[NFQA_MAX+1] = {
+static const struct nla_policy nfqa_verdict_batch_policy[NFQNL_ATTR_MAX+1] = {
 	[NFQA_VERDICT_HDR]	= { .len = sizeof(struct nfqnl_msg_verdict_hdr) },
 	[NFQA_MARK]		= { .type = NLA_U32 },
 	[NFQA_PRIORITY]		= { .type = NLA_U32 },
+	[NFQA_VERDICT_FLAGS]	= { .type = NLA_U32 },
 };
 
 static struct nfqnl_instance *
@@ -1288,6 +2171,18 @@ verdicthdr_get(const struct nlattr * const nfqa[])
 	return vhdr;
 }
 
+static int verdictflags_get(const struct nlattr * const nfqa[], u32 *flags)
+{
+	*flags = 0;
+	if (nfqa[NFQA_VERDICT_FLAGS])
+		*flags = ntohl(nla_get_be32(nfqa[NFQA_VERDICT_FLAGS]));
+
+	if (*flags & ~NFQA_VERDICT_F_FLOW_BYPASS)
+		return -EOPNOTSUPP;
+
+	return 0;
+}
+
 static int nfq_id_after(unsigned int id, unsigned int max)
 {
 	return (int)(id - max) > 0;
@@ -1302,8 +2197,11 @@ static int nfqnl_recv_verdict_batch(struct sk_buff *skb,
 	struct nf_queue_entry *entry, *tmp;
 	struct nfqnl_msg_verdict_hdr *vhdr;
 	struct nfqnl_instance *queue;
-	unsigned int verdict, maxid;
+	unsigned int verdict, maxid, i;
+	struct nfqnl_shard *shard;
 	LIST_HEAD(batch_list);
+	u32 vflags;
+	int err;
 
 	queue = verdict_instance_lookup(q, queue_num,
 					NETLINK_CB(skb).portid);
@@ -1314,19 +2212,27 @@ static int nfqnl_recv_verdict_batch(struct sk_buff *skb,
 	if (!vhdr)
 		return -EINVAL;
 
+	err = verdictflags_get(nfqa, &vflags);
+	if (err < 0)
+		return err;
+
 	verdict = ntohl(vhdr->verdict);
 	maxid = ntohl(vhdr->id);
 
-	spin_lock_bh(&queue->lock);
+	for (i = 0; i <= nfqnl_shard_mask(queue); i++) {
+		shard = &queue->shards[i];
 
-	list_for_each_entry_safe(entry, tmp, &queue->queue_list, list) {
-		if (nfq_id_after(entry->id, maxid))
-			break;
-		__dequeue_entry(queue, entry);
-		list_add_tail(&entry->list, &batch_list);
-	}
+		spin_lock_bh(&shard->lock);
 
-	spin_unlock_bh(&queue->lock);
+		list_for_each_entry_safe(entry, tmp, &shard->queue_list, list) {
+			if (nfq_id_after(entry->id, maxid))
+				break;
+			__dequeue_entry(queue, shard, entry);
+			list_add_tail(&entry->list, &batch_list);
+		}
+
+		spin_unlock_bh(&shard->lock);
+	}
 
 	if (list_empty(&batch_list))
 		return -ENOENT;
@@ -1338,6 +2244,9 @@ static int nfqnl_recv_verdict_batch(struct sk_buff *skb,
 		if (nfqa[NFQA_PRIORITY])
 			entry->skb->priority = ntohl(nla_get_be32(nfqa[NFQA_PRIORITY]));
 
+		if (vflags & NFQA_VERDICT_F_FLOW_BYPASS)
+			nfqnl_flow_bypass(queue, entry, verdict);
+
 		nfqnl_reinject(entry, verdict);
 	}
 	return 0;
@@ -1417,6 +2326,7 @@ static int nfqnl_recv_verdict(struct sk_buff *skb, const struct nfnl_info *info,
 	struct nf_queue_entry *entry;
 	struct nf_conn *ct = NULL;
 	unsigned int verdict;
+	u32 vflags;
 	int err;
 
 	queue = verdict_instance_lookup(q, queue_num,
@@ -1428,6 +2338,10 @@ static int nfqnl_recv_verdict(struct sk_buff *skb, const struct nfnl_info *info,
 	if (!vhdr)
 		return -EINVAL;
 
+	err = verdictflags_get(nfqa, &vflags);
+	if (err < 0)
+		return err;
+
 	verdict = ntohl(vhdr->verdict);
 
 	entry = find_dequeue_entry(queue, ntohl(vhdr->id));
@@ -1453,12 +2367,19 @@ static int nfqnl_recv_verdict(struct sk_buff *skb, const struct nfnl_info *info,
 		u16 payload_len = nla_len(nfqa[NFQA_PAYLOAD]);
 		int diff = payload_len - entry->skb->len;
 
-		if (nfqnl_mangle(nla_data(nfqa[NFQA_PAYLOAD]),
-				 payload_len, entry, diff) < 0)
-			verdict = NF_DROP;
+		if (nfqnl_gso_hdr_only(queue, entry->skb, payload_len)) {
+			if (nfqnl_mangle_gso_hdr(nla_data(nfqa[NFQA_PAYLOAD]),
+						 payload_len, entry) < 0)
+				verdict = NF_DROP;
+		} else {
+			if (nfqnl_mangle(nla_data(nfqa[NFQA_PAYLOAD]),
+					 payload_len, entry, diff) < 0)
+				verdict = NF_DROP;
 
-		if (ct && diff)
-			nfnl_ct->seq_adjust(entry->skb, ct, ctinfo, diff);
+			if (ct && diff)
+				nfnl_ct->seq_adjust(entry->skb, ct, ctinfo,
+						    diff);
+		}
 	}
 
 	if (nfqa[NFQA_MARK])
@@ -1467,6 +2388,9 @@ static int nfqnl_recv_verdict(struct sk_buff *skb, const struct nfnl_info *info,
 	if (nfqa[NFQA_PRIORITY])
 		entry->skb->priority = ntohl(nla_get_be32(nfqa[NFQA_PRIORITY]));
 
+	if (vflags & NFQA_VERDICT_F_FLOW_BYPASS)
+		nfqnl_flow_bypass(queue, entry, verdict);
+
 	nfqnl_reinject(entry, verdict);
 	return 0;
 }
@@ -1495,9 +2419,11 @@ static int nfqnl_recv_config(struct sk_buff *skb, const struct nfnl_info *info,
 {
 	struct nfnl_queue_net *q = nfnl_queue_pernet(info->net);
 	u_int16_t queue_num = ntohs(info->nfmsg->res_id);
+	struct hlist_head *hash = NULL, *bind_hash = NULL;
 	struct nfqnl_msg_config_cmd *cmd = NULL;
 	struct nfqnl_instance *queue;
 	__u32 flags = 0, mask = 0;
+	unsigned int hash_size = 0;
 	int ret = 0;
 
 	if (nfqa[NFQA_CFG_CMD]) {
@@ -1524,7 +2450,7 @@ static int nfqnl_recv_config(struct sk_buff *skb, const struct nfnl_info *info,
 		flags = ntohl(nla_get_be32(nfqa[NFQA_CFG_FLAGS]));
 		mask = ntohl(nla_get_be32(nfqa[NFQA_CFG_MASK]));
 
-		if (flags >= NFQA_CFG_F_MAX)
+		if (flags >= NFQNL_CFG_F_MAX)
 			return -EOPNOTSUPP;
 
 #if !IS_ENABLED(CONFIG_NETWORK_SECMARK)
@@ -1544,6 +2470,24 @@ static int nfqnl_recv_config(struct sk_buff *skb, const struct nfnl_info *info,
 		}
 	}
 
+	/* id hashes are allocated here, we cannot sleep further down */
+	if (cmd && cmd->command == NFQNL_CFG_CMD_BIND) {
+		bind_hash = nfqnl_hash_alloc(nfqnl_hash_size(NFQNL_QMAX_DEFAULT));
+		if (!bind_hash)
+			return -ENOMEM;
+	}
+
+	if (nfqa[NFQA_CFG_QUEUE_MAXLEN]) {
+		__be32 maxlen = nla_get_be32(nfqa[NFQA_CFG_QUEUE_MAXLEN]);
+
+		hash_size = nfqnl_hash_size(ntohl(maxlen));
+		hash = nfqnl_hash_alloc(hash_size);
+		if (!hash) {
+			kvfree(bind_hash);
+			return -ENOMEM;
+		}
+	}
+
 	rcu_read_lock();
 	queue = instance_lookup(q, queue_num);
 	if (queue && queue->peer_portid != NETLINK_CB(skb).portid) {
@@ -1559,11 +2503,15 @@ static int nfqnl_recv_config(struct sk_buff *skb, const struct nfnl_info *info,
 				goto err_out_unlock;
 			}
 			queue = instance_create(q, queue_num,
-						NETLINK_CB(skb).portid);
+						NETLINK_CB(skb).portid,
+						bind_hash);
 			if (IS_ERR(queue)) {
 				ret = PTR_ERR(queue);
 				goto err_out_unlock;
 			}
+			bind_hash = NULL;
+			/* new conntrack entries get room for flow bypasses */
+			WRITE_ONCE(info->net->nf.queue_bypass_used, true);
 			break;
 		case NFQNL_CFG_CMD_UNBIND:
 			if (!queue) {
@@ -1571,6 +2519,7 @@ static int nfqnl_recv_config(struct sk_buff *skb, const struct nfnl_info *info,
 				goto err_out_unlock;
 			}
 			instance_destroy(q, queue);
+			nf_queue_bypass_flush(info->net);
 			goto err_out_unlock;
 		case NFQNL_CFG_CMD_PF_BIND:
 		case NFQNL_CFG_CMD_PF_UNBIND:
@@ -1600,6 +2549,9 @@ static int nfqnl_recv_config(struct sk_buff *skb, const struct nfnl_info *info,
 		spin_lock_bh(&queue->lock);
 		queue->queue_maxlen = ntohl(*queue_maxlen);
 		spin_unlock_bh(&queue->lock);
+
+		if (hash_size != nfqnl_hash_cur_size(queue))
+			hash = nfqnl_hash_resize(queue, hash, hash_size);
 	}
 
 	if (nfqa[NFQA_CFG_FLAGS]) {
@@ -1611,6 +2563,8 @@ static int nfqnl_recv_config(struct sk_buff *skb, const struct nfnl_info *info,
 
 err_out_unlock:
 	rcu_read_unlock();
+	kvfree(bind_hash);
+	kvfree(hash);
 	return ret;
 }
 
@@ -1623,7 +2577,7 @@ static const struct nfnl_callback nfqnl_cb[NFQNL_MSG_MAX] = {
 	[NFQNL_MSG_VERDICT]	= {
 		.call		= nfqnl_recv_verdict,
 		.type		= NFNL_CB_RCU,
-		.attr_count	= NFQA_MAX,
+		.attr_count	= NFQNL_ATTR_MAX,
 		.policy		= nfqa_verdict_policy
 	},
 	[NFQNL_MSG_CONFIG]	= {
@@ -1635,7 +2589,7 @@ static const struct nfnl_callback nfqnl_cb[NFQNL_MSG_MAX] = {
 	[NFQNL_MSG_VERDICT_BATCH] = {
 		.call		= nfqnl_recv_verdict_batch,
 		.type		= NFNL_CB_RCU,
-		.attr_count	= NFQA_MAX,
+		.attr_count	= NFQNL_ATTR_MAX,
 		.policy		= nfqa_verdict_batch_policy
 	},
 };
@@ -1725,10 +2679,11 @@ static int seq_show(struct seq_file *s, void *v)
 
 	seq_printf(s, "%5u %6u %5u %1u %5u %5u %5u %8u %2d\n",
 		   inst->queue_num,
-		   inst->peer_portid, inst->queue_total,
+		   inst->peer_portid, atomic_read(&inst->queue_total),
 		   inst->copy_mode, inst->copy_range,
-		   inst->queue_dropped, inst->queue_user_dropped,
-		   inst->id_sequence, 1);
+		   atomic_read(&inst->queue_dropped),
+		   atomic_read(&inst->queue_user_dropped),
+		   atomic_read(&inst->id_sequence), 1);
 	return 0;
 }
 
@@ -1781,6 +2736,9 @@ static int __init nfnetlink_queue_init(void)
 {
 	int status;
 
+	BUILD_BUG_ON(NFQA_CFG_F_GSO_HDR < NFQA_CFG_F_MAX);
+	BUILD_BUG_ON(NFQA_VERDICT_FLAGS <= NFQA_MAX);
+
 	status = register_pernet_subsys(&nfnl_queue_net_ops);
 	if (status < 0) {
 		pr_err("failed to register pernet ops\n");
@@ -1800,10 +2758,18 @@ static int __init nfnetlink_queue_init(void)
 		goto cleanup_netlink_subsys;
 	}
 
+	status = nfqnl_ring_init();
+	if (status < 0) {
+		pr_err("failed to register ring device\n");
+		goto cleanup_netdev_notifier;
+	}
+
 	nf_register_queue_handler(&nfqh);
 
 	return status;
 
+cleanup_netdev_notifier:
+	unregister_netdevice_notifier(&nfqnl_dev_notifier);
 cleanup_netlink_subsys:
 	nfnetlink_subsys_unregister(&nfqnl_subsys);
 cleanup_netlink_notifier:
@@ -1822,6 +2788,7 @@ static void __exit nfnetlink_queue_fini(void)
 	unregister_pernet_subsys(&nfnl_queue_net_ops);
 
 	rcu_barrier(); /* Wait for completion of call_rcu()'s */
+	nfqnl_ring_fini();
 }
 
 MODULE_DESCRIPTION("netfilter packet queue handler");
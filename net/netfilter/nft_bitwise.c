@@ -593,6 +593,148 @@ const struct nft_expr_ops nft_bitwise_fast_ops = {
 	.offload	= nft_bitwise_fast_offload,
 };
 
+static int nft_bitwise16_fast_init(const struct nft_ctx *ctx,
+				   const struct nft_expr *expr,
+				   const struct nlattr * const tb[])
+{
+	struct nft_bitwise16_fast_expr *priv = nft_expr_priv(expr);
+	struct nft_data_desc desc = {
+		.type	= NFT_DATA_VALUE,
+		.size	= sizeof(priv->mask),
+		.len	= sizeof(priv->mask),
+	};
+	int err;
+
+	err = nft_parse_register_load(ctx, tb[NFTA_BITWISE_SREG], &priv->sreg,
+				      sizeof(priv->mask));
+	if (err < 0)
+		return err;
+
+	err = nft_parse_register_store(ctx, tb[NFTA_BITWISE_DREG], &priv->dreg,
+				       NULL, NFT_DATA_VALUE, sizeof(priv->mask));
+	if (err < 0)
+		return err;
+
+	if (tb[NFTA_BITWISE_DATA] ||
+	    tb[NFTA_BITWISE_SREG2])
+		return -EINVAL;
+
+	if (!tb[NFTA_BITWISE_MASK] ||
+	    !tb[NFTA_BITWISE_XOR])
+		return -EINVAL;
+
+	err = nft_data_init(NULL, &priv->mask, &desc, tb[NFTA_BITWISE_MASK]);
+	if (err < 0)
+		return err;
+
+	return nft_data_init(NULL, &priv->xor, &desc, tb[NFTA_BITWISE_XOR]);
+}
+
+static int
+nft_bitwise16_fast_dump(struct sk_buff *skb,
+			const struct nft_expr *expr, bool reset)
+{
+	const struct nft_bitwise16_fast_expr *priv = nft_expr_priv(expr);
+
+	if (nft_dump_register(skb, NFTA_BITWISE_SREG, priv->sreg))
+		return -1;
+	if (nft_dump_register(skb, NFTA_BITWISE_DREG, priv->dreg))
+		return -1;
+	if (nla_put_be32(skb, NFTA_BITWISE_LEN, htonl(sizeof(priv->mask))))
+		return -1;
+	if (nla_put_be32(skb, NFTA_BITWISE_OP, htonl(NFT_BITWISE_MASK_XOR)))
+		return -1;
+
+	if (nft_data_dump(skb, NFTA_BITWISE_MASK, &priv->mask,
+			  NFT_DATA_VALUE, sizeof(priv->mask)) < 0)
+		return -1;
+
+	if (nft_data_dump(skb, NFTA_BITWISE_XOR, &priv->xor,
+			  NFT_DATA_VALUE, sizeof(priv->xor)) < 0)
+		return -1;
+
+	return 0;
+}
+
+static int nft_bitwise16_fast_offload(struct nft_offload_ctx *ctx,
+				      struct nft_flow_rule *flow,
+				      const struct nft_expr *expr)
+{
+	const struct nft_bitwise16_fast_expr *priv = nft_expr_priv(expr);
+	struct nft_offload_reg *reg = &ctx->regs[priv->dreg];
+
+	if (memcmp(&priv->xor, &zero, sizeof(priv->xor)) ||
+	    priv->sreg != priv->dreg || reg->len != sizeof(priv->mask))
+		return -EOPNOTSUPP;
+
+	memcpy(&reg->mask, &priv->mask, sizeof(priv->mask));
+
+	return 0;
+}
+
+static bool nft_bitwise16_fast_reduce(struct nft_regs_track *track,
+				      const struct nft_expr *expr)
+{
+	const struct nft_bitwise16_fast_expr *priv = nft_expr_priv(expr);
+	const struct nft_bitwise16_fast_expr *bitwise;
+	unsigned int regcount;
+	u8 dreg;
+	int i;
+
+	if (!track->regs[priv->sreg].selector)
+		return false;
+
+	bitwise = nft_expr_priv(track->regs[priv->dreg].selector);
+	if (track->regs[priv->sreg].selector == track->regs[priv->dreg].selector &&
+	    track->regs[priv->sreg].num_reg == 0 &&
+	    track->regs[priv->dreg].bitwise &&
+	    track->regs[priv->dreg].bitwise->ops == expr->ops &&
+	    priv->sreg == bitwise->sreg &&
+	    priv->dreg == bitwise->dreg &&
+	    !memcmp(&priv->mask, &bitwise->mask, sizeof(priv->mask)) &&
+	    !memcmp(&priv->xor, &bitwise->xor, sizeof(priv->xor))) {
+		track->cur = expr;
+		return true;
+	}
+
+	if (track->regs[priv->sreg].bitwise ||
+	    track->regs[priv->sreg].num_reg != 0) {
+		nft_reg_track_cancel(track, priv->dreg, sizeof(priv->mask));
+		return false;
+	}
+
+	if (priv->sreg != priv->dreg) {
+		nft_reg_track_update(track, track->regs[priv->sreg].selector,
+				     priv->dreg, sizeof(priv->mask));
+	}
+
+	dreg = priv->dreg;
+	regcount = sizeof(priv->mask) / NFT_REG32_SIZE;
+	for (i = 0; i < regcount; i++, dreg++)
+		track->regs[dreg].bitwise = expr;
+
+	return false;
+}
+
+/* IPv6 prefixes, as the 16 byte cmp, on 64 bit aligned registers. */
+const struct nft_expr_ops nft_bitwise16_fast_ops = {
+	.type		= &nft_bitwise_type,
+	.size		= NFT_EXPR_SIZE(sizeof(struct nft_bitwise16_fast_expr)),
+	.eval		= NULL, /* inlined */
+	.init		= nft_bitwise16_fast_init,
+	.dump		= nft_bitwise16_fast_dump,
+	.reduce		= nft_bitwise16_fast_reduce,
+	.offload	= nft_bitwise16_fast_offload,
+};
+
+static bool nft_bitwise_reg_aligned(const struct nlattr *attr)
+{
+	u32 reg = ntohl(nla_get_be32(attr));
+
+	return (reg >= NFT_REG_1 && reg <= NFT_REG_4) ||
+	       (reg >= NFT_REG32_00 && reg <= NFT_REG32_12 && reg % 2 == 0);
+}
+
 static const struct nft_expr_ops *
 nft_bitwise_select_ops(const struct nft_ctx *ctx,
 		       const struct nlattr * const tb[])
@@ -609,14 +751,19 @@ nft_bitwise_select_ops(const struct nft_ctx *ctx,
 	if (err < 0)
 		return ERR_PTR(err);
 
-	if (len != sizeof(u32))
-		return &nft_bitwise_ops;
-
 	if (tb[NFTA_BITWISE_OP] &&
 	    ntohl(nla_get_be32(tb[NFTA_BITWISE_OP])) != NFT_BITWISE_MASK_XOR)
 		return &nft_bitwise_ops;
 
-	return &nft_bitwise_fast_ops;
+	if (len == sizeof(u32))
+		return &nft_bitwise_fast_ops;
+
+	if (len == sizeof(struct nft_data) &&
+	    nft_bitwise_reg_aligned(tb[NFTA_BITWISE_SREG]) &&
+	    nft_bitwise_reg_aligned(tb[NFTA_BITWISE_DREG]))
+		return &nft_bitwise16_fast_ops;
+
+	return &nft_bitwise_ops;
 }
 
 struct nft_expr_type nft_bitwise_type __read_mostly = {
@@ -641,6 +788,8 @@ bool nft_expr_reduce_bitwise(struct nft_regs_track *track,
 		return nft_bitwise_reduce(track, next);
 	else if (next->ops == &nft_bitwise_fast_ops)
 		return nft_bitwise_fast_reduce(track, next);
+	else if (next->ops == &nft_bitwise16_fast_ops)
+		return nft_bitwise16_fast_reduce(track, next);
 
 	return false;
 }
@@ -0,0 +1,189 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * BPF programs as nf_tables expressions.
+ *
+ * xt_bpf runs a program on the skb alone, so custom parsing can't hand
+ * its results to the rest of the rule.  The "bpf" expression runs a
+ * BPF_PROG_TYPE_NETFILTER program, with the context of hooks attached
+ * through a BPF link, and lets it load and store the data registers in
+ * place through the bpf_nft_regs() kfunc, e.g. to feed a set lookup
+ * with a field it parsed.
+ */
+
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/bpf.h>
+#include <linux/btf.h>
+#include <linux/btf_ids.h>
+#include <linux/filter.h>
+#include <linux/netlink.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nf_tables.h>
+#include <linux/netfilter/nft_bpf.h>
+#include <net/netfilter/nf_tables.h>
+#include <net/netfilter/nf_bpf_link.h>
+
+/* data registers as seen by programs, register 0 holds the verdict */
+#define NFT_BPF_REGS_OFF	(NFT_REG_SIZE / NFT_REG32_SIZE)
+#define NFT_BPF_REGS_SIZE	((NFT_REG32_NUM - NFT_BPF_REGS_OFF) * NFT_REG32_SIZE)
+
+struct nft_bpf {
+	struct bpf_prog		*prog;
+};
+
+static void nft_bpf_eval(const struct nft_expr *expr,
+			 struct nft_regs *regs,
+			 const struct nft_pktinfo *pkt)
+{
+	const struct nft_bpf *priv = nft_expr_priv(expr);
+	struct bpf_nf_ctx ctx = {
+		.state	= pkt->state,
+		.skb	= pkt->skb,
+		.pkt	= pkt,
+		.regs	= regs,
+	};
+
+	if (bpf_prog_run(priv->prog, &ctx) != NF_ACCEPT)
+		regs->verdict.code = NFT_BREAK;
+}
+
+static const struct nla_policy nft_bpf_policy[NFTA_BPF_MAX + 1] = {
+	[NFTA_BPF_FD]	= { .type = NLA_U32 },
+	[NFTA_BPF_ID]	= { .type = NLA_U32 },
+	[NFTA_BPF_TAG]	= { .type = NLA_BINARY, .len = BPF_TAG_SIZE },
+};
+
+static int nft_bpf_init(const struct nft_ctx *ctx,
+			const struct nft_expr *expr,
+			const struct nlattr * const tb[])
+{
+	struct nft_bpf *priv = nft_expr_priv(expr);
+	struct bpf_prog *prog;
+
+	if (!tb[NFTA_BPF_FD])
+		return -EINVAL;
+
+	prog = bpf_prog_get_type(ntohl(nla_get_be32(tb[NFTA_BPF_FD])),
+				 BPF_PROG_TYPE_NETFILTER);
+	if (IS_ERR(prog))
+		return PTR_ERR(prog);
+
+	priv->prog = prog;
+
+	return 0;
+}
+
+static void nft_bpf_destroy(const struct nft_ctx *ctx,
+			    const struct nft_expr *expr)
+{
+	struct nft_bpf *priv = nft_expr_priv(expr);
+
+	bpf_prog_put(priv->prog);
+}
+
+static int nft_bpf_dump(struct sk_buff *skb,
+			const struct nft_expr *expr, bool reset)
+{
+	const struct nft_bpf *priv = nft_expr_priv(expr);
+
+	if (nla_put_be32(skb, NFTA_BPF_ID, htonl(priv->prog->aux->id)) ||
+	    nla_put(skb, NFTA_BPF_TAG, BPF_TAG_SIZE, priv->prog->tag))
+		return -1;
+
+	return 0;
+}
+
+static bool nft_bpf_reduce(struct nft_regs_track *track,
+			   const struct nft_expr *expr)
+{
+	/* any register may have been written */
+	nft_reg_track_cancel(track, NFT_BPF_REGS_OFF, NFT_BPF_REGS_SIZE);
+
+	return false;
+}
+
+static struct nft_expr_type nft_bpf_type;
+static const struct nft_expr_ops nft_bpf_ops = {
+	.type		= &nft_bpf_type,
+	.size		= NFT_EXPR_SIZE(sizeof(struct nft_bpf)),
+	.eval		= nft_bpf_eval,
+	.init		= nft_bpf_init,
+	.destroy	= nft_bpf_destroy,
+	.dump		= nft_bpf_dump,
+	.reduce		= nft_bpf_reduce,
+};
+
+static struct nft_expr_type nft_bpf_type __read_mostly = {
+	.name		= "bpf",
+	.ops		= &nft_bpf_ops,
+	.policy		= nft_bpf_policy,
+	.maxattr	= NFTA_BPF_MAX,
+	.owner		= THIS_MODULE,
+};
+
+__bpf_kfunc_start_defs();
+
+/**
+ * bpf_nft_regs - Return the nf_tables data registers
+ * @ctx: program context
+ * @rdwr_buf_size: number of bytes the program accesses, at most 64
+ *
+ * Returns a pointer to the registers from NFT_REG32_00 on, or NULL if
+ * the program doesn't run from the "bpf" expression.
+ */
+__bpf_kfunc u32 *bpf_nft_regs(struct bpf_nf_ctx *ctx, const int rdwr_buf_size)
+{
+	if (!ctx->regs || rdwr_buf_size <= 0 ||
+	    rdwr_buf_size > NFT_BPF_REGS_SIZE)
+		return NULL;
+
+	return &ctx->regs->data[NFT_BPF_REGS_OFF];
+}
+
+/**
+ * bpf_nft_pktinfo - Return the nf_tables packet information
+ * @ctx: program context
+ *
+ * Returns NULL if the program doesn't run from the "bpf" expression.
+ */
+__bpf_kfunc const struct nft_pktinfo *bpf_nft_pktinfo(struct bpf_nf_ctx *ctx)
+{
+	return ctx->pkt;
+}
+
+__bpf_kfunc_end_defs();
+
+BTF_KFUNCS_START(nft_bpf_kfunc_ids)
+BTF_ID_FLAGS(func, bpf_nft_regs, KF_RET_NULL)
+BTF_ID_FLAGS(func, bpf_nft_pktinfo, KF_RET_NULL)
+BTF_KFUNCS_END(nft_bpf_kfunc_ids)
+
+static const struct btf_kfunc_id_set nft_bpf_kfunc_set = {
+	.owner	= THIS_MODULE,
+	.set	= &nft_bpf_kfunc_ids,
+};
+
+static int __init nft_bpf_module_init(void)
+{
+	int err;
+
+	err = register_btf_kfunc_id_set(BPF_PROG_TYPE_NETFILTER,
+					&nft_bpf_kfunc_set);
+	if (err < 0)
+		return err;
+
+	return nft_register_expr(&nft_bpf_type);
+}
+
+static void __exit nft_bpf_module_exit(void)
+{
+	nft_unregister_expr(&nft_bpf_type);
+}
+
+module_init(nft_bpf_module_init);
+module_exit(nft_bpf_module_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_ALIAS_NFT_EXPR("bpf");
+MODULE_DESCRIPTION("nftables BPF program support");
@@ -8,6 +8,9 @@
 #include <linux/kernel.h>
 #include <linux/init.h>
 #include <linux/module.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/mutex.h>
 #include <linux/netlink.h>
 #include <linux/netfilter.h>
 #include <linux/netfilter/nfnetlink.h>
@@ -24,10 +27,27 @@
 /* Used for matches where *info is larger than X byte */
 #define NFT_MATCH_LARGE_THRESH	192
 
+/* Info of a large match, kept out of line.  Matches without destructor
+ * and without kernel private part can't tell two rules with the same
+ * info apart once checked: those rules share a single copy, which is
+ * common when migrating large rulesets full of identical u32 or policy
+ * matches.
+ */
+struct nft_xt_match_info {
+	struct hlist_node	node;
+	const struct xt_match	*match;
+	unsigned int		use;
+	u32			hash;
+	u8			info[] __aligned(8);
+};
+
 struct nft_xt_match_priv {
-	void *info;
+	struct nft_xt_match_info *mi;
 };
 
+static DEFINE_HASHTABLE(nft_match_info_ht, 8);
+static DEFINE_MUTEX(nft_match_info_mutex);
+
 static int nft_compat_chain_validate_dependency(const struct nft_ctx *ctx,
 						const char *tablename)
 {
@@ -423,7 +443,7 @@ static void nft_match_large_eval(const struct nft_expr *expr,
 {
 	struct nft_xt_match_priv *priv = nft_expr_priv(expr);
 
-	__nft_match_eval(expr, regs, pkt, priv->info);
+	__nft_match_eval(expr, regs, pkt, priv->mi->info);
 }
 
 static void nft_match_eval(const struct nft_expr *expr,
@@ -527,22 +547,81 @@ nft_match_init(const struct nft_ctx *ctx, const struct nft_expr *expr,
 	return __nft_match_init(ctx, expr, tb, nft_expr_priv(expr));
 }
 
+static bool nft_match_info_shared(const struct xt_match *m)
+{
+	return !m->destroy && !m->usersize;
+}
+
+/* Returns an existing copy of @new->info if any, and frees @new. */
+static struct nft_xt_match_info *
+nft_match_info_get(struct nft_xt_match_info *new)
+{
+	unsigned int size = XT_ALIGN(new->match->matchsize);
+	struct nft_xt_match_info *mi;
+
+	new->hash = jhash(new->info, size, (u32)(unsigned long)new->match);
+
+	mutex_lock(&nft_match_info_mutex);
+	hash_for_each_possible(nft_match_info_ht, mi, node, new->hash) {
+		if (mi->match == new->match && mi->hash == new->hash &&
+		    !memcmp(mi->info, new->info, size)) {
+			mi->use++;
+			mutex_unlock(&nft_match_info_mutex);
+			kfree(new);
+			return mi;
+		}
+	}
+	new->use = 1;
+	hash_add(nft_match_info_ht, &new->node, new->hash);
+	mutex_unlock(&nft_match_info_mutex);
+
+	return new;
+}
+
+static void nft_match_info_put(struct nft_xt_match_info *mi)
+{
+	if (hlist_unhashed(&mi->node)) {
+		kfree(mi);
+		return;
+	}
+
+	mutex_lock(&nft_match_info_mutex);
+	if (--mi->use == 0)
+		hash_del(&mi->node);
+	else
+		mi = NULL;
+	mutex_unlock(&nft_match_info_mutex);
+
+	kfree(mi);
+}
+
 static int
 nft_match_large_init(const struct nft_ctx *ctx, const struct nft_expr *expr,
 		     const struct nlattr * const tb[])
 {
 	struct nft_xt_match_priv *priv = nft_expr_priv(expr);
 	struct xt_match *m = expr->ops->data;
+	struct nft_xt_match_info *mi;
 	int ret;
 
-	priv->info = kmalloc(XT_ALIGN(m->matchsize), GFP_KERNEL_ACCOUNT);
-	if (!priv->info)
+	mi = kmalloc(struct_size(mi, info, XT_ALIGN(m->matchsize)),
+		     GFP_KERNEL_ACCOUNT);
+	if (!mi)
 		return -ENOMEM;
 
-	ret = __nft_match_init(ctx, expr, tb, priv->info);
-	if (ret)
-		kfree(priv->info);
-	return ret;
+	INIT_HLIST_NODE(&mi->node);
+	mi->match = m;
+	ret = __nft_match_init(ctx, expr, tb, mi->info);
+	if (ret) {
+		kfree(mi);
+		return ret;
+	}
+
+	if (nft_match_info_shared(m))
+		mi = nft_match_info_get(mi);
+
+	priv->mi = mi;
+	return 0;
 }
 
 static void
@@ -573,9 +652,10 @@ static void
 nft_match_large_destroy(const struct nft_ctx *ctx, const struct nft_expr *expr)
 {
 	struct nft_xt_match_priv *priv = nft_expr_priv(expr);
+	struct nft_xt_match_info *mi = priv->mi;
 
-	__nft_match_destroy(ctx, expr, priv->info);
-	kfree(priv->info);
+	__nft_match_destroy(ctx, expr, mi->info);
+	nft_match_info_put(mi);
 }
 
 static int __nft_match_dump(struct sk_buff *skb, const struct nft_expr *expr,
@@ -606,7 +686,7 @@ static int nft_match_large_dump(struct sk_buff *skb,
 {
 	struct nft_xt_match_priv *priv = nft_expr_priv(e);
 
-	return __nft_match_dump(skb, e, priv->info);
+	return __nft_match_dump(skb, e, priv->mi->info);
 }
 
 static int nft_match_validate(const struct nft_ctx *ctx,
@@ -8,17 +8,46 @@
 #include <linux/netfilter/nf_tables.h>
 #include <net/netfilter/nf_tables.h>
 #include <net/netfilter/nf_conntrack.h>
+#include <net/netfilter/nf_conntrack_climit.h>
 #include <net/netfilter/nf_conntrack_count.h>
 #include <net/netfilter/nf_conntrack_core.h>
 #include <net/netfilter/nf_conntrack_tuple.h>
 #include <net/netfilter/nf_conntrack_zones.h>
 
+/* NFTA_CONNLIMIT_FLAGS, next to NFT_CONNLIMIT_F_INV.
+ *
+ * Count connections in a percpu counter that conntrack entries leave as
+ * they are destroyed, see nf_conntrack_climit.c, rather than in a list
+ * of tuples that is walked on each new connection.  Only new connections
+ * are counted, the count is approximate away from the limit.
+ */
+#define NFT_CONNLIMIT_F_PERCPU	(1 << 1)
+
 struct nft_connlimit {
 	struct nf_conncount_list	*list;
+	struct nf_ct_climit		*climit;
 	u32				limit;
 	bool				invert;
 };
 
+static void nft_connlimit_percpu_eval(struct nft_connlimit *priv,
+				      struct nft_regs *regs,
+				      const struct nft_pktinfo *pkt)
+{
+	enum ip_conntrack_info ctinfo;
+	struct nf_conn *ct;
+
+	ct = nf_ct_get(pkt->skb, &ctinfo);
+	if (ct && !nf_ct_is_template(ct) && !nf_ct_is_confirmed(ct) &&
+	    nf_ct_climit_add(ct, priv->climit) < 0) {
+		regs->verdict.code = NF_DROP;
+		return;
+	}
+
+	if (nf_ct_climit_over(priv->climit, priv->limit) ^ priv->invert)
+		regs->verdict.code = NFT_BREAK;
+}
+
 static inline void nft_connlimit_do_eval(struct nft_connlimit *priv,
 					 struct nft_regs *regs,
 					 const struct nft_pktinfo *pkt,
@@ -31,6 +60,11 @@ static inline void nft_connlimit_do_eval(struct nft_connlimit *priv,
 	const struct nf_conn *ct;
 	unsigned int count;
 
+	if (priv->climit) {
+		nft_connlimit_percpu_eval(priv, regs, pkt);
+		return;
+	}
+
 	tuple_ptr = &tuple;
 
 	ct = nf_ct_get(pkt->skb, &ctinfo);
@@ -56,11 +90,41 @@ static inline void nft_connlimit_do_eval(struct nft_connlimit *priv,
 	}
 }
 
+static int nft_connlimit_alloc(struct nft_connlimit *priv, bool percpu,
+			       gfp_t gfp)
+{
+	priv->list = NULL;
+	priv->climit = NULL;
+
+	if (percpu) {
+		priv->climit = nf_ct_climit_alloc(gfp);
+		return priv->climit ? 0 : -ENOMEM;
+	}
+
+	priv->list = kmalloc(sizeof(*priv->list), gfp);
+	if (!priv->list)
+		return -ENOMEM;
+
+	nf_conncount_list_init(priv->list);
+	return 0;
+}
+
+static void nft_connlimit_free(struct nft_connlimit *priv)
+{
+	if (priv->climit) {
+		nf_ct_climit_put(priv->climit);
+		return;
+	}
+
+	nf_conncount_cache_free(priv->list);
+	kfree(priv->list);
+}
+
 static int nft_connlimit_do_init(const struct nft_ctx *ctx,
 				 const struct nlattr * const tb[],
 				 struct nft_connlimit *priv)
 {
-	bool invert = false;
+	bool invert = false, percpu = false;
 	u32 flags, limit;
 	int err;
 
@@ -71,17 +135,21 @@ static int nft_connlimit_do_init(const struct nft_ctx *ctx,
 
 	if (tb[NFTA_CONNLIMIT_FLAGS]) {
 		flags = ntohl(nla_get_be32(tb[NFTA_CONNLIMIT_FLAGS]));
-		if (flags & ~NFT_CONNLIMIT_F_INV)
+		if (flags & ~(NFT_CONNLIMIT_F_INV | NFT_CONNLIMIT_F_PERCPU))
 			return -EOPNOTSUPP;
 		if (flags & NFT_CONNLIMIT_F_INV)
 			invert = true;
+		if (flags & NFT_CONNLIMIT_F_PERCPU) {
+			if (!IS_ENABLED(CONFIG_NF_CONNTRACK_CLIMIT))
+				return -EOPNOTSUPP;
+			percpu = true;
+		}
 	}
 
-	priv->list = kmalloc(sizeof(*priv->list), GFP_KERNEL_ACCOUNT);
-	if (!priv->list)
-		return -ENOMEM;
+	err = nft_connlimit_alloc(priv, percpu, GFP_KERNEL_ACCOUNT);
+	if (err < 0)
+		return err;
 
-	nf_conncount_list_init(priv->list);
 	priv->limit	= limit;
 	priv->invert	= invert;
 
@@ -91,7 +159,7 @@ static int nft_connlimit_do_init(const struct nft_ctx *ctx,
 
 	return 0;
 err_netns:
-	kfree(priv->list);
+	nft_connlimit_free(priv);
 
 	return err;
 }
@@ -100,17 +168,23 @@ static void nft_connlimit_do_destroy(const struct nft_ctx *ctx,
 				     struct nft_connlimit *priv)
 {
 	nf_ct_netns_put(ctx->net, ctx->family);
-	nf_conncount_cache_free(priv->list);
-	kfree(priv->list);
+	nft_connlimit_free(priv);
 }
 
 static int nft_connlimit_do_dump(struct sk_buff *skb,
 				 struct nft_connlimit *priv)
 {
+	u32 flags = 0;
+
+	if (priv->invert)
+		flags |= NFT_CONNLIMIT_F_INV;
+	if (priv->climit)
+		flags |= NFT_CONNLIMIT_F_PERCPU;
+
 	if (nla_put_be32(skb, NFTA_CONNLIMIT_COUNT, htonl(priv->limit)))
 		goto nla_put_failure;
-	if (priv->invert &&
-	    nla_put_be32(skb, NFTA_CONNLIMIT_FLAGS, htonl(NFT_CONNLIMIT_F_INV)))
+	if (flags &&
+	    nla_put_be32(skb, NFTA_CONNLIMIT_FLAGS, htonl(flags)))
 		goto nla_put_failure;
 
 	return 0;
@@ -214,12 +288,12 @@ static int nft_connlimit_clone(struct nft_expr *dst, const struct nft_expr *src,
 {
 	struct nft_connlimit *priv_dst = nft_expr_priv(dst);
 	struct nft_connlimit *priv_src = nft_expr_priv(src);
+	int err;
 
-	priv_dst->list = kmalloc(sizeof(*priv_dst->list), gfp);
-	if (!priv_dst->list)
-		return -ENOMEM;
+	err = nft_connlimit_alloc(priv_dst, priv_src->climit, gfp);
+	if (err < 0)
+		return err;
 
-	nf_conncount_list_init(priv_dst->list);
 	priv_dst->limit	 = priv_src->limit;
 	priv_dst->invert = priv_src->invert;
 
@@ -231,8 +305,7 @@ static void nft_connlimit_destroy_clone(const struct nft_ctx *ctx,
 {
 	struct nft_connlimit *priv = nft_expr_priv(expr);
 
-	nf_conncount_cache_free(priv->list);
-	kfree(priv->list);
+	nft_connlimit_free(priv);
 }
 
 static bool nft_connlimit_gc(struct net *net, const struct nft_expr *expr)
@@ -240,6 +313,9 @@ static bool nft_connlimit_gc(struct net *net, const struct nft_expr *expr)
 	struct nft_connlimit *priv = nft_expr_priv(expr);
 	bool ret;
 
+	if (priv->climit)
+		return nf_ct_climit_empty(priv->climit);
+
 	local_bh_disable();
 	ret = nf_conncount_gc_list(net, priv->list);
 	local_bh_enable();
@@ -30,6 +30,16 @@ struct nft_counter_percpu_priv {
 	struct nft_counter __percpu *counter;
 };
 
+/* Named counters keep the last totals folded from the per-cpu values,
+ * dumps within nf_tables_counter_fold_ms of that reuse them.
+ */
+struct nft_counter_obj_priv {
+	struct nft_counter_percpu_priv	priv;
+	seqlock_t			fold_lock;
+	unsigned long			folded_at;
+	struct nft_counter_tot		folded;
+};
+
 static DEFINE_PER_CPU(struct u64_stats_sync, nft_counter_sync);
 
 static inline void nft_counter_do_eval(struct nft_counter_percpu_priv *priv,
@@ -55,9 +65,9 @@ static inline void nft_counter_obj_eval(struct nft_object *obj,
 					struct nft_regs *regs,
 					const struct nft_pktinfo *pkt)
 {
-	struct nft_counter_percpu_priv *priv = nft_obj_data(obj);
+	struct nft_counter_obj_priv *opriv = nft_obj_data(obj);
 
-	nft_counter_do_eval(priv, regs, pkt);
+	nft_counter_do_eval(&opriv->priv, regs, pkt);
 }
 
 static int nft_counter_do_init(const struct nlattr * const tb[],
@@ -88,9 +98,12 @@ static int nft_counter_obj_init(const struct nft_ctx *ctx,
 				const struct nlattr * const tb[],
 				struct nft_object *obj)
 {
-	struct nft_counter_percpu_priv *priv = nft_obj_data(obj);
+	struct nft_counter_obj_priv *opriv = nft_obj_data(obj);
 
-	return nft_counter_do_init(tb, priv);
+	seqlock_init(&opriv->fold_lock);
+	opriv->folded_at = jiffies - MAX_JIFFY_OFFSET;
+
+	return nft_counter_do_init(tb, &opriv->priv);
 }
 
 static void nft_counter_do_destroy(struct nft_counter_percpu_priv *priv)
@@ -101,9 +114,9 @@ static void nft_counter_do_destroy(struct nft_counter_percpu_priv *priv)
 static void nft_counter_obj_destroy(const struct nft_ctx *ctx,
 				    struct nft_object *obj)
 {
-	struct nft_counter_percpu_priv *priv = nft_obj_data(obj);
+	struct nft_counter_obj_priv *opriv = nft_obj_data(obj);
 
-	nft_counter_do_destroy(priv);
+	nft_counter_do_destroy(&opriv->priv);
 }
 
 static void nft_counter_reset(struct nft_counter_percpu_priv *priv,
@@ -171,12 +184,65 @@ static int nft_counter_do_dump(struct sk_buff *skb,
 	return -1;
 }
 
+static bool nft_counter_fold_read(struct nft_counter_obj_priv *opriv,
+				  struct nft_counter_tot *total,
+				  unsigned long window)
+{
+	unsigned int seq;
+	bool fresh;
+
+	do {
+		seq = read_seqbegin(&opriv->fold_lock);
+		fresh = time_before(jiffies, opriv->folded_at + window);
+		*total = opriv->folded;
+	} while (read_seqretry(&opriv->fold_lock, seq));
+
+	return fresh;
+}
+
+static void nft_counter_fold(struct nft_counter_obj_priv *opriv,
+			     struct nft_counter_tot *total)
+{
+	nft_counter_fetch(&opriv->priv, total);
+
+	write_seqlock_bh(&opriv->fold_lock);
+	opriv->folded = *total;
+	opriv->folded_at = jiffies;
+	write_sequnlock_bh(&opriv->fold_lock);
+}
+
 static int nft_counter_obj_dump(struct sk_buff *skb,
 				struct nft_object *obj, bool reset)
 {
-	struct nft_counter_percpu_priv *priv = nft_obj_data(obj);
+	unsigned int fold_ms = READ_ONCE(nft_counter_fold_ms);
+	struct nft_counter_obj_priv *opriv = nft_obj_data(obj);
+	struct nft_counter_tot total;
 
-	return nft_counter_do_dump(skb, priv, reset);
+	/* resets subtract what was reported, they need exact values */
+	if (reset) {
+		if (nft_counter_do_dump(skb, &opriv->priv, true) < 0)
+			return -1;
+
+		/* the folded totals predate the reset */
+		write_seqlock_bh(&opriv->fold_lock);
+		opriv->folded_at = jiffies - MAX_JIFFY_OFFSET;
+		write_sequnlock_bh(&opriv->fold_lock);
+		return 0;
+	}
+
+	if (!fold_ms)
+		return nft_counter_do_dump(skb, &opriv->priv, false);
+
+	if (!nft_counter_fold_read(opriv, &total, msecs_to_jiffies(fold_ms)))
+		nft_counter_fold(opriv, &total);
+
+	if (nla_put_be64(skb, NFTA_COUNTER_BYTES, cpu_to_be64(total.bytes),
+			 NFTA_COUNTER_PAD) ||
+	    nla_put_be64(skb, NFTA_COUNTER_PACKETS, cpu_to_be64(total.packets),
+			 NFTA_COUNTER_PAD))
+		return -1;
+
+	return 0;
 }
 
 static const struct nla_policy nft_counter_policy[NFTA_COUNTER_MAX + 1] = {
@@ -187,7 +253,7 @@ static const struct nla_policy nft_counter_policy[NFTA_COUNTER_MAX + 1] = {
 struct nft_object_type nft_counter_obj_type;
 static const struct nft_object_ops nft_counter_obj_ops = {
 	.type		= &nft_counter_obj_type,
-	.size		= sizeof(struct nft_counter_percpu_priv),
+	.size		= sizeof(struct nft_counter_obj_priv),
 	.eval		= nft_counter_obj_eval,
 	.init		= nft_counter_obj_init,
 	.destroy	= nft_counter_obj_destroy,
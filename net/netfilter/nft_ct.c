@@ -925,6 +925,7 @@ static void nft_ct_timeout_obj_eval(struct nft_object *obj,
 	}
 
 	rcu_assign_pointer(timeout->timeout, priv->timeout);
+	nf_ct_timeout_changed(ct);
 
 	/* adjust the timeout as per 'new' state. ct is unconfirmed,
 	 * so the current timestamp must not be added.
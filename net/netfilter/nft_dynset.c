@@ -44,6 +44,74 @@ static int nft_dynset_expr_setup(const struct nft_dynset *priv,
 	return 0;
 }
 
+/* Each cpu takes room for NFT_DYNSET_CREDIT_BATCH new elements at a time
+ * from set->nelems, instead of bouncing its cache line around on every
+ * insertion.  Only done for sets large enough that the room held by idle
+ * cpus doesn't matter, see nft_dynset_credit_init().
+ */
+#define NFT_DYNSET_CREDIT_BATCH		32
+#define NFT_DYNSET_CREDIT_MIN_RATIO	16
+
+static bool nft_dynset_nelems_inc(struct nft_set *set)
+{
+	int __percpu *credit = READ_ONCE(set->nelems_credit);
+	int old, take;
+	bool ret;
+
+	if (!credit)
+		return atomic_add_unless(&set->nelems, 1, set->size);
+
+	local_bh_disable();
+	if (__this_cpu_read(*credit) > 0) {
+		__this_cpu_dec(*credit);
+		ret = true;
+		goto out;
+	}
+
+	old = atomic_read(&set->nelems);
+	do {
+		take = min_t(int, (int)READ_ONCE(set->size) - old,
+			     NFT_DYNSET_CREDIT_BATCH);
+		if (take <= 0) {
+			ret = false;
+			goto out;
+		}
+	} while (!atomic_try_cmpxchg(&set->nelems, &old, old + take));
+
+	__this_cpu_write(*credit, take - 1);
+	ret = true;
+out:
+	local_bh_enable();
+	return ret;
+}
+
+static void nft_dynset_nelems_dec(struct nft_set *set)
+{
+	int __percpu *credit = READ_ONCE(set->nelems_credit);
+
+	if (credit)
+		this_cpu_inc(*credit);
+	else
+		atomic_dec(&set->nelems);
+}
+
+/* Stays until the set is destroyed, insertions keep using set->nelems
+ * directly if this fails.
+ */
+static void nft_dynset_credit_init(struct nft_set *set)
+{
+	int __percpu *credit;
+
+	if (set->nelems_credit ||
+	    set->size < num_possible_cpus() * NFT_DYNSET_CREDIT_BATCH *
+			NFT_DYNSET_CREDIT_MIN_RATIO)
+		return;
+
+	credit = alloc_percpu_gfp(int, GFP_KERNEL_ACCOUNT);
+	if (credit)
+		WRITE_ONCE(set->nelems_credit, credit);
+}
+
 static struct nft_elem_priv *nft_dynset_new(struct nft_set *set,
 					    const struct nft_expr *expr,
 					    struct nft_regs *regs)
@@ -53,7 +121,7 @@ static struct nft_elem_priv *nft_dynset_new(struct nft_set *set,
 	void *elem_priv;
 	u64 timeout;
 
-	if (!atomic_add_unless(&set->nelems, 1, set->size))
+	if (!nft_dynset_nelems_inc(set))
 		return NULL;
 
 	timeout = priv->timeout ? : READ_ONCE(set->timeout);
@@ -73,8 +141,7 @@ static struct nft_elem_priv *nft_dynset_new(struct nft_set *set,
 err2:
 	nft_set_elem_destroy(set, elem_priv, false);
 err1:
-	if (set->size)
-		atomic_dec(&set->nelems);
+	nft_dynset_nelems_dec(set);
 	return NULL;
 }
 
@@ -326,6 +393,8 @@ static int nft_dynset_init(const struct nft_ctx *ctx,
 	if (set->size == 0)
 		set->size = 0xffff;
 
+	nft_dynset_credit_init(set);
+
 	priv->set = set;
 	return 0;
 
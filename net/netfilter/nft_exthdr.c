@@ -49,13 +49,27 @@ static void nft_exthdr_ipv6_eval(const struct nft_expr *expr,
 {
 	struct nft_exthdr *priv = nft_expr_priv(expr);
 	u32 *dest = &regs->data[priv->dreg];
+	const struct nft_pktinfo_hdr *hdr;
 	unsigned int offset = 0;
 	int err;
 
 	if (pkt->skb->protocol != htons(ETH_P_IPV6))
 		goto err;
 
-	err = ipv6_find_hdr(pkt->skb, &offset, priv->type, NULL, NULL);
+	hdr = nft_pktinfo_hdr_find(pkt, NFT_PKTINFO_HDR_IPV6, priv->type);
+	if (hdr) {
+		offset = hdr->off;
+		err = offset == NFT_PKTINFO_HDR_NONE ? -ENOENT : 0;
+	} else {
+		err = ipv6_find_hdr(pkt->skb, &offset, priv->type, NULL, NULL);
+		if (err < 0)
+			nft_pktinfo_hdr_store(pkt, NFT_PKTINFO_HDR_IPV6,
+					      priv->type, NFT_PKTINFO_HDR_NONE, 0);
+		else if (offset < NFT_PKTINFO_HDR_NONE)
+			nft_pktinfo_hdr_store(pkt, NFT_PKTINFO_HDR_IPV6,
+					      priv->type, offset, 0);
+	}
+
 	if (priv->flags & NFT_EXTHDR_F_PRESENT) {
 		nft_reg_store8(dest, err >= 0);
 		return;
@@ -185,43 +199,90 @@ nft_tcp_header_pointer(const struct nft_pktinfo *pkt,
 	return skb_header_pointer(pkt->skb, nft_thoff(pkt), *tcphdr_len, buffer);
 }
 
-static void nft_exthdr_tcp_eval(const struct nft_expr *expr,
-				struct nft_regs *regs,
-				const struct nft_pktinfo *pkt)
+/* Returns the offset of the first @type option in the TCP header and sets
+ * *@optl to its length, -ENOENT if there is none, -EMSGSIZE if it is
+ * truncated and -EINVAL if this is no TCP header.  The first lookup of a
+ * packet indexes all options in one pass, later ones for any type are then
+ * served from the pktinfo cache.
+ */
+static int nft_exthdr_tcp_find(const struct nft_pktinfo *pkt, u8 type,
+			       unsigned int *optl)
 {
 	u8 buff[sizeof(struct tcphdr) + MAX_TCP_OPTION_SPACE];
-	struct nft_exthdr *priv = nft_expr_priv(expr);
-	unsigned int i, optl, tcphdr_len, offset;
-	u32 *dest = &regs->data[priv->dreg];
-	struct tcphdr *tcph;
+	const struct nft_pktinfo_hdr *hdr;
+	unsigned int i, len, tcphdr_len;
+	bool complete = true;
+	int found = -ENOENT;
 	u8 *opt;
 
-	tcph = nft_tcp_header_pointer(pkt, sizeof(buff), buff, &tcphdr_len);
-	if (!tcph)
-		goto err;
+	hdr = nft_pktinfo_hdr_find(pkt, NFT_PKTINFO_HDR_TCPOPT, type);
+	if (hdr) {
+		if (hdr->off == NFT_PKTINFO_HDR_NONE)
+			return -ENOENT;
 
-	opt = (u8 *)tcph;
-	for (i = sizeof(*tcph); i < tcphdr_len - 1; i += optl) {
-		optl = optlen(opt, i);
+		*optl = hdr->len;
+		return hdr->off;
+	}
 
-		if (priv->type != opt[i])
-			continue;
+	if (type > TCPOPT_NOP && pkt->flags & NFT_PKTINFO_TCPOPT)
+		return -ENOENT;
 
-		if (i + optl > tcphdr_len || priv->len + priv->offset > optl)
-			goto err;
+	opt = nft_tcp_header_pointer(pkt, sizeof(buff), buff, &tcphdr_len);
+	if (!opt)
+		return -EINVAL;
 
-		offset = i + priv->offset;
-		if (priv->flags & NFT_EXTHDR_F_PRESENT) {
-			nft_reg_store8(dest, 1);
-		} else {
-			if (priv->len % NFT_REG32_SIZE)
-				dest[priv->len / NFT_REG32_SIZE] = 0;
-			memcpy(dest, opt + offset, priv->len);
+	for (i = sizeof(struct tcphdr); i < tcphdr_len - 1; i += len) {
+		len = optlen(opt, i);
+		if (i + len > tcphdr_len) {
+			if (opt[i] == type && found < 0)
+				found = -EMSGSIZE;
+			complete = false;
+			break;
 		}
 
-		return;
+		if (opt[i] == type && found < 0) {
+			found = i;
+			*optl = len;
+		}
+
+		if (opt[i] <= TCPOPT_NOP ||
+		    nft_pktinfo_hdr_find(pkt, NFT_PKTINFO_HDR_TCPOPT, opt[i]))
+			continue;
+
+		if (!nft_pktinfo_hdr_store(pkt, NFT_PKTINFO_HDR_TCPOPT, opt[i],
+					   i, len))
+			complete = false;
 	}
 
+	if (complete)
+		((struct nft_pktinfo *)pkt)->flags |= NFT_PKTINFO_TCPOPT;
+	else if (found == -ENOENT)
+		nft_pktinfo_hdr_store(pkt, NFT_PKTINFO_HDR_TCPOPT, type,
+				      NFT_PKTINFO_HDR_NONE, 0);
+
+	return found;
+}
+
+static void nft_exthdr_tcp_eval(const struct nft_expr *expr,
+				struct nft_regs *regs,
+				const struct nft_pktinfo *pkt)
+{
+	struct nft_exthdr *priv = nft_expr_priv(expr);
+	u32 *dest = &regs->data[priv->dreg];
+	unsigned int optl;
+	int offset;
+
+	offset = nft_exthdr_tcp_find(pkt, priv->type, &optl);
+	if (offset < 0 || priv->len + priv->offset > optl)
+		goto err;
+
+	if (priv->flags & NFT_EXTHDR_F_PRESENT)
+		nft_reg_store8(dest, 1);
+	else if (nft_skb_copy_to_reg(pkt->skb, nft_thoff(pkt) + offset +
+				     priv->offset, dest, priv->len) < 0)
+		goto err;
+
+	return;
 err:
 	if (priv->flags & NFT_EXTHDR_F_PRESENT)
 		*dest = 0;
@@ -233,77 +294,66 @@ static void nft_exthdr_tcp_set_eval(const struct nft_expr *expr,
 				    struct nft_regs *regs,
 				    const struct nft_pktinfo *pkt)
 {
-	u8 buff[sizeof(struct tcphdr) + MAX_TCP_OPTION_SPACE];
 	struct nft_exthdr *priv = nft_expr_priv(expr);
-	unsigned int i, optl, tcphdr_len, offset;
+	unsigned int optl, offset;
+	union {
+		__be16 v16;
+		__be32 v32;
+	} old, new;
 	struct tcphdr *tcph;
+	int i;
 	u8 *opt;
 
-	tcph = nft_tcp_header_pointer(pkt, sizeof(buff), buff, &tcphdr_len);
-	if (!tcph)
+	i = nft_exthdr_tcp_find(pkt, priv->type, &optl);
+	if (i == -ENOENT)
+		return;
+	if (i < 0 || priv->len + priv->offset > optl)
 		goto err;
 
-	if (skb_ensure_writable(pkt->skb, nft_thoff(pkt) + tcphdr_len))
+	if (skb_ensure_writable(pkt->skb, nft_thoff(pkt) + i + optl))
 		goto err;
 
 	tcph = (struct tcphdr *)(pkt->skb->data + nft_thoff(pkt));
 	opt = (u8 *)tcph;
-
-	for (i = sizeof(*tcph); i < tcphdr_len - 1; i += optl) {
-		union {
-			__be16 v16;
-			__be32 v32;
-		} old, new;
-
-		optl = optlen(opt, i);
-
-		if (priv->type != opt[i])
-			continue;
-
-		if (i + optl > tcphdr_len || priv->len + priv->offset > optl)
-			goto err;
-
-		offset = i + priv->offset;
-
-		switch (priv->len) {
-		case 2:
-			old.v16 = (__force __be16)get_unaligned((u16 *)(opt + offset));
-			new.v16 = (__force __be16)nft_reg_load16(
-				&regs->data[priv->sreg]);
-
-			switch (priv->type) {
-			case TCPOPT_MSS:
-				/* increase can cause connection to stall */
-				if (ntohs(old.v16) <= ntohs(new.v16))
-					return;
-			break;
-			}
-
-			if (old.v16 == new.v16)
+	offset = i + priv->offset;
+
+	switch (priv->len) {
+	case 2:
+		old.v16 = (__force __be16)get_unaligned((u16 *)(opt + offset));
+		new.v16 = (__force __be16)nft_reg_load16(
+			&regs->data[priv->sreg]);
+
+		switch (priv->type) {
+		case TCPOPT_MSS:
+			/* increase can cause connection to stall */
+			if (ntohs(old.v16) <= ntohs(new.v16))
 				return;
+		break;
+		}
 
-			put_unaligned(new.v16, (__be16*)(opt + offset));
-			inet_proto_csum_replace2(&tcph->check, pkt->skb,
-						 old.v16, new.v16, false);
-			break;
-		case 4:
-			new.v32 = nft_reg_load_be32(&regs->data[priv->sreg]);
-			old.v32 = (__force __be32)get_unaligned((u32 *)(opt + offset));
+		if (old.v16 == new.v16)
+			return;
 
-			if (old.v32 == new.v32)
-				return;
+		put_unaligned(new.v16, (__be16*)(opt + offset));
+		inet_proto_csum_replace2(&tcph->check, pkt->skb,
+					 old.v16, new.v16, false);
+		break;
+	case 4:
+		new.v32 = nft_reg_load_be32(&regs->data[priv->sreg]);
+		old.v32 = (__force __be32)get_unaligned((u32 *)(opt + offset));
 
-			put_unaligned(new.v32, (__be32*)(opt + offset));
-			inet_proto_csum_replace4(&tcph->check, pkt->skb,
-						 old.v32, new.v32, false);
-			break;
-		default:
-			WARN_ON_ONCE(1);
-			break;
-		}
+		if (old.v32 == new.v32)
+			return;
 
-		return;
+		put_unaligned(new.v32, (__be32*)(opt + offset));
+		inet_proto_csum_replace4(&tcph->check, pkt->skb,
+					 old.v32, new.v32, false);
+		break;
+	default:
+		WARN_ON_ONCE(1);
+		break;
 	}
+
 	return;
 err:
 	regs->verdict.code = NFT_BREAK;
@@ -313,50 +363,42 @@ static void nft_exthdr_tcp_strip_eval(const struct nft_expr *expr,
 				      struct nft_regs *regs,
 				      const struct nft_pktinfo *pkt)
 {
-	u8 buff[sizeof(struct tcphdr) + MAX_TCP_OPTION_SPACE];
 	struct nft_exthdr *priv = nft_expr_priv(expr);
-	unsigned int i, tcphdr_len, optl;
 	struct tcphdr *tcph;
+	unsigned int j, optl;
+	int i;
 	u8 *opt;
 
-	tcph = nft_tcp_header_pointer(pkt, sizeof(buff), buff, &tcphdr_len);
-	if (!tcph)
+	i = nft_exthdr_tcp_find(pkt, priv->type, &optl);
+	/* option not found, continue. This allows to do multiple
+	 * option removals per rule.
+	 */
+	if (i == -ENOENT)
+		return;
+	if (i == -EINVAL)
 		goto err;
+	if (i < 0)
+		goto drop;
 
-	if (skb_ensure_writable(pkt->skb, nft_thoff(pkt) + tcphdr_len))
+	if (skb_ensure_writable(pkt->skb, nft_thoff(pkt) + i + optl))
 		goto drop;
 
 	tcph = (struct tcphdr *)(pkt->skb->data + nft_thoff(pkt));
 	opt = (u8 *)tcph;
 
-	for (i = sizeof(*tcph); i < tcphdr_len - 1; i += optl) {
-		unsigned int j;
-
-		optl = optlen(opt, i);
-		if (priv->type != opt[i])
-			continue;
-
-		if (i + optl > tcphdr_len)
-			goto drop;
-
-		for (j = 0; j < optl; ++j) {
-			u16 n = TCPOPT_NOP;
-			u16 o = opt[i+j];
+	for (j = 0; j < optl; ++j) {
+		u16 n = TCPOPT_NOP;
+		u16 o = opt[i+j];
 
-			if ((i + j) % 2 == 0) {
-				o <<= 8;
-				n <<= 8;
-			}
-			inet_proto_csum_replace2(&tcph->check, pkt->skb, htons(o),
-						 htons(n), false);
+		if ((i + j) % 2 == 0) {
+			o <<= 8;
+			n <<= 8;
 		}
-		memset(opt + i, TCPOPT_NOP, optl);
-		return;
+		inet_proto_csum_replace2(&tcph->check, pkt->skb, htons(o),
+					 htons(n), false);
 	}
-
-	/* option not found, continue. This allows to do multiple
-	 * option removals per rule.
-	 */
+	memset(opt + i, TCPOPT_NOP, optl);
+	nft_pktinfo_hdr_flush(pkt);
 	return;
 err:
 	regs->verdict.code = NFT_BREAK;
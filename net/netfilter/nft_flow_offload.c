@@ -6,6 +6,8 @@
 #include <linux/netfilter.h>
 #include <linux/workqueue.h>
 #include <linux/spinlock.h>
+#include <linux/if_bridge.h>
+#include <linux/netfilter_bridge.h>
 #include <linux/netfilter/nf_conntrack_common.h>
 #include <linux/netfilter/nf_tables.h>
 #include <net/ip.h>
@@ -87,6 +89,7 @@ struct nft_forward_info {
 	} encap[NF_FLOW_TABLE_ENCAP_MAX];
 	u8 num_encaps;
 	u8 ingress_vlans;
+	struct flow_offload_tunnel tun;
 	u8 h_source[ETH_ALEN];
 	u8 h_dest[ETH_ALEN];
 	enum flow_offload_xmit_type xmit_type;
@@ -153,6 +156,20 @@ static void nft_dev_path_info(const struct net_device_path_stack *stack,
 			}
 			info->xmit_type = FLOW_OFFLOAD_XMIT_DIRECT;
 			break;
+		case DEV_PATH_TUN:
+			if (info->tun.proto) {
+				info->indev = NULL;
+				break;
+			}
+			info->tun.src_v4 = path->tun.src_v4;
+			info->tun.dst_v4 = path->tun.dst_v4;
+			info->tun.proto = path->tun.proto;
+			info->tun.ttl = path->tun.ttl;
+			info->tun.tos = path->tun.tos;
+			info->tun.df = path->tun.df;
+			memcpy(info->h_dest, path->tun.h_dest, ETH_ALEN);
+			info->xmit_type = FLOW_OFFLOAD_XMIT_DIRECT;
+			break;
 		default:
 			info->indev = NULL;
 			break;
@@ -209,12 +226,19 @@ static void nft_dev_forward_path(struct nf_flow_route *route,
 	}
 	route->tuple[!dir].in.num_encaps = info.num_encaps;
 	route->tuple[!dir].in.ingress_vlans = info.ingress_vlans;
+	if (info.tun.proto) {
+		/* received with the outer addresses swapped */
+		route->tuple[!dir].in.tun.src_v4 = info.tun.dst_v4;
+		route->tuple[!dir].in.tun.dst_v4 = info.tun.src_v4;
+		route->tuple[!dir].in.tun.proto = info.tun.proto;
+	}
 
 	if (info.xmit_type == FLOW_OFFLOAD_XMIT_DIRECT) {
 		memcpy(route->tuple[dir].out.h_source, info.h_source, ETH_ALEN);
 		memcpy(route->tuple[dir].out.h_dest, info.h_dest, ETH_ALEN);
 		route->tuple[dir].out.ifindex = info.outdev->ifindex;
 		route->tuple[dir].out.hw_ifindex = info.hw_outdev->ifindex;
+		route->tuple[dir].out.tun = info.tun;
 		route->tuple[dir].xmit_type = info.xmit_type;
 	}
 }
@@ -272,6 +296,60 @@ static int nft_flow_route(const struct nft_pktinfo *pkt,
 	return 0;
 }
 
+/* A bridged flow is forwarded from port to port with the ethernet header
+ * and vlan tag it was received with.  With vlan filtering, the bridge may
+ * tag or untag on egress, so such bridges are left alone.
+ */
+static int nft_flow_route_bridge(const struct nft_pktinfo *pkt,
+				 const struct nf_conn *ct,
+				 struct nf_flow_route *route,
+				 enum ip_conntrack_dir dir,
+				 struct nft_flowtable *ft)
+{
+	const struct net_device *in = nft_in(pkt), *out = nft_out(pkt);
+	const struct sk_buff *skb = pkt->skb;
+	const struct net_device *br_dev;
+	const struct ethhdr *eth;
+	int i;
+
+	if (ct->status & IPS_NAT_MASK)
+		return -EOPNOTSUPP;
+
+	if (!in || !out || !skb_mac_header_was_set(skb))
+		return -ENOENT;
+
+	br_dev = netdev_master_upper_dev_get_rcu((struct net_device *)in);
+	if (!br_dev || br_vlan_enabled(br_dev))
+		return -EOPNOTSUPP;
+
+	if (!nft_flowtable_find_dev(in, ft) ||
+	    !nft_flowtable_find_dev(out, ft))
+		return -ENOENT;
+
+	eth = eth_hdr(skb);
+	for (i = 0; i < FLOW_OFFLOAD_DIR_MAX; i++) {
+		const struct net_device *rx = i == dir ? in : out;
+		const struct net_device *tx = i == dir ? out : in;
+
+		route->tuple[i].in.ifindex = rx->ifindex;
+		if (skb_vlan_tag_present(skb)) {
+			route->tuple[i].in.encap[0].id = skb_vlan_tag_get(skb);
+			route->tuple[i].in.encap[0].proto = skb->vlan_proto;
+			route->tuple[i].in.num_encaps = 1;
+		}
+
+		route->tuple[i].out.ifindex = tx->ifindex;
+		route->tuple[i].out.hw_ifindex = tx->ifindex;
+		ether_addr_copy(route->tuple[i].out.h_source,
+				i == dir ? eth->h_source : eth->h_dest);
+		ether_addr_copy(route->tuple[i].out.h_dest,
+				i == dir ? eth->h_dest : eth->h_source);
+		route->tuple[i].xmit_type = FLOW_OFFLOAD_XMIT_BRIDGE;
+	}
+
+	return 0;
+}
+
 static bool nft_flow_offload_skip(struct sk_buff *skb, int family)
 {
 	if (skb_sec_path(skb))
@@ -357,7 +435,12 @@ static void nft_flow_offload_eval(const struct nft_expr *expr,
 		goto out;
 
 	dir = CTINFO2DIR(ctinfo);
-	if (nft_flow_route(pkt, ct, &route, dir, priv->flowtable) < 0)
+	if (nft_pf(pkt) == NFPROTO_BRIDGE)
+		ret = nft_flow_route_bridge(pkt, ct, &route, dir,
+					    priv->flowtable);
+	else
+		ret = nft_flow_route(pkt, ct, &route, dir, priv->flowtable);
+	if (ret < 0)
 		goto err_flow_route;
 
 	flow = flow_offload_alloc(ct);
@@ -391,9 +474,11 @@ static int nft_flow_offload_validate(const struct nft_ctx *ctx,
 {
 	unsigned int hook_mask = (1 << NF_INET_FORWARD);
 
-	if (ctx->family != NFPROTO_IPV4 &&
-	    ctx->family != NFPROTO_IPV6 &&
-	    ctx->family != NFPROTO_INET)
+	if (ctx->family == NFPROTO_BRIDGE)
+		hook_mask = (1 << NF_BR_FORWARD);
+	else if (ctx->family != NFPROTO_IPV4 &&
+		 ctx->family != NFPROTO_IPV6 &&
+		 ctx->family != NFPROTO_INET)
 		return -EOPNOTSUPP;
 
 	return nft_chain_validate_hooks(ctx->chain, hook_mask);
@@ -491,9 +576,20 @@ static int flow_offload_netdev_event(struct notifier_block *this,
 				     unsigned long event, void *ptr)
 {
 	struct net_device *dev = netdev_notifier_info_to_dev(ptr);
+	struct netdev_notifier_changeupper_info *info;
 
-	if (event != NETDEV_DOWN)
+	switch (event) {
+	case NETDEV_DOWN:
+		break;
+	case NETDEV_CHANGEUPPER:
+		/* bridged flows of a port that leaves its bridge */
+		info = ptr;
+		if (info->linking || !netif_is_bridge_master(info->upper_dev))
+			return NOTIFY_DONE;
+		break;
+	default:
 		return NOTIFY_DONE;
+	}
 
 	nf_flow_table_cleanup(dev);
 
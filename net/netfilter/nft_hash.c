@@ -6,18 +6,33 @@
 #include <linux/kernel.h>
 #include <linux/init.h>
 #include <linux/module.h>
+#include <linux/netdevice.h>
 #include <linux/netlink.h>
 #include <linux/netfilter.h>
 #include <linux/netfilter/nf_tables.h>
+#include <linux/netfilter/nft_hash.h>
 #include <net/netfilter/nf_tables.h>
 #include <net/netfilter/nf_tables_core.h>
+#include <net/netfilter/nf_jump_hash.h>
 #include <linux/jhash.h>
+#include <linux/unaligned.h>
+
+#define NFT_HASH_ATTR_MAX	NFTA_HASH_FLAGS
+
+static inline u32 nft_hash_scale(u32 h, u32 modulus, u32 flags)
+{
+	if (flags & NFT_HASH_F_CONSISTENT)
+		return nf_jump_hash(h, modulus);
+
+	return reciprocal_scale(h, modulus);
+}
 
 struct nft_jhash {
 	u8			sreg;
 	u8			dreg;
 	u8			len;
 	bool			autogen_seed:1;
+	u32			flags;
 	u32			modulus;
 	u32			seed;
 	u32			offset;
@@ -31,14 +46,15 @@ static void nft_jhash_eval(const struct nft_expr *expr,
 	const void *data = &regs->data[priv->sreg];
 	u32 h;
 
-	h = reciprocal_scale(jhash(data, priv->len, priv->seed),
-			     priv->modulus);
+	h = nft_hash_scale(jhash(data, priv->len, priv->seed),
+			   priv->modulus, priv->flags);
 
 	regs->data[priv->dreg] = h + priv->offset;
 }
 
 struct nft_symhash {
 	u8			dreg;
+	u32			flags;
 	u32			modulus;
 	u32			offset;
 };
@@ -51,13 +67,59 @@ static void nft_symhash_eval(const struct nft_expr *expr,
 	struct sk_buff *skb = pkt->skb;
 	u32 h;
 
-	h = reciprocal_scale(__skb_get_hash_symmetric_net(nft_net(pkt), skb),
-			     priv->modulus);
+	h = nft_hash_scale(__skb_get_hash_symmetric_net(nft_net(pkt), skb),
+			   priv->modulus, priv->flags);
 
 	regs->data[priv->dreg] = h + priv->offset;
 }
 
-static const struct nla_policy nft_hash_policy[NFTA_HASH_MAX + 1] = {
+struct nft_toeplitz {
+	u8			sreg;
+	u8			dreg;
+	u8			len;
+	u8			key_len;
+	u32			flags;
+	u32			modulus;
+	u32			offset;
+	u8			key[NETDEV_RSS_KEY_LEN];
+};
+
+static u32 nft_toeplitz(const u8 *key, const u8 *data, unsigned int len)
+{
+	u32 v = get_unaligned_be32(key);
+	unsigned int i, b;
+	u32 h = 0;
+
+	for (i = 0; i < len; i++) {
+		for (b = 0; b < BITS_PER_BYTE; b++) {
+			if (data[i] & (0x80 >> b))
+				h ^= v;
+			v = (v << 1) | ((key[i + 4] >> (7 - b)) & 1);
+		}
+	}
+
+	return h;
+}
+
+static void nft_toeplitz_eval(const struct nft_expr *expr,
+			      struct nft_regs *regs,
+			      const struct nft_pktinfo *pkt)
+{
+	struct nft_toeplitz *priv = nft_expr_priv(expr);
+	const struct sk_buff *skb = pkt->skb;
+	u32 h;
+
+	if (priv->flags & NFT_HASH_F_SKB && skb->l4_hash && !skb->sw_hash)
+		h = skb->hash;
+	else
+		h = nft_toeplitz(priv->key, (const u8 *)&regs->data[priv->sreg],
+				 priv->len);
+
+	regs->data[priv->dreg] = nft_hash_scale(h, priv->modulus,
+						priv->flags) + priv->offset;
+}
+
+static const struct nla_policy nft_hash_policy[NFT_HASH_ATTR_MAX + 1] = {
 	[NFTA_HASH_SREG]	= { .type = NLA_U32 },
 	[NFTA_HASH_DREG]	= { .type = NLA_U32 },
 	[NFTA_HASH_LEN]		= NLA_POLICY_MAX(NLA_BE32, 255),
@@ -65,6 +127,9 @@ static const struct nla_policy nft_hash_policy[NFTA_HASH_MAX + 1] = {
 	[NFTA_HASH_SEED]	= { .type = NLA_U32 },
 	[NFTA_HASH_OFFSET]	= { .type = NLA_U32 },
 	[NFTA_HASH_TYPE]	= { .type = NLA_U32 },
+	[NFTA_HASH_KEY]		= NLA_POLICY_MAX_LEN(NETDEV_RSS_KEY_LEN),
+	[NFTA_HASH_FLAGS]	= NLA_POLICY_MASK(NLA_BE32, NFT_HASH_F_SKB |
+						  NFT_HASH_F_CONSISTENT),
 };
 
 static int nft_jhash_init(const struct nft_ctx *ctx,
@@ -84,6 +149,12 @@ static int nft_jhash_init(const struct nft_ctx *ctx,
 	if (tb[NFTA_HASH_OFFSET])
 		priv->offset = ntohl(nla_get_be32(tb[NFTA_HASH_OFFSET]));
 
+	if (tb[NFTA_HASH_FLAGS]) {
+		priv->flags = ntohl(nla_get_be32(tb[NFTA_HASH_FLAGS]));
+		if (priv->flags & NFT_HASH_F_SKB)
+			return -EINVAL;
+	}
+
 	err = nft_parse_u32_check(tb[NFTA_HASH_LEN], U8_MAX, &len);
 	if (err < 0)
 		return err;
@@ -127,6 +198,12 @@ static int nft_symhash_init(const struct nft_ctx *ctx,
 	if (tb[NFTA_HASH_OFFSET])
 		priv->offset = ntohl(nla_get_be32(tb[NFTA_HASH_OFFSET]));
 
+	if (tb[NFTA_HASH_FLAGS]) {
+		priv->flags = ntohl(nla_get_be32(tb[NFTA_HASH_FLAGS]));
+		if (priv->flags & NFT_HASH_F_SKB)
+			return -EINVAL;
+	}
+
 	priv->modulus = ntohl(nla_get_be32(tb[NFTA_HASH_MODULUS]));
 	if (priv->modulus < 1)
 		return -ERANGE;
@@ -139,6 +216,64 @@ static int nft_symhash_init(const struct nft_ctx *ctx,
 					sizeof(u32));
 }
 
+static int nft_toeplitz_init(const struct nft_ctx *ctx,
+			     const struct nft_expr *expr,
+			     const struct nlattr * const tb[])
+{
+	struct nft_toeplitz *priv = nft_expr_priv(expr);
+	u32 len;
+	int err;
+
+	if (!tb[NFTA_HASH_SREG] ||
+	    !tb[NFTA_HASH_DREG] ||
+	    !tb[NFTA_HASH_LEN]  ||
+	    !tb[NFTA_HASH_MODULUS] ||
+	    tb[NFTA_HASH_SEED])
+		return -EINVAL;
+
+	if (tb[NFTA_HASH_OFFSET])
+		priv->offset = ntohl(nla_get_be32(tb[NFTA_HASH_OFFSET]));
+
+	if (tb[NFTA_HASH_FLAGS])
+		priv->flags = ntohl(nla_get_be32(tb[NFTA_HASH_FLAGS]));
+
+	err = nft_parse_u32_check(tb[NFTA_HASH_LEN], U8_MAX, &len);
+	if (err < 0)
+		return err;
+	if (len == 0)
+		return -ERANGE;
+
+	priv->len = len;
+
+	if (tb[NFTA_HASH_KEY]) {
+		priv->key_len = nla_len(tb[NFTA_HASH_KEY]);
+		if (priv->key_len <= sizeof(u32))
+			return -EINVAL;
+
+		nla_memcpy(priv->key, tb[NFTA_HASH_KEY], sizeof(priv->key));
+	} else {
+		netdev_rss_key_fill(priv->key, sizeof(priv->key));
+	}
+
+	/* the last input bit uses the 32 key bits following it */
+	if (len + sizeof(u32) > (priv->key_len ? : sizeof(priv->key)))
+		return -ERANGE;
+
+	err = nft_parse_register_load(ctx, tb[NFTA_HASH_SREG], &priv->sreg, len);
+	if (err < 0)
+		return err;
+
+	priv->modulus = ntohl(nla_get_be32(tb[NFTA_HASH_MODULUS]));
+	if (priv->modulus < 1)
+		return -ERANGE;
+
+	if (priv->offset + priv->modulus - 1 < priv->offset)
+		return -EOVERFLOW;
+
+	return nft_parse_register_store(ctx, tb[NFTA_HASH_DREG], &priv->dreg,
+					NULL, NFT_DATA_VALUE, sizeof(u32));
+}
+
 static int nft_jhash_dump(struct sk_buff *skb,
 			  const struct nft_expr *expr, bool reset)
 {
@@ -155,6 +290,9 @@ static int nft_jhash_dump(struct sk_buff *skb,
 	if (!priv->autogen_seed &&
 	    nla_put_be32(skb, NFTA_HASH_SEED, htonl(priv->seed)))
 		goto nla_put_failure;
+	if (priv->flags &&
+	    nla_put_be32(skb, NFTA_HASH_FLAGS, htonl(priv->flags)))
+		goto nla_put_failure;
 	if (priv->offset != 0)
 		if (nla_put_be32(skb, NFTA_HASH_OFFSET, htonl(priv->offset)))
 			goto nla_put_failure;
@@ -166,6 +304,46 @@ static int nft_jhash_dump(struct sk_buff *skb,
 	return -1;
 }
 
+static bool nft_toeplitz_reduce(struct nft_regs_track *track,
+				const struct nft_expr *expr)
+{
+	const struct nft_toeplitz *priv = nft_expr_priv(expr);
+
+	nft_reg_track_cancel(track, priv->dreg, sizeof(u32));
+
+	return false;
+}
+
+static int nft_toeplitz_dump(struct sk_buff *skb,
+			     const struct nft_expr *expr, bool reset)
+{
+	const struct nft_toeplitz *priv = nft_expr_priv(expr);
+
+	if (nft_dump_register(skb, NFTA_HASH_SREG, priv->sreg))
+		goto nla_put_failure;
+	if (nft_dump_register(skb, NFTA_HASH_DREG, priv->dreg))
+		goto nla_put_failure;
+	if (nla_put_be32(skb, NFTA_HASH_LEN, htonl(priv->len)))
+		goto nla_put_failure;
+	if (nla_put_be32(skb, NFTA_HASH_MODULUS, htonl(priv->modulus)))
+		goto nla_put_failure;
+	if (priv->key_len &&
+	    nla_put(skb, NFTA_HASH_KEY, priv->key_len, priv->key))
+		goto nla_put_failure;
+	if (priv->flags &&
+	    nla_put_be32(skb, NFTA_HASH_FLAGS, htonl(priv->flags)))
+		goto nla_put_failure;
+	if (priv->offset != 0)
+		if (nla_put_be32(skb, NFTA_HASH_OFFSET, htonl(priv->offset)))
+			goto nla_put_failure;
+	if (nla_put_be32(skb, NFTA_HASH_TYPE, htonl(NFT_HASH_TOEPLITZ)))
+		goto nla_put_failure;
+	return 0;
+
+nla_put_failure:
+	return -1;
+}
+
 static bool nft_jhash_reduce(struct nft_regs_track *track,
 			     const struct nft_expr *expr)
 {
@@ -185,6 +363,9 @@ static int nft_symhash_dump(struct sk_buff *skb,
 		goto nla_put_failure;
 	if (nla_put_be32(skb, NFTA_HASH_MODULUS, htonl(priv->modulus)))
 		goto nla_put_failure;
+	if (priv->flags &&
+	    nla_put_be32(skb, NFTA_HASH_FLAGS, htonl(priv->flags)))
+		goto nla_put_failure;
 	if (priv->offset != 0)
 		if (nla_put_be32(skb, NFTA_HASH_OFFSET, htonl(priv->offset)))
 			goto nla_put_failure;
@@ -209,6 +390,7 @@ static bool nft_symhash_reduce(struct nft_regs_track *track,
 
 	symhash = nft_expr_priv(track->regs[priv->dreg].selector);
 	if (priv->offset != symhash->offset ||
+	    priv->flags != symhash->flags ||
 	    priv->modulus != symhash->modulus) {
 		nft_reg_track_update(track, expr, priv->dreg, sizeof(u32));
 		return false;
@@ -239,6 +421,15 @@ static const struct nft_expr_ops nft_symhash_ops = {
 	.reduce		= nft_symhash_reduce,
 };
 
+static const struct nft_expr_ops nft_toeplitz_ops = {
+	.type		= &nft_hash_type,
+	.size		= NFT_EXPR_SIZE(sizeof(struct nft_toeplitz)),
+	.eval		= nft_toeplitz_eval,
+	.init		= nft_toeplitz_init,
+	.dump		= nft_toeplitz_dump,
+	.reduce		= nft_toeplitz_reduce,
+};
+
 static const struct nft_expr_ops *
 nft_hash_select_ops(const struct nft_ctx *ctx,
 		    const struct nlattr * const tb[])
@@ -254,6 +445,8 @@ nft_hash_select_ops(const struct nft_ctx *ctx,
 		return &nft_symhash_ops;
 	case NFT_HASH_JENKINS:
 		return &nft_jhash_ops;
+	case NFT_HASH_TOEPLITZ:
+		return &nft_toeplitz_ops;
 	default:
 		break;
 	}
@@ -264,12 +457,15 @@ static struct nft_expr_type nft_hash_type __read_mostly = {
 	.name		= "hash",
 	.select_ops	= nft_hash_select_ops,
 	.policy		= nft_hash_policy,
-	.maxattr	= NFTA_HASH_MAX,
+	.maxattr	= NFT_HASH_ATTR_MAX,
 	.owner		= THIS_MODULE,
 };
 
 static int __init nft_hash_module_init(void)
 {
+	BUILD_BUG_ON(NFTA_HASH_KEY <= NFTA_HASH_MAX);
+	BUILD_BUG_ON(NFT_HASH_TOEPLITZ <= NFT_HASH_SYM);
+
 	return nft_register_expr(&nft_hash_type);
 }
 
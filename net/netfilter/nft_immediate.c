@@ -249,6 +249,7 @@ static int nft_immediate_validate(const struct nft_ctx *ctx,
 	const struct nft_immediate_expr *priv = nft_expr_priv(expr);
 	struct nft_ctx *pctx = (struct nft_ctx *)ctx;
 	const struct nft_data *data;
+	bool tail;
 	int err;
 
 	if (priv->dreg != NFT_REG_VERDICT)
@@ -259,10 +260,17 @@ static int nft_immediate_validate(const struct nft_ctx *ctx,
 	switch (data->verdict.code) {
 	case NFT_JUMP:
 	case NFT_GOTO:
+		/* a tail call: nothing to return to */
+		tail = data->verdict.code == NFT_GOTO || ctx->tail;
+
 		pctx->level++;
+		if (!tail)
+			pctx->jumps++;
 		err = nft_chain_validate(ctx, data->verdict.chain);
 		if (err < 0)
 			return err;
+		if (!tail)
+			pctx->jumps--;
 		pctx->level--;
 		break;
 	default:
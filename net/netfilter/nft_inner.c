@@ -23,8 +23,13 @@
 #include <linux/ip.h>
 #include <linux/ipv6.h>
 
+/* @gen tags the last context saved, the hook state of the packet it was
+ * parsed from records it so that the base chains registered after the one
+ * that parsed it reuse it too.
+ */
 struct nft_inner_tun_ctx_locked {
 	struct nft_inner_tun_ctx ctx;
+	u32 gen;
 	local_lock_t bh_lock;
 };
 
@@ -242,11 +247,22 @@ static bool nft_inner_restore_tun_ctx(const struct nft_pktinfo *pkt,
 				      struct nft_inner_tun_ctx *tun_ctx)
 {
 	struct nft_inner_tun_ctx *this_cpu_tun_ctx;
+	bool found;
 
 	local_bh_disable();
 	local_lock_nested_bh(&nft_pcpu_tun_ctx.bh_lock);
 	this_cpu_tun_ctx = this_cpu_ptr(&nft_pcpu_tun_ctx.ctx);
-	if (this_cpu_tun_ctx->cookie != (unsigned long)pkt->skb) {
+
+	/* The skb address alone can't tell a new packet from the one the
+	 * context was parsed from in a previous base chain: freed skbs are
+	 * handed out again right away.
+	 */
+	found = this_cpu_tun_ctx->cookie == (unsigned long)pkt->skb;
+	if (found && !(pkt->flags & NFT_PKTINFO_INNER_FULL))
+		found = pkt->state->inner_gen &&
+			pkt->state->inner_gen == this_cpu_read(nft_pcpu_tun_ctx.gen);
+
+	if (!found) {
 		local_bh_enable();
 		local_unlock_nested_bh(&nft_pcpu_tun_ctx.bh_lock);
 		return false;
@@ -259,15 +275,24 @@ static bool nft_inner_restore_tun_ctx(const struct nft_pktinfo *pkt,
 }
 
 static void nft_inner_save_tun_ctx(const struct nft_pktinfo *pkt,
-				   const struct nft_inner_tun_ctx *tun_ctx)
+				   const struct nft_inner_tun_ctx *tun_ctx,
+				   bool parsed)
 {
 	struct nft_inner_tun_ctx *this_cpu_tun_ctx;
+	u32 gen;
 
 	local_bh_disable();
 	local_lock_nested_bh(&nft_pcpu_tun_ctx.bh_lock);
 	this_cpu_tun_ctx = this_cpu_ptr(&nft_pcpu_tun_ctx.ctx);
-	if (this_cpu_tun_ctx->cookie != tun_ctx->cookie)
+	if (parsed || this_cpu_tun_ctx->cookie != tun_ctx->cookie) {
 		*this_cpu_tun_ctx = *tun_ctx;
+
+		gen = this_cpu_inc_return(nft_pcpu_tun_ctx.gen);
+		if (!gen)
+			gen = this_cpu_inc_return(nft_pcpu_tun_ctx.gen);
+
+		((struct nf_hook_state *)pkt->state)->inner_gen = gen;
+	}
 	local_unlock_nested_bh(&nft_pcpu_tun_ctx.bh_lock);
 	local_bh_enable();
 }
@@ -276,7 +301,7 @@ static bool nft_inner_parse_needed(const struct nft_inner *priv,
 				   const struct nft_pktinfo *pkt,
 				   struct nft_inner_tun_ctx *tun_ctx)
 {
-	if (!(pkt->flags & NFT_PKTINFO_INNER_FULL))
+	if (!(pkt->flags & NFT_PKTINFO_INNER_FULL) && !pkt->state->inner_gen)
 		return true;
 
 	if (!nft_inner_restore_tun_ctx(pkt, tun_ctx))
@@ -293,13 +318,19 @@ static void nft_inner_eval(const struct nft_expr *expr, struct nft_regs *regs,
 {
 	const struct nft_inner *priv = nft_expr_priv(expr);
 	struct nft_inner_tun_ctx tun_ctx = {};
+	bool parsed = false;
 
 	if (nft_payload_inner_offset(pkt) < 0)
 		goto err;
 
-	if (nft_inner_parse_needed(priv, pkt, &tun_ctx) &&
-	    nft_inner_parse(priv, (struct nft_pktinfo *)pkt, &tun_ctx) < 0)
-		goto err;
+	if (nft_inner_parse_needed(priv, pkt, &tun_ctx)) {
+		if (nft_inner_parse(priv, (struct nft_pktinfo *)pkt, &tun_ctx) < 0)
+			goto err;
+
+		parsed = true;
+	} else {
+		((struct nft_pktinfo *)pkt)->flags |= NFT_PKTINFO_INNER_FULL;
+	}
 
 	switch (priv->expr_type) {
 	case NFT_INNER_EXPR_PAYLOAD:
@@ -312,7 +343,7 @@ static void nft_inner_eval(const struct nft_expr *expr, struct nft_regs *regs,
 		WARN_ON_ONCE(1);
 		goto err;
 	}
-	nft_inner_save_tun_ctx(pkt, &tun_ctx);
+	nft_inner_save_tun_ctx(pkt, &tun_ctx, parsed);
 
 	return;
 err:
@@ -5,6 +5,7 @@
 #include <linux/netlink.h>
 #include <linux/netfilter.h>
 #include <linux/netfilter/nf_tables.h>
+#include <linux/netfilter/nft_last.h>
 #include <net/netfilter/nf_tables_core.h>
 #include <net/netfilter/nf_tables.h>
 
@@ -13,71 +14,134 @@ struct nft_last {
 	unsigned int	set;
 };
 
+#define NFT_LAST_ATTR_MAX	NFTA_LAST_RESOLUTION
+
+/* one per cpu, so that hot rules don't bounce a shared cacheline */
 struct nft_last_priv {
-	struct nft_last	*last;
+	struct nft_last	__percpu *last;
+	/* the stamp is only rewritten once it is older than this */
+	unsigned long	resolution;
+	u32		resolution_ms;
 };
 
-static const struct nla_policy nft_last_policy[NFTA_LAST_MAX + 1] = {
+static void nft_last_fetch(struct nft_last __percpu *percpu,
+			   unsigned int *set, unsigned long *stamp)
+{
+	unsigned long now = jiffies;
+	struct nft_last *last;
+	int cpu;
+
+	*set = 0;
+	*stamp = 0;
+
+	for_each_possible_cpu(cpu) {
+		unsigned long last_jiffies;
+
+		last = per_cpu_ptr(percpu, cpu);
+		if (!READ_ONCE(last->set))
+			continue;
+
+		last_jiffies = READ_ONCE(last->jiffies);
+		if (time_before(now, last_jiffies)) {
+			WRITE_ONCE(last->set, 0);
+			continue;
+		}
+
+		if (!*set || time_after(last_jiffies, *stamp))
+			*stamp = last_jiffies;
+		*set = 1;
+	}
+}
+
+static void nft_last_store(struct nft_last __percpu *percpu,
+			   unsigned int set, unsigned long stamp)
+{
+	struct nft_last *last;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		last = per_cpu_ptr(percpu, cpu);
+		last->set = set;
+		last->jiffies = stamp;
+	}
+}
+
+static const struct nla_policy nft_last_policy[NFT_LAST_ATTR_MAX + 1] = {
 	[NFTA_LAST_SET] = { .type = NLA_U32 },
 	[NFTA_LAST_MSECS] = { .type = NLA_U64 },
+	[NFTA_LAST_RESOLUTION] = { .type = NLA_U32 },
 };
 
 static int nft_last_init(const struct nft_ctx *ctx, const struct nft_expr *expr,
 			 const struct nlattr * const tb[])
 {
 	struct nft_last_priv *priv = nft_expr_priv(expr);
-	struct nft_last *last;
+	struct nft_last __percpu *last;
+	unsigned long stamp = 0;
+	unsigned int set = 0;
 	u64 last_jiffies;
 	int err;
 
-	last = kzalloc(sizeof(*last), GFP_KERNEL_ACCOUNT);
-	if (!last)
-		return -ENOMEM;
+	BUILD_BUG_ON(NFTA_LAST_RESOLUTION <= NFTA_LAST_MAX);
+
+	if (tb[NFTA_LAST_RESOLUTION]) {
+		priv->resolution_ms =
+			ntohl(nla_get_be32(tb[NFTA_LAST_RESOLUTION]));
+		priv->resolution = msecs_to_jiffies(priv->resolution_ms);
+	}
 
 	if (tb[NFTA_LAST_SET])
-		last->set = ntohl(nla_get_be32(tb[NFTA_LAST_SET]));
+		set = ntohl(nla_get_be32(tb[NFTA_LAST_SET]));
 
-	if (last->set && tb[NFTA_LAST_MSECS]) {
+	if (set && tb[NFTA_LAST_MSECS]) {
 		err = nf_msecs_to_jiffies64(tb[NFTA_LAST_MSECS], &last_jiffies);
 		if (err < 0)
-			goto err;
+			return err;
 
-		last->jiffies = jiffies - (unsigned long)last_jiffies;
+		stamp = jiffies - (unsigned long)last_jiffies;
 	}
+
+	last = alloc_percpu_gfp(struct nft_last, GFP_KERNEL_ACCOUNT);
+	if (!last)
+		return -ENOMEM;
+
+	nft_last_store(last, set, stamp);
 	priv->last = last;
 
 	return 0;
-err:
-	kfree(last);
-
-	return err;
 }
 
 static void nft_last_eval(const struct nft_expr *expr,
 			  struct nft_regs *regs, const struct nft_pktinfo *pkt)
 {
 	struct nft_last_priv *priv = nft_expr_priv(expr);
-	struct nft_last *last = priv->last;
-
-	if (READ_ONCE(last->jiffies) != jiffies)
-		WRITE_ONCE(last->jiffies, jiffies);
-	if (READ_ONCE(last->set) == 0)
+	struct nft_last *last = this_cpu_ptr(priv->last);
+	unsigned long now = jiffies;
+
+	if (likely(READ_ONCE(last->set))) {
+		unsigned long stamp = READ_ONCE(last->jiffies);
+
+		if (stamp == now)
+			return;
+		if (priv->resolution &&
+		    time_in_range(now, stamp, stamp + priv->resolution))
+			return;
+	} else {
 		WRITE_ONCE(last->set, 1);
+	}
+
+	WRITE_ONCE(last->jiffies, now);
 }
 
 static int nft_last_dump(struct sk_buff *skb,
 			 const struct nft_expr *expr, bool reset)
 {
 	struct nft_last_priv *priv = nft_expr_priv(expr);
-	struct nft_last *last = priv->last;
-	unsigned long last_jiffies = READ_ONCE(last->jiffies);
-	u32 last_set = READ_ONCE(last->set);
+	unsigned long last_jiffies;
+	unsigned int last_set;
 	__be64 msecs;
 
-	if (time_before(jiffies, last_jiffies)) {
-		WRITE_ONCE(last->set, 0);
-		last_set = 0;
-	}
+	nft_last_fetch(priv->last, &last_set, &last_jiffies);
 
 	if (last_set)
 		msecs = nf_jiffies64_to_msecs(jiffies - last_jiffies);
@@ -88,6 +152,10 @@ static int nft_last_dump(struct sk_buff *skb,
 	    nla_put_be64(skb, NFTA_LAST_MSECS, msecs, NFTA_LAST_PAD))
 		goto nla_put_failure;
 
+	if (priv->resolution_ms &&
+	    nla_put_be32(skb, NFTA_LAST_RESOLUTION, htonl(priv->resolution_ms)))
+		goto nla_put_failure;
+
 	return 0;
 
 nla_put_failure:
@@ -99,20 +167,24 @@ static void nft_last_destroy(const struct nft_ctx *ctx,
 {
 	struct nft_last_priv *priv = nft_expr_priv(expr);
 
-	kfree(priv->last);
+	free_percpu(priv->last);
 }
 
 static int nft_last_clone(struct nft_expr *dst, const struct nft_expr *src, gfp_t gfp)
 {
 	struct nft_last_priv *priv_dst = nft_expr_priv(dst);
 	struct nft_last_priv *priv_src = nft_expr_priv(src);
+	unsigned long stamp;
+	unsigned int set;
 
-	priv_dst->last = kzalloc(sizeof(*priv_dst->last), gfp);
+	priv_dst->last = alloc_percpu_gfp(struct nft_last, gfp);
 	if (!priv_dst->last)
 		return -ENOMEM;
 
-	priv_dst->last->set = priv_src->last->set;
-	priv_dst->last->jiffies = priv_src->last->jiffies;
+	nft_last_fetch(priv_src->last, &set, &stamp);
+	nft_last_store(priv_dst->last, set, stamp);
+	priv_dst->resolution = priv_src->resolution;
+	priv_dst->resolution_ms = priv_src->resolution_ms;
 
 	return 0;
 }
@@ -132,7 +204,7 @@ struct nft_expr_type nft_last_type __read_mostly = {
 	.name		= "last",
 	.ops		= &nft_last_ops,
 	.policy		= nft_last_policy,
-	.maxattr	= NFTA_LAST_MAX,
+	.maxattr	= NFT_LAST_ATTR_MAX,
 	.flags		= NFT_EXPR_STATEFUL,
 	.owner		= THIS_MODULE,
 };
@@ -8,6 +8,7 @@
 #include <linux/kernel.h>
 #include <linux/init.h>
 #include <linux/module.h>
+#include <linux/percpu.h>
 #include <linux/spinlock.h>
 #include <linux/netlink.h>
 #include <linux/netfilter.h>
@@ -20,8 +21,19 @@ struct nft_limit {
 	u64		tokens;
 };
 
+/* NFTA_LIMIT_FLAGS, next to NFT_LIMIT_F_INV.
+ *
+ * Each cpu draws tokens from the shared bucket in chunks and spends them
+ * locally, the lock is only taken once the local tokens run out.  Tokens
+ * held by the cpus are outside of the bucket: the limit can admit up to
+ * tokens_max more than the exact one, and idle cpus hold on to theirs.
+ */
+#define NFT_LIMIT_F_PERCPU	(1 << 1)
+
 struct nft_limit_priv {
 	struct nft_limit *limit;
+	u64 __percpu	*pcpu_tokens;
+	u64		chunk;
 	u64		tokens_max;
 	u64		rate;
 	u64		nsecs;
@@ -29,11 +41,49 @@ struct nft_limit_priv {
 	bool		invert;
 };
 
+static bool nft_limit_eval_percpu(struct nft_limit_priv *priv, u64 cost)
+{
+	u64 now, tokens, need, grab;
+	bool admit = true;
+	u64 *local;
+
+	local_bh_disable();
+	local = this_cpu_ptr(priv->pcpu_tokens);
+	if (*local >= cost) {
+		*local -= cost;
+		goto out;
+	}
+
+	spin_lock(&priv->limit->lock);
+	now = ktime_get_ns();
+	tokens = priv->limit->tokens + now - priv->limit->last;
+	if (tokens > priv->tokens_max)
+		tokens = priv->tokens_max;
+
+	priv->limit->last = now;
+	need = cost - *local;
+	if (tokens >= need) {
+		grab = min(tokens, need + priv->chunk);
+		priv->limit->tokens = tokens - grab;
+		*local = *local + grab - cost;
+	} else {
+		priv->limit->tokens = tokens;
+		admit = false;
+	}
+	spin_unlock(&priv->limit->lock);
+out:
+	local_bh_enable();
+	return admit ? priv->invert : !priv->invert;
+}
+
 static inline bool nft_limit_eval(struct nft_limit_priv *priv, u64 cost)
 {
 	u64 now, tokens;
 	s64 delta;
 
+	if (priv->pcpu_tokens)
+		return nft_limit_eval_percpu(priv, cost);
+
 	spin_lock_bh(&priv->limit->lock);
 	now = ktime_get_ns();
 	tokens = priv->limit->tokens + now - priv->limit->last;
@@ -55,11 +105,21 @@ static inline bool nft_limit_eval(struct nft_limit_priv *priv, u64 cost)
 /* Use same default as in iptables. */
 #define NFT_LIMIT_PKT_BURST_DEFAULT	5
 
+static int nft_limit_percpu_init(struct nft_limit_priv *priv, gfp_t gfp)
+{
+	priv->pcpu_tokens = alloc_percpu_gfp(u64, gfp);
+	if (!priv->pcpu_tokens)
+		return -ENOMEM;
+
+	priv->chunk = div_u64(priv->tokens_max, num_possible_cpus());
+	return 0;
+}
+
 static int nft_limit_init(struct nft_limit_priv *priv,
 			  const struct nlattr * const tb[], bool pkts)
 {
 	u64 unit, tokens, rate_with_burst;
-	bool invert = false;
+	bool invert = false, percpu = false;
 
 	if (tb[NFTA_LIMIT_RATE] == NULL ||
 	    tb[NFTA_LIMIT_UNIT] == NULL)
@@ -103,11 +163,13 @@ static int nft_limit_init(struct nft_limit_priv *priv,
 	if (tb[NFTA_LIMIT_FLAGS]) {
 		u32 flags = ntohl(nla_get_be32(tb[NFTA_LIMIT_FLAGS]));
 
-		if (flags & ~NFT_LIMIT_F_INV)
+		if (flags & ~(NFT_LIMIT_F_INV | NFT_LIMIT_F_PERCPU))
 			return -EOPNOTSUPP;
 
 		if (flags & NFT_LIMIT_F_INV)
 			invert = true;
+		if (flags & NFT_LIMIT_F_PERCPU)
+			percpu = true;
 	}
 
 	priv->limit = kmalloc(sizeof(*priv->limit), GFP_KERNEL_ACCOUNT);
@@ -120,6 +182,12 @@ static int nft_limit_init(struct nft_limit_priv *priv,
 	priv->limit->last = ktime_get_ns();
 	spin_lock_init(&priv->limit->lock);
 
+	priv->pcpu_tokens = NULL;
+	if (percpu && nft_limit_percpu_init(priv, GFP_KERNEL_ACCOUNT) < 0) {
+		kfree(priv->limit);
+		return -ENOMEM;
+	}
+
 	return 0;
 }
 
@@ -129,6 +197,9 @@ static int nft_limit_dump(struct sk_buff *skb, const struct nft_limit_priv *priv
 	u32 flags = priv->invert ? NFT_LIMIT_F_INV : 0;
 	u64 secs = div_u64(priv->nsecs, NSEC_PER_SEC);
 
+	if (priv->pcpu_tokens)
+		flags |= NFT_LIMIT_F_PERCPU;
+
 	if (nla_put_be64(skb, NFTA_LIMIT_RATE, cpu_to_be64(priv->rate),
 			 NFTA_LIMIT_PAD) ||
 	    nla_put_be64(skb, NFTA_LIMIT_UNIT, cpu_to_be64(secs),
@@ -146,6 +217,7 @@ static int nft_limit_dump(struct sk_buff *skb, const struct nft_limit_priv *priv
 static void nft_limit_destroy(const struct nft_ctx *ctx,
 			      const struct nft_limit_priv *priv)
 {
+	free_percpu(priv->pcpu_tokens);
 	kfree(priv->limit);
 }
 
@@ -166,6 +238,12 @@ static int nft_limit_clone(struct nft_limit_priv *priv_dst,
 	priv_dst->limit->tokens = priv_src->tokens_max;
 	priv_dst->limit->last = ktime_get_ns();
 
+	priv_dst->pcpu_tokens = NULL;
+	if (priv_src->pcpu_tokens && nft_limit_percpu_init(priv_dst, gfp) < 0) {
+		kfree(priv_dst->limit);
+		return -ENOMEM;
+	}
+
 	return 0;
 }
 
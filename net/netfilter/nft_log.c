@@ -13,17 +13,33 @@
 #include <linux/netlink.h>
 #include <linux/netfilter.h>
 #include <linux/netfilter/nf_tables.h>
+#include <linux/netfilter/nft_log.h>
 #include <net/ipv6.h>
 #include <net/ip.h>
 #include <net/netfilter/nf_tables.h>
 #include <net/netfilter/nf_log.h>
 #include <linux/netdevice.h>
+#include <linux/random.h>
+#if IS_ENABLED(CONFIG_NF_CONNTRACK)
+#include <net/netfilter/nf_conntrack.h>
+#endif
+
+#define NFT_LOG_ATTR_MAX	NFTA_LOG_FILTER
 
 static const char *nft_log_null_prefix = "";
 
+struct nft_log_agg {
+	u32			count;
+	unsigned long		next;
+};
+
 struct nft_log {
 	struct nf_loginfo	loginfo;
 	char			*prefix;
+	u32			sample;
+	u32			filter;
+	unsigned long		interval;
+	struct nft_log_agg __percpu *agg;
 };
 
 static bool audit_ip4(struct audit_buffer *ab, struct sk_buff *skb)
@@ -101,24 +117,74 @@ static void nft_log_eval_audit(const struct nft_pktinfo *pkt)
 	audit_log_end(ab);
 }
 
+static bool nft_log_flow_first(const struct sk_buff *skb)
+{
+#if IS_ENABLED(CONFIG_NF_CONNTRACK)
+	enum ip_conntrack_info ctinfo;
+	const struct nf_conn *ct;
+
+	ct = nf_ct_get(skb, &ctinfo);
+
+	return !ct || !nf_ct_is_confirmed(ct);
+#else
+	return true;
+#endif
+}
+
+/* Returns the number of packets to report, 0 to stay quiet */
+static u32 nft_log_aggregate(const struct nft_log *priv)
+{
+	struct nft_log_agg *agg;
+	u32 count = 0;
+
+	local_bh_disable();
+	agg = this_cpu_ptr(priv->agg);
+	agg->count++;
+	if (time_after_eq(jiffies, agg->next)) {
+		agg->next = jiffies + priv->interval;
+		count = agg->count;
+		agg->count = 0;
+	}
+	local_bh_enable();
+
+	return count;
+}
+
 static void nft_log_eval(const struct nft_expr *expr,
 			 struct nft_regs *regs,
 			 const struct nft_pktinfo *pkt)
 {
 	const struct nft_log *priv = nft_expr_priv(expr);
+	const struct nf_loginfo *li = &priv->loginfo;
+	struct nf_loginfo agg_li;
 
-	if (priv->loginfo.type == NF_LOG_TYPE_LOG &&
-	    priv->loginfo.u.log.level == NFT_LOGLEVEL_AUDIT) {
+	if ((priv->filter & NFT_LOG_F_FLOW_FIRST) &&
+	    !nft_log_flow_first(pkt->skb))
+		return;
+
+	if (priv->sample && get_random_u32_below(priv->sample))
+		return;
+
+	if (priv->agg) {
+		agg_li = *li;
+		agg_li.u.ulog.count = nft_log_aggregate(priv);
+		if (!agg_li.u.ulog.count)
+			return;
+
+		li = &agg_li;
+	}
+
+	if (li->type == NF_LOG_TYPE_LOG &&
+	    li->u.log.level == NFT_LOGLEVEL_AUDIT) {
 		nft_log_eval_audit(pkt);
 		return;
 	}
 
 	nf_log_packet(nft_net(pkt), nft_pf(pkt), nft_hook(pkt), pkt->skb,
-		      nft_in(pkt), nft_out(pkt), &priv->loginfo, "%s",
-		      priv->prefix);
+		      nft_in(pkt), nft_out(pkt), li, "%s", priv->prefix);
 }
 
-static const struct nla_policy nft_log_policy[NFTA_LOG_MAX + 1] = {
+static const struct nla_policy nft_log_policy[NFT_LOG_ATTR_MAX + 1] = {
 	[NFTA_LOG_GROUP]	= { .type = NLA_U16 },
 	[NFTA_LOG_PREFIX]	= { .type = NLA_STRING,
 				    .len = NF_LOG_PREFIXLEN - 1 },
@@ -126,8 +192,51 @@ static const struct nla_policy nft_log_policy[NFTA_LOG_MAX + 1] = {
 	[NFTA_LOG_QTHRESHOLD]	= { .type = NLA_U16 },
 	[NFTA_LOG_LEVEL]	= { .type = NLA_U32 },
 	[NFTA_LOG_FLAGS]	= { .type = NLA_U32 },
+	[NFTA_LOG_SAMPLE]	= { .type = NLA_U32 },
+	[NFTA_LOG_INTERVAL]	= { .type = NLA_U32 },
+	[NFTA_LOG_FILTER]	= NLA_POLICY_MASK(NLA_BE32, NFT_LOG_F_FLOW_FIRST),
 };
 
+static int nft_log_init_sample(struct nft_log *priv,
+			       const struct nlattr * const tb[])
+{
+	int cpu;
+
+	if (tb[NFTA_LOG_FILTER]) {
+		priv->filter = ntohl(nla_get_be32(tb[NFTA_LOG_FILTER]));
+		if ((priv->filter & NFT_LOG_F_FLOW_FIRST) &&
+		    !IS_ENABLED(CONFIG_NF_CONNTRACK))
+			return -EOPNOTSUPP;
+	}
+
+	if (tb[NFTA_LOG_SAMPLE]) {
+		priv->sample = ntohl(nla_get_be32(tb[NFTA_LOG_SAMPLE]));
+		if (priv->sample == 1)
+			priv->sample = 0;
+	}
+
+	if (!tb[NFTA_LOG_INTERVAL])
+		return 0;
+
+	/* a sampled count would be meaningless */
+	if (priv->loginfo.type != NF_LOG_TYPE_ULOG || priv->sample)
+		return -EINVAL;
+
+	priv->interval =
+		msecs_to_jiffies(ntohl(nla_get_be32(tb[NFTA_LOG_INTERVAL])));
+	if (!priv->interval)
+		return -EINVAL;
+
+	priv->agg = alloc_percpu_gfp(struct nft_log_agg, GFP_KERNEL_ACCOUNT);
+	if (!priv->agg)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu)
+		per_cpu_ptr(priv->agg, cpu)->next = jiffies;
+
+	return 0;
+}
+
 static int nft_log_modprobe(struct net *net, enum nf_log_type t)
 {
 	switch (t) {
@@ -207,6 +316,10 @@ static int nft_log_init(const struct nft_ctx *ctx,
 		break;
 	}
 
+	err = nft_log_init_sample(priv, tb);
+	if (err < 0)
+		goto err1;
+
 	if (li->u.log.level == NFT_LOGLEVEL_AUDIT)
 		return 0;
 
@@ -221,6 +334,7 @@ static int nft_log_init(const struct nft_ctx *ctx,
 	return 0;
 
 err1:
+	free_percpu(priv->agg);
 	if (priv->prefix != nft_log_null_prefix)
 		kfree(priv->prefix);
 	return err;
@@ -235,6 +349,8 @@ static void nft_log_destroy(const struct nft_ctx *ctx,
 	if (priv->prefix != nft_log_null_prefix)
 		kfree(priv->prefix);
 
+	free_percpu(priv->agg);
+
 	if (li->u.log.level == NFT_LOGLEVEL_AUDIT)
 		return;
 
@@ -277,6 +393,18 @@ static int nft_log_dump(struct sk_buff *skb,
 		}
 		break;
 	}
+
+	if (priv->sample &&
+	    nla_put_be32(skb, NFTA_LOG_SAMPLE, htonl(priv->sample)))
+		goto nla_put_failure;
+	if (priv->agg &&
+	    nla_put_be32(skb, NFTA_LOG_INTERVAL,
+			 htonl(jiffies_to_msecs(priv->interval))))
+		goto nla_put_failure;
+	if (priv->filter &&
+	    nla_put_be32(skb, NFTA_LOG_FILTER, htonl(priv->filter)))
+		goto nla_put_failure;
+
 	return 0;
 
 nla_put_failure:
@@ -298,12 +426,14 @@ static struct nft_expr_type nft_log_type __read_mostly = {
 	.name		= "log",
 	.ops		= &nft_log_ops,
 	.policy		= nft_log_policy,
-	.maxattr	= NFTA_LOG_MAX,
+	.maxattr	= NFT_LOG_ATTR_MAX,
 	.owner		= THIS_MODULE,
 };
 
 static int __init nft_log_module_init(void)
 {
+	BUILD_BUG_ON(NFTA_LOG_SAMPLE <= NFTA_LOG_MAX);
+
 	return nft_register_expr(&nft_log_type);
 }
 
@@ -11,18 +11,14 @@
 #include <linux/rbtree.h>
 #include <linux/netlink.h>
 #include <linux/netfilter.h>
+#include <linux/sched/clock.h>
 #include <linux/netfilter/nf_tables.h>
+#include <linux/netfilter/nft_lookup.h>
+#include <net/netfilter/nf_conntrack.h>
 #include <net/netfilter/nf_tables.h>
 #include <net/netfilter/nf_tables_core.h>
-
-struct nft_lookup {
-	struct nft_set			*set;
-	u8				sreg;
-	u8				dreg;
-	bool				dreg_set;
-	bool				invert;
-	struct nft_set_binding		binding;
-};
+#include <net/netfilter/nf_tables_offload.h>
+#include <trace/events/netfilter.h>
 
 #ifdef CONFIG_MITIGATION_RETPOLINE
 bool nft_set_do_lookup(const struct net *net, const struct nft_set *set,
@@ -32,12 +28,16 @@ bool nft_set_do_lookup(const struct net *net, const struct nft_set *set,
 		return nft_hash_lookup_fast(net, set, key, ext);
 	if (set->ops == &nft_set_hash_type.ops)
 		return nft_hash_lookup(net, set, key, ext);
+	if (set->ops == &nft_set_ohash_type.ops)
+		return nft_ohash_lookup(net, set, key, ext);
 
 	if (set->ops == &nft_set_rhash_type.ops)
 		return nft_rhash_lookup(net, set, key, ext);
 
 	if (set->ops == &nft_set_bitmap_type.ops)
 		return nft_bitmap_lookup(net, set, key, ext);
+	if (set->ops == &nft_set_bitmap_tree_type.ops)
+		return nft_bitmap_tree_lookup(net, set, key, ext);
 
 	if (set->ops == &nft_set_pipapo_type.ops)
 		return nft_pipapo_lookup(net, set, key, ext);
@@ -55,18 +55,164 @@ bool nft_set_do_lookup(const struct net *net, const struct nft_set *set,
 EXPORT_SYMBOL_GPL(nft_set_do_lookup);
 #endif
 
-void nft_lookup_eval(const struct nft_expr *expr,
-		     struct nft_regs *regs,
-		     const struct nft_pktinfo *pkt)
+static noinline bool nft_lookup_traced(const struct net *net,
+				       const struct nft_set *set,
+				       const u32 *key,
+				       const struct nft_set_ext **ext)
+{
+	u64 start = local_clock();
+	bool found;
+
+	found = nft_set_do_lookup(net, set, key, ext);
+	trace_nft_set_lookup(set->table->name, set->name, found,
+			     local_clock() - start);
+
+	return found;
+}
+
+static __always_inline bool nft_lookup_set(const struct net *net,
+					   const struct nft_set *set,
+					   const u32 *key,
+					   const struct nft_set_ext **ext)
+{
+	if (trace_nft_set_lookup_enabled())
+		return nft_lookup_traced(net, set, key, ext);
+
+	return nft_set_do_lookup(net, set, key, ext);
+}
+
+static bool nft_lookup_prefiltered(const struct net *net,
+				   const struct nft_set *set, const u32 *key,
+				   const struct nft_set_ext **ext)
+{
+	const struct nft_set_prefilter *pf = rcu_dereference(set->prefilter);
+	bool found;
+
+	if (!pf)
+		return nft_lookup_set(net, set, key, ext);
+
+	this_cpu_inc(set->prefilter_stats->checked);
+	if (!nft_set_prefilter_test(pf, set, key)) {
+		this_cpu_inc(set->prefilter_stats->rejected);
+		return false;
+	}
+
+	found = nft_lookup_set(net, set, key, ext);
+	if (!found)
+		this_cpu_inc(set->prefilter_stats->false_positives);
+
+	return found;
+}
+
+#ifdef CONFIG_NF_CONNTRACK_VMAP_CACHE
+static bool nft_lookup_ct_cache_get(const struct nf_conn_vmap_cache *c,
+				    const struct nft_lookup *priv,
+				    unsigned int genid, struct nft_verdict *v)
+{
+	unsigned int seq;
+	bool hit;
+
+	seq = raw_read_seqcount(&c->seq);
+	if (seq & 1)
+		return false;
+
+	hit = c->genid == genid && c->lookup == priv;
+	v->code = c->code;
+	v->chain = c->chain;
+
+	return hit && !read_seqcount_retry(&c->seq, seq);
+}
+
+static void nft_lookup_ct_cache_set(struct nf_conn *ct,
+				    const struct nft_lookup *priv, u8 dir,
+				    unsigned int genid,
+				    const struct nft_verdict *v)
+{
+	struct nf_conn_vmap_cache *c = &ct->vmap_cache[dir];
+
+	/* first lookup of this generation keeps the slot, no thrashing */
+	if (READ_ONCE(c->genid) == genid && READ_ONCE(c->lookup))
+		return;
+
+	spin_lock_bh(&ct->lock);
+	if (c->genid == genid && c->lookup) {
+		spin_unlock_bh(&ct->lock);
+		return;
+	}
+	raw_write_seqcount_begin(&c->seq);
+	c->genid = genid;
+	c->lookup = priv;
+	c->code = v->code;
+	c->chain = v->chain;
+	raw_write_seqcount_end(&c->seq);
+	spin_unlock_bh(&ct->lock);
+}
+
+/* Verdict maps only, the key is the same for all packets of a connection in
+ * a given direction. A chain found in the cache can't go away before the
+ * genid changes, and then after a grace period only.
+ */
+static bool nft_lookup_ct_eval(const struct nft_lookup *priv,
+			       struct nft_regs *regs,
+			       const struct nft_pktinfo *pkt)
+{
+	const struct nft_set *set = priv->set;
+	const struct nft_set_ext *ext = NULL;
+	const struct net *net = nft_net(pkt);
+	enum ip_conntrack_info ctinfo;
+	unsigned int genid;
+	struct nf_conn *ct;
+	u8 dir;
+
+	ct = nf_ct_get(pkt->skb, &ctinfo);
+	/* templates are shared by all flows they are attached to */
+	if (!ct || nf_ct_is_template(ct))
+		return false;
+
+	dir = CTINFO2DIR(ctinfo);
+	/* read before the generation cursor, see nft_genid_bump() */
+	genid = smp_load_acquire(&net->nft.genid);
+	if (nft_lookup_ct_cache_get(&ct->vmap_cache[dir], priv, genid,
+				    &regs->verdict))
+		return true;
+
+	if (!nft_lookup_prefiltered(net, set, &regs->data[priv->sreg], &ext))
+		ext = nft_set_catchall_lookup(net, set);
+
+	if (!ext) {
+		regs->verdict.code = NFT_BREAK;
+	} else {
+		nft_data_copy(&regs->data[priv->dreg], nft_set_ext_data(ext),
+			      set->dlen);
+
+		/* stateful expressions of the element see every packet */
+		if (nft_set_ext_exists(ext, NFT_SET_EXT_EXPRESSIONS)) {
+			nft_set_elem_update_expr(ext, regs, pkt);
+			return true;
+		}
+	}
+
+	nft_lookup_ct_cache_set(ct, priv, dir, genid, &regs->verdict);
+
+	return true;
+}
+#endif
+
+void __nft_lookup_eval(const struct nft_lookup *priv,
+		       struct nft_regs *regs,
+		       const struct nft_pktinfo *pkt)
 {
-	const struct nft_lookup *priv = nft_expr_priv(expr);
 	const struct nft_set *set = priv->set;
 	const struct nft_set_ext *ext = NULL;
 	const struct net *net = nft_net(pkt);
 	bool found;
 
-	found =	nft_set_do_lookup(net, set, &regs->data[priv->sreg], &ext) ^
-				  priv->invert;
+#ifdef CONFIG_NF_CONNTRACK_VMAP_CACHE
+	if (unlikely(priv->ct_cache) && nft_lookup_ct_eval(priv, regs, pkt))
+		return;
+#endif
+	found =	nft_lookup_prefiltered(net, set, &regs->data[priv->sreg],
+				       &ext) ^ priv->invert;
 	if (!found) {
 		ext = nft_set_catchall_lookup(net, set);
 		if (!ext) {
@@ -84,6 +230,13 @@ void nft_lookup_eval(const struct nft_expr *expr,
 	}
 }
 
+void nft_lookup_eval(const struct nft_expr *expr,
+		     struct nft_regs *regs,
+		     const struct nft_pktinfo *pkt)
+{
+	__nft_lookup_eval(nft_expr_priv(expr), regs, pkt);
+}
+
 static const struct nla_policy nft_lookup_policy[NFTA_LOOKUP_MAX + 1] = {
 	[NFTA_LOOKUP_SET]	= { .type = NLA_STRING,
 				    .len = NFT_SET_MAXNAMELEN - 1 },
@@ -91,7 +244,8 @@ static const struct nla_policy nft_lookup_policy[NFTA_LOOKUP_MAX + 1] = {
 	[NFTA_LOOKUP_SREG]	= { .type = NLA_U32 },
 	[NFTA_LOOKUP_DREG]	= { .type = NLA_U32 },
 	[NFTA_LOOKUP_FLAGS]	=
-		NLA_POLICY_MASK(NLA_BE32, NFT_LOOKUP_F_INV),
+		NLA_POLICY_MASK(NLA_BE32, NFT_LOOKUP_F_INV |
+					  NFT_LOOKUP_F_CT_CACHE),
 };
 
 static int nft_lookup_init(const struct nft_ctx *ctx,
@@ -101,7 +255,7 @@ static int nft_lookup_init(const struct nft_ctx *ctx,
 	struct nft_lookup *priv = nft_expr_priv(expr);
 	u8 genmask = nft_genmask_next(ctx->net);
 	struct nft_set *set;
-	u32 flags;
+	u32 flags = 0;
 	int err;
 
 	if (tb[NFTA_LOOKUP_SET] == NULL ||
@@ -149,6 +303,18 @@ static int nft_lookup_init(const struct nft_ctx *ctx,
 			return -EINVAL;
 	}
 
+	if (flags & NFT_LOOKUP_F_CT_CACHE) {
+		if (!IS_ENABLED(CONFIG_NF_CONNTRACK_VMAP_CACHE))
+			return -EOPNOTSUPP;
+		if (!priv->dreg_set || set->dtype != NFT_DATA_VERDICT)
+			return -EINVAL;
+		/* elements can change or go away without a commit */
+		if (set->flags & (NFT_SET_TIMEOUT | NFT_SET_EVAL))
+			return -EOPNOTSUPP;
+
+		priv->ct_cache = true;
+	}
+
 	priv->binding.flags = set->flags & NFT_SET_MAP;
 
 	err = nf_tables_bind_set(ctx, set, &priv->binding);
@@ -190,6 +356,9 @@ static int nft_lookup_dump(struct sk_buff *skb,
 	const struct nft_lookup *priv = nft_expr_priv(expr);
 	u32 flags = priv->invert ? NFT_LOOKUP_F_INV : 0;
 
+	if (priv->ct_cache)
+		flags |= NFT_LOOKUP_F_CT_CACHE;
+
 	if (nla_put_string(skb, NFTA_LOOKUP_SET, priv->set->name))
 		goto nla_put_failure;
 	if (nft_dump_register(skb, NFTA_LOOKUP_SREG, priv->sreg))
@@ -219,6 +388,7 @@ static int nft_lookup_validate(const struct nft_ctx *ctx,
 	iter.type	= NFT_ITER_UPDATE;
 	iter.skip	= 0;
 	iter.count	= 0;
+	iter.pos	= 0;
 	iter.err	= 0;
 	iter.fn		= nft_setelem_validate;
 
@@ -243,6 +413,27 @@ static bool nft_lookup_reduce(struct nft_regs_track *track,
 	return false;
 }
 
+static int nft_lookup_offload(struct nft_offload_ctx *ctx,
+			      struct nft_flow_rule *flow,
+			      const struct nft_expr *expr)
+{
+	const struct nft_lookup *priv = nft_expr_priv(expr);
+
+	if (priv->invert ||
+	    (priv->dreg_set && priv->dreg != NFT_REG_VERDICT))
+		return -EOPNOTSUPP;
+
+	return nft_flow_rule_set_lookup(ctx, flow, priv->set, priv->sreg,
+					priv->dreg_set);
+}
+
+static bool nft_lookup_offload_action(const struct nft_expr *expr)
+{
+	const struct nft_lookup *priv = nft_expr_priv(expr);
+
+	return priv->dreg_set && priv->dreg == NFT_REG_VERDICT;
+}
+
 static const struct nft_expr_ops nft_lookup_ops = {
 	.type		= &nft_lookup_type,
 	.size		= NFT_EXPR_SIZE(sizeof(struct nft_lookup)),
@@ -254,6 +445,8 @@ static const struct nft_expr_ops nft_lookup_ops = {
 	.dump		= nft_lookup_dump,
 	.validate	= nft_lookup_validate,
 	.reduce		= nft_lookup_reduce,
+	.offload	= nft_lookup_offload,
+	.offload_action	= nft_lookup_offload_action,
 };
 
 struct nft_expr_type nft_lookup_type __read_mostly = {
@@ -0,0 +1,513 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Keyed rate limiter for nf_tables.
+ *
+ * Per-key limits built from a dynset with limit expressions allocate a
+ * whole expression and a spinlock per element.  A meter keeps the state
+ * of each key in a single word instead: the time at which its bucket is
+ * full again.  A packet is admitted if, starting from that time or from
+ * now if later, adding its cost stays within the bucket size; the update
+ * is a cmpxchg, lookups walk the hash under RCU.
+ *
+ * The hash has a fixed number of buckets and never grows.  Buckets are
+ * grouped into shards, each with its own lock and entry list in insertion
+ * order.  When a shard is full, an idle entry near the head of its list
+ * is evicted, entries still in use are moved to the tail.  If none is
+ * idle the oldest one goes.
+ */
+
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
+#include <linux/rculist.h>
+#include <linux/spinlock.h>
+#include <linux/netlink.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nf_tables.h>
+#include <linux/netfilter/nft_meter.h>
+#include <net/netfilter/nf_tables.h>
+
+#define NFT_METER_SHARDS	64u
+#define NFT_METER_SIZE_DEFAULT	65536u
+#define NFT_METER_SIZE_MAX	(1u << 24)
+#define NFT_METER_EVICT_SCAN	8
+
+/* Use same default as in iptables. */
+#define NFT_METER_PKT_BURST_DEFAULT	5
+
+struct nft_meter_ent {
+	struct hlist_node	node;
+	struct list_head	list;
+	struct rcu_head		rcu;
+	/* bucket is full again at this time, in ns */
+	u64			full_at;
+	u32			key[];
+};
+
+struct nft_meter_shard {
+	spinlock_t		lock;
+	u32			count;
+	struct list_head	list;
+} ____cacheline_aligned_in_smp;
+
+struct nft_meter {
+	struct hlist_head	*buckets;
+	struct nft_meter_shard	*shards;
+	u32			hmask;
+	u32			shard_max;
+	u32			size;
+	u32			seed;
+	u32			klen;
+	u32			burst;
+	u64			rate;
+	u64			nsecs;
+	u64			tokens_max;
+	/* cost of a packet, unless @bytes */
+	u64			cost;
+	bool			bytes;
+	bool			invert;
+};
+
+struct nft_meter_expr {
+	struct nft_object	*obj;
+	u8			sreg;
+};
+
+static const u32 nft_meter_nokey[NFT_DATA_VALUE_MAXLEN / sizeof(u32)];
+
+static struct nft_meter_ent *nft_meter_lookup(const struct nft_meter *m,
+					      const u32 *key, u32 hash)
+{
+	struct nft_meter_ent *ent;
+
+	hlist_for_each_entry_rcu(ent, &m->buckets[hash & m->hmask], node) {
+		if (!memcmp(ent->key, key, m->klen))
+			return ent;
+	}
+
+	return NULL;
+}
+
+static void nft_meter_evict(struct nft_meter_shard *shard,
+			    struct nft_meter_ent *ent)
+{
+	hlist_del_rcu(&ent->node);
+	list_del(&ent->list);
+	shard->count--;
+	kfree_rcu(ent, rcu);
+}
+
+static void nft_meter_make_room(struct nft_meter_shard *shard, u64 now)
+{
+	struct nft_meter_ent *ent;
+	int i;
+
+	for (i = 0; i < NFT_METER_EVICT_SCAN; i++) {
+		ent = list_first_entry(&shard->list, struct nft_meter_ent, list);
+		if (READ_ONCE(ent->full_at) <= now)
+			break;
+
+		list_move_tail(&ent->list, &shard->list);
+	}
+
+	nft_meter_evict(shard, list_first_entry(&shard->list,
+						struct nft_meter_ent, list));
+}
+
+static struct nft_meter_ent *nft_meter_insert(struct nft_meter *m,
+					      const u32 *key, u32 hash,
+					      u64 now)
+{
+	struct nft_meter_shard *shard;
+	struct nft_meter_ent *ent;
+
+	shard = &m->shards[hash & (NFT_METER_SHARDS - 1)];
+
+	spin_lock_bh(&shard->lock);
+	/* raced with another cpu */
+	ent = nft_meter_lookup(m, key, hash);
+	if (ent)
+		goto out;
+
+	if (shard->count >= m->shard_max)
+		nft_meter_make_room(shard, now);
+
+	ent = kmalloc(sizeof(*ent) + m->klen, GFP_ATOMIC | __GFP_NOWARN);
+	if (!ent)
+		goto out;
+
+	ent->full_at = 0;
+	memcpy(ent->key, key, m->klen);
+	hlist_add_head_rcu(&ent->node, &m->buckets[hash & m->hmask]);
+	list_add_tail(&ent->list, &shard->list);
+	shard->count++;
+out:
+	spin_unlock_bh(&shard->lock);
+	return ent;
+}
+
+static bool nft_meter_spend(const struct nft_meter *m,
+			    struct nft_meter_ent *ent, u64 cost, u64 now)
+{
+	u64 old, start;
+
+	do {
+		old = READ_ONCE(ent->full_at);
+		start = max(old, now);
+		if (start + cost - now > m->tokens_max)
+			return false;
+	} while (cmpxchg64(&ent->full_at, old, start + cost) != old);
+
+	return true;
+}
+
+static void nft_meter_do_eval(struct nft_meter *m, const u32 *key,
+			      struct nft_regs *regs,
+			      const struct nft_pktinfo *pkt)
+{
+	u32 hash = jhash(key, m->klen, m->seed);
+	u64 now = ktime_get_ns();
+	struct nft_meter_ent *ent;
+	u64 cost = m->cost;
+
+	ent = nft_meter_lookup(m, key, hash);
+	if (!ent) {
+		ent = nft_meter_insert(m, key, hash, now);
+		if (!ent) {
+			regs->verdict.code = NFT_BREAK;
+			return;
+		}
+	}
+
+	if (m->bytes)
+		cost = div64_u64(m->nsecs * pkt->skb->len, m->rate);
+
+	if (nft_meter_spend(m, ent, cost, now) == m->invert)
+		regs->verdict.code = NFT_BREAK;
+}
+
+static void nft_meter_flush(struct nft_meter *m)
+{
+	struct nft_meter_ent *ent, *next;
+	unsigned int i;
+
+	for (i = 0; i < NFT_METER_SHARDS; i++) {
+		struct nft_meter_shard *shard = &m->shards[i];
+
+		spin_lock_bh(&shard->lock);
+		list_for_each_entry_safe(ent, next, &shard->list, list)
+			nft_meter_evict(shard, ent);
+		spin_unlock_bh(&shard->lock);
+	}
+}
+
+static const struct nla_policy nft_meter_policy[NFTA_METER_MAX + 1] = {
+	[NFTA_METER_RATE]	= { .type = NLA_U64 },
+	[NFTA_METER_UNIT]	= { .type = NLA_U64 },
+	[NFTA_METER_BURST]	= { .type = NLA_U32 },
+	[NFTA_METER_TYPE]	= { .type = NLA_U32 },
+	[NFTA_METER_FLAGS]	= { .type = NLA_U32 },
+	[NFTA_METER_SIZE]	= { .type = NLA_U32 },
+	[NFTA_METER_KLEN]	= NLA_POLICY_RANGE(NLA_BE32, 1,
+						   NFT_DATA_VALUE_MAXLEN),
+};
+
+/* Same bucket sizes as nft_limit. */
+static int nft_meter_init_limit(struct nft_meter *m,
+				const struct nlattr * const tb[])
+{
+	u32 type = NFT_LIMIT_PKTS;
+	u64 unit, rate_with_burst;
+
+	if (!tb[NFTA_METER_RATE] || !tb[NFTA_METER_UNIT])
+		return -EINVAL;
+
+	m->rate = be64_to_cpu(nla_get_be64(tb[NFTA_METER_RATE]));
+	if (m->rate == 0)
+		return -EINVAL;
+
+	unit = be64_to_cpu(nla_get_be64(tb[NFTA_METER_UNIT]));
+	if (check_mul_overflow(unit, NSEC_PER_SEC, &m->nsecs))
+		return -EOVERFLOW;
+
+	if (tb[NFTA_METER_TYPE])
+		type = ntohl(nla_get_be32(tb[NFTA_METER_TYPE]));
+
+	if (tb[NFTA_METER_BURST])
+		m->burst = ntohl(nla_get_be32(tb[NFTA_METER_BURST]));
+
+	switch (type) {
+	case NFT_LIMIT_PKTS:
+		if (m->burst == 0)
+			m->burst = NFT_METER_PKT_BURST_DEFAULT;
+
+		m->cost = div64_u64(m->nsecs, m->rate);
+		if (check_mul_overflow(m->cost, (u64)m->burst, &m->tokens_max))
+			return -EOVERFLOW;
+		break;
+	case NFT_LIMIT_PKT_BYTES:
+		if (check_add_overflow(m->rate, (u64)m->burst, &rate_with_burst) ||
+		    check_mul_overflow(m->nsecs, rate_with_burst, &m->tokens_max))
+			return -EOVERFLOW;
+
+		m->tokens_max = div64_u64(m->tokens_max, m->rate);
+		m->bytes = true;
+		break;
+	default:
+		return -EOPNOTSUPP;
+	}
+
+	if (tb[NFTA_METER_FLAGS]) {
+		u32 flags = ntohl(nla_get_be32(tb[NFTA_METER_FLAGS]));
+
+		if (flags & ~NFT_LIMIT_F_INV)
+			return -EOPNOTSUPP;
+
+		m->invert = flags & NFT_LIMIT_F_INV;
+	}
+
+	return 0;
+}
+
+static int nft_meter_obj_init(const struct nft_ctx *ctx,
+			      const struct nlattr * const tb[],
+			      struct nft_object *obj)
+{
+	struct nft_meter *m = nft_obj_data(obj);
+	unsigned int i;
+	int err;
+
+	if (!tb[NFTA_METER_KLEN])
+		return -EINVAL;
+
+	m->klen = ntohl(nla_get_be32(tb[NFTA_METER_KLEN]));
+
+	m->size = NFT_METER_SIZE_DEFAULT;
+	if (tb[NFTA_METER_SIZE]) {
+		m->size = ntohl(nla_get_be32(tb[NFTA_METER_SIZE]));
+		if (m->size == 0 || m->size > NFT_METER_SIZE_MAX)
+			return -EINVAL;
+	}
+
+	err = nft_meter_init_limit(m, tb);
+	if (err < 0)
+		return err;
+
+	m->hmask = roundup_pow_of_two(max(m->size, NFT_METER_SHARDS)) - 1;
+	m->shard_max = DIV_ROUND_UP(m->size, NFT_METER_SHARDS);
+	get_random_bytes(&m->seed, sizeof(m->seed));
+
+	m->buckets = kvcalloc(m->hmask + 1, sizeof(*m->buckets),
+			      GFP_KERNEL_ACCOUNT);
+	if (!m->buckets)
+		return -ENOMEM;
+
+	m->shards = kvcalloc(NFT_METER_SHARDS, sizeof(*m->shards),
+			     GFP_KERNEL_ACCOUNT);
+	if (!m->shards) {
+		kvfree(m->buckets);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < NFT_METER_SHARDS; i++) {
+		spin_lock_init(&m->shards[i].lock);
+		INIT_LIST_HEAD(&m->shards[i].list);
+	}
+
+	return 0;
+}
+
+static void nft_meter_obj_destroy(const struct nft_ctx *ctx,
+				  struct nft_object *obj)
+{
+	struct nft_meter *m = nft_obj_data(obj);
+
+	nft_meter_flush(m);
+	kvfree(m->shards);
+	kvfree(m->buckets);
+}
+
+static void nft_meter_obj_eval(struct nft_object *obj,
+			       struct nft_regs *regs,
+			       const struct nft_pktinfo *pkt)
+{
+	nft_meter_do_eval(nft_obj_data(obj), nft_meter_nokey, regs, pkt);
+}
+
+static int nft_meter_obj_dump(struct sk_buff *skb, struct nft_object *obj,
+			      bool reset)
+{
+	struct nft_meter *m = nft_obj_data(obj);
+	u64 secs = div_u64(m->nsecs, NSEC_PER_SEC);
+	u32 flags = m->invert ? NFT_LIMIT_F_INV : 0;
+	u32 type = m->bytes ? NFT_LIMIT_PKT_BYTES : NFT_LIMIT_PKTS;
+
+	if (nla_put_be64(skb, NFTA_METER_RATE, cpu_to_be64(m->rate),
+			 NFTA_METER_PAD) ||
+	    nla_put_be64(skb, NFTA_METER_UNIT, cpu_to_be64(secs),
+			 NFTA_METER_PAD) ||
+	    nla_put_be32(skb, NFTA_METER_BURST, htonl(m->burst)) ||
+	    nla_put_be32(skb, NFTA_METER_TYPE, htonl(type)) ||
+	    nla_put_be32(skb, NFTA_METER_FLAGS, htonl(flags)) ||
+	    nla_put_be32(skb, NFTA_METER_SIZE, htonl(m->size)) ||
+	    nla_put_be32(skb, NFTA_METER_KLEN, htonl(m->klen)))
+		return -1;
+
+	/* all buckets full again */
+	if (reset)
+		nft_meter_flush(m);
+
+	return 0;
+}
+
+static struct nft_object_type nft_meter_obj_type;
+static const struct nft_object_ops nft_meter_obj_ops = {
+	.type		= &nft_meter_obj_type,
+	.size		= sizeof(struct nft_meter),
+	.init		= nft_meter_obj_init,
+	.destroy	= nft_meter_obj_destroy,
+	.eval		= nft_meter_obj_eval,
+	.dump		= nft_meter_obj_dump,
+};
+
+static struct nft_object_type nft_meter_obj_type __read_mostly = {
+	.type		= NFT_OBJECT_METER,
+	.ops		= &nft_meter_obj_ops,
+	.maxattr	= NFTA_METER_MAX,
+	.policy		= nft_meter_policy,
+	.owner		= THIS_MODULE,
+};
+
+static void nft_meter_eval(const struct nft_expr *expr,
+			   struct nft_regs *regs,
+			   const struct nft_pktinfo *pkt)
+{
+	const struct nft_meter_expr *priv = nft_expr_priv(expr);
+
+	nft_meter_do_eval(nft_obj_data(priv->obj), &regs->data[priv->sreg],
+			  regs, pkt);
+}
+
+static const struct nla_policy nft_meter_expr_policy[NFTA_METER_EXPR_MAX + 1] = {
+	[NFTA_METER_EXPR_NAME]	= { .type = NLA_STRING,
+				    .len = NFT_OBJ_MAXNAMELEN - 1 },
+	[NFTA_METER_EXPR_SREG]	= { .type = NLA_U32 },
+};
+
+static int nft_meter_init(const struct nft_ctx *ctx,
+			  const struct nft_expr *expr,
+			  const struct nlattr * const tb[])
+{
+	struct nft_meter_expr *priv = nft_expr_priv(expr);
+	u8 genmask = nft_genmask_next(ctx->net);
+	const struct nft_meter *m;
+	struct nft_object *obj;
+	int err;
+
+	if (!tb[NFTA_METER_EXPR_NAME] || !tb[NFTA_METER_EXPR_SREG])
+		return -EINVAL;
+
+	obj = nft_obj_lookup(ctx->net, ctx->table, tb[NFTA_METER_EXPR_NAME],
+			     NFT_OBJECT_METER, genmask);
+	if (IS_ERR(obj))
+		return -ENOENT;
+
+	m = nft_obj_data(obj);
+	err = nft_parse_register_load(ctx, tb[NFTA_METER_EXPR_SREG],
+				      &priv->sreg, m->klen);
+	if (err < 0)
+		return err;
+
+	if (!nft_use_inc(&obj->use))
+		return -EMFILE;
+
+	priv->obj = obj;
+
+	return 0;
+}
+
+static int nft_meter_dump(struct sk_buff *skb,
+			  const struct nft_expr *expr, bool reset)
+{
+	const struct nft_meter_expr *priv = nft_expr_priv(expr);
+
+	if (nla_put_string(skb, NFTA_METER_EXPR_NAME, priv->obj->key.name) ||
+	    nft_dump_register(skb, NFTA_METER_EXPR_SREG, priv->sreg))
+		return -1;
+
+	return 0;
+}
+
+static void nft_meter_deactivate(const struct nft_ctx *ctx,
+				 const struct nft_expr *expr,
+				 enum nft_trans_phase phase)
+{
+	const struct nft_meter_expr *priv = nft_expr_priv(expr);
+
+	if (phase == NFT_TRANS_COMMIT)
+		return;
+
+	nft_use_dec(&priv->obj->use);
+}
+
+static void nft_meter_activate(const struct nft_ctx *ctx,
+			       const struct nft_expr *expr)
+{
+	const struct nft_meter_expr *priv = nft_expr_priv(expr);
+
+	nft_use_inc_restore(&priv->obj->use);
+}
+
+static struct nft_expr_type nft_meter_type;
+static const struct nft_expr_ops nft_meter_ops = {
+	.type		= &nft_meter_type,
+	.size		= NFT_EXPR_SIZE(sizeof(struct nft_meter_expr)),
+	.eval		= nft_meter_eval,
+	.init		= nft_meter_init,
+	.activate	= nft_meter_activate,
+	.deactivate	= nft_meter_deactivate,
+	.dump		= nft_meter_dump,
+	.reduce		= NFT_REDUCE_READONLY,
+};
+
+static struct nft_expr_type nft_meter_type __read_mostly = {
+	.name		= "meter",
+	.ops		= &nft_meter_ops,
+	.policy		= nft_meter_expr_policy,
+	.maxattr	= NFTA_METER_EXPR_MAX,
+	.owner		= THIS_MODULE,
+};
+
+static int __init nft_meter_module_init(void)
+{
+	int err;
+
+	err = nft_register_obj(&nft_meter_obj_type);
+	if (err < 0)
+		return err;
+
+	err = nft_register_expr(&nft_meter_type);
+	if (err < 0)
+		goto err1;
+
+	return 0;
+err1:
+	nft_unregister_obj(&nft_meter_obj_type);
+	return err;
+}
+
+static void __exit nft_meter_module_exit(void)
+{
+	nft_unregister_expr(&nft_meter_type);
+	nft_unregister_obj(&nft_meter_obj_type);
+}
+
+module_init(nft_meter_module_init);
+module_exit(nft_meter_module_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_ALIAS_NFT_EXPR("meter");
+MODULE_ALIAS_NFT_OBJ(NFT_OBJECT_METER);
+MODULE_DESCRIPTION("nftables keyed rate limiter");
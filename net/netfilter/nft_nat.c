@@ -15,11 +15,14 @@
 #include <linux/netfilter_ipv4.h>
 #include <linux/netfilter/nfnetlink.h>
 #include <linux/netfilter/nf_tables.h>
+#include <linux/netfilter/nf_nat_block.h>
 #include <net/netfilter/nf_conntrack.h>
 #include <net/netfilter/nf_nat.h>
 #include <net/netfilter/nf_tables.h>
 #include <net/ip.h>
 
+#define NFT_NAT_ATTR_MAX	NFTA_NAT_BLOCK_SIZE
+
 struct nft_nat {
 	u8			sreg_addr_min;
 	u8			sreg_addr_max;
@@ -28,6 +31,7 @@ struct nft_nat {
 	enum nf_nat_manip_type  type:8;
 	u8			family;
 	u16			flags;
+	u16			block_size;
 };
 
 static void nft_nat_setup_addr(struct nf_nat_range2 *range,
@@ -121,11 +125,13 @@ static void nft_nat_eval(const struct nft_expr *expr,
 		nft_nat_setup_proto(&range, regs, priv);
 
 	range.flags = priv->flags;
+	if (priv->flags & NF_NAT_RANGE_PROTO_BLOCK)
+		range.base_proto.all = htons(priv->block_size);
 
 	regs->verdict.code = nf_nat_setup_info(ct, &range, priv->type);
 }
 
-static const struct nla_policy nft_nat_policy[NFTA_NAT_MAX + 1] = {
+static const struct nla_policy nft_nat_policy[NFT_NAT_ATTR_MAX + 1] = {
 	[NFTA_NAT_TYPE]		 = { .type = NLA_U32 },
 	[NFTA_NAT_FAMILY]	 = { .type = NLA_U32 },
 	[NFTA_NAT_REG_ADDR_MIN]	 = { .type = NLA_U32 },
@@ -133,7 +139,9 @@ static const struct nla_policy nft_nat_policy[NFTA_NAT_MAX + 1] = {
 	[NFTA_NAT_REG_PROTO_MIN] = { .type = NLA_U32 },
 	[NFTA_NAT_REG_PROTO_MAX] = { .type = NLA_U32 },
 	[NFTA_NAT_FLAGS]	 =
-		NLA_POLICY_MASK(NLA_BE32, NF_NAT_RANGE_MASK),
+		NLA_POLICY_MASK(NLA_BE32, NF_NAT_RANGE_MASK |
+					  NF_NAT_RANGE_PROTO_BLOCK),
+	[NFTA_NAT_BLOCK_SIZE]	 = NLA_POLICY_MIN(NLA_BE16, 1),
 };
 
 static int nft_nat_validate(const struct nft_ctx *ctx,
@@ -254,6 +262,18 @@ static int nft_nat_init(const struct nft_ctx *ctx, const struct nft_expr *expr,
 	if (tb[NFTA_NAT_FLAGS])
 		priv->flags |= ntohl(nla_get_be32(tb[NFTA_NAT_FLAGS]));
 
+	if (priv->flags & NF_NAT_RANGE_PROTO_BLOCK) {
+		if (priv->type != NF_NAT_MANIP_SRC ||
+		    !tb[NFTA_NAT_BLOCK_SIZE] ||
+		    (priv->flags & (NF_NAT_RANGE_PROTO_OFFSET |
+				    NF_NAT_RANGE_PROTO_RANDOM_ALL)))
+			return -EINVAL;
+
+		priv->block_size = ntohs(nla_get_be16(tb[NFTA_NAT_BLOCK_SIZE]));
+	} else if (tb[NFTA_NAT_BLOCK_SIZE]) {
+		return -EINVAL;
+	}
+
 	return nf_ct_netns_get(ctx->net, family);
 }
 
@@ -297,6 +317,10 @@ static int nft_nat_dump(struct sk_buff *skb,
 			goto nla_put_failure;
 	}
 
+	if (priv->flags & NF_NAT_RANGE_PROTO_BLOCK &&
+	    nla_put_be16(skb, NFTA_NAT_BLOCK_SIZE, htons(priv->block_size)))
+		goto nla_put_failure;
+
 	return 0;
 
 nla_put_failure:
@@ -327,7 +351,7 @@ static struct nft_expr_type nft_nat_type __read_mostly = {
 	.name           = "nat",
 	.ops            = &nft_nat_ops,
 	.policy         = nft_nat_policy,
-	.maxattr        = NFTA_NAT_MAX,
+	.maxattr        = NFT_NAT_ATTR_MAX,
 	.owner          = THIS_MODULE,
 };
 
@@ -359,7 +383,7 @@ static struct nft_expr_type nft_inet_nat_type __read_mostly = {
 	.family		= NFPROTO_INET,
 	.ops            = &nft_nat_inet_ops,
 	.policy         = nft_nat_policy,
-	.maxattr        = NFTA_NAT_MAX,
+	.maxattr        = NFT_NAT_ATTR_MAX,
 	.owner          = THIS_MODULE,
 };
 
@@ -379,8 +403,12 @@ static void nft_nat_inet_module_exit(void) { }
 
 static int __init nft_nat_module_init(void)
 {
-	int ret = nft_nat_inet_module_init();
+	int ret;
+
+	BUILD_BUG_ON(NFTA_NAT_BLOCK_SIZE <= NFTA_NAT_MAX);
+	BUILD_BUG_ON(NF_NAT_RANGE_PROTO_BLOCK & NF_NAT_RANGE_MASK);
 
+	ret = nft_nat_inet_module_init();
 	if (ret)
 		return ret;
 
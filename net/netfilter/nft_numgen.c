@@ -9,6 +9,7 @@
 #include <linux/netlink.h>
 #include <linux/netfilter.h>
 #include <linux/netfilter/nf_tables.h>
+#include <linux/netfilter/nft_numgen.h>
 #include <linux/random.h>
 #include <linux/static_key.h>
 #include <net/netfilter/nf_tables.h>
@@ -129,6 +130,102 @@ static void nft_ng_inc_destroy(const struct nft_ctx *ctx,
 	kfree(priv->counter);
 }
 
+struct nft_ng_inc_percpu {
+	u8			dreg;
+	u32			modulus;
+	u32 __percpu		*counter;
+	u32			offset;
+};
+
+static u32 nft_ng_inc_percpu_gen(const struct nft_ng_inc_percpu *priv)
+{
+	u32 *counter, nval;
+
+	local_bh_disable();
+	counter = this_cpu_ptr(priv->counter);
+	nval = *counter + 1 < priv->modulus ? *counter + 1 : 0;
+	*counter = nval;
+	local_bh_enable();
+
+	return nval + priv->offset;
+}
+
+static void nft_ng_inc_percpu_eval(const struct nft_expr *expr,
+				   struct nft_regs *regs,
+				   const struct nft_pktinfo *pkt)
+{
+	const struct nft_ng_inc_percpu *priv = nft_expr_priv(expr);
+
+	regs->data[priv->dreg] = nft_ng_inc_percpu_gen(priv);
+}
+
+static int nft_ng_inc_percpu_init(const struct nft_ctx *ctx,
+				  const struct nft_expr *expr,
+				  const struct nlattr * const tb[])
+{
+	struct nft_ng_inc_percpu *priv = nft_expr_priv(expr);
+	int cpu, err;
+
+	if (tb[NFTA_NG_OFFSET])
+		priv->offset = ntohl(nla_get_be32(tb[NFTA_NG_OFFSET]));
+
+	priv->modulus = ntohl(nla_get_be32(tb[NFTA_NG_MODULUS]));
+	if (priv->modulus == 0)
+		return -ERANGE;
+
+	if (priv->offset + priv->modulus - 1 < priv->offset)
+		return -EOVERFLOW;
+
+	priv->counter = alloc_percpu_gfp(u32, GFP_KERNEL_ACCOUNT);
+	if (!priv->counter)
+		return -ENOMEM;
+
+	/* CPU n starts at value n, so that a few packets spread over CPUs
+	 * don't all get the first value.
+	 */
+	for_each_possible_cpu(cpu)
+		*per_cpu_ptr(priv->counter, cpu) =
+			(priv->modulus - 1 + cpu % priv->modulus) % priv->modulus;
+
+	err = nft_parse_register_store(ctx, tb[NFTA_NG_DREG], &priv->dreg,
+				       NULL, NFT_DATA_VALUE, sizeof(u32));
+	if (err < 0)
+		goto err;
+
+	return 0;
+err:
+	free_percpu(priv->counter);
+
+	return err;
+}
+
+static int nft_ng_inc_percpu_dump(struct sk_buff *skb,
+				  const struct nft_expr *expr, bool reset)
+{
+	const struct nft_ng_inc_percpu *priv = nft_expr_priv(expr);
+
+	return nft_ng_dump(skb, priv->dreg, priv->modulus,
+			   NFT_NG_INCREMENTAL_PERCPU, priv->offset);
+}
+
+static void nft_ng_inc_percpu_destroy(const struct nft_ctx *ctx,
+				      const struct nft_expr *expr)
+{
+	const struct nft_ng_inc_percpu *priv = nft_expr_priv(expr);
+
+	free_percpu(priv->counter);
+}
+
+static bool nft_ng_inc_percpu_reduce(struct nft_regs_track *track,
+				     const struct nft_expr *expr)
+{
+	const struct nft_ng_inc_percpu *priv = nft_expr_priv(expr);
+
+	nft_reg_track_cancel(track, priv->dreg, NFT_REG32_SIZE);
+
+	return false;
+}
+
 struct nft_ng_random {
 	u8			dreg;
 	u32			modulus;
@@ -199,6 +296,16 @@ static const struct nft_expr_ops nft_ng_inc_ops = {
 	.reduce		= nft_ng_inc_reduce,
 };
 
+static const struct nft_expr_ops nft_ng_inc_percpu_ops = {
+	.type		= &nft_ng_type,
+	.size		= NFT_EXPR_SIZE(sizeof(struct nft_ng_inc_percpu)),
+	.eval		= nft_ng_inc_percpu_eval,
+	.init		= nft_ng_inc_percpu_init,
+	.destroy	= nft_ng_inc_percpu_destroy,
+	.dump		= nft_ng_inc_percpu_dump,
+	.reduce		= nft_ng_inc_percpu_reduce,
+};
+
 static const struct nft_expr_ops nft_ng_random_ops = {
 	.type		= &nft_ng_type,
 	.size		= NFT_EXPR_SIZE(sizeof(struct nft_ng_random)),
@@ -225,6 +332,8 @@ nft_ng_select_ops(const struct nft_ctx *ctx, const struct nlattr * const tb[])
 		return &nft_ng_inc_ops;
 	case NFT_NG_RANDOM:
 		return &nft_ng_random_ops;
+	case NFT_NG_INCREMENTAL_PERCPU:
+		return &nft_ng_inc_percpu_ops;
 	}
 
 	return ERR_PTR(-EINVAL);
@@ -145,6 +145,86 @@ int nft_payload_inner_offset(const struct nft_pktinfo *pkt)
 	return pkt->inneroff;
 }
 
+/* Returns a pointer to @len bytes at @offset if they are contiguous in one
+ * paged fragment or in the linear area of a frag_list skb.  Successive
+ * loads from the same fragment start from the one found last time, unless
+ * the skb was pulled in the mean time.
+ */
+static const void *nft_payload_frag_ptr(struct nft_pktinfo *pkt, int offset,
+					unsigned int len)
+{
+	const struct sk_buff *skb = pkt->skb;
+	const struct skb_shared_info *shinfo = skb_shinfo(skb);
+	unsigned int start = skb_headlen(skb), end, i = 0;
+	const struct sk_buff *iter;
+
+	if (offset < (int)start || !skb_frags_readable(skb))
+		return NULL;
+
+	if ((pkt->flags & NFT_PKTINFO_FRAG) &&
+	    pkt->fraghead == skb_headlen(skb) &&
+	    pkt->frag < shinfo->nr_frags && offset >= pkt->fragstart) {
+		i = pkt->frag;
+		start = pkt->fragstart;
+	}
+
+	for (; i < shinfo->nr_frags; i++) {
+		const skb_frag_t *frag = &shinfo->frags[i];
+
+		end = start + skb_frag_size(frag);
+		if (offset < end) {
+			if (offset + len > end ||
+			    PageHighMem(skb_frag_page(frag)))
+				return NULL;
+
+			pkt->frag = i;
+			pkt->fragstart = start;
+			pkt->fraghead = skb_headlen(skb);
+			pkt->flags |= NFT_PKTINFO_FRAG;
+
+			return skb_frag_address(frag) + offset - start;
+		}
+		start = end;
+	}
+
+	skb_walk_frags(skb, iter) {
+		end = start + iter->len;
+		if (offset < end) {
+			offset -= start;
+			if (offset + len > skb_headlen(iter))
+				return NULL;
+
+			return iter->data + offset;
+		}
+		start = end;
+	}
+
+	return NULL;
+}
+
+/* skb_copy_bits() for the loads of payload expressions, without a copy
+ * loop for data in the linear area or in a single fragment.
+ */
+static bool nft_payload_copy(const struct nft_pktinfo *pkt, int offset,
+			     void *dest, unsigned int len)
+{
+	const struct sk_buff *skb = pkt->skb;
+	const void *ptr;
+
+	if (likely(offset + (int)len <= (int)skb_headlen(skb))) {
+		memcpy(dest, skb->data + offset, len);
+		return true;
+	}
+
+	ptr = nft_payload_frag_ptr((struct nft_pktinfo *)pkt, offset, len);
+	if (ptr) {
+		memcpy(dest, ptr, len);
+		return true;
+	}
+
+	return skb_copy_bits(skb, offset, dest, len) == 0;
+}
+
 static bool nft_payload_need_vlan_adjust(u32 offset, u32 len)
 {
 	unsigned int boundary = offset + len;
@@ -201,7 +281,7 @@ void nft_payload_eval(const struct nft_expr *expr,
 	}
 	offset += priv->offset;
 
-	if (skb_copy_bits(skb, offset, dest, priv->len) < 0)
+	if (!nft_payload_copy(pkt, offset, dest, priv->len))
 		goto err;
 	return;
 err:
@@ -597,7 +677,6 @@ void nft_payload_inner_eval(const struct nft_expr *expr, struct nft_regs *regs,
 			    struct nft_inner_tun_ctx *tun_ctx)
 {
 	const struct nft_payload *priv = nft_expr_priv(expr);
-	const struct sk_buff *skb = pkt->skb;
 	u32 *dest = &regs->data[priv->dreg];
 	int offset;
 
@@ -635,7 +714,7 @@ void nft_payload_inner_eval(const struct nft_expr *expr, struct nft_regs *regs,
 	}
 	offset += priv->offset;
 
-	if (skb_copy_bits(skb, offset, dest, priv->len) < 0)
+	if (!nft_payload_copy(pkt, offset, dest, priv->len))
 		goto err;
 
 	return;
@@ -923,6 +1002,8 @@ static void nft_payload_set_eval(const struct nft_expr *expr,
 	    skb_store_bits(skb, offset, src, priv->len) < 0)
 		goto err;
 
+	nft_pktinfo_hdr_flush(pkt);
+
 	if (priv->csum_type == NFT_PAYLOAD_CSUM_SCTP &&
 	    pkt->tprot == IPPROTO_SCTP &&
 	    skb->ip_summed != CHECKSUM_PARTIAL) {
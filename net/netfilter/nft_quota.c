@@ -11,19 +11,52 @@
 #include <linux/netfilter.h>
 #include <linux/netfilter/nf_tables.h>
 #include <net/netfilter/nf_tables.h>
-
+#include <net/netfilter/nf_tables_core.h>
+
+/* With nf_tables_quota_percpu_slack set when the quota is created, each
+ * cpu collects up to @slack bytes in @pending before adding them to
+ * @consumed.  While @consumed is more than @margin, i.e. the slack of all
+ * cpus, away from the quota the shared counter is thus only written once
+ * every @slack bytes per cpu; closer to the quota every packet updates it
+ * again so the limit is exact.
+ */
 struct nft_quota {
 	atomic64_t	quota;
 	unsigned long	flags;
 	atomic64_t	*consumed;
+	u32 __percpu	*pending;
+	u32		slack;
+	u64		margin;
 };
 
+static u64 nft_quota_consume_percpu(struct nft_quota *priv, u32 len,
+				    u64 quota)
+{
+	u64 consumed = atomic64_read(priv->consumed);
+
+	if (consumed + priv->margin < quota) {
+		if (this_cpu_add_return(*priv->pending, len) < priv->slack)
+			return consumed;
+
+		len = this_cpu_xchg(*priv->pending, 0);
+	} else {
+		len += this_cpu_xchg(*priv->pending, 0);
+	}
+
+	return atomic64_add_return(len, priv->consumed);
+}
+
 static inline bool nft_overquota(struct nft_quota *priv,
 				 const struct sk_buff *skb,
 				 bool *report)
 {
-	u64 consumed = atomic64_add_return(skb->len, priv->consumed);
 	u64 quota = atomic64_read(&priv->quota);
+	u64 consumed;
+
+	if (priv->pending)
+		consumed = nft_quota_consume_percpu(priv, skb->len, quota);
+	else
+		consumed = atomic64_add_return(skb->len, priv->consumed);
 
 	if (report)
 		*report = consumed >= quota;
@@ -69,11 +102,43 @@ static void nft_quota_obj_eval(struct nft_object *obj,
 			       NFT_MSG_NEWOBJ, 0, nft_pf(pkt), 0, GFP_ATOMIC);
 }
 
+static int nft_quota_percpu_init(struct nft_quota *priv, u32 slack, gfp_t gfp)
+{
+	priv->pending = NULL;
+	priv->slack = slack;
+	priv->margin = 0;
+
+	if (!slack || num_possible_cpus() == 1)
+		return 0;
+
+	priv->pending = alloc_percpu_gfp(u32, gfp);
+	if (!priv->pending)
+		return -ENOMEM;
+
+	priv->margin = (u64)slack * num_possible_cpus();
+	return 0;
+}
+
+static u64 nft_quota_pending(const struct nft_quota *priv)
+{
+	u64 pending = 0;
+	int cpu;
+
+	if (!priv->pending)
+		return 0;
+
+	for_each_possible_cpu(cpu)
+		pending += READ_ONCE(*per_cpu_ptr(priv->pending, cpu));
+
+	return pending;
+}
+
 static int nft_quota_do_init(const struct nlattr * const tb[],
 			     struct nft_quota *priv)
 {
 	unsigned long flags = 0;
 	u64 quota, consumed = 0;
+	int err;
 
 	if (!tb[NFTA_QUOTA_BYTES])
 		return -EINVAL;
@@ -100,6 +165,13 @@ static int nft_quota_do_init(const struct nlattr * const tb[],
 	if (!priv->consumed)
 		return -ENOMEM;
 
+	err = nft_quota_percpu_init(priv, READ_ONCE(nft_quota_percpu_slack),
+				    GFP_KERNEL_ACCOUNT);
+	if (err < 0) {
+		kfree(priv->consumed);
+		return err;
+	}
+
 	atomic64_set(&priv->quota, quota);
 	priv->flags = flags;
 	atomic64_set(priv->consumed, consumed);
@@ -110,6 +182,7 @@ static int nft_quota_do_init(const struct nlattr * const tb[],
 static void nft_quota_do_destroy(const struct nft_ctx *ctx,
 				 struct nft_quota *priv)
 {
+	free_percpu(priv->pending);
 	kfree(priv->consumed);
 }
 
@@ -137,7 +210,7 @@ static void nft_quota_obj_update(struct nft_object *obj,
 static int nft_quota_do_dump(struct sk_buff *skb, struct nft_quota *priv,
 			     bool reset)
 {
-	u64 consumed, consumed_cap, quota;
+	u64 consumed, consumed_cap, pending, quota;
 	u32 flags = priv->flags;
 
 	/* Since we inconditionally increment consumed quota for each packet
@@ -145,12 +218,13 @@ static int nft_quota_do_dump(struct sk_buff *skb, struct nft_quota *priv,
 	 * userspace.
 	 */
 	consumed = atomic64_read(priv->consumed);
+	pending = nft_quota_pending(priv);
 	quota = atomic64_read(&priv->quota);
-	if (consumed >= quota) {
+	if (consumed + pending >= quota) {
 		consumed_cap = quota;
 		flags |= NFT_QUOTA_F_DEPLETED;
 	} else {
-		consumed_cap = consumed;
+		consumed_cap = consumed + pending;
 	}
 
 	if (nla_put_be64(skb, NFTA_QUOTA_BYTES, cpu_to_be64(quota),
@@ -160,6 +234,9 @@ static int nft_quota_do_dump(struct sk_buff *skb, struct nft_quota *priv,
 	    nla_put_be32(skb, NFTA_QUOTA_FLAGS, htonl(flags)))
 		goto nla_put_failure;
 
+	/* bytes pending on the cpus are left alone, they are reported
+	 * again after the reset.  This is bounded by the margin.
+	 */
 	if (reset) {
 		atomic64_sub(consumed, priv->consumed);
 		clear_bit(NFT_QUOTA_DEPLETED_BIT, &priv->flags);
@@ -251,7 +328,13 @@ static int nft_quota_clone(struct nft_expr *dst, const struct nft_expr *src, gfp
 	if (!priv_dst->consumed)
 		return -ENOMEM;
 
-	*priv_dst->consumed = *priv_src->consumed;
+	if (nft_quota_percpu_init(priv_dst, priv_src->slack, gfp) < 0) {
+		kfree(priv_dst->consumed);
+		return -ENOMEM;
+	}
+
+	atomic64_set(priv_dst->consumed, atomic64_read(priv_src->consumed) +
+					 nft_quota_pending(priv_src));
 
 	return 0;
 }
@@ -0,0 +1,535 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/* Microbenchmark of the nf_tables set backends
+ *
+ * For a few key shapes, a set of set_bench_elems elements is built with
+ * every backend that accepts its description.  Insertion, lookups of keys
+ * that are in the set and of keys that aren't, and removal are timed, and
+ * the memory the set took is sampled from the count of free pages, which
+ * is only meaningful on an otherwise idle machine.  The backend that
+ * nft_select_set_ops() picks for the same description is then compared
+ * with the one that had the fastest lookups.
+ *
+ * Elements are inserted and removed under the commit mutex of init_net,
+ * like a transaction would, but the generation is never flipped.  The
+ * bitmap backend only exposes elements after that, so its lookups are
+ * timed without checking their results.
+ */
+
+#include <kunit/test.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/random.h>
+#include <linux/vmstat.h>
+#include <linux/unaligned.h>
+#include <linux/netfilter/nf_tables.h>
+#include <net/netfilter/nf_tables_core.h>
+#include <net/netfilter/nf_tables.h>
+
+static unsigned int set_bench_elems __read_mostly = 65536;
+module_param(set_bench_elems, uint, 0644);
+MODULE_PARM_DESC(set_bench_elems, "Number of elements in the sets built by the set backend benchmark");
+
+/* lookups per RCU read side section */
+#define NFT_SET_BENCH_BATCH	256
+
+struct nft_set_bench_shape {
+	const char	*name;
+	u32		flags;
+	u8		field_count;
+	u8		field_len[NFT_REG32_COUNT];
+	/* keys are numbered up to twice this */
+	unsigned int	max_elems;
+};
+
+static const struct nft_set_bench_shape nft_set_bench_shapes[] = {
+	{
+		.name		= "port",
+		.field_count	= 1,
+		.field_len	= { 2 },
+		.max_elems	= 32768,
+	},
+	{
+		.name		= "ipv4",
+		.field_count	= 1,
+		.field_len	= { 4 },
+	},
+	{
+		.name		= "ipv6",
+		.field_count	= 1,
+		.field_len	= { 16 },
+	},
+	{
+		.name		= "ipv4 . port",
+		.field_count	= 2,
+		.field_len	= { 4, 2 },
+	},
+	{
+		.name		= "ipv4 interval",
+		.flags		= NFT_SET_INTERVAL,
+		.field_count	= 1,
+		.field_len	= { 4 },
+	},
+	{
+		.name		= "ipv4 . port interval",
+		.flags		= NFT_SET_INTERVAL,
+		.field_count	= 2,
+		.field_len	= { 4, 2 },
+	},
+};
+
+struct nft_set_bench {
+	const struct nft_set_bench_shape *shape;
+	struct nft_set_desc		desc;
+	unsigned int			nelems;
+	/* in u32 words */
+	unsigned int			stride;
+	/* keys of the elements and keys that miss, in random order */
+	u32				*hits;
+	u32				*misses;
+	struct {
+		struct nlattr		nla;
+		__be32			klen;
+	} klen_attr;
+	const struct nlattr		*nla[NFTA_SET_MAX + 1];
+};
+
+/* all times in nanoseconds per element */
+struct nft_set_bench_result {
+	const struct nft_set_ops	*ops;
+	u64				insert;
+	u64				hit;
+	u64				miss;
+	u64				remove;
+	unsigned long			bytes;
+	u64				estimate;
+};
+
+/* What userspace would ask for: a range becomes two elements, start and
+ * end, unless the set has several fields and stores the end in the
+ * element.
+ */
+static bool nft_set_bench_end_elem(const struct nft_set_bench_shape *shape)
+{
+	return shape->flags & NFT_SET_INTERVAL && shape->field_count == 1;
+}
+
+static bool nft_set_bench_key_end(const struct nft_set_bench_shape *shape)
+{
+	return shape->flags & NFT_SET_INTERVAL && shape->field_count > 1;
+}
+
+/* Key number @n: even ones are added to the set, odd ones are looked up as
+ * misses.  Exact keys are scattered over their field, ranges cover [k, k+1]
+ * of the first field and are four apart: @end is 1 for the inclusive end
+ * of a range, 2 for the end element, which is exclusive.
+ */
+static void nft_set_bench_key(const struct nft_set_bench_shape *shape,
+			      u32 n, u32 end, u32 *key)
+{
+	unsigned int i, len, off = 0;
+	u8 *p = (u8 *)key;
+	u32 v;
+
+	for (i = 0; i < shape->field_count; i++) {
+		len = shape->field_len[i];
+
+		if (i > 0)
+			v = 1024 + n % 16;
+		else if (shape->field_count > 1)
+			v = n / 16;
+		else
+			v = n;
+
+		if (i == 0 && shape->flags & NFT_SET_INTERVAL)
+			v = v * 4 + end;
+		else if (len == 2)
+			v = (v * 40503) & 0xffff;
+		else
+			v *= 2654435761U;
+
+		memset(p + off, 0, round_up(len, sizeof(u32)));
+		if (len == 2) {
+			put_unaligned_be16(v, p + off);
+		} else {
+			if (len == 16)
+				put_unaligned_be32(0x20010db8, p + off);
+			put_unaligned_be32(v, p + off + len - sizeof(u32));
+		}
+
+		off += round_up(len, sizeof(u32));
+	}
+}
+
+static void nft_set_bench_shuffle(u32 *keys, unsigned int stride,
+				  unsigned int num)
+{
+	u32 tmp[NFT_DATA_VALUE_MAXLEN / sizeof(u32)];
+	unsigned int i, j;
+
+	for (i = num - 1; i > 0; i--) {
+		j = get_random_u32_below(i + 1);
+		memcpy(tmp, keys + i * stride, stride * sizeof(u32));
+		memcpy(keys + i * stride, keys + j * stride,
+		       stride * sizeof(u32));
+		memcpy(keys + j * stride, tmp, stride * sizeof(u32));
+	}
+}
+
+static int nft_set_bench_init(struct nft_set_bench *b,
+			      const struct nft_set_bench_shape *shape)
+{
+	unsigned int i, klen = 0;
+
+	if (shape->field_count > 1) {
+		for (i = 0; i < shape->field_count; i++)
+			klen += round_up(shape->field_len[i], sizeof(u32));
+
+		b->desc.field_count = shape->field_count;
+		memcpy(b->desc.field_len, shape->field_len,
+		       sizeof(b->desc.field_len));
+	} else {
+		klen = shape->field_len[0];
+	}
+
+	b->shape = shape;
+	b->nelems = max(1U, min(set_bench_elems, shape->max_elems ?: U32_MAX / 2));
+	b->stride = DIV_ROUND_UP(klen, sizeof(u32));
+
+	b->desc.klen = klen;
+	b->desc.size = b->nelems;
+	b->desc.policy = NFT_SET_POL_PERFORMANCE;
+
+	b->klen_attr.nla.nla_len = nla_attr_size(sizeof(__be32));
+	b->klen_attr.nla.nla_type = NFTA_SET_KEY_LEN;
+	b->klen_attr.klen = htonl(klen);
+	b->nla[NFTA_SET_KEY_LEN] = &b->klen_attr.nla;
+
+	b->hits = kvcalloc(b->nelems, b->stride * sizeof(u32), GFP_KERNEL);
+	b->misses = kvcalloc(b->nelems, b->stride * sizeof(u32), GFP_KERNEL);
+	if (!b->hits || !b->misses) {
+		kvfree(b->hits);
+		kvfree(b->misses);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < b->nelems; i++) {
+		nft_set_bench_key(shape, 2 * i, 0, b->hits + i * b->stride);
+		nft_set_bench_key(shape, 2 * i + 1, 0, b->misses + i * b->stride);
+	}
+	nft_set_bench_shuffle(b->hits, b->stride, b->nelems);
+	nft_set_bench_shuffle(b->misses, b->stride, b->nelems);
+
+	return 0;
+}
+
+static void nft_set_bench_fini(struct nft_set_bench *b)
+{
+	kvfree(b->hits);
+	kvfree(b->misses);
+}
+
+static int nft_set_bench_add(struct nft_set *set,
+			     const struct nft_set_ext_tmpl *tmpl,
+			     const u32 *key, const u32 *key_end, u8 flags,
+			     struct nft_elem_priv **elem_priv)
+{
+	struct nft_set_elem elem = {};
+	struct nft_elem_priv *dup;
+	int err;
+
+	elem.priv = nft_set_elem_init(set, tmpl, key, key_end, NULL, 0, 0,
+				      GFP_KERNEL);
+	if (IS_ERR(elem.priv))
+		return PTR_ERR(elem.priv);
+
+	if (flags)
+		*nft_set_ext_flags(nft_set_elem_ext(set, elem.priv)) = flags;
+
+	memcpy(elem.key.val.data, key, set->klen);
+	if (key_end)
+		memcpy(elem.key_end.val.data, key_end, set->klen);
+
+	err = set->ops->insert(&init_net, set, &elem, &dup);
+	if (err < 0) {
+		kfree(elem.priv);
+		return err;
+	}
+
+	*elem_priv = elem.priv;
+	return 0;
+}
+
+static int nft_set_bench_del(struct nft_set *set,
+			     struct nft_elem_priv *elem_priv)
+{
+	const struct nft_set_ext *ext = nft_set_elem_ext(set, elem_priv);
+	struct nft_set_elem elem = { .priv = elem_priv };
+
+	memcpy(elem.key.val.data, nft_set_ext_key(ext), set->klen);
+	if (nft_set_ext_exists(ext, NFT_SET_EXT_KEY_END))
+		memcpy(elem.key_end.val.data, nft_set_ext_key_end(ext),
+		       set->klen);
+
+	elem_priv = set->ops->deactivate(&init_net, set, &elem);
+	if (!elem_priv)
+		return -ENOENT;
+
+	set->ops->remove(&init_net, set, elem_priv);
+	return 0;
+}
+
+static u64 nft_set_bench_lookup(const struct nft_set *set, const u32 *keys,
+				unsigned int stride, unsigned int num,
+				unsigned int *found)
+{
+	const struct nft_set_ext *ext;
+	unsigned int i, j, end;
+	u64 start, ns = 0;
+
+	*found = 0;
+	for (i = 0; i < num; i += NFT_SET_BENCH_BATCH) {
+		end = min(num, i + NFT_SET_BENCH_BATCH);
+
+		start = ktime_get_ns();
+		rcu_read_lock();
+		for (j = i; j < end; j++)
+			*found += set->ops->lookup(&init_net, set,
+						   keys + j * stride, &ext);
+		rcu_read_unlock();
+		ns += ktime_get_ns() - start;
+
+		cond_resched();
+	}
+
+	return div_u64(ns, num);
+}
+
+static int nft_set_bench_run(struct kunit *test, struct nft_set_bench *b,
+			     const struct nft_set_type *type,
+			     struct nft_set_bench_result *res)
+{
+	struct nftables_pernet *nft_net = nft_pernet(&init_net);
+	const struct nft_set_bench_shape *shape = b->shape;
+	struct nft_ctx ctx = { .net = &init_net };
+	const struct nft_set_ops *ops = &type->ops;
+	struct nft_set_desc desc = b->desc;
+	unsigned int i, nentries, found;
+	struct nft_elem_priv **elems;
+	struct nft_set_ext_tmpl tmpl;
+	struct nft_set_estimate est;
+	u32 key[NFT_DATA_VALUE_MAXLEN / sizeof(u32)];
+	u32 key_end[NFT_DATA_VALUE_MAXLEN / sizeof(u32)];
+	unsigned long free_pages;
+	struct nft_set *set;
+	bool visible;
+	long used;
+	u64 start;
+	int err;
+
+	if (!nft_set_ops_candidate(type, shape->flags) ||
+	    !ops->estimate(&desc, shape->flags, &est))
+		return -EOPNOTSUPP;
+
+	memset(res, 0, sizeof(*res));
+	res->ops = ops;
+	res->estimate = est.size;
+	visible = type != &nft_set_bitmap_type &&
+		  type != &nft_set_bitmap_tree_type;
+
+	nentries = b->nelems;
+	if (nft_set_bench_end_elem(shape))
+		nentries *= 2;
+
+	elems = kvcalloc(nentries, sizeof(*elems), GFP_KERNEL);
+	if (!elems)
+		return -ENOMEM;
+
+	free_pages = global_zone_page_state(NR_FREE_PAGES);
+
+	desc.size = nft_set_kernel_size(ops, &desc);
+	set = kvzalloc(sizeof(*set) + ops->privsize(b->nla, &desc), GFP_KERNEL);
+	if (!set) {
+		err = -ENOMEM;
+		goto err_set;
+	}
+
+	INIT_LIST_HEAD(&set->bindings);
+	INIT_LIST_HEAD(&set->catchall_list);
+	INIT_LIST_HEAD(&set->pending_update);
+	refcount_set(&set->refs, 1);
+	write_pnet(&set->net, &init_net);
+	set->ops = ops;
+	set->klen = desc.klen;
+	set->flags = shape->flags;
+	set->size = desc.size;
+	set->policy = desc.policy;
+	set->field_count = desc.field_count;
+	memcpy(set->field_len, desc.field_len, sizeof(set->field_len));
+
+	err = ops->init(set, &desc, b->nla);
+	if (err < 0)
+		goto err_init;
+
+	nft_set_ext_prepare(&tmpl);
+	nft_set_ext_add_length(&tmpl, NFT_SET_EXT_KEY, set->klen);
+	if (nft_set_bench_key_end(shape))
+		nft_set_ext_add_length(&tmpl, NFT_SET_EXT_KEY_END, set->klen);
+	if (nft_set_bench_end_elem(shape))
+		nft_set_ext_add(&tmpl, NFT_SET_EXT_FLAGS);
+
+	mutex_lock(&nft_net->commit_mutex);
+	start = ktime_get_ns();
+	for (i = 0, err = 0; i < b->nelems && !err; i++) {
+		nft_set_bench_key(shape, 2 * i, 0, key);
+
+		if (nft_set_bench_key_end(shape)) {
+			nft_set_bench_key(shape, 2 * i, 1, key_end);
+			err = nft_set_bench_add(set, &tmpl, key, key_end, 0,
+						&elems[i]);
+		} else if (nft_set_bench_end_elem(shape)) {
+			err = nft_set_bench_add(set, &tmpl, key, NULL, 0,
+						&elems[2 * i]);
+			if (err)
+				break;
+
+			nft_set_bench_key(shape, 2 * i, 2, key);
+			err = nft_set_bench_add(set, &tmpl, key, NULL,
+						NFT_SET_ELEM_INTERVAL_END,
+						&elems[2 * i + 1]);
+		} else {
+			err = nft_set_bench_add(set, &tmpl, key, NULL, 0,
+						&elems[i]);
+		}
+
+		cond_resched();
+	}
+	if (ops->commit)
+		ops->commit(set);
+	res->insert = div_u64(ktime_get_ns() - start, b->nelems);
+	mutex_unlock(&nft_net->commit_mutex);
+
+	KUNIT_EXPECT_EQ_MSG(test, err, 0, "%ps: insertion failed", ops->lookup);
+	if (err)
+		goto err_insert;
+
+	used = free_pages - global_zone_page_state(NR_FREE_PAGES);
+	res->bytes = max(used, 0L) * PAGE_SIZE;
+
+	res->hit = nft_set_bench_lookup(set, b->hits, b->stride, b->nelems,
+					&found);
+	if (visible)
+		KUNIT_EXPECT_EQ_MSG(test, found, b->nelems,
+				    "%ps: elements not found", ops->lookup);
+
+	res->miss = nft_set_bench_lookup(set, b->misses, b->stride, b->nelems,
+					 &found);
+	if (visible)
+		KUNIT_EXPECT_EQ_MSG(test, found, 0,
+				    "%ps: unexpected matches", ops->lookup);
+
+err_insert:
+	mutex_lock(&nft_net->commit_mutex);
+	start = ktime_get_ns();
+	for (i = 0; i < nentries; i++) {
+		if (!elems[i])
+			continue;
+
+		/* left to ->destroy() */
+		if (nft_set_bench_del(set, elems[i]) < 0)
+			elems[i] = NULL;
+
+		cond_resched();
+	}
+	if (ops->commit)
+		ops->commit(set);
+	res->remove = div_u64(ktime_get_ns() - start, b->nelems);
+	mutex_unlock(&nft_net->commit_mutex);
+
+	synchronize_rcu();
+
+	for (i = 0; i < nentries; i++) {
+		if (elems[i])
+			nf_tables_set_elem_destroy(&ctx, set, elems[i]);
+	}
+
+	ops->destroy(&ctx, set);
+err_init:
+	kvfree(set);
+err_set:
+	kvfree(elems);
+	return err;
+}
+
+static void nft_set_bench_test(struct kunit *test)
+{
+	const struct nft_set_bench_shape *shape = test->param_value;
+	struct nft_set_bench_result res, best = {}, picked = {};
+	const struct nft_set_ops *ops;
+	struct nft_set_bench *b;
+	unsigned int i;
+	int err;
+
+	b = kunit_kzalloc(test, sizeof(*b), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, b);
+
+	err = nft_set_bench_init(b, shape);
+	KUNIT_ASSERT_EQ(test, err, 0);
+
+	ops = __nft_select_set_ops(shape->flags, &b->desc);
+
+	kunit_info(test, "%s, %u elements\n", shape->name, b->nelems);
+
+	for (i = 0; i < nft_set_types_num; i++) {
+		err = nft_set_bench_run(test, b, nft_set_types[i], &res);
+		if (err == -EOPNOTSUPP)
+			continue;
+		if (err < 0) {
+			KUNIT_FAIL(test, "%ps: %d", nft_set_types[i]->ops.lookup,
+				   err);
+			continue;
+		}
+
+		kunit_info(test,
+			   "%-24ps insert %6llu ns hit %5llu ns miss %5llu ns remove %6llu ns memory %8lu KiB (estimate %llu KiB)\n",
+			   res.ops->lookup, res.insert, res.hit, res.miss,
+			   res.remove, res.bytes / 1024,
+			   res.estimate == ~0ULL ? 0 : res.estimate / 1024);
+
+		if (!best.ops || res.hit + res.miss < best.hit + best.miss)
+			best = res;
+		if (res.ops == ops)
+			picked = res;
+	}
+
+	nft_set_bench_fini(b);
+
+	if (IS_ERR(ops) || !picked.ops || !best.ops) {
+		kunit_info(test, "no backend selected\n");
+		return;
+	}
+
+	if (picked.ops == best.ops)
+		kunit_info(test, "selected %ps, fastest lookups\n",
+			   picked.ops->lookup);
+	else
+		kunit_info(test, "selected %ps, lookups %llu%% slower than %ps\n",
+			   picked.ops->lookup,
+			   div64_u64((picked.hit + picked.miss) * 100,
+				     best.hit + best.miss ?: 1) - 100,
+			   best.ops->lookup);
+}
+
+KUNIT_ARRAY_PARAM_DESC(nft_set_bench, nft_set_bench_shapes, name);
+
+static struct kunit_case nft_set_bench_cases[] = {
+	KUNIT_CASE_PARAM_ATTR(nft_set_bench_test, nft_set_bench_gen_params,
+			      { .speed = KUNIT_SPEED_SLOW }),
+	{}
+};
+
+static struct kunit_suite nft_set_bench_suite = {
+	.name = "nft_set_bench",
+	.test_cases = nft_set_bench_cases,
+};
+
+kunit_test_suite(nft_set_bench_suite);
@@ -8,13 +8,17 @@
 #include <linux/module.h>
 #include <linux/list.h>
 #include <linux/netlink.h>
+#include <linux/jhash.h>
+#include <linux/rhashtable.h>
 #include <linux/netfilter.h>
 #include <linux/netfilter/nf_tables.h>
+#include <linux/unaligned.h>
 #include <net/netfilter/nf_tables_core.h>
 
 struct nft_bitmap_elem {
 	struct nft_elem_priv	priv;
 	struct list_head	head;
+	struct rhlist_head	node;
 	struct nft_set_ext	ext;
 };
 
@@ -42,29 +46,115 @@ struct nft_bitmap_elem {
  *      path has not yet been executed yet, so removal is still pending. On
  *      transaction abortion, the next generation bit is reset to go back to
  *      restore its previous state.
+ *
+ * Keys of three and four bytes are handled by a two level tree: the upper bits
+ * of the key, in network byte order, select a leaf, which is a bitmap for 16
+ * bit keys as above, indexed by the lower 16 bits. Leaves are allocated on the
+ * first insertion into them and kept until the set is destroyed. Elements of
+ * trees are also hashed by key, so that the control plane doesn't walk the
+ * element list to find them back.
  */
 struct nft_bitmap {
 	struct	list_head	list;
+	struct rhltable		index;
 	u16			bitmap_size;
-	u8			bitmap[];
+	union {
+		DECLARE_FLEX_ARRAY(u8, bitmap);
+		DECLARE_FLEX_ARRAY(u8 __rcu *, leaf);
+	};
+};
+
+#define NFT_BITMAP_LEAF_BITS	16
+#define NFT_BITMAP_LEAF_KLEN	(NFT_BITMAP_LEAF_BITS / BITS_PER_BYTE)
+#define NFT_BITMAP_LEAF_MASK	((1U << NFT_BITMAP_LEAF_BITS) - 1)
+
+struct nft_bitmap_cmp_arg {
+	const struct nft_set	*set;
+	const void		*key;
 };
 
-static inline void nft_bitmap_location(const struct nft_set *set,
-				       const void *key,
-				       u32 *idx, u32 *off)
+static u32 nft_bitmap_hash_key(const void *data, u32 len, u32 seed)
 {
-	u32 k;
+	const struct nft_bitmap_cmp_arg *arg = data;
 
-	if (set->klen == 2)
-		k = *(u16 *)key;
-	else
-		k = *(u8 *)key;
+	return jhash(arg->key, len, seed);
+}
+
+static u32 nft_bitmap_hash_obj(const void *data, u32 len, u32 seed)
+{
+	const struct nft_bitmap_elem *be = data;
+
+	return jhash(nft_set_ext_key(&be->ext), len, seed);
+}
+
+static int nft_bitmap_hash_cmp(struct rhashtable_compare_arg *arg,
+			       const void *ptr)
+{
+	const struct nft_bitmap_cmp_arg *x = arg->key;
+	const struct nft_bitmap_elem *be = ptr;
+
+	return memcmp(nft_set_ext_key(&be->ext), x->key, x->set->klen);
+}
+
+static const struct rhashtable_params nft_bitmap_index_params = {
+	.head_offset		= offsetof(struct nft_bitmap_elem, node),
+	.hashfn			= nft_bitmap_hash_key,
+	.obj_hashfn		= nft_bitmap_hash_obj,
+	.obj_cmpfn		= nft_bitmap_hash_cmp,
+	.automatic_shrinking	= true,
+};
+
+static inline u32 nft_bitmap_leaves(u32 klen)
+{
+	return 1U << (klen * BITS_PER_BYTE - NFT_BITMAP_LEAF_BITS);
+}
+
+static inline u32 nft_bitmap_tree_key(const struct nft_set *set,
+				      const void *key)
+{
+	if (set->klen == 3)
+		return get_unaligned_be24(key);
+
+	return get_unaligned_be32(key);
+}
+
+static inline void nft_bitmap_index(u32 k, u32 *idx, u32 *off)
+{
 	k <<= 1;
 
 	*idx = k / BITS_PER_BYTE;
 	*off = k % BITS_PER_BYTE;
 }
 
+/* Return the byte holding the two bits of the element and their offset in
+ * it, from the control plane, or NULL if the key falls in a leaf that was
+ * never allocated.
+ */
+static u8 *nft_bitmap_location(const struct nft_set *set, const void *key,
+			       u32 *off)
+{
+	struct nft_bitmap *priv = nft_set_priv(set);
+	u8 *bitmap = priv->bitmap;
+	u32 k, idx;
+
+	if (set->klen > 2) {
+		k = nft_bitmap_tree_key(set, key);
+		idx = k >> NFT_BITMAP_LEAF_BITS;
+		bitmap = rcu_dereference_protected(priv->leaf[idx], true);
+		if (!bitmap)
+			return NULL;
+		k &= NFT_BITMAP_LEAF_MASK;
+	} else if (set->klen == 2) {
+		k = *(u16 *)key;
+	} else {
+		k = *(u8 *)key;
+	}
+
+	nft_bitmap_index(k, &idx, off);
+
+	return &bitmap[idx];
+}
+
 /* Fetch the two bits that represent the element and check if it is active based
  * on the generation mask.
  */
@@ -80,25 +170,76 @@ bool nft_bitmap_lookup(const struct net *net, const struct nft_set *set,
 {
 	const struct nft_bitmap *priv = nft_set_priv(set);
 	u8 genmask = nft_genmask_cur(net);
-	u32 idx, off;
+	u32 k, idx, off;
+
+	if (set->klen == 2)
+		k = *(u16 *)key;
+	else
+		k = *(u8 *)key;
 
-	nft_bitmap_location(set, key, &idx, &off);
+	nft_bitmap_index(k, &idx, &off);
 
 	return nft_bitmap_active(priv->bitmap, idx, off, genmask);
 }
 
-static struct nft_bitmap_elem *
-nft_bitmap_elem_find(const struct net *net,
-		     const struct nft_set *set, struct nft_bitmap_elem *this,
-		     u8 genmask)
+INDIRECT_CALLABLE_SCOPE
+bool nft_bitmap_tree_lookup(const struct net *net, const struct nft_set *set,
+			    const u32 *key, const struct nft_set_ext **ext)
 {
 	const struct nft_bitmap *priv = nft_set_priv(set);
+	u8 genmask = nft_genmask_cur(net);
+	u32 k, idx, off;
+	const u8 *leaf;
+
+	k = nft_bitmap_tree_key(set, key);
+	leaf = rcu_dereference(priv->leaf[k >> NFT_BITMAP_LEAF_BITS]);
+	if (!leaf)
+		return false;
+
+	nft_bitmap_index(k & NFT_BITMAP_LEAF_MASK, &idx, &off);
+
+	return nft_bitmap_active(leaf, idx, off, genmask);
+}
+
+/* The two bits of a key tell whether an element with this key is active in
+ * either generation, so that the element list is only walked for keys that
+ * are in the set. Trees look their elements up in the index instead.
+ */
+static struct nft_bitmap_elem *
+nft_bitmap_elem_find(const struct net *net, const struct nft_set *set,
+		     const void *key, u8 genmask)
+{
+	struct nft_bitmap *priv = nft_set_priv(set);
+	struct nft_bitmap_cmp_arg arg = {
+		.set	= set,
+		.key	= key,
+	};
 	struct nft_bitmap_elem *be;
+	struct rhlist_head *list;
+	u32 off;
+	u8 *b;
+
+	b = nft_bitmap_location(set, key, &off);
+	if (!b || !nft_bitmap_active(b, 0, off, genmask))
+		return NULL;
+
+	if (set->klen > 2) {
+		rcu_read_lock();
+		list = rhltable_lookup(&priv->index, &arg,
+				       nft_bitmap_index_params);
+		rhl_for_each_entry_rcu(be, list, list, node) {
+			if (nft_set_elem_active(&be->ext, genmask))
+				goto out;
+		}
+		be = NULL;
+out:
+		rcu_read_unlock();
+		return be;
+	}
 
 	list_for_each_entry_rcu(be, &priv->list, head,
 				lockdep_is_held(&nft_pernet(net)->commit_mutex)) {
-		if (memcmp(nft_set_ext_key(&be->ext),
-			   nft_set_ext_key(&this->ext), set->klen) ||
+		if (memcmp(nft_set_ext_key(&be->ext), key, set->klen) ||
 		    !nft_set_elem_active(&be->ext, genmask))
 			continue;
 
@@ -111,18 +252,32 @@ static struct nft_elem_priv *
 nft_bitmap_get(const struct net *net, const struct nft_set *set,
 	       const struct nft_set_elem *elem, unsigned int flags)
 {
-	const struct nft_bitmap *priv = nft_set_priv(set);
-	u8 genmask = nft_genmask_cur(net);
 	struct nft_bitmap_elem *be;
 
-	list_for_each_entry_rcu(be, &priv->list, head) {
-		if (memcmp(nft_set_ext_key(&be->ext), elem->key.val.data, set->klen) ||
-		    !nft_set_elem_active(&be->ext, genmask))
-			continue;
+	be = nft_bitmap_elem_find(net, set, elem->key.val.data,
+				  nft_genmask_cur(net));
+	if (!be)
+		return ERR_PTR(-ENOENT);
 
-		return &be->priv;
-	}
-	return ERR_PTR(-ENOENT);
+	return &be->priv;
+}
+
+static int nft_bitmap_leaf_alloc(const struct nft_set *set, const void *key)
+{
+	struct nft_bitmap *priv = nft_set_priv(set);
+	u32 i = nft_bitmap_tree_key(set, key) >> NFT_BITMAP_LEAF_BITS;
+	u8 *leaf;
+
+	if (rcu_access_pointer(priv->leaf[i]))
+		return 0;
+
+	leaf = kvzalloc(priv->bitmap_size, GFP_KERNEL_ACCOUNT);
+	if (!leaf)
+		return -ENOMEM;
+
+	rcu_assign_pointer(priv->leaf[i], leaf);
+
+	return 0;
 }
 
 static int nft_bitmap_insert(const struct net *net, const struct nft_set *set,
@@ -132,17 +287,31 @@ static int nft_bitmap_insert(const struct net *net, const struct nft_set *set,
 	struct nft_bitmap_elem *new = nft_elem_priv_cast(elem->priv), *be;
 	struct nft_bitmap *priv = nft_set_priv(set);
 	u8 genmask = nft_genmask_next(net);
-	u32 idx, off;
+	u32 off;
+	u8 *b;
+	int err;
 
-	be = nft_bitmap_elem_find(net, set, new, genmask);
+	be = nft_bitmap_elem_find(net, set, nft_set_ext_key(&new->ext),
+				  genmask);
 	if (be) {
 		*elem_priv = &be->priv;
 		return -EEXIST;
 	}
 
-	nft_bitmap_location(set, nft_set_ext_key(&new->ext), &idx, &off);
+	if (set->klen > 2) {
+		err = nft_bitmap_leaf_alloc(set, nft_set_ext_key(&new->ext));
+		if (err)
+			return err;
+
+		err = rhltable_insert(&priv->index, &new->node,
+				      nft_bitmap_index_params);
+		if (err)
+			return err;
+	}
+
+	b = nft_bitmap_location(set, nft_set_ext_key(&new->ext), &off);
 	/* Enter 01 state. */
-	priv->bitmap[idx] |= (genmask << off);
+	*b |= (genmask << off);
 	list_add_tail_rcu(&new->head, &priv->list);
 
 	return 0;
@@ -154,12 +323,16 @@ static void nft_bitmap_remove(const struct net *net, const struct nft_set *set,
 	struct nft_bitmap_elem *be = nft_elem_priv_cast(elem_priv);
 	struct nft_bitmap *priv = nft_set_priv(set);
 	u8 genmask = nft_genmask_next(net);
-	u32 idx, off;
+	u32 off;
+	u8 *b;
 
-	nft_bitmap_location(set, nft_set_ext_key(&be->ext), &idx, &off);
+	b = nft_bitmap_location(set, nft_set_ext_key(&be->ext), &off);
 	/* Enter 00 state. */
-	priv->bitmap[idx] &= ~(genmask << off);
+	*b &= ~(genmask << off);
 	list_del_rcu(&be->head);
+	if (set->klen > 2)
+		rhltable_remove(&priv->index, &be->node,
+				nft_bitmap_index_params);
 }
 
 static void nft_bitmap_activate(const struct net *net,
@@ -167,13 +340,13 @@ static void nft_bitmap_activate(const struct net *net,
 				struct nft_elem_priv *elem_priv)
 {
 	struct nft_bitmap_elem *be = nft_elem_priv_cast(elem_priv);
-	struct nft_bitmap *priv = nft_set_priv(set);
 	u8 genmask = nft_genmask_next(net);
-	u32 idx, off;
+	u32 off;
+	u8 *b;
 
-	nft_bitmap_location(set, nft_set_ext_key(&be->ext), &idx, &off);
+	b = nft_bitmap_location(set, nft_set_ext_key(&be->ext), &off);
 	/* Enter 11 state. */
-	priv->bitmap[idx] |= (genmask << off);
+	*b |= (genmask << off);
 	nft_clear(net, &be->ext);
 }
 
@@ -182,13 +355,13 @@ static void nft_bitmap_flush(const struct net *net,
 			     struct nft_elem_priv *elem_priv)
 {
 	struct nft_bitmap_elem *be = nft_elem_priv_cast(elem_priv);
-	struct nft_bitmap *priv = nft_set_priv(set);
 	u8 genmask = nft_genmask_next(net);
-	u32 idx, off;
+	u32 off;
+	u8 *b;
 
-	nft_bitmap_location(set, nft_set_ext_key(&be->ext), &idx, &off);
+	b = nft_bitmap_location(set, nft_set_ext_key(&be->ext), &off);
 	/* Enter 10 state, similar to deactivation. */
-	priv->bitmap[idx] &= ~(genmask << off);
+	*b &= ~(genmask << off);
 	nft_set_elem_change_active(net, set, &be->ext);
 }
 
@@ -196,19 +369,18 @@ static struct nft_elem_priv *
 nft_bitmap_deactivate(const struct net *net, const struct nft_set *set,
 		      const struct nft_set_elem *elem)
 {
-	struct nft_bitmap_elem *this = nft_elem_priv_cast(elem->priv), *be;
-	struct nft_bitmap *priv = nft_set_priv(set);
 	u8 genmask = nft_genmask_next(net);
-	u32 idx, off;
-
-	nft_bitmap_location(set, elem->key.val.data, &idx, &off);
+	struct nft_bitmap_elem *be;
+	u32 off;
+	u8 *b;
 
-	be = nft_bitmap_elem_find(net, set, this, genmask);
+	be = nft_bitmap_elem_find(net, set, elem->key.val.data, genmask);
 	if (!be)
 		return NULL;
 
+	b = nft_bitmap_location(set, elem->key.val.data, &off);
 	/* Enter 10 state. */
-	priv->bitmap[idx] &= ~(genmask << off);
+	*b &= ~(genmask << off);
 	nft_set_elem_change_active(net, set, &be->ext);
 
 	return &be->priv;
@@ -221,10 +393,18 @@ static void nft_bitmap_walk(const struct nft_ctx *ctx,
 	const struct nft_bitmap *priv = nft_set_priv(set);
 	struct nft_bitmap_elem *be;
 
-	list_for_each_entry_rcu(be, &priv->list, head) {
+	/* carry on from the element the previous walk stopped at */
+	if (nft_set_iter_resume(iter))
+		be = (struct nft_bitmap_elem *)iter->pos;
+	else
+		be = list_entry_rcu(priv->list.next, struct nft_bitmap_elem,
+				    head);
+
+	list_for_each_entry_from_rcu(be, &priv->list, head) {
 		if (iter->count < iter->skip)
 			goto cont;
 
+		iter->pos = (unsigned long)be;
 		iter->err = iter->fn(ctx, set, iter, &be->priv);
 
 		if (iter->err < 0)
@@ -256,18 +436,39 @@ static u64 nft_bitmap_privsize(const struct nlattr * const nla[],
 	return nft_bitmap_total_size(klen);
 }
 
+static inline u64 nft_bitmap_tree_total_size(u32 klen)
+{
+	return sizeof(struct nft_bitmap) +
+	       (u64)nft_bitmap_leaves(klen) * sizeof(u8 *);
+}
+
+static u64 nft_bitmap_tree_privsize(const struct nlattr * const nla[],
+				    const struct nft_set_desc *desc)
+{
+	u32 klen = ntohl(nla_get_be32(nla[NFTA_SET_KEY_LEN]));
+
+	return nft_bitmap_tree_total_size(klen);
+}
+
 static int nft_bitmap_init(const struct nft_set *set,
 			   const struct nft_set_desc *desc,
 			   const struct nlattr * const nla[])
 {
+	struct rhashtable_params params = nft_bitmap_index_params;
 	struct nft_bitmap *priv = nft_set_priv(set);
 
 	BUILD_BUG_ON(offsetof(struct nft_bitmap_elem, priv) != 0);
 
 	INIT_LIST_HEAD(&priv->list);
-	priv->bitmap_size = nft_bitmap_size(set->klen);
+	/* for trees, this is the size of a leaf */
+	priv->bitmap_size = nft_bitmap_size(min_t(u32, set->klen,
+						  NFT_BITMAP_LEAF_KLEN));
+	if (set->klen <= 2)
+		return 0;
 
-	return 0;
+	params.key_len = set->klen;
+
+	return rhltable_init(&priv->index, &params);
 }
 
 static void nft_bitmap_destroy(const struct nft_ctx *ctx,
@@ -275,9 +476,17 @@ static void nft_bitmap_destroy(const struct nft_ctx *ctx,
 {
 	struct nft_bitmap *priv = nft_set_priv(set);
 	struct nft_bitmap_elem *be, *n;
+	u32 i;
 
 	list_for_each_entry_safe(be, n, &priv->list, head)
 		nf_tables_set_elem_destroy(ctx, set, &be->priv);
+
+	if (set->klen <= 2)
+		return;
+
+	rhltable_destroy(&priv->index);
+	for (i = 0; i < nft_bitmap_leaves(set->klen); i++)
+		kvfree(rcu_dereference_protected(priv->leaf[i], true));
 }
 
 static bool nft_bitmap_estimate(const struct nft_set_desc *desc, u32 features,
@@ -296,6 +505,35 @@ static bool nft_bitmap_estimate(const struct nft_set_desc *desc, u32 features,
 	return true;
 }
 
+/* Trees only pay off if leaves are dense, but the key range of the set isn't
+ * known here: ask for at least 256 elements per leaf on average, that is, a
+ * declared size of 65536 elements for 24 bit keys and of 16M elements for
+ * 32 bit keys. Sparser sets go to the hashes.
+ */
+static bool nft_bitmap_tree_estimate(const struct nft_set_desc *desc,
+				     u32 features,
+				     struct nft_set_estimate *est)
+{
+	u64 leaves;
+
+	if (desc->klen != 3 && desc->klen != 4)
+		return false;
+	else if (desc->expr)
+		return false;
+
+	leaves = nft_bitmap_leaves(desc->klen);
+	if (desc->size < leaves * 256)
+		return false;
+
+	est->size   = nft_bitmap_tree_total_size(desc->klen) +
+		      leaves * nft_bitmap_size(NFT_BITMAP_LEAF_KLEN) +
+		      (u64)desc->size * sizeof(struct nft_bitmap_elem);
+	est->lookup = NFT_SET_CLASS_O_1;
+	est->space  = NFT_SET_CLASS_O_1;
+
+	return true;
+}
+
 const struct nft_set_type nft_set_bitmap_type = {
 	.ops		= {
 		.privsize	= nft_bitmap_privsize,
@@ -313,3 +551,21 @@ const struct nft_set_type nft_set_bitmap_type = {
 		.get		= nft_bitmap_get,
 	},
 };
+
+const struct nft_set_type nft_set_bitmap_tree_type = {
+	.ops		= {
+		.privsize	= nft_bitmap_tree_privsize,
+		.elemsize	= offsetof(struct nft_bitmap_elem, ext),
+		.estimate	= nft_bitmap_tree_estimate,
+		.init		= nft_bitmap_init,
+		.destroy	= nft_bitmap_destroy,
+		.insert		= nft_bitmap_insert,
+		.remove		= nft_bitmap_remove,
+		.deactivate	= nft_bitmap_deactivate,
+		.flush		= nft_bitmap_flush,
+		.activate	= nft_bitmap_activate,
+		.lookup		= nft_bitmap_tree_lookup,
+		.walk		= nft_bitmap_walk,
+		.get		= nft_bitmap_get,
+	},
+};
@@ -21,10 +21,31 @@
 /* We target a hash table size of 4, element hint is 75% of final size */
 #define NFT_RHASH_ELEMENT_HINT 3
 
+/* Garbage collection splits the buckets to scan between up to
+ * NFT_RHASH_GC_MAX_WORKERS, with at least NFT_RHASH_GC_CHUNK for each.
+ */
+#define NFT_RHASH_GC_MAX_WORKERS	16
+#define NFT_RHASH_GC_CHUNK		4096
+
+struct nft_rhash;
+
+struct nft_rhash_gc_worker {
+	struct work_struct		work;
+	struct nft_rhash		*priv;
+	u32				start;
+	u32				end;
+	u32				gc_seq;
+};
+
 struct nft_rhash {
 	struct rhashtable		ht;
 	struct delayed_work		gc_work;
 	u32				wq_gc_seq;
+	/* first bucket of the next run, with nft_set_gc_budget set */
+	u32				gc_cursor;
+	/* the gc work takes the first chunk, these the others */
+	unsigned int			gc_nr_workers;
+	struct nft_rhash_gc_worker	*gc_workers;
 };
 
 struct nft_rhash_elem {
@@ -317,16 +338,113 @@ static bool nft_rhash_expr_needs_gc_run(const struct nft_set *set,
 	return false;
 }
 
+/* Scan buckets [start, end) of the current table.  Elements moved by a
+ * concurrent resize might be missed, the next run finds them.
+ */
+static void nft_rhash_gc_scan(struct nft_rhash *priv, u32 start, u32 end,
+			      u32 gc_seq, bool catchall)
+{
+	struct nft_set *set = nft_set_container_of(priv);
+	struct net *net = read_pnet(&set->net);
+	struct nftables_pernet *nft_net = nft_pernet(net);
+	u32 wq_gc_seq = READ_ONCE(priv->wq_gc_seq);
+	const struct bucket_table *tbl;
+	struct nft_rhash_elem *he;
+	struct rhash_head *pos;
+	struct nft_trans_gc *gc;
+	u32 i, old;
+
+	gc = nft_trans_gc_alloc(set, gc_seq, GFP_KERNEL);
+	if (!gc)
+		return;
+
+	rcu_read_lock();
+	tbl = rht_dereference_rcu(priv->ht.tbl, &priv->ht);
+
+	for (i = start; i < end && i < tbl->size; i++) {
+		rht_for_each_entry_rcu(he, pos, tbl, i, node) {
+			/* Ruleset has been updated, try later. */
+			if (READ_ONCE(nft_net->gc_seq) != gc_seq)
+				goto abort;
+
+			/* Already queued in this gc run? Then, skip this
+			 * element. In case of (unlikely) sequence wraparound
+			 * and stale element wq_gc_seq, next gc run will just
+			 * find this expired element.
+			 */
+			old = READ_ONCE(he->wq_gc_seq);
+			if (old == wq_gc_seq)
+				continue;
+
+			if (nft_set_elem_is_dead(&he->ext))
+				goto dead_elem;
+
+			if (nft_set_ext_exists(&he->ext, NFT_SET_EXT_EXPRESSIONS) &&
+			    nft_rhash_expr_needs_gc_run(set, &he->ext))
+				goto needs_gc_run;
+
+			if (!nft_set_elem_expired(&he->ext))
+				continue;
+needs_gc_run:
+			nft_set_elem_dead(&he->ext);
+dead_elem:
+			/* Annotate gc sequence for this attempt.  Workers
+			 * scanning a table being resized can both meet an
+			 * element moved between their buckets, only the one
+			 * claiming it queues it.
+			 */
+			if (cmpxchg(&he->wq_gc_seq, old, wq_gc_seq) != old)
+				continue;
+
+			gc = nft_trans_gc_queue_async(gc, gc_seq, GFP_ATOMIC);
+			if (!gc)
+				goto out;
+
+			nft_trans_gc_elem_add(gc, he);
+		}
+
+		if (need_resched()) {
+			rcu_read_unlock();
+			cond_resched();
+			rcu_read_lock();
+
+			/* resized, leave the rest to the next run */
+			if (tbl != rht_dereference_rcu(priv->ht.tbl, &priv->ht))
+				goto out;
+		}
+	}
+
+	/* catchall list iteration requires rcu read side lock. */
+	if (catchall)
+		gc = nft_trans_gc_catchall_async(gc, gc_seq);
+out:
+	rcu_read_unlock();
+
+	if (gc)
+		nft_trans_gc_queue_async_done(gc);
+
+	return;
+abort:
+	rcu_read_unlock();
+	nft_trans_gc_destroy(gc);
+}
+
+static void nft_rhash_gc_worker(struct work_struct *work)
+{
+	struct nft_rhash_gc_worker *w;
+
+	w = container_of(work, struct nft_rhash_gc_worker, work);
+	nft_rhash_gc_scan(w->priv, w->start, w->end, w->gc_seq, false);
+}
+
 static void nft_rhash_gc(struct work_struct *work)
 {
 	struct nftables_pernet *nft_net;
-	struct nft_set *set;
-	struct nft_rhash_elem *he;
+	u32 gc_seq, size, start, end, chunk;
+	unsigned int budget, n, i;
 	struct nft_rhash *priv;
-	struct rhashtable_iter hti;
-	struct nft_trans_gc *gc;
+	struct nft_set *set;
 	struct net *net;
-	u32 gc_seq;
 
 	priv = container_of(work, struct nft_rhash, gc_work.work);
 	set  = nft_set_container_of(priv);
@@ -337,70 +455,41 @@ static void nft_rhash_gc(struct work_struct *work)
 	if (nft_set_gc_is_pending(set))
 		goto done;
 
-	gc = nft_trans_gc_alloc(set, gc_seq, GFP_KERNEL);
-	if (!gc)
-		goto done;
-
 	/* Elements never collected use a zero gc worker sequence number. */
 	if (unlikely(++priv->wq_gc_seq == 0))
 		priv->wq_gc_seq++;
 
-	rhashtable_walk_enter(&priv->ht, &hti);
-	rhashtable_walk_start(&hti);
-
-	while ((he = rhashtable_walk_next(&hti))) {
-		if (IS_ERR(he)) {
-			nft_trans_gc_destroy(gc);
-			gc = NULL;
-			goto try_later;
-		}
-
-		/* Ruleset has been updated, try later. */
-		if (READ_ONCE(nft_net->gc_seq) != gc_seq) {
-			nft_trans_gc_destroy(gc);
-			gc = NULL;
-			goto try_later;
-		}
-
-		/* rhashtable walk is unstable, already seen in this gc run?
-		 * Then, skip this element. In case of (unlikely) sequence
-		 * wraparound and stale element wq_gc_seq, next gc run will
-		 * just find this expired element.
-		 */
-		if (he->wq_gc_seq == priv->wq_gc_seq)
-			continue;
+	rcu_read_lock();
+	size = rht_dereference_rcu(priv->ht.tbl, &priv->ht)->size;
+	rcu_read_unlock();
 
-		if (nft_set_elem_is_dead(&he->ext))
-			goto dead_elem;
+	budget = READ_ONCE(nft_set_gc_budget);
+	if (!budget || budget >= size) {
+		start = 0;
+		end = size;
+	} else {
+		start = priv->gc_cursor < size ? priv->gc_cursor : 0;
+		end = min(start + budget, size);
+	}
+	priv->gc_cursor = end < size ? end : 0;
 
-		if (nft_set_ext_exists(&he->ext, NFT_SET_EXT_EXPRESSIONS) &&
-		    nft_rhash_expr_needs_gc_run(set, &he->ext))
-			goto needs_gc_run;
+	n = clamp(DIV_ROUND_UP(end - start, NFT_RHASH_GC_CHUNK),
+		  1U, priv->gc_nr_workers + 1);
+	chunk = DIV_ROUND_UP(end - start, n);
 
-		if (!nft_set_elem_expired(&he->ext))
-			continue;
-needs_gc_run:
-		nft_set_elem_dead(&he->ext);
-dead_elem:
-		gc = nft_trans_gc_queue_async(gc, gc_seq, GFP_ATOMIC);
-		if (!gc)
-			goto try_later;
+	for (i = 1; i < n; i++) {
+		struct nft_rhash_gc_worker *w = &priv->gc_workers[i - 1];
 
-		/* annotate gc sequence for this attempt. */
-		he->wq_gc_seq = priv->wq_gc_seq;
-		nft_trans_gc_elem_add(gc, he);
+		w->start = start + i * chunk;
+		w->end = min(w->start + chunk, end);
+		w->gc_seq = gc_seq;
+		queue_work(system_unbound_wq, &w->work);
 	}
 
-	gc = nft_trans_gc_catchall_async(gc, gc_seq);
-
-try_later:
-	/* catchall list iteration requires rcu read side lock. */
-	rhashtable_walk_stop(&hti);
-	rhashtable_walk_exit(&hti);
-
-	if (gc)
-		nft_trans_gc_queue_async_done(gc);
+	nft_rhash_gc_scan(priv, start, min(start + chunk, end), gc_seq, true);
 
+	for (i = 1; i < n; i++)
+		flush_work(&priv->gc_workers[i - 1].work);
 done:
 	queue_delayed_work(system_power_efficient_wq, &priv->gc_work,
 			   nft_set_gc_interval(set));
@@ -412,6 +501,29 @@ static u64 nft_rhash_privsize(const struct nlattr * const nla[],
 	return sizeof(struct nft_rhash);
 }
 
+static int nft_rhash_gc_workers_init(struct nft_rhash *priv)
+{
+	unsigned int i;
+
+	priv->gc_nr_workers = min_t(unsigned int, num_possible_cpus(),
+				    NFT_RHASH_GC_MAX_WORKERS) - 1;
+	if (!priv->gc_nr_workers)
+		return 0;
+
+	priv->gc_workers = kcalloc(priv->gc_nr_workers,
+				   sizeof(*priv->gc_workers),
+				   GFP_KERNEL_ACCOUNT);
+	if (!priv->gc_workers)
+		return -ENOMEM;
+
+	for (i = 0; i < priv->gc_nr_workers; i++) {
+		INIT_WORK(&priv->gc_workers[i].work, nft_rhash_gc_worker);
+		priv->gc_workers[i].priv = priv;
+	}
+
+	return 0;
+}
+
 static void nft_rhash_gc_init(const struct nft_set *set)
 {
 	struct nft_rhash *priv = nft_set_priv(set);
@@ -438,8 +550,15 @@ static int nft_rhash_init(const struct nft_set *set,
 		return err;
 
 	INIT_DEFERRABLE_WORK(&priv->gc_work, nft_rhash_gc);
-	if (set->flags & (NFT_SET_TIMEOUT | NFT_SET_EVAL))
+	if (set->flags & (NFT_SET_TIMEOUT | NFT_SET_EVAL)) {
+		err = nft_rhash_gc_workers_init(priv);
+		if (err < 0) {
+			rhashtable_destroy(&priv->ht);
+			return err;
+		}
+
 		nft_rhash_gc_init(set);
+	}
 
 	return 0;
 }
@@ -467,6 +586,7 @@ static void nft_rhash_destroy(const struct nft_ctx *ctx,
 	};
 
 	cancel_delayed_work_sync(&priv->gc_work);
+	kfree(priv->gc_workers);
 	rhashtable_free_and_destroy(&priv->ht, nft_rhash_elem_destroy,
 				    (void *)&rhash_ctx);
 }
@@ -494,18 +614,66 @@ static bool nft_rhash_estimate(const struct nft_set_desc *desc, u32 features,
 	return true;
 }
 
-struct nft_hash {
-	u32				seed;
+static bool nft_hash_transaction_mutex_held(const struct nft_set *set)
+{
+#ifdef CONFIG_PROVE_LOCKING
+	const struct net *net = read_pnet(&set->net);
+
+	return lockdep_is_held(&nft_pernet(net)->commit_mutex);
+#else
+	return true;
+#endif
+}
+
+/* Grow the table on commit once chains are this long on average */
+#define NFT_HASH_LOAD_MAX	2
+
+/* Elements are linked in the table through node[idx]: the table is rebuilt
+ * through the other node, so that lookups still walking the previous table
+ * aren't disturbed.
+ */
+struct nft_hash_table {
+	struct rcu_head			rcu;
 	u32				buckets;
+	u8				idx;
 	struct hlist_head		table[];
 };
 
+struct nft_hash {
+	u32				seed;
+	/* grace period after which node[!idx] is unused */
+	unsigned long			rebuild_gp;
+	struct nft_hash_table __rcu	*table;
+};
+
 struct nft_hash_elem {
 	struct nft_elem_priv		priv;
-	struct hlist_node		node;
+	struct hlist_node		node[2];
 	struct nft_set_ext		ext;
 };
 
+static struct nft_hash_table *nft_hash_table(const struct nft_set *set)
+{
+	struct nft_hash *priv = nft_set_priv(set);
+
+	return rcu_dereference_check(priv->table,
+				     nft_hash_transaction_mutex_held(set));
+}
+
+static struct nft_hash_table *nft_hash_table_alloc(u32 buckets, u8 idx)
+{
+	struct nft_hash_table *t;
+
+	t = kvzalloc(struct_size(t, table, buckets), GFP_KERNEL_ACCOUNT);
+	if (!t)
+		return NULL;
+
+	t->buckets = buckets;
+	t->idx = idx;
+
+	return t;
+}
+
 INDIRECT_CALLABLE_SCOPE
 bool nft_hash_lookup(const struct net *net, const struct nft_set *set,
 		     const u32 *key, const struct nft_set_ext **ext)
@@ -513,11 +681,13 @@ bool nft_hash_lookup(const struct net *net, const struct nft_set *set,
 	struct nft_hash *priv = nft_set_priv(set);
 	u8 genmask = nft_genmask_cur(net);
 	const struct nft_hash_elem *he;
+	const struct nft_hash_table *t;
 	u32 hash;
 
+	t = rcu_dereference(priv->table);
 	hash = jhash(key, set->klen, priv->seed);
-	hash = reciprocal_scale(hash, priv->buckets);
-	hlist_for_each_entry_rcu(he, &priv->table[hash], node) {
+	hash = reciprocal_scale(hash, t->buckets);
+	hlist_for_each_entry_rcu(he, &t->table[hash], node[t->idx]) {
 		if (!memcmp(nft_set_ext_key(&he->ext), key, set->klen) &&
 		    nft_set_elem_active(&he->ext, genmask)) {
 			*ext = &he->ext;
@@ -532,13 +702,14 @@ nft_hash_get(const struct net *net, const struct nft_set *set,
 	     const struct nft_set_elem *elem, unsigned int flags)
 {
 	struct nft_hash *priv = nft_set_priv(set);
+	struct nft_hash_table *t = nft_hash_table(set);
 	u8 genmask = nft_genmask_cur(net);
 	struct nft_hash_elem *he;
 	u32 hash;
 
 	hash = jhash(elem->key.val.data, set->klen, priv->seed);
-	hash = reciprocal_scale(hash, priv->buckets);
-	hlist_for_each_entry_rcu(he, &priv->table[hash], node) {
+	hash = reciprocal_scale(hash, t->buckets);
+	hlist_for_each_entry_rcu(he, &t->table[hash], node[t->idx]) {
 		if (!memcmp(nft_set_ext_key(&he->ext), elem->key.val.data, set->klen) &&
 		    nft_set_elem_active(&he->ext, genmask))
 			return &he->priv;
@@ -554,12 +725,14 @@ bool nft_hash_lookup_fast(const struct net *net,
 	struct nft_hash *priv = nft_set_priv(set);
 	u8 genmask = nft_genmask_cur(net);
 	const struct nft_hash_elem *he;
+	const struct nft_hash_table *t;
 	u32 hash, k1, k2;
 
+	t = rcu_dereference(priv->table);
 	k1 = *key;
 	hash = jhash_1word(k1, priv->seed);
-	hash = reciprocal_scale(hash, priv->buckets);
-	hlist_for_each_entry_rcu(he, &priv->table[hash], node) {
+	hash = reciprocal_scale(hash, t->buckets);
+	hlist_for_each_entry_rcu(he, &t->table[hash], node[t->idx]) {
 		k2 = *(u32 *)nft_set_ext_key(&he->ext)->data;
 		if (k1 == k2 &&
 		    nft_set_elem_active(&he->ext, genmask)) {
@@ -571,6 +744,7 @@ bool nft_hash_lookup_fast(const struct net *net,
 }
 
 static u32 nft_jhash(const struct nft_set *set, const struct nft_hash *priv,
+		     const struct nft_hash_table *t,
 		     const struct nft_set_ext *ext)
 {
 	const struct nft_data *key = nft_set_ext_key(ext);
@@ -582,7 +756,7 @@ static u32 nft_jhash(const struct nft_set *set, const struct nft_hash *priv,
 	} else {
 		hash = jhash(key, set->klen, priv->seed);
 	}
-	hash = reciprocal_scale(hash, priv->buckets);
+	hash = reciprocal_scale(hash, t->buckets);
 
 	return hash;
 }
@@ -593,11 +767,12 @@ static int nft_hash_insert(const struct net *net, const struct nft_set *set,
 {
 	struct nft_hash_elem *this = nft_elem_priv_cast(elem->priv), *he;
 	struct nft_hash *priv = nft_set_priv(set);
+	struct nft_hash_table *t = nft_hash_table(set);
 	u8 genmask = nft_genmask_next(net);
 	u32 hash;
 
-	hash = nft_jhash(set, priv, &this->ext);
-	hlist_for_each_entry(he, &priv->table[hash], node) {
+	hash = nft_jhash(set, priv, t, &this->ext);
+	hlist_for_each_entry(he, &t->table[hash], node[t->idx]) {
 		if (!memcmp(nft_set_ext_key(&this->ext),
 			    nft_set_ext_key(&he->ext), set->klen) &&
 		    nft_set_elem_active(&he->ext, genmask)) {
@@ -605,7 +780,7 @@ static int nft_hash_insert(const struct net *net, const struct nft_set *set,
 			return -EEXIST;
 		}
 	}
-	hlist_add_head_rcu(&this->node, &priv->table[hash]);
+	hlist_add_head_rcu(&this->node[t->idx], &t->table[hash]);
 	return 0;
 }
 
@@ -632,11 +807,12 @@ nft_hash_deactivate(const struct net *net, const struct nft_set *set,
 {
 	struct nft_hash_elem *this = nft_elem_priv_cast(elem->priv), *he;
 	struct nft_hash *priv = nft_set_priv(set);
+	struct nft_hash_table *t = nft_hash_table(set);
 	u8 genmask = nft_genmask_next(net);
 	u32 hash;
 
-	hash = nft_jhash(set, priv, &this->ext);
-	hlist_for_each_entry(he, &priv->table[hash], node) {
+	hash = nft_jhash(set, priv, t, &this->ext);
+	hlist_for_each_entry(he, &t->table[hash], node[t->idx]) {
 		if (!memcmp(nft_set_ext_key(&he->ext), &elem->key.val,
 			    set->klen) &&
 		    nft_set_elem_active(&he->ext, genmask)) {
@@ -652,23 +828,86 @@ static void nft_hash_remove(const struct net *net,
 			    struct nft_elem_priv *elem_priv)
 {
 	struct nft_hash_elem *he = nft_elem_priv_cast(elem_priv);
+	struct nft_hash_table *t = nft_hash_table(set);
+
+	hlist_del_rcu(&he->node[t->idx]);
+}
+
+/* The table is sized after the size of the set when it's created, but the
+ * size can be raised later on: rebuild the table once chains get long, by
+ * linking elements through their other node into a larger one.  Lookups
+ * switch to the new table as they start, and another rebuild has to wait
+ * until none of them can be walking the old one anymore.
+ */
+static void nft_hash_commit(struct nft_set *set)
+{
+	struct nft_hash *priv = nft_set_priv(set);
+	struct nft_hash_table *old = nft_hash_table(set), *t;
+	u32 nelems = atomic_read(&set->nelems);
+	struct nft_hash_elem *he;
+	u32 i, buckets;
+
+	if (nelems <= (u64)old->buckets * NFT_HASH_LOAD_MAX ||
+	    old->buckets == NFT_MAX_BUCKETS)
+		return;
+
+	if (!poll_state_synchronize_rcu(priv->rebuild_gp))
+		return;
+
+	buckets = nft_hash_buckets(nelems);
+	t = nft_hash_table_alloc(buckets, !old->idx);
+	if (!t)
+		return;
 
-	hlist_del_rcu(&he->node);
+	for (i = 0; i < old->buckets; i++) {
+		hlist_for_each_entry(he, &old->table[i], node[old->idx]) {
+			hlist_add_head_rcu(&he->node[t->idx],
+					   &t->table[nft_jhash(set, priv, t,
+							       &he->ext)]);
+		}
+		cond_resched();
+	}
+
+	rcu_assign_pointer(priv->table, t);
+	priv->rebuild_gp = get_state_synchronize_rcu();
+	kvfree_rcu(old, rcu);
 }
 
+static struct nft_hash_elem *nft_hash_first(const struct nft_hash_table *t,
+					     u32 i)
+{
+	struct hlist_node *first;
+
+	first = rcu_dereference_raw(hlist_first_rcu(&t->table[i]));
+
+	return hlist_entry_safe(first, struct nft_hash_elem, node[t->idx]);
+}
+
+/* The position is the element itself, it stays in the same bucket of the
+ * same table until the next commit.
+ */
 static void nft_hash_walk(const struct nft_ctx *ctx, struct nft_set *set,
 			  struct nft_set_iter *iter)
 {
+	struct nft_hash_table *t = nft_hash_table(set);
 	struct nft_hash *priv = nft_set_priv(set);
-	struct nft_hash_elem *he;
-	int i;
+	struct nft_hash_elem *he = NULL;
+	u32 i = 0;
+
+	if (nft_set_iter_resume(iter)) {
+		he = (struct nft_hash_elem *)iter->pos;
+		i = nft_jhash(set, priv, t, &he->ext);
+	}
 
-	for (i = 0; i < priv->buckets; i++) {
-		hlist_for_each_entry_rcu(he, &priv->table[i], node,
-					 lockdep_is_held(&nft_pernet(ctx->net)->commit_mutex)) {
+	for (; i < t->buckets; i++) {
+		if (!he)
+			he = nft_hash_first(t, i);
+
+		hlist_for_each_entry_from_rcu(he, node[t->idx]) {
 			if (iter->count < iter->skip)
 				goto cont;
 
+			iter->pos = (unsigned long)he;
 			iter->err = iter->fn(ctx, set, iter, &he->priv);
 			if (iter->err < 0)
 				return;
@@ -681,8 +920,7 @@ static void nft_hash_walk(const struct nft_ctx *ctx, struct nft_set *set,
 static u64 nft_hash_privsize(const struct nlattr * const nla[],
 			     const struct nft_set_desc *desc)
 {
-	return sizeof(struct nft_hash) +
-	       (u64)nft_hash_buckets(desc->size) * sizeof(struct hlist_head);
+	return sizeof(struct nft_hash);
 }
 
 static int nft_hash_init(const struct nft_set *set,
@@ -690,9 +928,15 @@ static int nft_hash_init(const struct nft_set *set,
 			 const struct nlattr * const tb[])
 {
 	struct nft_hash *priv = nft_set_priv(set);
+	struct nft_hash_table *t;
+
+	t = nft_hash_table_alloc(nft_hash_buckets(desc->size), 0);
+	if (!t)
+		return -ENOMEM;
 
-	priv->buckets = nft_hash_buckets(desc->size);
 	get_random_bytes(&priv->seed, sizeof(priv->seed));
+	priv->rebuild_gp = get_completed_synchronize_rcu();
+	RCU_INIT_POINTER(priv->table, t);
 
 	return 0;
 }
@@ -701,16 +945,21 @@ static void nft_hash_destroy(const struct nft_ctx *ctx,
 			     const struct nft_set *set)
 {
 	struct nft_hash *priv = nft_set_priv(set);
+	struct nft_hash_table *t;
 	struct nft_hash_elem *he;
 	struct hlist_node *next;
 	int i;
 
-	for (i = 0; i < priv->buckets; i++) {
-		hlist_for_each_entry_safe(he, next, &priv->table[i], node) {
-			hlist_del_rcu(&he->node);
+	t = rcu_dereference_protected(priv->table, true);
+	for (i = 0; i < t->buckets; i++) {
+		hlist_for_each_entry_safe(he, next, &t->table[i], node[t->idx]) {
+			hlist_del_rcu(&he->node[t->idx]);
 			nf_tables_set_elem_destroy(ctx, set, &he->priv);
 		}
+		cond_resched();
 	}
+
+	kvfree(t);
 }
 
 static bool nft_hash_estimate(const struct nft_set_desc *desc, u32 features,
@@ -722,7 +971,7 @@ static bool nft_hash_estimate(const struct nft_set_desc *desc, u32 features,
 	if (desc->klen == 4)
 		return false;
 
-	est->size   = sizeof(struct nft_hash) +
+	est->size   = sizeof(struct nft_hash) + sizeof(struct nft_hash_table) +
 		      (u64)nft_hash_buckets(desc->size) * sizeof(struct hlist_head) +
 		      (u64)desc->size * sizeof(struct nft_hash_elem);
 	est->lookup = NFT_SET_CLASS_O_1;
@@ -740,7 +989,7 @@ static bool nft_hash_fast_estimate(const struct nft_set_desc *desc, u32 features
 	if (desc->klen != 4)
 		return false;
 
-	est->size   = sizeof(struct nft_hash) +
+	est->size   = sizeof(struct nft_hash) + sizeof(struct nft_hash_table) +
 		      (u64)nft_hash_buckets(desc->size) * sizeof(struct hlist_head) +
 		      (u64)desc->size * sizeof(struct nft_hash_elem);
 	est->lookup = NFT_SET_CLASS_O_1;
@@ -749,6 +998,481 @@ static bool nft_hash_fast_estimate(const struct nft_set_desc *desc, u32 features
 	return true;
 }
 
+/* Open addressing table for sets with a size: a group of slots fills a
+ * cache line, with the element pointers and a 7-bit fingerprint of the hash
+ * of each key, the top byte of the tags is unused.  A lookup usually reads
+ * a single group and the matching element only.
+ *
+ * Removal leaves a tombstone, unless the group has an empty slot: no probe
+ * sequence went past that group then.  Tombstones are cleared and the table
+ * grows by building a new one, which replaces the old one via RCU.
+ */
+#define NFT_OHASH_SLOTS		7
+#define NFT_OHASH_EMPTY		0x80
+#define NFT_OHASH_DELETED	0xfe
+
+#define NFT_OHASH_TAGS_EMPTY	0xfe80808080808080ULL
+#define NFT_OHASH_LO		0x0001010101010101ULL
+#define NFT_OHASH_HI		0x0080808080808080ULL
+
+struct nft_ohash_elem {
+	struct nft_elem_priv		priv;
+	struct nft_set_ext		ext;
+};
+
+struct nft_ohash_group {
+	u64				tags;
+	struct nft_ohash_elem __rcu	*elems[NFT_OHASH_SLOTS];
+};
+
+struct nft_ohash_table {
+	struct rcu_head			rcu;
+	u32				mask;
+	/* bumped on rebuild, elements change slots */
+	u32				gen;
+	struct nft_ohash_group		*groups;
+};
+
+struct nft_ohash {
+	u32				seed;
+	u32				size;
+	/* slots holding an element, slots not empty */
+	u32				nelems;
+	u32				used;
+	struct nft_ohash_table __rcu	*table;
+};
+
+static struct nft_ohash_table *nft_ohash_table(const struct nft_set *set)
+{
+	struct nft_ohash *priv = nft_set_priv(set);
+
+	return rcu_dereference_check(priv->table,
+				     nft_hash_transaction_mutex_held(set));
+}
+
+/* Target a 75% load after a rebuild, the table is full at 7/8 */
+static u32 nft_ohash_groups(u64 nelems)
+{
+	u64 val = DIV_ROUND_UP_ULL(div_u64(nelems * 4, 3), NFT_OHASH_SLOTS);
+
+	if (val >= NFT_MAX_BUCKETS)
+		return NFT_MAX_BUCKETS;
+
+	return roundup_pow_of_two(max_t(u64, val, 1));
+}
+
+static bool nft_ohash_full(const struct nft_ohash_table *table, u32 used)
+{
+	return (u64)used * 8 > ((u64)table->mask + 1) * NFT_OHASH_SLOTS * 7;
+}
+
+static u32 nft_ohash_hash(const struct nft_set *set,
+			  const struct nft_ohash *priv, const void *key)
+{
+	if (set->klen == 4)
+		return jhash_1word(*(u32 *)key, priv->seed);
+
+	return jhash(key, set->klen, priv->seed);
+}
+
+/* A slot following a matching one might be reported too, keys are compared
+ * anyway.
+ */
+static u64 nft_ohash_match(u64 tags, u8 tag)
+{
+	u64 x = tags ^ (NFT_OHASH_LO * tag);
+
+	return (x - NFT_OHASH_LO) & ~x & NFT_OHASH_HI;
+}
+
+static u64 nft_ohash_match_empty(u64 tags)
+{
+	return tags & ~(tags << 6) & NFT_OHASH_HI;
+}
+
+static u64 nft_ohash_match_free(u64 tags)
+{
+	return tags & NFT_OHASH_HI;
+}
+
+static void nft_ohash_set_tag(struct nft_ohash_group *grp, unsigned int slot,
+			      u8 tag)
+{
+	u64 tags = grp->tags & ~(0xffULL << (slot * BITS_PER_BYTE));
+
+	WRITE_ONCE(grp->tags, tags | (u64)tag << (slot * BITS_PER_BYTE));
+}
+
+/* Called under rcu_read_lock() or with the transaction mutex held */
+static struct nft_ohash_elem *
+nft_ohash_find(const struct nft_set *set, const struct nft_ohash *priv,
+	       const struct nft_ohash_table *table, const void *key,
+	       u8 genmask)
+{
+	u32 hash = nft_ohash_hash(set, priv, key);
+	u8 tag = hash >> 25;
+	u32 i = hash, probe;
+
+	for (probe = 0; probe <= table->mask; probe++) {
+		const struct nft_ohash_group *grp;
+		u64 tags, match;
+
+		i = (i + probe) & table->mask;
+		grp = &table->groups[i];
+		tags = READ_ONCE(grp->tags);
+
+		for (match = nft_ohash_match(tags, tag); match;
+		     match &= match - 1) {
+			struct nft_ohash_elem *he;
+
+			he = rcu_dereference_raw(grp->elems[__ffs64(match) /
+							    BITS_PER_BYTE]);
+			if (he &&
+			    !memcmp(nft_set_ext_key(&he->ext), key, set->klen) &&
+			    nft_set_elem_active(&he->ext, genmask))
+				return he;
+		}
+
+		if (nft_ohash_match_empty(tags))
+			break;
+	}
+
+	return NULL;
+}
+
+/* Returns true if an empty slot was taken, false for a tombstone */
+static bool nft_ohash_add(const struct nft_set *set,
+			  const struct nft_ohash *priv,
+			  struct nft_ohash_table *table,
+			  struct nft_ohash_elem *he)
+{
+	u32 hash = nft_ohash_hash(set, priv, nft_set_ext_key(&he->ext));
+	u8 tag = hash >> 25;
+	u32 i = hash, probe;
+
+	for (probe = 0; probe <= table->mask; probe++) {
+		struct nft_ohash_group *grp;
+		unsigned int slot;
+		u64 free;
+		bool empty;
+
+		i = (i + probe) & table->mask;
+		grp = &table->groups[i];
+
+		free = nft_ohash_match_free(grp->tags);
+		if (!free)
+			continue;
+
+		slot = __ffs64(free) / BITS_PER_BYTE;
+		empty = ((grp->tags >> (slot * BITS_PER_BYTE)) & 0xff) ==
+			NFT_OHASH_EMPTY;
+
+		rcu_assign_pointer(grp->elems[slot], he);
+		nft_ohash_set_tag(grp, slot, tag);
+
+		return empty;
+	}
+
+	/* never full, see nft_ohash_full() */
+	WARN_ON_ONCE(1);
+	return false;
+}
+
+static struct nft_ohash_table *nft_ohash_table_alloc(u32 groups)
+{
+	struct nft_ohash_table *table;
+	u32 i;
+
+	table = kmalloc(sizeof(*table), GFP_KERNEL_ACCOUNT);
+	if (!table)
+		return NULL;
+
+	table->groups = kvcalloc(groups, sizeof(*table->groups),
+				 GFP_KERNEL_ACCOUNT);
+	if (!table->groups) {
+		kfree(table);
+		return NULL;
+	}
+
+	for (i = 0; i < groups; i++)
+		table->groups[i].tags = NFT_OHASH_TAGS_EMPTY;
+
+	table->mask = groups - 1;
+	table->gen = 0;
+
+	return table;
+}
+
+static void nft_ohash_table_free(struct nft_ohash_table *table)
+{
+	kvfree(table->groups);
+	kfree(table);
+}
+
+static void nft_ohash_table_free_rcu(struct rcu_head *rcu)
+{
+	nft_ohash_table_free(container_of(rcu, struct nft_ohash_table, rcu));
+}
+
+static int nft_ohash_rebuild(const struct nft_set *set, u32 nelems)
+{
+	struct nft_ohash *priv = nft_set_priv(set);
+	struct nft_ohash_table *old, *table;
+	u32 i, j;
+
+	table = nft_ohash_table_alloc(nft_ohash_groups(max(nelems, priv->size)));
+	if (!table)
+		return -ENOMEM;
+
+	old = nft_ohash_table(set);
+	table->gen = old->gen + 1;
+	for (i = 0; i <= old->mask; i++) {
+		for (j = 0; j < NFT_OHASH_SLOTS; j++) {
+			struct nft_ohash_elem *he;
+
+			he = rcu_dereference_protected(old->groups[i].elems[j],
+						       true);
+			if (he)
+				nft_ohash_add(set, priv, table, he);
+		}
+	}
+
+	priv->used = priv->nelems;
+	rcu_assign_pointer(priv->table, table);
+	call_rcu(&old->rcu, nft_ohash_table_free_rcu);
+
+	return 0;
+}
+
+INDIRECT_CALLABLE_SCOPE
+bool nft_ohash_lookup(const struct net *net, const struct nft_set *set,
+		      const u32 *key, const struct nft_set_ext **ext)
+{
+	struct nft_ohash *priv = nft_set_priv(set);
+	const struct nft_ohash_elem *he;
+
+	he = nft_ohash_find(set, priv, rcu_dereference(priv->table), key,
+			    nft_genmask_cur(net));
+	if (!he)
+		return false;
+
+	*ext = &he->ext;
+	return true;
+}
+
+static struct nft_elem_priv *
+nft_ohash_get(const struct net *net, const struct nft_set *set,
+	      const struct nft_set_elem *elem, unsigned int flags)
+{
+	struct nft_ohash *priv = nft_set_priv(set);
+	struct nft_ohash_elem *he;
+
+	he = nft_ohash_find(set, priv, nft_ohash_table(set),
+			    elem->key.val.data, nft_genmask_cur(net));
+	if (!he)
+		return ERR_PTR(-ENOENT);
+
+	return &he->priv;
+}
+
+static int nft_ohash_insert(const struct net *net, const struct nft_set *set,
+			    const struct nft_set_elem *elem,
+			    struct nft_elem_priv **elem_priv)
+{
+	struct nft_ohash_elem *this = nft_elem_priv_cast(elem->priv), *he;
+	struct nft_ohash *priv = nft_set_priv(set);
+	struct nft_ohash_table *table = nft_ohash_table(set);
+	int err;
+
+	he = nft_ohash_find(set, priv, table, nft_set_ext_key(&this->ext),
+			    nft_genmask_next(net));
+	if (he) {
+		*elem_priv = &he->priv;
+		return -EEXIST;
+	}
+
+	if (nft_ohash_full(table, priv->used + 1)) {
+		err = nft_ohash_rebuild(set, priv->nelems + 1);
+		if (err)
+			return err;
+
+		table = nft_ohash_table(set);
+	}
+
+	if (nft_ohash_add(set, priv, table, this))
+		priv->used++;
+	priv->nelems++;
+
+	return 0;
+}
+
+static void nft_ohash_activate(const struct net *net, const struct nft_set *set,
+			       struct nft_elem_priv *elem_priv)
+{
+	struct nft_ohash_elem *he = nft_elem_priv_cast(elem_priv);
+
+	nft_clear(net, &he->ext);
+}
+
+static void nft_ohash_flush(const struct net *net,
+			    const struct nft_set *set,
+			    struct nft_elem_priv *elem_priv)
+{
+	struct nft_ohash_elem *he = nft_elem_priv_cast(elem_priv);
+
+	nft_set_elem_change_active(net, set, &he->ext);
+}
+
+static struct nft_elem_priv *
+nft_ohash_deactivate(const struct net *net, const struct nft_set *set,
+		     const struct nft_set_elem *elem)
+{
+	struct nft_ohash *priv = nft_set_priv(set);
+	struct nft_ohash_elem *he;
+
+	he = nft_ohash_find(set, priv, nft_ohash_table(set), &elem->key.val,
+			    nft_genmask_next(net));
+	if (!he)
+		return NULL;
+
+	nft_set_elem_change_active(net, set, &he->ext);
+	return &he->priv;
+}
+
+static void nft_ohash_remove(const struct net *net,
+			     const struct nft_set *set,
+			     struct nft_elem_priv *elem_priv)
+{
+	struct nft_ohash_elem *he = nft_elem_priv_cast(elem_priv);
+	struct nft_ohash *priv = nft_set_priv(set);
+	struct nft_ohash_table *table = nft_ohash_table(set);
+	u32 i = nft_ohash_hash(set, priv, nft_set_ext_key(&he->ext)), probe;
+
+	for (probe = 0; probe <= table->mask; probe++) {
+		struct nft_ohash_group *grp;
+		unsigned int slot;
+
+		i = (i + probe) & table->mask;
+		grp = &table->groups[i];
+
+		for (slot = 0; slot < NFT_OHASH_SLOTS; slot++) {
+			if (rcu_access_pointer(grp->elems[slot]) != he)
+				continue;
+
+			RCU_INIT_POINTER(grp->elems[slot], NULL);
+			if (nft_ohash_match_empty(grp->tags)) {
+				nft_ohash_set_tag(grp, slot, NFT_OHASH_EMPTY);
+				priv->used--;
+			} else {
+				nft_ohash_set_tag(grp, slot, NFT_OHASH_DELETED);
+			}
+			priv->nelems--;
+			return;
+		}
+	}
+}
+
+static void nft_ohash_walk(const struct nft_ctx *ctx, struct nft_set *set,
+			   struct nft_set_iter *iter)
+{
+	struct nft_ohash_table *table = nft_ohash_table(set);
+	u32 i = 0, j = 0;
+
+	/* Slots only move when the table is rebuilt */
+	if (iter->pos_gen == table->gen &&
+	    iter->pos <= (table->mask + 1UL) * NFT_OHASH_SLOTS &&
+	    nft_set_iter_resume(iter)) {
+		i = (iter->pos - 1) / NFT_OHASH_SLOTS;
+		j = (iter->pos - 1) % NFT_OHASH_SLOTS;
+	}
+	iter->pos_gen = table->gen;
+
+	for (; i <= table->mask; i++, j = 0) {
+		for (; j < NFT_OHASH_SLOTS; j++) {
+			struct nft_ohash_elem *he;
+
+			he = rcu_dereference_raw(table->groups[i].elems[j]);
+			if (!he)
+				continue;
+
+			if (iter->count < iter->skip)
+				goto cont;
+
+			iter->pos = (unsigned long)i * NFT_OHASH_SLOTS + j + 1;
+			iter->err = iter->fn(ctx, set, iter, &he->priv);
+			if (iter->err < 0)
+				return;
+cont:
+			iter->count++;
+		}
+	}
+}
+
+static u64 nft_ohash_privsize(const struct nlattr * const nla[],
+			      const struct nft_set_desc *desc)
+{
+	return sizeof(struct nft_ohash);
+}
+
+static int nft_ohash_init(const struct nft_set *set,
+			  const struct nft_set_desc *desc,
+			  const struct nlattr * const tb[])
+{
+	struct nft_ohash *priv = nft_set_priv(set);
+	struct nft_ohash_table *table;
+
+	table = nft_ohash_table_alloc(nft_ohash_groups(desc->size));
+	if (!table)
+		return -ENOMEM;
+
+	get_random_bytes(&priv->seed, sizeof(priv->seed));
+	priv->size = desc->size;
+	priv->nelems = 0;
+	priv->used = 0;
+	RCU_INIT_POINTER(priv->table, table);
+
+	return 0;
+}
+
+static void nft_ohash_destroy(const struct nft_ctx *ctx,
+			      const struct nft_set *set)
+{
+	struct nft_ohash *priv = nft_set_priv(set);
+	struct nft_ohash_table *table;
+	u32 i, j;
+
+	table = rcu_dereference_protected(priv->table, true);
+	for (i = 0; i <= table->mask; i++) {
+		for (j = 0; j < NFT_OHASH_SLOTS; j++) {
+			struct nft_ohash_elem *he;
+
+			he = rcu_dereference_protected(table->groups[i].elems[j],
+						       true);
+			if (he)
+				nf_tables_set_elem_destroy(ctx, set, &he->priv);
+		}
+	}
+
+	nft_ohash_table_free(table);
+}
+
+static bool nft_ohash_estimate(const struct nft_set_desc *desc, u32 features,
+			       struct nft_set_estimate *est)
+{
+	if (!desc->size)
+		return false;
+
+	est->size   = sizeof(struct nft_ohash) +
+		      sizeof(struct nft_ohash_table) +
+		      (u64)nft_ohash_groups(desc->size) *
+		      sizeof(struct nft_ohash_group) +
+		      (u64)desc->size * sizeof(struct nft_ohash_elem);
+	est->lookup = NFT_SET_CLASS_O_1;
+	est->space  = NFT_SET_CLASS_O_N;
+
+	return true;
+}
+
 const struct nft_set_type nft_set_rhash_type = {
 	.features	= NFT_SET_MAP | NFT_SET_OBJECT |
 			  NFT_SET_TIMEOUT | NFT_SET_EVAL,
@@ -785,6 +1509,7 @@ const struct nft_set_type nft_set_hash_type = {
 		.deactivate	= nft_hash_deactivate,
 		.flush		= nft_hash_flush,
 		.remove		= nft_hash_remove,
+		.commit		= nft_hash_commit,
 		.lookup		= nft_hash_lookup,
 		.walk		= nft_hash_walk,
 		.get		= nft_hash_get,
@@ -804,8 +1529,28 @@ const struct nft_set_type nft_set_hash_fast_type = {
 		.deactivate	= nft_hash_deactivate,
 		.flush		= nft_hash_flush,
 		.remove		= nft_hash_remove,
+		.commit		= nft_hash_commit,
 		.lookup		= nft_hash_lookup_fast,
 		.walk		= nft_hash_walk,
 		.get		= nft_hash_get,
 	},
 };
+
+const struct nft_set_type nft_set_ohash_type = {
+	.features	= NFT_SET_MAP | NFT_SET_OBJECT,
+	.ops		= {
+		.privsize       = nft_ohash_privsize,
+		.elemsize	= offsetof(struct nft_ohash_elem, ext),
+		.estimate	= nft_ohash_estimate,
+		.init		= nft_ohash_init,
+		.destroy	= nft_ohash_destroy,
+		.insert		= nft_ohash_insert,
+		.activate	= nft_ohash_activate,
+		.deactivate	= nft_ohash_deactivate,
+		.flush		= nft_ohash_flush,
+		.remove		= nft_ohash_remove,
+		.lookup		= nft_ohash_lookup,
+		.walk		= nft_ohash_walk,
+		.get		= nft_ohash_get,
+	},
+};
@@ -338,8 +338,11 @@
 #include <uapi/linux/netfilter/nf_tables.h>
 #include <linux/bitmap.h>
 #include <linux/bitops.h>
+#include <linux/sort.h>
+#include <linux/bsearch.h>
 
 #include "nft_set_pipapo_avx2.h"
+#include "nft_set_pipapo_neon.h"
 #include "nft_set_pipapo.h"
 
 /**
@@ -397,42 +400,29 @@ int pipapo_refill(unsigned long *map, unsigned int len, unsigned int rules,
 }
 
 /**
- * nft_pipapo_lookup() - Lookup function
- * @net:	Network namespace
- * @set:	nftables API set representation
- * @key:	nftables API element representation containing key data
+ * pipapo_lookup_one() - Match a single key, bottom halves disabled
+ * @m:		Matching data
+ * @scratch:	Scratch maps for this CPU
+ * @rp:		Key data
+ * @genmask:	nftables API generation mask
  * @ext:	nftables API extension pointer, filled with matching reference
  *
- * For more details, see DOC: Theory of Operation.
- *
  * Return: true on match, false otherwise.
  */
-bool nft_pipapo_lookup(const struct net *net, const struct nft_set *set,
-		       const u32 *key, const struct nft_set_ext **ext)
+static bool pipapo_lookup_one(const struct nft_pipapo_match *m,
+			      struct nft_pipapo_scratch *scratch,
+			      const u8 *rp, u8 genmask,
+			      const struct nft_set_ext **ext)
 {
-	struct nft_pipapo *priv = nft_set_priv(set);
-	struct nft_pipapo_scratch *scratch;
 	unsigned long *res_map, *fill_map;
-	u8 genmask = nft_genmask_cur(net);
-	const struct nft_pipapo_match *m;
 	const struct nft_pipapo_field *f;
-	const u8 *rp = (const u8 *)key;
 	bool map_index;
 	int i;
 
-	local_bh_disable();
-
-	m = rcu_dereference(priv->match);
-
-	if (unlikely(!m || !*raw_cpu_ptr(m->scratch)))
-		goto out;
-
-	scratch = *raw_cpu_ptr(m->scratch);
-
 	map_index = scratch->map_index;
 
-	res_map  = scratch->map + (map_index ? m->bsize_max : 0);
-	fill_map = scratch->map + (map_index ? 0 : m->bsize_max);
+	res_map  = scratch->map + (map_index ? scratch->bsize : 0);
+	fill_map = scratch->map + (map_index ? 0 : scratch->bsize);
 
 	pipapo_resmap_init(m, res_map);
 
@@ -443,11 +433,7 @@ bool nft_pipapo_lookup(const struct net *net, const struct nft_set *set,
 		/* For each bit group: select lookup table bucket depending on
 		 * packet bytes value, then AND bucket value
 		 */
-		if (likely(f->bb == 8))
-			pipapo_and_field_buckets_8bit(f, res_map, rp);
-		else
-			pipapo_and_field_buckets_4bit(f, res_map, rp);
-		NFT_PIPAPO_GROUP_BITS_ARE_8_OR_4;
+		pipapo_and_field_buckets(f, res_map, rp);
 
 		rp += f->groups / NFT_PIPAPO_GROUPS_PER_BYTE(f);
 
@@ -463,8 +449,6 @@ bool nft_pipapo_lookup(const struct net *net, const struct nft_set *set,
 				  last);
 		if (b < 0) {
 			scratch->map_index = map_index;
-			local_bh_enable();
-
 			return false;
 		}
 
@@ -480,8 +464,6 @@ bool nft_pipapo_lookup(const struct net *net, const struct nft_set *set,
 			 * *next* bitmap (not initial) for the next packet.
 			 */
 			scratch->map_index = map_index;
-			local_bh_enable();
-
 			return true;
 		}
 
@@ -495,11 +477,41 @@ bool nft_pipapo_lookup(const struct net *net, const struct nft_set *set,
 		rp += NFT_PIPAPO_GROUPS_PADDING(f);
 	}
 
-out:
-	local_bh_enable();
 	return false;
 }
 
+/**
+ * nft_pipapo_lookup() - Lookup function
+ * @net:	Network namespace
+ * @set:	nftables API set representation
+ * @key:	nftables API element representation containing key data
+ * @ext:	nftables API extension pointer, filled with matching reference
+ *
+ * For more details, see DOC: Theory of Operation.
+ *
+ * Return: true on match, false otherwise.
+ */
+bool nft_pipapo_lookup(const struct net *net, const struct nft_set *set,
+		       const u32 *key, const struct nft_set_ext **ext)
+{
+	struct nft_pipapo *priv = nft_set_priv(set);
+	struct nft_pipapo_scratch *scratch;
+	const struct nft_pipapo_match *m;
+	bool ret = false;
+
+	local_bh_disable();
+
+	m = rcu_dereference(priv->match);
+
+	scratch = m ? pipapo_scratch_get(m) : NULL;
+	if (likely(scratch))
+		ret = pipapo_lookup_one(m, scratch, (const u8 *)key,
+					nft_genmask_cur(net), ext);
+
+	local_bh_enable();
+	return ret;
+}
+
 /**
  * pipapo_get() - Get matching element reference given key data
  * @net:	Network namespace
@@ -551,12 +563,7 @@ static struct nft_pipapo_elem *pipapo_get(const struct net *net,
 		/* For each bit group: select lookup table bucket depending on
 		 * packet bytes value, then AND bucket value
 		 */
-		if (f->bb == 8)
-			pipapo_and_field_buckets_8bit(f, res_map, data);
-		else if (f->bb == 4)
-			pipapo_and_field_buckets_4bit(f, res_map, data);
-		else
-			BUG();
+		pipapo_and_field_buckets(f, res_map, data);
 
 		data += f->groups / NFT_PIPAPO_GROUPS_PER_BYTE(f);
 
@@ -928,9 +935,95 @@ static void pipapo_lt_8b_to_4b(int old_groups, int bsize,
 	}
 }
 
+/**
+ * pipapo_lt_2b_to_4b() - Switch lookup table group width from 2 bits to 4 bits
+ * @old_groups:	Number of current groups
+ * @bsize:	Size of one bucket, in longs
+ * @old_lt:	Pointer to the current lookup table
+ * @new_lt:	Pointer to the new, pre-allocated lookup table
+ *
+ * Same as pipapo_lt_4b_to_8b(), for half the width:
+ *
+ *	N(b, g) := O(b / 4, 2 * g) & O(b % 4, 2 * g + 1)
+ */
+static void pipapo_lt_2b_to_4b(int old_groups, int bsize,
+			       unsigned long *old_lt, unsigned long *new_lt)
+{
+	int g, b, i;
+
+	for (g = 0; g < old_groups / 2; g++) {
+		int src_g0 = g * 2, src_g1 = g * 2 + 1;
+
+		for (b = 0; b < NFT_PIPAPO_BUCKETS(4); b++) {
+			int src_b0 = b / NFT_PIPAPO_BUCKETS(2);
+			int src_b1 = b % NFT_PIPAPO_BUCKETS(2);
+			int src_i0 = src_g0 * NFT_PIPAPO_BUCKETS(2) + src_b0;
+			int src_i1 = src_g1 * NFT_PIPAPO_BUCKETS(2) + src_b1;
+
+			for (i = 0; i < bsize; i++) {
+				*new_lt = old_lt[src_i0 * bsize + i] &
+					  old_lt[src_i1 * bsize + i];
+				new_lt++;
+			}
+		}
+	}
+}
+
+/**
+ * pipapo_lt_4b_to_2b() - Switch lookup table group width from 4 bits to 2 bits
+ * @old_groups:	Number of current groups
+ * @bsize:	Size of one bucket, in longs
+ * @old_lt:	Pointer to the current lookup table
+ * @new_lt:	Pointer to the new, pre-allocated lookup table
+ *
+ * Same as pipapo_lt_8b_to_4b(), for half the width: buckets of the two new
+ * groups are the union of old buckets with matching upper and lower two bits,
+ * respectively.
+ */
+static void pipapo_lt_4b_to_2b(int old_groups, int bsize,
+			       unsigned long *old_lt, unsigned long *new_lt)
+{
+	int g, b, bsrc, i;
+
+	memset(new_lt, 0, old_groups * 2 * NFT_PIPAPO_BUCKETS(2) * bsize *
+			  sizeof(unsigned long));
+
+	for (g = 0; g < old_groups; g++) {
+		unsigned long *src = old_lt + g * NFT_PIPAPO_BUCKETS(4) * bsize;
+
+		for (b = 0; b < NFT_PIPAPO_BUCKETS(2); b++) {
+			for (bsrc = 0; bsrc < NFT_PIPAPO_BUCKETS(4); bsrc++) {
+				if (bsrc >> 2 != b)
+					continue;
+
+				for (i = 0; i < bsize; i++)
+					new_lt[i] |= src[bsrc * bsize + i];
+			}
+
+			new_lt += bsize;
+		}
+
+		for (b = 0; b < NFT_PIPAPO_BUCKETS(2); b++) {
+			for (bsrc = 0; bsrc < NFT_PIPAPO_BUCKETS(4); bsrc++) {
+				if ((bsrc & 0x03) != b)
+					continue;
+
+				for (i = 0; i < bsize; i++)
+					new_lt[i] |= src[bsrc * bsize + i];
+			}
+
+			new_lt += bsize;
+		}
+	}
+}
+
 /**
  * pipapo_lt_bits_adjust() - Adjust group size for lookup table if needed
  * @f:		Field containing lookup table
+ *
+ * Tables bigger than NFT_PIPAPO_LT_SIZE_HIGH use the large set group width,
+ * and bigger than NFT_PIPAPO_LT_SIZE_HUGE the huge set one. Step back when
+ * they get small again, with some hysteresis.
  */
 static void pipapo_lt_bits_adjust(struct nft_pipapo_field *f)
 {
@@ -949,6 +1042,25 @@ static void pipapo_lt_bits_adjust(struct nft_pipapo_field *f)
 		lt_size = lt_calculate_size(groups, bb, f->bsize);
 		if (lt_size < 0)
 			return;
+	} else if (f->bb == NFT_PIPAPO_GROUP_BITS_LARGE_SET &&
+		   lt_size > NFT_PIPAPO_LT_SIZE_HUGE) {
+		groups = f->groups * 2;
+		bb = NFT_PIPAPO_GROUP_BITS_HUGE_SET;
+
+		lt_size = lt_calculate_size(groups, bb, f->bsize);
+		if (lt_size < 0)
+			return;
+	} else if (f->bb == NFT_PIPAPO_GROUP_BITS_HUGE_SET &&
+		   lt_size < NFT_PIPAPO_LT_SIZE_HUGE_LOW) {
+		groups = f->groups / 2;
+		bb = NFT_PIPAPO_GROUP_BITS_LARGE_SET;
+
+		lt_size = lt_calculate_size(groups, bb, f->bsize);
+		if (lt_size < 0)
+			return;
+
+		if (lt_size > NFT_PIPAPO_LT_SIZE_HUGE)
+			return;
 	} else if (f->bb == NFT_PIPAPO_GROUP_BITS_LARGE_SET &&
 		   lt_size < NFT_PIPAPO_LT_SIZE_LOW) {
 		groups = f->groups / 2;
@@ -971,7 +1083,7 @@ static void pipapo_lt_bits_adjust(struct nft_pipapo_field *f)
 	if (!new_lt)
 		return;
 
-	NFT_PIPAPO_GROUP_BITS_ARE_8_OR_4;
+	NFT_PIPAPO_GROUP_BITS_ARE_8_4_OR_2;
 	if (f->bb == 4 && bb == 8) {
 		pipapo_lt_4b_to_8b(f->groups, f->bsize,
 				   NFT_PIPAPO_LT_ALIGN(f->lt),
@@ -980,6 +1092,14 @@ static void pipapo_lt_bits_adjust(struct nft_pipapo_field *f)
 		pipapo_lt_8b_to_4b(f->groups, f->bsize,
 				   NFT_PIPAPO_LT_ALIGN(f->lt),
 				   NFT_PIPAPO_LT_ALIGN(new_lt));
+	} else if (f->bb == 2 && bb == 4) {
+		pipapo_lt_2b_to_4b(f->groups, f->bsize,
+				   NFT_PIPAPO_LT_ALIGN(f->lt),
+				   NFT_PIPAPO_LT_ALIGN(new_lt));
+	} else if (f->bb == 4 && bb == 2) {
+		pipapo_lt_4b_to_2b(f->groups, f->bsize,
+				   NFT_PIPAPO_LT_ALIGN(f->lt),
+				   NFT_PIPAPO_LT_ALIGN(new_lt));
 	} else {
 		BUG();
 	}
@@ -1203,17 +1323,21 @@ static void pipapo_map(struct nft_pipapo_match *m,
 		f->mt[map[i].to + j].e = e;
 }
 
+DEFINE_PER_CPU(struct nft_pipapo_scratch __rcu *, nft_pipapo_scratch);
+
+/* Protects scratch maps replacement, and the two variables below */
+static DEFINE_MUTEX(pipapo_scratch_mutex);
+static unsigned int pipapo_scratch_bsize;
+static unsigned int pipapo_scratch_users;
+
 /**
  * pipapo_free_scratch() - Free per-CPU map at original (not aligned) address
- * @m:		Matching data
- * @cpu:	CPU number
+ * @s:		Scratch maps, can be NULL
  */
-static void pipapo_free_scratch(const struct nft_pipapo_match *m, unsigned int cpu)
+static void pipapo_free_scratch(struct nft_pipapo_scratch *s)
 {
-	struct nft_pipapo_scratch *s;
 	void *mem;
 
-	s = *per_cpu_ptr(m->scratch, cpu);
 	if (!s)
 		return;
 
@@ -1223,60 +1347,147 @@ static void pipapo_free_scratch(const struct nft_pipapo_match *m, unsigned int c
 }
 
 /**
- * pipapo_realloc_scratch() - Reallocate scratch maps for partial match results
- * @clone:	Copy of matching data with pending insertions and deletions
- * @bsize_max:	Maximum bucket size, scratch maps cover two buckets
+ * pipapo_alloc_scratch() - Allocate zeroed scratch maps for a given CPU
+ * @bsize:	Size of each of the two maps, in longs
+ * @cpu:	CPU number, selects the memory node
  *
- * Return: 0 on success, -ENOMEM on failure.
+ * Return: scratch maps with aligned map field, NULL on failure.
  */
-static int pipapo_realloc_scratch(struct nft_pipapo_match *clone,
-				  unsigned long bsize_max)
+static struct nft_pipapo_scratch *pipapo_alloc_scratch(unsigned int bsize,
+						       int cpu)
 {
-	int i;
-
-	for_each_possible_cpu(i) {
-		struct nft_pipapo_scratch *scratch;
+	struct nft_pipapo_scratch *scratch;
 #ifdef NFT_PIPAPO_ALIGN
-		void *scratch_aligned;
-		u32 align_off;
+	void *scratch_aligned;
+	u32 align_off;
 #endif
-		scratch = kzalloc_node(struct_size(scratch, map,
-						   bsize_max * 2) +
-				       NFT_PIPAPO_ALIGN_HEADROOM,
-				       GFP_KERNEL_ACCOUNT, cpu_to_node(i));
-		if (!scratch) {
-			/* On failure, there's no need to undo previous
-			 * allocations: this means that some scratch maps have
-			 * a bigger allocated size now (this is only called on
-			 * insertion), but the extra space won't be used by any
-			 * CPU as new elements are not inserted and m->bsize_max
-			 * is not updated.
-			 */
-			return -ENOMEM;
-		}
 
-		pipapo_free_scratch(clone, i);
+	/* Shared by all sets, hence not accounted to any memory cgroup */
+	scratch = kzalloc_node(struct_size(scratch, map, bsize * 2) +
+			       NFT_PIPAPO_ALIGN_HEADROOM,
+			       GFP_KERNEL, cpu_to_node(cpu));
+	if (!scratch)
+		return NULL;
 
 #ifdef NFT_PIPAPO_ALIGN
-		/* Align &scratch->map (not the struct itself): the extra
-		 * %NFT_PIPAPO_ALIGN_HEADROOM bytes passed to kzalloc_node()
-		 * above guarantee we can waste up to those bytes in order
-		 * to align the map field regardless of its offset within
-		 * the struct.
-		 */
-		BUILD_BUG_ON(offsetof(struct nft_pipapo_scratch, map) > NFT_PIPAPO_ALIGN_HEADROOM);
+	/* Align &scratch->map (not the struct itself): the extra
+	 * %NFT_PIPAPO_ALIGN_HEADROOM bytes passed to kzalloc_node()
+	 * above guarantee we can waste up to those bytes in order
+	 * to align the map field regardless of its offset within
+	 * the struct.
+	 */
+	BUILD_BUG_ON(offsetof(struct nft_pipapo_scratch, map) > NFT_PIPAPO_ALIGN_HEADROOM);
 
-		scratch_aligned = NFT_PIPAPO_LT_ALIGN(&scratch->map);
-		scratch_aligned -= offsetof(struct nft_pipapo_scratch, map);
-		align_off = scratch_aligned - (void *)scratch;
+	scratch_aligned = NFT_PIPAPO_LT_ALIGN(&scratch->map);
+	scratch_aligned -= offsetof(struct nft_pipapo_scratch, map);
+	align_off = scratch_aligned - (void *)scratch;
 
-		scratch = scratch_aligned;
-		scratch->align_off = align_off;
+	scratch = scratch_aligned;
+	scratch->align_off = align_off;
 #endif
-		*per_cpu_ptr(clone->scratch, i) = scratch;
+	scratch->bsize = bsize;
+	scratch->clean = bsize;
+
+	return scratch;
+}
+
+/**
+ * pipapo_grow_scratch() - Make scratch maps cover a given bucket size
+ * @bsize_max:	Maximum bucket size of matching data about to be used
+ *
+ * Scratch maps for partial match results are shared by all sets: lookups run
+ * with bottom halves disabled and can't nest, and each of them leaves the
+ * inactive map all-zeroes up to its own bucket size, which is all the next
+ * lookup, for any set, relies on. The two maps sit at a fixed offset, the
+ * largest bucket size across sets, rounded up to a power of two so that a
+ * growing set doesn't replace maps, and wait for a grace period, on every
+ * insertion.
+ *
+ * Lookups pick new maps up as they start, old maps are freed once no lookup
+ * can be using them.
+ *
+ * Return: 0 on success, -ENOMEM on failure.
+ */
+static int pipapo_grow_scratch(unsigned int bsize_max)
+{
+	struct nft_pipapo_scratch **maps;
+	unsigned int bsize;
+	int i, err = 0;
+
+	mutex_lock(&pipapo_scratch_mutex);
+
+	if (bsize_max <= pipapo_scratch_bsize)
+		goto out;
+
+	err = -ENOMEM;
+	maps = kcalloc(nr_cpu_ids, sizeof(*maps), GFP_KERNEL);
+	if (!maps)
+		goto out;
+
+	bsize = roundup_pow_of_two(bsize_max);
+	for_each_possible_cpu(i) {
+		maps[i] = pipapo_alloc_scratch(bsize, i);
+		if (!maps[i])
+			goto out_free;
 	}
 
-	return 0;
+	/* From here on, maps[] holds the old maps */
+	for_each_possible_cpu(i) {
+		maps[i] = rcu_replace_pointer(per_cpu(nft_pipapo_scratch, i),
+					      maps[i],
+					      lockdep_is_held(&pipapo_scratch_mutex));
+	}
+	pipapo_scratch_bsize = bsize;
+	err = 0;
+
+	synchronize_rcu();
+
+out_free:
+	for_each_possible_cpu(i)
+		pipapo_free_scratch(maps[i]);
+	kfree(maps);
+out:
+	mutex_unlock(&pipapo_scratch_mutex);
+
+	return err;
+}
+
+/**
+ * pipapo_get_scratch() - Take a reference to shared scratch maps for a set
+ */
+static void pipapo_get_scratch(void)
+{
+	mutex_lock(&pipapo_scratch_mutex);
+	pipapo_scratch_users++;
+	mutex_unlock(&pipapo_scratch_mutex);
+}
+
+/**
+ * pipapo_put_scratch() - Drop a reference, free scratch maps if unused
+ *
+ * Sets are destroyed once they can't be looked up anymore, but lookups might
+ * still be running: wait for them before freeing.
+ */
+static void pipapo_put_scratch(void)
+{
+	struct nft_pipapo_scratch *s;
+	int i;
+
+	mutex_lock(&pipapo_scratch_mutex);
+
+	if (--pipapo_scratch_users || !pipapo_scratch_bsize)
+		goto out;
+
+	synchronize_rcu();
+
+	for_each_possible_cpu(i) {
+		s = rcu_replace_pointer(per_cpu(nft_pipapo_scratch, i), NULL,
+					lockdep_is_held(&pipapo_scratch_mutex));
+		pipapo_free_scratch(s);
+	}
+	pipapo_scratch_bsize = 0;
+out:
+	mutex_unlock(&pipapo_scratch_mutex);
 }
 
 static bool nft_pipapo_transaction_mutex_held(const struct nft_set *set)
@@ -1291,11 +1502,37 @@ static bool nft_pipapo_transaction_mutex_held(const struct nft_set *set)
 }
 
 static struct nft_pipapo_match *pipapo_clone(struct nft_pipapo_match *old);
+static struct nft_pipapo_match *pipapo_reuse_spare(struct nft_pipapo *priv);
+
+/**
+ * pipapo_match_size() - Get size of lookup and mapping tables
+ * @m:		Matching data
+ *
+ * Return: size of all the tables in @m, in bytes.
+ */
+static size_t pipapo_match_size(const struct nft_pipapo_match *m)
+{
+	const struct nft_pipapo_field *f;
+	size_t size = 0;
+	int i;
+
+	nft_pipapo_for_each_field(f, i, m) {
+		size += f->bsize * sizeof(*f->lt) *
+			f->groups * NFT_PIPAPO_BUCKETS(f->bb);
+		size += f->rules_alloc * sizeof(*f->mt);
+	}
+
+	return size;
+}
 
 /**
  * pipapo_maybe_clone() - Build clone for pending data changes, if not existing
  * @set:	nftables API set representation
  *
+ * For large sets, the copy replaced by the previous commit is reused as clone,
+ * once no readers are left, by replaying the changes from that transaction on
+ * it, see nft_pipapo_commit().
+ *
  * Return: newly created or existing clone, if any. NULL on allocation failure
  */
 static struct nft_pipapo_match *pipapo_maybe_clone(const struct nft_set *set)
@@ -1308,11 +1545,135 @@ static struct nft_pipapo_match *pipapo_maybe_clone(const struct nft_set *set)
 
 	m = rcu_dereference_protected(priv->match,
 				      nft_pipapo_transaction_mutex_held(set));
-	priv->clone = pipapo_clone(m);
+
+	priv->clone = pipapo_reuse_spare(priv);
+	if (!priv->clone)
+		priv->clone = pipapo_clone(m);
+	if (!priv->clone)
+		return NULL;
+
+	priv->log_len = 0;
+	priv->log_valid = pipapo_match_size(m) >= NFT_PIPAPO_SPARE_MIN;
+	if (!priv->log_valid) {
+		kvfree(priv->log);
+		priv->log = NULL;
+	}
 
 	return priv->clone;
 }
 
+/**
+ * pipapo_log_add() - Add entry to log of changes done by current transaction
+ * @priv:	Set private data
+ * @e:		Element being inserted or removed
+ * @insert:	Insertion if set, otherwise removal
+ *
+ * Return: new log entry, NULL if changes are not, or can't be, logged.
+ */
+static struct nft_pipapo_log_entry *pipapo_log_add(struct nft_pipapo *priv,
+						   struct nft_pipapo_elem *e,
+						   bool insert)
+{
+	struct nft_pipapo_log_entry *entry;
+
+	if (!priv->log_valid)
+		return NULL;
+
+	if (!priv->log) {
+		priv->log = kvmalloc_array(NFT_PIPAPO_LOG_MAX,
+					   sizeof(*priv->log),
+					   GFP_KERNEL_ACCOUNT);
+		if (!priv->log) {
+			priv->log_valid = false;
+			return NULL;
+		}
+	}
+
+	if (priv->log_len == NFT_PIPAPO_LOG_MAX) {
+		priv->log_valid = false;
+		return NULL;
+	}
+
+	entry = &priv->log[priv->log_len++];
+	entry->e = e;
+	entry->insert = insert;
+
+	return entry;
+}
+
+static void pipapo_log_insert(struct nft_pipapo *priv, struct nft_pipapo_elem *e,
+			      const u8 *start, const u8 *end)
+{
+	struct nft_pipapo_log_entry *entry = pipapo_log_add(priv, e, true);
+
+	if (!entry)
+		return;
+
+	memcpy(entry->start, start, priv->width);
+	memcpy(entry->end, end, priv->width);
+}
+
+static void pipapo_log_remove(struct nft_pipapo *priv, struct nft_pipapo_elem *e)
+{
+	pipapo_log_add(priv, e, false);
+}
+
+/**
+ * pipapo_do_insert() - Insert rules for validated ranges, map them to element
+ * @m:		Matching data
+ * @start:	Start of range, all fields
+ * @end:	End of range, all fields
+ * @e:		Element the rules in the last field map to
+ *
+ * Return: 0 on success, negative error code on failure, in which case
+ * matching data is left in an inconsistent state and needs to be discarded.
+ */
+static int pipapo_do_insert(struct nft_pipapo_match *m, const u8 *start,
+			    const u8 *end, struct nft_pipapo_elem *e)
+{
+	union nft_pipapo_map_bucket rulemap[NFT_PIPAPO_MAX_FIELDS];
+	struct nft_pipapo_field *f;
+	int i, bsize_max, err;
+
+	bsize_max = m->bsize_max;
+
+	nft_pipapo_for_each_field(f, i, m) {
+		int ret;
+
+		rulemap[i].to = f->rules;
+
+		ret = memcmp(start, end,
+			     f->groups / NFT_PIPAPO_GROUPS_PER_BYTE(f));
+		if (!ret)
+			ret = pipapo_insert(f, start, f->groups * f->bb);
+		else
+			ret = pipapo_expand(f, start, end, f->groups * f->bb);
+
+		if (ret < 0)
+			return ret;
+
+		if (f->bsize > bsize_max)
+			bsize_max = f->bsize;
+
+		rulemap[i].n = ret;
+
+		start += NFT_PIPAPO_GROUPS_PADDED_SIZE(f);
+		end += NFT_PIPAPO_GROUPS_PADDED_SIZE(f);
+	}
+
+	if (bsize_max > m->bsize_max) {
+		err = pipapo_grow_scratch(bsize_max);
+		if (err)
+			return err;
+
+		m->bsize_max = bsize_max;
+	}
+
+	pipapo_map(m, rulemap, e);
+
+	return 0;
+}
+
 /**
  * nft_pipapo_insert() - Validate and insert ranged elements
  * @net:	Network namespace
@@ -1327,15 +1688,15 @@ static int nft_pipapo_insert(const struct net *net, const struct nft_set *set,
 			     struct nft_elem_priv **elem_priv)
 {
 	const struct nft_set_ext *ext = nft_set_elem_ext(set, elem->priv);
-	union nft_pipapo_map_bucket rulemap[NFT_PIPAPO_MAX_FIELDS];
 	const u8 *start = (const u8 *)elem->key.val.data, *end;
 	struct nft_pipapo_match *m = pipapo_maybe_clone(set);
+	struct nft_pipapo *priv = nft_set_priv(set);
 	u8 genmask = nft_genmask_next(net);
 	struct nft_pipapo_elem *e, *dup;
 	u64 tstamp = nft_net_tstamp(net);
 	struct nft_pipapo_field *f;
 	const u8 *start_p, *end_p;
-	int i, bsize_max, err = 0;
+	int i, err;
 
 	if (!m)
 		return -ENOMEM;
@@ -1400,49 +1761,17 @@ static int nft_pipapo_insert(const struct net *net, const struct nft_set *set,
 	}
 
 	/* Insert */
-	bsize_max = m->bsize_max;
-
-	nft_pipapo_for_each_field(f, i, m) {
-		int ret;
-
-		rulemap[i].to = f->rules;
-
-		ret = memcmp(start, end,
-			     f->groups / NFT_PIPAPO_GROUPS_PER_BYTE(f));
-		if (!ret)
-			ret = pipapo_insert(f, start, f->groups * f->bb);
-		else
-			ret = pipapo_expand(f, start, end, f->groups * f->bb);
-
-		if (ret < 0)
-			return ret;
-
-		if (f->bsize > bsize_max)
-			bsize_max = f->bsize;
-
-		rulemap[i].n = ret;
-
-		start += NFT_PIPAPO_GROUPS_PADDED_SIZE(f);
-		end += NFT_PIPAPO_GROUPS_PADDED_SIZE(f);
-	}
-
-	if (!*get_cpu_ptr(m->scratch) || bsize_max > m->bsize_max) {
-		put_cpu_ptr(m->scratch);
-
-		err = pipapo_realloc_scratch(m, bsize_max);
-		if (err)
-			return err;
+	e = nft_elem_priv_cast(elem->priv);
 
-		m->bsize_max = bsize_max;
-	} else {
-		put_cpu_ptr(m->scratch);
+	err = pipapo_do_insert(m, start, end, e);
+	if (err) {
+		priv->log_valid = false;
+		return err;
 	}
 
-	e = nft_elem_priv_cast(elem->priv);
+	pipapo_log_insert(priv, e, start, end);
 	*elem_priv = &e->priv;
 
-	pipapo_map(m, rulemap, e);
-
 	return 0;
 }
 
@@ -1465,16 +1794,6 @@ static struct nft_pipapo_match *pipapo_clone(struct nft_pipapo_match *old)
 	new->field_count = old->field_count;
 	new->bsize_max = old->bsize_max;
 
-	new->scratch = alloc_percpu(*new->scratch);
-	if (!new->scratch)
-		goto out_scratch;
-
-	for_each_possible_cpu(i)
-		*per_cpu_ptr(new->scratch, i) = NULL;
-
-	if (pipapo_realloc_scratch(new, old->bsize_max))
-		goto out_scratch_realloc;
-
 	rcu_head_init(&new->rcu);
 
 	src = old->f;
@@ -1531,11 +1850,6 @@ static struct nft_pipapo_match *pipapo_clone(struct nft_pipapo_match *old)
 		kvfree(dst->lt);
 		dst--;
 	}
-out_scratch_realloc:
-	for_each_possible_cpu(i)
-		pipapo_free_scratch(new, i);
-out_scratch:
-	free_percpu(new->scratch);
 	kfree(new);
 
 	return NULL;
@@ -1776,6 +2090,7 @@ static void pipapo_gc(struct nft_set *set, struct nft_pipapo_match *m)
 
 			nft_pipapo_gc_deactivate(net, set, e);
 			pipapo_drop(m, rulemap);
+			pipapo_log_remove(priv, e);
 			nft_trans_gc_elem_add(gc, e);
 
 			/* And check again current first rule, which is now the
@@ -1810,12 +2125,6 @@ static void pipapo_free_fields(struct nft_pipapo_match *m)
 
 static void pipapo_free_match(struct nft_pipapo_match *m)
 {
-	int i;
-
-	for_each_possible_cpu(i)
-		pipapo_free_scratch(m, i);
-
-	free_percpu(m->scratch);
 	pipapo_free_fields(m);
 
 	kfree(m);
@@ -1833,6 +2142,135 @@ static void pipapo_reclaim_match(struct rcu_head *rcu)
 	pipapo_free_match(m);
 }
 
+/* Log entries are compared only by element pointer, the first member */
+static int pipapo_log_cmp(const void *a, const void *b)
+{
+	const struct nft_pipapo_elem *ea = *(struct nft_pipapo_elem * const *)a;
+	const struct nft_pipapo_elem *eb = *(struct nft_pipapo_elem * const *)b;
+
+	if (ea < eb)
+		return -1;
+
+	return ea > eb;
+}
+
+/**
+ * pipapo_drop_elems() - Drop rules mapping to given elements, by pointer
+ * @m:		Matching data
+ * @log:	Removal log entries, sorted by element pointer
+ * @n:		Number of entries in @log
+ *
+ * Elements might be gone already, so they are never dereferenced: walk rules
+ * as pipapo_gc() does and drop the ones mapping to one of the listed elements.
+ */
+static void pipapo_drop_elems(struct nft_pipapo_match *m,
+			      const struct nft_pipapo_log_entry *log,
+			      unsigned int n)
+{
+	unsigned int rules_f0, first_rule = 0, dropped = 0;
+
+	BUILD_BUG_ON(offsetof(struct nft_pipapo_log_entry, e) != 0);
+
+	while (dropped < n &&
+	       (rules_f0 = pipapo_rules_same_key(m->f, first_rule))) {
+		union nft_pipapo_map_bucket rulemap[NFT_PIPAPO_MAX_FIELDS];
+		const struct nft_pipapo_field *f;
+		unsigned int i, start, rules_fx;
+		struct nft_pipapo_elem *e;
+
+		start = first_rule;
+		rules_fx = rules_f0;
+
+		nft_pipapo_for_each_field(f, i, m) {
+			rulemap[i].to = start;
+			rulemap[i].n = rules_fx;
+
+			if (i < m->field_count - 1) {
+				rules_fx = f->mt[start].n;
+				start = f->mt[start].to;
+			}
+		}
+
+		f--;
+		i--;
+		e = f->mt[rulemap[i].to].e;
+
+		if (bsearch(&e, log, n, sizeof(*log), pipapo_log_cmp)) {
+			pipapo_drop(m, rulemap);
+			dropped++;
+		} else {
+			first_rule += rules_f0;
+		}
+	}
+}
+
+/**
+ * pipapo_replay() - Apply logged changes to matching data
+ * @m:		Matching data
+ * @log:	Log of changes, sorted in place for batched removals
+ * @len:	Number of entries in @log
+ *
+ * Return: 0 on success, negative error code on failure, in which case @m needs
+ * to be discarded.
+ */
+static int pipapo_replay(struct nft_pipapo_match *m,
+			 struct nft_pipapo_log_entry *log, unsigned int len)
+{
+	unsigned int i = 0, n;
+	int err;
+
+	while (i < len) {
+		if (log[i].insert) {
+			err = pipapo_do_insert(m, log[i].start, log[i].end,
+					       log[i].e);
+			if (err)
+				return err;
+
+			i++;
+			continue;
+		}
+
+		/* Consecutive removals commute, drop them in a single walk */
+		for (n = 1; i + n < len && !log[i + n].insert; n++)
+			;
+
+		sort(log + i, n, sizeof(*log), pipapo_log_cmp, NULL);
+		pipapo_drop_elems(m, log + i, n);
+		i += n;
+	}
+
+	return 0;
+}
+
+/**
+ * pipapo_reuse_spare() - Bring spare copy up to date to use it as new clone
+ * @priv:	Set private data
+ *
+ * The spare copy is the matching data replaced by the last commit, and it's
+ * behind the current one by exactly the changes in the log. Wait for readers
+ * of the spare copy to go away, if any are left, then replay the log on it.
+ *
+ * Return: up to date copy of matching data, NULL if not available.
+ */
+static struct nft_pipapo_match *pipapo_reuse_spare(struct nft_pipapo *priv)
+{
+	struct nft_pipapo_match *spare = priv->spare;
+
+	if (!spare)
+		return NULL;
+
+	priv->spare = NULL;
+
+	cond_synchronize_rcu(priv->spare_gp);
+
+	if (pipapo_replay(spare, priv->log, priv->log_len)) {
+		pipapo_free_match(spare);
+		return NULL;
+	}
+
+	return spare;
+}
+
 /**
  * nft_pipapo_commit() - Replace lookup data with current working copy
  * @set:	nftables API set representation
@@ -1842,7 +2280,10 @@ static void pipapo_reclaim_match(struct rcu_head *rcu)
  * working copy doesn't have pending changes.
  *
  * We also need to create a new working copy for subsequent insertions and
- * deletions.
+ * deletions. For large sets, instead of freeing the replaced copy, keep it
+ * as spare, if the changes done by this transaction are all logged: the next
+ * transaction can then replay them on the spare, instead of copying tables
+ * again from scratch.
  */
 static void nft_pipapo_commit(struct nft_set *set)
 {
@@ -1859,8 +2300,16 @@ static void nft_pipapo_commit(struct nft_set *set)
 				  nft_pipapo_transaction_mutex_held(set));
 	priv->clone = NULL;
 
-	if (old)
-		call_rcu(&old->rcu, pipapo_reclaim_match);
+	if (!old)
+		return;
+
+	if (priv->log_valid && pipapo_match_size(old) >= NFT_PIPAPO_SPARE_MIN) {
+		priv->spare = old;
+		priv->spare_gp = get_state_synchronize_rcu();
+		return;
+	}
+
+	call_rcu(&old->rcu, pipapo_reclaim_match);
 }
 
 static void nft_pipapo_abort(const struct nft_set *set)
@@ -2123,6 +2572,7 @@ static void nft_pipapo_remove(const struct net *net, const struct nft_set *set,
 
 			if (last && f->mt[rulemap[i].to].e == e) {
 				pipapo_drop(m, rulemap);
+				pipapo_log_remove(priv, e);
 				return;
 			}
 		}
@@ -2143,18 +2593,24 @@ static void nft_pipapo_remove(const struct net *net, const struct nft_set *set,
  * As elements are referenced in the mapping array for the last field, directly
  * scan that array: there's no need to follow rule mappings from the first
  * field. @m is protected either by RCU read lock or by transaction mutex.
+ *
+ * The position is the index of the rule in that array, which only changes when
+ * the matching data is replaced on commit.
  */
 static void nft_pipapo_do_walk(const struct nft_ctx *ctx, struct nft_set *set,
 			       const struct nft_pipapo_match *m,
 			       struct nft_set_iter *iter)
 {
 	const struct nft_pipapo_field *f;
-	unsigned int i, r;
+	unsigned int i, r = 0;
 
 	for (i = 0, f = m->f; i < m->field_count - 1; i++, f++)
 		;
 
-	for (r = 0; r < f->rules; r++) {
+	if (iter->pos <= f->rules && nft_set_iter_resume(iter))
+		r = iter->pos - 1;
+
+	for (; r < f->rules; r++) {
 		struct nft_pipapo_elem *e;
 
 		if (r < f->rules - 1 && f->mt[r + 1].e == f->mt[r].e)
@@ -2165,6 +2621,7 @@ static void nft_pipapo_do_walk(const struct nft_ctx *ctx, struct nft_set *set,
 
 		e = f->mt[r].e;
 
+		iter->pos = r + 1;
 		iter->err = iter->fn(ctx, set, iter, &e->priv);
 		if (iter->err < 0)
 			return;
@@ -2270,7 +2727,7 @@ static int nft_pipapo_init(const struct nft_set *set,
 	struct nft_pipapo *priv = nft_set_priv(set);
 	struct nft_pipapo_match *m;
 	struct nft_pipapo_field *f;
-	int err, i, field_count;
+	int i, field_count;
 
 	BUILD_BUG_ON(offsetof(struct nft_pipapo_elem, priv) != 0);
 
@@ -2289,14 +2746,6 @@ static int nft_pipapo_init(const struct nft_set *set,
 	m->field_count = field_count;
 	m->bsize_max = 0;
 
-	m->scratch = alloc_percpu(struct nft_pipapo_scratch *);
-	if (!m->scratch) {
-		err = -ENOMEM;
-		goto out_scratch;
-	}
-	for_each_possible_cpu(i)
-		*per_cpu_ptr(m->scratch, i) = NULL;
-
 	rcu_head_init(&m->rcu);
 
 	nft_pipapo_for_each_field(f, i, m) {
@@ -2304,7 +2753,7 @@ static int nft_pipapo_init(const struct nft_set *set,
 
 		/* f->groups is u8 */
 		BUILD_BUG_ON((NFT_PIPAPO_MAX_BYTES *
-			      BITS_PER_BYTE / NFT_PIPAPO_GROUP_BITS_LARGE_SET) >= 256);
+			      BITS_PER_BYTE / NFT_PIPAPO_GROUP_BITS_HUGE_SET) >= 256);
 
 		f->bb = NFT_PIPAPO_GROUP_BITS_INIT;
 		f->groups = len * NFT_PIPAPO_GROUPS_PER_BYTE(f);
@@ -2318,14 +2767,10 @@ static int nft_pipapo_init(const struct nft_set *set,
 		f->mt = NULL;
 	}
 
+	pipapo_get_scratch();
 	rcu_assign_pointer(priv->match, m);
 
 	return 0;
-
-out_scratch:
-	kfree(m);
-
-	return err;
 }
 
 /**
@@ -2353,6 +2798,7 @@ static void nft_set_pipapo_match_destroy(const struct nft_ctx *ctx,
 		e = f->mt[r].e;
 
 		nf_tables_set_elem_destroy(ctx, set, &e->priv);
+		cond_resched();
 	}
 }
 
@@ -2377,7 +2823,16 @@ static void nft_pipapo_destroy(const struct nft_ctx *ctx,
 		nft_set_pipapo_match_destroy(ctx, set, m);
 	}
 
+	/* Spare copy is only ever referenced by commits older than this one */
+	if (priv->spare) {
+		pipapo_free_match(priv->spare);
+		priv->spare = NULL;
+	}
+	kvfree(priv->log);
+	priv->log = NULL;
+
 	pipapo_free_match(m);
+	pipapo_put_scratch();
 }
 
 /**
@@ -2443,3 +2898,28 @@ const struct nft_set_type nft_set_pipapo_avx2_type = {
 	},
 };
 #endif
+
+#if defined(CONFIG_ARM64) && defined(CONFIG_KERNEL_MODE_NEON)
+const struct nft_set_type nft_set_pipapo_neon_type = {
+	.features	= NFT_SET_INTERVAL | NFT_SET_MAP | NFT_SET_OBJECT |
+			  NFT_SET_TIMEOUT,
+	.ops		= {
+		.lookup		= nft_pipapo_neon_lookup,
+		.insert		= nft_pipapo_insert,
+		.activate	= nft_pipapo_activate,
+		.deactivate	= nft_pipapo_deactivate,
+		.flush		= nft_pipapo_flush,
+		.remove		= nft_pipapo_remove,
+		.walk		= nft_pipapo_walk,
+		.get		= nft_pipapo_get,
+		.privsize	= nft_pipapo_privsize,
+		.estimate	= nft_pipapo_neon_estimate,
+		.init		= nft_pipapo_init,
+		.destroy	= nft_pipapo_destroy,
+		.gc_init	= nft_pipapo_gc_init,
+		.commit		= nft_pipapo_commit,
+		.abort		= nft_pipapo_abort,
+		.elemsize	= offsetof(struct nft_pipapo_elem, ext),
+	},
+};
+#endif
@@ -19,9 +19,11 @@
 #define NFT_PIPAPO_GROUP_BITS_INIT	NFT_PIPAPO_GROUP_BITS_SMALL_SET
 #define NFT_PIPAPO_GROUP_BITS_SMALL_SET	8
 #define NFT_PIPAPO_GROUP_BITS_LARGE_SET	4
-#define NFT_PIPAPO_GROUP_BITS_ARE_8_OR_4				\
+#define NFT_PIPAPO_GROUP_BITS_HUGE_SET	2
+#define NFT_PIPAPO_GROUP_BITS_ARE_8_4_OR_2				\
 	BUILD_BUG_ON((NFT_PIPAPO_GROUP_BITS_SMALL_SET != 8) ||		\
-		     (NFT_PIPAPO_GROUP_BITS_LARGE_SET != 4))
+		     (NFT_PIPAPO_GROUP_BITS_LARGE_SET != 4) ||		\
+		     (NFT_PIPAPO_GROUP_BITS_HUGE_SET != 2))
 #define NFT_PIPAPO_GROUPS_PER_BYTE(f)	(BITS_PER_BYTE / (f)->bb)
 
 /* If a lookup table gets bigger than NFT_PIPAPO_LT_SIZE_HIGH, switch to the
@@ -39,6 +41,16 @@
 #define NFT_PIPAPO_LT_SIZE_LOW		NFT_PIPAPO_LT_SIZE_THRESHOLD -	\
 					NFT_PIPAPO_LT_SIZE_HYSTERESIS
 
+/* Past NFT_PIPAPO_LT_SIZE_HUGE, switch to the huge group width: with four
+ * buckets for each two bits, instead of sixteen for each four bits, a rule
+ * takes half the space, at the cost of twice the bucket intersections on
+ * lookup. Switch back if the table gets smaller than NFT_PIPAPO_LT_SIZE_HUGE_LOW,
+ * that is, if it would then be comfortably below NFT_PIPAPO_LT_SIZE_HUGE.
+ */
+#define NFT_PIPAPO_LT_SIZE_HUGE		(1 << 26)
+#define NFT_PIPAPO_LT_SIZE_HUGE_LOW	(NFT_PIPAPO_LT_SIZE_HUGE / 2 -	\
+					 (NFT_PIPAPO_LT_SIZE_HUGE >> 4))
+
 /* Fields are padded to 32 bits in input registers */
 #define NFT_PIPAPO_GROUPS_PADDED_SIZE(f)				\
 	(round_up((f)->groups / NFT_PIPAPO_GROUPS_PER_BYTE(f), sizeof(u32)))
@@ -126,40 +138,77 @@ struct nft_pipapo_field {
  * struct nft_pipapo_scratch - percpu data used for lookup and matching
  * @map_index:	Current working bitmap index, toggled between field matches
  * @align_off:	Offset to get the originally allocated address
+ * @bsize:	Size of each of the two bitmaps, in longs
+ * @clean:	The inactive bitmap is all-zeroes up to here, in longs
  * @map:	store partial matching results during lookup
  */
 struct nft_pipapo_scratch {
 	u8 map_index;
 	u32 align_off;
+	unsigned int bsize;
+	unsigned int clean;
 	unsigned long map[];
 };
 
+/* Scratch maps, shared by all sets, see pipapo_grow_scratch() */
+DECLARE_PER_CPU(struct nft_pipapo_scratch __rcu *, nft_pipapo_scratch);
+
 /**
  * struct nft_pipapo_match - Data used for lookup and matching
  * @field_count:	Amount of fields in set
  * @bsize_max:		Maximum lookup table bucket size of all fields, in longs
- * @scratch:		Preallocated per-CPU maps for partial matching results
  * @rcu:		Matching data is swapped on commits
  * @f:			Fields, with lookup and mapping tables
  */
 struct nft_pipapo_match {
 	u8 field_count;
 	unsigned int bsize_max;
-	struct nft_pipapo_scratch * __percpu *scratch;
 	struct rcu_head rcu;
 	struct nft_pipapo_field f[] __counted_by(field_count);
 };
 
+/* Keep the previous matching data around for reuse from this size on */
+#define NFT_PIPAPO_SPARE_MIN		(1 << 20)
+
+/* Maximum number of changes a transaction can log, if exceeded, the next
+ * transaction clones matching data from scratch
+ */
+#define NFT_PIPAPO_LOG_MAX		1024
+
+/**
+ * struct nft_pipapo_log_entry - Change to matching data, replayed on spare copy
+ * @e:		Inserted or removed element, don't dereference: might be gone
+ * @insert:	Insertion if set, otherwise removal
+ * @start:	Start of inserted range, all fields, including padding
+ * @end:	End of inserted range, all fields, including padding
+ */
+struct nft_pipapo_log_entry {
+	struct nft_pipapo_elem *e;
+	bool insert;
+	u8 start[NFT_DATA_VALUE_MAXLEN];
+	u8 end[NFT_DATA_VALUE_MAXLEN];
+};
+
 /**
  * struct nft_pipapo - Representation of a set
  * @match:	Currently in-use matching data
  * @clone:	Copy where pending insertions and deletions are kept
+ * @spare:	Matching data replaced by the last commit, if kept for reuse
+ * @spare_gp:	RCU grace period state at the time @spare was replaced
+ * @log:	Changes done by the last transaction, NFT_PIPAPO_LOG_MAX entries
+ * @log_len:	Number of entries in @log
+ * @log_valid:	@log contains all the changes done by the last transaction
  * @width:	Total bytes to be matched for one packet, including padding
  * @last_gc:	Timestamp of last garbage collection run, jiffies
  */
 struct nft_pipapo {
 	struct nft_pipapo_match __rcu *match;
 	struct nft_pipapo_match *clone;
+	struct nft_pipapo_match *spare;
+	unsigned long spare_gp;
+	struct nft_pipapo_log_entry *log;
+	unsigned int log_len;
+	bool log_valid;
 	int width;
 	unsigned long last_gc;
 };
@@ -228,6 +277,49 @@ static inline void pipapo_and_field_buckets_8bit(const struct nft_pipapo_field *
 	}
 }
 
+/**
+ * pipapo_and_field_buckets_2bit() - Intersect 2-bit buckets
+ * @f:		Field including lookup table
+ * @dst:	Area to store result
+ * @data:	Input data selecting table buckets
+ */
+static inline void pipapo_and_field_buckets_2bit(const struct nft_pipapo_field *f,
+						 unsigned long *dst,
+						 const u8 *data)
+{
+	unsigned long *lt = NFT_PIPAPO_LT_ALIGN(f->lt);
+	int group;
+
+	for (group = 0; group < f->groups; group++) {
+		int shift = BITS_PER_BYTE - 2 * (group % 4 + 1);
+		u8 v = (data[group / 4] >> shift) & 0x03;
+
+		__bitmap_and(dst, dst, lt + v * f->bsize,
+			     f->bsize * BITS_PER_LONG);
+		lt += f->bsize * NFT_PIPAPO_BUCKETS(2);
+	}
+}
+
+/**
+ * pipapo_and_field_buckets() - Intersect buckets for any group width
+ * @f:		Field including lookup table
+ * @dst:	Area to store result
+ * @data:	Input data selecting table buckets
+ */
+static inline void pipapo_and_field_buckets(const struct nft_pipapo_field *f,
+					    unsigned long *dst,
+					    const u8 *data)
+{
+	NFT_PIPAPO_GROUP_BITS_ARE_8_4_OR_2;
+
+	if (likely(f->bb == 8))
+		pipapo_and_field_buckets_8bit(f, dst, data);
+	else if (likely(f->bb == 4))
+		pipapo_and_field_buckets_4bit(f, dst, data);
+	else
+		pipapo_and_field_buckets_2bit(f, dst, data);
+}
+
 /**
  * pipapo_estimate_size() - Estimate worst-case for set size
  * @desc:	Set description, element count and field description used here
@@ -299,4 +391,34 @@ static inline void pipapo_resmap_init(const struct nft_pipapo_match *m, unsigned
 	for (i = f->bsize; i < m->bsize_max; i++)
 		res_map[i] = 0ul;
 }
+
+/**
+ * pipapo_scratch_get() - Get scratch maps for this CPU, bottom halves disabled
+ * @m:		Matching data the maps are used for
+ *
+ * Lookups leave the inactive map all-zeroes only up to the bucket size of
+ * their own set, and the maps are shared by all sets: if a set with
+ * smaller buckets used them last, clear the rest of the inactive map.
+ *
+ * Return: scratch maps, NULL if they don't cover the bucket size of @m yet.
+ */
+static inline struct nft_pipapo_scratch *
+pipapo_scratch_get(const struct nft_pipapo_match *m)
+{
+	struct nft_pipapo_scratch *s;
+	unsigned long *fill_map;
+
+	s = rcu_dereference(*raw_cpu_ptr(&nft_pipapo_scratch));
+	if (unlikely(!s || s->bsize < m->bsize_max))
+		return NULL;
+
+	if (unlikely(s->clean < m->bsize_max)) {
+		fill_map = s->map + (s->map_index ? 0 : s->bsize);
+		memset(fill_map + s->clean, 0,
+		       (m->bsize_max - s->clean) * sizeof(*fill_map));
+	}
+	s->clean = m->bsize_max;
+
+	return s;
+}
 #endif /* _NFT_SET_PIPAPO_H */
@@ -1047,8 +1047,8 @@ static int nft_pipapo_avx2_lookup_8b_16(unsigned long *map, unsigned long *fill,
  * @last:	Last field: stop at the first match and return bit index
  *
  * This function should never be called, but is provided for the case the field
- * size doesn't match any of the known data types. Matching rate is
- * substantially lower than AVX2 routines.
+ * size doesn't match any of the known data types, and for the 2-bit group
+ * width of huge sets. Matching rate is substantially lower than AVX2 routines.
  *
  * Return: -1 on no match, rule index of match if @last, otherwise first long
  * word index to be checked next (i.e. first filled word).
@@ -1066,11 +1066,7 @@ static int nft_pipapo_avx2_lookup_slow(const struct nft_pipapo_match *mdata,
 		pipapo_resmap_init(mdata, map);
 
 	for (i = offset; i < bsize; i++) {
-		if (f->bb == 8)
-			pipapo_and_field_buckets_8bit(f, map, pkt);
-		else
-			pipapo_and_field_buckets_4bit(f, map, pkt);
-		NFT_PIPAPO_GROUP_BITS_ARE_8_OR_4;
+		pipapo_and_field_buckets(f, map, pkt);
 
 		b = pipapo_refill(map, bsize, f->rules, fill, f->mt, last);
 
@@ -1133,62 +1129,29 @@ static inline void pipapo_resmap_init_avx2(const struct nft_pipapo_match *m, uns
 }
 
 /**
- * nft_pipapo_avx2_lookup() - Lookup function for AVX2 implementation
- * @net:	Network namespace
- * @set:	nftables API set representation
- * @key:	nftables API element representation containing key data
+ * nft_pipapo_avx2_lookup_one() - Match a single key, FPU section held
+ * @m:		Matching data
+ * @scratch:	Scratch maps for this CPU
+ * @rp:		Key data
+ * @genmask:	nftables API generation mask
  * @ext:	nftables API extension pointer, filled with matching reference
  *
- * For more details, see DOC: Theory of Operation in nft_set_pipapo.c.
- *
- * This implementation exploits the repetitive characteristic of the algorithm
- * to provide a fast, vectorised version using the AVX2 SIMD instruction set.
- *
  * Return: true on match, false otherwise.
  */
-bool nft_pipapo_avx2_lookup(const struct net *net, const struct nft_set *set,
-			    const u32 *key, const struct nft_set_ext **ext)
+static bool nft_pipapo_avx2_lookup_one(const struct nft_pipapo_match *m,
+				       struct nft_pipapo_scratch *scratch,
+				       const u8 *rp, u8 genmask,
+				       const struct nft_set_ext **ext)
 {
-	struct nft_pipapo *priv = nft_set_priv(set);
-	struct nft_pipapo_scratch *scratch;
-	u8 genmask = nft_genmask_cur(net);
-	const struct nft_pipapo_match *m;
 	const struct nft_pipapo_field *f;
-	const u8 *rp = (const u8 *)key;
 	unsigned long *res, *fill;
 	bool map_index;
 	int i, ret = 0;
 
-	local_bh_disable();
-
-	if (unlikely(!irq_fpu_usable())) {
-		bool fallback_res = nft_pipapo_lookup(net, set, key, ext);
-
-		local_bh_enable();
-		return fallback_res;
-	}
-
-	m = rcu_dereference(priv->match);
-
-	/* This also protects access to all data related to scratch maps.
-	 *
-	 * Note that we don't need a valid MXCSR state for any of the
-	 * operations we use here, so pass 0 as mask and spare a LDMXCSR
-	 * instruction.
-	 */
-	kernel_fpu_begin_mask(0);
-
-	scratch = *raw_cpu_ptr(m->scratch);
-	if (unlikely(!scratch)) {
-		kernel_fpu_end();
-		local_bh_enable();
-		return false;
-	}
-
 	map_index = scratch->map_index;
 
-	res  = scratch->map + (map_index ? m->bsize_max : 0);
-	fill = scratch->map + (map_index ? 0 : m->bsize_max);
+	res  = scratch->map + (map_index ? scratch->bsize : 0);
+	fill = scratch->map + (map_index ? 0 : scratch->bsize);
 
 	pipapo_resmap_init_avx2(m, res);
 
@@ -1219,7 +1182,7 @@ bool nft_pipapo_avx2_lookup(const struct net *net, const struct nft_set *set,
 								  ret, rp,
 								  first, last);
 			}
-		} else {
+		} else if (likely(f->bb == 4)) {
 			if (f->groups == 2) {
 				NFT_SET_PIPAPO_AVX2_LOOKUP(4, 2);
 			} else if (f->groups == 4) {
@@ -1235,8 +1198,11 @@ bool nft_pipapo_avx2_lookup(const struct net *net, const struct nft_set *set,
 								  ret, rp,
 								  first, last);
 			}
+		} else {
+			ret = nft_pipapo_avx2_lookup_slow(m, res, fill, f,
+							  ret, rp, first, last);
 		}
-		NFT_PIPAPO_GROUP_BITS_ARE_8_OR_4;
+		NFT_PIPAPO_GROUP_BITS_ARE_8_4_OR_2;
 
 #undef NFT_SET_PIPAPO_AVX2_LOOKUP
 
@@ -1261,8 +1227,58 @@ bool nft_pipapo_avx2_lookup(const struct net *net, const struct nft_set *set,
 out:
 	if (i % 2)
 		scratch->map_index = !map_index;
+
+	return ret >= 0;
+}
+
+/**
+ * nft_pipapo_avx2_lookup() - Lookup function for AVX2 implementation
+ * @net:	Network namespace
+ * @set:	nftables API set representation
+ * @key:	nftables API element representation containing key data
+ * @ext:	nftables API extension pointer, filled with matching reference
+ *
+ * For more details, see DOC: Theory of Operation in nft_set_pipapo.c.
+ *
+ * This implementation exploits the repetitive characteristic of the algorithm
+ * to provide a fast, vectorised version using the AVX2 SIMD instruction set.
+ *
+ * Return: true on match, false otherwise.
+ */
+bool nft_pipapo_avx2_lookup(const struct net *net, const struct nft_set *set,
+			    const u32 *key, const struct nft_set_ext **ext)
+{
+	struct nft_pipapo *priv = nft_set_priv(set);
+	struct nft_pipapo_scratch *scratch;
+	const struct nft_pipapo_match *m;
+	bool ret = false;
+
+	local_bh_disable();
+
+	if (unlikely(!irq_fpu_usable())) {
+		bool fallback_res = nft_pipapo_lookup(net, set, key, ext);
+
+		local_bh_enable();
+		return fallback_res;
+	}
+
+	m = rcu_dereference(priv->match);
+
+	/* This also protects access to all data related to scratch maps.
+	 *
+	 * Note that we don't need a valid MXCSR state for any of the
+	 * operations we use here, so pass 0 as mask and spare a LDMXCSR
+	 * instruction.
+	 */
+	kernel_fpu_begin_mask(0);
+
+	scratch = pipapo_scratch_get(m);
+	if (likely(scratch))
+		ret = nft_pipapo_avx2_lookup_one(m, scratch, (const u8 *)key,
+						 nft_genmask_cur(net), ext);
+
 	kernel_fpu_end();
 	local_bh_enable();
 
-	return ret >= 0;
+	return ret;
 }
@@ -0,0 +1,17 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef _NFT_SET_PIPAPO_NEON_H
+#define _NFT_SET_PIPAPO_NEON_H
+
+#if defined(CONFIG_ARM64) && defined(CONFIG_KERNEL_MODE_NEON)
+struct nft_pipapo_field;
+
+bool nft_pipapo_neon_estimate(const struct nft_set_desc *desc, u32 features,
+			      struct nft_set_estimate *est);
+
+/* built with FP/SIMD registers enabled, call within kernel_neon_begin/end() */
+int nft_pipapo_neon_lookup_field(unsigned long *map, unsigned long *fill,
+				 const struct nft_pipapo_field *f, int offset,
+				 const u8 *pkt, bool first, bool last);
+#endif /* defined(CONFIG_ARM64) && defined(CONFIG_KERNEL_MODE_NEON) */
+
+#endif /* _NFT_SET_PIPAPO_NEON_H */
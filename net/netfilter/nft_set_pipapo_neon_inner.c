@@ -0,0 +1,158 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+/* PIPAPO: PIle PAcket POlicies: NEON field matching for arm64
+ *
+ * This file is built with FP/SIMD registers enabled, so it must only be
+ * called between kernel_neon_begin() and kernel_neon_end(), see
+ * nft_set_pipapo_neon.c.
+ */
+
+#include <linux/kernel.h>
+#include <linux/bitmap.h>
+#include <linux/bitops.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nf_tables.h>
+#include <net/netfilter/nf_tables_core.h>
+
+#include <asm/neon-intrinsics.h>
+
+#include "nft_set_pipapo_neon.h"
+#include "nft_set_pipapo.h"
+
+/* One Q register holds two words of a bucket */
+#define NFT_PIPAPO_LONGS_PER_Q		(128 / BITS_PER_LONG)
+
+/**
+ * nft_pipapo_neon_refill() - Scan words of a bitmap, set bits from mapping table
+ * @map:	Words of the bitmap to be scanned, cleared while scanning
+ * @offset:	Index of the first word in @map, in the whole bitmap
+ * @len:	Count of words to scan
+ * @dst:	Destination bitmap
+ * @f:		Field, containing mapping table
+ * @last:	Return index of first set bit, if this is the last field
+ *
+ * Same as pipapo_refill(), restricted to the words just matched.
+ *
+ * Return: first set bit index if @last, index of first filled word
+ * otherwise, -1 if no bits are set.
+ */
+static int nft_pipapo_neon_refill(unsigned long *map, int offset, int len,
+				  unsigned long *dst,
+				  const struct nft_pipapo_field *f, bool last)
+{
+	int k, ret = -1;
+
+	for (k = 0; k < len; k++) {
+		while (map[k]) {
+			int r = __builtin_ctzl(map[k]);
+			int i = (offset + k) * BITS_PER_LONG + r;
+
+			map[k] &= ~(1UL << r);
+
+			if (unlikely(i >= f->rules)) {
+				map[k] = 0;
+				return ret;
+			}
+
+			if (last)
+				return i;
+
+			bitmap_set(dst, f->mt[i].to, f->mt[i].n);
+
+			if (ret == -1)
+				ret = f->mt[i].to / BITS_PER_LONG;
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * nft_pipapo_neon_lookup_field() - NEON-based matching for one field
+ * @map:	Previous match result, used as initial bitmap
+ * @fill:	Destination bitmap to be filled with current match result
+ * @f:		Field, containing lookup and mapping tables
+ * @offset:	Ignore words before the given index, no bits are filled there
+ * @pkt:	Packet data, pointer to input nftables register
+ * @first:	If this is the first field, don't source previous result
+ * @last:	Last field: stop at the first match and return bit index
+ *
+ * Unlike the generic implementation, which intersects whole buckets group by
+ * group, go through buckets two words at a time, intersect the matching
+ * buckets of all groups in a Q register, store the result and refill the
+ * next bitmap from it right away, so that each word of the result is written
+ * only once. Words that were already empty in @map are skipped.
+ *
+ * Calling this again for the last field, with @first unset, returns the next
+ * matching rule, if any.
+ *
+ * Return: -1 on no match, rule index of match if @last, otherwise first long
+ * word index to be checked next (i.e. first filled word).
+ */
+int nft_pipapo_neon_lookup_field(unsigned long *map, unsigned long *fill,
+				 const struct nft_pipapo_field *f, int offset,
+				 const u8 *pkt, bool first, bool last)
+{
+	u8 pg[NFT_PIPAPO_MAX_BITS / NFT_PIPAPO_GROUP_BITS_HUGE_SET];
+	unsigned int buckets = NFT_PIPAPO_BUCKETS(f->bb);
+	const unsigned long *lt = f->lt;
+	int i, g, b, ret = -1;
+
+	NFT_PIPAPO_GROUP_BITS_ARE_8_4_OR_2;
+
+	for (g = 0; g < f->groups; g++) {
+		int per_byte = NFT_PIPAPO_GROUPS_PER_BYTE(f);
+		int shift = BITS_PER_BYTE - f->bb * (g % per_byte + 1);
+
+		pg[g] = (pkt[g / per_byte] >> shift) & (buckets - 1);
+	}
+
+	for (i = offset; i < f->bsize; i += NFT_PIPAPO_LONGS_PER_Q) {
+		int len = min_t(int, NFT_PIPAPO_LONGS_PER_Q, f->bsize - i);
+
+		if (likely(len == NFT_PIPAPO_LONGS_PER_Q)) {
+			uint64x2_t acc;
+
+			if (first) {
+				acc = vdupq_n_u64(~0ULL);
+			} else {
+				acc = vld1q_u64((const u64 *)&map[i]);
+				if (!(vgetq_lane_u64(acc, 0) |
+				      vgetq_lane_u64(acc, 1)))
+					continue;
+			}
+
+			for (g = 0; g < f->groups; g++) {
+				const unsigned long *bucket;
+
+				bucket = lt + (g * buckets + pg[g]) * f->bsize;
+				acc = vandq_u64(acc,
+						vld1q_u64((const u64 *)&bucket[i]));
+			}
+
+			vst1q_u64((u64 *)&map[i], acc);
+		} else {
+			unsigned long acc = first ? ULONG_MAX : map[i];
+
+			if (!acc)
+				continue;
+
+			for (g = 0; g < f->groups; g++)
+				acc &= lt[(g * buckets + pg[g]) * f->bsize + i];
+
+			map[i] = acc;
+		}
+
+		b = nft_pipapo_neon_refill(&map[i], i, len, fill, f, last);
+		if (b < 0)
+			continue;
+
+		if (last)
+			return b;
+
+		if (ret == -1)
+			ret = b;
+	}
+
+	return ret;
+}
@@ -10,16 +10,20 @@
 #include <linux/module.h>
 #include <linux/list.h>
 #include <linux/rbtree.h>
+#include <linux/prefetch.h>
 #include <linux/netlink.h>
 #include <linux/netfilter.h>
 #include <linux/netfilter/nf_tables.h>
 #include <net/netfilter/nf_tables_core.h>
 
+struct nft_rbtree_array;
+
 struct nft_rbtree {
 	struct rb_root		root;
 	rwlock_t		lock;
 	seqcount_rwlock_t	count;
 	unsigned long		last_gc;
+	struct nft_rbtree_array __rcu *array;
 };
 
 struct nft_rbtree_elem {
@@ -28,6 +32,17 @@ struct nft_rbtree_elem {
 	struct nft_set_ext	ext;
 };
 
+/* Sorted copy of the keys in the tree, rebuilt on commit and used by the
+ * packet path instead of the tree, so that lookups never wait for writers.
+ * An interval end, or a key with no element left, is a NULL element.
+ */
+struct nft_rbtree_array {
+	struct rcu_head			rcu;
+	unsigned int			num;
+	u8				*keys;
+	const struct nft_rbtree_elem	*elems[];
+};
+
 static bool nft_rbtree_interval_end(const struct nft_rbtree_elem *rbe)
 {
 	return nft_set_ext_exists(&rbe->ext, NFT_SET_EXT_FLAGS) &&
@@ -113,14 +128,73 @@ static bool __nft_rbtree_lookup(const struct net *net, const struct nft_set *set
 	return false;
 }
 
+static const u8 *nft_rbtree_array_key(const struct nft_set *set,
+				      const struct nft_rbtree_array *array,
+				      unsigned int i)
+{
+	return array->keys + i * set->klen;
+}
+
+/* Find the last key not greater than @key: it matches if it's an interval
+ * start or, for sets without intervals, if it's the same key.
+ */
+static bool nft_rbtree_array_lookup(const struct net *net,
+				    const struct nft_set *set,
+				    const struct nft_rbtree_array *array,
+				    const u32 *key,
+				    const struct nft_set_ext **ext)
+{
+	unsigned int lo = 0, hi = array->num;
+	const struct nft_rbtree_elem *rbe;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		/* whichever way this goes, the next key is one of these */
+		prefetch(nft_rbtree_array_key(set, array, lo + (mid - lo) / 2));
+		prefetch(nft_rbtree_array_key(set, array, mid + (hi - mid) / 2));
+
+		if (memcmp(nft_rbtree_array_key(set, array, mid), key,
+			   set->klen) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (!lo)
+		return false;
+
+	rbe = array->elems[lo - 1];
+	if (!rbe)
+		return false;
+
+	if (!(set->flags & NFT_SET_INTERVAL) &&
+	    memcmp(nft_rbtree_array_key(set, array, lo - 1), key, set->klen))
+		return false;
+
+	if (!nft_set_elem_active(&rbe->ext, nft_genmask_cur(net)) ||
+	    nft_rbtree_elem_expired(rbe))
+		return false;
+
+	*ext = &rbe->ext;
+	return true;
+}
+
 INDIRECT_CALLABLE_SCOPE
 bool nft_rbtree_lookup(const struct net *net, const struct nft_set *set,
 		       const u32 *key, const struct nft_set_ext **ext)
 {
 	struct nft_rbtree *priv = nft_set_priv(set);
-	unsigned int seq = read_seqcount_begin(&priv->count);
+	const struct nft_rbtree_array *array;
+	unsigned int seq;
 	bool ret;
 
+	array = rcu_dereference(priv->array);
+	if (likely(array))
+		return nft_rbtree_array_lookup(net, set, array, key, ext);
+
+	seq = read_seqcount_begin(&priv->count);
+
 	ret = __nft_rbtree_lookup(net, set, key, ext, seq);
 	if (ret || !read_seqcount_retry(&priv->count, seq))
 		return ret;
@@ -232,6 +306,84 @@ static void nft_rbtree_gc_elem_remove(struct net *net, struct nft_set *set,
 	rb_erase(&rbe->node, &priv->root);
 }
 
+/* Stop using the array, before elements it refers to can be freed */
+static void nft_rbtree_array_drop(struct nft_rbtree *priv)
+{
+	struct nft_rbtree_array *old;
+
+	old = rcu_replace_pointer(priv->array, NULL, true);
+	if (old)
+		kvfree_rcu(old, rcu);
+}
+
+/* Called on commit, with the new generation already current. Expired
+ * elements are left out, so that the ones garbage collection frees next are
+ * never referenced by the array.
+ */
+static void nft_rbtree_array_build(const struct nft_set *set,
+				   struct nft_rbtree *priv)
+{
+	struct net *net = read_pnet(&set->net);
+	u8 genmask = nft_genmask_cur(net);
+	u64 tstamp = nft_net_tstamp(net);
+	struct nft_rbtree_array *array;
+	unsigned int num = 0;
+	struct rb_node *node;
+	size_t size;
+
+	for (node = rb_first(&priv->root); node; node = rb_next(node))
+		num++;
+
+	size = struct_size(array, elems, num);
+	if (check_add_overflow(size, array_size(num, set->klen), &size))
+		goto err;
+
+	array = kvmalloc(size, GFP_KERNEL_ACCOUNT);
+	if (!array)
+		goto err;
+
+	array->keys = (u8 *)&array->elems[num];
+	array->num = 0;
+
+	/* the tree is sorted from highest to lowest key */
+	for (node = rb_last(&priv->root); node; node = rb_prev(node)) {
+		struct nft_rbtree_elem *rbe;
+		const void *key;
+		bool end;
+
+		rbe = rb_entry(node, struct nft_rbtree_elem, node);
+		if (!nft_set_elem_active(&rbe->ext, genmask))
+			continue;
+
+		end = nft_rbtree_interval_end(rbe);
+		if (!end && __nft_set_elem_expired(&rbe->ext, tstamp))
+			continue;
+
+		key = nft_set_ext_key(&rbe->ext);
+
+		/* end of an interval and start of the next one: start wins */
+		if (array->num &&
+		    !memcmp(nft_rbtree_array_key(set, array, array->num - 1),
+			    key, set->klen)) {
+			if (end)
+				continue;
+			array->num--;
+		}
+
+		array->elems[array->num] = end ? NULL : rbe;
+		memcpy(array->keys + array->num * set->klen, key, set->klen);
+		array->num++;
+	}
+
+	array = rcu_replace_pointer(priv->array, array, true);
+	if (array)
+		kvfree_rcu(array, rcu);
+
+	return;
+err:
+	nft_rbtree_array_drop(priv);
+}
+
 static const struct nft_rbtree_elem *
 nft_rbtree_gc_elem(const struct nft_set *__set, struct nft_rbtree *priv,
 		   struct nft_rbtree_elem *rbe)
@@ -246,6 +398,9 @@ nft_rbtree_gc_elem(const struct nft_set *__set, struct nft_rbtree *priv,
 	if (!gc)
 		return ERR_PTR(-ENOMEM);
 
+	/* back to the tree until the next commit */
+	nft_rbtree_array_drop(priv);
+
 	/* search for end interval coming before this element.
 	 * end intervals don't carry a timeout extension, they
 	 * are coupled with the interval start element.
@@ -593,14 +748,28 @@ static void nft_rbtree_walk(const struct nft_ctx *ctx,
 	struct nft_rbtree *priv = nft_set_priv(set);
 	struct nft_rbtree_elem *rbe;
 	struct rb_node *node;
+	u32 seq;
 
 	read_lock_bh(&priv->lock);
-	for (node = rb_first(&priv->root); node != NULL; node = rb_next(node)) {
+	node = rb_first(&priv->root);
+
+	/* The tree is left untouched while the sequence count doesn't change,
+	 * the element the previous walk stopped at is still linked then.
+	 */
+	seq = raw_read_seqcount(&priv->count);
+	if (iter->pos_gen == seq && nft_set_iter_resume(iter)) {
+		rbe = (struct nft_rbtree_elem *)iter->pos;
+		node = &rbe->node;
+	}
+	iter->pos_gen = seq;
+
+	for (; node != NULL; node = rb_next(node)) {
 		rbe = rb_entry(node, struct nft_rbtree_elem, node);
 
 		if (iter->count < iter->skip)
 			goto cont;
 
+		iter->pos = (unsigned long)rbe;
 		iter->err = iter->fn(ctx, set, iter, &rbe->priv);
 		if (iter->err < 0) {
 			read_unlock_bh(&priv->lock);
@@ -699,6 +868,7 @@ static int nft_rbtree_init(const struct nft_set *set,
 	rwlock_init(&priv->lock);
 	seqcount_rwlock_init(&priv->count, &priv->lock);
 	priv->root = RB_ROOT;
+	RCU_INIT_POINTER(priv->array, NULL);
 
 	return 0;
 }
@@ -710,10 +880,13 @@ static void nft_rbtree_destroy(const struct nft_ctx *ctx,
 	struct nft_rbtree_elem *rbe;
 	struct rb_node *node;
 
+	kvfree(rcu_dereference_protected(priv->array, true));
+
 	while ((node = priv->root.rb_node) != NULL) {
 		rb_erase(node, &priv->root);
 		rbe = rb_entry(node, struct nft_rbtree_elem, node);
 		nf_tables_set_elem_destroy(ctx, set, &rbe->priv);
+		cond_resched();
 	}
 }
 
@@ -739,6 +912,8 @@ static void nft_rbtree_commit(struct nft_set *set)
 {
 	struct nft_rbtree *priv = nft_set_priv(set);
 
+	nft_rbtree_array_build(set, priv);
+
 	if (time_after_eq(jiffies, priv->last_gc + nft_set_gc_interval(set)))
 		nft_rbtree_gc(set);
 }
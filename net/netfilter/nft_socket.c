@@ -3,6 +3,7 @@
 #include <linux/netfilter/nf_tables.h>
 #include <net/netfilter/nf_tables.h>
 #include <net/netfilter/nf_tables_core.h>
+#include <net/netfilter/nf_conntrack_sock.h>
 #include <net/netfilter/nf_socket.h>
 #include <net/inet_sock.h>
 #include <net/tcp.h>
@@ -87,6 +88,10 @@ static struct sock *nft_socket_do_lookup(const struct nft_pktinfo *pkt)
 	if (!indev)
 		return NULL;
 
+	sk = nf_ct_sk_get(skb);
+	if (sk)
+		return sk;
+
 	switch (nft_pf(pkt)) {
 	case NFPROTO_IPV4:
 		sk = nf_sk_lookup_slow_v4(nft_net(pkt), skb, indev);
@@ -101,6 +106,7 @@ static struct sock *nft_socket_do_lookup(const struct nft_pktinfo *pkt)
 		break;
 	}
 
+	nf_ct_sk_set(skb, sk);
 	return sk;
 }
 
@@ -0,0 +1,433 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Multi-pattern payload search for nf_tables.
+ *
+ * Matching a packet against N strings with xt_string takes N rules and
+ * N passes over the payload.  The "string" expression compiles all of
+ * its patterns into a single Aho-Corasick automaton, see lib/ts_ac.c,
+ * and tells which one matched in one pass, optionally storing its index
+ * in a register for a verdict map lookup.
+ *
+ * The patterns are either listed in the expression or taken from the
+ * keys of a constant set, anonymous ones included, so that rules can
+ * share them.  Keys have a fixed length: as for interface names, the
+ * trailing zero bytes of a key are not part of the pattern.  If the set
+ * is a map with u32 values, the value of the element that matched is
+ * stored in the register instead of an index.
+ */
+
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/skbuff.h>
+#include <linux/textsearch.h>
+#include <linux/netlink.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nf_tables.h>
+#include <linux/netfilter/nft_string.h>
+#include <net/netfilter/nf_tables.h>
+
+struct nft_string {
+	struct ts_config	*config;
+	struct nft_set		*set;
+	struct nft_set_binding	binding;
+	u32			*ids;
+	u32			from;
+	u32			to;
+	u32			flags;
+	u8			dreg;
+	bool			dreg_set;
+};
+
+static void nft_string_eval(const struct nft_expr *expr,
+			    struct nft_regs *regs,
+			    const struct nft_pktinfo *pkt)
+{
+	const struct nft_string *priv = nft_expr_priv(expr);
+	struct sk_buff *skb = pkt->skb;
+	unsigned int nhoff, from, to;
+	struct ts_state state;
+
+	nhoff = skb_network_offset(skb);
+	if (priv->from >= skb->len - nhoff)
+		goto nomatch;
+
+	from = nhoff + priv->from;
+	to = nhoff + min(priv->to, skb->len - nhoff);
+
+	if (skb_find_text_state(skb, from, to, priv->config,
+				&state) == UINT_MAX)
+		goto nomatch;
+
+	if (priv->dreg_set)
+		regs->data[priv->dreg] = priv->ids ? priv->ids[state.id] :
+						     state.id;
+	return;
+nomatch:
+	regs->verdict.code = NFT_BREAK;
+}
+
+static const struct nla_policy nft_string_policy[NFTA_STRING_MAX + 1] = {
+	[NFTA_STRING_PATTERNS]	= { .type = NLA_NESTED },
+	[NFTA_STRING_FROM]	= { .type = NLA_U32 },
+	[NFTA_STRING_TO]	= { .type = NLA_U32 },
+	[NFTA_STRING_FLAGS]	= NLA_POLICY_MASK(NLA_BE32, NFT_STRING_F_ICASE),
+	[NFTA_STRING_DREG]	= { .type = NLA_U32 },
+	[NFTA_STRING_SET]	= { .type = NLA_STRING,
+				    .len = NFT_SET_MAXNAMELEN - 1 },
+	[NFTA_STRING_SET_ID]	= { .type = NLA_U32 },
+};
+
+/* Flatten the pattern list into the pattern set format of ts_ac. */
+static u8 *nft_string_set(const struct nlattr *attr, unsigned int *set_len)
+{
+	unsigned int n = 0, len = 0;
+	const struct nlattr *tmp;
+	int rem;
+	u8 *set;
+
+	nla_for_each_nested(tmp, attr, rem) {
+		if (nla_type(tmp) != NFTA_STRING_PATTERN ||
+		    nla_len(tmp) == 0 ||
+		    nla_len(tmp) > NFT_STRING_MAX_PATTERN_LEN)
+			return ERR_PTR(-EINVAL);
+		if (++n > NFT_STRING_MAX_PATTERNS)
+			return ERR_PTR(-E2BIG);
+		len += 1 + nla_len(tmp);
+	}
+	if (n == 0 || len > TS_AC_MAX_SET_LEN)
+		return ERR_PTR(-EINVAL);
+
+	set = kmalloc(len, GFP_KERNEL_ACCOUNT);
+	if (!set)
+		return ERR_PTR(-ENOMEM);
+
+	len = 0;
+	nla_for_each_nested(tmp, attr, rem) {
+		set[len++] = nla_len(tmp);
+		memcpy(set + len, nla_data(tmp), nla_len(tmp));
+		len += nla_len(tmp);
+	}
+	*set_len = len;
+
+	return set;
+}
+
+struct nft_string_walk {
+	struct nft_set_iter	iter;
+	unsigned int		n;
+	unsigned int		len;
+	u8			*set;
+	u32			*ids;
+};
+
+static unsigned int nft_string_key_len(const struct nft_set *set,
+				       const struct nft_set_ext *ext)
+{
+	const u8 *key = (const u8 *)nft_set_ext_key(ext)->data;
+	unsigned int len = set->klen;
+
+	while (len > 0 && key[len - 1] == 0)
+		len--;
+
+	return len;
+}
+
+static int nft_string_walk_elem(const struct nft_ctx *ctx,
+				struct nft_set *set,
+				const struct nft_set_iter *iter,
+				struct nft_elem_priv *elem_priv)
+{
+	struct nft_string_walk *w = container_of(iter, struct nft_string_walk,
+						 iter);
+	const struct nft_set_ext *ext = nft_set_elem_ext(set, elem_priv);
+	unsigned int len;
+
+	if (!nft_set_elem_active(ext, iter->genmask))
+		return 0;
+
+	len = nft_string_key_len(set, ext);
+	if (len == 0 || len > NFT_STRING_MAX_PATTERN_LEN)
+		return -EINVAL;
+	if (w->n >= NFT_STRING_MAX_PATTERNS)
+		return -E2BIG;
+
+	/* First pass sizes the set, second one fills it. */
+	if (w->set) {
+		w->set[w->len] = len;
+		memcpy(w->set + w->len + 1, nft_set_ext_key(ext)->data, len);
+		if (w->ids)
+			w->ids[w->n] = nft_set_ext_data(ext)->data[0];
+	}
+	w->len += 1 + len;
+	w->n++;
+
+	return 0;
+}
+
+static int nft_string_walk(const struct nft_ctx *ctx, struct nft_set *set,
+			   struct nft_string_walk *w)
+{
+	w->iter.genmask	= nft_genmask_next(ctx->net);
+	w->iter.type	= NFT_ITER_UPDATE;
+	w->iter.skip	= 0;
+	w->iter.count	= 0;
+	w->iter.err	= 0;
+	w->iter.fn	= nft_string_walk_elem;
+	w->n		= 0;
+	w->len		= 0;
+
+	set->ops->walk(ctx, set, &w->iter);
+
+	return w->iter.err;
+}
+
+/* Collect the keys of @set into the pattern set format of ts_ac, and
+ * the u32 values of a map into @ids.
+ */
+static u8 *nft_string_set_elems(const struct nft_ctx *ctx,
+				struct nft_set *set, unsigned int *set_len,
+				u32 **ids)
+{
+	struct nft_string_walk w = {};
+	int err;
+
+	err = nft_string_walk(ctx, set, &w);
+	if (err < 0)
+		return ERR_PTR(err);
+	if (w.n == 0 || w.len > TS_AC_MAX_SET_LEN)
+		return ERR_PTR(-EINVAL);
+
+	w.set = kmalloc(w.len, GFP_KERNEL_ACCOUNT);
+	if (!w.set)
+		return ERR_PTR(-ENOMEM);
+
+	if (set->flags & NFT_SET_MAP) {
+		w.ids = kmalloc_array(w.n, sizeof(u32), GFP_KERNEL_ACCOUNT);
+		if (!w.ids) {
+			err = -ENOMEM;
+			goto err;
+		}
+	}
+
+	/* the set is constant and we hold the commit mutex, it can't have
+	 * changed in between.
+	 */
+	err = nft_string_walk(ctx, set, &w);
+	if (err < 0)
+		goto err;
+
+	*set_len = w.len;
+	*ids = w.ids;
+
+	return w.set;
+err:
+	kfree(w.ids);
+	kfree(w.set);
+	return ERR_PTR(err);
+}
+
+static int nft_string_init(const struct nft_ctx *ctx,
+			   const struct nft_expr *expr,
+			   const struct nlattr * const tb[])
+{
+	struct nft_string *priv = nft_expr_priv(expr);
+	u8 genmask = nft_genmask_next(ctx->net);
+	int ts_flags = TS_AUTOLOAD;
+	struct nft_set *elems = NULL;
+	unsigned int set_len;
+	int err;
+	u8 *set;
+
+	if (!tb[NFTA_STRING_PATTERNS] == !tb[NFTA_STRING_SET])
+		return -EINVAL;
+
+	if (tb[NFTA_STRING_SET]) {
+		elems = nft_set_lookup_global(ctx->net, ctx->table,
+					      tb[NFTA_STRING_SET],
+					      tb[NFTA_STRING_SET_ID], genmask);
+		if (IS_ERR(elems))
+			return PTR_ERR(elems);
+
+		/* The patterns are compiled once, here. */
+		if (!(elems->flags & NFT_SET_CONSTANT) ||
+		    elems->flags & (NFT_SET_INTERVAL | NFT_SET_OBJECT))
+			return -EOPNOTSUPP;
+		if (elems->flags & NFT_SET_MAP &&
+		    (elems->dtype == NFT_DATA_VERDICT ||
+		     elems->dlen != sizeof(u32)))
+			return -EOPNOTSUPP;
+	}
+
+	priv->to = U32_MAX;
+	if (tb[NFTA_STRING_FROM])
+		priv->from = ntohl(nla_get_be32(tb[NFTA_STRING_FROM]));
+	if (tb[NFTA_STRING_TO])
+		priv->to = ntohl(nla_get_be32(tb[NFTA_STRING_TO]));
+	if (priv->from > priv->to)
+		return -EINVAL;
+
+	if (tb[NFTA_STRING_FLAGS])
+		priv->flags = ntohl(nla_get_be32(tb[NFTA_STRING_FLAGS]));
+	if (priv->flags & NFT_STRING_F_ICASE)
+		ts_flags |= TS_IGNORECASE;
+
+	if (tb[NFTA_STRING_DREG]) {
+		if (elems && !(elems->flags & NFT_SET_MAP))
+			return -EINVAL;
+
+		err = nft_parse_register_store(ctx, tb[NFTA_STRING_DREG],
+					       &priv->dreg, NULL,
+					       NFT_DATA_VALUE, sizeof(u32));
+		if (err < 0)
+			return err;
+		priv->dreg_set = true;
+	}
+
+	if (elems)
+		set = nft_string_set_elems(ctx, elems, &set_len, &priv->ids);
+	else
+		set = nft_string_set(tb[NFTA_STRING_PATTERNS], &set_len);
+	if (IS_ERR(set))
+		return PTR_ERR(set);
+
+	priv->config = textsearch_prepare("ac", set, set_len,
+					  GFP_KERNEL_ACCOUNT, ts_flags);
+	kfree(set);
+	if (IS_ERR(priv->config)) {
+		err = PTR_ERR(priv->config);
+		goto err;
+	}
+
+	if (elems) {
+		priv->binding.flags = elems->flags & NFT_SET_MAP;
+
+		err = nf_tables_bind_set(ctx, elems, &priv->binding);
+		if (err < 0)
+			goto err_bind;
+
+		priv->set = elems;
+	}
+
+	return 0;
+err_bind:
+	textsearch_destroy(priv->config);
+err:
+	kfree(priv->ids);
+	return err;
+}
+
+static void nft_string_deactivate(const struct nft_ctx *ctx,
+				  const struct nft_expr *expr,
+				  enum nft_trans_phase phase)
+{
+	struct nft_string *priv = nft_expr_priv(expr);
+
+	if (priv->set)
+		nf_tables_deactivate_set(ctx, priv->set, &priv->binding,
+					 phase);
+}
+
+static void nft_string_activate(const struct nft_ctx *ctx,
+				const struct nft_expr *expr)
+{
+	struct nft_string *priv = nft_expr_priv(expr);
+
+	if (priv->set)
+		nf_tables_activate_set(ctx, priv->set);
+}
+
+static void nft_string_destroy(const struct nft_ctx *ctx,
+			       const struct nft_expr *expr)
+{
+	struct nft_string *priv = nft_expr_priv(expr);
+
+	textsearch_destroy(priv->config);
+	kfree(priv->ids);
+	if (priv->set)
+		nf_tables_destroy_set(ctx, priv->set);
+}
+
+static int nft_string_dump(struct sk_buff *skb,
+			   const struct nft_expr *expr, bool reset)
+{
+	const struct nft_string *priv = nft_expr_priv(expr);
+	const u8 *set = textsearch_get_pattern(priv->config);
+	unsigned int len = textsearch_get_pattern_len(priv->config);
+	struct nlattr *nest;
+	unsigned int i;
+
+	if (priv->set) {
+		if (nla_put_string(skb, NFTA_STRING_SET, priv->set->name))
+			return -1;
+		goto out;
+	}
+
+	nest = nla_nest_start_noflag(skb, NFTA_STRING_PATTERNS);
+	if (!nest)
+		return -1;
+	for (i = 0; i < len; i += 1 + set[i])
+		if (nla_put(skb, NFTA_STRING_PATTERN, set[i], set + i + 1))
+			return -1;
+	nla_nest_end(skb, nest);
+out:
+	if (nla_put_be32(skb, NFTA_STRING_FROM, htonl(priv->from)) ||
+	    nla_put_be32(skb, NFTA_STRING_TO, htonl(priv->to)) ||
+	    nla_put_be32(skb, NFTA_STRING_FLAGS, htonl(priv->flags)))
+		return -1;
+
+	if (priv->dreg_set &&
+	    nft_dump_register(skb, NFTA_STRING_DREG, priv->dreg))
+		return -1;
+
+	return 0;
+}
+
+static bool nft_string_reduce(struct nft_regs_track *track,
+			      const struct nft_expr *expr)
+{
+	const struct nft_string *priv = nft_expr_priv(expr);
+
+	if (priv->dreg_set)
+		nft_reg_track_cancel(track, priv->dreg, sizeof(u32));
+
+	return false;
+}
+
+static struct nft_expr_type nft_string_type;
+static const struct nft_expr_ops nft_string_ops = {
+	.type		= &nft_string_type,
+	.size		= NFT_EXPR_SIZE(sizeof(struct nft_string)),
+	.eval		= nft_string_eval,
+	.init		= nft_string_init,
+	.activate	= nft_string_activate,
+	.deactivate	= nft_string_deactivate,
+	.destroy	= nft_string_destroy,
+	.dump		= nft_string_dump,
+	.reduce		= nft_string_reduce,
+};
+
+static struct nft_expr_type nft_string_type __read_mostly = {
+	.name		= "string",
+	.ops		= &nft_string_ops,
+	.policy		= nft_string_policy,
+	.maxattr	= NFTA_STRING_MAX,
+	.owner		= THIS_MODULE,
+};
+
+static int __init nft_string_module_init(void)
+{
+	return nft_register_expr(&nft_string_type);
+}
+
+static void __exit nft_string_module_exit(void)
+{
+	nft_unregister_expr(&nft_string_type);
+}
+
+module_init(nft_string_module_init);
+module_exit(nft_string_module_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_ALIAS_NFT_EXPR("string");
+MODULE_DESCRIPTION("nftables multi-pattern payload search");
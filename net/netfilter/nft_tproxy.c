@@ -3,6 +3,7 @@
 #include <linux/netfilter/nf_tables.h>
 #include <net/netfilter/nf_tables.h>
 #include <net/netfilter/nf_tables_core.h>
+#include <net/netfilter/nf_conntrack_sock.h>
 #include <net/netfilter/nf_tproxy.h>
 #include <net/inet_sock.h>
 #include <net/tcp.h>
@@ -46,10 +47,14 @@ static void nft_tproxy_eval_v4(const struct nft_expr *expr,
 	 * happens if the redirect already happened and the current packet
 	 * belongs to an already established connection
 	 */
-	sk = nf_tproxy_get_sock_v4(nft_net(pkt), skb, iph->protocol,
-				   iph->saddr, iph->daddr,
-				   hp->source, hp->dest,
-				   skb->dev, NF_TPROXY_LOOKUP_ESTABLISHED);
+	sk = nf_ct_sk_get(skb);
+	if (!sk) {
+		sk = nf_tproxy_get_sock_v4(nft_net(pkt), skb, iph->protocol,
+					   iph->saddr, iph->daddr,
+					   hp->source, hp->dest,
+					   skb->dev, NF_TPROXY_LOOKUP_ESTABLISHED);
+		nf_ct_sk_set(skb, sk);
+	}
 
 	if (priv->sreg_addr)
 		taddr = nft_reg_load_be32(&regs->data[priv->sreg_addr]);
@@ -114,10 +119,15 @@ static void nft_tproxy_eval_v6(const struct nft_expr *expr,
 	 * happens if the redirect already happened and the current packet
 	 * belongs to an already established connection
 	 */
-	sk = nf_tproxy_get_sock_v6(nft_net(pkt), skb, thoff, l4proto,
-				   &iph->saddr, &iph->daddr,
-				   hp->source, hp->dest,
-				   nft_in(pkt), NF_TPROXY_LOOKUP_ESTABLISHED);
+	sk = nf_ct_sk_get(skb);
+	if (!sk) {
+		sk = nf_tproxy_get_sock_v6(nft_net(pkt), skb, thoff, l4proto,
+					   &iph->saddr, &iph->daddr,
+					   hp->source, hp->dest,
+					   nft_in(pkt),
+					   NF_TPROXY_LOOKUP_ESTABLISHED);
+		nf_ct_sk_set(skb, sk);
+	}
 
 	if (priv->sreg_addr)
 		memcpy(&taddr, &regs->data[priv->sreg_addr], sizeof(taddr));
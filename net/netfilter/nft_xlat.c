@@ -0,0 +1,174 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Stateless IPv4/IPv6 translation for nf_tables, see nf_nat_xlat.c.
+ *
+ * Translated packets are received again in the other family, as done for
+ * decapsulated tunnel packets: they go through its prerouting hook, with
+ * conntrack and NAT, and are then routed as usual.  The conntrack entry of
+ * the original family is dropped, translated flows are best exempted from
+ * tracking there with notrack.
+ */
+
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/netlink.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nf_tables.h>
+#include <linux/netfilter/nft_xlat.h>
+#include <linux/netdevice.h>
+#include <net/ip.h>
+#include <net/ipv6.h>
+#include <net/netfilter/nf_tables.h>
+#include <net/netfilter/nf_nat_xlat.h>
+
+struct nft_xlat {
+	struct in6_addr		prefix;
+};
+
+/* RFC 6052 well-known prefix, 64:ff9b::/96 */
+static const struct in6_addr nft_xlat_wkp = {
+	{ { 0x00, 0x64, 0xff, 0x9b } }
+};
+
+static void nft_xlat_eval(const struct nft_expr *expr,
+			  struct nft_regs *regs,
+			  const struct nft_pktinfo *pkt)
+{
+	const struct nft_xlat *priv = nft_expr_priv(expr);
+	struct sk_buff *skb = pkt->skb;
+	bool frag = false;
+	int err;
+
+	/* expiring packets are left to the stack, which sends the error */
+	switch (nft_pf(pkt)) {
+	case NFPROTO_IPV4:
+		if (ip_hdr(skb)->ttl <= 1)
+			goto out_break;
+
+		frag = !(ip_hdr(skb)->frag_off & htons(IP_DF));
+		err = nf_nat_xlat_4to6(skb, &priv->prefix);
+		break;
+	case NFPROTO_IPV6:
+		if (ipv6_hdr(skb)->hop_limit <= 1)
+			goto out_break;
+
+		err = nf_nat_xlat_6to4(skb, &priv->prefix);
+		break;
+	default:
+		goto out_break;
+	}
+
+	if (err == -EPROTONOSUPPORT || err == -EINVAL)
+		goto out_break;
+	if (err < 0)
+		goto out_drop;
+
+	/* The translator forwards the packet, RFC 7915 4.1 and 5.1: this
+	 * also ends translation loops, the new header is ours to write.
+	 */
+	if (skb->protocol == htons(ETH_P_IPV6))
+		ipv6_hdr(skb)->hop_limit--;
+	else
+		ip_decrease_ttl(ip_hdr(skb));
+
+	nf_reset_ct(skb);
+	skb_dst_drop(skb);
+	skb_reset_mac_header(skb);
+	skb->pkt_type = PACKET_HOST;
+
+	/* IPv4 packets without DF are fragmented as needed, RFC 7915 4.1 */
+	if (skb->protocol == htons(ETH_P_IPV6))
+		skb->ignore_df = frag;
+
+	netif_rx(skb);
+	regs->verdict.code = NF_STOLEN;
+	return;
+out_drop:
+	regs->verdict.code = NF_DROP;
+	return;
+out_break:
+	regs->verdict.code = NFT_BREAK;
+}
+
+static const struct nla_policy nft_xlat_policy[NFTA_XLAT_MAX + 1] = {
+	[NFTA_XLAT_PREFIX]	= NLA_POLICY_EXACT_LEN(sizeof(struct in6_addr)),
+};
+
+static int nft_xlat_validate(const struct nft_ctx *ctx,
+			     const struct nft_expr *expr)
+{
+	if (ctx->family != NFPROTO_IPV4 &&
+	    ctx->family != NFPROTO_IPV6 &&
+	    ctx->family != NFPROTO_INET)
+		return -EOPNOTSUPP;
+
+	return nft_chain_validate_hooks(ctx->chain, 1 << NF_INET_PRE_ROUTING);
+}
+
+static int nft_xlat_init(const struct nft_ctx *ctx,
+			 const struct nft_expr *expr,
+			 const struct nlattr * const tb[])
+{
+	struct nft_xlat *priv = nft_expr_priv(expr);
+
+	if (!tb[NFTA_XLAT_PREFIX]) {
+		priv->prefix = nft_xlat_wkp;
+		return 0;
+	}
+
+	nla_memcpy(&priv->prefix, tb[NFTA_XLAT_PREFIX], sizeof(priv->prefix));
+
+	/* the IPv4 address goes there */
+	if (priv->prefix.s6_addr32[3])
+		return -EINVAL;
+
+	return 0;
+}
+
+static int nft_xlat_dump(struct sk_buff *skb,
+			 const struct nft_expr *expr, bool reset)
+{
+	const struct nft_xlat *priv = nft_expr_priv(expr);
+
+	if (nla_put_in6_addr(skb, NFTA_XLAT_PREFIX, &priv->prefix))
+		return -1;
+
+	return 0;
+}
+
+static struct nft_expr_type nft_xlat_type;
+static const struct nft_expr_ops nft_xlat_ops = {
+	.type		= &nft_xlat_type,
+	.size		= NFT_EXPR_SIZE(sizeof(struct nft_xlat)),
+	.eval		= nft_xlat_eval,
+	.init		= nft_xlat_init,
+	.dump		= nft_xlat_dump,
+	.validate	= nft_xlat_validate,
+	.reduce		= NFT_REDUCE_READONLY,
+};
+
+static struct nft_expr_type nft_xlat_type __read_mostly = {
+	.name		= "xlat",
+	.ops		= &nft_xlat_ops,
+	.policy		= nft_xlat_policy,
+	.maxattr	= NFTA_XLAT_MAX,
+	.owner		= THIS_MODULE,
+};
+
+static int __init nft_xlat_module_init(void)
+{
+	return nft_register_expr(&nft_xlat_type);
+}
+
+static void __exit nft_xlat_module_exit(void)
+{
+	nft_unregister_expr(&nft_xlat_type);
+}
+
+module_init(nft_xlat_module_init);
+module_exit(nft_xlat_module_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_ALIAS_NFT_EXPR("xlat");
+MODULE_DESCRIPTION("nftables stateless IPv4/IPv6 translation");
@@ -21,8 +21,10 @@
 #include <linux/mutex.h>
 #include <linux/mm.h>
 #include <linux/slab.h>
+#include <linux/sort.h>
 #include <linux/audit.h>
 #include <linux/user_namespace.h>
+#include <linux/workqueue.h>
 #include <net/net_namespace.h>
 #include <net/netns/generic.h>
 
@@ -1210,10 +1212,156 @@ void xt_free_table_info(struct xt_table_info *info)
 		kvfree(info->jumpstack);
 	}
 
+	xt_dispatch_free(info->dispatch);
 	kvfree(info);
 }
 EXPORT_SYMBOL(xt_free_table_info);
 
+static int xt_dispatch_key_cmp(const void *a, const void *b)
+{
+	const struct xt_dispatch_key *ka = a, *kb = b;
+
+	if (ka->key != kb->key)
+		return ka->key < kb->key ? -1 : 1;
+
+	return ka->offset < kb->offset ? -1 : 1;
+}
+
+static void xt_dispatch_add_run(struct xt_dispatch *d, unsigned int idx,
+				struct xt_dispatch_key *keys,
+				const void *entry0, unsigned int grain,
+				u32 (*rule_key)(const void *, u16 *),
+				u32 start, unsigned int len, u32 end)
+{
+	struct xt_dispatch_run *run = &d->runs[idx];
+	struct xt_dispatch_slot *s;
+	unsigned int i, n = 0;
+	u32 offset = start;
+	u16 next;
+
+	d->slots[start / grain].run = idx + 1;
+
+	for (i = 0; i < len; i++, offset += next) {
+		keys[i].key = rule_key(entry0 + offset, &next);
+		keys[i].offset = offset;
+	}
+	sort(keys, len, sizeof(*keys), xt_dispatch_key_cmp, NULL);
+
+	for (i = 0; i < len; i++) {
+		s = &d->slots[keys[i].offset / grain];
+		s->key = keys[i].key;
+		if (i + 1 < len && keys[i + 1].key == keys[i].key)
+			s->next = keys[i + 1].offset;
+		else
+			s->next = end;
+
+		/* Keep the first rule of each key for the lookup. */
+		if (n == 0 || keys[n - 1].key != keys[i].key)
+			keys[n++] = keys[i];
+	}
+
+	run->keys = keys;
+	run->nkeys = n;
+	run->end = end;
+}
+
+/**
+ * xt_dispatch_build - index the runs of single key rules of a ruleset
+ * @info: checked table, gets the index
+ * @entry0: first entry of the table
+ * @grain: size of the smallest entry of the family
+ * @min_run: number of consecutive rules worth an index
+ * @rule_key: key of the rule at @entry, 0 if it has none, and its size
+ *
+ * Rules of a run that don't have the key of a packet must not be able to
+ * match it, nor have side effects.  This is only an optimization: if
+ * there's nothing to index or no memory, rules are walked linearly.
+ */
+void xt_dispatch_build(struct xt_table_info *info, const void *entry0,
+		       unsigned int grain, unsigned int min_run,
+		       u32 (*rule_key)(const void *entry, u16 *next_offset))
+{
+	unsigned int nruns = 0, nkeys = 0, nslots, len = 0;
+	struct xt_dispatch_key *keys;
+	struct xt_dispatch *d;
+	u32 offset, start = 0;
+	size_t sz;
+	u16 next;
+
+	/* The last entry is always the ERROR target, so runs end in the loop. */
+	for (offset = 0; offset < info->size; offset += next) {
+		if (rule_key(entry0 + offset, &next)) {
+			len++;
+			continue;
+		}
+		if (len >= min_run) {
+			nruns++;
+			nkeys += len;
+		}
+		len = 0;
+	}
+
+	if (!nruns)
+		return;
+
+	nslots = info->size / grain + 1;
+	sz = struct_size(d, slots, nslots) +
+	     array_size(nruns, sizeof(struct xt_dispatch_run)) +
+	     array_size(nkeys, sizeof(struct xt_dispatch_key));
+	d = kvzalloc(sz, GFP_KERNEL_ACCOUNT);
+	if (!d)
+		return;
+
+	d->runs = (void *)&d->slots[nslots];
+	keys = (void *)&d->runs[nruns];
+
+	nruns = 0;
+	for (offset = 0; offset < info->size; offset += next) {
+		if (rule_key(entry0 + offset, &next)) {
+			if (len++ == 0)
+				start = offset;
+			continue;
+		}
+		if (len >= min_run) {
+			xt_dispatch_add_run(d, nruns++, keys, entry0, grain,
+					    rule_key, start, len, offset);
+			keys += len;
+		}
+		len = 0;
+	}
+
+	info->dispatch = d;
+}
+EXPORT_SYMBOL_GPL(xt_dispatch_build);
+
+/* Offset of the first rule for @key in a run, or of the end of the run. */
+u32 xt_dispatch_lookup(const struct xt_dispatch *d, unsigned int run,
+		       u32 key)
+{
+	const struct xt_dispatch_run *r = &d->runs[run];
+	unsigned int lo = 0, hi = r->nkeys, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (r->keys[mid].key < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo < r->nkeys && r->keys[lo].key == key)
+		return r->keys[lo].offset;
+
+	return r->end;
+}
+EXPORT_SYMBOL_GPL(xt_dispatch_lookup);
+
+void xt_dispatch_free(struct xt_dispatch *d)
+{
+	kvfree(d);
+}
+EXPORT_SYMBOL_GPL(xt_dispatch_free);
+
 struct xt_table *xt_find_table(struct net *net, u8 af, const char *name)
 {
 	struct xt_pernet *xt_net = net_generic(net, xt_pernet_id);
@@ -1381,6 +1529,79 @@ struct xt_counters *xt_counters_alloc(unsigned int counters)
 }
 EXPORT_SYMBOL(xt_counters_alloc);
 
+/* Below this many rules per worker, harvesting isn't worth a work item. */
+#define XT_HARVEST_MIN_ENTRIES	4096
+#define XT_HARVEST_MAX_WORKERS	16
+
+struct xt_harvest {
+	struct work_struct		work;
+	const struct xt_table_info	*info;
+	struct xt_counters		*counters;
+	xt_harvest_fn_t			fn;
+	unsigned int			first;
+	unsigned int			last;
+};
+
+static void xt_harvest_work(struct work_struct *work)
+{
+	struct xt_harvest *h = container_of(work, struct xt_harvest, work);
+
+	h->fn(h->info, h->first, h->last, h->counters);
+}
+
+/**
+ * xt_harvest_counters - sum the percpu rule counters of a table
+ *
+ * @info: table whose counters are summed
+ * @counters: result array, one slot per rule
+ * @fn: family callback summing the rules [first, last)
+ *
+ * Summing walks every rule once per possible cpu, which takes seconds
+ * for big rulesets on big machines.  Split the rules in ranges and
+ * sum them from unbound workqueues in parallel.  @fn must cope with
+ * packets still updating the counters unless @info was replaced.
+ */
+void xt_harvest_counters(const struct xt_table_info *info,
+			 struct xt_counters *counters, xt_harvest_fn_t fn)
+{
+	unsigned int i, n, chunk;
+	struct xt_harvest *h;
+
+	n = min3(num_online_cpus(), info->number / XT_HARVEST_MIN_ENTRIES,
+		 XT_HARVEST_MAX_WORKERS);
+	if (n <= 1)
+		goto inline_harvest;
+
+	h = kcalloc(n, sizeof(*h), GFP_KERNEL);
+	if (!h)
+		goto inline_harvest;
+
+	chunk = DIV_ROUND_UP(info->number, n);
+	for (i = 0; i < n; i++) {
+		INIT_WORK(&h[i].work, xt_harvest_work);
+		h[i].info = info;
+		h[i].counters = counters;
+		h[i].fn = fn;
+		h[i].first = i * chunk;
+		h[i].last = min(h[i].first + chunk, info->number);
+		/* The first range is summed by the caller. */
+		if (i)
+			queue_work(system_unbound_wq, &h[i].work);
+	}
+
+	fn(info, h[0].first, h[0].last, counters);
+
+	for (i = 1; i < n; i++)
+		flush_work(&h[i].work);
+
+	kfree(h);
+	return;
+
+inline_harvest:
+	fn(info, 0, info->number, counters);
+}
+EXPORT_SYMBOL_GPL(xt_harvest_counters);
+
 struct xt_table_info *
 xt_replace_table(struct xt_table *table,
 	      unsigned int num_counters,
@@ -33,6 +33,8 @@ struct idletimer_tg {
 	struct list_head entry;
 	struct alarm alarm;
 	struct timer_list timer;
+	/* expiry pushed by packets, the timer catches up when it fires */
+	unsigned long expires;
 	struct work_struct work;
 
 	struct kobject *kobj;
@@ -77,7 +79,7 @@ static ssize_t idletimer_tg_show(struct device *dev,
 			ktimespec = ktime_to_timespec64(expires_alarm);
 			time_diff = ktimespec.tv_sec;
 		} else {
-			expires = timer->timer.expires;
+			expires = READ_ONCE(timer->expires);
 			time_diff = jiffies_to_msecs(expires - jiffies) / 1000;
 		}
 	}
@@ -94,6 +96,19 @@ static void idletimer_tg_work(struct work_struct *work)
 {
 	struct idletimer_tg *timer = container_of(work, struct idletimer_tg,
 						  work);
+	unsigned long expires;
+
+	/* packets that came in after the timer fired moved the expiry */
+	mutex_lock(&list_mutex);
+	if (!(timer->timer_type & XT_IDLETIMER_ALARM)) {
+		expires = READ_ONCE(timer->expires);
+		if (time_after(expires, jiffies)) {
+			mod_timer(&timer->timer, expires);
+			mutex_unlock(&list_mutex);
+			return;
+		}
+	}
+	mutex_unlock(&list_mutex);
 
 	sysfs_notify(idletimer_tg_kobj, NULL, timer->attr.attr.name);
 }
@@ -101,6 +116,13 @@ static void idletimer_tg_work(struct work_struct *work)
 static void idletimer_tg_expired(struct timer_list *t)
 {
 	struct idletimer_tg *timer = timer_container_of(timer, t, timer);
+	unsigned long expires = READ_ONCE(timer->expires);
+
+	/* packets came in since the timer was armed */
+	if (time_after(expires, jiffies)) {
+		mod_timer(&timer->timer, expires);
+		return;
+	}
 
 	pr_debug("timer %s expired\n", timer->attr.attr.name);
 
@@ -115,6 +137,31 @@ static void idletimer_tg_alarmproc(struct alarm *alarm, ktime_t now)
 	schedule_work(&timer->work);
 }
 
+static void idletimer_tg_arm(struct idletimer_tg *timer, unsigned int timeout)
+{
+	unsigned long expires = secs_to_jiffies(timeout) + jiffies;
+
+	WRITE_ONCE(timer->expires, expires);
+	mod_timer(&timer->timer, expires);
+}
+
+/* Packets only store the new expiry, at most once per jiffy, instead of
+ * taking the lock of the timer base on each of them.  The timer is only
+ * modified when it isn't armed anymore, or when a rule with a shorter
+ * timeout must make it fire earlier.
+ */
+static void idletimer_tg_touch(struct idletimer_tg *timer, unsigned int timeout)
+{
+	unsigned long expires = secs_to_jiffies(timeout) + jiffies;
+
+	if (READ_ONCE(timer->expires) != expires)
+		WRITE_ONCE(timer->expires, expires);
+
+	if (!timer_pending(&timer->timer) ||
+	    time_before(expires, READ_ONCE(timer->timer.expires)))
+		mod_timer(&timer->timer, expires);
+}
+
 static int idletimer_check_sysfs_name(const char *name, unsigned int size)
 {
 	int ret;
@@ -167,8 +214,7 @@ static int idletimer_tg_create(struct idletimer_tg_info *info)
 
 	INIT_WORK(&info->timer->work, idletimer_tg_work);
 
-	mod_timer(&info->timer->timer,
-		  secs_to_jiffies(info->timeout) + jiffies);
+	idletimer_tg_arm(info->timer, info->timeout);
 
 	return 0;
 
@@ -228,8 +274,7 @@ static int idletimer_tg_create_v1(struct idletimer_tg_info_v1 *info)
 		alarm_start_relative(&info->timer->alarm, tout);
 	} else {
 		timer_setup(&info->timer->timer, idletimer_tg_expired, 0);
-		mod_timer(&info->timer->timer,
-				secs_to_jiffies(info->timeout) + jiffies);
+		idletimer_tg_arm(info->timer, info->timeout);
 	}
 
 	return 0;
@@ -253,8 +298,7 @@ static unsigned int idletimer_tg_target(struct sk_buff *skb,
 	pr_debug("resetting timer %s, timeout period %u\n",
 		 info->label, info->timeout);
 
-	mod_timer(&info->timer->timer,
-		  secs_to_jiffies(info->timeout) + jiffies);
+	idletimer_tg_touch(info->timer, info->timeout);
 
 	return XT_CONTINUE;
 }
@@ -274,8 +318,7 @@ static unsigned int idletimer_tg_target_v1(struct sk_buff *skb,
 		ktime_t tout = ktime_set(info->timeout, 0);
 		alarm_start_relative(&info->timer->alarm, tout);
 	} else {
-		mod_timer(&info->timer->timer,
-				secs_to_jiffies(info->timeout) + jiffies);
+		idletimer_tg_touch(info->timer, info->timeout);
 	}
 
 	return XT_CONTINUE;
@@ -319,8 +362,7 @@ static int idletimer_tg_checkentry(const struct xt_tgchk_param *par)
 	info->timer = __idletimer_tg_find_by_label(info->label);
 	if (info->timer) {
 		info->timer->refcnt++;
-		mod_timer(&info->timer->timer,
-			  secs_to_jiffies(info->timeout) + jiffies);
+		idletimer_tg_arm(info->timer, info->timeout);
 
 		pr_debug("increased refcnt of timer %s to %u\n",
 			 info->label, info->timer->refcnt);
@@ -381,8 +423,7 @@ static int idletimer_tg_checkentry_v1(const struct xt_tgchk_param *par)
 				alarm_start_relative(&info->timer->alarm, tout);
 			}
 		} else {
-				mod_timer(&info->timer->timer,
-					secs_to_jiffies(info->timeout) + jiffies);
+			idletimer_tg_arm(info->timer, info->timeout);
 		}
 		pr_debug("increased refcnt of timer %s to %u\n",
 			 info->label, info->timer->refcnt);
@@ -11,8 +11,15 @@
 
 #include <linux/netfilter/x_tables.h>
 #include <net/netfilter/nf_conntrack.h>
+#include <net/netfilter/nf_jump_hash.h>
 #include <linux/netfilter/xt_cluster.h>
 
+/* Map flows to nodes with a consistent hash: when total_nodes grows by
+ * one, only the flows that move to the new node change hands, instead
+ * of almost all of them.  All nodes of the cluster must agree on it.
+ */
+#define XT_CLUSTER_F_CONSISTENT	(1 << 1)
+
 static inline u32 nf_ct_orig_ipv4_src(const struct nf_conn *ct)
 {
 	return (__force u32)ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip;
@@ -53,6 +60,9 @@ xt_cluster_hash(const struct nf_conn *ct,
 		break;
 	}
 
+	if (info->flags & XT_CLUSTER_F_CONSISTENT)
+		return nf_jump_hash(hash, info->total_nodes);
+
 	return reciprocal_scale(hash, info->total_nodes);
 }
 
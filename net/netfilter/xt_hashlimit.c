@@ -112,26 +112,36 @@ struct dsthash_ent {
 	struct rcu_head rcu;
 };
 
+struct hashlimit_buckets {
+	unsigned int size;
+	struct rcu_head rcu;
+	struct hlist_head hash[];
+};
+
 struct xt_hashlimit_htable {
 	struct hlist_node node;		/* global list of all htables */
 	refcount_t use;
 	u_int8_t family;
-	bool rnd_initialized;
+	bool resizing;			/* inserts also take the resize lock */
 
 	struct hashlimit_cfg3 cfg;	/* config */
 
 	/* used internally */
-	spinlock_t lock;		/* lock for list_head */
+	spinlock_t lock;		/* serializes resizing with inserts */
+	spinlock_t *locks;		/* per bucket range lock for the lists */
+	unsigned int locks_mask;
 	u_int32_t rnd;			/* random seed for hash */
-	unsigned int count;		/* number entries in table */
+	atomic_t count;			/* number entries in table */
+	unsigned int gc_next;		/* first bucket of the next gc run */
 	struct delayed_work gc_work;
 
+	struct hashlimit_buckets __rcu *buckets;
+	struct hashlimit_buckets __rcu *old_buckets;	/* while resizing */
+
 	/* seq_file stuff */
 	struct proc_dir_entry *pde;
 	const char *name;
 	struct net *net;
-
-	struct hlist_head hash[];	/* hashtable itself */
 };
 
 static int
@@ -170,6 +180,11 @@ cfg_copy(struct hashlimit_cfg3 *to, const void *from, int revision)
 	return 0;
 }
 
+/* Bucket locks per possible cpu, at most one per bucket */
+#define HASHLIMIT_LOCKS_PER_CPU	32
+/* Buckets scanned per gc run */
+#define HASHLIMIT_GC_BUCKETS	4096
+
 static DEFINE_MUTEX(hashlimit_mutex);	/* protects htables list */
 static struct kmem_cache *hashlimit_cachep __read_mostly;
 
@@ -180,29 +195,37 @@ static inline bool dst_cmp(const struct dsthash_ent *ent,
 }
 
 static u_int32_t
-hash_dst(const struct xt_hashlimit_htable *ht, const struct dsthash_dst *dst)
+hash_dst(const struct xt_hashlimit_htable *ht,
+	 const struct hashlimit_buckets *b, const struct dsthash_dst *dst)
 {
 	u_int32_t hash = jhash2((const u32 *)dst,
 				sizeof(*dst)/sizeof(u32),
 				ht->rnd);
 	/*
-	 * Instead of returning hash % ht->cfg.size (implying a divide)
-	 * we return the high 32 bits of the (hash * ht->cfg.size) that will
-	 * give results between [0 and cfg.size-1] and same hash distribution,
+	 * Instead of returning hash % b->size (implying a divide)
+	 * we return the high 32 bits of the (hash * b->size) that will
+	 * give results between [0 and size-1] and same hash distribution,
 	 * but using a multiply, less expensive than a divide
 	 */
-	return reciprocal_scale(hash, ht->cfg.size);
+	return reciprocal_scale(hash, b->size);
+}
+
+static spinlock_t *
+hashlimit_bucket_lock(const struct xt_hashlimit_htable *ht, u_int32_t hash)
+{
+	return &ht->locks[hash & ht->locks_mask];
 }
 
 static struct dsthash_ent *
-dsthash_find(const struct xt_hashlimit_htable *ht,
-	     const struct dsthash_dst *dst)
+dsthash_find_bucket(const struct xt_hashlimit_htable *ht,
+		    const struct hashlimit_buckets *b,
+		    const struct dsthash_dst *dst)
 {
 	struct dsthash_ent *ent;
-	u_int32_t hash = hash_dst(ht, dst);
+	u_int32_t hash = hash_dst(ht, b, dst);
 
-	if (!hlist_empty(&ht->hash[hash])) {
-		hlist_for_each_entry_rcu(ent, &ht->hash[hash], node)
+	if (!hlist_empty(&b->hash[hash])) {
+		hlist_for_each_entry_rcu(ent, &b->hash[hash], node)
 			if (dst_cmp(ent, dst)) {
 				spin_lock(&ent->lock);
 				return ent;
@@ -211,33 +234,59 @@ dsthash_find(const struct xt_hashlimit_htable *ht,
 	return NULL;
 }
 
+static struct dsthash_ent *
+dsthash_find(const struct xt_hashlimit_htable *ht,
+	     const struct dsthash_dst *dst)
+{
+	const struct hashlimit_buckets *old;
+	struct dsthash_ent *ent;
+
+	ent = dsthash_find_bucket(ht, rcu_dereference(ht->buckets), dst);
+	if (ent)
+		return ent;
+
+	/* not moved to the new buckets yet */
+	old = rcu_dereference(ht->old_buckets);
+	if (unlikely(old))
+		return dsthash_find_bucket(ht, old, dst);
+
+	return NULL;
+}
+
 /* allocate dsthash_ent, initialize dst, put in htable and lock it */
 static struct dsthash_ent *
 dsthash_alloc_init(struct xt_hashlimit_htable *ht,
 		   const struct dsthash_dst *dst, bool *race)
 {
+	struct hashlimit_buckets *b;
 	struct dsthash_ent *ent;
+	bool resizing;
+	spinlock_t *lock;
+	u_int32_t hash;
+
+	/* htable_resize() moves entries around under ht->lock, it waits
+	 * for an RCU grace period after setting ->resizing so everybody
+	 * inserting takes it.
+	 */
+	resizing = READ_ONCE(ht->resizing);
+	if (unlikely(resizing))
+		spin_lock(&ht->lock);
 
-	spin_lock(&ht->lock);
+	b = rcu_dereference(ht->buckets);
+	hash = hash_dst(ht, b, dst);
+	lock = hashlimit_bucket_lock(ht, hash);
+	spin_lock(lock);
 
 	/* Two or more packets may race to create the same entry in the
 	 * hashtable, double check if this packet lost race.
 	 */
 	ent = dsthash_find(ht, dst);
 	if (ent != NULL) {
-		spin_unlock(&ht->lock);
 		*race = true;
-		return ent;
+		goto out;
 	}
 
-	/* initialize hash with random val at the time we allocate
-	 * the first hashtable entry */
-	if (unlikely(!ht->rnd_initialized)) {
-		get_random_bytes(&ht->rnd, sizeof(ht->rnd));
-		ht->rnd_initialized = true;
-	}
-
-	if (ht->cfg.max && ht->count >= ht->cfg.max) {
+	if (ht->cfg.max && atomic_read(&ht->count) >= ht->cfg.max) {
 		/* FIXME: do something. question is what.. */
 		net_err_ratelimited("max count of %u reached\n", ht->cfg.max);
 		ent = NULL;
@@ -248,10 +297,13 @@ dsthash_alloc_init(struct xt_hashlimit_htable *ht,
 		spin_lock_init(&ent->lock);
 
 		spin_lock(&ent->lock);
-		hlist_add_head_rcu(&ent->node, &ht->hash[hash_dst(ht, dst)]);
-		ht->count++;
+		hlist_add_head_rcu(&ent->node, &b->hash[hash]);
+		atomic_inc(&ht->count);
 	}
-	spin_unlock(&ht->lock);
+out:
+	spin_unlock(lock);
+	if (unlikely(resizing))
+		spin_unlock(&ht->lock);
 	return ent;
 }
 
@@ -267,10 +319,52 @@ dsthash_free(struct xt_hashlimit_htable *ht, struct dsthash_ent *ent)
 {
 	hlist_del_rcu(&ent->node);
 	call_rcu(&ent->rcu, dsthash_free_rcu);
-	ht->count--;
+	atomic_dec(&ht->count);
 }
 static void htable_gc(struct work_struct *work);
 
+static struct hashlimit_buckets *htable_buckets_alloc(unsigned int size)
+{
+	struct hashlimit_buckets *b;
+	unsigned int i;
+
+	b = kvmalloc(struct_size(b, hash, size), GFP_KERNEL);
+	if (b == NULL)
+		return NULL;
+
+	b->size = size;
+	for (i = 0; i < size; i++)
+		INIT_HLIST_HEAD(&b->hash[i]);
+
+	return b;
+}
+
+/* gc, resizing and destruction never run concurrently */
+static struct hashlimit_buckets *
+htable_buckets(const struct xt_hashlimit_htable *ht)
+{
+	return rcu_dereference_protected(ht->buckets, true);
+}
+
+static void htable_set_max(struct xt_hashlimit_htable *hinfo,
+			   const struct hashlimit_cfg3 *cfg)
+{
+	if (cfg->max == 0)
+		hinfo->cfg.max = 8 * hinfo->cfg.size;
+	else if (cfg->max < hinfo->cfg.size)
+		hinfo->cfg.max = hinfo->cfg.size;
+	else
+		hinfo->cfg.max = cfg->max;
+}
+
+static void htable_free(struct xt_hashlimit_htable *hinfo)
+{
+	kvfree(rcu_access_pointer(hinfo->buckets));
+	free_bucket_spinlocks(hinfo->locks);
+	kfree(hinfo->name);
+	kfree(hinfo);
+}
+
 static int htable_create(struct net *net, struct hashlimit_cfg3 *cfg,
 			 const char *name, u_int8_t family,
 			 struct xt_hashlimit_htable **out_hinfo,
@@ -279,7 +373,7 @@ static int htable_create(struct net *net, struct hashlimit_cfg3 *cfg,
 	struct hashlimit_net *hashlimit_net = hashlimit_pernet(net);
 	struct xt_hashlimit_htable *hinfo;
 	const struct seq_operations *ops;
-	unsigned int size, i;
+	unsigned int size;
 	unsigned long nr_pages = totalram_pages();
 	int ret;
 
@@ -293,7 +387,7 @@ static int htable_create(struct net *net, struct hashlimit_cfg3 *cfg,
 		if (size < 16)
 			size = 16;
 	}
-	hinfo = kvmalloc(struct_size(hinfo, hash, size), GFP_KERNEL);
+	hinfo = kzalloc(sizeof(*hinfo), GFP_KERNEL);
 	if (hinfo == NULL)
 		return -ENOMEM;
 	*out_hinfo = hinfo;
@@ -301,26 +395,28 @@ static int htable_create(struct net *net, struct hashlimit_cfg3 *cfg,
 	/* copy match config into hashtable config */
 	ret = cfg_copy(&hinfo->cfg, (void *)cfg, 3);
 	if (ret) {
-		kvfree(hinfo);
+		kfree(hinfo);
 		return ret;
 	}
 
 	hinfo->cfg.size = size;
-	if (hinfo->cfg.max == 0)
-		hinfo->cfg.max = 8 * hinfo->cfg.size;
-	else if (hinfo->cfg.max < hinfo->cfg.size)
-		hinfo->cfg.max = hinfo->cfg.size;
+	htable_set_max(hinfo, &hinfo->cfg);
 
-	for (i = 0; i < hinfo->cfg.size; i++)
-		INIT_HLIST_HEAD(&hinfo->hash[i]);
+	RCU_INIT_POINTER(hinfo->buckets, htable_buckets_alloc(size));
+	if (alloc_bucket_spinlocks(&hinfo->locks, &hinfo->locks_mask, size,
+				   HASHLIMIT_LOCKS_PER_CPU, GFP_KERNEL) ||
+	    !rcu_access_pointer(hinfo->buckets)) {
+		htable_free(hinfo);
+		return -ENOMEM;
+	}
 
 	refcount_set(&hinfo->use, 1);
-	hinfo->count = 0;
+	atomic_set(&hinfo->count, 0);
 	hinfo->family = family;
-	hinfo->rnd_initialized = false;
+	hinfo->rnd = get_random_u32();
 	hinfo->name = kstrdup(name, GFP_KERNEL);
 	if (!hinfo->name) {
-		kvfree(hinfo);
+		htable_free(hinfo);
 		return -ENOMEM;
 	}
 	spin_lock_init(&hinfo->lock);
@@ -341,8 +437,7 @@ static int htable_create(struct net *net, struct hashlimit_cfg3 *cfg,
 		hashlimit_net->ipt_hashlimit : hashlimit_net->ip6t_hashlimit,
 		ops, hinfo);
 	if (hinfo->pde == NULL) {
-		kfree(hinfo->name);
-		kvfree(hinfo);
+		htable_free(hinfo);
 		return -ENOMEM;
 	}
 	hinfo->net = net;
@@ -356,38 +451,106 @@ static int htable_create(struct net *net, struct hashlimit_cfg3 *cfg,
 	return 0;
 }
 
-static void htable_selective_cleanup(struct xt_hashlimit_htable *ht, bool select_all)
+static void htable_selective_cleanup(struct xt_hashlimit_htable *ht,
+				     unsigned int from, unsigned int to,
+				     bool select_all)
 {
+	struct hashlimit_buckets *b = htable_buckets(ht);
 	unsigned int i;
 
-	for (i = 0; i < ht->cfg.size; i++) {
-		struct hlist_head *head = &ht->hash[i];
+	for (i = from; i < to; i++) {
+		struct hlist_head *head = &b->hash[i];
+		spinlock_t *lock = hashlimit_bucket_lock(ht, i);
 		struct dsthash_ent *dh;
 		struct hlist_node *n;
 
 		if (hlist_empty(head))
 			continue;
 
-		spin_lock_bh(&ht->lock);
+		spin_lock_bh(lock);
 		hlist_for_each_entry_safe(dh, n, head, node) {
 			if (time_after_eq(jiffies, dh->expires) || select_all)
 				dsthash_free(ht, dh);
 		}
-		spin_unlock_bh(&ht->lock);
+		spin_unlock_bh(lock);
 		cond_resched();
 	}
 }
 
+/* Each gc run scans one slice of the buckets and the slices of a whole
+ * pass are spread over gc_interval, so huge tables don't stall a cpu.
+ */
 static void htable_gc(struct work_struct *work)
 {
 	struct xt_hashlimit_htable *ht;
+	unsigned int size, end, slices;
+	unsigned long delay;
 
 	ht = container_of(work, struct xt_hashlimit_htable, gc_work.work);
 
-	htable_selective_cleanup(ht, false);
+	size = htable_buckets(ht)->size;
+	end = min(ht->gc_next + HASHLIMIT_GC_BUCKETS, size);
+	htable_selective_cleanup(ht, ht->gc_next, end, false);
+	ht->gc_next = end < size ? end : 0;
 
-	queue_delayed_work(system_power_efficient_wq,
-			   &ht->gc_work, msecs_to_jiffies(ht->cfg.gc_interval));
+	slices = DIV_ROUND_UP(size, HASHLIMIT_GC_BUCKETS);
+	delay = max(msecs_to_jiffies(ht->cfg.gc_interval) / slices, 1UL);
+	queue_delayed_work(system_power_efficient_wq, &ht->gc_work, delay);
+}
+
+/* Move all entries to a table of @size buckets.  Lookups search both
+ * tables meanwhile and may miss an entry that is being moved, then the
+ * insert path finds it again under ht->lock.
+ */
+static int htable_resize(struct xt_hashlimit_htable *ht, unsigned int size,
+			 const struct hashlimit_cfg3 *cfg)
+{
+	struct hashlimit_buckets *old, *new;
+	struct dsthash_ent *ent;
+	struct hlist_node *n;
+	unsigned int i;
+
+	new = htable_buckets_alloc(size);
+	if (new == NULL)
+		return -ENOMEM;
+
+	cancel_delayed_work_sync(&ht->gc_work);
+
+	WRITE_ONCE(ht->resizing, true);
+	synchronize_rcu();
+
+	old = htable_buckets(ht);
+	spin_lock_bh(&ht->lock);
+	rcu_assign_pointer(ht->old_buckets, old);
+	rcu_assign_pointer(ht->buckets, new);
+	ht->cfg.size = size;
+	htable_set_max(ht, cfg);
+	spin_unlock_bh(&ht->lock);
+
+	for (i = 0; i < old->size; i++) {
+		spin_lock_bh(&ht->lock);
+		hlist_for_each_entry_safe(ent, n, &old->hash[i], node) {
+			hlist_del_rcu(&ent->node);
+			hlist_add_head_rcu(&ent->node,
+					   &new->hash[hash_dst(ht, new, &ent->dst)]);
+		}
+		spin_unlock_bh(&ht->lock);
+		cond_resched();
+	}
+
+	/* Inserts that saw ->resizing also take the bucket lock, so they
+	 * don't race with the ones that don't see it anymore.
+	 */
+	spin_lock_bh(&ht->lock);
+	RCU_INIT_POINTER(ht->old_buckets, NULL);
+	WRITE_ONCE(ht->resizing, false);
+	spin_unlock_bh(&ht->lock);
+	kvfree_rcu(old, rcu);
+
+	ht->gc_next = 0;
+	queue_delayed_work(system_power_efficient_wq, &ht->gc_work,
+			   msecs_to_jiffies(ht->cfg.gc_interval));
+	return 0;
 }
 
 static void htable_remove_proc_entry(struct xt_hashlimit_htable *hinfo)
@@ -429,9 +592,9 @@ static void htable_put(struct xt_hashlimit_htable *hinfo)
 		mutex_unlock(&hashlimit_mutex);
 
 		cancel_delayed_work_sync(&hinfo->gc_work);
-		htable_selective_cleanup(hinfo, true);
-		kfree(hinfo->name);
-		kvfree(hinfo);
+		htable_selective_cleanup(hinfo, 0, htable_buckets(hinfo)->size,
+					 true);
+		htable_free(hinfo);
 	}
 }
 
@@ -903,6 +1066,14 @@ static int hashlimit_mt_check_common(const struct xt_mtchk_param *par,
 			mutex_unlock(&hashlimit_mutex);
 			return ret;
 		}
+	} else if (cfg->size && cfg->size != (*hinfo)->cfg.size) {
+		ret = htable_resize(*hinfo, cfg->size, cfg);
+		if (ret < 0) {
+			/* still referenced by the rules already using it */
+			refcount_dec(&(*hinfo)->use);
+			mutex_unlock(&hashlimit_mutex);
+			return ret;
+		}
 	}
 	mutex_unlock(&hashlimit_mutex);
 
@@ -1051,46 +1222,56 @@ static struct xt_match hashlimit_mt_reg[] __read_mostly = {
 };
 
 /* PROC stuff */
+
+/* The bucket array is the one seen at start: a resize may replace it
+ * meanwhile, but it is only freed after the read side section ends.
+ */
+struct dl_seq_iter {
+	struct hashlimit_buckets *b;
+	unsigned int bucket;
+};
+
 static void *dl_seq_start(struct seq_file *s, loff_t *pos)
-	__acquires(htable->lock)
+	__acquires(RCU_BH)
 {
 	struct xt_hashlimit_htable *htable = pde_data(file_inode(s->file));
-	unsigned int *bucket;
+	struct hashlimit_buckets *b;
+	struct dl_seq_iter *iter;
 
-	spin_lock_bh(&htable->lock);
-	if (*pos >= htable->cfg.size)
+	rcu_read_lock_bh();
+	b = rcu_dereference_bh(htable->buckets);
+	if (*pos >= b->size)
 		return NULL;
 
-	bucket = kmalloc(sizeof(unsigned int), GFP_ATOMIC);
-	if (!bucket)
+	iter = kmalloc(sizeof(*iter), GFP_ATOMIC);
+	if (!iter)
 		return ERR_PTR(-ENOMEM);
 
-	*bucket = *pos;
-	return bucket;
+	iter->b = b;
+	iter->bucket = *pos;
+	return iter;
 }
 
 static void *dl_seq_next(struct seq_file *s, void *v, loff_t *pos)
 {
-	struct xt_hashlimit_htable *htable = pde_data(file_inode(s->file));
-	unsigned int *bucket = v;
+	struct dl_seq_iter *iter = v;
 
-	*pos = ++(*bucket);
-	if (*pos >= htable->cfg.size) {
+	*pos = ++iter->bucket;
+	if (*pos >= iter->b->size) {
 		kfree(v);
 		return NULL;
 	}
-	return bucket;
+	return iter;
 }
 
 static void dl_seq_stop(struct seq_file *s, void *v)
-	__releases(htable->lock)
+	__releases(RCU_BH)
 {
-	struct xt_hashlimit_htable *htable = pde_data(file_inode(s->file));
-	unsigned int *bucket = v;
+	struct dl_seq_iter *iter = v;
 
-	if (!IS_ERR(bucket))
-		kfree(bucket);
-	spin_unlock_bh(&htable->lock);
+	if (!IS_ERR(iter))
+		kfree(iter);
+	rcu_read_unlock_bh();
 }
 
 static void dl_seq_print(struct dsthash_ent *ent, u_int8_t family,
@@ -1172,11 +1353,13 @@ static int dl_seq_real_show(struct dsthash_ent *ent, u_int8_t family,
 static int dl_seq_show_v2(struct seq_file *s, void *v)
 {
 	struct xt_hashlimit_htable *htable = pde_data(file_inode(s->file));
-	unsigned int *bucket = (unsigned int *)v;
+	struct dl_seq_iter *iter = v;
+	struct hlist_head *head;
 	struct dsthash_ent *ent;
 
-	if (!hlist_empty(&htable->hash[*bucket])) {
-		hlist_for_each_entry(ent, &htable->hash[*bucket], node)
+	head = &iter->b->hash[iter->bucket];
+	if (!hlist_empty(head)) {
+		hlist_for_each_entry_rcu(ent, head, node)
 			if (dl_seq_real_show_v2(ent, htable->family, s))
 				return -1;
 	}
@@ -1186,11 +1369,13 @@ static int dl_seq_show_v2(struct seq_file *s, void *v)
 static int dl_seq_show_v1(struct seq_file *s, void *v)
 {
 	struct xt_hashlimit_htable *htable = pde_data(file_inode(s->file));
-	unsigned int *bucket = v;
+	struct dl_seq_iter *iter = v;
+	struct hlist_head *head;
 	struct dsthash_ent *ent;
 
-	if (!hlist_empty(&htable->hash[*bucket])) {
-		hlist_for_each_entry(ent, &htable->hash[*bucket], node)
+	head = &iter->b->hash[iter->bucket];
+	if (!hlist_empty(head)) {
+		hlist_for_each_entry_rcu(ent, head, node)
 			if (dl_seq_real_show_v1(ent, htable->family, s))
 				return -1;
 	}
@@ -1200,11 +1385,13 @@ static int dl_seq_show_v1(struct seq_file *s, void *v)
 static int dl_seq_show(struct seq_file *s, void *v)
 {
 	struct xt_hashlimit_htable *htable = pde_data(file_inode(s->file));
-	unsigned int *bucket = v;
+	struct dl_seq_iter *iter = v;
+	struct hlist_head *head;
 	struct dsthash_ent *ent;
 
-	if (!hlist_empty(&htable->hash[*bucket])) {
-		hlist_for_each_entry(ent, &htable->hash[*bucket], node)
+	head = &iter->b->hash[iter->bucket];
+	if (!hlist_empty(head)) {
+		hlist_for_each_entry_rcu(ent, head, node)
 			if (dl_seq_real_show(ent, htable->family, s))
 				return -1;
 	}
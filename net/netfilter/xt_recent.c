@@ -45,7 +45,21 @@ static unsigned int ip_list_hash_size __read_mostly;
 static unsigned int ip_list_perms __read_mostly = 0644;
 static unsigned int ip_list_uid __read_mostly;
 static unsigned int ip_list_gid __read_mostly;
-module_param(ip_list_tot, uint, 0400);
+
+/* ip_list_tot can be raised at runtime, keep the hash it sizes sane */
+#define XT_RECENT_MAX_TOT	(1U << 24)
+
+static int param_set_list_tot(const char *val, const struct kernel_param *kp)
+{
+	return param_set_uint_minmax(val, kp, 1, XT_RECENT_MAX_TOT);
+}
+
+static const struct kernel_param_ops param_ops_list_tot = {
+	.set = param_set_list_tot,
+	.get = param_get_uint,
+};
+
+module_param_cb(ip_list_tot, &param_ops_list_tot, &ip_list_tot, 0644);
 module_param(ip_list_hash_size, uint, 0400);
 module_param(ip_list_perms, uint, 0400);
 module_param(ip_list_uid, uint, 0644);
@@ -63,26 +77,41 @@ MODULE_PARM_DESC(ip_pkt_list_tot, "number of packets per IP address to remember
 
 #define XT_RECENT_MAX_NSTAMPS	65536
 
+/* Buckets looked at for an entry to evict when a table is full */
+#define XT_RECENT_EVICT_SCAN	64
+
 struct recent_entry {
 	struct list_head	list;
 	struct list_head	lru_list;
+	struct rcu_head		rcu;
 	union nf_inet_addr	addr;
 	u_int16_t		family;
 	u_int8_t		ttl;
 	u_int16_t		index;
 	u_int16_t		nstamps;
+	u_int16_t		nstamps_mask;
 	unsigned long		stamps[];
 };
 
+/* Each bucket keeps its own LRU list: lookups are lockless and updates
+ * only contend on addresses hashing to the same bucket.
+ */
+struct recent_bucket {
+	spinlock_t		lock;
+	struct list_head	chain;
+	struct list_head	lru_list;
+};
+
 struct recent_table {
 	struct list_head	list;
+	struct rcu_head		rcu;
 	char			name[XT_RECENT_NAME_LEN];
 	union nf_inet_addr	mask;
 	unsigned int		refcnt;
-	unsigned int		entries;
+	atomic_t		entries;
 	u_int16_t		nstamps_max_mask;
-	struct list_head	lru_list;
-	struct list_head	iphash[];
+	unsigned int		hash_mask;
+	struct recent_bucket	buckets[];
 };
 
 struct recent_net {
@@ -99,7 +128,6 @@ static inline struct recent_net *recent_pernet(struct net *net)
 	return net_generic(net, recent_net_id);
 }
 
-static DEFINE_SPINLOCK(recent_lock);
 static DEFINE_MUTEX(recent_mutex);
 
 #ifdef CONFIG_PROC_FS
@@ -108,32 +136,39 @@ static const struct proc_ops recent_mt_proc_ops;
 
 static u_int32_t hash_rnd __read_mostly;
 
-static inline unsigned int recent_entry_hash4(const union nf_inet_addr *addr)
+static inline unsigned int recent_entry_hash4(const struct recent_table *t,
+					      const union nf_inet_addr *addr)
 {
-	return jhash_1word((__force u32)addr->ip, hash_rnd) &
-	       (ip_list_hash_size - 1);
+	return jhash_1word((__force u32)addr->ip, hash_rnd) & t->hash_mask;
 }
 
-static inline unsigned int recent_entry_hash6(const union nf_inet_addr *addr)
+static inline unsigned int recent_entry_hash6(const struct recent_table *t,
+					      const union nf_inet_addr *addr)
 {
 	return jhash2((u32 *)addr->ip6, ARRAY_SIZE(addr->ip6), hash_rnd) &
-	       (ip_list_hash_size - 1);
+	       t->hash_mask;
 }
 
+static struct recent_bucket *
+recent_entry_bucket(struct recent_table *t, const union nf_inet_addr *addrp,
+		    u_int16_t family)
+{
+	if (family == NFPROTO_IPV4)
+		return &t->buckets[recent_entry_hash4(t, addrp)];
+	else
+		return &t->buckets[recent_entry_hash6(t, addrp)];
+}
+
+/* Under rcu_read_lock() or the bucket lock */
 static struct recent_entry *
-recent_entry_lookup(const struct recent_table *table,
+recent_entry_lookup(const struct recent_bucket *b,
 		    const union nf_inet_addr *addrp, u_int16_t family,
 		    u_int8_t ttl)
 {
 	struct recent_entry *e;
-	unsigned int h;
 
-	if (family == NFPROTO_IPV4)
-		h = recent_entry_hash4(addrp);
-	else
-		h = recent_entry_hash6(addrp);
-
-	list_for_each_entry(e, &table->iphash[h], list)
+	list_for_each_entry_rcu(e, &b->chain, list,
+				lockdep_is_held(&b->lock))
 		if (e->family == family &&
 		    memcmp(&e->addr, addrp, sizeof(e->addr)) == 0 &&
 		    (ttl == e->ttl || ttl == 0 || e->ttl == 0))
@@ -143,24 +178,50 @@ recent_entry_lookup(const struct recent_table *table,
 
 static void recent_entry_remove(struct recent_table *t, struct recent_entry *e)
 {
-	list_del(&e->list);
+	list_del_rcu(&e->list);
 	list_del(&e->lru_list);
-	kfree(e);
-	t->entries--;
+	kfree_rcu(e, rcu);
+	atomic_dec(&t->entries);
+}
+
+/* The table is full: drop the least recently used entry of the bucket
+ * @b or, if it has none, of the next bucket that has some and isn't
+ * busy.  Called with the lock of @b held.
+ */
+static void recent_table_evict(struct recent_table *t, struct recent_bucket *b)
+{
+	unsigned int i, h = b - t->buckets;
+	struct recent_bucket *o;
+
+	for (i = 0; i <= min_t(unsigned int, t->hash_mask, XT_RECENT_EVICT_SCAN);
+	     i++) {
+		o = &t->buckets[(h + i) & t->hash_mask];
+		if (list_empty(&o->lru_list))
+			continue;
+		if (o != b && !spin_trylock(&o->lock))
+			continue;
+		if (!list_empty(&o->lru_list))
+			recent_entry_remove(t, list_first_entry(&o->lru_list,
+					    struct recent_entry, lru_list));
+		if (o != b)
+			spin_unlock(&o->lock);
+		return;
+	}
 }
 
 /*
  * Drop entries with timestamps older then 'time'.
  */
-static void recent_entry_reap(struct recent_table *t, unsigned long time,
+static void recent_entry_reap(struct recent_table *t, struct recent_bucket *b,
+			      unsigned long time,
 			      struct recent_entry *working, bool update)
 {
 	struct recent_entry *e;
 
 	/*
-	 * The head of the LRU list is always the oldest entry.
+	 * The head of the bucket's LRU list is always its oldest entry.
 	 */
-	e = list_entry(t->lru_list.next, struct recent_entry, lru_list);
+	e = list_entry(b->lru_list.next, struct recent_entry, lru_list);
 
 	/*
 	 * Do not reap the entry which are going to be updated.
@@ -176,19 +237,20 @@ static void recent_entry_reap(struct recent_table *t, unsigned long time,
 }
 
 static struct recent_entry *
-recent_entry_init(struct recent_table *t, const union nf_inet_addr *addr,
-		  u_int16_t family, u_int8_t ttl)
+recent_entry_init(struct recent_table *t, struct recent_bucket *b,
+		  const union nf_inet_addr *addr, u_int16_t family,
+		  u_int8_t ttl)
 {
+	/* Entries keep the ring size they were created with, the table's
+	 * may grow meanwhile.
+	 */
+	unsigned int nstamps_mask = READ_ONCE(t->nstamps_max_mask);
 	struct recent_entry *e;
-	unsigned int nstamps_max = t->nstamps_max_mask;
 
-	if (t->entries >= ip_list_tot) {
-		e = list_entry(t->lru_list.next, struct recent_entry, lru_list);
-		recent_entry_remove(t, e);
-	}
+	if (atomic_read(&t->entries) >= READ_ONCE(ip_list_tot))
+		recent_table_evict(t, b);
 
-	nstamps_max += 1;
-	e = kmalloc(struct_size(e, stamps, nstamps_max), GFP_ATOMIC);
+	e = kmalloc(struct_size(e, stamps, nstamps_mask + 1), GFP_ATOMIC);
 	if (e == NULL)
 		return NULL;
 	memcpy(&e->addr, addr, sizeof(e->addr));
@@ -196,23 +258,21 @@ recent_entry_init(struct recent_table *t, const union nf_inet_addr *addr,
 	e->stamps[0] = jiffies;
 	e->nstamps   = 1;
 	e->index     = 1;
+	e->nstamps_mask = nstamps_mask;
 	e->family    = family;
-	if (family == NFPROTO_IPV4)
-		list_add_tail(&e->list, &t->iphash[recent_entry_hash4(addr)]);
-	else
-		list_add_tail(&e->list, &t->iphash[recent_entry_hash6(addr)]);
-	list_add_tail(&e->lru_list, &t->lru_list);
-	t->entries++;
+	list_add_tail_rcu(&e->list, &b->chain);
+	list_add_tail(&e->lru_list, &b->lru_list);
+	atomic_inc(&t->entries);
 	return e;
 }
 
-static void recent_entry_update(struct recent_table *t, struct recent_entry *e)
+static void recent_entry_update(struct recent_bucket *b, struct recent_entry *e)
 {
-	e->index &= t->nstamps_max_mask;
+	e->index &= e->nstamps_mask;
 	e->stamps[e->index++] = jiffies;
 	if (e->index > e->nstamps)
 		e->nstamps = e->index;
-	list_move_tail(&e->lru_list, &t->lru_list);
+	list_move_tail(&e->lru_list, &b->lru_list);
 }
 
 static struct recent_table *recent_table_lookup(struct recent_net *recent_net,
@@ -220,7 +280,8 @@ static struct recent_table *recent_table_lookup(struct recent_net *recent_net,
 {
 	struct recent_table *t;
 
-	list_for_each_entry(t, &recent_net->tables, list)
+	list_for_each_entry_rcu(t, &recent_net->tables, list,
+				lockdep_is_held(&recent_mutex))
 		if (!strcmp(t->name, name))
 			return t;
 	return NULL;
@@ -229,11 +290,32 @@ static struct recent_table *recent_table_lookup(struct recent_net *recent_net,
 static void recent_table_flush(struct recent_table *t)
 {
 	struct recent_entry *e, *next;
+	struct recent_bucket *b;
 	unsigned int i;
 
-	for (i = 0; i < ip_list_hash_size; i++)
-		list_for_each_entry_safe(e, next, &t->iphash[i], list)
+	for (i = 0; i <= t->hash_mask; i++) {
+		b = &t->buckets[i];
+		spin_lock_bh(&b->lock);
+		list_for_each_entry_safe(e, next, &b->chain, list)
 			recent_entry_remove(t, e);
+		spin_unlock_bh(&b->lock);
+	}
+}
+
+/* Count the hits of @e within the window, returns true if enough */
+static bool recent_entry_hits(const struct recent_entry *e,
+			      const struct xt_recent_mtinfo_v1 *info,
+			      unsigned long time)
+{
+	unsigned int i, hits = 0, nstamps = READ_ONCE(e->nstamps);
+
+	for (i = 0; i < nstamps; i++) {
+		if (info->seconds && time_after(time, READ_ONCE(e->stamps[i])))
+			continue;
+		if (!info->hit_count || ++hits >= info->hit_count)
+			return true;
+	}
+	return false;
 }
 
 static bool
@@ -242,10 +324,11 @@ recent_mt(const struct sk_buff *skb, struct xt_action_param *par)
 	struct net *net = xt_net(par);
 	struct recent_net *recent_net = recent_pernet(net);
 	const struct xt_recent_mtinfo_v1 *info = par->matchinfo;
+	struct recent_bucket *b;
 	struct recent_table *t;
 	struct recent_entry *e;
 	union nf_inet_addr addr = {}, addr_mask;
-	u_int8_t ttl;
+	u_int8_t ttl, ttl_match;
 	bool ret = info->invert;
 
 	if (xt_family(par) == NFPROTO_IPV4) {
@@ -273,17 +356,32 @@ recent_mt(const struct sk_buff *skb, struct xt_action_param *par)
 	    (!skb->sk || !net_eq(net, sock_net(skb->sk))))
 		ttl++;
 
-	spin_lock_bh(&recent_lock);
 	t = recent_table_lookup(recent_net, info->name);
 
 	nf_inet_addr_mask(&addr, &addr_mask, &t->mask);
+	b = recent_entry_bucket(t, &addr_mask, xt_family(par));
+	if (!(info->check_set & XT_RECENT_TTL))
+		ttl_match = 0;
+	else
+		ttl_match = ttl;
+
+	/* --rcheck without --reap only reads, don't take the bucket lock */
+	if ((info->check_set & (XT_RECENT_CHECK | XT_RECENT_REAP)) ==
+	    XT_RECENT_CHECK) {
+		e = recent_entry_lookup(b, &addr_mask, xt_family(par),
+					ttl_match);
+		if (e && recent_entry_hits(e, info,
+					   jiffies - info->seconds * HZ))
+			ret = !ret;
+		return ret;
+	}
 
-	e = recent_entry_lookup(t, &addr_mask, xt_family(par),
-				(info->check_set & XT_RECENT_TTL) ? ttl : 0);
+	spin_lock_bh(&b->lock);
+	e = recent_entry_lookup(b, &addr_mask, xt_family(par), ttl_match);
 	if (e == NULL) {
 		if (!(info->check_set & XT_RECENT_SET))
 			goto out;
-		e = recent_entry_init(t, &addr_mask, xt_family(par), ttl);
+		e = recent_entry_init(t, b, &addr_mask, xt_family(par), ttl);
 		if (e == NULL)
 			par->hotdrop = true;
 		ret = !ret;
@@ -297,30 +395,23 @@ recent_mt(const struct sk_buff *skb, struct xt_action_param *par)
 		ret = !ret;
 	} else if (info->check_set & (XT_RECENT_CHECK | XT_RECENT_UPDATE)) {
 		unsigned long time = jiffies - info->seconds * HZ;
-		unsigned int i, hits = 0;
-
-		for (i = 0; i < e->nstamps; i++) {
-			if (info->seconds && time_after(time, e->stamps[i]))
-				continue;
-			if (!info->hit_count || ++hits >= info->hit_count) {
-				ret = !ret;
-				break;
-			}
-		}
+
+		if (recent_entry_hits(e, info, time))
+			ret = !ret;
 
 		/* info->seconds must be non-zero */
 		if (info->check_set & XT_RECENT_REAP)
-			recent_entry_reap(t, time, e,
+			recent_entry_reap(t, b, time, e,
 				info->check_set & XT_RECENT_UPDATE && ret);
 	}
 
 	if (info->check_set & XT_RECENT_SET ||
 	    (info->check_set & XT_RECENT_UPDATE && ret)) {
-		recent_entry_update(t, e);
+		recent_entry_update(b, e);
 		e->ttl = ttl;
 	}
 out:
-	spin_unlock_bh(&recent_lock);
+	spin_unlock_bh(&b->lock);
 	return ret;
 }
 
@@ -339,7 +430,7 @@ static int recent_mt_check(const struct xt_mtchk_param *par,
 	kuid_t uid;
 	kgid_t gid;
 #endif
-	unsigned int nstamp_mask;
+	unsigned int nstamp_mask, hash_size;
 	unsigned int i;
 	int ret = -EINVAL;
 
@@ -380,10 +471,8 @@ static int recent_mt_check(const struct xt_mtchk_param *par,
 	t = recent_table_lookup(recent_net, info->name);
 	if (t != NULL) {
 		if (nstamp_mask > t->nstamps_max_mask) {
-			spin_lock_bh(&recent_lock);
+			WRITE_ONCE(t->nstamps_max_mask, nstamp_mask);
 			recent_table_flush(t);
-			t->nstamps_max_mask = nstamp_mask;
-			spin_unlock_bh(&recent_lock);
 		}
 
 		t->refcnt++;
@@ -391,19 +480,26 @@ static int recent_mt_check(const struct xt_mtchk_param *par,
 		goto out;
 	}
 
-	t = kvzalloc(struct_size(t, iphash, ip_list_hash_size), GFP_KERNEL);
+	/* Sized for the current ip_list_tot, which may have been raised
+	 * since the module was loaded.
+	 */
+	hash_size = ip_list_hash_size ? : 1 << fls(READ_ONCE(ip_list_tot));
+	t = kvzalloc(struct_size(t, buckets, hash_size), GFP_KERNEL);
 	if (t == NULL) {
 		ret = -ENOMEM;
 		goto out;
 	}
 	t->refcnt = 1;
 	t->nstamps_max_mask = nstamp_mask;
+	t->hash_mask = hash_size - 1;
 
 	memcpy(&t->mask, &info->mask, sizeof(t->mask));
 	strcpy(t->name, info->name);
-	INIT_LIST_HEAD(&t->lru_list);
-	for (i = 0; i < ip_list_hash_size; i++)
-		INIT_LIST_HEAD(&t->iphash[i]);
+	for (i = 0; i < hash_size; i++) {
+		spin_lock_init(&t->buckets[i].lock);
+		INIT_LIST_HEAD(&t->buckets[i].chain);
+		INIT_LIST_HEAD(&t->buckets[i].lru_list);
+	}
 #ifdef CONFIG_PROC_FS
 	uid = make_kuid(&init_user_ns, ip_list_uid);
 	gid = make_kgid(&init_user_ns, ip_list_gid);
@@ -421,9 +517,7 @@ static int recent_mt_check(const struct xt_mtchk_param *par,
 	}
 	proc_set_user(pde, uid, gid);
 #endif
-	spin_lock_bh(&recent_lock);
-	list_add_tail(&t->list, &recent_net->tables);
-	spin_unlock_bh(&recent_lock);
+	list_add_tail_rcu(&t->list, &recent_net->tables);
 	ret = 0;
 out:
 	mutex_unlock(&recent_mutex);
@@ -457,15 +551,14 @@ static void recent_mt_destroy(const struct xt_mtdtor_param *par)
 	mutex_lock(&recent_mutex);
 	t = recent_table_lookup(recent_net, info->name);
 	if (--t->refcnt == 0) {
-		spin_lock_bh(&recent_lock);
-		list_del(&t->list);
-		spin_unlock_bh(&recent_lock);
+		list_del_rcu(&t->list);
 #ifdef CONFIG_PROC_FS
 		if (recent_net->xt_recent != NULL)
 			remove_proc_entry(t->name, recent_net->xt_recent);
 #endif
 		recent_table_flush(t);
-		recent_table_free(t);
+		/* other rules may be walking the table list */
+		kvfree_rcu(t, rcu);
 	}
 	mutex_unlock(&recent_mutex);
 }
@@ -477,17 +570,17 @@ struct recent_iter_state {
 };
 
 static void *recent_seq_start(struct seq_file *seq, loff_t *pos)
-	__acquires(recent_lock)
+	__acquires(RCU)
 {
 	struct recent_iter_state *st = seq->private;
 	const struct recent_table *t = st->table;
 	struct recent_entry *e;
 	loff_t p = *pos;
 
-	spin_lock_bh(&recent_lock);
+	rcu_read_lock();
 
-	for (st->bucket = 0; st->bucket < ip_list_hash_size; st->bucket++)
-		list_for_each_entry(e, &t->iphash[st->bucket], list)
+	for (st->bucket = 0; st->bucket <= t->hash_mask; st->bucket++)
+		list_for_each_entry_rcu(e, &t->buckets[st->bucket].chain, list)
 			if (p-- == 0)
 				return e;
 	return NULL;
@@ -498,31 +591,29 @@ static void *recent_seq_next(struct seq_file *seq, void *v, loff_t *pos)
 	struct recent_iter_state *st = seq->private;
 	const struct recent_table *t = st->table;
 	const struct recent_entry *e = v;
-	const struct list_head *head = e->list.next;
+	const struct list_head *head = rcu_dereference(list_next_rcu(&e->list));
 
 	(*pos)++;
-	while (head == &t->iphash[st->bucket]) {
-		if (++st->bucket >= ip_list_hash_size)
+	while (head == &t->buckets[st->bucket].chain) {
+		if (++st->bucket > t->hash_mask)
 			return NULL;
-		head = t->iphash[st->bucket].next;
+		head = rcu_dereference(list_next_rcu(&t->buckets[st->bucket].chain));
 	}
 	return list_entry(head, struct recent_entry, list);
 }
 
 static void recent_seq_stop(struct seq_file *s, void *v)
-	__releases(recent_lock)
+	__releases(RCU)
 {
-	spin_unlock_bh(&recent_lock);
+	rcu_read_unlock();
 }
 
 static int recent_seq_show(struct seq_file *seq, void *v)
 {
 	const struct recent_entry *e = v;
-	struct recent_iter_state *st = seq->private;
-	const struct recent_table *t = st->table;
 	unsigned int i;
 
-	i = (e->index - 1) & t->nstamps_max_mask;
+	i = (e->index - 1) & e->nstamps_mask;
 
 	if (e->family == NFPROTO_IPV4)
 		seq_printf(seq, "src=%pI4 ttl: %u last_seen: %lu oldest_pkt: %u",
@@ -560,6 +651,7 @@ recent_mt_proc_write(struct file *file, const char __user *input,
 		     size_t size, loff_t *loff)
 {
 	struct recent_table *t = pde_data(file_inode(file));
+	struct recent_bucket *b;
 	struct recent_entry *e;
 	char buf[sizeof("+b335:1d35:1e55:dead:c0de:1715:255.255.255.255")];
 	const char *c = buf;
@@ -579,9 +671,7 @@ recent_mt_proc_write(struct file *file, const char __user *input,
 		return -ESPIPE;
 	switch (*c) {
 	case '/': /* flush table */
-		spin_lock_bh(&recent_lock);
 		recent_table_flush(t);
-		spin_unlock_bh(&recent_lock);
 		return size;
 	case '-': /* remove address */
 		add = false;
@@ -607,18 +697,19 @@ recent_mt_proc_write(struct file *file, const char __user *input,
 	if (!succ)
 		return -EINVAL;
 
-	spin_lock_bh(&recent_lock);
-	e = recent_entry_lookup(t, &addr, family, 0);
+	b = recent_entry_bucket(t, &addr, family);
+	spin_lock_bh(&b->lock);
+	e = recent_entry_lookup(b, &addr, family, 0);
 	if (e == NULL) {
 		if (add)
-			recent_entry_init(t, &addr, family, 0);
+			recent_entry_init(t, b, &addr, family, 0);
 	} else {
 		if (add)
-			recent_entry_update(t, e);
+			recent_entry_update(b, e);
 		else
 			recent_entry_remove(t, e);
 	}
-	spin_unlock_bh(&recent_lock);
+	spin_unlock_bh(&b->lock);
 	/* Note we removed one above */
 	*loff += size + 1;
 	return size + 1;
@@ -651,12 +742,12 @@ static void __net_exit recent_proc_net_exit(struct net *net)
 	 * that the parent xt_recent proc entry is empty before trying to
 	 * remove it.
 	 */
-	spin_lock_bh(&recent_lock);
+	mutex_lock(&recent_mutex);
 	list_for_each_entry(t, &recent_net->tables, list)
 	        remove_proc_entry(t->name, recent_net->xt_recent);
 
 	recent_net->xt_recent = NULL;
-	spin_unlock_bh(&recent_lock);
+	mutex_unlock(&recent_mutex);
 
 	remove_proc_entry("xt_recent", net->proc_net);
 }
@@ -742,7 +833,8 @@ static int __init recent_mt_init(void)
 
 	if (!ip_list_tot || ip_pkt_list_tot >= XT_RECENT_MAX_NSTAMPS)
 		return -EINVAL;
-	ip_list_hash_size = 1 << fls(ip_list_tot);
+	if (ip_list_hash_size)
+		ip_list_hash_size = roundup_pow_of_two(ip_list_hash_size);
 
 	err = register_pernet_subsys(&recent_net_ops);
 	if (err)
@@ -712,7 +712,7 @@ static bool tcf_ct_flow_table_lookup(struct tcf_ct_params *p,
 
 	nf_conn_act_ct_ext_fill(skb, ct, ctinfo);
 	tcf_ct_flow_ct_ext_ifidx_update(flow);
-	flow_offload_refresh(nf_ft, flow, force_refresh);
+	flow_offload_refresh(nf_ft, flow, dir, force_refresh);
 	if (!test_bit(IPS_ASSURED_BIT, &ct->status)) {
 		/* Process this flow in SW to allow promoting to ASSURED */
 		return false;
@@ -1035,6 +1035,7 @@ TC_INDIRECT_SCOPE int tcf_ct_act(struct sk_buff *skb, const struct tc_action *a,
 		state.hook = NF_INET_PRE_ROUTING;
 		state.net = net;
 		state.pf = family;
+		state.inner_gen = 0;
 		err = nf_conntrack_in(skb, &state);
 		if (err != NF_ACCEPT)
 			goto nf_error;